@@ -31,6 +31,13 @@
 static const uint16_t kLustreMountArgsHostMax   = 255;
 static const uint16_t kLustreMountArgsLabelMax  = 255;
 
+// What lookup does with the names Finder and Spotlight probe every directory for (.DS_Store, ._ files and the like).
+enum lustre_mount_probes {
+    kLustreMountProbesCache     = 0,                                    // remember which each directory lacks while it's unchanged
+    kLustreMountProbesLookup    = 1,                                    // ask the server every time
+    kLustreMountProbesAbsent    = 2,                                    // never ask; they're always missing
+};
+
 struct lustre_mount_args {
     char                        host[kLustreMountArgsHostMax];          // string representation of ip4/ip6 address since the kernel doesn't have the routines
     struct sockaddr_in          address_ip4;                            // ipv4 address to use (if present)
@@ -42,6 +49,7 @@ struct lustre_mount_args {
     uint8_t                     identity_key_length;                    // length of above key
     uint32_t                    force_failure;                          // if non-zero, mount will always fail
     int32_t                     flags;                                  // mount flags
+    uint32_t                    probes;                                 // a lustre_mount_probes
 };
 
 #endif /* lustre_mount_args_h */
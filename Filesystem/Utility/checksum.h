@@ -0,0 +1,57 @@
+//
+//  checksum.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// Data checksums for bulk transfers: CRC32C and Adler-32, the two kinds a server is most likely to offer.  Both use zlib's conventions, so
+// a checksum is carried on from one buffer to the next by passing it back in, starting from kLustreCRC32CInit or kLustreAdler32Init, and
+// two checksums of neighbouring buffers can be folded into the checksum of both without seeing the data again.
+//
+// CRC32C uses the CPU's CRC instruction where there is one (SSE4.2 on Intel, the ARMv8 CRC extension on Apple Silicon) over three
+// interleaved streams, folded together at the end; elsewhere it's table-driven, eight bytes a step.  Adler-32 works on sixteen bytes a step
+// in plain 64-bit registers.  Neither touches vector registers, whose state the kernel doesn't save for us.
+
+#ifndef lustre_checksum_h
+#define lustre_checksum_h
+
+#include <mach/mach_types.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+static const uint32_t   kLustreCRC32CInit                   = 0;
+static const uint32_t   kLustreAdler32Init                  = 1;
+
+// Same shape as a request's bulk segment, so a bulk transfer's list can be checksummed as it is.
+struct lustre_checksum_segment {
+    const void *                data;
+    uint32_t                    length;
+};
+
+uint32_t    lustre_crc32c(uint32_t crc, const void * data, size_t length);
+uint32_t    lustre_crc32c_segments(uint32_t crc, const struct lustre_checksum_segment * segments, uint32_t count);
+uint32_t    lustre_crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t length2);
+
+uint32_t    lustre_adler32(uint32_t adler, const void * data, size_t length);
+uint32_t    lustre_adler32_segments(uint32_t adler, const struct lustre_checksum_segment * segments, uint32_t count);
+uint32_t    lustre_adler32_combine(uint32_t adler1, uint32_t adler2, uint64_t length2);
+
+boolean_t   lustre_crc32c_is_accelerated(void);
+
+#endif /* lustre_checksum_h */
@@ -0,0 +1,144 @@
+//
+//  ksock.c
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <string.h>
+
+#include "ksock.h"
+
+#pragma mark - Bulk
+
+void lustre_ksock_cursor_init(struct lustre_ksock_cursor * cursor, const struct lustre_ksock_segment * segments, uint32_t count, uint32_t offset)
+{
+    cursor->segments    = segments;
+    cursor->count       = count;
+    cursor->index       = 0;
+    cursor->offset      = offset;
+
+    while ((cursor->index < cursor->count) && (cursor->offset >= cursor->segments[cursor->index].length)) {
+        cursor->offset -= cursor->segments[cursor->index].length;
+        cursor->index  += 1;
+    }
+}
+
+// Fills up to max iovecs with the next of *remaining bytes, and takes off what was used.  Returns the number of iovecs filled.
+uint32_t lustre_ksock_cursor_fill(struct lustre_ksock_cursor * cursor, struct iovec * iov, uint32_t max, uint32_t * remaining)
+{
+    uint32_t    count;
+    uint32_t    length;
+
+    count = 0;
+    while ((count < max) && (*remaining > 0) && (cursor->index < cursor->count)) {
+        length = MIN(cursor->segments[cursor->index].length - cursor->offset, *remaining);
+
+        iov[count].iov_base = (uint8_t *)cursor->segments[cursor->index].data + cursor->offset;
+        iov[count].iov_len  = length;
+        count              += 1;
+        *remaining         -= length;
+
+        cursor->offset += length;
+        if (cursor->offset == cursor->segments[cursor->index].length) {
+            cursor->index  += 1;
+            cursor->offset  = 0;
+        }
+    }
+
+    return count;
+}
+
+#pragma mark - Hello
+
+// Fills in the acceptor's request and socklnd's hello for a connection of type, as seen from our side, to peer_nid.
+void lustre_ksock_hello(struct lnet_acceptor_connreq * request, struct ksock_hello_msg * hello, uint64_t local_nid, uint64_t peer_nid, uint64_t incarnation, uint32_t type)
+{
+    bzero(request, sizeof(struct lnet_acceptor_connreq));
+    request->acr_magic              = kLustreLNetAcceptorMagic;
+    request->acr_version            = kLustreLNetAcceptorVersion;
+    request->acr_nid                = peer_nid;
+
+    bzero(hello, sizeof(struct ksock_hello_msg));
+    hello->kshm_magic               = kLustreLNetProtoMagic;
+    hello->kshm_version             = kLustreLNetSocklndVersion;
+    hello->kshm_src_nid             = local_nid;
+    hello->kshm_dst_nid             = peer_nid;
+    hello->kshm_src_pid             = kLustreLNetPIDLustre;
+    hello->kshm_dst_pid             = kLustreLNetPIDLustre;
+    hello->kshm_src_incarnation     = incarnation;
+    hello->kshm_ctype               = type;
+}
+
+// Checks the part of a hello before kshm_src_nid, which says how long the rest is.  Only little endian peers speaking version 3 will do.
+errno_t lustre_ksock_hello_check_version(const struct ksock_hello_msg * hello)
+{
+    if ((hello->kshm_magic != kLustreLNetProtoMagic) || (hello->kshm_version != kLustreLNetSocklndVersion)) {
+        return EPROTO;
+    }
+
+    return 0;
+}
+
+// Checks the rest of the hello peer_nid answered ours with, up to its addresses.  type is the one the peer should describe the connection
+// as, from its own side.  Returns ECONNREFUSED if it turned the connection down.
+errno_t lustre_ksock_hello_check(const struct ksock_hello_msg * hello, uint64_t peer_nid, uint32_t type)
+{
+    if (hello->kshm_nips > kLustreLNetInterfacesMax) {
+        return EPROTO;
+    }
+    if (hello->kshm_ctype == (uint32_t)kLustreKsockConnNone) {
+        return ECONNREFUSED;
+    }
+    if ((hello->kshm_ctype != type) || (hello->kshm_src_nid != peer_nid)) {
+        return EPROTO;
+    }
+
+    return 0;
+}
+
+#pragma mark - Messages
+
+// Fills in what every LNet message has in common.
+void lustre_ksock_header(struct ksock_msg * header, uint64_t dest_nid, uint64_t src_nid, uint32_t type, uint32_t payload_length)
+{
+    bzero(header, sizeof(struct ksock_msg));
+
+    header->ksm_type                = kLustreKsockMsgLNet;
+    header->ksm_hdr.dest_nid        = dest_nid;
+    header->ksm_hdr.src_nid         = src_nid;
+    header->ksm_hdr.dest_pid        = kLustreLNetPIDLustre;
+    header->ksm_hdr.src_pid         = kLustreLNetPIDLustre;
+    header->ksm_hdr.type            = type;
+    header->ksm_hdr.payload_length  = payload_length;
+}
+
+// Checks an LNet message's header once it's been read whole, before any of its payload is.
+errno_t lustre_ksock_header_check(const struct ksock_msg * header)
+{
+    if (header->ksm_type != kLustreKsockMsgLNet) {
+        return EPROTO;
+    }
+    if (header->ksm_hdr.payload_length > kLustreLNetMTU) {
+        return EPROTO;
+    }
+
+    return 0;
+}
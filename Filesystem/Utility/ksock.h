@@ -0,0 +1,63 @@
+//
+//  ksock.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// socklnd framing: the acceptor request and hello a connection opens with, the header every message after them carries, and the walk over
+// a bulk transfer's segments.  Nothing here touches a socket or anything else of the kernel's, so the same code builds into a userspace
+// program that speaks to a stand-in server over loopback (see Tests/Network); network.c does the I/O.
+
+#ifndef lustre_ksock_h
+#define lustre_ksock_h
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "wire.h"
+
+#if defined(__linux__)
+typedef int errno_t;                                                            // <sys/types.h> has it on macOS
+#endif
+
+// Same shape as a request's bulk segment, so a request's list can be walked as it is.
+struct lustre_ksock_segment {
+    void *                      data;
+    uint32_t                    length;
+};
+
+// Walks bulk segments as one stream of bytes.
+struct lustre_ksock_cursor {
+    const struct lustre_ksock_segment * segments;
+    uint32_t                    count;
+    uint32_t                    index;
+    uint32_t                    offset;                                         // into segments[index]
+};
+
+void        lustre_ksock_cursor_init(struct lustre_ksock_cursor * cursor, const struct lustre_ksock_segment * segments, uint32_t count, uint32_t offset);
+uint32_t    lustre_ksock_cursor_fill(struct lustre_ksock_cursor * cursor, struct iovec * iov, uint32_t max, uint32_t * remaining);
+
+void        lustre_ksock_hello(struct lnet_acceptor_connreq * request, struct ksock_hello_msg * hello, uint64_t local_nid, uint64_t peer_nid, uint64_t incarnation, uint32_t type);
+errno_t     lustre_ksock_hello_check_version(const struct ksock_hello_msg * hello);
+errno_t     lustre_ksock_hello_check(const struct ksock_hello_msg * hello, uint64_t peer_nid, uint32_t type);
+
+void        lustre_ksock_header(struct ksock_msg * header, uint64_t dest_nid, uint64_t src_nid, uint32_t type, uint32_t payload_length);
+errno_t     lustre_ksock_header_check(const struct ksock_msg * header);
+
+#endif /* lustre_ksock_h */
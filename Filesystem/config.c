@@ -0,0 +1,476 @@
+//
+//  config.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Reads the client configuration log ("<fsname>-client") from the MGS.  The log is a sequence of lustre_cfg records that, between them,
+// name every MDT and OST and say which NID serves each.  We only care about enough of it to build imports.
+
+#include <libkern/libkern.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "config.h"
+#include "request.h"
+#include "logging.h"
+#include "assert.h"
+
+static const uint32_t   kLustreConfigNameMax                = 64;
+static const uint32_t   kLustreConfigInitialCapacity        = 32;
+static const uint32_t   kLustreConfigBlocksMax              = 4096;     // guards against a server that never reports the end of the log
+
+struct lustre_config_uuid {
+    char                                            uuid[kLustreUUIDSize];
+    uint64_t                                        nid;
+};
+
+struct lustre_config_device {
+    char                                            name[kLustreConfigNameMax];
+    enum lustre_import_type                         type;
+};
+
+struct lustre_config_state {
+    struct lustre_config_uuid *                     uuids;
+    uint32_t                                        uuid_count;
+    uint32_t                                        uuid_capacity;
+    struct lustre_config_device *                   devices;
+    uint32_t                                        device_count;
+    uint32_t                                        device_capacity;
+    lustre_config_target_callback                   callback;
+    void *                                          callback_data;
+    OSMallocTag                                     malloc_tag;                     // the MGS import's
+};
+
+#pragma mark - Internal
+
+// Makes room for one more element in a growable array.
+static errno_t lustre_config_grow(OSMallocTag malloc_tag, void ** array, uint32_t * capacity, uint32_t count, size_t element_size)
+{
+    void *      grown;
+    uint32_t    grown_capacity;
+
+    if (count < *capacity) {
+        return 0;
+    }
+
+    grown_capacity  = (*capacity == 0) ? kLustreConfigInitialCapacity : *capacity * 2;
+    grown           = OSMalloc((uint32_t)(grown_capacity * element_size), malloc_tag);
+    if (!grown) {
+        return ENOMEM;
+    }
+
+    if (*array) {
+        memcpy(grown, *array, count * element_size);
+        OSFree(*array, (uint32_t)(*capacity * element_size), malloc_tag);
+    }
+
+    *array      = grown;
+    *capacity   = grown_capacity;
+
+    return 0;
+}
+
+// Returns buffer index of the record as a C string, or NULL if it's missing or not terminated.  The record comes off the wire, so the
+// buffer count is checked against what fits before anything is computed from it, and offsets are summed in 64 bits.
+static const char * lustre_config_buffer(const struct lustre_cfg * lcfg, uint32_t length, uint32_t index)
+{
+    uint64_t offset;
+    uint32_t i;
+
+    if (length < sizeof(struct lustre_cfg)) {
+        return NULL;
+    }
+    if ((lcfg->lcfg_bufcount > (length - sizeof(struct lustre_cfg)) / sizeof(uint32_t)) || (index >= lcfg->lcfg_bufcount)) {
+        return NULL;
+    }
+
+    offset = sizeof(struct lustre_cfg) + (uint64_t)lcfg->lcfg_bufcount * sizeof(uint32_t);
+    offset = (offset + 7) & ~7ULL;
+    if (offset > length) {
+        return NULL;
+    }
+    for (i=0; i<index; i++) {
+        offset += ((uint64_t)lcfg->lcfg_buflens[i] + 7) & ~7ULL;
+        if (offset > length) {
+            return NULL;
+        }
+    }
+
+    if ((lcfg->lcfg_buflens[index] == 0) || (lcfg->lcfg_buflens[index] > length - offset)) {
+        return NULL;
+    }
+    if (((const char *)lcfg)[offset + lcfg->lcfg_buflens[index] - 1] != '\0') {
+        return NULL;
+    }
+
+    return (const char *)lcfg + offset;
+}
+
+// Target UUIDs look like "fs1-OST001f_UUID"; the hex number is the target index.
+static boolean_t lustre_config_index_from_uuid(const char * uuid, const char * kind, uint32_t * index)
+{
+    const char *    cursor;
+    uint32_t        value;
+    uint32_t        i;
+    char            c;
+
+    cursor = strnstr(uuid, kind, kLustreUUIDSize);
+    if (!cursor) {
+        return FALSE;
+    }
+
+    cursor += strlen(kind);
+    value   = 0;
+
+    for (i=0; i<4; i++) {
+        c = cursor[i];
+        if ((c >= '0') && (c <= '9')) {
+            value = (value << 4) | (uint32_t)(c - '0');
+        } else if ((c >= 'a') && (c <= 'f')) {
+            value = (value << 4) | (uint32_t)(c - 'a' + 10);
+        } else if ((c >= 'A') && (c <= 'F')) {
+            value = (value << 4) | (uint32_t)(c - 'A' + 10);
+        } else {
+            return FALSE;
+        }
+    }
+
+    *index = value;
+
+    return TRUE;
+}
+
+static void lustre_config_add_uuid(struct lustre_config_state * state, const char * uuid, uint64_t nid)
+{
+    uint32_t i;
+
+    // A UUID can be listed with several NIDs (failover partners); the first one is the primary.
+
+    for (i=0; i<state->uuid_count; i++) {
+        if (strncmp(state->uuids[i].uuid, uuid, kLustreUUIDSize) == 0) {
+            return;
+        }
+    }
+
+    if (lustre_config_grow(state->malloc_tag, (void **)&state->uuids, &state->uuid_capacity, state->uuid_count, sizeof(struct lustre_config_uuid)) != 0) {
+        os_log_error(lustre_logger_vfs, "Couldn't grow config uuid table");
+        return;
+    }
+
+    strlcpy(state->uuids[state->uuid_count].uuid, uuid, kLustreUUIDSize);
+    state->uuids[state->uuid_count].nid = nid;
+    state->uuid_count += 1;
+}
+
+static void lustre_config_attach(struct lustre_config_state * state, const char * name, const char * type)
+{
+    enum lustre_import_type import_type;
+
+    if (strcmp(type, "mdc") == 0) {
+        import_type = kLustreImportTypeMDT;
+    } else if (strcmp(type, "osc") == 0) {
+        import_type = kLustreImportTypeOST;
+    } else {
+        return;                                     // lov, lmv and friends are client side constructs we don't need
+    }
+
+    if (lustre_config_grow(state->malloc_tag, (void **)&state->devices, &state->device_capacity, state->device_count, sizeof(struct lustre_config_device)) != 0) {
+        os_log_error(lustre_logger_vfs, "Couldn't grow config device table");
+        return;
+    }
+
+    strlcpy(state->devices[state->device_count].name, name, kLustreConfigNameMax);
+    state->devices[state->device_count].type = import_type;
+    state->device_count += 1;
+}
+
+static void lustre_config_setup(struct lustre_config_state * state, const char * name, const char * target_uuid, const char * connection_uuid)
+{
+    struct lustre_config_target target;
+    uint32_t                    i;
+
+    for (i=0; i<state->device_count; i++) {
+        if (strncmp(state->devices[i].name, name, kLustreConfigNameMax) == 0) {
+            break;
+        }
+    }
+    if (i == state->device_count) {
+        return;
+    }
+
+    bzero(&target, sizeof(target));
+    target.type = state->devices[i].type;
+    strlcpy(target.target_uuid, target_uuid, kLustreUUIDSize);
+
+    if (!lustre_config_index_from_uuid(target_uuid, (target.type == kLustreImportTypeMDT) ? "-MDT" : "-OST", &target.index)) {
+        os_log_error(lustre_logger_vfs, "Can't find target index in %{public}s", target_uuid);
+        return;
+    }
+
+    for (i=0; i<state->uuid_count; i++) {
+        if (strncmp(state->uuids[i].uuid, connection_uuid, kLustreUUIDSize) == 0) {
+            target.nid = state->uuids[i].nid;
+            break;
+        }
+    }
+    if (i == state->uuid_count) {
+        os_log_error(lustre_logger_vfs, "No NID for %{public}s", connection_uuid);
+        return;
+    }
+
+    state->callback(&target, state->callback_data);
+}
+
+static void lustre_config_process_record(struct lustre_config_state * state, const struct llog_rec_hdr * record)
+{
+    const struct lustre_cfg *   lcfg;
+    uint32_t                    length;
+    const char *                buffers[3];
+
+    if (record->lrh_type != kLustreLLOGRecordTypeConfig) {
+        return;
+    }
+    if (record->lrh_len < sizeof(struct llog_rec_hdr) + sizeof(struct llog_rec_tail) + sizeof(struct lustre_cfg)) {
+        return;
+    }
+
+    lcfg    = (const struct lustre_cfg *)(record + 1);
+    length  = record->lrh_len - (uint32_t)sizeof(struct llog_rec_hdr) - (uint32_t)sizeof(struct llog_rec_tail);
+
+    buffers[0] = lustre_config_buffer(lcfg, length, 0);
+    buffers[1] = lustre_config_buffer(lcfg, length, 1);
+    buffers[2] = lustre_config_buffer(lcfg, length, 2);
+
+    switch (lcfg->lcfg_command) {
+        case kLustreCfgAddUUID:
+            if (buffers[1]) {
+                lustre_config_add_uuid(state, buffers[1], lcfg->lcfg_nid);
+            }
+            break;
+        case kLustreCfgAttach:
+            if (buffers[0] && buffers[1]) {
+                lustre_config_attach(state, buffers[0], buffers[1]);
+            }
+            break;
+        case kLustreCfgSetup:
+            if (buffers[0] && buffers[1] && buffers[2]) {
+                lustre_config_setup(state, buffers[0], buffers[1], buffers[2]);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Walks the records in one chunk of the log.  Returns the highest record index seen.
+static uint32_t lustre_config_process_block(struct lustre_config_state * state, const uint8_t * block, uint32_t length)
+{
+    const struct llog_rec_hdr * record;
+    uint32_t                    offset;
+    uint32_t                    last_index;
+
+    offset      = 0;
+    last_index  = 0;
+
+    while (offset + sizeof(struct llog_rec_hdr) <= length) {
+        record = (const struct llog_rec_hdr *)(block + offset);
+        if ((record->lrh_len < sizeof(struct llog_rec_hdr)) || (record->lrh_len > length - offset)) {
+            break;
+        }
+
+        lustre_config_process_record(state, record);
+
+        last_index  = MAX(last_index, record->lrh_index);
+        offset      += (record->lrh_len + 7) & ~7;
+    }
+
+    return last_index;
+}
+
+static struct lustre_request * lustre_config_request(struct lustre_import * mgs_import, uint32_t opcode, const struct llog_logid * logid, struct llogd_body ** body)
+{
+    struct lustre_request * request;
+
+    request = lustre_request_alloc(mgs_import, opcode);
+    if (!request) {
+        return NULL;
+    }
+
+    *body = lustre_request_field_add(request, sizeof(struct llogd_body));
+    if (!*body) {
+        lustre_request_ref_count_dec(request);
+        return NULL;
+    }
+
+    if (logid) {
+        (*body)->lgd_logid = *logid;
+    }
+    (*body)->lgd_len = kLustreLLOGChunkSize;
+
+    lustre_request_set_reply_size(request, kLustreLLOGChunkSize + 1024);
+
+    return request;
+}
+
+#pragma mark - External
+
+// Fetches and parses the client configuration log one chunk at a time, reporting each target through callback as soon as it's known so
+// the caller can start connecting to it while later chunks are still on the way.
+errno_t lustre_config_process(struct lustre_import * mgs_import, const char * fsname, lustre_config_target_callback callback, void * data)
+{
+    struct lustre_config_state  state;
+    struct lustre_request *     request;
+    struct llogd_body *         body;
+    const struct llogd_body *   reply_body;
+    const struct llog_rec_hdr * header;
+    struct llog_logid           logid;
+    const uint8_t *             block;
+    char *                      name;
+    uint32_t                    name_length;
+    uint32_t                    header_length;
+    uint32_t                    block_length;
+    uint32_t                    last_index;
+    uint32_t                    seen_index;
+    uint32_t                    current_index;
+    uint64_t                    current_offset;
+    uint32_t                    blocks;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(!mgs_import);
+    LUSTRE_BUG_ON(!fsname);
+    LUSTRE_BUG_ON(!callback);
+
+    bzero(&state, sizeof(state));
+    state.callback      = callback;
+    state.callback_data = data;
+    state.malloc_tag    = mgs_import->malloc_tag;
+
+    request = NULL;
+
+    // Open the log by name.
+
+    request = lustre_config_request(mgs_import, kLustreOpcodeLLOGOriginHandleCreate, NULL, &body);
+    if (!request) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    name_length = (uint32_t)strlen(fsname) + (uint32_t)sizeof("-client");
+    name = lustre_request_field_add(request, name_length);
+    if (!name) {
+        error = ENOMEM;
+        goto end;
+    }
+    snprintf(name, name_length, "%s-client", fsname);
+
+    error = lustre_request_send(request);
+    if (error != 0) {
+        os_log_error(lustre_logger_vfs, "Couldn't open config log for %{public}s, error %d", fsname, error);
+        goto end;
+    }
+
+    reply_body = lustre_request_reply_field(request, 1, sizeof(struct llogd_body), NULL);
+    if (!reply_body) {
+        error = EPROTO;
+        goto end;
+    }
+    logid = reply_body->lgd_logid;
+
+    lustre_request_ref_count_dec(request);
+    request = NULL;
+
+    // The header's tail carries the index of the last record, which is how we know when to stop.
+
+    request = lustre_config_request(mgs_import, kLustreOpcodeLLOGOriginHandleReadHeader, &logid, &body);
+    if (!request) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    error = lustre_request_send(request);
+    if (error != 0) {
+        goto end;
+    }
+
+    header = lustre_request_reply_field(request, 1, sizeof(struct llog_rec_hdr) + sizeof(struct llog_rec_tail), &header_length);
+    if (!header || (header->lrh_len > header_length) || (header->lrh_len < sizeof(struct llog_rec_hdr) + sizeof(struct llog_rec_tail))) {
+        error = EPROTO;
+        goto end;
+    }
+    last_index = ((const struct llog_rec_tail *)((const uint8_t *)header + header->lrh_len - sizeof(struct llog_rec_tail)))->lrt_index;
+
+    lustre_request_ref_count_dec(request);
+    request = NULL;
+
+    // Read chunks until we've seen the last record.
+
+    seen_index      = 0;
+    current_index   = 0;
+    current_offset  = 0;
+
+    for (blocks=0; (seen_index < last_index) && (blocks < kLustreConfigBlocksMax); blocks++) {
+        request = lustre_config_request(mgs_import, kLustreOpcodeLLOGOriginHandleNextBlock, &logid, &body);
+        if (!request) {
+            error = ENOMEM;
+            goto end;
+        }
+
+        body->lgd_index         = seen_index + 1;
+        body->lgd_saved_index   = current_index;
+        body->lgd_cur_offset    = current_offset;
+
+        error = lustre_request_send(request);
+        if (error != 0) {
+            goto end;
+        }
+
+        reply_body  = lustre_request_reply_field(request, 1, sizeof(struct llogd_body), NULL);
+        block       = lustre_request_reply_field(request, 2, 0, &block_length);
+        if (!reply_body || !block) {
+            error = EPROTO;
+            goto end;
+        }
+
+        current_index   = reply_body->lgd_saved_index;
+        current_offset  = reply_body->lgd_cur_offset;
+        seen_index      = MAX(seen_index, lustre_config_process_block(&state, block, block_length));
+
+        lustre_request_ref_count_dec(request);
+        request = NULL;
+
+        if (block_length == 0) {
+            break;
+        }
+    }
+
+end:
+    if (request) {
+        lustre_request_ref_count_dec(request);
+    }
+    if (state.uuids) {
+        OSFree(state.uuids, state.uuid_capacity * (uint32_t)sizeof(struct lustre_config_uuid), state.malloc_tag);
+    }
+    if (state.devices) {
+        OSFree(state.devices, state.device_capacity * (uint32_t)sizeof(struct lustre_config_device), state.malloc_tag);
+    }
+
+    return error;
+}
@@ -0,0 +1,40 @@
+//
+//  config.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef lustre_config_h
+#define lustre_config_h
+
+#include <sys/types.h>
+#include "import.h"
+
+struct lustre_config_target {
+    enum lustre_import_type                         type;                           // only ever MDT or OST
+    uint32_t                                        index;
+    char                                            target_uuid[kLustreUUIDSize];
+    uint64_t                                        nid;                            // primary NID of the server
+};
+
+// Called for each target as soon as its record has been parsed, while the rest of the log is still being fetched.
+typedef void (* lustre_config_target_callback)(const struct lustre_config_target * target, void * data);
+
+errno_t     lustre_config_process(struct lustre_import * mgs_import, const char * fsname, lustre_config_target_callback callback, void * data);
+
+#endif /* lustre_config_h */
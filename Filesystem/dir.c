@@ -0,0 +1,516 @@
+//
+//  dir.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <libkern/OSAtomic.h>
+#include <libkern/libkern.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/proc.h>
+#include <sys/dirent.h>
+#include <sys/vnode.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "dir.h"
+#include "mdc.h"
+#include "node.h"
+#include "extensions.h"
+#include "logging.h"
+#include "assert.h"
+
+#define LUSTRE_DIR_DIRENT_LENGTH(_namelen)      ((offsetof(struct dirent, d_name) + (_namelen) + 1 + 3) & ~3)
+#define LUSTRE_DIR_DIRENTRY_LENGTH(_namelen)    ((offsetof(struct direntry, d_name) + (_namelen) + 1 + 7) & ~7)
+
+struct lustre_dir_read_context {
+    const struct lu_fid *   root_fid;
+    boolean_t               extended;
+    uio_t                   uio;
+    int *                   count;
+};
+
+#pragma mark - Internal
+
+static void lustre_dir_free(struct lustre_dir * dir)
+{
+    LUSTRE_BUG_ON(dir->chunks);
+
+    lck_mtx_free(dir->lock, dir->lock_group);
+    OSFree(dir, sizeof(struct lustre_dir), dir->malloc_tag);
+}
+
+static void lustre_dir_chunk_free(struct lustre_dir_chunk * chunk)
+{
+    OSMallocTag malloc_tag;
+
+    malloc_tag = chunk->dir->malloc_tag;
+
+    if (chunk->data) {
+        OSFree(chunk->data, kLustreDirChunkSize, malloc_tag);
+    }
+    OSFree(chunk, sizeof(struct lustre_dir_chunk), malloc_tag);
+}
+
+// Caller holds the dir lock.  Drops a use of the chunk, and frees it once it's unused and no longer listed.
+static void lustre_dir_chunk_release_locked(struct lustre_dir_chunk * chunk)
+{
+    LUSTRE_BUG_ON(chunk->users == 0);
+
+    chunk->users -= 1;
+    if ((chunk->users == 0) && !chunk->listed) {
+        lustre_dir_chunk_free(chunk);
+    }
+}
+
+// Caller holds the dir lock.  Evicts the least recently used idle chunks until the directory is back under its limit.
+static void lustre_dir_evict(struct lustre_dir * dir)
+{
+    struct lustre_dir_chunk * victim;
+
+    while (dir->chunk_count > kLustreDirChunksMax) {
+        victim = lustre_dir_chunk_victim(dir);
+        if (!victim) {
+            break;
+        }
+        lustre_dir_chunk_unlist(dir, victim);
+        lustre_dir_chunk_free(victim);
+    }
+}
+
+static void lustre_dir_fetch_done(struct lustre_request * request, void * data)
+{
+    struct lustre_dir_chunk *   chunk;
+    struct lustre_dir *         dir;
+    const struct lu_dirpage *   last_page;
+    uint32_t                    length;
+    errno_t                     error;
+
+    chunk   = (struct lustre_dir_chunk *)data;
+    dir     = chunk->dir;
+    error   = request->error;
+    length  = request->bulk_transferred;
+
+    if ((error == 0) && ((length < kLustreDirPageSize) || (length > kLustreDirChunkSize))) {
+        os_log_error(lustre_logger_vfs, "Directory read returned %u bytes", length);
+        error = EPROTO;
+    }
+
+    lck_mtx_lock(dir->lock);
+
+    if (error == 0) {
+        last_page       = (const struct lu_dirpage *)(chunk->data + (length / kLustreDirPageSize - 1) * kLustreDirPageSize);
+        chunk->length   = length - (length % kLustreDirPageSize);
+        chunk->hash_end = last_page->ldp_hash_end;
+        chunk->state    = kLustreDirChunkReady;
+    } else {
+        chunk->error    = error;
+        chunk->state    = kLustreDirChunkFailed;
+        if (chunk->listed) {
+            lustre_dir_chunk_unlist(dir, chunk);
+        }
+    }
+
+    if (chunk->waiting) {
+        wakeup(chunk);
+        chunk->waiting = FALSE;
+    }
+
+    lustre_dir_chunk_release_locked(chunk);
+    lustre_dir_evict(dir);
+
+    lck_mtx_unlock(dir->lock);
+
+    lustre_dir_ref_count_dec(dir);
+}
+
+// Starts reading a chunk from hash.  The chunk is listed only if the directory hasn't been invalidated since generation, so a read that
+// races with a revoke still gets its data but nobody else reuses it.  With result set, returns the chunk with a use for the caller.
+static errno_t lustre_dir_fetch(struct lustre_dir * dir, struct lustre_import * import, const struct lu_fid * fid, uint64_t hash, uint32_t generation, struct lustre_dir_chunk ** result)
+{
+    struct lustre_dir_chunk *   chunk;
+    struct lustre_dir_chunk *   existing;
+    errno_t                     error;
+
+    chunk = OSMalloc(sizeof(struct lustre_dir_chunk), dir->malloc_tag);
+    if (!chunk) {
+        return ENOMEM;
+    }
+
+    bzero(chunk, sizeof(struct lustre_dir_chunk));
+
+    chunk->dir          = dir;
+    chunk->hash_start   = hash;
+    chunk->hash_end     = hash;
+    chunk->state        = kLustreDirChunkFetching;
+    chunk->users        = result ? 2 : 1;
+
+    chunk->data = OSMalloc(kLustreDirChunkSize, dir->malloc_tag);
+    if (!chunk->data) {
+        lustre_dir_chunk_free(chunk);
+        return ENOMEM;
+    }
+
+    chunk->segment = (struct lustre_request_segment){ chunk->data, kLustreDirChunkSize };
+
+    lck_mtx_lock(dir->lock);
+
+    existing = lustre_dir_chunk_find(dir, hash);
+    if (existing) {
+        // Someone beat us to it.
+
+        if (result) {
+            existing->users += 1;
+            *result = existing;
+        }
+        lck_mtx_unlock(dir->lock);
+        lustre_dir_chunk_free(chunk);
+        return 0;
+    }
+
+    if (dir->generation == generation) {
+        lustre_dir_chunk_insert(dir, chunk);
+    }
+
+    lck_mtx_unlock(dir->lock);
+
+    if (result) {
+        *result = chunk;
+    }
+
+    lustre_dir_ref_count_inc(dir);
+
+    error = lustre_mdc_readpage_async(import, fid, hash, &chunk->segment, 1, lustre_dir_fetch_done, chunk);
+    if (error != 0) {
+        lck_mtx_lock(dir->lock);
+        chunk->error = error;
+        chunk->state = kLustreDirChunkFailed;
+        if (chunk->listed) {
+            lustre_dir_chunk_unlist(dir, chunk);
+        }
+        if (chunk->waiting) {
+            wakeup(chunk);
+            chunk->waiting = FALSE;
+        }
+        lustre_dir_chunk_release_locked(chunk);
+        lck_mtx_unlock(dir->lock);
+
+        lustre_dir_ref_count_dec(dir);
+    }
+
+    return 0;
+}
+
+// Returns the chunk covering hash with a use for the caller, reading it if need be.
+static errno_t lustre_dir_chunk_get(struct lustre_dir * dir, struct lustre_import * import, const struct lu_fid * fid, uint64_t hash, uint32_t generation, struct lustre_dir_chunk ** result)
+{
+    struct lustre_dir_chunk *   chunk;
+    errno_t                     error;
+
+    chunk = NULL;
+
+    lck_mtx_lock(dir->lock);
+    chunk = lustre_dir_chunk_find(dir, hash);
+    if (chunk) {
+        chunk->users += 1;
+    }
+    lck_mtx_unlock(dir->lock);
+
+    if (!chunk) {
+        error = lustre_dir_fetch(dir, import, fid, hash, generation, &chunk);
+        if (error != 0) {
+            return error;
+        }
+    }
+
+    lck_mtx_lock(dir->lock);
+
+    while (chunk->state == kLustreDirChunkFetching) {
+        chunk->waiting = TRUE;
+        (void) msleep(chunk, dir->lock, PINOD, __FUNCTION__, NULL);
+    }
+
+    error = chunk->error;
+    if (error == 0) {
+        dir->clock          += 1;
+        chunk->last_used    = dir->clock;
+    } else {
+        lustre_dir_chunk_release_locked(chunk);
+        chunk = NULL;
+    }
+
+    lck_mtx_unlock(dir->lock);
+
+    *result = chunk;
+
+    return error;
+}
+
+static void lustre_dir_chunk_put(struct lustre_dir_chunk * chunk)
+{
+    struct lustre_dir * dir;
+
+    dir = chunk->dir;
+
+    lck_mtx_lock(dir->lock);
+    lustre_dir_chunk_release_locked(chunk);
+    lck_mtx_unlock(dir->lock);
+}
+
+// Packs one entry into the uio as a dirent, or a direntry for VNODE_READDIR_EXTENDED.  Returns ENOBUFS if it doesn't fit.
+static errno_t lustre_dir_pack_entry(const struct lustre_dir_entry * entry, void * data)
+{
+    struct lustre_dir_read_context *    context;
+    union {
+        struct dirent                   standard;
+        struct direntry                 extended;
+    }                                   record;
+    uint64_t                            fileid;
+    size_t                              length;
+    errno_t                             error;
+
+    context = (struct lustre_dir_read_context *)data;
+
+    if ((entry->fid.f_seq == context->root_fid->f_seq) && (entry->fid.f_oid == context->root_fid->f_oid) && (entry->fid.f_ver == context->root_fid->f_ver)) {
+        fileid = 2;
+    } else {
+        fileid = lustre_node_fileid(&entry->fid);
+    }
+
+    if (context->extended) {
+        length = LUSTRE_DIR_DIRENTRY_LENGTH(entry->namelen);
+        bzero(&record.extended, length);
+        record.extended.d_ino       = fileid;
+        record.extended.d_seekoff   = (uint64_t)lustre_dir_cookie_from_hash(entry->next_hash);
+        record.extended.d_reclen    = (uint16_t)length;
+        record.extended.d_namlen    = (uint16_t)entry->namelen;
+        record.extended.d_type      = entry->type;
+        memcpy(record.extended.d_name, entry->name, entry->namelen);
+    } else {
+        length = LUSTRE_DIR_DIRENT_LENGTH(entry->namelen);
+        bzero(&record.standard, length);
+        record.standard.d_fileno    = (uint32_t)fileid;
+        record.standard.d_reclen    = (uint16_t)length;
+        record.standard.d_namlen    = (uint8_t)entry->namelen;
+        record.standard.d_type      = entry->type;
+        memcpy(record.standard.d_name, entry->name, entry->namelen);
+    }
+
+    error = lustre_extension_uio_move(&record, length, context->uio);
+    if (error == 0) {
+        *context->count += 1;
+    }
+
+    return error;
+}
+
+#pragma mark - External
+
+struct lustre_dir * lustre_dir_alloc(OSMallocTag malloc_tag, lck_grp_t * lock_group)
+{
+    struct lustre_dir * dir;
+
+    dir = OSMalloc(sizeof(struct lustre_dir), malloc_tag);
+    if (!dir) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate directory cache");
+        return NULL;
+    }
+
+    bzero(dir, sizeof(struct lustre_dir));
+
+    dir->malloc_tag = malloc_tag;
+    dir->lock_group = lock_group;
+    dir->ref_count  = 1;
+
+    dir->lock = lck_mtx_alloc_init(lock_group, NULL);
+    if (!dir->lock) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate directory cache lock");
+        OSFree(dir, sizeof(struct lustre_dir), malloc_tag);
+        return NULL;
+    }
+
+    return dir;
+}
+
+void lustre_dir_ref_count_inc(struct lustre_dir * dir)
+{
+    LUSTRE_BUG_ON(!dir);
+
+    OSIncrementAtomic(&dir->ref_count);
+}
+
+// Fetches in flight hold references, so by the time the last one goes every chunk is idle.
+void lustre_dir_ref_count_dec(struct lustre_dir * dir)
+{
+    int32_t count;
+
+    LUSTRE_BUG_ON(!dir);
+
+    count = OSDecrementAtomic(&dir->ref_count);
+
+    if (count == 1) {
+        lustre_dir_invalidate(dir);
+        lustre_dir_free(dir);
+    }
+}
+
+uint32_t lustre_dir_generation(struct lustre_dir * dir)
+{
+    uint32_t generation;
+
+    LUSTRE_BUG_ON(!dir);
+
+    lck_mtx_lock(dir->lock);
+    generation = dir->generation;
+    lck_mtx_unlock(dir->lock);
+
+    return generation;
+}
+
+// Drops every cached chunk.  Chunks in use are freed by their last user; fetches in flight finish but aren't kept.
+void lustre_dir_invalidate(struct lustre_dir * dir)
+{
+    struct lustre_dir_chunk * chunk;
+
+    LUSTRE_BUG_ON(!dir);
+
+    lck_mtx_lock(dir->lock);
+
+    dir->generation += 1;
+
+    while ((chunk = dir->chunks) != NULL) {
+        lustre_dir_chunk_unlist(dir, chunk);
+        if (chunk->users == 0) {
+            lustre_dir_chunk_free(chunk);
+        }
+    }
+
+    lck_mtx_unlock(dir->lock);
+}
+
+// Reads the chunk at hash ahead of time when a reader is about to need it, so a sequential listing keeps the network busy; a search
+// starts the first chunk of directories it will walk next the same way.  Does nothing if the chunk is already cached or on its way.
+void lustre_dir_prefetch(struct lustre_dir * dir, struct lustre_import * import, const struct lu_fid * fid, uint64_t hash, uint32_t generation)
+{
+    boolean_t needed;
+
+    LUSTRE_BUG_ON(!dir);
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!fid);
+
+    if (hash == kLustreDirHashEnd) {
+        return;
+    }
+
+    lck_mtx_lock(dir->lock);
+    needed = (dir->generation == generation) && !lustre_dir_chunk_find(dir, hash);
+    lck_mtx_unlock(dir->lock);
+
+    if (needed) {
+        (void)lustre_dir_fetch(dir, import, fid, hash, generation, NULL);
+    }
+}
+
+// Hands entries from *hash onwards to callback until it returns non-zero or the directory ends, leaving *hash where the next walk should
+// start; a callback returning ENOBUFS stops the walk without error, and the entry it refused comes first next time.  Chunks are kept for
+// reuse only if nothing invalidated the directory since generation, which the caller took before making sure it holds the UPDATE lock.
+errno_t lustre_dir_walk(struct lustre_dir * dir, struct lustre_import * import, const struct lu_fid * fid, uint32_t generation, uint64_t * hash, lustre_dir_entry_callback callback, void * data)
+{
+    struct lustre_dir_chunk *   chunk;
+    uint64_t                    start;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(!dir);
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!hash);
+    LUSTRE_BUG_ON(!callback);
+
+    error = 0;
+
+    while (*hash != kLustreDirHashEnd) {
+        start = *hash;
+
+        error = lustre_dir_chunk_get(dir, import, fid, *hash, generation, &chunk);
+        if (error != 0) {
+            break;
+        }
+
+        lustre_dir_prefetch(dir, import, fid, chunk->hash_end, generation);
+
+        error = lustre_dir_chunk_walk(chunk, hash, callback, data);
+        if (error == EPROTO) {
+            os_log_error(lustre_logger_vfs, "Directory chunk at %llx has an entry running past its page", start);
+        }
+
+        lustre_dir_chunk_put(chunk);
+
+        if (error == ENOBUFS) {
+            error = 0;
+            break;
+        }
+        if (error != 0) {
+            break;
+        }
+
+        // A chunk always ends past where it started; anything else would have us read the same pages forever.
+
+        if (*hash <= start) {
+            os_log_error(lustre_logger_vfs, "Directory chunk at %llx made no progress", start);
+            error = EIO;
+            break;
+        }
+    }
+
+    return error;
+}
+
+// Reads entries into uio from the cookie in its offset, which is left at the cookie to resume from.  Running out of room in the caller's
+// buffer just ends this read; getdirentries copes with short results.
+errno_t lustre_dir_read(struct lustre_dir * dir, struct lustre_import * import, const struct lu_fid * fid, const struct lu_fid * root_fid, uint32_t generation, uio_t uio, int flags, int * eof, int * count)
+{
+    struct lustre_dir_read_context  context;
+    uint64_t                        hash;
+    errno_t                         error;
+
+    LUSTRE_BUG_ON(!dir);
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!root_fid);
+    LUSTRE_BUG_ON(!uio);
+    LUSTRE_BUG_ON(!eof);
+    LUSTRE_BUG_ON(!count);
+
+    *count              = 0;
+    hash                = lustre_dir_hash_from_cookie(uio_offset(uio));
+    context.root_fid    = root_fid;
+    context.extended    = (flags & VNODE_READDIR_EXTENDED) != 0;
+    context.uio         = uio;
+    context.count       = count;
+
+    error = lustre_dir_walk(dir, import, fid, generation, &hash, lustre_dir_pack_entry, &context);
+
+    uio_setoffset(uio, lustre_dir_cookie_from_hash(hash));
+
+    *eof = (hash == kLustreDirHashEnd);
+
+    return error;
+}
@@ -0,0 +1,111 @@
+//
+//  dir.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Directory page cache.  Directory pages are read from the MDT a chunk (up to 1MB) at a time and kept per directory, keyed by the range
+// of name hashes each chunk covers, so a readdir that resumes at any cookie finds its place without rereading what came before.  Chunks
+// are only reused while the directory's UPDATE lock is held; losing the lock invalidates them.
+
+#ifndef lustre_dir_h
+#define lustre_dir_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <kern/locks.h>
+#include <libkern/OSMalloc.h>
+#include "wire.h"
+#include "request.h"
+
+static const uint32_t   kLustreDirChunkSize                 = 1024 * 1024;
+static const uint32_t   kLustreDirChunksMax                 = 4;                // per directory, not counting chunks in use
+
+struct lustre_import;
+struct lustre_dir;
+
+struct lustre_dir_entry {
+    const char *                                    name;                           // not terminated; points into the page
+    uint32_t                                        namelen;
+    struct lu_fid                                   fid;
+    uint8_t                                         type;                           // DT_*
+    uint64_t                                        hash;
+    uint64_t                                        next_hash;                      // where to resume after this entry
+};
+
+typedef errno_t (* lustre_dir_entry_callback)(const struct lustre_dir_entry * entry, void * data);
+
+enum lustre_dir_chunk_state {
+    kLustreDirChunkFetching                         = 0,
+    kLustreDirChunkReady,
+    kLustreDirChunkFailed,
+};
+
+struct lustre_dir_chunk {
+    struct lustre_dir *                             dir;
+    uint64_t                                        hash_start;                     // hash the chunk was read from
+    uint64_t                                        hash_end;                       // where the next chunk starts, once ready
+    uint8_t *                                       data;                           // kLustreDirChunkSize bytes of directory pages
+    uint32_t                                        length;                         // bytes read into data
+    struct lustre_request_segment                   segment;                        // describes data for the bulk transfer
+
+    enum lustre_dir_chunk_state                     state;                          // following protected by the dir lock
+    errno_t                                         error;                          // set when failed
+    boolean_t                                       listed;                         // on the dir's chunk list
+    boolean_t                                       waiting;
+    uint32_t                                        users;                          // readers, waiters and the fetch itself
+    uint64_t                                        last_used;
+    struct lustre_dir_chunk *                       next;                           // ordered by hash_start
+};
+
+struct lustre_dir {
+    OSMallocTag                                     malloc_tag;
+    lck_grp_t *                                     lock_group;
+    lck_mtx_t *                                     lock;                           // protects following fields and chunk state
+    struct lustre_dir_chunk *                       chunks;
+    uint32_t                                        chunk_count;
+    uint32_t                                        generation;                     // bumped on invalidation; stale fetches are dropped
+    uint64_t                                        clock;                          // for least recently used eviction
+
+    int32_t                                         ref_count;                      // the node's, plus one per fetch in flight
+};
+
+struct lustre_dir *     lustre_dir_alloc(OSMallocTag malloc_tag, lck_grp_t * lock_group);
+void                    lustre_dir_ref_count_inc(struct lustre_dir * dir);
+void                    lustre_dir_ref_count_dec(struct lustre_dir * dir);
+
+uint32_t                lustre_dir_generation(struct lustre_dir * dir);
+void                    lustre_dir_invalidate(struct lustre_dir * dir);
+
+off_t                   lustre_dir_cookie_from_hash(uint64_t hash);
+uint64_t                lustre_dir_hash_from_cookie(off_t cookie);
+
+// Chunk list and page walk (dirchunk.c).  Callers hold the dir lock, bar the walk, which only needs a use of the chunk.
+
+void                        lustre_dir_chunk_insert(struct lustre_dir * dir, struct lustre_dir_chunk * chunk);
+void                        lustre_dir_chunk_unlist(struct lustre_dir * dir, struct lustre_dir_chunk * chunk);
+struct lustre_dir_chunk *   lustre_dir_chunk_find(struct lustre_dir * dir, uint64_t hash);
+struct lustre_dir_chunk *   lustre_dir_chunk_victim(struct lustre_dir * dir);
+errno_t                     lustre_dir_chunk_walk(struct lustre_dir_chunk * chunk, uint64_t * hash, lustre_dir_entry_callback callback, void * data);
+
+void                    lustre_dir_prefetch(struct lustre_dir * dir, struct lustre_import * import, const struct lu_fid * fid, uint64_t hash, uint32_t generation);
+errno_t                 lustre_dir_walk(struct lustre_dir * dir, struct lustre_import * import, const struct lu_fid * fid, uint32_t generation, uint64_t * hash, lustre_dir_entry_callback callback, void * data);
+errno_t                 lustre_dir_read(struct lustre_dir * dir, struct lustre_import * import, const struct lu_fid * fid, const struct lu_fid * root_fid, uint32_t generation, uio_t uio, int flags, int * eof, int * count);
+
+#endif /* lustre_dir_h */
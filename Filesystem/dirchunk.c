@@ -0,0 +1,193 @@
+//
+//  dirchunk.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// The directory page cache's list of chunks and the walk over a chunk's pages.  Neither takes a lock, allocates or does I/O; dir.c does
+// that around them.
+
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/dirent.h>
+#include <sys/stat.h>
+
+#include "dir.h"
+#include "assert.h"
+
+#pragma mark - External
+
+// Name hashes use all 64 bits, but lseek won't take a negative offset, so cookies drop the lowest bit.  Resuming from a cookie can repeat
+// the entry before it only if their hashes differ in nothing but that bit.
+off_t lustre_dir_cookie_from_hash(uint64_t hash)
+{
+    return (off_t)(hash >> 1);
+}
+
+uint64_t lustre_dir_hash_from_cookie(off_t cookie)
+{
+    return (cookie < 0) ? 0 : ((uint64_t)cookie << 1);
+}
+
+// Caller holds the dir lock.
+void lustre_dir_chunk_unlist(struct lustre_dir * dir, struct lustre_dir_chunk * chunk)
+{
+    struct lustre_dir_chunk ** link;
+
+    LUSTRE_BUG_ON(!chunk->listed);
+
+    link = &dir->chunks;
+    while (*link && (*link != chunk)) {
+        link = &(*link)->next;
+    }
+
+    LUSTRE_BUG_ON(!*link);
+
+    *link           = chunk->next;
+    chunk->next     = NULL;
+    chunk->listed   = FALSE;
+    dir->chunk_count -= 1;
+}
+
+// Caller holds the dir lock.
+void lustre_dir_chunk_insert(struct lustre_dir * dir, struct lustre_dir_chunk * chunk)
+{
+    struct lustre_dir_chunk ** link;
+
+    LUSTRE_BUG_ON(chunk->listed);
+
+    link = &dir->chunks;
+    while (*link && ((*link)->hash_start < chunk->hash_start)) {
+        link = &(*link)->next;
+    }
+
+    chunk->next     = *link;
+    chunk->listed   = TRUE;
+    *link           = chunk;
+    dir->chunk_count += 1;
+}
+
+// Caller holds the dir lock.  Finds the ready chunk that covers hash, or the one being fetched from exactly there.
+struct lustre_dir_chunk * lustre_dir_chunk_find(struct lustre_dir * dir, uint64_t hash)
+{
+    struct lustre_dir_chunk * chunk;
+
+    for (chunk = dir->chunks; chunk && (chunk->hash_start <= hash); chunk = chunk->next) {
+        if (chunk->state == kLustreDirChunkFetching) {
+            if (chunk->hash_start == hash) {
+                break;
+            }
+        } else if ((chunk->state == kLustreDirChunkReady) && ((hash < chunk->hash_end) || (chunk->hash_end == kLustreDirHashEnd))) {
+            break;
+        }
+    }
+
+    return chunk;
+}
+
+// Caller holds the dir lock.  Returns the least recently used chunk nobody is using, or NULL if there is none.
+struct lustre_dir_chunk * lustre_dir_chunk_victim(struct lustre_dir * dir)
+{
+    struct lustre_dir_chunk * chunk;
+    struct lustre_dir_chunk * victim;
+
+    victim = NULL;
+    for (chunk = dir->chunks; chunk; chunk = chunk->next) {
+        if ((chunk->users == 0) && (chunk->state == kLustreDirChunkReady) && (!victim || (chunk->last_used < victim->last_used))) {
+            victim = chunk;
+        }
+    }
+
+    return victim;
+}
+
+// Hands the chunk's entries from *hash onwards to callback.  On return *hash is where the next walk should start: the entry the callback
+// refused (ENOBUFS) or the start of the next chunk.  Returns EPROTO
+// if an entry runs past its page.
+errno_t lustre_dir_chunk_walk(struct lustre_dir_chunk * chunk, uint64_t * hash, lustre_dir_entry_callback callback, void * data)
+{
+    const struct lu_dirpage *   page;
+    const struct lu_dirpage *   last_page;
+    const struct lu_dirent *    entry;
+    const struct lu_dirent *    next;
+    const struct luda_type *    type;
+    const uint8_t *             page_end;
+    struct lustre_dir_entry     found;
+    boolean_t                   collide;
+    uint32_t                    offset;
+    errno_t                     error;
+
+    last_page   = (const struct lu_dirpage *)(chunk->data + chunk->length - kLustreDirPageSize);
+    collide     = (last_page->ldp_flags & kLustreDirPageFlagCollide) != 0;
+
+    for (offset = 0; offset < chunk->length; offset += kLustreDirPageSize) {
+        page        = (const struct lu_dirpage *)(chunk->data + offset);
+        page_end    = (const uint8_t *)page + kLustreDirPageSize;
+
+        if ((page->ldp_flags & kLustreDirPageFlagEmpty) || ((page->ldp_hash_end < *hash) && (page->ldp_hash_end != kLustreDirHashEnd))) {
+            continue;
+        }
+
+        for (entry = page->ldp_entries; entry; entry = next) {
+            if (((const uint8_t *)entry->lde_name > page_end) || ((const uint8_t *)entry->lde_name + entry->lde_namelen > page_end)) {
+                return EPROTO;
+            }
+
+            next = NULL;
+            if (entry->lde_reclen != 0) {
+                next = (const struct lu_dirent *)((const uint8_t *)entry + entry->lde_reclen);
+                if ((const uint8_t *)next + sizeof(struct lu_dirent) > page_end) {
+                    next = NULL;
+                }
+            }
+
+            // With a collision at the end of the chunk, the next chunk starts with every entry of that hash, so leave them to it.
+
+            if ((entry->lde_hash < *hash) || (collide && (entry->lde_hash == chunk->hash_end))) {
+                continue;
+            }
+            if (entry->lde_namelen > MAXNAMLEN) {
+                continue;
+            }
+
+            found.name      = entry->lde_name;
+            found.namelen   = entry->lde_namelen;
+            found.fid       = entry->lde_fid;
+            found.hash      = entry->lde_hash;
+            found.next_hash = next ? next->lde_hash : page->ldp_hash_end;
+            found.type      = DT_UNKNOWN;
+            if (entry->lde_attrs & kLustreDirentAttrType) {
+                type        = (const struct luda_type *)(entry->lde_name + ((entry->lde_namelen + 1) & ~1));
+                found.type  = IFTODT(type->lt_type);
+            }
+
+            error = callback(&found, data);
+            if (error == ENOBUFS) {
+                *hash = entry->lde_hash;
+                return ENOBUFS;
+            }
+            if (error != 0) {
+                return error;
+            }
+        }
+    }
+
+    *hash = chunk->hash_end;
+
+    return 0;
+}
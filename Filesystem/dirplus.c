@@ -0,0 +1,208 @@
+//
+//  dirplus.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <libkern/libkern.h>
+#include <sys/errno.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "dirplus.h"
+#include "mdc.h"
+#include "volume.h"
+#include "request.h"
+#include "logging.h"
+#include "assert.h"
+
+#pragma mark - Internal
+
+static errno_t lustre_dirplus_collect(const struct lustre_dir_entry * entry, void * data)
+{
+    struct lustre_dirplus *         dirplus;
+    struct lustre_dirplus_entry *   collected;
+
+    dirplus = (struct lustre_dirplus *)data;
+
+    // getattrlistbulk never returns "." or "..", whether the read is filtered or not.
+
+    if ((entry->namelen == 1) && (entry->name[0] == '.')) {
+        return 0;
+    }
+    if ((entry->namelen == 2) && (entry->name[0] == '.') && (entry->name[1] == '.')) {
+        return 0;
+    }
+    if (dirplus->filter && !dirplus->filter(entry, dirplus->filter_data)) {
+        return 0;
+    }
+    if (dirplus->count == dirplus->capacity) {
+        return ENOBUFS;
+    }
+
+    collected = &dirplus->entries[dirplus->count];
+
+    bzero(collected, sizeof(struct lustre_dirplus_entry));
+    memcpy(collected->name, entry->name, entry->namelen);
+    collected->namelen      = entry->namelen;
+    collected->fid          = entry->fid;
+    collected->type         = entry->type;
+    collected->hash         = entry->hash;
+    collected->next_hash    = entry->next_hash;
+
+    dirplus->count += 1;
+
+    return 0;
+}
+
+// Fills in attributes for every entry: from the node cache where a lock keeps them current, and otherwise from getattrs that all go out
+// before we wait for any.  An entry whose getattr fails keeps its error; the others are unaffected.
+static errno_t lustre_dirplus_fetch_attrs(struct lustre_volume * volume, struct lustre_import * import, struct lustre_dirplus * dirplus)
+{
+    struct lustre_request_set *     set;
+    struct lustre_dirplus_entry *   entry;
+    struct mdt_body                 body;
+    uint32_t                        i;
+
+    set = lustre_request_set_alloc(volume->malloc_tag, volume->lock_group);
+    if (!set) {
+        return ENOMEM;
+    }
+
+    for (i=0; i<dirplus->count; i++) {
+        entry = &dirplus->entries[i];
+
+        if (lustre_volume_is_root_fid(volume, &entry->fid)) {
+            entry->attr = lustre_node_get_attr(volume->root_node);
+            continue;
+        }
+        if (lustre_node_cached_attr(volume, &entry->fid, &entry->attr)) {
+            continue;
+        }
+
+        entry->error = lustre_mdc_getattr_prepare(import, &entry->fid, &entry->request);
+        if (entry->error != 0) {
+            continue;
+        }
+
+        entry->error = lustre_request_set_add(set, entry->request);
+        if (entry->error != 0) {
+            lustre_request_ref_count_dec(entry->request);
+            entry->request = NULL;
+        }
+    }
+
+    // Per-request errors are picked up below, entry by entry.
+
+    (void)lustre_request_set_send(set);
+    (void)lustre_request_set_wait(set);
+
+    for (i=0; i<dirplus->count; i++) {
+        entry = &dirplus->entries[i];
+        if (!entry->request) {
+            continue;
+        }
+
+        entry->error = lustre_mdc_getattr_interpret(entry->request, &body);
+        if (entry->error == 0) {
+            lustre_node_attr_from_body(&entry->attr, &body);
+        }
+
+        lustre_request_ref_count_dec(entry->request);
+        entry->request = NULL;
+    }
+
+    lustre_request_set_free(set);
+
+    return 0;
+}
+
+#pragma mark - External
+
+// Gathers up to max entries of the directory from hash onwards, with their attributes.  On success *result holds at least one entry
+// unless the directory has none left; its hash is where the next read should start.
+errno_t lustre_dirplus_read(struct lustre_volume * volume, struct lustre_dir * dir, struct lustre_import * import, const struct lu_fid * fid, uint32_t generation, uint64_t hash, uint32_t max, struct lustre_dirplus ** result)
+{
+    return lustre_dirplus_read_filtered(volume, dir, import, fid, generation, hash, max, NULL, NULL, result);
+}
+
+// As lustre_dirplus_read, but only entries filter takes are gathered and only they cost a getattr.  The walk goes on past the rest until
+// max entries are gathered or the directory ends, so *result may come back empty with its hash moved on.
+errno_t lustre_dirplus_read_filtered(struct lustre_volume * volume, struct lustre_dir * dir, struct lustre_import * import, const struct lu_fid * fid, uint32_t generation, uint64_t hash, uint32_t max, lustre_dirplus_filter filter, void * filter_data, struct lustre_dirplus ** result)
+{
+    struct lustre_dirplus *     dirplus;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!dir);
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!result);
+
+    *result = NULL;
+
+    if (max == 0) {
+        return EINVAL;
+    }
+
+    dirplus = OSMalloc(sizeof(struct lustre_dirplus), volume->malloc_tag);
+    if (!dirplus) {
+        return ENOMEM;
+    }
+
+    bzero(dirplus, sizeof(struct lustre_dirplus));
+
+    dirplus->malloc_tag     = volume->malloc_tag;
+    dirplus->capacity       = (max < kLustreDirPlusBatchMax) ? max : kLustreDirPlusBatchMax;
+    dirplus->hash           = hash;
+    dirplus->filter         = filter;
+    dirplus->filter_data    = filter_data;
+
+    dirplus->entries = OSMalloc(dirplus->capacity * sizeof(struct lustre_dirplus_entry), dirplus->malloc_tag);
+    if (!dirplus->entries) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    error = lustre_dir_walk(dir, import, fid, generation, &dirplus->hash, lustre_dirplus_collect, dirplus);
+    if (error != 0) {
+        goto end;
+    }
+
+    error = lustre_dirplus_fetch_attrs(volume, import, dirplus);
+
+end:
+    if (error == 0) {
+        *result = dirplus;
+    } else {
+        lustre_dirplus_free(dirplus);
+    }
+
+    return error;
+}
+
+void lustre_dirplus_free(struct lustre_dirplus * dirplus)
+{
+    LUSTRE_BUG_ON(!dirplus);
+
+    if (dirplus->entries) {
+        OSFree(dirplus->entries, dirplus->capacity * sizeof(struct lustre_dirplus_entry), dirplus->malloc_tag);
+    }
+    OSFree(dirplus, sizeof(struct lustre_dirplus), dirplus->malloc_tag);
+}
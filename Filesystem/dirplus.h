@@ -0,0 +1,72 @@
+//
+//  dirplus.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// Directory entries together with their attributes, for getattrlistbulk.  Directory pages only carry names, FIDs and types, so the
+// attributes come from nodes whose locks still vouch for them or from getattr RPCs sent together in one request set; a batch costs one
+// round trip to the MDT however many entries it holds.
+
+#ifndef lustre_dirplus_h
+#define lustre_dirplus_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include "wire.h"
+#include "dir.h"
+#include "node.h"
+
+static const uint32_t   kLustreDirPlusBatchMax              = 512;              // entries gathered per call
+
+struct lustre_volume;
+struct lustre_import;
+struct lustre_request;
+
+// Decides from its directory page entry whether an entry is worth its attributes; entries it turns down are passed over.
+typedef boolean_t (* lustre_dirplus_filter)(const struct lustre_dir_entry * entry, void * data);
+
+struct lustre_dirplus_entry {
+    char                                            name[MAXNAMLEN + 1];
+    uint32_t                                        namelen;
+    struct lu_fid                                   fid;
+    uint8_t                                         type;                           // DT_*
+    uint64_t                                        hash;
+    uint64_t                                        next_hash;                      // where to resume after this entry
+    errno_t                                         error;                          // attr is only valid when this is 0
+    struct lustre_node_attr                         attr;
+    struct lustre_request *                         request;                        // getattr in flight, if any
+};
+
+struct lustre_dirplus {
+    OSMallocTag                                     malloc_tag;
+    struct lustre_dirplus_entry *                   entries;
+    uint32_t                                        count;
+    uint32_t                                        capacity;
+    uint64_t                                        hash;                           // where to resume after the last entry
+    lustre_dirplus_filter                           filter;                         // or NULL to take every entry
+    void *                                          filter_data;
+};
+
+errno_t                 lustre_dirplus_read(struct lustre_volume * volume, struct lustre_dir * dir, struct lustre_import * import, const struct lu_fid * fid, uint32_t generation, uint64_t hash, uint32_t max, struct lustre_dirplus ** result);
+errno_t                 lustre_dirplus_read_filtered(struct lustre_volume * volume, struct lustre_dir * dir, struct lustre_import * import, const struct lu_fid * fid, uint32_t generation, uint64_t hash, uint32_t max, lustre_dirplus_filter filter, void * filter_data, struct lustre_dirplus ** result);
+void                    lustre_dirplus_free(struct lustre_dirplus * dirplus);
+
+#endif /* lustre_dirplus_h */
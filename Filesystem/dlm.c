@@ -0,0 +1,564 @@
+//
+//  dlm.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <libkern/OSAtomic.h>
+#include <libkern/libkern.h>
+#include <kern/thread.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/proc.h>
+#include <sys/random.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "dlm.h"
+#include "import.h"
+#include "request.h"
+#include "logging.h"
+#include "assert.h"
+
+#pragma mark - Internal
+
+static uint32_t lustre_dlm_bucket(uint64_t cookie)
+{
+    return (uint32_t)((cookie * 0x9E3779B97F4A7C15ULL) >> 32) & (kLustreDLMHashSize - 1);
+}
+
+static void lustre_dlm_lock_free(struct lustre_dlm_lock * lock)
+{
+    LUSTRE_BUG_ON(lock->hashed);
+
+    lustre_import_ref_count_dec(lock->import);
+
+    OSFree(lock, sizeof(struct lustre_dlm_lock), lock->namespace->malloc_tag);
+}
+
+// Caller holds the namespace lock.
+static void lustre_dlm_unhash(struct lustre_dlm_namespace * namespace, struct lustre_dlm_lock * lock)
+{
+    struct lustre_dlm_lock ** link;
+
+    link = &namespace->buckets[lustre_dlm_bucket(lock->handle.cookie)];
+    while (*link && (*link != lock)) {
+        link = &(*link)->hash_next;
+    }
+
+    LUSTRE_BUG_ON(!*link);
+
+    *link           = lock->hash_next;
+    lock->hash_next = NULL;
+    lock->hashed    = FALSE;
+    namespace->count -= 1;
+}
+
+// Tells the server we no longer hold the lock.  Nobody waits for the reply.
+static void lustre_dlm_send_cancel(struct lustre_dlm_lock * lock)
+{
+    struct lustre_request * request;
+    struct ldlm_request *   body;
+
+    request = lustre_request_alloc(lock->import, kLustreOpcodeLDLMCancel);
+    if (!request) {
+        return;
+    }
+
+    body = lustre_request_field_add(request, sizeof(struct ldlm_request));
+    if (body) {
+        body->lock_count        = 1;
+        body->lock_handle[0]    = lock->remote_handle;
+        (void)lustre_request_send_async(request);
+    }
+
+    lustre_request_ref_count_dec(request);
+}
+
+#pragma mark - External
+
+struct lustre_dlm_namespace * lustre_dlm_namespace_alloc(OSMallocTag malloc_tag, lck_grp_t * lock_group)
+{
+    struct lustre_dlm_namespace *   namespace;
+    uint64_t                        cookie;
+
+    namespace = (struct lustre_dlm_namespace *)OSMalloc(sizeof(struct lustre_dlm_namespace), malloc_tag);
+    if (!namespace) {
+        os_log_error(lustre_logger_network, "Couldn't allocate lock namespace");
+        return NULL;
+    }
+
+    bzero(namespace, sizeof(struct lustre_dlm_namespace));
+
+    namespace->malloc_tag   = malloc_tag;
+    namespace->lock_group   = lock_group;
+
+    // Servers call back with nothing but our handle, and every mounted volume on a server shares its connections, so each handle carries
+    // its namespace's network id in its top bits for callbacks to be routed by.  Below them, each namespace starts somewhere random, so a
+    // callback for a lock from before a remount won't find one of the new namespace's.
+
+    read_random(&cookie, sizeof(cookie));
+    namespace->next_cookie  = (SInt64)(cookie >> 1) + 1;
+
+    namespace->lock = lck_mtx_alloc_init(lock_group, NULL);
+    if (!namespace->lock) {
+        os_log_error(lustre_logger_network, "Couldn't allocate lock namespace lock");
+        OSFree(namespace, sizeof(struct lustre_dlm_namespace), malloc_tag);
+        return NULL;
+    }
+
+    return namespace;
+}
+
+// Drops any locks still hashed without telling the server; used at unmount, once teardown has disconnected from every target and the
+// servers have dropped our locks along with our exports.  A target we couldn't reach drops them when it evicts us for not pinging.
+void lustre_dlm_namespace_free(struct lustre_dlm_namespace * namespace)
+{
+    struct lustre_dlm_lock *    lock;
+    uint32_t                    i;
+
+    LUSTRE_BUG_ON(!namespace);
+
+    lck_mtx_lock(namespace->lock);
+    for (i=0; i<kLustreDLMHashSize; i++) {
+        while ((lock = namespace->buckets[i]) != NULL) {
+            lock->revoked   = TRUE;
+            lock->revoke    = NULL;
+            lustre_dlm_unhash(namespace, lock);
+            lck_mtx_unlock(namespace->lock);
+            lustre_dlm_lock_ref_count_dec(lock);
+            lck_mtx_lock(namespace->lock);
+        }
+    }
+    lck_mtx_unlock(namespace->lock);
+
+    lck_mtx_free(namespace->lock, namespace->lock_group);
+    OSFree(namespace, sizeof(struct lustre_dlm_namespace), namespace->malloc_tag);
+}
+
+// The import's connection has been lost, and with it every lock its target granted us, since the server will take us for a new client when
+// we reconnect.  Each such lock is dropped as if the server had called it back, cached data and all, but nothing is sent: there's nothing
+// left on the server to cancel.  Enqueues waiting for a grant give up.
+void lustre_dlm_namespace_revoke(struct lustre_dlm_namespace * namespace, struct lustre_import * import)
+{
+    struct lustre_dlm_lock *    lock;
+    lustre_dlm_revoke_callback  revoke;
+    void *                      revoke_data;
+    uint32_t                    count;
+    uint32_t                    i;
+
+    LUSTRE_BUG_ON(!namespace);
+    LUSTRE_BUG_ON(!import);
+
+    count = 0;
+
+    lck_mtx_lock(namespace->lock);
+    for (i=0; i<kLustreDLMHashSize; i++) {
+        for (lock = namespace->buckets[i]; lock; ) {
+            if ((lock->import != import) || lock->revoked) {
+                lock = lock->hash_next;
+                continue;
+            }
+
+            lustre_dlm_lock_ref_count_inc(lock);
+
+            revoke                  = lock->revoke;
+            revoke_data             = lock->revoke_data;
+            lock->revoke            = NULL;
+            lock->revoke_data       = NULL;
+            lock->revoked           = TRUE;
+            lock->callback_thread   = current_thread();
+            wakeup(&lock->waiting);
+
+            lck_mtx_unlock(namespace->lock);
+
+            if (revoke) {
+                revoke(lock, revoke_data);
+            }
+
+            lck_mtx_lock(namespace->lock);
+            lock->callback_thread   = NULL;
+            lock->granted           = FALSE;
+            lock->waiting           = FALSE;
+            wakeup(&lock->callback_thread);
+            if (lock->hashed) {
+                lustre_dlm_unhash(namespace, lock);
+                lustre_dlm_lock_ref_count_dec(lock);
+            }
+            lck_mtx_unlock(namespace->lock);
+
+            lustre_dlm_lock_ref_count_dec(lock);
+            count += 1;
+
+            lck_mtx_lock(namespace->lock);
+            lock = namespace->buckets[i];
+        }
+    }
+    lck_mtx_unlock(namespace->lock);
+
+    if (count > 0) {
+        os_log_info(lustre_logger_network, "Dropped %u locks from %{public}s", count, import->target_uuid);
+    }
+}
+
+// Same mapping the servers use for MDT objects.
+struct ldlm_res_id lustre_dlm_resource_from_fid(const struct lu_fid * fid)
+{
+    struct ldlm_res_id resource;
+
+    LUSTRE_BUG_ON(!fid);
+
+    bzero(&resource, sizeof(resource));
+    resource.name[0] = fid->f_seq;
+    resource.name[1] = ((uint64_t)fid->f_ver << 32) | fid->f_oid;
+
+    return resource;
+}
+
+// Returns a lock that isn't granted yet, with a reference for the caller.  The namespace keeps its own reference until the lock is
+// cancelled, so that server callbacks can find it.
+struct lustre_dlm_lock * lustre_dlm_lock_alloc(struct lustre_dlm_namespace * namespace, struct lustre_import * import, enum lustre_dlm_type type, enum lustre_dlm_mode mode, const struct ldlm_res_id * resource)
+{
+    struct lustre_dlm_lock *    lock;
+    uint32_t                    bucket;
+
+    LUSTRE_BUG_ON(!namespace);
+    LUSTRE_BUG_ON(namespace->network_id == 0);
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!resource);
+
+    lock = (struct lustre_dlm_lock *)OSMalloc(sizeof(struct lustre_dlm_lock), namespace->malloc_tag);
+    if (!lock) {
+        os_log_error(lustre_logger_network, "Couldn't allocate lock");
+        return NULL;
+    }
+
+    bzero(lock, sizeof(struct lustre_dlm_lock));
+
+    lustre_import_ref_count_inc(import);
+    lock->namespace     = namespace;
+    lock->import        = import;
+    lock->handle.cookie = ((uint64_t)namespace->network_id << kLustreDLMNamespaceShift) | ((uint64_t)OSIncrementAtomic64(&namespace->next_cookie) & ((1ULL << kLustreDLMNamespaceShift) - 1));
+    lock->resource      = *resource;
+    lock->type          = type;
+    lock->mode          = mode;
+    lock->ref_count     = 2;
+
+    bucket = lustre_dlm_bucket(lock->handle.cookie);
+
+    lck_mtx_lock(namespace->lock);
+    lock->hash_next             = namespace->buckets[bucket];
+    namespace->buckets[bucket]  = lock;
+    lock->hashed                = TRUE;
+    namespace->count            += 1;
+    lck_mtx_unlock(namespace->lock);
+
+    return lock;
+}
+
+void lustre_dlm_lock_ref_count_inc(struct lustre_dlm_lock * lock)
+{
+    LUSTRE_BUG_ON(!lock);
+
+    OSIncrementAtomic(&lock->ref_count);
+}
+
+void lustre_dlm_lock_ref_count_dec(struct lustre_dlm_lock * lock)
+{
+    LUSTRE_BUG_ON(!lock);
+
+    if (OSDecrementAtomic(&lock->ref_count) == 1) {
+        lustre_dlm_lock_free(lock);
+    }
+}
+
+// Fills in the enqueue body for this lock.
+void lustre_dlm_lock_pack(struct lustre_dlm_lock * lock, struct ldlm_request * request, uint32_t flags, const union ldlm_wire_policy_data * policy)
+{
+    LUSTRE_BUG_ON(!lock);
+    LUSTRE_BUG_ON(!request);
+
+    request->lock_flags                         = flags;
+    request->lock_count                         = 1;
+    request->lock_desc.l_resource.lr_type       = lock->type;
+    request->lock_desc.l_resource.lr_name       = lock->resource;
+    request->lock_desc.l_req_mode               = lock->mode;
+    request->lock_handle[0]                     = lock->handle;
+    if (policy) {
+        request->lock_desc.l_policy_data        = *policy;
+    }
+}
+
+// Records what the server granted.  Returns FALSE if it granted nothing, or if we gave the lock up while the enqueue was in flight; either
+// way the lock is cancelled.
+boolean_t lustre_dlm_lock_granted(struct lustre_dlm_lock * lock, const struct ldlm_reply * reply)
+{
+    struct lustre_dlm_namespace *   namespace;
+    boolean_t                       granted;
+    boolean_t                       stale;
+
+    LUSTRE_BUG_ON(!lock);
+    LUSTRE_BUG_ON(!reply);
+
+    namespace   = lock->namespace;
+    granted     = (reply->lock_handle.cookie != 0) && (reply->lock_desc.l_granted_mode != 0);
+
+    lck_mtx_lock(namespace->lock);
+    if (granted) {
+        lock->remote_handle = reply->lock_handle;
+        lock->resource      = reply->lock_desc.l_resource.lr_name;
+        lock->mode          = reply->lock_desc.l_granted_mode;
+        lock->policy        = reply->lock_desc.l_policy_data;
+    }
+    stale = lock->revoked;
+    if (granted && !stale) {
+        lock->granted       = TRUE;
+    }
+    lck_mtx_unlock(namespace->lock);
+
+    if (granted && stale) {
+        lustre_dlm_send_cancel(lock);
+    } else if (!granted && !stale) {
+        lustre_dlm_lock_cancel(lock);
+    }
+
+    return granted && !stale;
+}
+
+// Returns FALSE if the lock has already been revoked, in which case nothing may be cached under it.
+boolean_t lustre_dlm_lock_set_revoke(struct lustre_dlm_lock * lock, lustre_dlm_revoke_callback revoke, void * data)
+{
+    boolean_t result;
+
+    LUSTRE_BUG_ON(!lock);
+
+    lck_mtx_lock(lock->namespace->lock);
+    result = lock->granted && !lock->revoked;
+    if (result) {
+        lock->revoke        = revoke;
+        lock->revoke_data   = data;
+    }
+    lck_mtx_unlock(lock->namespace->lock);
+
+    return result;
+}
+
+boolean_t lustre_dlm_lock_is_valid(struct lustre_dlm_lock * lock)
+{
+    boolean_t result;
+
+    LUSTRE_BUG_ON(!lock);
+
+    lck_mtx_lock(lock->namespace->lock);
+    result = lock->granted && !lock->revoked;
+    lck_mtx_unlock(lock->namespace->lock);
+
+    return result;
+}
+
+// For locks the server may queue rather than refuse (flock locks): records what the enqueue reply says and, if the lock is queued behind
+// someone else's, sleeps until the server's completion callback grants it.  Returns 0 once granted, EAGAIN if the server refused it, or
+// EINTR/ERESTART if a signal came first; on error the caller cancels the lock, which takes it off the server's queue too.
+errno_t lustre_dlm_lock_wait(struct lustre_dlm_lock * lock, const struct ldlm_reply * reply)
+{
+    struct lustre_dlm_namespace *   namespace;
+    errno_t                         error;
+
+    LUSTRE_BUG_ON(!lock);
+    LUSTRE_BUG_ON(!reply);
+
+    namespace   = lock->namespace;
+    error       = 0;
+
+    if (reply->lock_flags & kLustreDLMFlagFlockDeadlock) {
+        return EDEADLK;
+    }
+    if (reply->lock_handle.cookie == 0) {
+        return EAGAIN;
+    }
+
+    lck_mtx_lock(namespace->lock);
+
+    lock->remote_handle = reply->lock_handle;
+    lock->resource      = reply->lock_desc.l_resource.lr_name;
+    if ((reply->lock_desc.l_granted_mode != 0) && !lock->revoked) {
+        lock->mode      = reply->lock_desc.l_granted_mode;
+        lock->policy    = reply->lock_desc.l_policy_data;
+        lock->granted   = TRUE;
+    } else if ((reply->lock_flags & kLustreDLMFlagsBlocked) && !lock->granted && !lock->revoked) {
+        lock->waiting   = TRUE;
+        while (!lock->granted && !lock->revoked && (error == 0)) {
+            error = msleep(&lock->waiting, namespace->lock, PINOD | PCATCH, __FUNCTION__, NULL);
+        }
+    }
+    if ((error == 0) && !lock->granted) {
+        error = EAGAIN;
+    }
+    if (lock->granted) {
+        lock->waiting   = FALSE;
+    }
+
+    lck_mtx_unlock(namespace->lock);
+
+    return error;
+}
+
+// Gives the lock back.  Once this returns the revoke callback is not running and will never run.  The caller's reference is untouched.
+void lustre_dlm_lock_cancel(struct lustre_dlm_lock * lock)
+{
+    struct lustre_dlm_namespace *   namespace;
+    boolean_t                       send;
+    boolean_t                       hashed;
+
+    LUSTRE_BUG_ON(!lock);
+
+    namespace = lock->namespace;
+
+    lck_mtx_lock(namespace->lock);
+
+    lock->revoke        = NULL;
+    lock->revoke_data   = NULL;
+    while (lock->callback_thread && (lock->callback_thread != current_thread())) {
+        msleep(&lock->callback_thread, namespace->lock, PINOD, __FUNCTION__, NULL);
+    }
+
+    send            = lock->granted || lock->waiting;
+    hashed          = lock->hashed;
+    lock->granted   = FALSE;
+    lock->waiting   = FALSE;
+    lock->revoked   = TRUE;
+    if (hashed) {
+        lustre_dlm_unhash(namespace, lock);
+    }
+
+    lck_mtx_unlock(namespace->lock);
+
+    if (send) {
+        lustre_dlm_send_cancel(lock);
+    }
+    if (hashed) {
+        lustre_dlm_lock_ref_count_dec(lock);
+    }
+}
+
+// Drops the lock without telling the server, for locks the server keeps track of itself: a granted flock lock lasts on the server until an
+// unlock enqueue takes its range away, whichever lock that unlock comes with.  The caller's reference is untouched.
+void lustre_dlm_lock_forget(struct lustre_dlm_lock * lock)
+{
+    struct lustre_dlm_namespace *   namespace;
+    boolean_t                       hashed;
+
+    LUSTRE_BUG_ON(!lock);
+    LUSTRE_BUG_ON(lock->waiting);
+
+    namespace = lock->namespace;
+
+    lck_mtx_lock(namespace->lock);
+    hashed          = lock->hashed;
+    lock->granted   = FALSE;
+    lock->revoked   = TRUE;
+    lock->revoke    = NULL;
+    if (hashed) {
+        lustre_dlm_unhash(namespace, lock);
+    }
+    lck_mtx_unlock(namespace->lock);
+
+    if (hashed) {
+        lustre_dlm_lock_ref_count_dec(lock);
+    }
+}
+
+// Called by the network layer when a server sends a blocking callback for one of our locks.  Drops whatever was cached under the lock and
+// then cancels it.
+errno_t lustre_dlm_blocking_callback(struct lustre_dlm_namespace * namespace, struct lustre_handle handle)
+{
+    struct lustre_dlm_lock *    lock;
+    lustre_dlm_revoke_callback  revoke;
+    void *                      revoke_data;
+
+    LUSTRE_BUG_ON(!namespace);
+
+    lck_mtx_lock(namespace->lock);
+
+    for (lock = namespace->buckets[lustre_dlm_bucket(handle.cookie)]; lock; lock = lock->hash_next) {
+        if (lock->handle.cookie == handle.cookie) {
+            break;
+        }
+    }
+    if (!lock || lock->revoked) {
+        lck_mtx_unlock(namespace->lock);
+        return ENOENT;
+    }
+
+    lustre_dlm_lock_ref_count_inc(lock);
+
+    revoke                  = lock->revoke;
+    revoke_data             = lock->revoke_data;
+    lock->revoke            = NULL;
+    lock->revoked           = TRUE;
+    lock->callback_thread   = current_thread();
+
+    lck_mtx_unlock(namespace->lock);
+
+    if (revoke) {
+        revoke(lock, revoke_data);
+    }
+
+    lck_mtx_lock(namespace->lock);
+    lock->callback_thread = NULL;
+    wakeup(&lock->callback_thread);
+    lck_mtx_unlock(namespace->lock);
+
+    lustre_dlm_lock_cancel(lock);
+    lustre_dlm_lock_ref_count_dec(lock);
+
+    return 0;
+}
+
+// Called by the network layer when a server sends a completion callback: a lock it queued has now been granted, as desc says.  Wakes
+// whoever is waiting for it in lustre_dlm_lock_wait.
+errno_t lustre_dlm_completion_callback(struct lustre_dlm_namespace * namespace, struct lustre_handle handle, const struct ldlm_lock_desc * desc)
+{
+    struct lustre_dlm_lock * lock;
+
+    LUSTRE_BUG_ON(!namespace);
+    LUSTRE_BUG_ON(!desc);
+
+    lck_mtx_lock(namespace->lock);
+
+    for (lock = namespace->buckets[lustre_dlm_bucket(handle.cookie)]; lock; lock = lock->hash_next) {
+        if (lock->handle.cookie == handle.cookie) {
+            break;
+        }
+    }
+    if (!lock || lock->revoked) {
+        lck_mtx_unlock(namespace->lock);
+        return ENOENT;
+    }
+
+    if (desc->l_granted_mode != 0) {
+        lock->mode      = desc->l_granted_mode;
+        lock->policy    = desc->l_policy_data;
+        lock->granted   = TRUE;
+        wakeup(&lock->waiting);
+    }
+
+    lck_mtx_unlock(namespace->lock);
+
+    return 0;
+}
@@ -0,0 +1,99 @@
+//
+//  dlm.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Client side of the Lustre distributed lock manager.  A lock granted by a server lets us cache whatever it protects (names, attributes,
+// data) until the server asks for it back with a blocking callback.  Whoever caches something under a lock registers a revoke callback,
+// which is where the cache gets dropped.
+
+#ifndef lustre_dlm_h
+#define lustre_dlm_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <kern/locks.h>
+#include <libkern/OSMalloc.h>
+#include "wire.h"
+
+static const uint32_t   kLustreDLMHashSize                  = 1024;
+static const uint32_t   kLustreDLMNamespaceShift            = 56;               // handles carry their namespace's network id from here up
+
+struct lustre_import;
+struct lustre_dlm_lock;
+
+// Called at most once, without any DLM locks held, when the server revokes the lock.  Must not cancel the lock itself; the DLM does that.
+typedef void (* lustre_dlm_revoke_callback)(struct lustre_dlm_lock * lock, void * data);
+
+struct lustre_dlm_lock {
+    struct lustre_dlm_namespace *                   namespace;
+    struct lustre_import *                          import;                         // target that grants the lock
+    struct lustre_handle                            handle;                         // ours; server callbacks quote it
+    struct lustre_handle                            remote_handle;                  // the server's; used to cancel
+    struct ldlm_res_id                              resource;                       // may be changed by the server for intent enqueues
+    enum lustre_dlm_type                            type;
+    enum lustre_dlm_mode                            mode;                           // requested, then granted, mode
+    union ldlm_wire_policy_data                     policy;                         // granted bits or extent
+
+    boolean_t                                       granted;                        // following protected by the namespace lock
+    boolean_t                                       revoked;                        // server wants it back, or we cancelled it
+    boolean_t                                       waiting;                        // queued on the server behind a conflicting lock
+    boolean_t                                       hashed;
+    thread_t                                        callback_thread;                // running the revoke callback, if any
+    lustre_dlm_revoke_callback                      revoke;
+    void *                                          revoke_data;
+    struct lustre_dlm_lock *                        hash_next;
+
+    int32_t                                         ref_count;
+};
+
+struct lustre_dlm_namespace {
+    OSMallocTag                                     malloc_tag;
+    lck_grp_t *                                     lock_group;
+    lck_mtx_t *                                     lock;                           // protects following and lock state
+    struct lustre_dlm_lock *                        buckets[kLustreDLMHashSize];    // by our handle
+    uint32_t                                        count;
+    volatile SInt64                                 next_cookie;
+
+    uint32_t                                        network_id;                     // set by lustre_network_namespace_add
+    uint32_t                                        network_users;                  // callbacks on their way in; protected by the network lock
+};
+
+struct lustre_dlm_namespace *   lustre_dlm_namespace_alloc(OSMallocTag malloc_tag, lck_grp_t * lock_group);
+void                            lustre_dlm_namespace_free(struct lustre_dlm_namespace * namespace);
+void                            lustre_dlm_namespace_revoke(struct lustre_dlm_namespace * namespace, struct lustre_import * import);
+
+struct ldlm_res_id              lustre_dlm_resource_from_fid(const struct lu_fid * fid);
+
+struct lustre_dlm_lock *        lustre_dlm_lock_alloc(struct lustre_dlm_namespace * namespace, struct lustre_import * import, enum lustre_dlm_type type, enum lustre_dlm_mode mode, const struct ldlm_res_id * resource);
+void                            lustre_dlm_lock_ref_count_inc(struct lustre_dlm_lock * lock);
+void                            lustre_dlm_lock_ref_count_dec(struct lustre_dlm_lock * lock);
+
+void                            lustre_dlm_lock_pack(struct lustre_dlm_lock * lock, struct ldlm_request * request, uint32_t flags, const union ldlm_wire_policy_data * policy);
+boolean_t                       lustre_dlm_lock_granted(struct lustre_dlm_lock * lock, const struct ldlm_reply * reply);
+boolean_t                       lustre_dlm_lock_set_revoke(struct lustre_dlm_lock * lock, lustre_dlm_revoke_callback revoke, void * data);
+boolean_t                       lustre_dlm_lock_is_valid(struct lustre_dlm_lock * lock);
+errno_t                         lustre_dlm_lock_wait(struct lustre_dlm_lock * lock, const struct ldlm_reply * reply);
+void                            lustre_dlm_lock_cancel(struct lustre_dlm_lock * lock);
+void                            lustre_dlm_lock_forget(struct lustre_dlm_lock * lock);
+
+errno_t                         lustre_dlm_blocking_callback(struct lustre_dlm_namespace * namespace, struct lustre_handle handle);
+errno_t                         lustre_dlm_completion_callback(struct lustre_dlm_namespace * namespace, struct lustre_handle handle, const struct ldlm_lock_desc * desc);
+
+#endif /* lustre_dlm_h */
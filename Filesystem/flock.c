@@ -0,0 +1,311 @@
+//
+//  flock.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <libkern/libkern.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/unistd.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "flock.h"
+#include "volume.h"
+#include "import.h"
+#include "mdc.h"
+#include "dlm.h"
+#include "logging.h"
+#include "assert.h"
+
+#pragma mark - Internal
+
+static errno_t lustre_flocks_enqueue(struct lustre_flocks * flocks, enum lustre_dlm_mode mode, uint32_t flags, uint64_t owner, pid_t pid, uint64_t start, uint64_t end, struct ldlm_lock_desc * desc)
+{
+    struct lustre_volume *      volume;
+    struct lustre_import *      import;
+    struct ldlm_flock_wire      flock;
+    errno_t                     error;
+
+    volume = flocks->volume;
+
+    error = lustre_volume_fid_import(volume, &flocks->fid, &import);
+    if (error != 0) {
+        return error;
+    }
+
+    bzero(&flock, sizeof(flock));
+    flock.lfw_start = start;
+    flock.lfw_end   = end;
+    flock.lfw_owner = owner;
+    flock.lfw_pid   = (uint32_t)pid;
+
+    error = lustre_mdc_flock(import, volume->dlm, &flocks->fid, mode, flags, &flock, desc);
+    lustre_import_ref_count_dec(import);
+
+    return error;
+}
+
+#pragma mark - External
+
+struct lustre_flocks * lustre_flocks_alloc(struct lustre_volume * volume, const struct lu_fid * fid)
+{
+    struct lustre_flocks * flocks;
+
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!fid);
+
+    flocks = OSMalloc(sizeof(struct lustre_flocks), volume->malloc_tag);
+    if (!flocks) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate advisory lock table");
+        return NULL;
+    }
+
+    bzero(flocks, sizeof(struct lustre_flocks));
+
+    flocks->volume  = volume;
+    flocks->fid     = *fid;
+
+    flocks->lock = lck_mtx_alloc_init(volume->lock_group, NULL);
+    if (!flocks->lock) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate advisory lock table lock");
+        OSFree(flocks, sizeof(struct lustre_flocks), volume->malloc_tag);
+        return NULL;
+    }
+
+    return flocks;
+}
+
+// Every owner has closed the file by the time its node goes, and closing unlocks, so there's normally nothing left to give back.
+void lustre_flocks_free(struct lustre_flocks * flocks)
+{
+    struct lustre_volume *      volume;
+    struct lustre_flock_range * range;
+
+    LUSTRE_BUG_ON(!flocks);
+
+    volume = flocks->volume;
+
+    while ((range = flocks->ranges) != NULL) {
+        flocks->ranges = range->next;
+        OSFree(range, sizeof(struct lustre_flock_range), volume->malloc_tag);
+    }
+
+    lck_mtx_free(flocks->lock, volume->lock_group);
+    OSFree(flocks, sizeof(struct lustre_flocks), volume->malloc_tag);
+}
+
+// What the server knows a lock owner (a process for fcntl locks, an open file for flock ones) by.  The same id gives the same owner on
+// every file of the volume, which the server's deadlock detection relies on.
+uint64_t lustre_flocks_owner(struct lustre_flocks * flocks, const void * id)
+{
+    LUSTRE_BUG_ON(!flocks);
+
+    return (uint64_t)(uintptr_t)id ^ flocks->volume->flock_salt;
+}
+
+// Takes (F_RDLCK, F_WRLCK) or drops (F_UNLCK) start-end for owner.  With wait set a lock in somebody's way waits until it's granted,
+// which only the server can tell us; without it, EAGAIN comes back straight away if a local owner is in the way, and from the server if
+// another client is.  A signal while waiting gives EINTR with nothing taken.  A change waits for the owner's last one to finish first; an
+// unlock does so whatever signals come, since close relies on it.
+errno_t lustre_flocks_set(struct lustre_flocks * flocks, uint64_t owner, pid_t pid, short type, uint64_t start, uint64_t end, boolean_t wait)
+{
+    struct lustre_flock_range *     spares[2];
+    struct lustre_flock_range *     freed;
+    struct lustre_flock_range *     range;
+    struct lustre_flock_busy        busy;
+    struct lustre_flock_busy **     link;
+    enum lustre_dlm_mode            mode;
+    uint32_t                        flags;
+    boolean_t                       held;
+    uint32_t                        i;
+    errno_t                         error;
+
+    LUSTRE_BUG_ON(!flocks);
+    LUSTRE_BUG_ON(start > end);
+
+    bzero(spares, sizeof(spares));
+    freed = NULL;
+    error = 0;
+
+    switch (type) {
+        case F_RDLCK:
+            mode = kLustreDLMModePR;
+            break;
+        case F_WRLCK:
+            mode = kLustreDLMModePW;
+            break;
+        case F_UNLCK:
+            mode = kLustreDLMModeNL;
+            break;
+        default:
+            return EINVAL;
+    }
+
+    lck_mtx_lock(flocks->lock);
+
+    for (link = &flocks->busy; *link; ) {
+        if ((*link)->owner != owner) {
+            link = &(*link)->next;
+            continue;
+        }
+        flocks->waiting = TRUE;
+        if (msleep(flocks, flocks->lock, (type == F_UNLCK) ? PINOD : PINOD | PCATCH, __FUNCTION__, NULL) != 0) {
+            lck_mtx_unlock(flocks->lock);
+            return EINTR;
+        }
+        link = &flocks->busy;
+    }
+
+    held = lustre_flocks_held(flocks, owner, type, start, end);
+    if ((type == F_UNLCK) ? !held : held) {
+        lck_mtx_unlock(flocks->lock);
+        return 0;
+    }
+    if ((type != F_UNLCK) && !wait && lustre_flocks_conflict(flocks, owner, type, start, end)) {
+        lck_mtx_unlock(flocks->lock);
+        return EAGAIN;
+    }
+
+    busy.owner      = owner;
+    busy.next       = flocks->busy;
+    flocks->busy    = &busy;
+
+    lck_mtx_unlock(flocks->lock);
+
+    for (i=0; i<2; i++) {
+        spares[i] = OSMalloc(sizeof(struct lustre_flock_range), flocks->volume->malloc_tag);
+        if (!spares[i]) {
+            error = ENOMEM;
+            break;
+        }
+    }
+
+    // A waiting lock goes to the server even when the conflict is local: it queues the lock, grants it when the owner in the way lets go,
+    // and notices deadlocks, none of which the table can do.
+
+    if (error == 0) {
+        flags = wait ? 0 : kLustreDLMFlagBlockNoWait;
+
+        error = lustre_flocks_enqueue(flocks, mode, flags, owner, pid, start, end, NULL);
+        if ((error != 0) && (type == F_UNLCK)) {
+            // The owner is going either way, and may be gone for good (this is how close drops a process's locks), so it's forgotten here too.
+
+            os_log_error(lustre_logger_vfs, "Couldn't unlock [0x%llx:0x%x:0x%x] on the server: %d", flocks->fid.f_seq, flocks->fid.f_oid, flocks->fid.f_ver, error);
+            error = 0;
+        }
+    }
+
+    lck_mtx_lock(flocks->lock);
+
+    if (error == 0) {
+        lustre_flocks_apply(flocks, owner, pid, type, start, end, spares, &freed);
+    }
+
+    for (link = &flocks->busy; *link != &busy; link = &(*link)->next) {
+        LUSTRE_BUG_ON(!*link);
+    }
+    *link = busy.next;
+
+    if (flocks->waiting) {
+        flocks->waiting = FALSE;
+        wakeup(flocks);
+    }
+
+    lck_mtx_unlock(flocks->lock);
+
+    for (i=0; i<2; i++) {
+        if (spares[i]) {
+            OSFree(spares[i], sizeof(struct lustre_flock_range), flocks->volume->malloc_tag);
+        }
+    }
+    while ((range = freed) != NULL) {
+        freed = range->next;
+        OSFree(range, sizeof(struct lustre_flock_range), flocks->volume->malloc_tag);
+    }
+
+    return error;
+}
+
+// Answers F_GETLK: fills in fl with a lock that would stop owner taking start-end with fl->l_type, or sets fl->l_type to F_UNLCK if none
+// would.  Local owners are asked first, then the server.
+errno_t lustre_flocks_get(struct lustre_flocks * flocks, uint64_t owner, pid_t pid, struct flock * fl, uint64_t start, uint64_t end)
+{
+    const struct lustre_flock_range *   range;
+    struct ldlm_lock_desc               desc;
+    enum lustre_dlm_mode                mode;
+    uint64_t                            first;
+    uint64_t                            last;
+    errno_t                             error;
+
+    LUSTRE_BUG_ON(!flocks);
+    LUSTRE_BUG_ON(!fl);
+
+    switch (fl->l_type) {
+        case F_RDLCK:
+            mode = kLustreDLMModePR;
+            break;
+        case F_WRLCK:
+            mode = kLustreDLMModePW;
+            break;
+        default:
+            return EINVAL;
+    }
+
+    lck_mtx_lock(flocks->lock);
+    range = lustre_flocks_conflict(flocks, owner, fl->l_type, start, end);
+    if (range) {
+        fl->l_type  = range->type;
+        fl->l_pid   = range->pid;
+        first       = range->start;
+        last        = range->end;
+    }
+    lck_mtx_unlock(flocks->lock);
+
+    if (!range) {
+        bzero(&desc, sizeof(desc));
+
+        error = lustre_flocks_enqueue(flocks, mode, kLustreDLMFlagTestLock, owner, pid, start, end, &desc);
+        if (error != 0) {
+            return error;
+        }
+
+        switch (desc.l_granted_mode) {
+            case kLustreDLMModePR:
+                fl->l_type = F_RDLCK;
+                break;
+            case kLustreDLMModePW:
+                fl->l_type = F_WRLCK;
+                break;
+            default:
+                fl->l_type = F_UNLCK;
+                return 0;
+        }
+        fl->l_pid   = (pid_t)desc.l_policy_data.l_flock.lfw_pid;
+        first       = desc.l_policy_data.l_flock.lfw_start;
+        last        = desc.l_policy_data.l_flock.lfw_end;
+    }
+
+    fl->l_whence    = SEEK_SET;
+    fl->l_start     = (off_t)first;
+    fl->l_len       = (last == kLustreFlockEOF) ? 0 : (off_t)(last - first + 1);
+
+    return 0;
+}
@@ -0,0 +1,88 @@
+//
+//  flock.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// Advisory locks (fcntl and flock).  The MDT arbitrates between clients with flock locks on the file, which it keeps until an unlock
+// takes their range away and which, when one conflicts, it queues rather than refuses: a waiting lock is granted by a completion callback,
+// so nobody polls.  Each file also keeps the ranges this client's owners hold, with the same split and merge rules the server uses, so
+// anything the table can settle doesn't go to the MDT at all: taking a lock the owner already holds, dropping one it doesn't (every close
+// by a process that has ever locked anything), and refusing a non-blocking lock that another local owner is in the way of.
+//
+// Flock locks have no blocking callbacks, so a range can't be kept after its owner lets go without stalling other clients; unlocks that
+// matter always reach the server.
+//
+// One owner's changes are made one at a time, from the check against the table through the server's answer to the table's update, so
+// two threads of a process can't have the server grant in one order and the table record in another.
+
+#ifndef lustre_flock_h
+#define lustre_flock_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <sys/fcntl.h>
+#include <kern/locks.h>
+#include "wire.h"
+
+static const uint64_t   kLustreFlockEOF                     = UINT64_MAX;       // end of a range that runs to the end of the file
+
+struct lustre_volume;
+
+struct lustre_flock_range {
+    uint64_t                                        owner;
+    pid_t                                           pid;
+    short                                           type;                           // F_RDLCK or F_WRLCK
+    uint64_t                                        start;
+    uint64_t                                        end;                            // inclusive
+    struct lustre_flock_range *                     next;
+};
+
+// An owner with a change on its way; lives on the changing thread's stack.
+struct lustre_flock_busy {
+    uint64_t                                        owner;
+    struct lustre_flock_busy *                      next;
+};
+
+struct lustre_flocks {
+    struct lustre_volume *                          volume;
+    struct lu_fid                                   fid;
+    lck_mtx_t *                                     lock;                           // protects following fields
+    struct lustre_flock_range *                     ranges;                         // held by local owners; one owner's never overlap or touch
+    uint32_t                                        count;
+    struct lustre_flock_busy *                      busy;                           // owners with a change on its way
+    boolean_t                                       waiting;                        // somebody waits for one of them to finish
+};
+
+struct lustre_flocks *  lustre_flocks_alloc(struct lustre_volume * volume, const struct lu_fid * fid);
+void                    lustre_flocks_free(struct lustre_flocks * flocks);
+
+uint64_t                lustre_flocks_owner(struct lustre_flocks * flocks, const void * id);
+errno_t                 lustre_flocks_range(const struct flock * fl, uint64_t size, uint64_t * start, uint64_t * end);
+
+errno_t                 lustre_flocks_set(struct lustre_flocks * flocks, uint64_t owner, pid_t pid, short type, uint64_t start, uint64_t end, boolean_t wait);
+errno_t                 lustre_flocks_get(struct lustre_flocks * flocks, uint64_t owner, pid_t pid, struct flock * fl, uint64_t start, uint64_t end);
+
+// The table itself (flocktable.c).  Callers hold the lock.
+
+const struct lustre_flock_range *   lustre_flocks_conflict(struct lustre_flocks * flocks, uint64_t owner, short type, uint64_t start, uint64_t end);
+boolean_t                           lustre_flocks_held(struct lustre_flocks * flocks, uint64_t owner, short type, uint64_t start, uint64_t end);
+void                                lustre_flocks_apply(struct lustre_flocks * flocks, uint64_t owner, pid_t pid, short type, uint64_t start, uint64_t end, struct lustre_flock_range ** spares, struct lustre_flock_range ** freed);
+
+#endif /* lustre_flock_h */
@@ -0,0 +1,196 @@
+//
+//  flocktable.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// The table of ranges each file's local owners hold, and the struct flock arithmetic that feeds it.  No locks, allocation or I/O; flock.c
+// does those around it.
+
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/unistd.h>
+
+#include "flock.h"
+#include "assert.h"
+
+#pragma mark - Internal
+
+static boolean_t lustre_flocks_overlap(const struct lustre_flock_range * range, uint64_t start, uint64_t end)
+{
+    return (range->start <= end) && (range->end >= start);
+}
+
+static boolean_t lustre_flocks_touch(const struct lustre_flock_range * range, uint64_t start, uint64_t end)
+{
+    return ((range->end != kLustreFlockEOF) && (range->end + 1 == start)) || ((end != kLustreFlockEOF) && (end + 1 == range->start));
+}
+
+#pragma mark - External
+
+// Caller holds the lock.  Returns a range of another owner's that a lock of this type over start-end would conflict with, if any.
+const struct lustre_flock_range * lustre_flocks_conflict(struct lustre_flocks * flocks, uint64_t owner, short type, uint64_t start, uint64_t end)
+{
+    const struct lustre_flock_range * range;
+
+    for (range = flocks->ranges; range; range = range->next) {
+        if ((range->owner != owner) && lustre_flocks_overlap(range, start, end) && ((type == F_WRLCK) || (range->type == F_WRLCK))) {
+            return range;
+        }
+    }
+
+    return NULL;
+}
+
+// Caller holds the lock.  With type F_UNLCK, says whether owner holds anything in start-end; otherwise whether it already holds all of it
+// with this type, since an owner's ranges of one type that touch are always merged.
+boolean_t lustre_flocks_held(struct lustre_flocks * flocks, uint64_t owner, short type, uint64_t start, uint64_t end)
+{
+    const struct lustre_flock_range * range;
+
+    for (range = flocks->ranges; range; range = range->next) {
+        if (range->owner != owner) {
+            continue;
+        }
+        if (type == F_UNLCK) {
+            if (lustre_flocks_overlap(range, start, end)) {
+                return TRUE;
+            }
+        } else if ((range->type == type) && (range->start <= start) && (range->end >= end)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+// Caller holds the lock.  Does to owner's ranges what the server does to its locks: start-end is taken away from them (F_UNLCK) or takes
+// their place, merging with any of the same type it overlaps or touches.  At most one range gets split in two, and one added, so the two
+// spares are all it needs; those it takes are set to NULL.  Ranges it drops are chained onto *freed for the caller to free.
+void lustre_flocks_apply(struct lustre_flocks * flocks, uint64_t owner, pid_t pid, short type, uint64_t start, uint64_t end, struct lustre_flock_range ** spares, struct lustre_flock_range ** freed)
+{
+    struct lustre_flock_range **    link;
+    struct lustre_flock_range *     range;
+    struct lustre_flock_range *     split;
+
+    link = &flocks->ranges;
+    while ((range = *link) != NULL) {
+        if ((range->owner != owner) || (!lustre_flocks_overlap(range, start, end) && !lustre_flocks_touch(range, start, end))) {
+            link = &range->next;
+            continue;
+        }
+
+        if ((type != F_UNLCK) && (range->type == type)) {
+            start   = MIN(start, range->start);
+            end     = MAX(end, range->end);
+        } else if (!lustre_flocks_overlap(range, start, end)) {
+            link = &range->next;
+            continue;
+        } else if ((range->start < start) && (range->end > end)) {
+            split       = spares[0];
+            spares[0]   = NULL;
+            LUSTRE_BUG_ON(!split);
+
+            *split          = *range;
+            split->start    = end + 1;
+            range->end      = start - 1;
+            range->next     = split;
+            flocks->count   += 1;
+
+            link = &split->next;
+            continue;
+        } else if (range->start < start) {
+            range->end  = start - 1;
+            link        = &range->next;
+            continue;
+        } else if (range->end > end) {
+            range->start    = end + 1;
+            link            = &range->next;
+            continue;
+        }
+
+        *link           = range->next;
+        range->next     = *freed;
+        *freed          = range;
+        flocks->count   -= 1;
+    }
+
+    if (type != F_UNLCK) {
+        range       = spares[1];
+        spares[1]   = NULL;
+        LUSTRE_BUG_ON(!range);
+
+        range->owner    = owner;
+        range->pid      = pid;
+        range->type     = type;
+        range->start    = start;
+        range->end      = end;
+        range->next     = flocks->ranges;
+        flocks->ranges  = range;
+        flocks->count   += 1;
+    }
+}
+
+// Turns a struct flock into an inclusive byte range, the way <x-man-page://2/fcntl> says; size is the file's, for SEEK_END.  SEEK_CUR has
+// already been made relative to the start of the file by VFS.
+errno_t lustre_flocks_range(const struct flock * fl, uint64_t size, uint64_t * start, uint64_t * end)
+{
+    off_t first;
+
+    LUSTRE_BUG_ON(!fl);
+    LUSTRE_BUG_ON(!start);
+    LUSTRE_BUG_ON(!end);
+
+    switch (fl->l_whence) {
+        case SEEK_SET:
+        case SEEK_CUR:
+            first = fl->l_start;
+            break;
+        case SEEK_END:
+            if ((size > INT64_MAX) || ((fl->l_start > 0) && ((off_t)size > INT64_MAX - fl->l_start))) {
+                return EOVERFLOW;
+            }
+            first = (off_t)size + fl->l_start;
+            break;
+        default:
+            return EINVAL;
+    }
+
+    if (fl->l_len < 0) {
+        if (first == 0) {
+            return EINVAL;
+        }
+        *end    = (uint64_t)(first - 1);
+        first   += fl->l_len;
+    } else if (fl->l_len == 0) {
+        *end    = kLustreFlockEOF;
+    } else {
+        if (first > INT64_MAX - fl->l_len + 1) {
+            return EOVERFLOW;
+        }
+        *end    = (uint64_t)(first + fl->l_len - 1);
+    }
+    if (first < 0) {
+        return EINVAL;
+    }
+
+    *start = (uint64_t)first;
+
+    return 0;
+}
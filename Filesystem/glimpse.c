@@ -0,0 +1,669 @@
+//
+//  glimpse.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <libkern/libkern.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "glimpse.h"
+#include "layout.h"
+#include "volume.h"
+#include "node.h"
+#include "import.h"
+#include "osc.h"
+#include "io.h"
+#include "dlm.h"
+#include "request.h"
+#include "logging.h"
+#include "assert.h"
+
+// What the objects said so far, protected by the glimpse lock.
+struct lustre_glimpse_merge {
+    const struct lustre_layout *    layout;
+    uint64_t                        size;
+    uint64_t                        blocks;
+    struct timespec                 modify_time;
+    errno_t                         error;
+};
+
+// One object being asked.
+struct lustre_glimpse_pending {
+    struct lustre_glimpse *         glimpse;
+    struct lustre_glimpse_merge *   merge;
+    uint32_t                        stripe;
+    struct lustre_request *         request;
+    struct lustre_dlm_lock *        lock;                       // until the reply has been interpreted
+};
+
+#pragma mark - Internal
+
+// Caller holds the lock.
+static void lustre_glimpse_merge_add(struct lustre_glimpse_merge * merge, uint32_t stripe, const struct ost_lvb * lvb)
+{
+    struct timespec modify_time;
+
+    modify_time = (struct timespec){ (time_t)lvb->lvb_mtime, (long)lvb->lvb_mtime_ns };
+
+    merge->size     = MAX(merge->size, lustre_layout_file_size(merge->layout, stripe, lvb->lvb_size));
+    merge->blocks   += lvb->lvb_blocks;
+    if ((modify_time.tv_sec > merge->modify_time.tv_sec) || ((modify_time.tv_sec == merge->modify_time.tv_sec) && (modify_time.tv_nsec > merge->modify_time.tv_nsec))) {
+        merge->modify_time = modify_time;
+    }
+}
+
+static size_t lustre_glimpse_extent_map_size(uint32_t count)
+{
+    return sizeof(struct lustre_glimpse_extent_map) + count * sizeof(struct lustre_glimpse_extent);
+}
+
+static void lustre_glimpse_extent_map_free(struct lustre_volume * volume, struct lustre_glimpse_extent_map * map)
+{
+    OSFree(map, lustre_glimpse_extent_map_size(map->capacity), volume->malloc_tag);
+}
+
+// Keeps what reads back as data from an object's FIEMAP reply: unwritten extents read as zeroes, so they count as holes, and extents
+// that touch are joined.  A reply that filled every slot without marking its last extent only maps the object up to that extent's end.
+static struct lustre_glimpse_extent_map * lustre_glimpse_extent_map_alloc(struct lustre_volume * volume, const struct fiemap * fiemap)
+{
+    struct lustre_glimpse_extent_map *  map;
+    const struct fiemap_extent *        extent;
+    struct lustre_glimpse_extent *      last;
+    uint32_t                            count;
+    uint32_t                            i;
+
+    count = 0;
+    for (i=0; i<fiemap->fm_mapped_extents; i++) {
+        if (!(fiemap->fm_extents[i].fe_flags & kLustreFiemapExtentUnwritten) && (fiemap->fm_extents[i].fe_length > 0)) {
+            count += 1;
+        }
+    }
+
+    map = OSMalloc((uint32_t)lustre_glimpse_extent_map_size(count), volume->malloc_tag);
+    if (!map) {
+        return NULL;
+    }
+
+    bzero(map, lustre_glimpse_extent_map_size(count));
+    map->capacity   = count;
+    map->end        = UINT64_MAX;
+
+    for (i=0; i<fiemap->fm_mapped_extents; i++) {
+        extent = &fiemap->fm_extents[i];
+        if ((extent->fe_flags & kLustreFiemapExtentUnwritten) || (extent->fe_length == 0)) {
+            continue;
+        }
+
+        last = (map->count > 0) ? &map->extents[map->count - 1] : NULL;
+        if (last && (extent->fe_logical < last->offset + last->length)) {
+            break;
+        }
+        if (last && (extent->fe_logical == last->offset + last->length)) {
+            last->length += extent->fe_length;
+        } else {
+            map->extents[map->count] = (struct lustre_glimpse_extent){ extent->fe_logical, extent->fe_length };
+            map->count += 1;
+        }
+    }
+
+    // Extents out of order, or a reply cut short, leave the rest of the object unmapped, which reads as data.
+
+    extent = (fiemap->fm_mapped_extents > 0) ? &fiemap->fm_extents[fiemap->fm_mapped_extents - 1] : NULL;
+    if ((i < fiemap->fm_mapped_extents) || ((fiemap->fm_mapped_extents == fiemap->fm_extent_count) && extent && !(extent->fe_flags & kLustreFiemapExtentLast))) {
+        map->end = (map->count > 0) ? map->extents[map->count - 1].offset + map->extents[map->count - 1].length : 0;
+    }
+
+    return map;
+}
+
+// The OST wants a glimpse lock back: someone is about to write the object, so what we kept under the lock is going stale, and so are
+// the file's pages that came from it.  Those are thrown out while we still hold the lock, which also keeps the vnode from being
+// reclaimed under us: freeing the glimpse cancels it, and cancelling waits for this callback.
+static void lustre_glimpse_revoked(struct lustre_dlm_lock * lock, void * data)
+{
+    struct lustre_glimpse *             glimpse;
+    struct lustre_glimpse_extent_map *  extents;
+    boolean_t                           found;
+    boolean_t                           release;
+    uint32_t                            stripe_size;
+    uint32_t                            stripe_count;
+    uint32_t                            i;
+
+    glimpse         = (struct lustre_glimpse *)data;
+    found           = FALSE;
+    release         = FALSE;
+    extents         = NULL;
+    stripe_size     = 0;
+    stripe_count    = 0;
+
+    lck_mtx_lock(glimpse->lock);
+    for (i=0; i<glimpse->object_count; i++) {
+        if (glimpse->objects[i].lock == lock) {
+            stripe_size     = glimpse->stripe_size;
+            stripe_count    = glimpse->object_count;
+            found           = TRUE;
+            break;
+        }
+    }
+    lck_mtx_unlock(glimpse->lock);
+
+    if (!found) {
+        return;
+    }
+
+    lustre_io_invalidate_stripe(glimpse->node, i, stripe_size, stripe_count);
+
+    // A new layout may have moved the lock to the stale list meanwhile; whoever did that cancels and releases it.
+
+    lck_mtx_lock(glimpse->lock);
+    for (i=0; i<glimpse->object_count; i++) {
+        if (glimpse->objects[i].lock == lock) {
+            glimpse->objects[i].lock    = NULL;
+            extents                     = glimpse->objects[i].extents;
+            glimpse->objects[i].extents = NULL;
+            release = TRUE;
+            break;
+        }
+    }
+    lck_mtx_unlock(glimpse->lock);
+
+    if (extents) {
+        lustre_glimpse_extent_map_free(glimpse->volume, extents);
+    }
+    if (release) {
+        lustre_dlm_lock_ref_count_dec(lock);
+    }
+}
+
+// Caller holds the lock.  Makes sure the objects we keep are the layout's, starting afresh if not.  Locks kept for the old objects are
+// moved to *stale for the caller to cancel once the lock is dropped; cancelling waits for revoke callbacks, which take the lock.
+static errno_t lustre_glimpse_prepare_objects(struct lustre_glimpse * glimpse, const struct lustre_layout * layout, struct lustre_glimpse_object ** stale, uint32_t * stale_count)
+{
+    struct lustre_glimpse_object *  objects;
+    boolean_t                       same;
+    uint32_t                        i;
+
+    *stale          = NULL;
+    *stale_count    = 0;
+
+    same = (glimpse->object_count == layout->object_count);
+    for (i=0; same && (i<layout->object_count); i++) {
+        same = (glimpse->objects[i].ost_index == layout->objects[i].ost_index) && (memcmp(&glimpse->objects[i].oi, &layout->objects[i].oi, sizeof(struct ost_id)) == 0);
+    }
+    if (same) {
+        glimpse->stripe_size = layout->stripe_size;
+        return 0;
+    }
+
+    objects = OSMalloc(layout->object_count * sizeof(struct lustre_glimpse_object), glimpse->volume->malloc_tag);
+    if (!objects) {
+        return ENOMEM;
+    }
+
+    bzero(objects, layout->object_count * sizeof(struct lustre_glimpse_object));
+    for (i=0; i<layout->object_count; i++) {
+        objects[i].oi           = layout->objects[i].oi;
+        objects[i].ost_index    = layout->objects[i].ost_index;
+    }
+
+    *stale                  = glimpse->objects;
+    *stale_count            = glimpse->object_count;
+    glimpse->objects        = objects;
+    glimpse->object_count   = layout->object_count;
+    glimpse->stripe_size    = layout->stripe_size;
+
+    return 0;
+}
+
+static void lustre_glimpse_release_objects(struct lustre_glimpse * glimpse, struct lustre_glimpse_object * objects, uint32_t count)
+{
+    uint32_t i;
+
+    if (!objects) {
+        return;
+    }
+
+    for (i=0; i<count; i++) {
+        if (objects[i].extents) {
+            lustre_glimpse_extent_map_free(glimpse->volume, objects[i].extents);
+        }
+        if (objects[i].lock) {
+            lustre_dlm_lock_cancel(objects[i].lock);
+            lustre_dlm_lock_ref_count_dec(objects[i].lock);
+        }
+    }
+    OSFree(objects, count * sizeof(struct lustre_glimpse_object), glimpse->volume->malloc_tag);
+}
+
+// Runs on the network layer's completion path as each object answers: merges the answer and keeps the lock, if the OST granted one and
+// the object is still one of ours.
+static void lustre_glimpse_complete(struct lustre_request * request, void * data)
+{
+    struct lustre_glimpse_pending * pending;
+    struct lustre_glimpse *         glimpse;
+    struct lustre_glimpse_object *  object;
+    struct lustre_dlm_lock *        lock;
+    struct lustre_dlm_lock *        release;
+    struct ost_lvb                  lvb;
+    errno_t                         error;
+
+    pending = (struct lustre_glimpse_pending *)data;
+    glimpse = pending->glimpse;
+
+    error           = lustre_osc_glimpse_interpret(request, pending->lock, &lvb, &lock);
+    pending->lock   = NULL;
+    release         = lock;
+
+    lck_mtx_lock(glimpse->lock);
+
+    if (error == 0) {
+        lustre_glimpse_merge_add(pending->merge, pending->stripe, &lvb);
+    } else if (pending->merge->error == 0) {
+        pending->merge->error = error;
+    }
+
+    object = NULL;
+    if ((pending->stripe < glimpse->object_count) && (glimpse->objects[pending->stripe].ost_index == pending->merge->layout->objects[pending->stripe].ost_index) &&
+        (memcmp(&glimpse->objects[pending->stripe].oi, &pending->merge->layout->objects[pending->stripe].oi, sizeof(struct ost_id)) == 0)) {
+        object = &glimpse->objects[pending->stripe];
+    }
+    if (lock && object && lustre_dlm_lock_set_revoke(lock, lustre_glimpse_revoked, glimpse)) {
+        release         = object->lock;
+        object->lock    = lock;
+        object->lvb     = lvb;
+    }
+
+    lck_mtx_unlock(glimpse->lock);
+
+    if (release) {
+        lustre_dlm_lock_cancel(release);
+        lustre_dlm_lock_ref_count_dec(release);
+    }
+}
+
+// Caller holds the lock.  Finds the first byte at or after offset in one object that holds data (or is a hole, if data is FALSE), or
+// UINT64_MAX if there isn't one.  Past the end of what the map covers, and without a map at all, everything counts as data.
+static uint64_t lustre_glimpse_object_next(const struct lustre_glimpse_object * object, uint64_t offset, boolean_t data)
+{
+    const struct lustre_glimpse_extent_map *    map;
+    const struct lustre_glimpse_extent *        extent;
+    uint32_t                                    i;
+
+    map = object->lock ? object->extents : NULL;
+    if (!map) {
+        return data ? offset : UINT64_MAX;
+    }
+
+    for (i=0; i<map->count; i++) {
+        extent = &map->extents[i];
+        if (offset >= extent->offset + extent->length) {
+            continue;
+        }
+        if (data) {
+            return MAX(offset, extent->offset);
+        }
+        if (offset < extent->offset) {
+            return offset;
+        }
+        offset = extent->offset + extent->length;
+    }
+
+    if (map->end != UINT64_MAX) {
+        return data ? MAX(offset, map->end) : ((offset < map->end) ? offset : UINT64_MAX);
+    }
+    return data ? UINT64_MAX : offset;
+}
+
+#pragma mark - External
+
+struct lustre_glimpse * lustre_glimpse_alloc(struct lustre_node * node)
+{
+    struct lustre_volume *  volume;
+    struct lustre_glimpse * glimpse;
+
+    LUSTRE_BUG_ON(!node);
+
+    volume = node->volume;
+
+    glimpse = OSMalloc(sizeof(struct lustre_glimpse), volume->malloc_tag);
+    if (!glimpse) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate glimpse");
+        return NULL;
+    }
+
+    bzero(glimpse, sizeof(struct lustre_glimpse));
+
+    glimpse->volume = volume;
+    glimpse->node   = node;
+
+    glimpse->lock = lck_mtx_alloc_init(volume->lock_group, NULL);
+    if (!glimpse->lock) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate glimpse lock");
+        OSFree(glimpse, sizeof(struct lustre_glimpse), volume->malloc_tag);
+        return NULL;
+    }
+
+    return glimpse;
+}
+
+// Gives back every glimpse lock we kept.
+void lustre_glimpse_free(struct lustre_glimpse * glimpse)
+{
+    struct lustre_volume * volume;
+
+    LUSTRE_BUG_ON(!glimpse);
+
+    volume = glimpse->volume;
+
+    lustre_glimpse_release_objects(glimpse, glimpse->objects, glimpse->object_count);
+
+    lck_mtx_free(glimpse->lock, volume->lock_group);
+    OSFree(glimpse, sizeof(struct lustre_glimpse), volume->malloc_tag);
+}
+
+// Works out the size, blocks and modify time of a file with layout (which must have objects) into attr.  Objects whose glimpse lock we
+// still hold answer from what we kept; the rest are asked all at once.  attr's modify time is only ever moved later.
+errno_t lustre_glimpse_attrs(struct lustre_glimpse * glimpse, const struct lustre_layout * layout, struct lustre_node_attr * attr)
+{
+    struct lustre_volume *          volume;
+    struct lustre_glimpse_pending * pending;
+    struct lustre_glimpse_object *  stale;
+    struct lustre_glimpse_merge     merge;
+    struct lustre_request_set *     set;
+    struct lustre_import *          import;
+    uint32_t                        stale_count;
+    uint32_t                        count;
+    uint32_t                        i;
+    errno_t                         error;
+
+    LUSTRE_BUG_ON(!glimpse);
+    LUSTRE_BUG_ON(!layout);
+    LUSTRE_BUG_ON(layout->object_count == 0);
+    LUSTRE_BUG_ON(!attr);
+
+    volume  = glimpse->volume;
+    set     = NULL;
+
+    pending = OSMalloc(layout->object_count * sizeof(struct lustre_glimpse_pending), volume->malloc_tag);
+    if (!pending) {
+        return ENOMEM;
+    }
+
+    bzero(pending, layout->object_count * sizeof(struct lustre_glimpse_pending));
+    bzero(&merge, sizeof(merge));
+    merge.layout        = layout;
+    merge.modify_time   = attr->modify_time;
+
+    // Whatever we hold locks for is merged straight away.
+
+    count = 0;
+
+    lck_mtx_lock(glimpse->lock);
+    error = lustre_glimpse_prepare_objects(glimpse, layout, &stale, &stale_count);
+    if (error == 0) {
+        for (i=0; i<layout->object_count; i++) {
+            if (glimpse->objects[i].lock) {
+                lustre_glimpse_merge_add(&merge, i, &glimpse->objects[i].lvb);
+            } else {
+                pending[count].glimpse  = glimpse;
+                pending[count].merge    = &merge;
+                pending[count].stripe   = i;
+                count += 1;
+            }
+        }
+    }
+    lck_mtx_unlock(glimpse->lock);
+
+    lustre_glimpse_release_objects(glimpse, stale, stale_count);
+
+    if ((error != 0) || (count == 0)) {
+        goto end;
+    }
+
+    set = lustre_request_set_alloc(volume->malloc_tag, volume->lock_group);
+    if (!set) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    for (i=0; i<count; i++) {
+        error = lustre_volume_ost_import(volume, layout->objects[pending[i].stripe].ost_index, &import);
+        if (error != 0) {
+            goto end;
+        }
+
+        error = lustre_osc_glimpse_prepare(import, volume->dlm, &layout->objects[pending[i].stripe].oi, &pending[i].request, &pending[i].lock);
+        lustre_import_ref_count_dec(import);
+        if (error != 0) {
+            goto end;
+        }
+
+        lustre_request_set_callback(pending[i].request, lustre_glimpse_complete, &pending[i]);
+        error = lustre_request_set_add(set, pending[i].request);
+        if (error != 0) {
+            goto end;
+        }
+    }
+
+    (void)lustre_request_set_send(set);
+    (void)lustre_request_set_wait(set);
+
+    error = merge.error;
+
+end:
+    if (set) {
+        lustre_request_set_free(set);
+    }
+    for (i=0; i<count; i++) {
+        if (pending[i].lock) {
+            lustre_dlm_lock_cancel(pending[i].lock);
+            lustre_dlm_lock_ref_count_dec(pending[i].lock);
+        }
+        if (pending[i].request) {
+            lustre_request_ref_count_dec(pending[i].request);
+        }
+    }
+    OSFree(pending, layout->object_count * sizeof(struct lustre_glimpse_pending), volume->malloc_tag);
+
+    if (error == 0) {
+        attr->size          = merge.size;
+        attr->blocks        = merge.blocks;
+        attr->modify_time   = merge.modify_time;
+    }
+
+    return error;
+}
+
+// Makes sure we have extent maps for every object of a file with layout whose glimpse lock we hold, asking the OSTs for the missing ones
+// all at once.  Objects we hold no lock for are left unmapped: someone is writing them, so a map would be stale before it arrived.  A
+// map is only kept if the lock it was asked for under is still held when it arrives.
+errno_t lustre_glimpse_extents(struct lustre_glimpse * glimpse, const struct lustre_layout * layout)
+{
+    struct lustre_volume *              volume;
+    struct lustre_glimpse_object *      stale;
+    struct lustre_glimpse_extent_map *  map;
+    struct lustre_dlm_lock **           locks;
+    struct lustre_request **            requests;
+    struct lustre_request_set *         set;
+    struct lustre_import *              import;
+    const struct fiemap *               fiemap;
+    uint32_t                            stale_count;
+    uint32_t                            count;
+    uint32_t                            i;
+    errno_t                             error;
+
+    LUSTRE_BUG_ON(!glimpse);
+    LUSTRE_BUG_ON(!layout);
+    LUSTRE_BUG_ON(layout->object_count == 0);
+
+    volume      = glimpse->volume;
+    set         = NULL;
+    count       = 0;
+
+    locks       = OSMalloc(layout->object_count * sizeof(struct lustre_dlm_lock *), volume->malloc_tag);
+    requests    = OSMalloc(layout->object_count * sizeof(struct lustre_request *), volume->malloc_tag);
+    if (!locks || !requests) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    bzero(locks, layout->object_count * sizeof(struct lustre_dlm_lock *));
+    bzero(requests, layout->object_count * sizeof(struct lustre_request *));
+
+    // Each lock asked under is held on to, so it can't be freed and another take its place while the map is on its way.
+
+    lck_mtx_lock(glimpse->lock);
+    error = lustre_glimpse_prepare_objects(glimpse, layout, &stale, &stale_count);
+    if (error == 0) {
+        for (i=0; i<layout->object_count; i++) {
+            if (glimpse->objects[i].lock && !glimpse->objects[i].extents) {
+                locks[i] = glimpse->objects[i].lock;
+                lustre_dlm_lock_ref_count_inc(locks[i]);
+                count += 1;
+            }
+        }
+    }
+    lck_mtx_unlock(glimpse->lock);
+
+    lustre_glimpse_release_objects(glimpse, stale, stale_count);
+
+    if ((error != 0) || (count == 0)) {
+        goto end;
+    }
+
+    set = lustre_request_set_alloc(volume->malloc_tag, volume->lock_group);
+    if (!set) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    for (i=0; i<layout->object_count; i++) {
+        if (!locks[i]) {
+            continue;
+        }
+
+        error = lustre_volume_ost_import(volume, layout->objects[i].ost_index, &import);
+        if (error != 0) {
+            goto end;
+        }
+
+        error = lustre_osc_fiemap_prepare(import, &layout->objects[i].oi, kLustreGlimpseExtentsMax, &requests[i]);
+        lustre_import_ref_count_dec(import);
+        if (error != 0) {
+            goto end;
+        }
+
+        error = lustre_request_set_add(set, requests[i]);
+        if (error != 0) {
+            goto end;
+        }
+    }
+
+    (void)lustre_request_set_send(set);
+    (void)lustre_request_set_wait(set);
+
+    // An object whose map didn't come back stays unmapped, which only costs reading its holes.
+
+    for (i=0; i<layout->object_count; i++) {
+        if (!requests[i] || (lustre_osc_fiemap_interpret(requests[i], &fiemap) != 0)) {
+            continue;
+        }
+
+        map = lustre_glimpse_extent_map_alloc(volume, fiemap);
+        if (!map) {
+            continue;
+        }
+
+        lck_mtx_lock(glimpse->lock);
+        if ((i < glimpse->object_count) && (glimpse->objects[i].lock == locks[i]) && !glimpse->objects[i].extents) {
+            glimpse->objects[i].extents = map;
+            map = NULL;
+        }
+        lck_mtx_unlock(glimpse->lock);
+
+        if (map) {
+            lustre_glimpse_extent_map_free(volume, map);
+        }
+    }
+
+end:
+    if (set) {
+        lustre_request_set_free(set);
+    }
+    for (i=0; locks && requests && (i<layout->object_count); i++) {
+        if (requests[i]) {
+            lustre_request_ref_count_dec(requests[i]);
+        }
+        if (locks[i]) {
+            lustre_dlm_lock_ref_count_dec(locks[i]);
+        }
+    }
+    if (requests) {
+        OSFree(requests, layout->object_count * sizeof(struct lustre_request *), volume->malloc_tag);
+    }
+    if (locks) {
+        OSFree(locks, layout->object_count * sizeof(struct lustre_dlm_lock *), volume->malloc_tag);
+    }
+
+    return error;
+}
+
+// The first file offset at or after offset that holds data (or is a hole, if data is FALSE) as far as the extent maps we hold say, or
+// UINT64_MAX if there's none.  Never waits for the network.  Where the file ends isn't known here: past it is a hole either way.
+uint64_t lustre_glimpse_next(struct lustre_glimpse * glimpse, const struct lustre_layout * layout, uint64_t offset, boolean_t data)
+{
+    const struct lustre_glimpse_object *    object;
+    uint64_t                                next;
+    uint64_t                                result;
+    boolean_t                               same;
+    uint32_t                                i;
+
+    LUSTRE_BUG_ON(!glimpse);
+    LUSTRE_BUG_ON(!layout);
+    LUSTRE_BUG_ON(layout->object_count == 0);
+
+    result = UINT64_MAX;
+
+    lck_mtx_lock(glimpse->lock);
+
+    same = (glimpse->object_count == layout->object_count);
+    for (i=0; same && (i<layout->object_count); i++) {
+        same = (glimpse->objects[i].ost_index == layout->objects[i].ost_index) && (memcmp(&glimpse->objects[i].oi, &layout->objects[i].oi, sizeof(struct ost_id)) == 0);
+    }
+
+    if (!same) {
+        result = data ? offset : UINT64_MAX;
+    } else {
+        for (i=0; i<layout->object_count; i++) {
+            object  = &glimpse->objects[i];
+            next    = lustre_glimpse_object_next(object, lustre_layout_object_offset(layout, i, offset), data);
+            if (next != UINT64_MAX) {
+                result = MIN(result, lustre_layout_file_offset(layout, i, next));
+            }
+        }
+    }
+
+    lck_mtx_unlock(glimpse->lock);
+
+    return result;
+}
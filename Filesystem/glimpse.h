@@ -0,0 +1,83 @@
+//
+//  glimpse.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Glimpses: a striped file's size, blocks and modify time are only known to its objects.  A glimpse asks all of them at once and merges
+// the answers as they arrive, so finding the size of a 64-stripe file costs one round trip, not 64.  Where an OST grants the glimpse lock
+// (nobody is writing the object) its answer is kept with the lock, and later glimpses use it without asking again until the OST calls the
+// lock back, which it does before anyone writes the object.  The file's pages cached from that object are thrown out then too.
+//
+// An object's extent map (which parts of it hold data) is kept under its glimpse lock the same way.  Maps are only asked for when a file
+// looks sparse, all objects at once, and let holes be read as zeroes without going to the OSTs and SEEK_HOLE/SEEK_DATA be answered
+// locally.  An object we hold no map for counts as all data.
+
+#ifndef lustre_glimpse_h
+#define lustre_glimpse_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <kern/locks.h>
+#include "wire.h"
+
+struct lustre_volume;
+struct lustre_node;
+struct lustre_layout;
+struct lustre_node_attr;
+struct lustre_dlm_lock;
+
+static const uint32_t   kLustreGlimpseExtentsMax            = 1024;             // extents mapped per object; past the last, all data
+
+struct lustre_glimpse_extent {
+    uint64_t                                        offset;                         // in the object
+    uint64_t                                        length;
+};
+
+struct lustre_glimpse_extent_map {
+    uint32_t                                        count;
+    uint32_t                                        capacity;
+    uint64_t                                        end;                            // mapped up to here; UINT64_MAX if the whole object is
+    struct lustre_glimpse_extent                    extents[0];                     // data, in order, not touching
+};
+
+struct lustre_glimpse_object {
+    struct ost_id                                   oi;                             // copied from the layout, to notice a new one
+    uint32_t                                        ost_index;
+    struct lustre_dlm_lock *                        lock;                           // granted glimpse lock, NULL if none
+    struct ost_lvb                                  lvb;                            // what the object said; good while lock is held
+    struct lustre_glimpse_extent_map *              extents;                        // likewise, once asked for; NULL if not
+};
+
+struct lustre_glimpse {
+    struct lustre_volume *                          volume;
+    struct lustre_node *                            node;                           // whose glimpse this is
+    lck_mtx_t *                                     lock;                           // protects following fields
+    struct lustre_glimpse_object *                  objects;                        // one per object of the layout last glimpsed
+    uint32_t                                        object_count;
+    uint32_t                                        stripe_size;                    // of the same layout
+};
+
+struct lustre_glimpse *     lustre_glimpse_alloc(struct lustre_node * node);
+void                        lustre_glimpse_free(struct lustre_glimpse * glimpse);
+
+errno_t                     lustre_glimpse_attrs(struct lustre_glimpse * glimpse, const struct lustre_layout * layout, struct lustre_node_attr * attr);
+errno_t                     lustre_glimpse_extents(struct lustre_glimpse * glimpse, const struct lustre_layout * layout);
+uint64_t                    lustre_glimpse_next(struct lustre_glimpse * glimpse, const struct lustre_layout * layout, uint64_t offset, boolean_t data);
+
+#endif /* lustre_glimpse_h */
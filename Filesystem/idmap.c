@@ -0,0 +1,34 @@
+//
+//  idmap.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "idmap.h"
+
+#pragma mark - External
+
+// Returns the local id for identity, or nobody (the local one) if it has none.
+uint32_t lustre_idmap_lookup(uint64_t identity, uint32_t nobody)
+{
+    if ((identity > UINT32_MAX) || (identity == kLustreIdmapServerNobody)) {
+        return nobody;
+    }
+
+    return (uint32_t)identity;
+}
@@ -0,0 +1,34 @@
+//
+//  idmap.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Maps server identities to local uid/gid.  Ids are used as the server sends them, apart from its nobody and anything too wide to be a
+// local id.  Nothing is cached: with no resolver to ask there's nothing to save, and a lookup is a couple of compares that takes no lock.
+
+#ifndef lustre_idmap_h
+#define lustre_idmap_h
+
+#include <mach/mach_types.h>
+
+static const uint64_t   kLustreIdmapServerNobody            = 65534;        // what Linux servers use for nobody/nogroup
+
+uint32_t                lustre_idmap_lookup(uint64_t identity, uint32_t nobody);
+
+#endif /* lustre_idmap_h */
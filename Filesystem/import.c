@@ -0,0 +1,783 @@
+//
+//  import.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <libkern/OSAtomic.h>
+#include <libkern/libkern.h>
+#include <kern/thread.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/proc.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "import.h"
+#include "request.h"
+#include "network.h"
+#include "logging.h"
+#include "assert.h"
+
+static const uint32_t   kLustreImportTableInitialCapacity   = 8;
+static const uint32_t   kLustreImportBRWSize                = 4 * 1024 * 1024;
+static const uint32_t   kLustreImportBRWSizeDefault         = 1024 * 1024;      // what servers that don't negotiate allow
+static const uint64_t   kLustreImportGrantWanted            = 64 * 1024 * 1024; // OST space we ask to be able to dirty
+
+#pragma mark - Internal
+
+static void lustre_import_free(struct lustre_import * import)
+{
+    LUSTRE_BUG_ON(!import);
+
+    if (import->peer) {
+        lustre_network_peer_put(import->peer);
+    }
+    if (import->lock) {
+        lck_mtx_free(import->lock, import->lock_group);
+    }
+
+    OSFree(import, sizeof(struct lustre_import), import->malloc_tag);
+}
+
+static uint32_t lustre_import_connect_opcode(enum lustre_import_type type)
+{
+    switch (type) {
+        case kLustreImportTypeMGS:  return kLustreOpcodeMGSConnect;
+        case kLustreImportTypeMDT:  return kLustreOpcodeMDSConnect;
+        case kLustreImportTypeOST:  return kLustreOpcodeOSTConnect;
+    }
+
+    LUSTRE_BUG();
+}
+
+static uint32_t lustre_import_disconnect_opcode(enum lustre_import_type type)
+{
+    switch (type) {
+        case kLustreImportTypeMGS:  return kLustreOpcodeMGSDisconnect;
+        case kLustreImportTypeMDT:  return kLustreOpcodeMDSDisconnect;
+        case kLustreImportTypeOST:  return kLustreOpcodeOSTDisconnect;
+    }
+
+    LUSTRE_BUG();
+}
+
+// Servers evict clients they haven't heard from in a while, and this is how an idle one is heard from.  A ping that fails means the
+// connection is gone as far as we can tell, whatever the server thinks.
+static void lustre_import_ping(struct lustre_import * import)
+{
+    struct lustre_request * request;
+    errno_t                 error;
+
+    request = lustre_request_alloc(import, kLustreOpcodeOBDPing);
+    if (!request) {
+        return;
+    }
+
+    error = lustre_request_send(request);
+    if ((error != 0) && (error != ESHUTDOWN)) {
+        lustre_import_disconnected(import, request->handle, error);
+    }
+
+    lustre_request_ref_count_dec(request);
+}
+
+// One per import once it has first been asked to connect, holding a reference on it until the import is closed.  Pings while connected,
+// retries the connect while disconnected, and recovers the import as soon as it's marked evicted.
+static void lustre_import_pinger(void * parameter, wait_result_t wait_result)
+{
+    struct lustre_import *  import;
+    struct timespec         interval;
+
+    import      = parameter;
+    interval    = (struct timespec){ kLustreImportPingIntervalSeconds, 0 };
+
+    lck_mtx_lock(import->lock);
+    while (import->state != kLustreImportStateClosed) {
+        if (import->evicted) {
+            lck_mtx_unlock(import->lock);
+            if (import->evict) {
+                import->evict(import, import->evict_data);
+            }
+            lck_mtx_lock(import->lock);
+            import->evicted = FALSE;
+            lck_mtx_unlock(import->lock);
+
+            (void)lustre_import_connect_async(import);
+
+            lck_mtx_lock(import->lock);
+            continue;
+        }
+
+        if (msleep(&import->pinging, import->lock, PINOD, __FUNCTION__, &interval) != EWOULDBLOCK) {
+            continue;
+        }
+
+        if (import->state == kLustreImportStateFull) {
+            lck_mtx_unlock(import->lock);
+            lustre_import_ping(import);
+            lck_mtx_lock(import->lock);
+        } else if (import->state == kLustreImportStateDisconnected) {
+            lck_mtx_unlock(import->lock);
+            (void)lustre_import_connect_async(import);
+            lck_mtx_lock(import->lock);
+        }
+    }
+    import->pinging = FALSE;
+    wakeup(&import->pinging);
+    lck_mtx_unlock(import->lock);
+
+    lustre_import_ref_count_dec(import);
+
+    thread_terminate(current_thread());
+}
+
+// Runs on the network layer's completion path, so it must not block.  Wakes everyone waiting for this import.
+static void lustre_import_connect_interpret(struct lustre_request * request, void * data)
+{
+    struct lustre_import *          import;
+    const struct ptlrpc_body *      body;
+    const struct obd_connect_data * connect_data;
+    errno_t                         error;
+
+    import  = data;
+    error   = request->error;
+    body    = NULL;
+
+    LUSTRE_BUG_ON(!import);
+
+    if (error == 0) {
+        body            = lustre_request_reply_body(request);
+        connect_data    = lustre_request_reply_field(request, 1, sizeof(struct obd_connect_data), NULL);
+        if (!body || !connect_data) {
+            error = EPROTO;
+        }
+    }
+
+    lck_mtx_lock(import->lock);
+
+    if (import->state == kLustreImportStateClosed) {
+        // Unmounted while the connect was in flight; leave it closed.
+    } else if (error == 0) {
+        import->remote_handle       = body->pb_handle;
+        import->connect_data        = *connect_data;
+        import->connection_count    += 1;
+        import->grant               = (connect_data->ocd_connect_flags & kLustreConnectFlagGrant) ? connect_data->ocd_grant : 0;
+        import->grant_dirty         = 0;
+        import->connect_error       = 0;
+        import->state               = kLustreImportStateFull;
+    } else {
+        import->connect_error       = error;
+        import->state               = kLustreImportStateDisconnected;
+    }
+
+    wakeup(&import->state);
+
+    lck_mtx_unlock(import->lock);
+
+    if (error == 0) {
+        os_log_info(lustre_logger_network, "Connected to %{public}s", import->target_uuid);
+    } else {
+        os_log_error(lustre_logger_network, "Failed to connect to %{public}s, error %d", import->target_uuid, error);
+    }
+}
+
+#pragma mark - External
+
+struct lustre_import * lustre_import_alloc(OSMallocTag malloc_tag, lck_grp_t * lock_group, enum lustre_import_type type, uint32_t index, const char * target_uuid, const char * client_uuid, uint64_t nid, uint16_t port)
+{
+    struct lustre_import * import;
+
+    LUSTRE_BUG_ON(!target_uuid);
+    LUSTRE_BUG_ON(!client_uuid);
+
+    import = (struct lustre_import *)OSMalloc(sizeof(struct lustre_import), malloc_tag);
+    if (!import) {
+        os_log_error(lustre_logger_network, "Couldn't allocate import");
+        return NULL;
+    }
+
+    bzero(import, sizeof(struct lustre_import));
+
+    import->malloc_tag  = malloc_tag;
+    import->lock_group  = lock_group;
+
+    import->lock = lck_mtx_alloc_init(lock_group, NULL);
+    if (!import->lock) {
+        os_log_error(lustre_logger_network, "Couldn't allocate import lock");
+        lustre_import_free(import);
+        return NULL;
+    }
+
+    import->ref_count   = 1;
+    import->type        = type;
+    import->index       = index;
+    import->nid         = nid;
+    import->port        = (port != 0) ? port : kLustreImportDefaultPort;
+    import->state       = kLustreImportStateNew;
+    strlcpy(import->target_uuid, target_uuid, kLustreUUIDSize);
+    strlcpy(import->client_uuid, client_uuid, kLustreUUIDSize);
+
+    import->peer = lustre_network_peer_get(import->nid, import->port);
+    if (!import->peer) {
+        os_log_error(lustre_logger_network, "Couldn't allocate peer for %{public}s", import->target_uuid);
+        lustre_import_free(import);
+        return NULL;
+    }
+
+    return import;
+}
+
+void lustre_import_ref_count_inc(struct lustre_import * import)
+{
+    LUSTRE_BUG_ON(!import);
+
+    OSIncrementAtomic(&import->ref_count);
+}
+
+void lustre_import_ref_count_dec(struct lustre_import * import)
+{
+    LUSTRE_BUG_ON(!import);
+
+    if (OSDecrementAtomic(&import->ref_count) == 1) {
+        lustre_import_free(import);
+    }
+}
+
+// Xids come from the network layer rather than the import: imports on the same server share its connections, and replies are matched by
+// xid alone.
+uint64_t lustre_import_next_xid(struct lustre_import * import)
+{
+    LUSTRE_BUG_ON(!import);
+
+    return lustre_network_next_xid();
+}
+
+struct lustre_handle lustre_import_remote_handle(struct lustre_import * import)
+{
+    struct lustre_handle handle;
+
+    LUSTRE_BUG_ON(!import);
+
+    lck_mtx_lock(import->lock);
+    handle = import->remote_handle;
+    lck_mtx_unlock(import->lock);
+
+    return handle;
+}
+
+// Largest bulk read or write the target accepts in one RPC, as negotiated on connect.
+uint32_t lustre_import_brw_size(struct lustre_import * import)
+{
+    uint32_t brw_size;
+
+    LUSTRE_BUG_ON(!import);
+
+    lck_mtx_lock(import->lock);
+    if ((import->connect_data.ocd_connect_flags & kLustreConnectFlagBRWSize) && (import->connect_data.ocd_brw_size != 0)) {
+        brw_size = MIN(import->connect_data.ocd_brw_size, kLustreImportBRWSize);
+    } else {
+        brw_size = kLustreImportBRWSizeDefault;
+    }
+    lck_mtx_unlock(import->lock);
+
+    return brw_size;
+}
+
+// Grant is OST space the server has set aside for us, so data we cache dirty is sure to fit when it's written.  Takes bytes of it for data
+// about to be dirtied; returns FALSE, taking nothing, if we haven't that much, in which case the data has to be written straight away.
+boolean_t lustre_import_grant_take(struct lustre_import * import, uint64_t bytes)
+{
+    boolean_t taken;
+
+    LUSTRE_BUG_ON(!import);
+
+    lck_mtx_lock(import->lock);
+    taken = (import->state == kLustreImportStateFull) && (import->grant >= bytes);
+    if (taken) {
+        import->grant       -= bytes;
+        import->grant_dirty += bytes;
+    }
+    lck_mtx_unlock(import->lock);
+
+    return taken;
+}
+
+// Gives back grant taken for data that was never dirtied after all.
+void lustre_import_grant_return(struct lustre_import * import, uint64_t bytes)
+{
+    LUSTRE_BUG_ON(!import);
+
+    lck_mtx_lock(import->lock);
+    bytes               = MIN(bytes, import->grant_dirty);
+    import->grant       += bytes;
+    import->grant_dirty -= bytes;
+    lck_mtx_unlock(import->lock);
+}
+
+// Dirty data has been written; the grant it held is now space used on the OST.  Data written without grant counts too, which can only make
+// us claim less dirty than we have.
+void lustre_import_grant_written(struct lustre_import * import, uint64_t bytes)
+{
+    LUSTRE_BUG_ON(!import);
+
+    lck_mtx_lock(import->lock);
+    import->grant_dirty -= MIN(bytes, import->grant_dirty);
+    lck_mtx_unlock(import->lock);
+}
+
+// Fills in how our grant stands on an outgoing write, asking for enough more to keep kLustreImportGrantWanted available.
+void lustre_import_grant_announce(struct lustre_import * import, struct obdo * oa)
+{
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!oa);
+
+    lck_mtx_lock(import->lock);
+    if (import->connect_data.ocd_connect_flags & kLustreConnectFlagGrant) {
+        oa->o_valid     |= kLustreOBDFlagGrant | kLustreMDFlagBlocks;
+        oa->o_grant     = import->grant;
+        oa->o_blocks    = import->grant_dirty;
+        oa->o_mode      = (uint32_t)((import->grant < kLustreImportGrantWanted) ? kLustreImportGrantWanted - import->grant : 0);
+        oa->o_misc      = 0;
+    }
+    lck_mtx_unlock(import->lock);
+}
+
+// Adds whatever extra grant came back on a write reply.
+void lustre_import_grant_update(struct lustre_import * import, const struct obdo * oa)
+{
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!oa);
+
+    if (!(oa->o_valid & kLustreOBDFlagGrant)) {
+        return;
+    }
+
+    lck_mtx_lock(import->lock);
+    import->grant += oa->o_grant;
+    lck_mtx_unlock(import->lock);
+}
+
+// Sets what's called when the import loses its connection, before it's reconnected.
+void lustre_import_set_evict(struct lustre_import * import, lustre_import_evict_callback evict, void * data)
+{
+    LUSTRE_BUG_ON(!import);
+
+    lck_mtx_lock(import->lock);
+    LUSTRE_BUG_ON(import->pinging);
+    import->evict       = evict;
+    import->evict_data  = data;
+    lck_mtx_unlock(import->lock);
+}
+
+// Starts connecting and returns straight away.  Does nothing if the import is already connected or connecting, or is waiting for its
+// pinger to recover it, which reconnects it afterwards.
+errno_t lustre_import_connect_async(struct lustre_import * import)
+{
+    struct lustre_request *     request;
+    struct obd_connect_data *   connect_data;
+    struct lustre_handle *      local_handle;
+    char *                      target_uuid;
+    char *                      client_uuid;
+    thread_t                    thread;
+    boolean_t                   start;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(!import);
+
+    lck_mtx_lock(import->lock);
+    if (import->state == kLustreImportStateClosed) {
+        lck_mtx_unlock(import->lock);
+        return ESHUTDOWN;
+    }
+    if ((import->state == kLustreImportStateConnecting) || (import->state == kLustreImportStateFull) || import->evicted) {
+        lck_mtx_unlock(import->lock);
+        return 0;
+    }
+    import->state           = kLustreImportStateConnecting;
+    import->remote_handle   = (struct lustre_handle){ 0 };
+    start                   = !import->pinging;
+    import->pinging         = TRUE;
+    lck_mtx_unlock(import->lock);
+
+    // No import is connected without a pinger, or nothing would recover it.
+
+    if (start) {
+        lustre_import_ref_count_inc(import);
+        if (kernel_thread_start(lustre_import_pinger, import, &thread) != KERN_SUCCESS) {
+            os_log_error(lustre_logger_network, "Couldn't start pinger for %{public}s", import->target_uuid);
+            lck_mtx_lock(import->lock);
+            import->pinging         = FALSE;
+            import->connect_error   = ENOMEM;
+            import->state           = kLustreImportStateDisconnected;
+            wakeup(&import->pinging);
+            wakeup(&import->state);
+            lck_mtx_unlock(import->lock);
+            lustre_import_ref_count_dec(import);
+            return ENOMEM;
+        }
+        thread_deallocate(thread);
+    }
+
+    error = ENOMEM;
+
+    request = lustre_request_alloc(import, lustre_import_connect_opcode(import->type));
+    if (!request) {
+        goto end;
+    }
+
+    // Any failure from here on, including a failure to send, is reported through lustre_import_connect_interpret.
+
+    lustre_request_set_reply_size(request, 1024);
+    lustre_request_set_callback(request, lustre_import_connect_interpret, import);
+
+    target_uuid     = lustre_request_field_add(request, kLustreUUIDSize);
+    client_uuid     = lustre_request_field_add(request, kLustreUUIDSize);
+    local_handle    = lustre_request_field_add(request, sizeof(struct lustre_handle));
+    connect_data    = lustre_request_field_add(request, sizeof(struct obd_connect_data));
+    if (!target_uuid || !client_uuid || !local_handle || !connect_data) {
+        lustre_request_complete(request, NULL, 0, error);
+        goto end;
+    }
+
+    strlcpy(target_uuid, import->target_uuid, kLustreUUIDSize);
+    strlcpy(client_uuid, import->client_uuid, kLustreUUIDSize);
+    local_handle->cookie = (uint64_t)(uintptr_t)import;
+
+    connect_data->ocd_connect_flags = kLustreConnectFlagVersion | kLustreConnectFlagFid | kLustreConnectFlagFull20;
+    connect_data->ocd_version       = kLustreConnectVersion;
+    if (import->type == kLustreImportTypeMDT) {
+        connect_data->ocd_connect_flags |= kLustreConnectFlagIBits | kLustreConnectFlagAttrFid | kLustreConnectFlag64BitHash;
+        connect_data->ocd_ibits_known   = kLustreInodeBitsKnown;
+    } else if (import->type == kLustreImportTypeOST) {
+        connect_data->ocd_connect_flags |= kLustreConnectFlagGrant | kLustreConnectFlagBRWSize | kLustreConnectFlagBulkMatchBits;
+        connect_data->ocd_brw_size      = kLustreImportBRWSize;
+        connect_data->ocd_index         = import->index;
+        connect_data->ocd_grant         = (uint32_t)kLustreImportGrantWanted;
+    }
+
+    error = lustre_request_send_async(request);
+
+end:
+    if (request) {
+        lustre_request_ref_count_dec(request);
+    } else {
+        lck_mtx_lock(import->lock);
+        import->connect_error   = error;
+        import->state           = kLustreImportStateDisconnected;
+        wakeup(&import->state);
+        lck_mtx_unlock(import->lock);
+    }
+
+    return error;
+}
+
+// Blocks until this import is connected.  An import that previously failed gets one fresh connect attempt, so a server that comes back
+// is picked up by the next user rather than needing a remount.  One being recovered is waited for.
+errno_t lustre_import_wait_connected(struct lustre_import * import)
+{
+    struct timespec timeout;
+    boolean_t       retried;
+    errno_t         error;
+
+    LUSTRE_BUG_ON(!import);
+
+    retried = FALSE;
+    timeout = (struct timespec){ kLustreRequestTimeoutSeconds, 0 };
+
+    lck_mtx_lock(import->lock);
+    while (1) {
+        if (import->state == kLustreImportStateFull) {
+            error = 0;
+            break;
+        } else if (import->state == kLustreImportStateClosed) {
+            error = ESHUTDOWN;
+            break;
+        } else if ((import->state == kLustreImportStateConnecting) || import->evicted) {
+            if (msleep(&import->state, import->lock, PINOD, __FUNCTION__, &timeout) == EWOULDBLOCK) {
+                error = ETIMEDOUT;
+                break;
+            }
+        } else if (!retried) {
+            retried = TRUE;
+            lck_mtx_unlock(import->lock);
+            (void)lustre_import_connect_async(import);
+            lck_mtx_lock(import->lock);
+        } else {
+            error = (import->connect_error != 0) ? import->connect_error : ENOTCONN;
+            break;
+        }
+    }
+    lck_mtx_unlock(import->lock);
+
+    return error;
+}
+
+boolean_t lustre_import_is_connected(struct lustre_import * import)
+{
+    boolean_t connected;
+
+    LUSTRE_BUG_ON(!import);
+
+    lck_mtx_lock(import->lock);
+    connected = (import->state == kLustreImportStateFull);
+    lck_mtx_unlock(import->lock);
+
+    return connected;
+}
+
+// The connection that handle came from is gone: the server said it doesn't know us (it evicted us, or restarted), or stopped answering.
+// Runs on the network layer's completion path, so it only marks the import; the pinger drops what was cached under the target's locks
+// and reconnects.  A handle from an older connection changes nothing.
+void lustre_import_disconnected(struct lustre_import * import, struct lustre_handle handle, errno_t error)
+{
+    boolean_t lost;
+
+    LUSTRE_BUG_ON(!import);
+
+    lck_mtx_lock(import->lock);
+    lost = (import->state == kLustreImportStateFull) && (import->remote_handle.cookie == handle.cookie);
+    if (lost) {
+        import->connect_error   = error;
+        import->state           = kLustreImportStateDisconnected;
+        import->evicted         = TRUE;
+        wakeup(&import->pinging);
+        wakeup(&import->state);
+    }
+    lck_mtx_unlock(import->lock);
+
+    if (lost) {
+        os_log_error(lustre_logger_network, "Lost connection to %{public}s, error %d", import->target_uuid, error);
+    }
+}
+
+// Adds a disconnect to set if the import is connected, so the server drops our export, and every lock it granted us, straight away
+// instead of once it has given up waiting for our pings.  The import may be closed before the set is sent.
+errno_t lustre_import_disconnect(struct lustre_import * import, struct lustre_request_set * set)
+{
+    struct lustre_request * request;
+    errno_t                 error;
+
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!set);
+
+    if (!lustre_import_is_connected(import)) {
+        return 0;
+    }
+
+    request = lustre_request_alloc(import, lustre_import_disconnect_opcode(import->type));
+    if (!request) {
+        return ENOMEM;
+    }
+
+    error = lustre_request_set_add(set, request);
+
+    lustre_request_ref_count_dec(request);
+
+    return error;
+}
+
+// Marks the import unusable, wakes anyone waiting on it and waits for its pinger to stop.  Connects still in flight finish harmlessly.
+void lustre_import_close(struct lustre_import * import)
+{
+    LUSTRE_BUG_ON(!import);
+
+    lck_mtx_lock(import->lock);
+    import->state = kLustreImportStateClosed;
+    wakeup(&import->state);
+    wakeup(&import->pinging);
+    while (import->pinging) {
+        (void)msleep(&import->pinging, import->lock, PINOD, __FUNCTION__, NULL);
+    }
+    lck_mtx_unlock(import->lock);
+}
+
+#pragma mark - Tables
+
+static uint32_t lustre_import_table_capacity(struct lustre_import_table * table)
+{
+    uint32_t capacity;
+
+    lck_mtx_lock(table->lock);
+    capacity = table->capacity;
+    lck_mtx_unlock(table->lock);
+
+    return capacity;
+}
+
+struct lustre_import_table * lustre_import_table_alloc(OSMallocTag malloc_tag, lck_grp_t * lock_group)
+{
+    struct lustre_import_table * table;
+
+    table = (struct lustre_import_table *)OSMalloc(sizeof(struct lustre_import_table), malloc_tag);
+    if (!table) {
+        os_log_error(lustre_logger_network, "Couldn't allocate import table");
+        return NULL;
+    }
+
+    bzero(table, sizeof(struct lustre_import_table));
+
+    table->malloc_tag   = malloc_tag;
+    table->lock_group   = lock_group;
+
+    table->lock = lck_mtx_alloc_init(lock_group, NULL);
+    if (!table->lock) {
+        os_log_error(lustre_logger_network, "Couldn't allocate import table lock");
+        OSFree(table, sizeof(struct lustre_import_table), malloc_tag);
+        return NULL;
+    }
+
+    return table;
+}
+
+void lustre_import_table_free(struct lustre_import_table * table)
+{
+    uint32_t i;
+
+    LUSTRE_BUG_ON(!table);
+
+    for (i=0; i<table->capacity; i++) {
+        if (table->imports[i]) {
+            lustre_import_ref_count_dec(table->imports[i]);
+        }
+    }
+    if (table->imports) {
+        OSFree(table->imports, table->capacity * sizeof(struct lustre_import *), table->malloc_tag);
+    }
+    lck_mtx_free(table->lock, table->lock_group);
+    OSFree(table, sizeof(struct lustre_import_table), table->malloc_tag);
+}
+
+// The table takes its own reference.  Fails with EEXIST if the index is already taken.
+errno_t lustre_import_table_insert(struct lustre_import_table * table, struct lustre_import * import)
+{
+    struct lustre_import ** imports;
+    uint32_t                capacity;
+    errno_t                 error;
+
+    LUSTRE_BUG_ON(!table);
+    LUSTRE_BUG_ON(!import);
+
+    error = 0;
+
+    lck_mtx_lock(table->lock);
+
+    if (import->index >= table->capacity) {
+        capacity = MAX(table->capacity, kLustreImportTableInitialCapacity);
+        while (capacity <= import->index) {
+            capacity *= 2;
+        }
+        imports = OSMalloc(capacity * sizeof(struct lustre_import *), table->malloc_tag);
+        if (!imports) {
+            error = ENOMEM;
+            goto end;
+        }
+        bzero(imports, capacity * sizeof(struct lustre_import *));
+        if (table->imports) {
+            memcpy(imports, table->imports, table->capacity * sizeof(struct lustre_import *));
+            OSFree(table->imports, table->capacity * sizeof(struct lustre_import *), table->malloc_tag);
+        }
+        table->imports  = imports;
+        table->capacity = capacity;
+    }
+
+    if (table->imports[import->index]) {
+        error = EEXIST;
+        goto end;
+    }
+
+    lustre_import_ref_count_inc(import);
+    table->imports[import->index] = import;
+    table->count += 1;
+
+end:
+    lck_mtx_unlock(table->lock);
+
+    return error;
+}
+
+// Returns the import with a reference the caller must drop, or NULL.
+struct lustre_import * lustre_import_table_lookup(struct lustre_import_table * table, uint32_t index)
+{
+    struct lustre_import * import;
+
+    LUSTRE_BUG_ON(!table);
+
+    import = NULL;
+
+    lck_mtx_lock(table->lock);
+    if ((index < table->capacity) && table->imports[index]) {
+        import = table->imports[index];
+        lustre_import_ref_count_inc(import);
+    }
+    lck_mtx_unlock(table->lock);
+
+    return import;
+}
+
+uint32_t lustre_import_table_count(struct lustre_import_table * table)
+{
+    uint32_t count;
+
+    LUSTRE_BUG_ON(!table);
+
+    lck_mtx_lock(table->lock);
+    count = table->count;
+    lck_mtx_unlock(table->lock);
+
+    return count;
+}
+
+void lustre_import_table_disconnect(struct lustre_import_table * table, struct lustre_request_set * set)
+{
+    struct lustre_import *  import;
+    uint32_t                i;
+    errno_t                 error;
+
+    LUSTRE_BUG_ON(!table);
+    LUSTRE_BUG_ON(!set);
+
+    for (i=0; i<lustre_import_table_capacity(table); i++) {
+        import = lustre_import_table_lookup(table, i);
+        if (!import) {
+            continue;
+        }
+        error = lustre_import_disconnect(import, set);
+        if (error != 0) {
+            os_log_error(lustre_logger_network, "Couldn't disconnect from %{public}s, error %d", import->target_uuid, error);
+        }
+        lustre_import_ref_count_dec(import);
+    }
+}
+
+// Closing waits for each import's pinger, which may be running a lock's revoke callback, so the table isn't kept locked meanwhile.
+void lustre_import_table_close(struct lustre_import_table * table)
+{
+    struct lustre_import *  import;
+    uint32_t                i;
+
+    LUSTRE_BUG_ON(!table);
+
+    for (i=0; i<lustre_import_table_capacity(table); i++) {
+        import = lustre_import_table_lookup(table, i);
+        if (import) {
+            lustre_import_close(import);
+            lustre_import_ref_count_dec(import);
+        }
+    }
+}
@@ -0,0 +1,128 @@
+//
+//  import.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// An import is our side of a connection to one server target (the MGS, an MDT or an OST).  Imports connect asynchronously; anyone who needs
+// a particular target calls lustre_import_wait_connected, which only blocks until that one target is usable.
+//
+// Once connected, each import has a pinger thread that keeps the server from evicting us while we're idle.  If the server says it no longer
+// knows us, or stops answering, the import goes back to disconnected and the pinger recovers it: everything cached under locks the target
+// granted is dropped, since a new connection is a new client as far as the server is concerned, and then it reconnects.
+
+#ifndef lustre_import_h
+#define lustre_import_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <kern/locks.h>
+#include <libkern/OSMalloc.h>
+#include "wire.h"
+
+static const uint16_t   kLustreImportDefaultPort            = 988;
+static const uint32_t   kLustreImportPingIntervalSeconds    = 25;               // a quarter of the servers' default timeout, as Linux pings
+
+struct lustre_network_peer;
+struct lustre_request_set;
+struct lustre_import;
+
+// Called from the pinger, with no locks held, when the connection to the target has been lost and before reconnecting.
+typedef void (* lustre_import_evict_callback)(struct lustre_import * import, void * data);
+
+enum lustre_import_type {
+    kLustreImportTypeMGS,
+    kLustreImportTypeMDT,
+    kLustreImportTypeOST,
+};
+
+enum lustre_import_state {
+    kLustreImportStateNew,                                                          // not yet asked to connect
+    kLustreImportStateConnecting,                                                   // connect RPC in flight
+    kLustreImportStateFull,                                                         // connected, requests may be sent
+    kLustreImportStateDisconnected,                                                 // connect failed or connection lost, may be retried
+    kLustreImportStateClosed,                                                       // torn down, never usable again
+};
+
+struct lustre_import {
+    enum lustre_import_type                         type;
+    uint32_t                                        index;                          // target index (MDT or OST number)
+    char                                            target_uuid[kLustreUUIDSize];   // e.g. "fs1-OST0003_UUID"
+    char                                            client_uuid[kLustreUUIDSize];   // identifies this mount to the server
+    uint64_t                                        nid;                            // LNet NID of the server
+    uint16_t                                        port;                           // acceptor port
+    struct lustre_network_peer *                    peer;                           // connections to nid, shared by every import on that server
+    OSMallocTag                                     malloc_tag;                     // owning volume's tag, also used for this import's requests
+    lck_grp_t *                                     lock_group;                     // owning volume's lock group
+    lustre_import_evict_callback                    evict;                          // set before the first connect
+    void *                                          evict_data;
+
+    lck_mtx_t *                                     lock;                           // protects following fields
+    enum lustre_import_state                        state;
+    errno_t                                         connect_error;                  // why the last connect failed
+    struct lustre_handle                            remote_handle;                  // export handle returned by the server
+    struct obd_connect_data                         connect_data;                   // as negotiated with the server
+    uint32_t                                        connection_count;               // bumped on every successful connect
+    uint64_t                                        grant;                          // OST space granted to us and not yet spent on dirty data
+    uint64_t                                        grant_dirty;                    // spent on dirty data not yet written
+    boolean_t                                       evicted;                        // connection lost, pinger hasn't recovered yet
+    boolean_t                                       pinging;                        // pinger thread running
+
+    int32_t                                         ref_count;
+};
+
+struct lustre_import_table {
+    OSMallocTag                                     malloc_tag;
+    lck_grp_t *                                     lock_group;
+    lck_mtx_t *                                     lock;                           // protects following fields
+    struct lustre_import **                         imports;                        // indexed by target index, may be sparse
+    uint32_t                                        capacity;
+    uint32_t                                        count;
+};
+
+struct lustre_import *          lustre_import_alloc(OSMallocTag malloc_tag, lck_grp_t * lock_group, enum lustre_import_type type, uint32_t index, const char * target_uuid, const char * client_uuid, uint64_t nid, uint16_t port);
+void                            lustre_import_ref_count_inc(struct lustre_import * import);
+void                            lustre_import_ref_count_dec(struct lustre_import * import);
+
+uint64_t                        lustre_import_next_xid(struct lustre_import * import);
+struct lustre_handle            lustre_import_remote_handle(struct lustre_import * import);
+uint32_t                        lustre_import_brw_size(struct lustre_import * import);
+
+boolean_t                       lustre_import_grant_take(struct lustre_import * import, uint64_t bytes);
+void                            lustre_import_grant_return(struct lustre_import * import, uint64_t bytes);
+void                            lustre_import_grant_written(struct lustre_import * import, uint64_t bytes);
+void                            lustre_import_grant_announce(struct lustre_import * import, struct obdo * oa);
+void                            lustre_import_grant_update(struct lustre_import * import, const struct obdo * oa);
+
+void                            lustre_import_set_evict(struct lustre_import * import, lustre_import_evict_callback evict, void * data);
+errno_t                         lustre_import_connect_async(struct lustre_import * import);
+errno_t                         lustre_import_wait_connected(struct lustre_import * import);
+boolean_t                       lustre_import_is_connected(struct lustre_import * import);
+void                            lustre_import_disconnected(struct lustre_import * import, struct lustre_handle handle, errno_t error);
+errno_t                         lustre_import_disconnect(struct lustre_import * import, struct lustre_request_set * set);
+void                            lustre_import_close(struct lustre_import * import);
+
+struct lustre_import_table *    lustre_import_table_alloc(OSMallocTag malloc_tag, lck_grp_t * lock_group);
+void                            lustre_import_table_free(struct lustre_import_table * table);
+errno_t                         lustre_import_table_insert(struct lustre_import_table * table, struct lustre_import * import);
+struct lustre_import *          lustre_import_table_lookup(struct lustre_import_table * table, uint32_t index);
+uint32_t                        lustre_import_table_count(struct lustre_import_table * table);
+void                            lustre_import_table_disconnect(struct lustre_import_table * table, struct lustre_request_set * set);
+void                            lustre_import_table_close(struct lustre_import_table * table);
+
+#endif /* lustre_import_h */
@@ -0,0 +1,993 @@
+//
+//  io.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <libkern/libkern.h>
+#include <libkern/OSAtomic.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/ubc.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "io.h"
+#include "volume.h"
+#include "node.h"
+#include "layout.h"
+#include "import.h"
+#include "mdc.h"
+#include "osc.h"
+#include "request.h"
+#include "writeback.h"
+#include "glimpse.h"
+#include "logging.h"
+#include "assert.h"
+
+static const uint32_t   kLustreIOExtentsMax                 = 16;               // per RPC; a piece that doesn't fit starts another
+static const uint32_t   kLustreIOSegmentsMax                = 16;
+static const uint32_t   kLustreIORPCsInitial                = 8;
+
+struct lustre_io;
+
+// One bulk read of one object.
+struct lustre_io_rpc {
+    struct lustre_io *                              io;
+    struct lustre_import *                          import;                         // OST holding the object, with a reference
+    uint32_t                                        stripe;                         // index into the layout's objects
+    uint32_t                                        brw_size;                       // most the OST takes in one RPC
+    uint32_t                                        length;
+    boolean_t                                       full;                           // no more pieces go into this one
+    struct lustre_osc_extent                        extents[kLustreIOExtentsMax];   // in the object
+    uint32_t                                        extent_count;
+    struct lustre_request_segment                   segments[kLustreIOSegmentsMax]; // in the caller's buffer
+    uint32_t                                        segment_count;
+};
+
+// One read of a file range, split into RPCs.
+struct lustre_io {
+    OSMallocTag                                     malloc_tag;
+    struct lustre_layout *                          layout;                         // with a reference
+    lustre_io_callback                              callback;
+    void *                                          callback_data;
+    struct lustre_io_rpc *                          rpcs;                           // never moved once the first is sent
+    uint32_t                                        rpc_count;
+    uint32_t                                        rpc_capacity;
+    volatile SInt32                                 outstanding;                    // RPCs not yet completed, plus one until all are sent
+    volatile SInt32                                 error;                          // first error from any RPC
+};
+
+// One read or write of a file kept on its MDT (Data-on-MDT).  The object is the file itself, named by its FID, and the whole range goes
+// in one RPC, as the MDT's part of a file is never bigger than one.
+struct lustre_io_dom {
+    OSMallocTag                                     malloc_tag;
+    boolean_t                                       write;
+    struct lustre_request_segment                   segment;                        // the caller's buffer
+    lustre_io_callback                              callback;
+    void *                                          callback_data;
+};
+
+#pragma mark - Internal
+
+static void lustre_io_free(struct lustre_io * io)
+{
+    uint32_t i;
+
+    for (i=0; i<io->rpc_count; i++) {
+        if (io->rpcs[i].import) {
+            lustre_import_ref_count_dec(io->rpcs[i].import);
+        }
+    }
+    if (io->rpcs) {
+        OSFree(io->rpcs, io->rpc_capacity * sizeof(struct lustre_io_rpc), io->malloc_tag);
+    }
+    lustre_layout_ref_count_dec(io->layout);
+
+    OSFree(io, sizeof(struct lustre_io), io->malloc_tag);
+}
+
+static void lustre_io_set_error(struct lustre_io * io, errno_t error)
+{
+    (void)OSCompareAndSwap(0, (UInt32)error, (volatile UInt32 *)&io->error);
+}
+
+// Drops one of io's outstanding counts; the last one reports to the caller and frees it.
+static void lustre_io_release(struct lustre_io * io)
+{
+    if (OSDecrementAtomic(&io->outstanding) == 1) {
+        io->callback(io->error, io->callback_data);
+        lustre_io_free(io);
+    }
+}
+
+// Starts another RPC for stripe.  Every RPC for the same object shares one import reference lookup; the first one waits for the OST to
+// be connected.
+static errno_t lustre_io_rpc_add(struct lustre_volume * volume, struct lustre_io * io, uint32_t stripe, struct lustre_io_rpc ** result)
+{
+    struct lustre_io_rpc *  rpcs;
+    struct lustre_io_rpc *  rpc;
+    struct lustre_import *  import;
+    uint32_t                capacity;
+    uint32_t                i;
+    errno_t                 error;
+
+    import = NULL;
+    for (i=io->rpc_count; i>0; i--) {
+        if (io->rpcs[i-1].stripe == stripe) {
+            import = io->rpcs[i-1].import;
+            lustre_import_ref_count_inc(import);
+            break;
+        }
+    }
+    if (!import) {
+        error = lustre_volume_ost_import(volume, io->layout->objects[stripe].ost_index, &import);
+        if (error != 0) {
+            return error;
+        }
+    }
+
+    if (io->rpc_count == io->rpc_capacity) {
+        capacity    = (io->rpc_capacity == 0) ? kLustreIORPCsInitial : io->rpc_capacity * 2;
+        rpcs        = OSMalloc(capacity * sizeof(struct lustre_io_rpc), io->malloc_tag);
+        if (!rpcs) {
+            lustre_import_ref_count_dec(import);
+            return ENOMEM;
+        }
+        if (io->rpcs) {
+            memcpy(rpcs, io->rpcs, io->rpc_count * sizeof(struct lustre_io_rpc));
+            OSFree(io->rpcs, io->rpc_capacity * sizeof(struct lustre_io_rpc), io->malloc_tag);
+        }
+        io->rpcs            = rpcs;
+        io->rpc_capacity    = capacity;
+    }
+
+    rpc = &io->rpcs[io->rpc_count];
+    io->rpc_count += 1;
+
+    bzero(rpc, sizeof(struct lustre_io_rpc));
+    rpc->io         = io;
+    rpc->import     = import;
+    rpc->stripe     = stripe;
+    rpc->brw_size   = lustre_import_brw_size(import);
+
+    *result = rpc;
+
+    return 0;
+}
+
+// Cuts [offset, offset + length) into pieces that each stay within one stripe unit and gathers them into RPCs by object.  Pieces of the
+// same object that touch in the object become one extent, and pieces that touch in the buffer one segment, so a file with a single
+// stripe reads a whole cluster with one extent and one segment.
+static errno_t lustre_io_plan(struct lustre_volume * volume, struct lustre_io * io, uint64_t offset, uint8_t * data, uint32_t length)
+{
+    struct lustre_io_rpc *          rpc;
+    struct lustre_osc_extent *      extent;
+    struct lustre_request_segment * segment;
+    uint64_t                        object_offset;
+    uint32_t                        stripe;
+    uint32_t                        run;
+    uint32_t                        piece;
+    uint32_t                        done;
+    uint32_t                        i;
+    errno_t                         error;
+
+    for (done=0; done<length; done+=piece) {
+        lustre_layout_map(io->layout, offset + done, &stripe, &object_offset, &run);
+
+        rpc = NULL;
+        for (i=io->rpc_count; i>0; i--) {
+            if ((io->rpcs[i-1].stripe == stripe) && !io->rpcs[i-1].full) {
+                rpc = &io->rpcs[i-1];
+                break;
+            }
+        }
+        if (rpc && ((rpc->length == rpc->brw_size) || (rpc->extent_count == kLustreIOExtentsMax) || (rpc->segment_count == kLustreIOSegmentsMax))) {
+            rpc->full   = TRUE;
+            rpc         = NULL;
+        }
+        if (!rpc) {
+            error = lustre_io_rpc_add(volume, io, stripe, &rpc);
+            if (error != 0) {
+                return error;
+            }
+        }
+
+        piece = MIN(MIN(run, length - done), rpc->brw_size - rpc->length);
+
+        extent = (rpc->extent_count > 0) ? &rpc->extents[rpc->extent_count - 1] : NULL;
+        if (extent && (extent->offset + extent->length == object_offset)) {
+            extent->length += piece;
+        } else {
+            rpc->extents[rpc->extent_count] = (struct lustre_osc_extent){ object_offset, piece };
+            rpc->extent_count += 1;
+        }
+
+        segment = (rpc->segment_count > 0) ? &rpc->segments[rpc->segment_count - 1] : NULL;
+        if (segment && ((uint8_t *)segment->data + segment->length == data + done)) {
+            segment->length += piece;
+        } else {
+            rpc->segments[rpc->segment_count] = (struct lustre_request_segment){ data + done, piece };
+            rpc->segment_count += 1;
+        }
+
+        rpc->length += piece;
+    }
+
+    return 0;
+}
+
+// Runs on the network layer's completion path.  Whatever didn't arrive lies past the end of the object, which reads as zeroes: either a
+// hole or beyond the end of the file.
+static void lustre_io_read_complete(struct lustre_request * request, void * data)
+{
+    struct lustre_io_rpc *          rpc;
+    struct lustre_request_segment * segment;
+    uint32_t                        transferred;
+    uint32_t                        i;
+    errno_t                         error;
+
+    rpc = (struct lustre_io_rpc *)data;
+
+    error = lustre_osc_read_interpret(request, &transferred);
+    if (error == 0) {
+        for (i=0; i<rpc->segment_count; i++) {
+            segment = &rpc->segments[i];
+            if (transferred >= segment->length) {
+                transferred -= segment->length;
+            } else {
+                bzero((uint8_t *)segment->data + transferred, segment->length - transferred);
+                transferred = 0;
+            }
+        }
+    } else {
+        lustre_io_set_error(rpc->io, error);
+    }
+
+    lustre_io_release(rpc->io);
+}
+
+// Gets the sizes of all of a file's objects at once and works out the file's size from them (see glimpse.h).
+static errno_t lustre_io_object_attrs(struct lustre_node * node, struct lustre_layout * layout, struct lustre_node_attr * attr)
+{
+    struct lustre_glimpse * glimpse;
+
+    glimpse = lustre_node_glimpse(node);
+    if (!glimpse) {
+        return ENOMEM;
+    }
+
+    return lustre_glimpse_attrs(glimpse, layout, attr);
+}
+
+static void lustre_io_strategy_done(errno_t error, void * data)
+{
+    buf_t buf;
+
+    buf = (buf_t)data;
+
+    (void)buf_unmap(buf);
+    if (error != 0) {
+        buf_seterror(buf, error);
+        buf_setresid(buf, buf_count(buf));
+    }
+    buf_biodone(buf);
+}
+
+// Runs on the network layer's completion path.  As with objects, a short read stopped at the end of the file.
+static void lustre_io_dom_complete(struct lustre_request * request, void * data)
+{
+    struct lustre_io_dom *  dom;
+    uint32_t                transferred;
+    errno_t                 error;
+
+    dom = (struct lustre_io_dom *)data;
+
+    if (dom->write) {
+        error = lustre_osc_write_interpret(request);
+    } else {
+        error = lustre_osc_read_interpret(request, &transferred);
+        if ((error == 0) && (transferred < dom->segment.length)) {
+            bzero((uint8_t *)dom->segment.data + transferred, dom->segment.length - transferred);
+        }
+    }
+
+    dom->callback(error, dom->callback_data);
+
+    OSFree(dom, sizeof(struct lustre_io_dom), dom->malloc_tag);
+}
+
+// Reads or writes [offset, offset + length) of node, whose layout keeps its data on the MDT, with the same bulk RPCs an OST takes.  The
+// range must lie within the MDT's part of the file.  Returns an error only if nothing was sent; otherwise callback runs exactly once.
+static errno_t lustre_io_dom_async(struct lustre_volume * volume, struct lustre_node * node, boolean_t write, uint64_t offset, void * data, uint32_t length, lustre_io_callback callback, void * callback_data)
+{
+    struct lustre_io_dom *      dom;
+    struct lustre_import *      import;
+    struct lustre_request *     request;
+    struct lustre_osc_extent    extent;
+    struct ost_id               oi;
+    errno_t                     error;
+
+    error = lustre_volume_fid_import(volume, &node->fid, &import);
+    if (error != 0) {
+        return error;
+    }
+
+    dom = OSMalloc(sizeof(struct lustre_io_dom), volume->malloc_tag);
+    if (!dom) {
+        lustre_import_ref_count_dec(import);
+        return ENOMEM;
+    }
+
+    dom->malloc_tag     = volume->malloc_tag;
+    dom->write          = write;
+    dom->segment        = (struct lustre_request_segment){ data, length };
+    dom->callback       = callback;
+    dom->callback_data  = callback_data;
+
+    bzero(&oi, sizeof(oi));
+    oi.oi_fid   = node->fid;
+    extent      = (struct lustre_osc_extent){ offset, length };
+
+    if (write) {
+        error = lustre_osc_write_prepare(import, &oi, &extent, 1, &dom->segment, 1, &request);
+    } else {
+        error = lustre_osc_read_prepare(import, &oi, &extent, 1, &dom->segment, 1, &request);
+    }
+    lustre_import_ref_count_dec(import);
+    if (error != 0) {
+        OSFree(dom, sizeof(struct lustre_io_dom), volume->malloc_tag);
+        return error;
+    }
+
+    lustre_request_set_callback(request, lustre_io_dom_complete, dom);
+
+    // A failure to send completes the request, so the callback has already heard about it.
+
+    (void)lustre_request_send_async(request);
+    lustre_request_ref_count_dec(request);
+
+    return 0;
+}
+
+// lustre_io_strategy for a file kept on the MDT.  Writes aren't held for the writeback: lustre_vnop_write makes them synchronous, and
+// the MDT takes each in one RPC anyway.  Nothing lies past the MDT's part of the file until the file grows objects, so reads there are
+// zeroes and writes there (which lustre_vnop_write refuses) fail.
+static void lustre_io_strategy_dom(struct lustre_volume * volume, struct lustre_node * node, struct lustre_layout * layout, buf_t buf, uint64_t offset, caddr_t data, uint32_t length)
+{
+    uint32_t    within;
+    errno_t     error;
+
+    within = (offset < layout->dom_size) ? (uint32_t)MIN((uint64_t)length, layout->dom_size - offset) : 0;
+
+    if (!(buf_flags(buf) & B_READ)) {
+        error = (within == length) ? lustre_io_dom_async(volume, node, TRUE, offset, data, length, lustre_io_strategy_done, buf) : EFBIG;
+    } else if (within == 0) {
+        bzero(data, length);
+        lustre_io_strategy_done(0, buf);
+        return;
+    } else {
+        bzero(data + within, length - within);
+        error = lustre_io_dom_async(volume, node, FALSE, offset, data, within, lustre_io_strategy_done, buf);
+    }
+
+    if (error != 0) {
+        lustre_io_strategy_done(error, buf);
+    }
+}
+
+// Brings the UBC into line with the node's attributes: pages cached from an older version of the file (one with a different modify time
+// or size) are thrown away, and the UBC's idea of the size is updated.
+static void lustre_io_sync_ubc(struct lustre_node * node, vnode_t vnode)
+{
+    struct lustre_node_attr attr;
+
+    attr = lustre_node_get_attr(node);
+
+    if (lustre_node_data_changed(node, &attr)) {
+        (void)ubc_msync(vnode, 0, ubc_getsize(vnode), NULL, UBC_INVALIDATE);
+    }
+    if (ubc_getsize(vnode) != (off_t)attr.size) {
+        (void)ubc_setsize(vnode, (off_t)attr.size);
+    }
+}
+
+// Puts data an open reply carried into whichever of its pages the UBC doesn't have yet, so reading them costs nothing.  Pages the UBC
+// already has are as current, since lustre_io_sync_ubc has just thrown out any that weren't.
+static void lustre_io_fill(vnode_t vnode, uint64_t offset, const void * data, uint32_t length)
+{
+    upl_t               upl;
+    upl_page_info_t *   pl;
+    vm_offset_t         address;
+    uint32_t            size;
+    uint32_t            piece;
+    uint32_t            i;
+
+    if ((offset % PAGE_SIZE) != 0) {
+        return;
+    }
+
+    size = (uint32_t)round_page_32(length);
+
+    if (ubc_create_upl(vnode, (off_t)offset, (int)size, &upl, &pl, UPL_UBC_PAGEIN | UPL_RET_ONLY_ABSENT) != KERN_SUCCESS) {
+        return;
+    }
+    if (ubc_upl_map(upl, &address) != KERN_SUCCESS) {
+        (void)ubc_upl_abort_range(upl, 0, size, UPL_ABORT_FREE_ON_EMPTY);
+        return;
+    }
+
+    for (i=0; i<size/PAGE_SIZE; i++) {
+        if (!upl_page_present(pl, (int)i)) {
+            continue;
+        }
+        piece = MIN(PAGE_SIZE, length - i * PAGE_SIZE);
+        memcpy((uint8_t *)address + i * PAGE_SIZE, (const uint8_t *)data + i * PAGE_SIZE, piece);
+        bzero((uint8_t *)address + i * PAGE_SIZE + piece, PAGE_SIZE - piece);
+    }
+
+    (void)ubc_upl_unmap(upl);
+    (void)ubc_upl_commit_range(upl, 0, size, UPL_COMMIT_FREE_ON_EMPTY | UPL_COMMIT_CLEAR_DIRTY);
+}
+
+#pragma mark - External
+
+// Fetches the file's layout and current attributes: the rest from the MDT, the size, blocks and modify time from its objects, which is
+// the only place they're current.  Done on open, so each open sees what was written before it (close-to-open consistency).
+errno_t lustre_io_refresh(struct lustre_volume * volume, struct lustre_node * node)
+{
+    struct lustre_import *      import;
+    struct lustre_layout *      layout;
+    struct lustre_node_attr     attr;
+    struct mdt_body             body;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(node->type != VREG);
+
+    error = lustre_volume_fid_import(volume, &node->fid, &import);
+    if (error != 0) {
+        return error;
+    }
+
+    error = lustre_mdc_getattr_layout(import, &node->fid, volume->malloc_tag, &body, &layout);
+    lustre_import_ref_count_dec(import);
+    if (error != 0) {
+        if (error == ENOTSUP) {
+            os_log_error(lustre_logger_vfs, "Layout of [0x%llx:0x%x:0x%x] isn't supported", node->fid.f_seq, node->fid.f_oid, node->fid.f_ver);
+        }
+        return error;
+    }
+
+    lustre_node_attr_from_body(&attr, &body);
+
+    if (layout && (layout->object_count > 0)) {
+        error = lustre_io_object_attrs(node, layout, &attr);
+        if (error != 0) {
+            lustre_layout_ref_count_dec(layout);
+            return error;
+        }
+    }
+
+    lustre_node_set_layout(node, layout, &attr);
+
+    return 0;
+}
+
+// As lustre_io_refresh, for the size, blocks and modify time only, when the rest of the attributes are known to be current: no MDT RPC,
+// and no OST RPC either for objects whose glimpse lock we still hold.
+errno_t lustre_io_glimpse(struct lustre_volume * volume, struct lustre_node * node)
+{
+    struct lustre_layout *      layout;
+    struct lustre_node_attr     attr;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(node->type != VREG);
+
+    layout = lustre_node_layout(node);
+    if (!layout) {
+        return lustre_io_refresh(volume, node);
+    }
+
+    error = 0;
+    if (layout->object_count > 0) {
+        attr    = lustre_node_get_attr(node);
+        error   = lustre_io_object_attrs(node, layout, &attr);
+        if (error == 0) {
+            lustre_node_set_size(node, &attr);
+        }
+    }
+
+    lustre_layout_ref_count_dec(layout);
+
+    return error;
+}
+
+// Fetches extent maps for a file that looks sparse, going by its blocks falling short of its size, so lustre_io_hole can answer for its
+// holes (see glimpse.h).  Files that don't look sparse cost nothing.
+errno_t lustre_io_extents(struct lustre_volume * volume, struct lustre_node * node)
+{
+    struct lustre_layout *      layout;
+    struct lustre_glimpse *     glimpse;
+    struct lustre_node_attr     attr;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(node->type != VREG);
+
+    attr = lustre_node_get_attr(node);
+    if (attr.blocks * 512 >= attr.size) {
+        return 0;
+    }
+
+    layout = lustre_node_layout(node);
+    if (!layout) {
+        return 0;
+    }
+
+    error = 0;
+    if (layout->object_count > 0) {
+        glimpse = lustre_node_glimpse(node);
+        error   = glimpse ? lustre_glimpse_extents(glimpse, layout) : ENOMEM;
+    }
+
+    lustre_layout_ref_count_dec(layout);
+
+    return error;
+}
+
+// Whether the file is known to have a hole at offset, which must be block aligned, for a read of length bytes: *run is set to how much of
+// the read is hole, or else how much is data, in whole blocks.  Never waits for the network, so only maps already fetched are used.
+boolean_t lustre_io_hole(struct lustre_node * node, uint64_t offset, uint64_t length, uint64_t * run)
+{
+    struct lustre_layout *      layout;
+    struct lustre_glimpse *     glimpse;
+    uint64_t                    next;
+    boolean_t                   hole;
+
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!run);
+
+    *run    = length;
+    hole    = FALSE;
+
+    layout = lustre_node_layout(node);
+    if (!layout) {
+        return FALSE;
+    }
+
+    glimpse = (layout->object_count > 0) ? lustre_node_glimpse(node) : NULL;
+    if (glimpse) {
+        next = lustre_glimpse_next(glimpse, layout, offset, TRUE);
+        if (next > offset) {
+            // A hole that doesn't cover a whole block is read like data.
+
+            next = (next == UINT64_MAX) ? length : (next - offset) / kLustreIOBlockSize * kLustreIOBlockSize;
+            if (next > 0) {
+                *run    = MIN(next, length);
+                hole    = TRUE;
+            }
+        }
+        if (!hole) {
+            next = lustre_glimpse_next(glimpse, layout, offset, FALSE);
+            if (next != UINT64_MAX) {
+                *run = MIN(MAX(roundup(next - offset, kLustreIOBlockSize), kLustreIOBlockSize), length);
+            }
+        }
+    }
+
+    lustre_layout_ref_count_dec(layout);
+
+    return hole;
+}
+
+// Answers SEEK_HOLE (hole TRUE) or SEEK_DATA for the file from *offset, leaving the answer there.  Our dirty data is written out first
+// and the size and maps brought up to date, so the answer holds for what has been written so far.  Where the maps don't say, the file is
+// data up to its end, which is always a hole; past the end is ENXIO.
+errno_t lustre_io_seek(struct lustre_volume * volume, struct lustre_node * node, vnode_t vnode, boolean_t hole, off_t * offset)
+{
+    struct lustre_layout *      layout;
+    struct lustre_glimpse *     glimpse;
+    struct lustre_node_attr     attr;
+    uint64_t                    next;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!vnode);
+    LUSTRE_BUG_ON(!offset);
+
+    if (*offset < 0) {
+        return ENXIO;
+    }
+
+    lustre_writeback_flush(volume->writeback, node, vnode);
+
+    error = lustre_io_glimpse(volume, node);
+    if (error == 0) {
+        error = lustre_io_extents(volume, node);
+    }
+    if (error != 0) {
+        return error;
+    }
+
+    attr = lustre_node_get_attr(node);
+    if ((uint64_t)*offset >= attr.size) {
+        return ENXIO;
+    }
+
+    next = hole ? UINT64_MAX : (uint64_t)*offset;
+
+    layout = lustre_node_layout(node);
+    if (layout && (layout->object_count > 0)) {
+        glimpse = lustre_node_glimpse(node);
+        if (glimpse) {
+            next = lustre_glimpse_next(glimpse, layout, (uint64_t)*offset, !hole);
+        }
+    }
+    if (layout) {
+        lustre_layout_ref_count_dec(layout);
+    }
+
+    if (hole) {
+        next = MIN(next, attr.size);
+    } else if (next >= attr.size) {
+        return ENXIO;
+    }
+
+    *offset = (off_t)next;
+
+    return 0;
+}
+
+// Writes back anything dirty, refreshes the file as lustre_io_refresh does and brings the UBC into line: pages cached from an older version of the file (one with a
+// different modify time or size) are thrown away, and the UBC's idea of the size is updated.
+errno_t lustre_io_revalidate(struct lustre_volume * volume, struct lustre_node * node, vnode_t vnode)
+{
+    errno_t error;
+
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!vnode);
+
+    // Whatever we have written has to reach the OSTs first, or the size they report would cut it off.
+
+    lustre_writeback_flush(volume->writeback, node, vnode);
+
+    error = lustre_io_refresh(volume, node);
+    if (error != 0) {
+        return error;
+    }
+
+    lustre_io_sync_ubc(node, vnode);
+
+    return 0;
+}
+
+// Throws out the file's cached pages that live on one of its objects, which someone else is about to write, getting anything dirty
+// written first.  Called from that object's glimpse lock revoke, which reclaim waits for, so the node's vnode stays usable until we
+// return.  A file with one object, or with more stripe units on the object than are worth a call each, is thrown out whole.
+void lustre_io_invalidate_stripe(struct lustre_node * node, uint32_t stripe, uint32_t stripe_size, uint32_t stripe_count)
+{
+    vnode_t     vnode;
+    off_t       size;
+    off_t       width;
+    off_t       offset;
+    int         flags;
+
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON((stripe_count > 0) && (stripe >= stripe_count));
+
+    vnode = lustre_node_vnode(node);
+    if (!vnode) {
+        return;
+    }
+
+    lustre_writeback_flush(node->volume->writeback, node, vnode);
+
+    flags   = UBC_PUSHDIRTY | UBC_SYNC | UBC_INVALIDATE;
+    size    = (off_t)round_page_64(ubc_getsize(vnode));
+    width   = (off_t)stripe_size * stripe_count;
+
+    if ((stripe_count <= 1) || (stripe_size == 0) || (size / width >= kLustreIOInvalidateUnitsMax)) {
+        (void)ubc_msync(vnode, 0, size, NULL, flags);
+        return;
+    }
+
+    for (offset = (off_t)stripe * stripe_size; offset < size; offset += width) {
+        (void)ubc_msync(vnode, offset, MIN(offset + (off_t)stripe_size, size), NULL, flags);
+    }
+}
+
+// As lustre_io_revalidate, with the attributes and layout an open's reply just brought instead of asking the MDT again.  Data that came
+// inline with the reply goes straight into the UBC, so a small file kept on the MDT is read without another RPC.
+errno_t lustre_io_opened(struct lustre_volume * volume, struct lustre_node * node, vnode_t vnode, const struct lustre_mdc_open_reply * reply)
+{
+    struct lustre_layout *      layout;
+    struct lustre_node_attr     attr;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!vnode);
+    LUSTRE_BUG_ON(!reply);
+
+    lustre_writeback_flush(volume->writeback, node, vnode);
+
+    lustre_node_attr_from_body(&attr, &reply->body);
+
+    layout = reply->layout;
+    if (layout) {
+        lustre_layout_ref_count_inc(layout);
+    }
+
+    if (layout && (layout->object_count > 0)) {
+        error = lustre_io_object_attrs(node, layout, &attr);
+        if (error != 0) {
+            lustre_layout_ref_count_dec(layout);
+            return error;
+        }
+    }
+
+    lustre_node_set_layout(node, layout, &attr);
+
+    lustre_io_sync_ubc(node, vnode);
+
+    if (reply->data && layout && (layout->dom_size > 0) && (reply->data_offset < attr.size)) {
+        lustre_io_fill(vnode, reply->data_offset, reply->data, (uint32_t)MIN((uint64_t)reply->data_length, attr.size - reply->data_offset));
+    }
+
+    return 0;
+}
+
+// Reads [offset, offset + length) of the file with layout into data.  Returns an error only if nothing was sent; otherwise callback runs
+// exactly once, from the network layer's completion path, after the last RPC completes.  layout must have objects.
+errno_t lustre_io_read_async(struct lustre_volume * volume, struct lustre_layout * layout, uint64_t offset, void * data, uint32_t length, lustre_io_callback callback, void * callback_data)
+{
+    struct lustre_io *          io;
+    struct lustre_io_rpc *      rpc;
+    struct lustre_request *     request;
+    uint32_t                    i;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!layout);
+    LUSTRE_BUG_ON(layout->object_count == 0);
+    LUSTRE_BUG_ON(!data);
+    LUSTRE_BUG_ON(length == 0);
+    LUSTRE_BUG_ON(!callback);
+
+    io = OSMalloc(sizeof(struct lustre_io), volume->malloc_tag);
+    if (!io) {
+        return ENOMEM;
+    }
+
+    bzero(io, sizeof(struct lustre_io));
+
+    lustre_layout_ref_count_inc(layout);
+
+    io->malloc_tag      = volume->malloc_tag;
+    io->layout          = layout;
+    io->callback        = callback;
+    io->callback_data   = callback_data;
+
+    error = lustre_io_plan(volume, io, offset, (uint8_t *)data, length);
+    if (error != 0) {
+        lustre_io_free(io);
+        return error;
+    }
+
+    // Every RPC goes out before any reply is waited for.  The extra count keeps io alive until the last one is sent, however quickly
+    // the others complete.
+
+    io->outstanding = io->rpc_count + 1;
+
+    for (i=0; i<io->rpc_count; i++) {
+        rpc = &io->rpcs[i];
+
+        error = lustre_osc_read_prepare(rpc->import, &layout->objects[rpc->stripe].oi, rpc->extents, rpc->extent_count, rpc->segments, rpc->segment_count, &request);
+        if (error != 0) {
+            lustre_io_set_error(io, error);
+            lustre_io_release(io);
+            continue;
+        }
+
+        lustre_request_set_callback(request, lustre_io_read_complete, rpc);
+
+        // A failure to send completes the request, so the callback has already heard about it.
+
+        (void)lustre_request_send_async(request);
+        lustre_request_ref_count_dec(request);
+    }
+
+    lustre_io_release(io);
+
+    return 0;
+}
+
+// Whether a read or write should bypass the UBC.  Callers ask with F_NOCACHE (IO_NOCACHE); besides that, transfers big enough that
+// caching them would only evict everything else, and aligned well enough for the cluster layer to do them directly, bypass it anyway.
+// Either way the cluster layer wires the caller's pages and hands them to lustre_io_strategy in bufs of up to a cluster, so the data
+// goes between the network and the caller's memory without being copied, and it does any unaligned head or tail through the UBC.
+boolean_t lustre_io_is_direct(uio_t uio, int ioflag)
+{
+    LUSTRE_BUG_ON(!uio);
+
+    if (ioflag & IO_NOCACHE) {
+        return TRUE;
+    }
+
+    return uio_isuserspace(uio) && (uio_resid(uio) >= kLustreIODirectMin) && ((uio_offset(uio) & PAGE_MASK) == 0) &&
+           ((uio_resid(uio) & PAGE_MASK) == 0) && ((uio_curriovbase(uio) & PAGE_MASK) == 0);
+}
+
+// Reads the pages of a page fault at [offset, offset + size) in.  Rather than just the pages the VM asked for, it reads the whole stripe
+// around them (up to kLustreIOPageinMax), which is one RPC to one object, and then the next cluster of the file is ours to fill before
+// anything faults on it.  Faults that keep arriving just past what the last ones read in are sequential, and get the clusters after
+// theirs read ahead too, twice as many each time up to kLustreIOPageinAheadMax.  Pages already resident are left alone.
+errno_t lustre_io_pagein(struct lustre_node * node, vnode_t vnode, const struct lustre_layout * layout, off_t offset, size_t size, off_t filesize, int flags)
+{
+    upl_t               upl;
+    upl_page_info_t *   pl;
+    off_t               unit;
+    off_t               start;
+    off_t               end;
+    off_t               ahead;
+    uint32_t            pages;
+    uint32_t            first;
+    uint32_t            i;
+    boolean_t           sequential;
+    boolean_t           issued;
+    errno_t             error;
+    errno_t             result;
+
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!vnode);
+    LUSTRE_BUG_ON(size == 0);
+
+    // The cluster: whole stripes, page aligned, clipped to the file (but never short of what the VM asked for).
+
+    unit = PAGE_SIZE;
+    if (layout && (layout->object_count > 0)) {
+        unit = MAX(MIN((off_t)layout->stripe_size, (off_t)kLustreIOPageinMax), (off_t)PAGE_SIZE);
+        unit = unit - (unit % PAGE_SIZE);
+    } else if (layout && (layout->dom_size > 0)) {
+        unit = round_page_64(MIN((off_t)layout->dom_size, (off_t)kLustreIOPageinMax));
+    }
+
+    start   = offset - (offset % unit);
+    end     = roundup(offset + (off_t)size, unit);
+    end     = MIN(end, round_page_64(filesize));
+    end     = MAX(end, offset + (off_t)size);
+
+    lck_mtx_lock(node->lock);
+    sequential = (start != 0) && (start == (off_t)node->pagein_next);
+    if (sequential) {
+        node->pagein_ahead = MIN(MAX(node->pagein_ahead * 2, 1), kLustreIOPageinAheadMax);
+    } else {
+        node->pagein_ahead = 0;
+    }
+    ahead               = (off_t)node->pagein_ahead * unit;
+    node->pagein_next   = (uint64_t)(end + ahead);
+    lck_mtx_unlock(node->lock);
+
+    if (ubc_create_upl(vnode, start, (int)(end - start), &upl, &pl, UPL_UBC_PAGEIN | UPL_RET_ONLY_ABSENT) != KERN_SUCCESS) {
+        return EINVAL;
+    }
+
+    // Every run of absent pages is one cluster_pagein, which commits or aborts its own pages (freeing the UPL with the last of them);
+    // normally the run is the whole cluster.  If every page turned up in the meantime, the UPL is ours to throw away.
+
+    result  = 0;
+    issued  = FALSE;
+    pages   = (uint32_t)((end - start) / PAGE_SIZE);
+    i       = 0;
+    while (i < pages) {
+        for (; (i < pages) && !upl_page_present(pl, (int)i); i++) {
+        }
+        if (i == pages) {
+            break;
+        }
+        first = i;
+        for (; (i < pages) && upl_page_present(pl, (int)i); i++) {
+        }
+
+        error = cluster_pagein(vnode, upl, (upl_offset_t)(first * PAGE_SIZE), start + (off_t)first * PAGE_SIZE, (int)((i - first) * PAGE_SIZE), filesize, flags & ~UPL_NOCOMMIT);
+        issued = TRUE;
+
+        // Only failing to read the pages the VM asked for fails the fault.
+
+        if ((error != 0) && (result == 0) && (start + (off_t)i * PAGE_SIZE > offset) && (start + (off_t)first * PAGE_SIZE < offset + (off_t)size)) {
+            result = error;
+        }
+    }
+    if (!issued) {
+        (void)ubc_upl_abort_range(upl, 0, (upl_size_t)(end - start), UPL_ABORT_FREE_ON_EMPTY);
+    }
+
+    if ((ahead > 0) && (end < filesize)) {
+        (void)advisory_read(vnode, filesize, end, (int)MIN(ahead, filesize - end));
+    }
+
+    return result;
+}
+
+// Does a buf's I/O for the cluster layer.  Its block number is in kLustreIOBlockSize units of file offset (see lustre_vnop_blockmap).
+// Reads go straight out; writes are handed to the writeback, which may hold them a while to fill out RPCs, but not if the buf is
+// synchronous (as msync's is, when the caller waits) or direct I/O's (B_PHYS), whose pages are the caller's, wired for the call.  The VM's
+// own pageouts are async and held like the cluster layer's writes, so the scattered dirty pages of a mapping still go out in full RPCs,
+// a flusher tick later at most.  The buf completes on the network layer's completion path once every piece is done, or here if the I/O couldn't be started.
+void lustre_io_strategy(struct lustre_volume * volume, struct lustre_node * node, buf_t buf)
+{
+    struct lustre_layout *  layout;
+    caddr_t                 data;
+    uint64_t                offset;
+    uint32_t                length;
+    errno_t                 error;
+
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!buf);
+
+    offset  = (uint64_t)buf_blkno(buf) * kLustreIOBlockSize;
+    length  = buf_count(buf);
+
+    error = buf_map(buf, &data);
+    if (error != 0) {
+        buf_seterror(buf, error);
+        buf_setresid(buf, length);
+        buf_biodone(buf);
+        return;
+    }
+
+    layout = lustre_node_layout(node);
+    if (!layout) {
+        error = lustre_io_refresh(volume, node);
+        if (error == 0) {
+            layout = lustre_node_layout(node);
+        }
+    }
+
+    if (error != 0) {
+        lustre_io_strategy_done(error, buf);
+    } else if (layout && (layout->object_count == 0) && (layout->dom_size > 0)) {
+        lustre_io_strategy_dom(volume, node, layout, buf, offset, data, length);
+    } else if (!(buf_flags(buf) & B_READ)) {
+        if (!layout || (layout->object_count == 0)) {
+            lustre_io_strategy_done(ENOTSUP, buf);
+        } else {
+            lustre_writeback_add(volume->writeback, node, layout, offset, data, length, !(buf_flags(buf) & B_ASYNC) || (buf_flags(buf) & B_PHYS), lustre_io_strategy_done, buf);
+        }
+    } else if (!layout || (layout->object_count == 0)) {
+        bzero(data, length);
+        lustre_io_strategy_done(0, buf);
+    } else {
+        error = lustre_io_read_async(volume, layout, offset, data, length, lustre_io_strategy_done, buf);
+        if (error != 0) {
+            lustre_io_strategy_done(error, buf);
+        }
+    }
+
+    if (layout) {
+        lustre_layout_ref_count_dec(layout);
+    }
+}
@@ -0,0 +1,66 @@
+//
+//  io.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// File data.  Reads come down from the UBC cluster layer as bufs covering whole clusters; each is cut at stripe boundaries and turned into
+// one bulk read per object (more only when a piece is bigger than the OST takes in one RPC), all sent before any reply is waited for.  The
+// cluster layer keeps several clusters in flight when reading ahead, so a sequential reader keeps every object of the file busy.  Writes
+// take the same route down and are then gathered into RPCs by the writeback (see writeback.h).  Direct I/O (see lustre_io_is_direct)
+// takes it too, in bufs mapping the caller's own wired pages, and goes straight out.  Page faults on mapped files read whole stripes at a
+// time (see lustre_io_pagein), and the VM's pageouts are bufs like any other write.  Small files kept on the MDT (Data-on-MDT) read and
+// write through the MDT instead, and usually arrive with the open (see lustre_io_opened).
+
+#ifndef lustre_io_h
+#define lustre_io_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <sys/buf.h>
+#include <sys/vnode.h>
+
+static const uint32_t   kLustreIOBlockSize                  = 4096;             // unit of buf block numbers, see lustre_vnop_blockmap
+static const uint32_t   kLustreIOClusterMin                 = 4 * 1024 * 1024;  // one full-sized RPC
+static const uint32_t   kLustreIOClusterMax                 = 16 * 1024 * 1024;
+static const uint32_t   kLustreIODirectMin                  = 64 * 1024 * 1024; // aligned transfers at least this big bypass the UBC
+static const uint32_t   kLustreIOPageinMax                  = 4 * 1024 * 1024;  // biggest cluster a page fault reads
+static const uint32_t   kLustreIOPageinAheadMax             = 8;                // clusters prefetched ahead of sequential faults
+static const uint32_t   kLustreIOInvalidateUnitsMax         = 1024;             // stripe units dropped one by one; past this, the whole file
+
+struct lustre_volume;
+struct lustre_node;
+struct lustre_layout;
+struct lustre_mdc_open_reply;
+
+typedef void (* lustre_io_callback)(errno_t error, void * data);
+
+errno_t                 lustre_io_refresh(struct lustre_volume * volume, struct lustre_node * node);
+errno_t                 lustre_io_glimpse(struct lustre_volume * volume, struct lustre_node * node);
+errno_t                 lustre_io_extents(struct lustre_volume * volume, struct lustre_node * node);
+boolean_t               lustre_io_hole(struct lustre_node * node, uint64_t offset, uint64_t length, uint64_t * run);
+errno_t                 lustre_io_seek(struct lustre_volume * volume, struct lustre_node * node, vnode_t vnode, boolean_t hole, off_t * offset);
+errno_t                 lustre_io_revalidate(struct lustre_volume * volume, struct lustre_node * node, vnode_t vnode);
+void                    lustre_io_invalidate_stripe(struct lustre_node * node, uint32_t stripe, uint32_t stripe_size, uint32_t stripe_count);
+errno_t                 lustre_io_opened(struct lustre_volume * volume, struct lustre_node * node, vnode_t vnode, const struct lustre_mdc_open_reply * reply);
+errno_t                 lustre_io_read_async(struct lustre_volume * volume, struct lustre_layout * layout, uint64_t offset, void * data, uint32_t length, lustre_io_callback callback, void * callback_data);
+boolean_t               lustre_io_is_direct(uio_t uio, int ioflag);
+errno_t                 lustre_io_pagein(struct lustre_node * node, vnode_t vnode, const struct lustre_layout * layout, off_t offset, size_t size, off_t filesize, int flags);
+void                    lustre_io_strategy(struct lustre_volume * volume, struct lustre_node * node, buf_t buf);
+
+#endif /* lustre_io_h */
@@ -0,0 +1,270 @@
+//
+//  layout.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <libkern/libkern.h>
+#include <libkern/OSAtomic.h>
+#include <sys/errno.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "layout.h"
+#include "logging.h"
+#include "assert.h"
+
+#pragma mark - Internal
+
+static uint32_t lustre_layout_size(uint32_t object_count)
+{
+    return sizeof(struct lustre_layout) + object_count * sizeof(struct lustre_layout_object);
+}
+
+// Composite layouts are only supported in the shape a Data-on-MDT file has: a first component on the MDT, from offset 0, and after it
+// nothing with objects yet (the file has never grown past what the MDT holds, so its later components haven't been instantiated).
+static errno_t lustre_layout_alloc_composite(OSMallocTag malloc_tag, const void * ea, uint32_t length, struct lustre_layout ** result)
+{
+    const struct lov_comp_md_v1 *       header;
+    const struct lov_comp_md_entry_v1 * entry;
+    const struct lov_mds_md_v1 *        component;
+    struct lustre_layout *              layout;
+    uint32_t                            i;
+
+    header = (const struct lov_comp_md_v1 *)ea;
+
+    if ((length < sizeof(struct lov_comp_md_v1)) || (header->lcm_entry_count == 0)
+        || (length < sizeof(struct lov_comp_md_v1) + header->lcm_entry_count * sizeof(struct lov_comp_md_entry_v1))) {
+        return EPROTO;
+    }
+
+    entry = &header->lcm_entries[0];
+    if ((entry->lcme_offset > length) || (entry->lcme_size < sizeof(struct lov_mds_md_v1)) || (entry->lcme_size > length - entry->lcme_offset)) {
+        return EPROTO;
+    }
+
+    component = (const struct lov_mds_md_v1 *)((const uint8_t *)ea + entry->lcme_offset);
+    if (!(component->lmm_pattern & kLustreLOVPatternMDT) || (entry->lcme_extent.e_start != 0) || (entry->lcme_extent.e_end == 0)) {
+        return ENOTSUP;
+    }
+    for (i=1; i<header->lcm_entry_count; i++) {
+        if (header->lcm_entries[i].lcme_flags & kLustreLOVCompFlagInit) {
+            return ENOTSUP;
+        }
+    }
+
+    layout = OSMalloc(lustre_layout_size(0), malloc_tag);
+    if (!layout) {
+        return ENOMEM;
+    }
+
+    bzero(layout, lustre_layout_size(0));
+
+    layout->malloc_tag      = malloc_tag;
+    layout->pattern         = component->lmm_pattern;
+    layout->stripe_size     = component->lmm_stripe_size;
+    layout->generation      = header->lcm_layout_gen;
+    layout->dom_size        = entry->lcme_extent.e_end;
+    layout->ref_count       = 1;
+
+    *result = layout;
+
+    return 0;
+}
+
+#pragma mark - External
+
+// Parses a LOV EA.  Files get one object per stripe; a directory's default, or a file that has no objects (not yet created, or released to
+// an archive), gets none, and so does a file kept on the MDT.  Other composite layouts aren't supported yet and fail with ENOTSUP.
+errno_t lustre_layout_alloc(OSMallocTag malloc_tag, const void * ea, uint32_t length, struct lustre_layout ** result)
+{
+    const struct lov_mds_md_v1 *    header;
+    const struct lov_ost_data_v1 *  objects;
+    struct lustre_layout *          layout;
+    uint32_t                        header_size;
+    uint32_t                        object_count;
+    uint32_t                        i;
+
+    LUSTRE_BUG_ON(!ea);
+    LUSTRE_BUG_ON(!result);
+
+    *result = NULL;
+    header  = (const struct lov_mds_md_v1 *)ea;
+
+    if (length < sizeof(struct lov_mds_md_v1)) {
+        return EPROTO;
+    }
+
+    switch (header->lmm_magic) {
+        case kLustreLOVMagicV1:
+            header_size = sizeof(struct lov_mds_md_v1);
+            objects     = ((const struct lov_mds_md_v1 *)ea)->lmm_objects;
+            break;
+        case kLustreLOVMagicV3:
+            header_size = sizeof(struct lov_mds_md_v3);
+            objects     = ((const struct lov_mds_md_v3 *)ea)->lmm_objects;
+            break;
+        case kLustreLOVMagicCompV1:
+            return lustre_layout_alloc_composite(malloc_tag, ea, length, result);
+        default:
+            os_log_error(lustre_logger_vfs, "Unknown layout magic 0x%08x", header->lmm_magic);
+            return EPROTO;
+    }
+
+    if (length < header_size) {
+        return EPROTO;
+    }
+
+    object_count = (length - header_size) / sizeof(struct lov_ost_data_v1);
+    if (header->lmm_pattern & kLustreLOVPatternReleased) {
+        object_count = 0;
+    } else if (object_count > 0) {
+        if (!(header->lmm_pattern & kLustreLOVPatternRAID0) || (header->lmm_pattern & kLustreLOVPatternMDT)) {
+            return ENOTSUP;
+        }
+        if ((header->lmm_stripe_count == 0) || (object_count < header->lmm_stripe_count) || (header->lmm_stripe_size < kLustreLayoutStripeSizeMin)) {
+            return EPROTO;
+        }
+        object_count = header->lmm_stripe_count;
+    }
+
+    layout = OSMalloc(lustre_layout_size(object_count), malloc_tag);
+    if (!layout) {
+        return ENOMEM;
+    }
+
+    bzero(layout, lustre_layout_size(object_count));
+
+    layout->malloc_tag      = malloc_tag;
+    layout->pattern         = header->lmm_pattern;
+    layout->stripe_size     = header->lmm_stripe_size;
+    layout->stripe_count    = header->lmm_stripe_count;
+    layout->generation      = header->lmm_layout_gen;
+    layout->object_count    = object_count;
+    layout->ref_count       = 1;
+
+    for (i=0; i<object_count; i++) {
+        layout->objects[i].ost_index    = objects[i].l_ost_idx;
+        layout->objects[i].oi           = objects[i].l_ost_oi;
+    }
+
+    *result = layout;
+
+    return 0;
+}
+
+void lustre_layout_ref_count_inc(struct lustre_layout * layout)
+{
+    LUSTRE_BUG_ON(!layout);
+
+    OSIncrementAtomic(&layout->ref_count);
+}
+
+void lustre_layout_ref_count_dec(struct lustre_layout * layout)
+{
+    LUSTRE_BUG_ON(!layout);
+
+    if (OSDecrementAtomic(&layout->ref_count) == 1) {
+        OSFree(layout, lustre_layout_size(layout->object_count), layout->malloc_tag);
+    }
+}
+
+// Bytes in one full round of stripes, after which the pattern repeats.
+uint64_t lustre_layout_stripe_width(const struct lustre_layout * layout)
+{
+    LUSTRE_BUG_ON(!layout);
+
+    return (uint64_t)layout->stripe_size * layout->object_count;
+}
+
+// Finds where a file offset lives: which stripe (index into objects), the offset within that object, and how many bytes on from there
+// stay in the same object before the next stripe unit starts.
+void lustre_layout_map(const struct lustre_layout * layout, uint64_t offset, uint32_t * stripe, uint64_t * object_offset, uint32_t * run)
+{
+    uint64_t unit;
+    uint32_t within;
+
+    LUSTRE_BUG_ON(!layout);
+    LUSTRE_BUG_ON(layout->object_count == 0);
+    LUSTRE_BUG_ON(!stripe);
+    LUSTRE_BUG_ON(!object_offset);
+    LUSTRE_BUG_ON(!run);
+
+    unit    = offset / layout->stripe_size;
+    within  = (uint32_t)(offset % layout->stripe_size);
+
+    *stripe         = (uint32_t)(unit % layout->object_count);
+    *object_offset  = (unit / layout->object_count) * layout->stripe_size + within;
+    *run            = layout->stripe_size - within;
+}
+
+// Where in one object the file's bytes from offset on start: the object offset of the first byte at or after offset that lives in stripe.
+// The bytes of [a, b) in that object are then [object_offset(a), object_offset(b)).
+uint64_t lustre_layout_object_offset(const struct lustre_layout * layout, uint32_t stripe, uint64_t offset)
+{
+    uint64_t unit;
+    uint64_t round;
+    uint32_t position;
+
+    LUSTRE_BUG_ON(!layout);
+    LUSTRE_BUG_ON(stripe >= layout->object_count);
+
+    unit        = offset / layout->stripe_size;
+    round       = unit / layout->object_count;
+    position    = (uint32_t)(unit % layout->object_count);
+
+    if (position == stripe) {
+        return round * layout->stripe_size + (offset % layout->stripe_size);
+    } else if (position < stripe) {
+        return round * layout->stripe_size;
+    } else {
+        return (round + 1) * layout->stripe_size;
+    }
+}
+
+// Where a byte of one object lives in the file; the inverse of lustre_layout_map.
+uint64_t lustre_layout_file_offset(const struct lustre_layout * layout, uint32_t stripe, uint64_t object_offset)
+{
+    uint64_t unit;
+
+    LUSTRE_BUG_ON(!layout);
+    LUSTRE_BUG_ON(stripe >= layout->object_count);
+
+    unit = object_offset / layout->stripe_size;
+
+    return (unit * layout->object_count + stripe) * layout->stripe_size + (object_offset % layout->stripe_size);
+}
+
+// The smallest file size consistent with one object's size.  The file is as long as the largest of these across its objects.
+uint64_t lustre_layout_file_size(const struct lustre_layout * layout, uint32_t stripe, uint64_t object_size)
+{
+    uint64_t last;
+    uint64_t unit;
+
+    LUSTRE_BUG_ON(!layout);
+    LUSTRE_BUG_ON(stripe >= layout->object_count);
+
+    if (object_size == 0) {
+        return 0;
+    }
+
+    last    = object_size - 1;
+    unit    = last / layout->stripe_size;
+
+    return (unit * layout->object_count + stripe) * layout->stripe_size + (last % layout->stripe_size) + 1;
+}
@@ -0,0 +1,65 @@
+//
+//  layout.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// File layouts.  A striped file's data is cut into stripe_size units dealt round its objects in turn, so unit n of the file is unit
+// (n / count) of object (n % count).  Layouts come from the LOV EA the MDT returns with a file's attributes and are shared, read-only and
+// reference counted, by everyone doing I/O on the file while it stays current.  A small file may instead keep its data on the MDT
+// (Data-on-MDT), in which case it has no objects and dom_size says how much of it the MDT holds.
+
+#ifndef lustre_layout_h
+#define lustre_layout_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <libkern/OSMalloc.h>
+#include "wire.h"
+
+static const uint32_t   kLustreLayoutStripeSizeDefault      = 1024 * 1024;      // used when neither the file nor its directory says
+static const uint32_t   kLustreLayoutStripeSizeMin          = 64 * 1024;
+
+struct lustre_layout_object {
+    uint32_t                                        ost_index;
+    struct ost_id                                   oi;
+};
+
+struct lustre_layout {
+    OSMallocTag                                     malloc_tag;
+    uint32_t                                        pattern;
+    uint32_t                                        stripe_size;                    // 0 in a directory default that doesn't set it
+    uint32_t                                        stripe_count;                   // likewise; may be kLustreLOVStripeCountAll
+    uint32_t                                        generation;                     // bumped by the MDT whenever the layout changes
+    uint32_t                                        object_count;                   // stripe_count for files with data, 0 otherwise
+    uint64_t                                        dom_size;                       // bytes from 0 kept on the MDT, 0 if none
+    int32_t                                         ref_count;
+    struct lustre_layout_object                     objects[0];
+};
+
+errno_t                 lustre_layout_alloc(OSMallocTag malloc_tag, const void * ea, uint32_t length, struct lustre_layout ** layout);
+void                    lustre_layout_ref_count_inc(struct lustre_layout * layout);
+void                    lustre_layout_ref_count_dec(struct lustre_layout * layout);
+
+uint64_t                lustre_layout_stripe_width(const struct lustre_layout * layout);
+void                    lustre_layout_map(const struct lustre_layout * layout, uint64_t offset, uint32_t * stripe, uint64_t * object_offset, uint32_t * run);
+uint64_t                lustre_layout_object_offset(const struct lustre_layout * layout, uint32_t stripe, uint64_t offset);
+uint64_t                lustre_layout_file_offset(const struct lustre_layout * layout, uint32_t stripe, uint64_t object_offset);
+uint64_t                lustre_layout_file_size(const struct lustre_layout * layout, uint32_t stripe, uint64_t object_size);
+
+#endif /* lustre_layout_h */
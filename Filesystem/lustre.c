@@ -26,6 +26,8 @@
 #include "constants.h"
 #include "vnop.h"
 #include "vfsop.h"
+#include "sysctl.h"
+#include "network.h"
 #include "logging.h"
 #include "assert.h"
 
@@ -48,53 +50,54 @@ typedef errno_t (* vnodeop)(void *);
 // The following is a list of all of the vnode operations supported on Mac OS X 10.4+, with the ones that we support uncommented.
 static struct vnodeopv_entry_desc vnodeop_entries[] = {
     //  { &vnop_access_desc,        (vnodeop) lustre_vnop_access       },
-    //  { &vnop_advlock_desc,       (vnodeop) lustre_vnop_advlock      },
+        { &vnop_advlock_desc,       (vnodeop) lustre_vnop_advlock      },
     //  { &vnop_allocate_desc,      (vnodeop) lustre_vnop_allocate     },
-    //  { &vnop_blktooff_desc,      (vnodeop) lustre_vnop_blktooff     },
-    //  { &vnop_blockmap_desc,      (vnodeop) lustre_vnop_blockmap     },
+        { &vnop_blktooff_desc,      (vnodeop) lustre_vnop_blktooff     },
+        { &vnop_blockmap_desc,      (vnodeop) lustre_vnop_blockmap     },
     //  { &vnop_bwrite_desc,        (vnodeop) lustre_vnop_bwrite       },
         { &vnop_close_desc,         (vnodeop) lustre_vnop_close        },
-    //  { &vnop_copyfile_desc,      (vnodeop) lustre_vnop_copyfile     },
+    //  { &vnop_copyfile_desc,      (vnodeop) lustre_vnop_copyfile     },            // no server-side copy in the protocol, and needs create first
     //  { &vnop_create_desc,        (vnodeop) lustre_vnop_create       },
         { &vnop_default_desc,       (vnodeop) vn_default_error         },
     //  { &vnop_exchange_desc,      (vnodeop) lustre_vnop_exchange     },
-    //  { &vnop_fsync_desc,         (vnodeop) lustre_vnop_fsync        },
+        { &vnop_fsync_desc,         (vnodeop) lustre_vnop_fsync        },
         { &vnop_getattr_desc,       (vnodeop) lustre_vnop_getattr      },
     //  { &vnop_getattrlist_desc,   (vnodeop) lustre_vnop_getattrlist  },            // not useful, implement getattr instead
-    //  { &vnop_getxattr_desc,      (vnodeop) lustre_vnop_getxattr     },
+        { &vnop_getattrlistbulk_desc, (vnodeop) lustre_vnop_getattrlistbulk },
+        { &vnop_getxattr_desc,      (vnodeop) lustre_vnop_getxattr     },
     //  { &vnop_inactive_desc,      (vnodeop) lustre_vnop_inactive     },
-    //  { &vnop_ioctl_desc,         (vnodeop) lustre_vnop_ioctl        },
+        { &vnop_ioctl_desc,         (vnodeop) lustre_vnop_ioctl        },
     //  { &vnop_link_desc,          (vnodeop) lustre_vnop_link         },
-    //  { &vnop_listxattr_desc,     (vnodeop) lustre_vnop_listxattr    },
+        { &vnop_listxattr_desc,     (vnodeop) lustre_vnop_listxattr    },
         { &vnop_lookup_desc,        (vnodeop) lustre_vnop_lookup       },
     //  { &vnop_mkdir_desc,         (vnodeop) lustre_vnop_mkdir        },
     //  { &vnop_mknod_desc,         (vnodeop) lustre_vnop_mknod        },
-    //  { &vnop_mmap_desc,          (vnodeop) lustre_vnop_mmap         },
+        { &vnop_mmap_desc,          (vnodeop) lustre_vnop_mmap         },
     //  { &vnop_mnomap_desc,        (vnodeop) lustre_vnop_mnomap       },
-    //  { &vnop_offtoblk_desc,      (vnodeop) lustre_vnop_offtoblk     },
+        { &vnop_offtoblk_desc,      (vnodeop) lustre_vnop_offtoblk     },
         { &vnop_open_desc,          (vnodeop) lustre_vnop_open         },
-    //  { &vnop_pagein_desc,        (vnodeop) lustre_vnop_pagein       },
-    //  { &vnop_pageout_desc,       (vnodeop) lustre_vnop_pageout      },
+        { &vnop_pagein_desc,        (vnodeop) lustre_vnop_pagein       },
+        { &vnop_pageout_desc,       (vnodeop) lustre_vnop_pageout      },
     //  { &vnop_pathconf_desc,      (vnodeop) lustre_vnop_pathconf     },
-    //  { &vnop_read_desc,          (vnodeop) lustre_vnop_read         },
+        { &vnop_read_desc,          (vnodeop) lustre_vnop_read         },
         { &vnop_readdir_desc,       (vnodeop) lustre_vnop_read_dir     },
     //  { &vnop_readdirattr_desc,   (vnodeop) lustre_vnop_readdirattr  },
     //  { &vnop_readlink_desc,      (vnodeop) lustre_vnop_readlink     },
         { &vnop_reclaim_desc,       (vnodeop) lustre_vnop_reclaim      },
     //  { &vnop_remove_desc,        (vnodeop) lustre_vnop_remove       },
-    //  { &vnop_removexattr_desc,   (vnodeop) lustre_vnop_removexattr  },
+        { &vnop_removexattr_desc,   (vnodeop) lustre_vnop_removexattr  },
     //  { &vnop_rename_desc,        (vnodeop) lustre_vnop_rename       },
     //  { &vnop_revoke_desc,        (vnodeop) lustre_vnop_revoke       },
     //  { &vnop_rmdir_desc,         (vnodeop) lustre_vnop_rmdir        },
-    //  { &vnop_searchfs_desc,      (vnodeop) lustre_vnop_searchfs     },
+        { &vnop_searchfs_desc,      (vnodeop) lustre_vnop_searchfs     },
     //  { &vnop_select_desc,        (vnodeop) lustre_vnop_select       },
     //  { &vnop_setattr_desc,       (vnodeop) lustre_vnop_setattr      },
     //  { &vnop_setattrlist_desc,   (vnodeop) lustre_vnop_setattrlist  },            // not useful, implement setattr instead
-    //  { &vnop_setxattr_desc,      (vnodeop) lustre_vnop_setxattr     },
-    //  { &vnop_strategy_desc,      (vnodeop) lustre_vnop_strategy     },
+        { &vnop_setxattr_desc,      (vnodeop) lustre_vnop_setxattr     },
+        { &vnop_strategy_desc,      (vnodeop) lustre_vnop_strategy     },
     //  { &vnop_symlink_desc,       (vnodeop) lustre_vnop_symlink      },
     //  { &vnop_whiteout_desc,      (vnodeop) lustre_vnop_whiteout     },
-    //  { &vnop_write_desc,         (vnodeop) lustre_vnop_write        },
+        { &vnop_write_desc,         (vnodeop) lustre_vnop_write        },
         { NULL, NULL }
 };
 
@@ -144,6 +147,7 @@ struct vfs_fsentry vfs_entry = {
     | VFS_TBLNOMACLABEL
     | VFS_TBLFSNODELOCK                         // ditto
     | VFS_TBLNOTYPENUM                          // we don't have a pre-defined file system type (the VT_XXX constants in <sys/vnode.h>); VFS should dynamically assign us a type
+    | VFS_TBLVNOP_PAGEINV2                      // pagein makes its own UPLs, so that a page fault can read in the stripe around it
     | VFS_TBL64BITREADY,                        // we are 64-bit aware; our mount, ioctl and sysctl entry points can be called by both 32-bit and 64-bit processes; we're will
                                                 // use the type of process to interpret our arguments (if they're not 32/64-bit invariant)
     {NULL, NULL}                                // vfe_reserv
@@ -208,6 +212,14 @@ kern_return_t lustre_start(kmod_info_t * ki, void * d)
     
     result = lustre_init_memory_and_locks();
 
+    if (result == KERN_SUCCESS) {
+        result = lustre_sysctl_register();
+    }
+
+    if (result == KERN_SUCCESS) {
+        result = lustre_network_register();
+    }
+
     if (result == KERN_SUCCESS) {
         strlcpy(vfs_entry.vfe_fsname, kLustreFilesystemName, MFSNAMELEN);
         if (vfs_fsadd(&vfs_entry, &vfs_table_ref) != 0) {
@@ -216,6 +228,8 @@ kern_return_t lustre_start(kmod_info_t * ki, void * d)
     }
 
     if (result != KERN_SUCCESS) {
+        lustre_network_unregister();
+        lustre_sysctl_unregister();
         lustre_terminate_memory_and_locks();
     }
 
@@ -233,6 +247,8 @@ kern_return_t lustre_stop(kmod_info_t * ki, void * d)
     if (vfs_fsremove(vfs_table_ref) == 0) {
         vfs_table_ref = NULL;
 
+        lustre_network_unregister();
+        lustre_sysctl_unregister();
         lustre_terminate_memory_and_locks();
         
         result = KERN_SUCCESS;
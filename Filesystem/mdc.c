@@ -0,0 +1,1067 @@
+//
+//  mdc.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <libkern/libkern.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "mdc.h"
+#include "import.h"
+#include "request.h"
+#include "layout.h"
+#include "logging.h"
+#include "assert.h"
+
+static const uint32_t   kLustreMDCReplySize                 = 8192;
+static const uint32_t   kLustreMDCOpenReplySize             = 8192 + 64 * 1024; // room for a small file's data to come back inline
+static const uint32_t   kLustreMDCOpenReplyLayout           = 3;                // open reply fields after the body: layout, ACL, two capabilities
+static const uint32_t   kLustreMDCOpenReplyInline           = 7;                // and then the inline data, a niobuf_remote and its bytes
+static const uint32_t   kLustreMDCXattrReplyNames           = 3;                // getxattr reply fields after the body: names, values, lengths
+
+#pragma mark - Internal
+
+static errno_t lustre_mdc_getattr_build(struct lustre_import * import, const struct lu_fid * fid, uint64_t valid, uint32_t ea_size, struct lustre_request ** result)
+{
+    struct lustre_request *     request;
+    struct mdt_body *           request_body;
+
+    request = lustre_request_alloc(import, kLustreOpcodeMDSGetattr);
+    if (!request) {
+        return ENOMEM;
+    }
+
+    request_body = lustre_request_field_add(request, sizeof(struct mdt_body));
+    if (!request_body) {
+        lustre_request_ref_count_dec(request);
+        return ENOMEM;
+    }
+
+    request_body->mbo_fid1          = *fid;
+    request_body->mbo_valid         = valid;
+    request_body->mbo_eadatasize    = ea_size;
+
+    lustre_request_set_reply_size(request, kLustreMDCReplySize);
+
+    *result = request;
+
+    return 0;
+}
+
+#pragma mark - External
+
+errno_t lustre_mdc_get_root(struct lustre_import * import, struct lu_fid * fid)
+{
+    struct lustre_request *     request;
+    struct mdt_body *           body;
+    const struct mdt_body *     reply_body;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!fid);
+
+    request = lustre_request_alloc(import, kLustreOpcodeMDSGetRoot);
+    if (!request) {
+        return ENOMEM;
+    }
+
+    body = lustre_request_field_add(request, sizeof(struct mdt_body));
+    if (!body) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    error = lustre_request_send(request);
+    if (error != 0) {
+        goto end;
+    }
+
+    reply_body = lustre_request_reply_field(request, 1, sizeof(struct mdt_body), NULL);
+    if (!reply_body) {
+        error = EPROTO;
+        goto end;
+    }
+
+    *fid = reply_body->mbo_fid1;
+
+end:
+    lustre_request_ref_count_dec(request);
+
+    return error;
+}
+
+errno_t lustre_mdc_getattr(struct lustre_import * import, const struct lu_fid * fid, struct mdt_body * body)
+{
+    struct lustre_request *     request;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!body);
+
+    error = lustre_mdc_getattr_prepare(import, fid, &request);
+    if (error != 0) {
+        return error;
+    }
+
+    error = lustre_request_send(request);
+    if (error == 0) {
+        error = lustre_mdc_getattr_interpret(request, body);
+    }
+
+    lustre_request_ref_count_dec(request);
+
+    return error;
+}
+
+// Builds a getattr request without sending it, so callers can put many in a request set and have them in flight together.
+errno_t lustre_mdc_getattr_prepare(struct lustre_import * import, const struct lu_fid * fid, struct lustre_request ** result)
+{
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!result);
+
+    return lustre_mdc_getattr_build(import, fid, kLustreMDFlagGetattr, 0, result);
+}
+
+// Unpacks the reply to a completed getattr request.
+errno_t lustre_mdc_getattr_interpret(struct lustre_request * request, struct mdt_body * body)
+{
+    const struct mdt_body *     reply_body;
+
+    LUSTRE_BUG_ON(!request);
+    LUSTRE_BUG_ON(!body);
+
+    if (request->error != 0) {
+        return request->error;
+    }
+
+    reply_body = lustre_request_reply_field(request, 1, sizeof(struct mdt_body), NULL);
+    if (!reply_body) {
+        return EPROTO;
+    }
+
+    *body = *reply_body;
+
+    return 0;
+}
+
+// As lustre_mdc_getattr, also fetching the object's layout.  *layout is NULL if it has none: not a regular file or a directory with a
+// default, or a file created without objects.
+errno_t lustre_mdc_getattr_layout(struct lustre_import * import, const struct lu_fid * fid, OSMallocTag malloc_tag, struct mdt_body * body, struct lustre_layout ** layout)
+{
+    struct lustre_request *     request;
+    const void *                ea;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!body);
+    LUSTRE_BUG_ON(!layout);
+
+    *layout = NULL;
+
+    error = lustre_mdc_getattr_build(import, fid, kLustreMDFlagGetattr | kLustreMDFlagEASize, kLustreMDMaxEASize, &request);
+    if (error != 0) {
+        return error;
+    }
+
+    error = lustre_request_send(request);
+    if (error == 0) {
+        error = lustre_mdc_getattr_interpret(request, body);
+    }
+    if (error != 0) {
+        goto end;
+    }
+
+    if (!(body->mbo_valid & kLustreMDFlagEASize) || (body->mbo_eadatasize == 0)) {
+        goto end;
+    }
+
+    ea = lustre_request_reply_field(request, 2, body->mbo_eadatasize, NULL);
+    if (!ea) {
+        error = EPROTO;
+        goto end;
+    }
+
+    error = lustre_layout_alloc(malloc_tag, ea, body->mbo_eadatasize, layout);
+
+end:
+    lustre_request_ref_count_dec(request);
+
+    return error;
+}
+
+// Looks name up in parent with a getattr intent, so one RPC returns the child's attributes and a lock that keeps them, and the name,
+// valid.  On success the lock (if the server granted one) covers the child.  On ENOENT the server may instead grant an UPDATE lock on the
+// parent, which keeps the negative result valid until the directory changes.  *lock is NULL whenever nothing was granted.
+errno_t lustre_mdc_lookup(struct lustre_import * import, struct lustre_dlm_namespace * namespace, const struct lu_fid * parent, const char * name, size_t length, struct mdt_body * body, struct lustre_dlm_lock ** lock)
+{
+    struct lustre_request *         request;
+    struct lustre_dlm_lock *        dlm_lock;
+    errno_t                         error;
+
+    LUSTRE_BUG_ON(!body);
+    LUSTRE_BUG_ON(!lock);
+
+    *lock = NULL;
+
+    error = lustre_mdc_lookup_prepare(import, namespace, parent, name, length, &request, &dlm_lock);
+    if (error != 0) {
+        return error;
+    }
+
+    // A failure to send is left in the request, where interpreting it finds it and cancels the lock.
+
+    (void)lustre_request_send(request);
+
+    error = lustre_mdc_lookup_interpret(request, dlm_lock, body, lock);
+
+    lustre_request_ref_count_dec(request);
+
+    return error;
+}
+
+// Builds a lookup request without sending it, along with the lock it enqueues.  The caller passes both to lustre_mdc_lookup_interpret
+// once the request has completed, which disposes of the lock.
+errno_t lustre_mdc_lookup_prepare(struct lustre_import * import, struct lustre_dlm_namespace * namespace, const struct lu_fid * parent, const char * name, size_t length, struct lustre_request ** result, struct lustre_dlm_lock ** lock)
+{
+    struct lustre_request *         request;
+    struct lustre_dlm_lock *        dlm_lock;
+    struct ldlm_request *           enqueue;
+    struct ldlm_intent *            intent;
+    struct mdt_body *               request_body;
+    char *                          request_name;
+    union ldlm_wire_policy_data     policy;
+    struct ldlm_res_id              resource;
+    errno_t                         error;
+
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!namespace);
+    LUSTRE_BUG_ON(!parent);
+    LUSTRE_BUG_ON(!name);
+    LUSTRE_BUG_ON(!result);
+    LUSTRE_BUG_ON(!lock);
+
+    *result     = NULL;
+    *lock       = NULL;
+    dlm_lock    = NULL;
+    resource    = lustre_dlm_resource_from_fid(parent);
+
+    request = lustre_request_alloc(import, kLustreOpcodeLDLMEnqueue);
+    if (!request) {
+        return ENOMEM;
+    }
+
+    dlm_lock = lustre_dlm_lock_alloc(namespace, import, kLustreDLMTypeIBits, kLustreDLMModeCR, &resource);
+    if (!dlm_lock) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    // The capability, between the body and the name, is left empty, as for open.
+
+    enqueue         = lustre_request_field_add(request, sizeof(struct ldlm_request));
+    intent          = lustre_request_field_add(request, sizeof(struct ldlm_intent));
+    request_body    = lustre_request_field_add(request, sizeof(struct mdt_body));
+    if (!enqueue || !intent || !request_body || !lustre_request_field_add(request, 0)) {
+        error = ENOMEM;
+        goto end;
+    }
+    request_name    = lustre_request_field_add(request, (uint32_t)length + 1);
+    if (!request_name) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    bzero(&policy, sizeof(policy));
+    policy.l_inodebits.bits = kLustreInodeBitLookup | kLustreInodeBitUpdate | kLustreInodeBitPerm;
+
+    lustre_dlm_lock_pack(dlm_lock, enqueue, kLustreDLMFlagHasIntent, &policy);
+
+    intent->opc                     = kLustreIntentGetattr;
+    request_body->mbo_fid1          = *parent;
+    request_body->mbo_valid         = kLustreMDFlagGetattr | kLustreMDFlagEASize;
+    request_body->mbo_eadatasize    = kLustreMDMaxEASize;
+    memcpy(request_name, name, length);
+
+    lustre_request_set_reply_size(request, kLustreMDCReplySize);
+
+    error = 0;
+
+end:
+    if (error == 0) {
+        *result = request;
+        *lock   = dlm_lock;
+    } else {
+        if (dlm_lock) {
+            lustre_dlm_lock_cancel(dlm_lock);
+            lustre_dlm_lock_ref_count_dec(dlm_lock);
+        }
+        lustre_request_ref_count_dec(request);
+    }
+
+    return error;
+}
+
+// Unpacks the reply to a completed lookup request, with the same results as lustre_mdc_lookup.  Takes over the caller's reference to
+// dlm_lock, which either ends up in *lock or is cancelled.
+errno_t lustre_mdc_lookup_interpret(struct lustre_request * request, struct lustre_dlm_lock * dlm_lock, struct mdt_body * body, struct lustre_dlm_lock ** lock)
+{
+    const struct ldlm_reply *       reply;
+    const struct mdt_body *         reply_body;
+    errno_t                         error;
+
+    LUSTRE_BUG_ON(!request);
+    LUSTRE_BUG_ON(!dlm_lock);
+    LUSTRE_BUG_ON(!body);
+    LUSTRE_BUG_ON(!lock);
+
+    *lock = NULL;
+
+    error = request->error;
+    if (error != 0) {
+        goto end;
+    }
+
+    reply = lustre_request_reply_field(request, 1, sizeof(struct ldlm_reply), NULL);
+    if (!reply) {
+        error = EPROTO;
+        goto end;
+    }
+
+    // The enqueue itself succeeded; the intent's own result is carried in the reply.
+
+    if (!(reply->lock_policy_res1 & kLustreDispositionIntentExecuted)) {
+        error = EPROTO;
+    } else if ((int64_t)reply->lock_policy_res2 != 0) {
+        error = lustre_request_errno_from_wire((int32_t)reply->lock_policy_res2);
+    } else if (reply->lock_policy_res1 & kLustreDispositionLookupNegative) {
+        error = ENOENT;
+    } else {
+        reply_body = lustre_request_reply_field(request, 2, sizeof(struct mdt_body), NULL);
+        if (reply_body) {
+            *body = *reply_body;
+        } else {
+            error = EPROTO;
+        }
+    }
+
+    if (((error == 0) || (error == ENOENT)) && lustre_dlm_lock_granted(dlm_lock, reply)) {
+        *lock       = dlm_lock;
+        dlm_lock    = NULL;
+    }
+
+end:
+    if (dlm_lock) {
+        lustre_dlm_lock_cancel(dlm_lock);
+        lustre_dlm_lock_ref_count_dec(dlm_lock);
+    }
+
+    return error;
+}
+
+// Asks for a plain CR lock on the directory's UPDATE bit, which the server revokes before the directory's entries change.  Returns 0 with
+// *lock NULL if the server wouldn't grant it.
+errno_t lustre_mdc_update_lock(struct lustre_import * import, struct lustre_dlm_namespace * namespace, const struct lu_fid * fid, struct lustre_dlm_lock ** lock)
+{
+    struct lustre_request *         request;
+    struct lustre_dlm_lock *        dlm_lock;
+    struct ldlm_request *           enqueue;
+    const struct ldlm_reply *       reply;
+    union ldlm_wire_policy_data     policy;
+    struct ldlm_res_id              resource;
+    errno_t                         error;
+
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!namespace);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!lock);
+
+    *lock       = NULL;
+    resource    = lustre_dlm_resource_from_fid(fid);
+
+    request = lustre_request_alloc(import, kLustreOpcodeLDLMEnqueue);
+    if (!request) {
+        return ENOMEM;
+    }
+
+    dlm_lock = lustre_dlm_lock_alloc(namespace, import, kLustreDLMTypeIBits, kLustreDLMModeCR, &resource);
+    if (!dlm_lock) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    enqueue = lustre_request_field_add(request, sizeof(struct ldlm_request));
+    if (!enqueue) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    bzero(&policy, sizeof(policy));
+    policy.l_inodebits.bits = kLustreInodeBitUpdate;
+
+    lustre_dlm_lock_pack(dlm_lock, enqueue, 0, &policy);
+
+    error = lustre_request_send(request);
+    if (error != 0) {
+        goto end;
+    }
+
+    reply = lustre_request_reply_field(request, 1, sizeof(struct ldlm_reply), NULL);
+    if (!reply) {
+        error = EPROTO;
+        goto end;
+    }
+
+    if (lustre_dlm_lock_granted(dlm_lock, reply)) {
+        *lock       = dlm_lock;
+        dlm_lock    = NULL;
+    }
+
+end:
+    if (dlm_lock) {
+        lustre_dlm_lock_cancel(dlm_lock);
+        lustre_dlm_lock_ref_count_dec(dlm_lock);
+    }
+    lustre_request_ref_count_dec(request);
+
+    return error;
+}
+
+// Sends a flock enqueue for fid: mode PR or PW takes the range in flock for its owner, waiting behind other clients' locks unless flags has
+// kLustreDLMFlagBlockNoWait; mode NL drops whatever the owner holds in it.  With kLustreDLMFlagTestLock nothing changes, and desc comes
+// back with a conflicting lock's mode and range, or a mode of 0 or NL if nothing is in the way.  Granted flock locks are the server's to
+// keep track of, so nothing is left in the namespace afterwards.
+errno_t lustre_mdc_flock(struct lustre_import * import, struct lustre_dlm_namespace * namespace, const struct lu_fid * fid, enum lustre_dlm_mode mode, uint32_t flags, const struct ldlm_flock_wire * flock, struct ldlm_lock_desc * desc)
+{
+    struct lustre_request *         request;
+    struct lustre_dlm_lock *        dlm_lock;
+    struct ldlm_request *           enqueue;
+    const struct ldlm_reply *       reply;
+    union ldlm_wire_policy_data     policy;
+    struct ldlm_res_id              resource;
+    errno_t                         error;
+
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!namespace);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!flock);
+    LUSTRE_BUG_ON((flags & kLustreDLMFlagTestLock) && !desc);
+
+    dlm_lock    = NULL;
+    resource    = lustre_dlm_resource_from_fid(fid);
+
+    request = lustre_request_alloc(import, kLustreOpcodeLDLMEnqueue);
+    if (!request) {
+        return ENOMEM;
+    }
+
+    dlm_lock = lustre_dlm_lock_alloc(namespace, import, kLustreDLMTypeFlock, mode, &resource);
+    if (!dlm_lock) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    enqueue = lustre_request_field_add(request, sizeof(struct ldlm_request));
+    if (!enqueue) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    bzero(&policy, sizeof(policy));
+    policy.l_flock = *flock;
+
+    lustre_dlm_lock_pack(dlm_lock, enqueue, flags, &policy);
+
+    error = lustre_request_send(request);
+    if (error != 0) {
+        goto end;
+    }
+
+    reply = lustre_request_reply_field(request, 1, sizeof(struct ldlm_reply), NULL);
+    if (!reply) {
+        error = EPROTO;
+        goto end;
+    }
+
+    if (flags & kLustreDLMFlagTestLock) {
+        *desc = reply->lock_desc;
+    } else if (mode != kLustreDLMModeNL) {
+        error = lustre_dlm_lock_wait(dlm_lock, reply);
+        if (error != 0) {
+            goto end;
+        }
+    }
+
+    lustre_dlm_lock_forget(dlm_lock);
+
+end:
+    if (dlm_lock) {
+        if (error != 0) {
+            lustre_dlm_lock_cancel(dlm_lock);
+        }
+        lustre_dlm_lock_ref_count_dec(dlm_lock);
+    }
+    lustre_request_ref_count_dec(request);
+
+    return error;
+}
+
+// Opens fid by FID with an open intent, so the MDT hands back an open handle in reply->body.mbo_open_handle along with the file's
+// attributes and layout.  A small file kept on the MDT may come with its data too, when the server can fit it in the reply.  flags are
+// kLustreOpenFlag* bits; with kLustreOpenFlagLock the server may also grant an OPEN lock, returned in *lock, which lets the handle be kept
+// and reused until the server wants it back.  *lock is NULL whenever no OPEN lock was granted.  On success the caller gives reply back
+// with lustre_mdc_open_reply_release.
+errno_t lustre_mdc_open(struct lustre_import * import, struct lustre_dlm_namespace * namespace, const struct lu_fid * fid, uint64_t flags, OSMallocTag malloc_tag, struct lustre_mdc_open_reply * reply, struct lustre_dlm_lock ** lock)
+{
+    struct lustre_request *         request;
+    struct lustre_dlm_lock *        dlm_lock;
+    struct ldlm_request *           enqueue;
+    struct ldlm_intent *            intent;
+    struct mdt_rec_create *         record;
+    const struct ldlm_reply *       dlm_reply;
+    const struct mdt_body *         reply_body;
+    const struct niobuf_remote *    niobuf;
+    const void *                    ea;
+    union ldlm_wire_policy_data     policy;
+    struct ldlm_res_id              resource;
+    enum lustre_dlm_mode            mode;
+    uint32_t                        length;
+    errno_t                         error;
+
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!namespace);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!reply);
+    LUSTRE_BUG_ON(!lock);
+
+    bzero(reply, sizeof(struct lustre_mdc_open_reply));
+
+    *lock       = NULL;
+    resource    = lustre_dlm_resource_from_fid(fid);
+
+    // The OPEN lock's mode is what conflicts with other clients' opens: writers share CW, executables PR, readers CR.
+
+    if (flags & kLustreOpenFlagWrite) {
+        mode = kLustreDLMModeCW;
+    } else if (flags & kLustreOpenFlagExec) {
+        mode = kLustreDLMModePR;
+    } else {
+        mode = kLustreDLMModeCR;
+    }
+
+    request = lustre_request_alloc(import, kLustreOpcodeLDLMEnqueue);
+    if (!request) {
+        return ENOMEM;
+    }
+
+    dlm_lock = lustre_dlm_lock_alloc(namespace, import, kLustreDLMTypeIBits, mode, &resource);
+    if (!dlm_lock) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    // Both capabilities and the name are left empty; opening by FID needs none of them.
+
+    enqueue = lustre_request_field_add(request, sizeof(struct ldlm_request));
+    intent  = lustre_request_field_add(request, sizeof(struct ldlm_intent));
+    record  = lustre_request_field_add(request, sizeof(struct mdt_rec_create));
+    if (!enqueue || !intent || !record
+        || !lustre_request_field_add(request, 0) || !lustre_request_field_add(request, 0)
+        || !lustre_request_field_add(request, 0) || !lustre_request_field_add(request, 0)) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    bzero(&policy, sizeof(policy));
+    policy.l_inodebits.bits = kLustreInodeBitOpen;
+
+    lustre_dlm_lock_pack(dlm_lock, enqueue, kLustreDLMFlagHasIntent, &policy);
+
+    flags |= kLustreOpenFlagByFid;
+
+    intent->opc         = kLustreIntentOpen;
+    record->cr_opcode   = kLustreReintOpen;
+    record->cr_fid1     = *fid;
+    record->cr_fid2     = *fid;
+    record->cr_flags_l  = (uint32_t)flags;
+    record->cr_flags_h  = (uint32_t)(flags >> 32);
+
+    lustre_request_set_reply_size(request, kLustreMDCOpenReplySize);
+
+    error = lustre_request_send(request);
+    if (error != 0) {
+        goto end;
+    }
+
+    dlm_reply = lustre_request_reply_field(request, 1, sizeof(struct ldlm_reply), NULL);
+    if (!dlm_reply) {
+        error = EPROTO;
+        goto end;
+    }
+
+    if (!(dlm_reply->lock_policy_res1 & kLustreDispositionIntentExecuted)) {
+        error = EPROTO;
+    } else if ((int64_t)dlm_reply->lock_policy_res2 != 0) {
+        error = lustre_request_errno_from_wire((int32_t)dlm_reply->lock_policy_res2);
+    } else if (!(dlm_reply->lock_policy_res1 & kLustreDispositionOpenOpen)) {
+        error = EPROTO;
+    } else {
+        reply_body = lustre_request_reply_field(request, 2, sizeof(struct mdt_body), NULL);
+        if (reply_body && (reply_body->mbo_valid & kLustreMDFlagHandle)) {
+            reply->body = *reply_body;
+        } else {
+            error = EPROTO;
+        }
+    }
+    if (error != 0) {
+        goto end;
+    }
+
+    // From here on the file is open on the MDT, and anything that goes wrong has to close it again.
+
+    if ((reply->body.mbo_valid & kLustreMDFlagEASize) && (reply->body.mbo_eadatasize > 0)) {
+        ea = lustre_request_reply_field(request, kLustreMDCOpenReplyLayout, reply->body.mbo_eadatasize, NULL);
+        error = ea ? lustre_layout_alloc(malloc_tag, ea, reply->body.mbo_eadatasize, &reply->layout) : EPROTO;
+    }
+
+    niobuf = lustre_request_reply_field(request, kLustreMDCOpenReplyInline, sizeof(struct niobuf_remote), &length);
+    if ((error == 0) && niobuf && (niobuf->rnb_len > 0) && (niobuf->rnb_len <= length - sizeof(struct niobuf_remote))) {
+        reply->data = OSMalloc(niobuf->rnb_len, malloc_tag);
+        if (reply->data) {
+            memcpy(reply->data, niobuf + 1, niobuf->rnb_len);
+            reply->data_offset  = niobuf->rnb_offset;
+            reply->data_length  = niobuf->rnb_len;
+        }
+    }
+
+    if (error != 0) {
+        (void)lustre_mdc_close(import, fid, reply->body.mbo_open_handle);
+        goto end;
+    }
+
+    if ((dlm_reply->lock_policy_res1 & kLustreDispositionOpenLock) && lustre_dlm_lock_granted(dlm_lock, dlm_reply)) {
+        *lock       = dlm_lock;
+        dlm_lock    = NULL;
+    }
+
+end:
+    if (dlm_lock) {
+        lustre_dlm_lock_cancel(dlm_lock);
+        lustre_dlm_lock_ref_count_dec(dlm_lock);
+    }
+    lustre_request_ref_count_dec(request);
+
+    return error;
+}
+
+void lustre_mdc_open_reply_release(struct lustre_mdc_open_reply * reply, OSMallocTag malloc_tag)
+{
+    LUSTRE_BUG_ON(!reply);
+
+    if (reply->layout) {
+        lustre_layout_ref_count_dec(reply->layout);
+        reply->layout = NULL;
+    }
+    if (reply->data) {
+        OSFree(reply->data, reply->data_length, malloc_tag);
+        reply->data = NULL;
+    }
+}
+
+// Closes an open handle returned by lustre_mdc_open.  The handle is gone afterwards whatever the result.
+errno_t lustre_mdc_close(struct lustre_import * import, const struct lu_fid * fid, struct lustre_handle handle)
+{
+    struct lustre_request * request;
+    errno_t                 error;
+
+    error = lustre_mdc_close_prepare(import, fid, handle, &request);
+    if (error != 0) {
+        return error;
+    }
+
+    error = lustre_request_send(request);
+
+    lustre_request_ref_count_dec(request);
+
+    return error;
+}
+
+// Builds the close for lustre_mdc_close, for callers that can't wait for it.
+errno_t lustre_mdc_close_prepare(struct lustre_import * import, const struct lu_fid * fid, struct lustre_handle handle, struct lustre_request ** result)
+{
+    struct lustre_request *         request;
+    struct mdt_ioepoch *            epoch;
+    struct mdt_rec_setattr *        record;
+
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!result);
+
+    request = lustre_request_alloc(import, kLustreOpcodeMDSClose);
+    if (!request) {
+        return ENOMEM;
+    }
+
+    epoch   = lustre_request_field_add(request, sizeof(struct mdt_ioepoch));
+    record  = lustre_request_field_add(request, sizeof(struct mdt_rec_setattr));
+    if (!epoch || !record || !lustre_request_field_add(request, 0)) {
+        lustre_request_ref_count_dec(request);
+        return ENOMEM;
+    }
+
+    epoch->mio_open_handle  = handle;
+    record->sa_opcode       = kLustreReintSetattr;
+    record->sa_fid          = *fid;
+
+    lustre_request_set_reply_size(request, kLustreMDCReplySize);
+
+    *result = request;
+
+    return 0;
+}
+
+// Builds a getxattr intent for every extended attribute fid has, without sending it, along with the PR lock on the XATTR bit it enqueues.
+// size bounds the names, and separately the values, the server may send back; if they don't fit the intent fails with ERANGE.  The caller
+// passes the request and lock to lustre_mdc_getxattr_interpret once the request has completed, which disposes of the lock.
+errno_t lustre_mdc_getxattr_prepare(struct lustre_import * import, struct lustre_dlm_namespace * namespace, const struct lu_fid * fid, uint32_t size, struct lustre_request ** result, struct lustre_dlm_lock ** lock)
+{
+    struct lustre_request *         request;
+    struct lustre_dlm_lock *        dlm_lock;
+    struct ldlm_request *           enqueue;
+    struct ldlm_intent *            intent;
+    struct mdt_body *               request_body;
+    union ldlm_wire_policy_data     policy;
+    struct ldlm_res_id              resource;
+    errno_t                         error;
+
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!namespace);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(size == 0);
+    LUSTRE_BUG_ON(!result);
+    LUSTRE_BUG_ON(!lock);
+
+    *result     = NULL;
+    *lock       = NULL;
+    resource    = lustre_dlm_resource_from_fid(fid);
+
+    request = lustre_request_alloc(import, kLustreOpcodeLDLMEnqueue);
+    if (!request) {
+        return ENOMEM;
+    }
+
+    dlm_lock = lustre_dlm_lock_alloc(namespace, import, kLustreDLMTypeIBits, kLustreDLMModePR, &resource);
+    if (!dlm_lock) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    enqueue         = lustre_request_field_add(request, sizeof(struct ldlm_request));
+    intent          = lustre_request_field_add(request, sizeof(struct ldlm_intent));
+    request_body    = lustre_request_field_add(request, sizeof(struct mdt_body));
+    if (!enqueue || !intent || !request_body || !lustre_request_field_add(request, 0)) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    bzero(&policy, sizeof(policy));
+    policy.l_inodebits.bits = kLustreInodeBitXattr;
+
+    lustre_dlm_lock_pack(dlm_lock, enqueue, kLustreDLMFlagHasIntent, &policy);
+
+    intent->opc                     = kLustreIntentGetxattr;
+    request_body->mbo_fid1          = *fid;
+    request_body->mbo_valid         = kLustreMDFlagXattrAll;
+    request_body->mbo_eadatasize    = size;
+
+    // The server sizes the names, the values and the value lengths all by what we asked for.
+
+    lustre_request_set_reply_size(request, kLustreMDCReplySize + 3 * size);
+
+    error = 0;
+
+end:
+    if (error == 0) {
+        *result = request;
+        *lock   = dlm_lock;
+    } else {
+        if (dlm_lock) {
+            lustre_dlm_lock_cancel(dlm_lock);
+            lustre_dlm_lock_ref_count_dec(dlm_lock);
+        }
+        lustre_request_ref_count_dec(request);
+    }
+
+    return error;
+}
+
+// Unpacks the reply to a completed getxattr intent into *xattrs, which the caller gives back with lustre_mdc_xattrs_release on success.
+// Takes over the caller's reference to dlm_lock, which ends up in *lock if the server granted it and is cancelled otherwise; with no lock
+// nothing tells us when the attributes change.
+errno_t lustre_mdc_getxattr_interpret(struct lustre_request * request, struct lustre_dlm_lock * dlm_lock, OSMallocTag malloc_tag, struct lustre_mdc_xattrs * xattrs, struct lustre_dlm_lock ** lock)
+{
+    const struct ldlm_reply *       reply;
+    const struct mdt_body *         reply_body;
+    const char *                    names;
+    const uint8_t *                 values;
+    const uint32_t *                lengths;
+    uint64_t                        total;
+    uint32_t                        offset;
+    size_t                          length;
+    uint32_t                        i;
+    errno_t                         error;
+
+    LUSTRE_BUG_ON(!request);
+    LUSTRE_BUG_ON(!dlm_lock);
+    LUSTRE_BUG_ON(!xattrs);
+    LUSTRE_BUG_ON(!lock);
+
+    bzero(xattrs, sizeof(struct lustre_mdc_xattrs));
+
+    *lock = NULL;
+
+    error = request->error;
+    if (error != 0) {
+        goto end;
+    }
+
+    reply       = lustre_request_reply_field(request, 1, sizeof(struct ldlm_reply), NULL);
+    reply_body  = lustre_request_reply_field(request, 2, sizeof(struct mdt_body), NULL);
+    if (!reply) {
+        error = EPROTO;
+        goto end;
+    }
+    if ((int64_t)reply->lock_policy_res2 != 0) {
+        error = lustre_request_errno_from_wire((int32_t)reply->lock_policy_res2);
+        goto end;
+    }
+    if (!reply_body) {
+        error = EPROTO;
+        goto end;
+    }
+
+    // The sizes travel in body fields that mean something else elsewhere: names in mbo_eadatasize, values in mbo_aclsize and the count
+    // in mbo_max_mdsize.
+
+    names   = NULL;
+    values  = NULL;
+    lengths = NULL;
+    if (reply_body->mbo_max_mdsize > 0) {
+        names   = lustre_request_reply_field(request, kLustreMDCXattrReplyNames, reply_body->mbo_eadatasize, NULL);
+        values  = lustre_request_reply_field(request, kLustreMDCXattrReplyNames + 1, reply_body->mbo_aclsize, NULL);
+        lengths = lustre_request_reply_field(request, kLustreMDCXattrReplyNames + 2, reply_body->mbo_max_mdsize * sizeof(uint32_t), NULL);
+        if (!names || !lengths || ((reply_body->mbo_aclsize > 0) && !values)) {
+            error = EPROTO;
+            goto end;
+        }
+    }
+
+    offset  = 0;
+    total   = 0;
+    for (i=0; i<reply_body->mbo_max_mdsize; i++) {
+        length = strnlen(names + offset, reply_body->mbo_eadatasize - offset);
+        if (offset + length >= reply_body->mbo_eadatasize) {
+            error = EPROTO;
+            goto end;
+        }
+        offset  += length + 1;
+        total   += lengths[i];
+    }
+    if (total > reply_body->mbo_aclsize) {
+        error = EPROTO;
+        goto end;
+    }
+
+    xattrs->count           = reply_body->mbo_max_mdsize;
+    xattrs->names_length    = offset;
+    xattrs->values_length   = (uint32_t)total;
+    if (xattrs->count > 0) {
+        xattrs->names   = OSMalloc(xattrs->names_length, malloc_tag);
+        xattrs->lengths = OSMalloc(xattrs->count * sizeof(uint32_t), malloc_tag);
+    }
+    if (xattrs->values_length > 0) {
+        xattrs->values  = OSMalloc(xattrs->values_length, malloc_tag);
+    }
+    if ((xattrs->count > 0) && (!xattrs->names || !xattrs->lengths || ((xattrs->values_length > 0) && !xattrs->values))) {
+        lustre_mdc_xattrs_release(xattrs, malloc_tag);
+        error = ENOMEM;
+        goto end;
+    }
+
+    if (xattrs->count > 0) {
+        memcpy(xattrs->names, names, xattrs->names_length);
+        memcpy(xattrs->lengths, lengths, xattrs->count * sizeof(uint32_t));
+    }
+    if (xattrs->values_length > 0) {
+        memcpy(xattrs->values, values, xattrs->values_length);
+    }
+
+    if (lustre_dlm_lock_granted(dlm_lock, reply)) {
+        *lock       = dlm_lock;
+        dlm_lock    = NULL;
+    }
+
+end:
+    if (dlm_lock) {
+        lustre_dlm_lock_cancel(dlm_lock);
+        lustre_dlm_lock_ref_count_dec(dlm_lock);
+    }
+
+    return error;
+}
+
+void lustre_mdc_xattrs_release(struct lustre_mdc_xattrs * xattrs, OSMallocTag malloc_tag)
+{
+    LUSTRE_BUG_ON(!xattrs);
+
+    if (xattrs->names) {
+        OSFree(xattrs->names, xattrs->names_length, malloc_tag);
+    }
+    if (xattrs->values) {
+        OSFree(xattrs->values, xattrs->values_length, malloc_tag);
+    }
+    if (xattrs->lengths) {
+        OSFree(xattrs->lengths, xattrs->count * sizeof(uint32_t), malloc_tag);
+    }
+    bzero(xattrs, sizeof(struct lustre_mdc_xattrs));
+}
+
+// Sets fid's extended attribute name (a full server name, namespace included) to length bytes of value, or removes it if value is NULL.
+// flags are kLustreXattrFlag* bits.  The MDT calls back every XATTR lock on the file, ours included, before it makes the change.
+errno_t lustre_mdc_setxattr(struct lustre_import * import, const struct lu_fid * fid, const char * name, const void * value, uint32_t length, uint32_t flags)
+{
+    struct lustre_request *         request;
+    struct mdt_rec_setxattr *       record;
+    char *                          request_name;
+    void *                          request_value;
+    struct timespec                 now;
+    size_t                          name_length;
+    errno_t                         error;
+
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!name);
+
+    if (!value) {
+        length = 0;
+    }
+    name_length = strlen(name);
+
+    request = lustre_request_alloc(import, kLustreOpcodeMDSReint);
+    if (!request) {
+        return ENOMEM;
+    }
+
+    // The capability is left empty, as for open.
+
+    record = lustre_request_field_add(request, sizeof(struct mdt_rec_setxattr));
+    if (!record || !lustre_request_field_add(request, 0)) {
+        error = ENOMEM;
+        goto end;
+    }
+    request_name    = lustre_request_field_add(request, (uint32_t)name_length + 1);
+    request_value   = lustre_request_field_add(request, length);
+    if (!request_name || !request_value) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    nanotime(&now);
+
+    record->sx_opcode   = kLustreReintSetxattr;
+    record->sx_fid      = *fid;
+    record->sx_valid    = value ? kLustreMDFlagXattr : kLustreMDFlagXattrRemove;
+    record->sx_time     = now.tv_sec;
+    record->sx_size     = length;
+    record->sx_flags    = flags;
+    memcpy(request_name, name, name_length);
+    if (length > 0) {
+        memcpy(request_value, value, length);
+    }
+
+    lustre_request_set_reply_size(request, kLustreMDCReplySize);
+
+    error = lustre_request_send(request);
+
+end:
+    lustre_request_ref_count_dec(request);
+
+    return error;
+}
+
+// Starts reading directory pages from hash onwards into segments, which must be whole directory pages.  Returns an error only if the
+// request couldn't be built; otherwise callback runs exactly once, failures to send included, and finds the number of bytes read in
+// request->bulk_transferred.
+errno_t lustre_mdc_readpage_async(struct lustre_import * import, const struct lu_fid * fid, uint64_t hash, const struct lustre_request_segment * segments, uint32_t count, lustre_request_callback callback, void * data)
+{
+    struct lustre_request *     request;
+    struct mdt_body *           body;
+    uint32_t                    length;
+    uint32_t                    i;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!segments);
+    LUSTRE_BUG_ON(!callback);
+
+    request = lustre_request_alloc(import, kLustreOpcodeMDSReadpage);
+    if (!request) {
+        return ENOMEM;
+    }
+
+    body = lustre_request_field_add(request, sizeof(struct mdt_body));
+    if (!body) {
+        error = ENOMEM;
+        goto end;
+    }
+
+    length = 0;
+    for (i=0; i<count; i++) {
+        LUSTRE_BUG_ON((segments[i].length % kLustreDirPageSize) != 0);
+        length += segments[i].length;
+    }
+
+    // The hash and size travel in fields that mean something else for other opcodes.
+
+    body->mbo_fid1  = *fid;
+    body->mbo_valid = kLustreMDFlagId;
+    body->mbo_size  = hash;
+    body->mbo_nlink = length;
+    body->mbo_mode  = kLustreDirentAttrFid | kLustreDirentAttrType;
+
+    lustre_request_set_bulk(request, kLustreRequestBulkPut, kLustrePortalMDSBulk, segments, count);
+    lustre_request_set_callback(request, callback, data);
+
+    // A failure to send completes the request, so the callback has already heard about it.
+
+    (void)lustre_request_send_async(request);
+    error = 0;
+
+end:
+    lustre_request_ref_count_dec(request);
+
+    return error;
+}
@@ -0,0 +1,76 @@
+//
+//  mdc.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Metadata client: the RPCs we send to MDTs.
+
+#ifndef lustre_mdc_h
+#define lustre_mdc_h
+
+#include <sys/types.h>
+#include <libkern/OSMalloc.h>
+#include "wire.h"
+#include "dlm.h"
+#include "request.h"
+
+struct lustre_import;
+struct lustre_layout;
+
+// What an open's reply carries besides the handle: the file's layout and, for a small file kept on the MDT, some or all of its data.
+struct lustre_mdc_open_reply {
+    struct mdt_body                                 body;                           // attributes and the open handle
+    struct lustre_layout *                          layout;                         // with a reference, or NULL if the file has none
+    uint64_t                                        data_offset;                    // page aligned
+    uint32_t                                        data_length;                    // file bytes from data_offset; the page is zeroes past them
+    void *                                          data;                           // data_length bytes, or NULL
+};
+
+// A file's whole set of extended attributes, as a getxattr intent returns it: count names, each terminated, back to back in names, and
+// their values back to back in values in the same order, lengths[i] bytes each.
+struct lustre_mdc_xattrs {
+    char *                                          names;
+    uint32_t                                        names_length;
+    uint8_t *                                       values;
+    uint32_t                                        values_length;
+    uint32_t *                                      lengths;
+    uint32_t                                        count;
+};
+
+errno_t     lustre_mdc_get_root(struct lustre_import * import, struct lu_fid * fid);
+errno_t     lustre_mdc_getattr(struct lustre_import * import, const struct lu_fid * fid, struct mdt_body * body);
+errno_t     lustre_mdc_getattr_prepare(struct lustre_import * import, const struct lu_fid * fid, struct lustre_request ** request);
+errno_t     lustre_mdc_getattr_interpret(struct lustre_request * request, struct mdt_body * body);
+errno_t     lustre_mdc_getattr_layout(struct lustre_import * import, const struct lu_fid * fid, OSMallocTag malloc_tag, struct mdt_body * body, struct lustre_layout ** layout);
+errno_t     lustre_mdc_lookup(struct lustre_import * import, struct lustre_dlm_namespace * namespace, const struct lu_fid * parent, const char * name, size_t length, struct mdt_body * body, struct lustre_dlm_lock ** lock);
+errno_t     lustre_mdc_lookup_prepare(struct lustre_import * import, struct lustre_dlm_namespace * namespace, const struct lu_fid * parent, const char * name, size_t length, struct lustre_request ** request, struct lustre_dlm_lock ** lock);
+errno_t     lustre_mdc_lookup_interpret(struct lustre_request * request, struct lustre_dlm_lock * dlm_lock, struct mdt_body * body, struct lustre_dlm_lock ** lock);
+errno_t     lustre_mdc_update_lock(struct lustre_import * import, struct lustre_dlm_namespace * namespace, const struct lu_fid * fid, struct lustre_dlm_lock ** lock);
+errno_t     lustre_mdc_flock(struct lustre_import * import, struct lustre_dlm_namespace * namespace, const struct lu_fid * fid, enum lustre_dlm_mode mode, uint32_t flags, const struct ldlm_flock_wire * flock, struct ldlm_lock_desc * desc);
+errno_t     lustre_mdc_open(struct lustre_import * import, struct lustre_dlm_namespace * namespace, const struct lu_fid * fid, uint64_t flags, OSMallocTag malloc_tag, struct lustre_mdc_open_reply * reply, struct lustre_dlm_lock ** lock);
+void        lustre_mdc_open_reply_release(struct lustre_mdc_open_reply * reply, OSMallocTag malloc_tag);
+errno_t     lustre_mdc_close(struct lustre_import * import, const struct lu_fid * fid, struct lustre_handle handle);
+errno_t     lustre_mdc_close_prepare(struct lustre_import * import, const struct lu_fid * fid, struct lustre_handle handle, struct lustre_request ** request);
+errno_t     lustre_mdc_getxattr_prepare(struct lustre_import * import, struct lustre_dlm_namespace * namespace, const struct lu_fid * fid, uint32_t size, struct lustre_request ** request, struct lustre_dlm_lock ** lock);
+errno_t     lustre_mdc_getxattr_interpret(struct lustre_request * request, struct lustre_dlm_lock * dlm_lock, OSMallocTag malloc_tag, struct lustre_mdc_xattrs * xattrs, struct lustre_dlm_lock ** lock);
+void        lustre_mdc_xattrs_release(struct lustre_mdc_xattrs * xattrs, OSMallocTag malloc_tag);
+errno_t     lustre_mdc_setxattr(struct lustre_import * import, const struct lu_fid * fid, const char * name, const void * value, uint32_t length, uint32_t flags);
+errno_t     lustre_mdc_readpage_async(struct lustre_import * import, const struct lu_fid * fid, uint64_t hash, const struct lustre_request_segment * segments, uint32_t count, lustre_request_callback callback, void * data);
+
+#endif /* lustre_mdc_h */
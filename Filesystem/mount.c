@@ -24,9 +24,11 @@
 #include <sys/disk.h>
 #include <sys/proc.h>
 #include <libkern/libkern.h>
+#include <mach/vm_param.h>
 
 #include "mount.h"
 #include "volume.h"
+#include "sysctl.h"
 #include "logging.h"
 #include "assert.h"
 #include "mount_args.h"
@@ -38,6 +40,8 @@
 void lustre_mount_init_get_attr_list_goop(struct vfs_attr * attr)
 {
     attr->f_capabilities.capabilities[VOL_CAPABILITIES_FORMAT]      = 0
+    | VOL_CAP_FMT_SPARSE_FILES
+    | VOL_CAP_FMT_ZERO_RUNS
     | VOL_CAP_FMT_CASE_SENSITIVE
     | VOL_CAP_FMT_FAST_STATFS
     | VOL_CAP_FMT_2TB_FILESIZE
@@ -65,7 +69,11 @@ void lustre_mount_init_get_attr_list_goop(struct vfs_attr * attr)
     | VOL_CAP_FMT_64BIT_OBJECT_IDS
     ;
     attr->f_capabilities.capabilities[VOL_CAPABILITIES_INTERFACES]  = 0
+    | VOL_CAP_INT_SEARCHFS
     | VOL_CAP_INT_READDIRATTR
+    | VOL_CAP_INT_ADVLOCK
+    | VOL_CAP_INT_FLOCK
+    | VOL_CAP_INT_EXTENDED_ATTR
     ;
     attr->f_capabilities.valid[VOL_CAPABILITIES_INTERFACES]         = 0
     | VOL_CAP_INT_SEARCHFS
@@ -212,7 +220,14 @@ errno_t lustre_mount_setup(struct lustre_volume * volume, user_addr_t data, vfs_
         goto end;
     }
     
+    error = lustre_volume_connect(volume);
+    if (error != 0) {
+        os_log_error(lustre_logger_vfs, "Failed to connect volume");
+        goto end;
+    }
+    
     lustre_volume_set_ready(volume);
+    lustre_sysctl_volume_add(volume);
     
 end:
     
@@ -241,6 +256,8 @@ void lustre_mount_setup_vfs(struct lustre_volume * volume)
 {
     struct vfs_attr     attr;
     struct vfsstatfs *  statfs;
+    struct vfsioattr    ioattr;
+    uint32_t            cluster_size;
     
     LUSTRE_BUG_ON(!volume);
     LUSTRE_BUG_ON(volume->root_vnode);
@@ -309,5 +326,17 @@ void lustre_mount_setup_vfs(struct lustre_volume * volume)
     
     strlcpy(statfs->f_mntfromname, lustre_volume_url(volume), MAXPATHLEN);
     
+    // The cluster layer reads and writes this much at a time; see lustre_volume_cluster_size.
+    
+    cluster_size = lustre_volume_cluster_size(volume);
+    vfs_ioattr(volume->mount_point, &ioattr);
+    ioattr.io_maxreadcnt        = cluster_size;
+    ioattr.io_maxwritecnt       = cluster_size;
+    ioattr.io_segreadcnt        = cluster_size / PAGE_SIZE;
+    ioattr.io_segwritecnt       = cluster_size / PAGE_SIZE;
+    ioattr.io_maxsegreadsize    = cluster_size;
+    ioattr.io_maxsegwritesize   = cluster_size;
+    vfs_setioattr(volume->mount_point, &ioattr);
+    
     vfs_setflags(volume->mount_point, volume->mount_args.flags);    
 }
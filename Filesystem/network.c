@@ -0,0 +1,1940 @@
+//
+//  network.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <libkern/OSAtomic.h>
+#include <libkern/libkern.h>
+#include <kern/thread.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/kpi_mbuf.h>
+#include <netinet/tcp.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "network.h"
+#include "request.h"
+#include "import.h"
+#include "dlm.h"
+#include "ksock.h"
+#include "logging.h"
+#include "assert.h"
+
+static const uint32_t   kLustreNetworkTypeTCP               = 2;                // SOCKLND
+static const uint16_t   kLustreNetworkPortReservedMin       = 512;              // servers only accept connections from reserved ports
+static const uint16_t   kLustreNetworkPortReservedMax       = 1023;
+static const uint32_t   kLustreNetworkIovecs                = 16;               // segments handed to each socket call
+static const int        kLustreNetworkSocketBuffer          = 2 * 1024 * 1024;  // bulk connections only
+static const uint32_t   kLustreNetworkNIDStringSize         = 32;
+static const int32_t    kLustreNetworkStatusNoLock          = -22;              // -EINVAL, what Linux clients answer for locks they don't have
+static const int32_t    kLustreNetworkStatusNoLockData      = -303;             // -ELDLM_NO_LOCK_DATA: nothing cached to glimpse
+static const int32_t    kLustreNetworkStatusNotSupported    = -95;              // -EOPNOTSUPP, as Linux numbers it
+static const uint32_t   kLustreNetworkCallbackPeek          = 512;              // read of a lock callback to find its handle in
+
+// A request from a server (only ever a lock callback), waiting for its peer's callback thread.
+struct lustre_network_callback {
+    struct lustre_network_peer *                    peer;                           // with a reference, for the reply
+    struct lustre_dlm_namespace *                   namespace;                      // with a use counted; NULL if the handle is nobody's
+    OSMallocTag                                     malloc_tag;                     // the namespace's, if any
+    uint64_t                                        xid;                            // the server's, which our reply is matched by
+    void *                                          message;
+    uint32_t                                        length;
+    struct lustre_network_callback *                next;
+};
+
+// Requests a failed peer had outstanding, being failed once their bulk has stopped.
+struct lustre_network_drain {
+    struct lustre_network_peer *                    peer;                           // with a reference
+    struct lustre_network_pending *                 list;
+    errno_t                                         error;
+};
+
+static lck_mtx_t *                          lustre_network_lock             = NULL;     // protects following
+static struct lustre_network_peer *         lustre_network_peers            = NULL;
+static struct lustre_dlm_namespace *        lustre_network_namespaces[kLustreNetworkNamespacesMax];    // by network id
+static uint32_t                             lustre_network_threads          = 0;
+
+static uint64_t                             lustre_network_incarnation      = 0;        // tells servers a reloaded kext is someone new
+static volatile SInt64                      lustre_network_last_xid         = 0;
+
+static void lustre_network_receiver(void * parameter, wait_result_t wait_result);
+static void lustre_network_sender(void * parameter, wait_result_t wait_result);
+static void lustre_network_connector(void * parameter, wait_result_t wait_result);
+static void lustre_network_callback_thread(void * parameter, wait_result_t wait_result);
+
+#pragma mark - Internal
+
+// Formats a NID the way lctl does, for logging.
+static void lustre_network_nid_string(uint64_t nid, char * buffer)
+{
+    uint32_t address;
+
+    address = (uint32_t)nid;
+
+    snprintf(buffer, kLustreNetworkNIDStringSize, "%u.%u.%u.%u@tcp", (address >> 24) & 0xff, (address >> 16) & 0xff, (address >> 8) & 0xff, address & 0xff);
+}
+
+// Every thread the network starts is counted, so unregistering can wait until none of them is left running our code.
+static errno_t lustre_network_thread_start(thread_continue_t function, void * parameter)
+{
+    thread_t thread;
+
+    lck_mtx_lock(lustre_network_lock);
+    lustre_network_threads += 1;
+    lck_mtx_unlock(lustre_network_lock);
+
+    if (kernel_thread_start(function, parameter, &thread) != KERN_SUCCESS) {
+        lck_mtx_lock(lustre_network_lock);
+        lustre_network_threads -= 1;
+        wakeup(&lustre_network_threads);
+        lck_mtx_unlock(lustre_network_lock);
+        return ENOMEM;
+    }
+    thread_deallocate(thread);
+
+    return 0;
+}
+
+static void lustre_network_thread_exit(void)
+{
+    lck_mtx_lock(lustre_network_lock);
+    LUSTRE_BUG_ON(lustre_network_threads == 0);
+    lustre_network_threads -= 1;
+    wakeup(&lustre_network_threads);
+    lck_mtx_unlock(lustre_network_lock);
+
+    thread_terminate(current_thread());
+}
+
+static uint32_t lustre_network_bucket(uint64_t xid)
+{
+    return (uint32_t)(xid / kLustreNetworkXidStep) & (kLustreNetworkPendingBuckets - 1);
+}
+
+// The portal each kind of request is served on.  Replies come back to portals fixed by the service, so they're matched by xid alone.
+static uint32_t lustre_network_request_portal(const struct lustre_request * request)
+{
+    if (request->opcode == kLustreOpcodeLDLMCancel) {
+        return kLustrePortalLDLMCancelRequest;
+    }
+
+    switch (request->import->type) {
+        case kLustreImportTypeMGS:
+            return kLustrePortalMGSRequest;
+        case kLustreImportTypeMDT:
+            return (request->opcode == kLustreOpcodeMDSReadpage) ? kLustrePortalMDSReadpage : kLustrePortalMDSRequest;
+        case kLustreImportTypeOST:
+            return ((request->opcode == kLustreOpcodeOSTRead) || (request->opcode == kLustreOpcodeOSTWrite)) ? kLustrePortalOSTIO : kLustrePortalOSTRequest;
+    }
+
+    LUSTRE_BUG();
+}
+
+static uint32_t lustre_network_bulk_length(const struct lustre_request * request)
+{
+    uint32_t    length;
+    uint32_t    i;
+
+    length = 0;
+    for (i=0; i<request->bulk_count; i++) {
+        length += request->bulk_segments[i].length;
+    }
+
+    return length;
+}
+
+// Bulk for a request arrives in LNet-sized pieces, each matched by one of the request's match bits in turn; where a piece goes in the
+// segments follows from which one it is.
+static uint32_t lustre_network_bulk_offset(const struct lustre_network_pending * pending, uint64_t match_bits, uint32_t offset)
+{
+    return (uint32_t)(match_bits - pending->xid) * kLustreLNetMTU + offset;
+}
+
+// Starts a walk over the request's bulk segments, offset bytes in.
+static void lustre_network_cursor_init(struct lustre_ksock_cursor * cursor, const struct lustre_request * request, uint32_t offset)
+{
+    lustre_ksock_cursor_init(cursor, (const struct lustre_ksock_segment *)request->bulk_segments, request->bulk_count, offset);
+}
+
+// Fills in what every message we send has in common.
+static void lustre_network_header(const struct lustre_network_peer * peer, struct ksock_msg * header, uint32_t type, uint32_t payload_length)
+{
+    lustre_ksock_header(header, peer->nid, peer->local_nid, type, payload_length);
+}
+
+#pragma mark - Pending Requests
+
+// Called with the peer lock held.
+static void lustre_network_pending_link(struct lustre_network_peer * peer, struct lustre_network_pending * pending)
+{
+    struct lustre_network_pending ** bucket;
+
+    bucket = &peer->pending[lustre_network_bucket(pending->xid)];
+
+    pending->next   = *bucket;
+    pending->linked = TRUE;
+    *bucket         = pending;
+}
+
+// Called with the peer lock held.  Finds the request that owns xid, and unlinks it if asked to.  A request only matches itself when
+// given, since an xid from before a reconnect may still be around.
+static struct lustre_network_pending * lustre_network_pending_find(struct lustre_network_peer * peer, uint64_t xid, const struct lustre_request * request, boolean_t unlink)
+{
+    struct lustre_network_pending **    link;
+    struct lustre_network_pending *     pending;
+
+    for (link = &peer->pending[lustre_network_bucket(xid)]; (pending = *link); link = &pending->next) {
+        if ((pending->xid == xid) && (!request || (pending->request == request))) {
+            if (unlink) {
+                *link           = pending->next;
+                pending->next   = NULL;
+                pending->linked = FALSE;
+            }
+            return pending;
+        }
+    }
+
+    return NULL;
+}
+
+static void lustre_network_pending_free(struct lustre_network_pending * pending)
+{
+    lustre_request_ref_count_dec(pending->request);
+    OSFree(pending, sizeof(struct lustre_network_pending), pending->malloc_tag);
+}
+
+#pragma mark - Connections
+
+static void lustre_network_peer_release(struct lustre_network_peer * peer)
+{
+    if (OSDecrementAtomic(&peer->ref_count) != 1) {
+        return;
+    }
+
+    LUSTRE_BUG_ON(peer->state == kLustreNetworkPeerReady);
+
+    lck_mtx_free(peer->lock, lustre_lock_group);
+    OSFree(peer, sizeof(struct lustre_network_peer), lustre_os_malloc_tag);
+}
+
+static void lustre_network_conn_release(struct lustre_network_conn * conn)
+{
+    struct lustre_network_peer * peer;
+
+    if (OSDecrementAtomic(&conn->ref_count) != 1) {
+        return;
+    }
+
+    peer = conn->peer;
+
+    LUSTRE_BUG_ON(conn->queue);
+
+    if (conn->socket) {
+        sock_close(conn->socket);
+    }
+    if (conn->send_lock) {
+        lck_mtx_free(conn->send_lock, lustre_lock_group);
+    }
+    OSFree(conn, sizeof(struct lustre_network_conn), lustre_os_malloc_tag);
+
+    lustre_network_peer_release(peer);
+}
+
+// Stops the connection for good: the threads on it see the socket shut down and leave, and anything still queued for the bulk out thread
+// is dropped, so nobody waits on it.
+static void lustre_network_conn_close(struct lustre_network_conn * conn)
+{
+    struct lustre_network_peer *    peer;
+    struct lustre_network_tx *      tx;
+
+    peer = conn->peer;
+
+    lck_mtx_lock(peer->lock);
+    conn->closing = TRUE;
+    while ((tx = conn->queue)) {
+        conn->queue         = tx->next;
+        tx->pending->busy   = FALSE;
+        wakeup(tx->pending);
+        OSFree(tx, sizeof(struct lustre_network_tx), tx->malloc_tag);
+    }
+    conn->queue_tail = &conn->queue;
+    wakeup(&conn->queue);
+    lck_mtx_unlock(peer->lock);
+
+    if (conn->socket) {
+        (void)sock_shutdown(conn->socket, SHUT_RDWR);
+    }
+}
+
+// Sends one whole message.  Called with the connection's send lock held, so messages from different threads never interleave.
+static errno_t lustre_network_conn_write(struct lustre_network_conn * conn, struct iovec * iov, uint32_t count)
+{
+    struct msghdr   msg;
+    size_t          length;
+    size_t          sent;
+    errno_t         error;
+    uint32_t        i;
+
+    if (conn->closing) {
+        return ENOTCONN;
+    }
+
+    length = 0;
+    for (i=0; i<count; i++) {
+        length += iov[i].iov_len;
+    }
+
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov     = iov;
+    msg.msg_iovlen  = (int)count;
+
+    sent  = 0;
+    error = sock_send(conn->socket, &msg, 0, &sent);
+    if ((error == 0) && (sent != length)) {
+        error = ETIMEDOUT;
+    }
+
+    return error;
+}
+
+// Receives exactly the bytes iov describes, which it uses up.  Between messages a connection may sit idle as long as it likes; once a
+// message has started, going kLustreNetworkTimeoutSeconds without progress fails it.
+static errno_t lustre_network_conn_receive(struct lustre_network_conn * conn, struct iovec * iov, uint32_t count, boolean_t idle)
+{
+    struct msghdr   msg;
+    size_t          received;
+    errno_t         error;
+
+    while ((count > 0) && (iov[0].iov_len == 0)) {
+        iov++;
+        count--;
+    }
+
+    while (count > 0) {
+        bzero(&msg, sizeof(msg));
+        msg.msg_iov     = iov;
+        msg.msg_iovlen  = (int)count;
+
+        received = 0;
+        error    = sock_receive(conn->socket, &msg, MSG_WAITALL, &received);
+        if ((error == EWOULDBLOCK) && (received == 0) && idle && !conn->closing) {
+            continue;
+        }
+        if ((error == EWOULDBLOCK) && (received > 0)) {
+            error = 0;
+        }
+        if (error != 0) {
+            return error;
+        }
+        if (received == 0) {
+            return ECONNRESET;
+        }
+
+        idle = FALSE;
+
+        while ((count > 0) && (received >= iov[0].iov_len)) {
+            received -= iov[0].iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov[0].iov_base  = (uint8_t *)iov[0].iov_base + received;
+            iov[0].iov_len  -= received;
+        }
+    }
+
+    return 0;
+}
+
+static errno_t lustre_network_conn_receive_buffer(struct lustre_network_conn * conn, void * buffer, uint32_t length, boolean_t idle)
+{
+    struct iovec iov;
+
+    iov.iov_base    = buffer;
+    iov.iov_len     = length;
+
+    return lustre_network_conn_receive(conn, &iov, 1, idle);
+}
+
+// Throws away payload nobody wants, without having to find somewhere to put it.
+static errno_t lustre_network_conn_skip(struct lustre_network_conn * conn, uint32_t length)
+{
+    mbuf_t      data;
+    size_t      received;
+    errno_t     error;
+
+    while (length > 0) {
+        data        = NULL;
+        received    = length;
+        error       = sock_receivembuf(conn->socket, NULL, &data, MSG_WAITALL, &received);
+        if (data) {
+            mbuf_freem(data);
+        }
+        if ((error == EWOULDBLOCK) && (received > 0)) {
+            error = 0;
+        }
+        if (error != 0) {
+            return error;
+        }
+        if (received == 0) {
+            return ECONNRESET;
+        }
+        length -= (uint32_t)received;
+    }
+
+    return 0;
+}
+
+// Called with the peer lock held.  Takes the connections and every request waiting on them away from the peer; lustre_network_peer_abort
+// finishes them off without the lock.
+static void lustre_network_peer_detach(struct lustre_network_peer * peer, struct lustre_network_conn ** conns, struct lustre_network_pending ** list)
+{
+    struct lustre_network_pending * pending;
+    uint32_t                        i;
+
+    for (i=0; i<kLustreNetworkConnCount; i++) {
+        conns[i]        = peer->conns[i];
+        peer->conns[i]  = NULL;
+    }
+
+    *list = NULL;
+    for (i=0; i<kLustreNetworkPendingBuckets; i++) {
+        while ((pending = peer->pending[i])) {
+            peer->pending[i]    = pending->next;
+            pending->linked     = FALSE;
+            pending->next       = *list;
+            *list               = pending;
+        }
+    }
+
+    peer->draining += 1;
+}
+
+// Fails the requests detached from the peer, once no bulk is moving for any of them.  Bulk sent without copying isn't done moving until
+// the stack gives the pages back, which may take the connection's socket being closed.  A request that was never answered may or may not
+// have been carried out, and can't be sent again under the same xid once its import reconnects as a new client, so unless the peer is
+// going away its import is marked disconnected first and recovered like one the server evicted.
+static void lustre_network_peer_drain(struct lustre_network_peer * peer, struct lustre_network_pending * list, errno_t error)
+{
+    struct lustre_network_pending * pending;
+
+    lck_mtx_lock(peer->lock);
+    for (pending = list; pending; pending = pending->next) {
+        while (pending->busy) {
+            (void)msleep(pending, peer->lock, PINOD, __FUNCTION__, NULL);
+        }
+    }
+    peer->draining -= 1;
+    wakeup(&peer->draining);
+    lck_mtx_unlock(peer->lock);
+
+    while ((pending = list)) {
+        list = pending->next;
+        if (error != ESHUTDOWN) {
+            lustre_import_disconnected(pending->request->import, pending->request->handle, error);
+        }
+        lustre_request_complete(pending->request, NULL, 0, error);
+        lustre_network_pending_free(pending);
+    }
+}
+
+static void lustre_network_drainer(void * parameter, wait_result_t wait_result)
+{
+    struct lustre_network_drain * drain;
+
+    drain = parameter;
+
+    lustre_network_peer_drain(drain->peer, drain->list, drain->error);
+
+    lustre_network_peer_release(drain->peer);
+    OSFree(drain, sizeof(struct lustre_network_drain), lustre_os_malloc_tag);
+
+    lustre_network_thread_exit();
+}
+
+// Closes the connections detached from the peer and fails the requests that were waiting on them.  The caller may hold a reference on
+// one of the connections, which would keep its socket open and its pages lent for as long as it waited, so unless told it may wait the
+// requests are drained from a thread of their own.
+static void lustre_network_peer_abort(struct lustre_network_peer * peer, struct lustre_network_conn ** conns, struct lustre_network_pending * list, errno_t error, boolean_t wait)
+{
+    struct lustre_network_drain *   drain;
+    uint32_t                        i;
+
+    for (i=0; i<kLustreNetworkConnCount; i++) {
+        if (conns[i]) {
+            lustre_network_conn_close(conns[i]);
+            lustre_network_conn_release(conns[i]);
+        }
+    }
+
+    if (!wait && list) {
+        drain = OSMalloc(sizeof(struct lustre_network_drain), lustre_os_malloc_tag);
+        if (drain) {
+            OSIncrementAtomic(&peer->ref_count);
+            drain->peer     = peer;
+            drain->list     = list;
+            drain->error    = error;
+            if (lustre_network_thread_start(lustre_network_drainer, drain) == 0) {
+                return;
+            }
+            OSDecrementAtomic(&peer->ref_count);
+            OSFree(drain, sizeof(struct lustre_network_drain), lustre_os_malloc_tag);
+        }
+        os_log_error(lustre_logger_network, "Couldn't start drain, failing requests from this thread");
+    }
+
+    lustre_network_peer_drain(peer, list, error);
+}
+
+// Any error on any of a peer's connections takes them all down, and everything outstanding on them fails, taking its import down too.
+// The next send reconnects the peer; imports with nothing outstanding carry on over the new connections.
+static void lustre_network_peer_fail(struct lustre_network_conn * conn, errno_t error)
+{
+    struct lustre_network_peer *    peer;
+    struct lustre_network_conn *    conns[kLustreNetworkConnCount];
+    struct lustre_network_pending * list;
+    char                            name[kLustreNetworkNIDStringSize];
+
+    peer = conn->peer;
+
+    lck_mtx_lock(peer->lock);
+    if (peer->conns[conn->type] != conn) {
+        lck_mtx_unlock(peer->lock);
+        return;
+    }
+    lustre_network_peer_detach(peer, conns, &list);
+    if (peer->state == kLustreNetworkPeerReady) {
+        peer->state = kLustreNetworkPeerIdle;
+    }
+    peer->error = error;
+    lck_mtx_unlock(peer->lock);
+
+    lustre_network_nid_string(peer->nid, name);
+    os_log_error(lustre_logger_network, "Lost connection to %{public}s, error %d", name, error);
+
+    lustre_network_peer_abort(peer, conns, list, ENOTCONN, FALSE);
+}
+
+// Sends one message on whichever connection suits its size.
+static errno_t lustre_network_peer_send(struct lustre_network_peer * peer, struct iovec * iov, uint32_t count)
+{
+    struct lustre_network_conn *    conn;
+    size_t                          length;
+    errno_t                         error;
+    uint32_t                        i;
+
+    length = 0;
+    for (i=0; i<count; i++) {
+        length += iov[i].iov_len;
+    }
+
+    lck_mtx_lock(peer->lock);
+    conn = peer->conns[(length >= kLustreNetworkBulkMin) ? kLustreNetworkConnBulkOut : kLustreNetworkConnControl];
+    if (conn) {
+        OSIncrementAtomic(&conn->ref_count);
+    }
+    lck_mtx_unlock(peer->lock);
+
+    if (!conn) {
+        return ENOTCONN;
+    }
+
+    lck_mtx_lock(conn->send_lock);
+    error = lustre_network_conn_write(conn, iov, count);
+    lck_mtx_unlock(conn->send_lock);
+
+    if (error != 0) {
+        lustre_network_peer_fail(conn, error);
+    }
+
+    lustre_network_conn_release(conn);
+
+    return error;
+}
+
+// Binds to the highest free reserved port, as Linux clients do.  Only works from a kernel thread, which is where connections are opened.
+static errno_t lustre_network_conn_bind(struct lustre_network_conn * conn)
+{
+    struct sockaddr_in  address;
+    uint16_t            port;
+    errno_t             error;
+
+    error = EADDRINUSE;
+    for (port = kLustreNetworkPortReservedMax; (port >= kLustreNetworkPortReservedMin) && (error == EADDRINUSE); port--) {
+        bzero(&address, sizeof(address));
+        address.sin_len         = sizeof(address);
+        address.sin_family      = AF_INET;
+        address.sin_port        = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+        error = sock_bind(conn->socket, (struct sockaddr *)&address);
+    }
+
+    return error;
+}
+
+// Speaks the acceptor's request and socklnd's hello, and checks the server's hello back.  The server describes the connection from its
+// own side, so what's bulk in for us is bulk out for it.
+static errno_t lustre_network_conn_handshake(struct lustre_network_conn * conn, uint64_t local_nid)
+{
+    static const uint32_t               wire_types[kLustreNetworkConnCount]     = { kLustreKsockConnControl, kLustreKsockConnBulkIn, kLustreKsockConnBulkOut };
+    static const uint32_t               server_types[kLustreNetworkConnCount]   = { kLustreKsockConnControl, kLustreKsockConnBulkOut, kLustreKsockConnBulkIn };
+    struct lustre_network_peer *        peer;
+    struct lnet_acceptor_connreq        request;
+    struct ksock_hello_msg              hello;
+    uint32_t                            addresses[kLustreLNetInterfacesMax];
+    struct iovec                        iov[2];
+    char                                name[kLustreNetworkNIDStringSize];
+    errno_t                             error;
+
+    peer = conn->peer;
+
+    lustre_network_nid_string(peer->nid, name);
+
+    lustre_ksock_hello(&request, &hello, local_nid, peer->nid, lustre_network_incarnation, wire_types[conn->type]);
+
+    iov[0].iov_base = &request;
+    iov[0].iov_len  = sizeof(request);
+    iov[1].iov_base = &hello;
+    iov[1].iov_len  = sizeof(hello);
+
+    error = lustre_network_conn_write(conn, iov, 2);
+    if (error != 0) {
+        return error;
+    }
+
+    // Magic and version come first, since they say how long the rest is.
+
+    bzero(&hello, sizeof(hello));
+    error = lustre_network_conn_receive_buffer(conn, &hello, offsetof(struct ksock_hello_msg, kshm_src_nid), FALSE);
+    if (error != 0) {
+        return error;
+    }
+    error = lustre_ksock_hello_check_version(&hello);
+    if (error != 0) {
+        if (hello.kshm_magic == kLustreLNetProtoMagicSwabbed) {
+            os_log_error(lustre_logger_network, "Big endian peers are not supported");
+        } else {
+            os_log_error(lustre_logger_network, "%{public}s answered with magic 0x%x, socklnd version %u", name, hello.kshm_magic, hello.kshm_version);
+        }
+        return error;
+    }
+
+    error = lustre_network_conn_receive_buffer(conn, &hello.kshm_src_nid, sizeof(hello) - offsetof(struct ksock_hello_msg, kshm_src_nid), FALSE);
+    if (error != 0) {
+        return error;
+    }
+    error = lustre_ksock_hello_check(&hello, peer->nid, server_types[conn->type]);
+    if (error == ECONNREFUSED) {
+        os_log_error(lustre_logger_network, "%{public}s turned down a connection", name);
+        return error;
+    }
+    if (error != 0) {
+        os_log_error(lustre_logger_network, "%{public}s answered as NID 0x%llx with connection type %u and %u addresses", name, hello.kshm_src_nid, hello.kshm_ctype, hello.kshm_nips);
+        return error;
+    }
+
+    return lustre_network_conn_receive_buffer(conn, addresses, hello.kshm_nips * (uint32_t)sizeof(uint32_t), FALSE);
+}
+
+// Opens one connection of the given type, returning it with a reference.  local_nid is set to the address the server sees us at.
+static errno_t lustre_network_conn_open(struct lustre_network_peer * peer, enum lustre_network_conn_type type, uint64_t * local_nid, struct lustre_network_conn ** result)
+{
+    struct lustre_network_conn *    conn;
+    struct sockaddr_in              address;
+    struct timeval                  timeout;
+    struct linger                   linger;
+    int                             option;
+    errno_t                         error;
+
+    conn = OSMalloc(sizeof(struct lustre_network_conn), lustre_os_malloc_tag);
+    if (!conn) {
+        os_log_error(lustre_logger_network, "Couldn't allocate connection");
+        return ENOMEM;
+    }
+
+    bzero(conn, sizeof(struct lustre_network_conn));
+
+    OSIncrementAtomic(&peer->ref_count);
+    conn->peer          = peer;
+    conn->type          = type;
+    conn->queue_tail    = &conn->queue;
+    conn->ref_count     = 1;
+
+    conn->send_lock = lck_mtx_alloc_init(lustre_lock_group, NULL);
+    if (!conn->send_lock) {
+        os_log_error(lustre_logger_network, "Couldn't allocate connection lock");
+        error = ENOMEM;
+        goto end;
+    }
+
+    error = sock_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, NULL, &conn->socket);
+    if (error != 0) {
+        conn->socket = NULL;
+        goto end;
+    }
+
+    timeout = (struct timeval){ kLustreNetworkTimeoutSeconds, 0 };
+    linger  = (struct linger){ 1, 0 };
+    option  = 1;
+
+    (void)sock_setsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+    (void)sock_setsockopt(conn->socket, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof(option));
+    (void)sock_setsockopt(conn->socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    (void)sock_setsockopt(conn->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (type != kLustreNetworkConnControl) {
+        option = kLustreNetworkSocketBuffer;
+        (void)sock_setsockopt(conn->socket, SOL_SOCKET, SO_SNDBUF, &option, sizeof(option));
+        (void)sock_setsockopt(conn->socket, SOL_SOCKET, SO_RCVBUF, &option, sizeof(option));
+    }
+    if (type == kLustreNetworkConnBulkOut) {
+        (void)sock_setsockopt(conn->socket, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));    // closing frees lent pages at once
+    }
+
+    error = lustre_network_conn_bind(conn);
+    if (error != 0) {
+        os_log_error(lustre_logger_network, "Couldn't bind a reserved port, error %d", error);
+        goto end;
+    }
+
+    bzero(&address, sizeof(address));
+    address.sin_len         = sizeof(address);
+    address.sin_family      = AF_INET;
+    address.sin_port        = htons(peer->port);
+    address.sin_addr.s_addr = htonl((uint32_t)peer->nid);
+
+    error = sock_connect(conn->socket, (struct sockaddr *)&address, MSG_DONTWAIT);
+    if (error == EINPROGRESS) {
+        error = sock_connectwait(conn->socket, &timeout);
+        if (error == EINPROGRESS) {
+            error = ETIMEDOUT;
+        }
+    }
+    if (error != 0) {
+        goto end;
+    }
+
+    bzero(&address, sizeof(address));
+    error = sock_getsockname(conn->socket, (struct sockaddr *)&address, sizeof(address));
+    if (error != 0) {
+        goto end;
+    }
+    *local_nid = lustre_network_nid(address.sin_addr);
+
+    error = lustre_network_conn_handshake(conn, *local_nid);
+
+end:
+    if (error != 0) {
+        lustre_network_conn_release(conn);
+        conn = NULL;
+    }
+
+    *result = conn;
+
+    return error;
+}
+
+#pragma mark - Namespaces
+
+// Finds the namespace a lock handle was made in from the id in its top bits, and counts a use of it, which keeps it from being removed
+// until lustre_network_namespace_put.
+static struct lustre_dlm_namespace * lustre_network_namespace_get(struct lustre_handle handle)
+{
+    struct lustre_dlm_namespace *   namespace;
+    uint64_t                        id;
+
+    id = handle.cookie >> kLustreDLMNamespaceShift;
+    if (id >= kLustreNetworkNamespacesMax) {
+        return NULL;
+    }
+
+    lck_mtx_lock(lustre_network_lock);
+    namespace = lustre_network_namespaces[id];
+    if (namespace) {
+        namespace->network_users += 1;
+    }
+    lck_mtx_unlock(lustre_network_lock);
+
+    return namespace;
+}
+
+static void lustre_network_namespace_put(struct lustre_dlm_namespace * namespace)
+{
+    if (!namespace) {
+        return;
+    }
+
+    lck_mtx_lock(lustre_network_lock);
+    LUSTRE_BUG_ON(namespace->network_users == 0);
+    namespace->network_users -= 1;
+    if (namespace->network_users == 0) {
+        wakeup(&namespace->network_users);
+    }
+    lck_mtx_unlock(lustre_network_lock);
+}
+
+static void lustre_network_callback_free(struct lustre_network_callback * callback)
+{
+    struct lustre_dlm_namespace *   namespace;
+    OSMallocTag                     malloc_tag;
+
+    namespace   = callback->namespace;
+    malloc_tag  = callback->malloc_tag;
+
+    lustre_network_peer_release(callback->peer);
+    OSFree(callback->message, callback->length, malloc_tag);
+    OSFree(callback, sizeof(struct lustre_network_callback), malloc_tag);
+
+    // Last, since the tag goes with the namespace's volume.
+
+    lustre_network_namespace_put(namespace);
+}
+
+#pragma mark - Receiving
+
+// Queues a lock callback for the peer's callback thread; handling one may take a while, and may need this connection to do it.  Enough
+// of it is read first to find the lock's handle, so it can be kept with the namespace the handle names, and allocated from its tag.
+static errno_t lustre_network_receive_callback(struct lustre_network_conn * conn, const struct lnet_hdr * hdr)
+{
+    struct lustre_network_peer *        peer;
+    struct lustre_network_callback *    callback;
+    struct lustre_dlm_namespace *       namespace;
+    const struct ldlm_request *         request;
+    OSMallocTag                         malloc_tag;
+    uint8_t                             peek[kLustreNetworkCallbackPeek];
+    uint32_t                            peeked;
+    boolean_t                           queued;
+    errno_t                             error;
+
+    peer = conn->peer;
+
+    if (hdr->payload_length == 0) {
+        return 0;
+    }
+
+    peeked  = MIN(hdr->payload_length, kLustreNetworkCallbackPeek);
+    error   = lustre_network_conn_receive_buffer(conn, peek, peeked, FALSE);
+    if (error != 0) {
+        return error;
+    }
+
+    request     = lustre_request_message_field(peek, peeked, 1, sizeof(struct ldlm_request), NULL);
+    namespace   = request ? lustre_network_namespace_get(request->lock_handle[0]) : NULL;
+    malloc_tag  = namespace ? namespace->malloc_tag : lustre_os_malloc_tag;
+
+    callback = OSMalloc(sizeof(struct lustre_network_callback), malloc_tag);
+    if (!callback) {
+        os_log_error(lustre_logger_network, "Couldn't allocate lock callback");
+        lustre_network_namespace_put(namespace);
+        return lustre_network_conn_skip(conn, hdr->payload_length - peeked);
+    }
+
+    bzero(callback, sizeof(struct lustre_network_callback));
+
+    callback->namespace     = namespace;
+    callback->malloc_tag    = malloc_tag;
+    callback->length        = hdr->payload_length;
+    callback->xid           = hdr->msg.put.match_bits;
+    callback->message       = OSMalloc(callback->length, malloc_tag);
+    if (!callback->message) {
+        os_log_error(lustre_logger_network, "Couldn't allocate lock callback message");
+        OSFree(callback, sizeof(struct lustre_network_callback), malloc_tag);
+        lustre_network_namespace_put(namespace);
+        return lustre_network_conn_skip(conn, hdr->payload_length - peeked);
+    }
+
+    OSIncrementAtomic(&peer->ref_count);
+    callback->peer = peer;
+
+    memcpy(callback->message, peek, peeked);
+    if (callback->length > peeked) {
+        error = lustre_network_conn_receive_buffer(conn, (uint8_t *)callback->message + peeked, callback->length - peeked, FALSE);
+        if (error != 0) {
+            lustre_network_callback_free(callback);
+            return error;
+        }
+    }
+
+    // Once the peer is closed its thread has gone, and nobody would answer.
+
+    lck_mtx_lock(peer->lock);
+    queued = peer->callback_running;
+    if (queued) {
+        *peer->callbacks_tail   = callback;
+        peer->callbacks_tail    = &callback->next;
+        wakeup(&peer->callbacks);
+    }
+    lck_mtx_unlock(peer->lock);
+
+    if (!queued) {
+        lustre_network_callback_free(callback);
+    }
+
+    return 0;
+}
+
+// The reply goes straight into a buffer of its own size, which the request takes.  Bulk always arrives before the reply, but bulk being
+// sent for the request may still be finishing on another thread.
+static errno_t lustre_network_receive_reply(struct lustre_network_conn * conn, const struct lnet_hdr * hdr)
+{
+    struct lustre_network_peer *    peer;
+    struct lustre_network_pending * pending;
+    struct lustre_request *         request;
+    void *                          reply;
+    errno_t                         error;
+
+    peer = conn->peer;
+
+    lck_mtx_lock(peer->lock);
+    pending = lustre_network_pending_find(peer, hdr->msg.put.match_bits, NULL, TRUE);
+    if (pending) {
+        while (pending->busy) {
+            (void)msleep(pending, peer->lock, PINOD, __FUNCTION__, NULL);
+        }
+    }
+    lck_mtx_unlock(peer->lock);
+
+    if (!pending) {
+        os_log_info(lustre_logger_network, "Dropped reply for xid %llu", hdr->msg.put.match_bits);
+        return lustre_network_conn_skip(conn, hdr->payload_length);
+    }
+
+    request = pending->request;
+
+    if (hdr->payload_length == 0) {
+        lustre_request_complete(request, NULL, 0, EPROTO);
+        lustre_network_pending_free(pending);
+        return 0;
+    }
+
+    reply = OSMalloc(hdr->payload_length, request->import->malloc_tag);
+    if (!reply) {
+        os_log_error(lustre_logger_network, "Couldn't allocate reply");
+        lustre_request_complete(request, NULL, 0, ENOMEM);
+        lustre_network_pending_free(pending);
+        return lustre_network_conn_skip(conn, hdr->payload_length);
+    }
+
+    error = lustre_network_conn_receive_buffer(conn, reply, hdr->payload_length, FALSE);
+    if (error == 0) {
+        lustre_request_complete(request, reply, hdr->payload_length, 0);
+    } else {
+        OSFree(reply, hdr->payload_length, request->import->malloc_tag);
+        lustre_request_complete(request, NULL, 0, error);
+    }
+
+    lustre_network_pending_free(pending);
+
+    return error;
+}
+
+// Data the server puts for a read goes straight into the request's segments.  Returns how much of it was taken, for the ack.
+static errno_t lustre_network_receive_bulk(struct lustre_network_conn * conn, const struct lnet_hdr * hdr, uint32_t * accepted)
+{
+    struct lustre_network_peer *    peer;
+    struct lustre_network_pending * pending;
+    struct lustre_ksock_cursor      cursor;
+    struct iovec                    iov[kLustreNetworkIovecs];
+    uint32_t                        offset;
+    uint32_t                        length;
+    uint32_t                        remaining;
+    uint32_t                        count;
+    errno_t                         error;
+
+    peer        = conn->peer;
+    *accepted   = 0;
+
+    lck_mtx_lock(peer->lock);
+    pending = lustre_network_pending_find(peer, hdr->msg.put.match_bits & ~(uint64_t)(kLustreNetworkXidStep - 1), NULL, FALSE);
+    if (pending && ((pending->request->bulk_type != kLustreRequestBulkPut) || (pending->request->bulk_portal != hdr->msg.put.ptl_index) || pending->busy)) {
+        pending = NULL;
+    }
+    if (pending) {
+        pending->busy = TRUE;
+    }
+    lck_mtx_unlock(peer->lock);
+
+    if (!pending) {
+        os_log_info(lustre_logger_network, "Dropped bulk for match bits %llu", hdr->msg.put.match_bits);
+        return lustre_network_conn_skip(conn, hdr->payload_length);
+    }
+
+    offset  = lustre_network_bulk_offset(pending, hdr->msg.put.match_bits, hdr->msg.put.offset);
+    length  = lustre_network_bulk_length(pending->request);
+    length  = (offset < length) ? MIN(hdr->payload_length, length - offset) : 0;
+
+    lustre_network_cursor_init(&cursor, pending->request, offset);
+
+    error       = 0;
+    remaining   = length;
+    while ((error == 0) && (remaining > 0)) {
+        count = lustre_ksock_cursor_fill(&cursor, iov, kLustreNetworkIovecs, &remaining);
+        error = lustre_network_conn_receive(conn, iov, count, FALSE);
+    }
+    if ((error == 0) && (length < hdr->payload_length)) {
+        error = lustre_network_conn_skip(conn, hdr->payload_length - length);
+    }
+
+    lck_mtx_lock(peer->lock);
+    if (error == 0) {
+        pending->request->bulk_transferred += length;
+    }
+    pending->busy = FALSE;
+    wakeup(pending);
+    lck_mtx_unlock(peer->lock);
+
+    *accepted = length;
+
+    return error;
+}
+
+static errno_t lustre_network_send_ack(struct lustre_network_peer * peer, const struct lnet_put * put, uint32_t length)
+{
+    struct ksock_msg    header;
+    struct iovec        iov;
+
+    lustre_network_header(peer, &header, kLustreLNetMsgAck, 0);
+    header.ksm_hdr.msg.ack.dst_wmd      = put->ack_wmd;
+    header.ksm_hdr.msg.ack.match_bits   = put->match_bits;
+    header.ksm_hdr.msg.ack.mlength      = length;
+
+    iov.iov_base    = &header;
+    iov.iov_len     = sizeof(header);
+
+    return lustre_network_peer_send(peer, &iov, 1);
+}
+
+// socklnd asks for an ack of big messages it sent without copying, so it knows when it may reuse the pages.
+static errno_t lustre_network_send_noop(struct lustre_network_peer * peer, uint64_t cookie)
+{
+    struct ksock_msg    header;
+    struct iovec        iov;
+
+    bzero(&header, sizeof(header));
+    header.ksm_type             = kLustreKsockMsgNoop;
+    header.ksm_zc_cookies[1]    = cookie;
+
+    iov.iov_base    = &header;
+    iov.iov_len     = offsetof(struct ksock_msg, ksm_hdr);
+
+    return lustre_network_peer_send(peer, &iov, 1);
+}
+
+static errno_t lustre_network_receive_put(struct lustre_network_conn * conn, const struct lnet_hdr * hdr)
+{
+    uint32_t    accepted;
+    errno_t     error;
+
+    accepted = hdr->payload_length;
+
+    switch (hdr->msg.put.ptl_index) {
+        case kLustrePortalLDLMCallbackRequest:
+            error = lustre_network_receive_callback(conn, hdr);
+            break;
+        case kLustrePortalOSTBulk:
+        case kLustrePortalMDSBulk:
+            error = lustre_network_receive_bulk(conn, hdr, &accepted);
+            break;
+        default:
+            error = lustre_network_receive_reply(conn, hdr);
+            break;
+    }
+
+    if ((error == 0) && (hdr->msg.put.ack_wmd.wh_interface_cookie != kLustreLNetWireCookieNone)) {
+        error = lustre_network_send_ack(conn->peer, &hdr->msg.put, accepted);
+    }
+
+    return error;
+}
+
+// The server wants data for a write.  Sending it is left to the bulk out thread, so this connection carries on receiving meanwhile; a get
+// that matches nothing is dropped, as LNet does, and the server's bulk times out.
+static errno_t lustre_network_receive_get(struct lustre_network_conn * conn, const struct lnet_hdr * hdr)
+{
+    struct lustre_network_peer *    peer;
+    struct lustre_network_pending * pending;
+    struct lustre_network_conn *    out;
+    struct lustre_network_tx *      tx;
+    uint32_t                        offset;
+    uint32_t                        length;
+    errno_t                         error;
+
+    peer = conn->peer;
+
+    error = lustre_network_conn_skip(conn, hdr->payload_length);
+    if (error != 0) {
+        return error;
+    }
+
+    // The request is kept busy while the tx is allocated from its import's tag, so it can't be let go of meanwhile.
+
+    lck_mtx_lock(peer->lock);
+    pending = lustre_network_pending_find(peer, hdr->msg.get.match_bits & ~(uint64_t)(kLustreNetworkXidStep - 1), NULL, FALSE);
+    if (pending && ((pending->request->bulk_type != kLustreRequestBulkGet) || (pending->request->bulk_portal != hdr->msg.get.ptl_index) || pending->busy)) {
+        pending = NULL;
+    }
+    if (pending) {
+        pending->busy = TRUE;
+    }
+    lck_mtx_unlock(peer->lock);
+
+    if (!pending) {
+        os_log_info(lustre_logger_network, "Dropped get for match bits %llu", hdr->msg.get.match_bits);
+        return 0;
+    }
+
+    tx = OSMalloc(sizeof(struct lustre_network_tx), pending->malloc_tag);
+    if (!tx) {
+        os_log_error(lustre_logger_network, "Couldn't allocate bulk reply");
+    }
+
+    lck_mtx_lock(peer->lock);
+    out = peer->conns[kLustreNetworkConnBulkOut];
+    if (!tx || !out || out->closing || !pending->linked) {
+        pending->busy = FALSE;
+        wakeup(pending);
+        lck_mtx_unlock(peer->lock);
+        if (tx) {
+            OSFree(tx, sizeof(struct lustre_network_tx), pending->malloc_tag);
+            os_log_info(lustre_logger_network, "Dropped get for match bits %llu", hdr->msg.get.match_bits);
+        }
+        return 0;
+    }
+
+    offset  = lustre_network_bulk_offset(pending, hdr->msg.get.match_bits, hdr->msg.get.src_offset);
+    length  = lustre_network_bulk_length(pending->request);
+    length  = (offset < length) ? MIN(hdr->msg.get.sink_length, length - offset) : 0;
+
+    lustre_network_header(peer, &tx->header, kLustreLNetMsgReply, length);
+    tx->header.ksm_hdr.msg.reply.dst_wmd = hdr->msg.get.return_wmd;
+    tx->malloc_tag  = pending->malloc_tag;
+    tx->pending     = pending;
+    tx->offset      = offset;
+    tx->length      = length;
+    tx->next        = NULL;
+
+    *out->queue_tail    = tx;
+    out->queue_tail     = &tx->next;
+    wakeup(&out->queue);
+    lck_mtx_unlock(peer->lock);
+
+    return 0;
+}
+
+static errno_t lustre_network_receive_message(struct lustre_network_conn * conn, const struct ksock_msg * header)
+{
+    const struct lnet_hdr * hdr;
+    errno_t                 error;
+
+    hdr = &header->ksm_hdr;
+
+    error = lustre_ksock_header_check(header);
+    if (error != 0) {
+        os_log_error(lustre_logger_network, "Message payload of %u bytes is too big", hdr->payload_length);
+        return error;
+    }
+
+    switch (hdr->type) {
+        case kLustreLNetMsgPut:
+            error = lustre_network_receive_put(conn, hdr);
+            break;
+        case kLustreLNetMsgGet:
+            error = lustre_network_receive_get(conn, hdr);
+            break;
+        default:
+            error = lustre_network_conn_skip(conn, hdr->payload_length);    // acks, and replies to gets we never send
+            break;
+    }
+
+    if ((error == 0) && (header->ksm_zc_cookies[0] != 0)) {
+        error = lustre_network_send_noop(conn->peer, header->ksm_zc_cookies[0]);
+    }
+
+    return error;
+}
+
+// One per connection.  Each message header is read into place here, and the payload moved to wherever it belongs by the message's type.
+static void lustre_network_receiver(void * parameter, wait_result_t wait_result)
+{
+    struct lustre_network_conn *    conn;
+    struct ksock_msg                header;
+    errno_t                         error;
+
+    conn = parameter;
+
+    for (;;) {
+        error = lustre_network_conn_receive_buffer(conn, &header, offsetof(struct ksock_msg, ksm_hdr), TRUE);
+        if (error != 0) {
+            break;
+        }
+        if (header.ksm_type == kLustreKsockMsgNoop) {
+            continue;
+        }
+        if (header.ksm_type != kLustreKsockMsgLNet) {
+            os_log_error(lustre_logger_network, "Unknown socklnd message type 0x%x", header.ksm_type);
+            error = EPROTO;
+            break;
+        }
+
+        error = lustre_network_conn_receive_buffer(conn, &header.ksm_hdr, sizeof(struct lnet_hdr), FALSE);
+        if (error == 0) {
+            error = lustre_network_receive_message(conn, &header);
+        }
+        if (error != 0) {
+            break;
+        }
+    }
+
+    lustre_network_peer_fail(conn, error);
+    lustre_network_conn_release(conn);
+
+    lustre_network_thread_exit();
+}
+
+#pragma mark - Sending
+
+// Drops a hold on the tx: the sender's, or one of the clusters lent to the stack.  The last lets the request go.  This runs wherever the
+// stack frees mbufs, so it only ever takes the peer lock, which is never held around a socket call.
+static void lustre_network_tx_release(struct lustre_network_tx * tx)
+{
+    struct lustre_network_peer * peer;
+
+    if (OSDecrementAtomic(&tx->clusters) != 1) {
+        return;
+    }
+
+    peer = tx->peer;
+
+    lck_mtx_lock(peer->lock);
+    if (tx->error == 0) {
+        tx->pending->request->bulk_transferred += tx->length;
+    }
+    tx->pending->busy = FALSE;
+    wakeup(tx->pending);
+    lck_mtx_unlock(peer->lock);
+
+    OSFree(tx, sizeof(struct lustre_network_tx), tx->malloc_tag);
+
+    lustre_network_peer_release(peer);
+}
+
+static void lustre_network_tx_cluster_free(caddr_t buffer, u_int size, caddr_t argument)
+{
+    lustre_network_tx_release((struct lustre_network_tx *)argument);
+}
+
+// Builds the tx as an mbuf chain: the header copied into an mbuf of its own, then each page of the data attached as an external cluster.
+// Clusters never cross a page, since drivers expect a cluster to be physically contiguous.  The pages stay lent until the stack frees the
+// mbufs, once the server has acknowledged them.
+static errno_t lustre_network_tx_chain(struct lustre_network_tx * tx, mbuf_t * result)
+{
+    struct lustre_ksock_cursor      cursor;
+    struct iovec                    iov;
+    mbuf_t                          head;
+    mbuf_t                          last;
+    mbuf_t                          mbuf;
+    uint8_t *                       data;
+    size_t                          left;
+    size_t                          piece;
+    uint32_t                        remaining;
+    errno_t                         error;
+
+    error = mbuf_gethdr(MBUF_WAITOK, MBUF_TYPE_DATA, &head);
+    if (error != 0) {
+        return error;
+    }
+
+    memcpy(mbuf_data(head), &tx->header, sizeof(struct ksock_msg));
+    mbuf_setlen(head, sizeof(struct ksock_msg));
+    mbuf_pkthdr_setlen(head, sizeof(struct ksock_msg) + tx->length);
+
+    lustre_network_cursor_init(&cursor, tx->pending->request, tx->offset);
+
+    last        = head;
+    remaining   = tx->length;
+    while (lustre_ksock_cursor_fill(&cursor, &iov, 1, &remaining) > 0) {
+        for (data = iov.iov_base, left = iov.iov_len; left > 0; data += piece, left -= piece) {
+            piece = MIN(left, PAGE_SIZE - ((uintptr_t)data & PAGE_MASK));
+
+            mbuf = NULL;
+            OSIncrementAtomic(&tx->clusters);
+            error = mbuf_attachcluster(MBUF_WAITOK, MBUF_TYPE_DATA, &mbuf, (caddr_t)data, lustre_network_tx_cluster_free, piece, (caddr_t)tx);
+            if (error != 0) {
+                OSDecrementAtomic(&tx->clusters);
+                mbuf_freem(head);
+                return error;
+            }
+
+            mbuf_setlen(mbuf, piece);
+            (void)mbuf_setnext(last, mbuf);
+            last = mbuf;
+        }
+    }
+
+    *result = head;
+
+    return 0;
+}
+
+// As lustre_network_conn_write, for a chain built by lustre_network_tx_chain, which it always uses up.
+static errno_t lustre_network_conn_write_chain(struct lustre_network_conn * conn, mbuf_t chain)
+{
+    size_t  length;
+    size_t  sent;
+    errno_t error;
+
+    if (conn->closing) {
+        mbuf_freem(chain);
+        return ENOTCONN;
+    }
+
+    length  = mbuf_pkthdr_len(chain);
+    sent    = 0;
+    error   = sock_sendmbuf(conn->socket, NULL, chain, 0, &sent);
+    if ((error == 0) && (sent != length)) {
+        error = ETIMEDOUT;
+    }
+
+    return error;
+}
+
+// Sends by copying, through the socket's own buffers: small bulk, or when the chain couldn't be built.  The header goes out with the first
+// of the data.
+static errno_t lustre_network_tx_copy(struct lustre_network_conn * conn, struct lustre_network_tx * tx)
+{
+    struct lustre_ksock_cursor      cursor;
+    struct iovec                    iov[kLustreNetworkIovecs];
+    uint32_t                        remaining;
+    uint32_t                        count;
+    errno_t                         error;
+
+    lustre_network_cursor_init(&cursor, tx->pending->request, tx->offset);
+
+    iov[0].iov_base = &tx->header;
+    iov[0].iov_len  = sizeof(struct ksock_msg);
+    count           = 1;
+    remaining       = tx->length;
+
+    do {
+        count += lustre_ksock_cursor_fill(&cursor, iov + count, kLustreNetworkIovecs - count, &remaining);
+        error  = lustre_network_conn_write(conn, iov, count);
+        count  = 0;
+    } while ((error == 0) && (remaining > 0));
+
+    return error;
+}
+
+// The bulk out connection's thread, which sends the data servers get from us.  Once a tx is handed to the stack the thread moves on; the
+// request stays busy until the last of its pages comes back, so neither its reply nor a cancel lets the pages go while the stack has them.
+static void lustre_network_sender(void * parameter, wait_result_t wait_result)
+{
+    struct lustre_network_conn *    conn;
+    struct lustre_network_peer *    peer;
+    struct lustre_network_tx *      tx;
+    mbuf_t                          chain;
+    errno_t                         error;
+
+    conn = parameter;
+    peer = conn->peer;
+
+    lck_mtx_lock(peer->lock);
+    while (!conn->closing) {
+        tx = conn->queue;
+        if (!tx) {
+            (void)msleep(&conn->queue, peer->lock, PINOD, __FUNCTION__, NULL);
+            continue;
+        }
+        conn->queue = tx->next;
+        if (!conn->queue) {
+            conn->queue_tail = &conn->queue;
+        }
+        lck_mtx_unlock(peer->lock);
+
+        OSIncrementAtomic(&peer->ref_count);
+        tx->peer        = peer;
+        tx->clusters    = 1;
+        tx->error       = 0;
+
+        chain = NULL;
+        if ((tx->length < kLustreNetworkZeroCopyMin) || (lustre_network_tx_chain(tx, &chain) != 0)) {
+            chain = NULL;
+        }
+
+        lck_mtx_lock(conn->send_lock);
+        error = chain ? lustre_network_conn_write_chain(conn, chain) : lustre_network_tx_copy(conn, tx);
+        lck_mtx_unlock(conn->send_lock);
+
+        tx->error = error;
+        lustre_network_tx_release(tx);
+
+        if (error != 0) {
+            lustre_network_peer_fail(conn, error);
+        }
+
+        lck_mtx_lock(peer->lock);
+    }
+    lck_mtx_unlock(peer->lock);
+
+    lustre_network_conn_release(conn);
+
+    lustre_network_thread_exit();
+}
+
+// Opens all three connections from a kernel thread of its own, so binding a reserved port passes the privilege check whichever process
+// happened to send first.  Whoever is waiting in lustre_network_peer_connect is woken with the result.
+static void lustre_network_connector(void * parameter, wait_result_t wait_result)
+{
+    struct lustre_network_peer *    peer;
+    struct lustre_network_conn *    conns[kLustreNetworkConnCount];
+    uint64_t                        local_nid;
+    char                            name[kLustreNetworkNIDStringSize];
+    boolean_t                       start;
+    errno_t                         error;
+    uint32_t                        i;
+
+    peer = parameter;
+
+    bzero(conns, sizeof(conns));
+
+    error = 0;
+    for (i=0; (i<kLustreNetworkConnCount) && (error == 0); i++) {
+        error = lustre_network_conn_open(peer, (enum lustre_network_conn_type)i, &local_nid, &conns[i]);
+    }
+
+    lck_mtx_lock(peer->lock);
+    if ((error == 0) && (peer->state == kLustreNetworkPeerClosed)) {
+        error = ESHUTDOWN;
+    }
+    if (error == 0) {
+        for (i=0; i<kLustreNetworkConnCount; i++) {
+            peer->conns[i] = conns[i];
+        }
+        peer->local_nid     = local_nid;
+        peer->generation   += 1;
+        peer->state         = kLustreNetworkPeerReady;
+    } else if (peer->state != kLustreNetworkPeerClosed) {
+        peer->state         = kLustreNetworkPeerIdle;
+    }
+    peer->error = error;
+    wakeup(&peer->state);
+    lck_mtx_unlock(peer->lock);
+
+    lustre_network_nid_string(peer->nid, name);
+
+    if (error == 0) {
+        os_log_info(lustre_logger_network, "Connected to %{public}s", name);
+
+        // The callback thread outlives the connections, so only the first ones start it.  It's running before any receiver could queue
+        // a callback for it.
+
+        lck_mtx_lock(peer->lock);
+        start                   = !peer->callback_running;
+        peer->callback_running  = TRUE;
+        lck_mtx_unlock(peer->lock);
+
+        if (start) {
+            OSIncrementAtomic(&peer->ref_count);
+            if (lustre_network_thread_start(lustre_network_callback_thread, peer) != 0) {
+                OSDecrementAtomic(&peer->ref_count);
+                lck_mtx_lock(peer->lock);
+                peer->callback_running = FALSE;
+                lck_mtx_unlock(peer->lock);
+                os_log_error(lustre_logger_network, "Couldn't start lock callback thread for %{public}s", name);
+                lustre_network_peer_fail(conns[kLustreNetworkConnControl], ENOMEM);
+            }
+        }
+
+        // The peer holds the references conn_open returned; each thread takes its own.
+
+        for (i=0; i<kLustreNetworkConnCount; i++) {
+            OSIncrementAtomic(&conns[i]->ref_count);
+            if (lustre_network_thread_start(lustre_network_receiver, conns[i]) != 0) {
+                lustre_network_conn_release(conns[i]);
+                lustre_network_peer_fail(conns[i], ENOMEM);
+            }
+        }
+        OSIncrementAtomic(&conns[kLustreNetworkConnBulkOut]->ref_count);
+        if (lustre_network_thread_start(lustre_network_sender, conns[kLustreNetworkConnBulkOut]) != 0) {
+            lustre_network_conn_release(conns[kLustreNetworkConnBulkOut]);
+            lustre_network_peer_fail(conns[kLustreNetworkConnBulkOut], ENOMEM);
+        }
+    } else {
+        os_log_error(lustre_logger_network, "Couldn't connect to %{public}s, error %d", name, error);
+
+        for (i=0; i<kLustreNetworkConnCount; i++) {
+            if (conns[i]) {
+                lustre_network_conn_close(conns[i]);
+                lustre_network_conn_release(conns[i]);
+            }
+        }
+    }
+
+    lustre_network_peer_release(peer);
+
+    lustre_network_thread_exit();
+}
+
+// Returns once the peer is connected, or the attempt to connect it has failed.
+static errno_t lustre_network_peer_connect(struct lustre_network_peer * peer)
+{
+    errno_t error;
+
+    lck_mtx_lock(peer->lock);
+
+    if (peer->state == kLustreNetworkPeerIdle) {
+        peer->state = kLustreNetworkPeerConnecting;
+        OSIncrementAtomic(&peer->ref_count);
+        if (lustre_network_thread_start(lustre_network_connector, peer) != 0) {
+            OSDecrementAtomic(&peer->ref_count);
+            peer->state = kLustreNetworkPeerIdle;
+            lck_mtx_unlock(peer->lock);
+            return ENOMEM;
+        }
+    }
+
+    while (peer->state == kLustreNetworkPeerConnecting) {
+        (void)msleep(&peer->state, peer->lock, PINOD, __FUNCTION__, NULL);
+    }
+
+    switch (peer->state) {
+        case kLustreNetworkPeerReady:   error = 0;                                          break;
+        case kLustreNetworkPeerClosed:  error = ESHUTDOWN;                                  break;
+        default:                        error = (peer->error != 0) ? peer->error : ENOTCONN; break;
+    }
+
+    lck_mtx_unlock(peer->lock);
+
+    return error;
+}
+
+#pragma mark - Callbacks
+
+// Hands a lock callback to the namespace its handle named.  The namespace can't be removed meanwhile, since the callback counts as a use.
+static errno_t lustre_network_dispatch(struct lustre_dlm_namespace * namespace, uint32_t opcode, struct lustre_handle handle, const struct ldlm_lock_desc * desc)
+{
+    if (!namespace) {
+        return ENOENT;
+    }
+
+    if (opcode == kLustreOpcodeLDLMBlockingCallback) {
+        return lustre_dlm_blocking_callback(namespace, handle);
+    }
+    return lustre_dlm_completion_callback(namespace, handle, desc);
+}
+
+static void lustre_network_callback_reply(struct lustre_network_callback * callback, uint32_t opcode, int32_t status)
+{
+    struct {
+        struct lustre_msg_v2    msg;
+        uint32_t                buflens[2];                                         // one buffer; the second pads the header to 8 bytes
+        struct ptlrpc_body      body;
+    }                           reply;
+    struct ksock_msg            header;
+    struct iovec                iov[2];
+    errno_t                     error;
+
+    bzero(&reply, sizeof(reply));
+    reply.msg.lm_bufcount   = 1;
+    reply.msg.lm_magic      = kLustreMsgMagicV2;
+    reply.buflens[0]        = sizeof(struct ptlrpc_body);
+    reply.body.pb_type      = kLustreMsgTypeReply;
+    reply.body.pb_version   = kLustreMsgVersion | kLustreDLMVersion;
+    reply.body.pb_opc       = opcode;
+    reply.body.pb_status    = (uint32_t)status;
+
+    lustre_network_header(callback->peer, &header, kLustreLNetMsgPut, sizeof(reply));
+    header.ksm_hdr.msg.put.ack_wmd.wh_interface_cookie  = kLustreLNetWireCookieNone;
+    header.ksm_hdr.msg.put.ack_wmd.wh_object_cookie     = kLustreLNetWireCookieNone;
+    header.ksm_hdr.msg.put.match_bits                   = callback->xid;
+    header.ksm_hdr.msg.put.ptl_index                    = kLustrePortalLDLMCallbackReply;
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len  = sizeof(header);
+    iov[1].iov_base = &reply;
+    iov[1].iov_len  = sizeof(reply);
+
+    error = lustre_network_peer_send(callback->peer, iov, 2);
+    if (error != 0) {
+        os_log_error(lustre_logger_network, "Couldn't answer lock callback %u, error %d", opcode, error);
+    }
+}
+
+// Answers the way Linux clients do: a lock we don't have is -EINVAL, which servers take as a race with our cancel, and a glimpse gets
+// -ELDLM_NO_LOCK_DATA, since we never hold the write locks that would make our sizes worth asking for.
+static void lustre_network_callback_handle(struct lustre_network_callback * callback)
+{
+    const struct ptlrpc_body *      body;
+    const struct ldlm_request *     request;
+    int32_t                         status;
+    errno_t                         error;
+
+    body    = lustre_request_message_field(callback->message, callback->length, 0, sizeof(struct ptlrpc_body), NULL);
+    request = lustre_request_message_field(callback->message, callback->length, 1, sizeof(struct ldlm_request), NULL);
+    if (!body || !request || (((const struct lustre_msg_v2 *)callback->message)->lm_magic != kLustreMsgMagicV2)) {
+        os_log_error(lustre_logger_network, "Malformed lock callback");
+        return;
+    }
+
+    switch (body->pb_opc) {
+        case kLustreOpcodeLDLMBlockingCallback:
+        case kLustreOpcodeLDLMCompletionCallback:
+            error  = lustre_network_dispatch(callback->namespace, body->pb_opc, request->lock_handle[0], &request->lock_desc);
+            status = (error == 0) ? 0 : kLustreNetworkStatusNoLock;
+            break;
+        case kLustreOpcodeLDLMGlimpseCallback:
+            status = kLustreNetworkStatusNoLockData;
+            break;
+        default:
+            os_log_error(lustre_logger_network, "Unexpected callback opcode %u", body->pb_opc);
+            status = kLustreNetworkStatusNotSupported;
+            break;
+    }
+
+    lustre_network_callback_reply(callback, body->pb_opc, status);
+}
+
+// One per peer, started with its first connections, so one server's callbacks never wait behind another's.  Handles them in the order
+// they came, and leaves once the peer is closed; any still queued then go unanswered.
+static void lustre_network_callback_thread(void * parameter, wait_result_t wait_result)
+{
+    struct lustre_network_peer *        peer;
+    struct lustre_network_callback *    callback;
+    struct lustre_network_callback *    list;
+
+    peer = parameter;
+
+    lck_mtx_lock(peer->lock);
+    while (peer->state != kLustreNetworkPeerClosed) {
+        callback = peer->callbacks;
+        if (!callback) {
+            (void)msleep(&peer->callbacks, peer->lock, PINOD, __FUNCTION__, NULL);
+            continue;
+        }
+        peer->callbacks = callback->next;
+        if (!peer->callbacks) {
+            peer->callbacks_tail = &peer->callbacks;
+        }
+        lck_mtx_unlock(peer->lock);
+
+        lustre_network_callback_handle(callback);
+        lustre_network_callback_free(callback);
+
+        lck_mtx_lock(peer->lock);
+    }
+    list                    = peer->callbacks;
+    peer->callbacks         = NULL;
+    peer->callbacks_tail    = &peer->callbacks;
+    peer->callback_running  = FALSE;
+    lck_mtx_unlock(peer->lock);
+
+    while ((callback = list)) {
+        list = callback->next;
+        lustre_network_callback_free(callback);
+    }
+
+    lustre_network_peer_release(peer);
+
+    lustre_network_thread_exit();
+}
+
+#pragma mark - External
+
+kern_return_t lustre_network_register(void)
+{
+    struct timeval now;
+
+    LUSTRE_BUG_ON(lustre_network_lock);
+
+    lustre_network_lock = lck_mtx_alloc_init(lustre_lock_group, NULL);
+    if (!lustre_network_lock) {
+        os_log_error(lustre_logger_network, "Couldn't allocate network lock");
+        return KERN_FAILURE;
+    }
+
+    // As on Linux, both come from the clock, so servers can't mistake us for whoever was loaded before.
+
+    microtime(&now);
+    lustre_network_incarnation  = (uint64_t)now.tv_sec * USEC_PER_SEC + (uint64_t)now.tv_usec;
+    lustre_network_last_xid     = (SInt64)(((uint64_t)now.tv_sec << 20) & ~(uint64_t)(kLustreNetworkXidStep - 1));
+
+    bzero(lustre_network_namespaces, sizeof(lustre_network_namespaces));
+
+    return KERN_SUCCESS;
+}
+
+// Only called once every volume has gone, so there are no peers left; their threads (callback threads among them, with whatever
+// callbacks came in behind the last unmount) may still be on their way out.
+void lustre_network_unregister(void)
+{
+    uint32_t i;
+
+    if (!lustre_network_lock) {
+        return;
+    }
+
+    lck_mtx_lock(lustre_network_lock);
+    LUSTRE_BUG_ON(lustre_network_peers);
+    for (i=0; i<kLustreNetworkNamespacesMax; i++) {
+        LUSTRE_BUG_ON(lustre_network_namespaces[i]);
+    }
+    while (lustre_network_threads > 0) {
+        (void)msleep(&lustre_network_threads, lustre_network_lock, PINOD, __FUNCTION__, NULL);
+    }
+    lck_mtx_unlock(lustre_network_lock);
+
+    lck_mtx_free(lustre_network_lock, lustre_lock_group);
+    lustre_network_lock = NULL;
+}
+
+// NIDs are (network type << 16 | network number) << 32 | address; we only speak tcp0.
+uint64_t lustre_network_nid(struct in_addr address)
+{
+    return ((uint64_t)(kLustreNetworkTypeTCP << 16) << 32) | (uint64_t)ntohl(address.s_addr);
+}
+
+uint64_t lustre_network_next_xid(void)
+{
+    return (uint64_t)OSAddAtomic64(kLustreNetworkXidStep, &lustre_network_last_xid) + kLustreNetworkXidStep;
+}
+
+// Returns the peer for a server, with a use counted against it.  The peer doesn't connect until something is sent to it.
+struct lustre_network_peer * lustre_network_peer_get(uint64_t nid, uint16_t port)
+{
+    struct lustre_network_peer * peer;
+
+    lck_mtx_lock(lustre_network_lock);
+
+    for (peer = lustre_network_peers; peer; peer = peer->next) {
+        if ((peer->nid == nid) && (peer->port == port)) {
+            break;
+        }
+    }
+
+    if (!peer) {
+        peer = OSMalloc(sizeof(struct lustre_network_peer), lustre_os_malloc_tag);
+        if (!peer) {
+            os_log_error(lustre_logger_network, "Couldn't allocate peer");
+            lck_mtx_unlock(lustre_network_lock);
+            return NULL;
+        }
+
+        bzero(peer, sizeof(struct lustre_network_peer));
+
+        peer->lock = lck_mtx_alloc_init(lustre_lock_group, NULL);
+        if (!peer->lock) {
+            os_log_error(lustre_logger_network, "Couldn't allocate peer lock");
+            OSFree(peer, sizeof(struct lustre_network_peer), lustre_os_malloc_tag);
+            lck_mtx_unlock(lustre_network_lock);
+            return NULL;
+        }
+
+        peer->nid               = nid;
+        peer->port              = port;
+        peer->state             = kLustreNetworkPeerIdle;
+        peer->callbacks_tail    = &peer->callbacks;
+        peer->next              = lustre_network_peers;
+        lustre_network_peers    = peer;
+    }
+
+    peer->users += 1;
+    OSIncrementAtomic(&peer->ref_count);
+
+    lck_mtx_unlock(lustre_network_lock);
+
+    return peer;
+}
+
+// The last import to go closes the peer's connections.  Nothing can be outstanding on them by then.
+void lustre_network_peer_put(struct lustre_network_peer * peer)
+{
+    struct lustre_network_peer **   link;
+    struct lustre_network_conn *    conns[kLustreNetworkConnCount];
+    struct lustre_network_pending * list;
+    boolean_t                       last;
+
+    LUSTRE_BUG_ON(!peer);
+
+    lck_mtx_lock(lustre_network_lock);
+    LUSTRE_BUG_ON(peer->users == 0);
+    peer->users -= 1;
+    last = (peer->users == 0);
+    if (last) {
+        for (link = &lustre_network_peers; *link != peer; link = &(*link)->next) {
+        }
+        *link = peer->next;
+    }
+    lck_mtx_unlock(lustre_network_lock);
+
+    if (last) {
+        lck_mtx_lock(peer->lock);
+        lustre_network_peer_detach(peer, conns, &list);
+        peer->state = kLustreNetworkPeerClosed;
+        wakeup(&peer->state);
+        wakeup(&peer->callbacks);
+        lck_mtx_unlock(peer->lock);
+
+        lustre_network_peer_abort(peer, conns, list, ESHUTDOWN, TRUE);
+    }
+
+    lustre_network_peer_release(peer);
+}
+
+// Gives the namespace an id for its lock handles to carry, so callbacks for them go straight to it.  Returns EBUSY if every id is taken.
+errno_t lustre_network_namespace_add(struct lustre_dlm_namespace * namespace)
+{
+    uint32_t id;
+
+    LUSTRE_BUG_ON(!namespace);
+    LUSTRE_BUG_ON(namespace->network_id != 0);
+
+    lck_mtx_lock(lustre_network_lock);
+    for (id=1; (id<kLustreNetworkNamespacesMax) && lustre_network_namespaces[id]; id++) {
+    }
+    if (id < kLustreNetworkNamespacesMax) {
+        lustre_network_namespaces[id]   = namespace;
+        namespace->network_id           = id;
+    }
+    lck_mtx_unlock(lustre_network_lock);
+
+    if (id == kLustreNetworkNamespacesMax) {
+        os_log_error(lustre_logger_network, "Too many lock namespaces");
+        return EBUSY;
+    }
+
+    return 0;
+}
+
+// Returns once no callback holds a use of the namespace.  Callbacks arriving after that find no namespace and are answered as such.
+void lustre_network_namespace_remove(struct lustre_dlm_namespace * namespace)
+{
+    LUSTRE_BUG_ON(!namespace);
+
+    if (namespace->network_id == 0) {
+        return;
+    }
+
+    lck_mtx_lock(lustre_network_lock);
+    LUSTRE_BUG_ON(lustre_network_namespaces[namespace->network_id] != namespace);
+    lustre_network_namespaces[namespace->network_id] = NULL;
+    while (namespace->network_users > 0) {
+        (void)msleep(&namespace->network_users, lustre_network_lock, PINOD, __FUNCTION__, NULL);
+    }
+    lck_mtx_unlock(lustre_network_lock);
+
+    namespace->network_id = 0;
+}
+
+// Sends the request as an LNet put to its service's portal, matched by its xid, connecting to the server first if need be.  The request
+// is tracked from before the send, since the reply can beat the send's return.
+errno_t lustre_network_send(struct lustre_request * request)
+{
+    struct lustre_network_peer *    peer;
+    struct lustre_network_pending * pending;
+    struct ksock_msg                header;
+    struct iovec                    iov[2];
+    void *                          message;
+    uint32_t                        length;
+    errno_t                         error;
+
+    LUSTRE_BUG_ON(!request);
+    LUSTRE_BUG_ON(!request->import->peer);
+
+    peer = request->import->peer;
+
+    error = lustre_network_peer_connect(peer);
+    if (error != 0) {
+        return error;
+    }
+
+    pending = OSMalloc(sizeof(struct lustre_network_pending), request->import->malloc_tag);
+    if (!pending) {
+        os_log_error(lustre_logger_network, "Couldn't allocate pending request");
+        return ENOMEM;
+    }
+
+    error = lustre_request_pack(request, &message, &length);
+    if (error != 0) {
+        OSFree(pending, sizeof(struct lustre_network_pending), request->import->malloc_tag);
+        return error;
+    }
+
+    bzero(pending, sizeof(struct lustre_network_pending));
+
+    lustre_request_ref_count_inc(request);
+    pending->request    = request;
+    pending->malloc_tag = request->import->malloc_tag;
+    pending->xid        = request->xid;
+
+    lustre_network_header(peer, &header, kLustreLNetMsgPut, length);
+    header.ksm_hdr.msg.put.ack_wmd.wh_interface_cookie  = kLustreLNetWireCookieNone;
+    header.ksm_hdr.msg.put.ack_wmd.wh_object_cookie     = kLustreLNetWireCookieNone;
+    header.ksm_hdr.msg.put.match_bits                   = request->xid;
+    header.ksm_hdr.msg.put.ptl_index                    = lustre_network_request_portal(request);
+
+    lck_mtx_lock(peer->lock);
+    lustre_network_pending_link(peer, pending);
+    lck_mtx_unlock(peer->lock);
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len  = sizeof(header);
+    iov[1].iov_base = message;
+    iov[1].iov_len  = length;
+
+    error = lustre_network_peer_send(peer, iov, 2);
+
+    OSFree(message, length, request->import->malloc_tag);
+
+    if (error != 0) {
+        lustre_network_cancel(request);
+    }
+
+    return error;
+}
+
+// Stops tracking the request.  Once this returns nothing more is read into or sent from its bulk segments.
+void lustre_network_cancel(struct lustre_request * request)
+{
+    struct lustre_network_peer *    peer;
+    struct lustre_network_pending * pending;
+
+    LUSTRE_BUG_ON(!request);
+
+    peer = request->import->peer;
+
+    lck_mtx_lock(peer->lock);
+    pending = lustre_network_pending_find(peer, request->xid, request, TRUE);
+    if (pending) {
+        while (pending->busy) {
+            (void)msleep(pending, peer->lock, PINOD, __FUNCTION__, NULL);
+        }
+    } else {
+        while (peer->draining > 0) {
+            (void)msleep(&peer->draining, peer->lock, PINOD, __FUNCTION__, NULL);
+        }
+    }
+    lck_mtx_unlock(peer->lock);
+
+    if (pending) {
+        lustre_network_pending_free(pending);
+    }
+}
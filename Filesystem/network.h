@@ -0,0 +1,141 @@
+//
+//  network.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// LNet over TCP, spoken the way the Linux socklnd speaks it, so any server's acceptor takes us as one of its own.  Each server NID is a
+// peer, shared by every import (and every mounted volume) on that server, and each peer gets three connections: control for requests,
+// replies and everything else small; bulk in for the data servers put to us; and bulk out for the data they get from us, and for the odd
+// large request.  Small RPCs therefore never queue behind somebody's megabyte of file data.
+//
+// Requests go out from the caller's thread, header and message in one scatter/gather send.  Each connection has a receive thread that
+// reads a message header into place and then moves the payload straight to where it belongs: a reply buffer, a request's bulk segments,
+// or the peer's callback queue, whose thread hands each lock callback to the DLM namespace its handle names.  Bulk for the server to get is sent by the bulk out connection's
+// own thread, so no receive thread ever waits on a large send.  It goes without copying: the pages are lent to the stack as mbuf external
+// clusters, and the request stays busy until the stack hands the last of them back.
+//
+// Replies and bulk are matched to requests by xid.  Xids are handed out here, in steps of kLustreNetworkXidStep, so they're unique over
+// every import sharing a peer, and a request with several megabytes of bulk has match bits to spare for each LNet-sized piece of it.
+
+#ifndef lustre_network_h
+#define lustre_network_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <sys/kpi_socket.h>
+#include <netinet/in.h>
+#include <kern/locks.h>
+#include "wire.h"
+#include "dlm.h"
+
+static const uint32_t   kLustreNetworkXidStep               = 16;               // match bits each request owns
+static const uint32_t   kLustreNetworkPendingBuckets        = 64;
+static const uint32_t   kLustreNetworkBulkMin               = 1024;             // messages this size or more use the bulk connections
+static const uint32_t   kLustreNetworkZeroCopyMin           = 16 * 1024;        // bulk this size or more is sent from the pages themselves
+static const uint32_t   kLustreNetworkTimeoutSeconds        = 50;               // connect, or no progress on a message in either direction
+static const uint32_t   kLustreNetworkNamespacesMax         = 256;              // ids fit above kLustreDLMNamespaceShift; 0 is none
+
+struct lustre_request;
+struct lustre_network_peer;
+struct lustre_network_callback;
+
+enum lustre_network_conn_type {
+    kLustreNetworkConnControl,
+    kLustreNetworkConnBulkIn,
+    kLustreNetworkConnBulkOut,
+    kLustreNetworkConnCount,
+};
+
+enum lustre_network_peer_state {
+    kLustreNetworkPeerIdle,                                                         // no connections; the next send opens them
+    kLustreNetworkPeerConnecting,
+    kLustreNetworkPeerReady,
+    kLustreNetworkPeerClosed,                                                       // nobody uses the peer any more
+};
+
+// A request waiting for its reply.  While busy, bulk is moving to or from the request's segments and the entry mustn't be let go of.
+struct lustre_network_pending {
+    struct lustre_request *                         request;                        // with a reference
+    OSMallocTag                                     malloc_tag;                     // the request's import's, which this came from
+    uint64_t                                        xid;
+    boolean_t                                       busy;
+    boolean_t                                       linked;
+    struct lustre_network_pending *                 next;
+};
+
+// Bulk the server asked to get, queued for the bulk out connection's thread.
+struct lustre_network_tx {
+    struct ksock_msg                                header;
+    OSMallocTag                                     malloc_tag;                     // the request's import's, which this came from
+    struct lustre_network_peer *                    peer;                           // with a reference, once sending
+    struct lustre_network_pending *                 pending;                        // busy until the stack is done with the data
+    uint32_t                                        offset;                         // into the request's segments
+    uint32_t                                        length;
+    volatile SInt32                                 clusters;                       // lent to the stack, plus one while sending
+    volatile SInt32                                 error;
+    struct lustre_network_tx *                      next;
+};
+
+struct lustre_network_conn {
+    struct lustre_network_peer *                    peer;                           // with a reference
+    enum lustre_network_conn_type                   type;
+    socket_t                                        socket;
+    lck_mtx_t *                                     send_lock;                      // held for the whole of each message sent
+    struct lustre_network_tx *                      queue;                          // bulk out only; following protected by the peer lock
+    struct lustre_network_tx **                     queue_tail;
+    boolean_t                                       closing;
+    int32_t                                         ref_count;
+};
+
+struct lustre_network_peer {
+    uint64_t                                        nid;
+    uint16_t                                        port;
+    lck_mtx_t *                                     lock;                           // protects following
+    enum lustre_network_peer_state                  state;
+    errno_t                                         error;                          // why the last connect failed
+    uint32_t                                        generation;                     // bumped each time the connections are opened
+    uint64_t                                        local_nid;                      // our address, as this server sees it
+    struct lustre_network_conn *                    conns[kLustreNetworkConnCount];
+    struct lustre_network_pending *                 pending[kLustreNetworkPendingBuckets];
+    uint32_t                                        draining;                       // aborts still waiting for bulk to stop
+    struct lustre_network_callback *                callbacks;                      // for the peer's callback thread, in order
+    struct lustre_network_callback **               callbacks_tail;
+    boolean_t                                       callback_running;               // the thread has been started and not yet left
+    uint32_t                                        users;                          // imports, protected by the network lock
+    int32_t                                         ref_count;
+    struct lustre_network_peer *                    next;                           // protected by the network lock
+};
+
+kern_return_t                   lustre_network_register(void);
+void                            lustre_network_unregister(void);
+
+uint64_t                        lustre_network_nid(struct in_addr address);
+uint64_t                        lustre_network_next_xid(void);
+
+struct lustre_network_peer *    lustre_network_peer_get(uint64_t nid, uint16_t port);
+void                            lustre_network_peer_put(struct lustre_network_peer * peer);
+
+errno_t                         lustre_network_namespace_add(struct lustre_dlm_namespace * namespace);
+void                            lustre_network_namespace_remove(struct lustre_dlm_namespace * namespace);
+
+// The network layer takes a reference on the request for as long as it tracks it, and completes it with lustre_request_complete.
+errno_t                         lustre_network_send(struct lustre_request * request);
+void                            lustre_network_cancel(struct lustre_request * request);
+
+#endif /* lustre_network_h */
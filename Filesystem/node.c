@@ -0,0 +1,1040 @@
+//
+//  node.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <libkern/libkern.h>
+#include <kern/clock.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/proc.h>
+#include <sys/stat.h>
+#include <sys/vnode.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "node.h"
+#include "statahead.h"
+#include "readahead.h"
+#include "glimpse.h"
+#include "flock.h"
+#include "xattr.h"
+#include "probe.h"
+#include "layout.h"
+#include "volume.h"
+#include "logging.h"
+#include "assert.h"
+
+extern int (**vnode_operations)(void *);
+
+#pragma mark - Internal
+
+static uint32_t lustre_node_bucket(const struct lu_fid * fid)
+{
+    return (uint32_t)(((fid->f_seq ^ ((uint64_t)fid->f_oid << 32) ^ fid->f_ver) * 0x9E3779B97F4A7C15ULL) >> 32) & (kLustreNodeHashSize - 1);
+}
+
+static boolean_t lustre_node_fid_equal(const struct lu_fid * a, const struct lu_fid * b)
+{
+    return (a->f_seq == b->f_seq) && (a->f_oid == b->f_oid) && (a->f_ver == b->f_ver);
+}
+
+// Caller holds the table lock.
+static struct lustre_node * lustre_node_table_find(struct lustre_node_table * table, const struct lu_fid * fid)
+{
+    struct lustre_node * node;
+
+    for (node = table->buckets[lustre_node_bucket(fid)]; node; node = node->hash_next) {
+        if (lustre_node_fid_equal(&node->fid, fid)) {
+            break;
+        }
+    }
+
+    return node;
+}
+
+// Caller holds the table lock.
+static void lustre_node_table_insert(struct lustre_node_table * table, struct lustre_node * node)
+{
+    struct lustre_node ** bucket;
+
+    LUSTRE_BUG_ON(node->hashed);
+
+    bucket          = &table->buckets[lustre_node_bucket(&node->fid)];
+    node->hash_next = *bucket;
+    node->hashed    = TRUE;
+    *bucket         = node;
+    table->count   += 1;
+}
+
+// Caller holds the table lock.
+static void lustre_node_table_remove(struct lustre_node_table * table, struct lustre_node * node)
+{
+    struct lustre_node ** link;
+
+    LUSTRE_BUG_ON(!node->hashed);
+
+    link = &table->buckets[lustre_node_bucket(&node->fid)];
+    while (*link && (*link != node)) {
+        link = &(*link)->hash_next;
+    }
+
+    LUSTRE_BUG_ON(!*link);
+
+    *link           = node->hash_next;
+    node->hash_next = NULL;
+    node->hashed    = FALSE;
+    table->count   -= 1;
+}
+
+// The names cached for this node are no longer safe to use.  Purging under the node lock means the vnode can't finish being reclaimed
+// while we're at it: reclaim clears node->vnode under the same lock before anything else.
+static void lustre_node_lookup_revoked(struct lustre_dlm_lock * lock, void * data)
+{
+    struct lustre_node *    node;
+    boolean_t               release;
+
+    node    = (struct lustre_node *)data;
+    release = FALSE;
+
+    lck_mtx_lock(node->lock);
+    if (node->lookup_lock == lock) {
+        node->lookup_lock = NULL;
+        if (node->vnode) {
+            cache_purge(node->vnode);
+        }
+        release = TRUE;
+    }
+    lck_mtx_unlock(node->lock);
+
+    if (release) {
+        lustre_dlm_lock_ref_count_dec(lock);
+    }
+}
+
+// The directory has changed, so names we cached as missing from it may have appeared and its pages are out of date.
+static void lustre_node_update_revoked(struct lustre_dlm_lock * lock, void * data)
+{
+    struct lustre_node *    node;
+    boolean_t               release;
+
+    node    = (struct lustre_node *)data;
+    release = FALSE;
+
+    lck_mtx_lock(node->lock);
+    if (node->update_lock == lock) {
+        node->update_lock   = NULL;
+        lustre_probe_invalidate(&node->probes_absent);
+        if (node->vnode) {
+            cache_purge_negatives(node->vnode);
+        }
+        if (node->dir) {
+            lustre_dir_invalidate(node->dir);
+        }
+        release = TRUE;
+    }
+    lck_mtx_unlock(node->lock);
+
+    if (release) {
+        lustre_dlm_lock_ref_count_dec(lock);
+    }
+}
+
+static uint64_t lustre_node_attr_deadline(void)
+{
+    uint64_t deadline;
+
+    clock_interval_to_deadline(kLustreNodeAttrTTLMilliseconds, kMillisecondScale, &deadline);
+
+    return deadline;
+}
+
+static boolean_t lustre_node_time_before(const struct timespec * a, const struct timespec * b)
+{
+    return (a->tv_sec < b->tv_sec) || ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec));
+}
+
+static void lustre_node_lock_release(struct lustre_dlm_lock * lock)
+{
+    if (lock) {
+        lustre_dlm_lock_cancel(lock);
+        lustre_dlm_lock_ref_count_dec(lock);
+    }
+}
+
+#pragma mark - External
+
+struct lustre_node_table * lustre_node_table_alloc(OSMallocTag malloc_tag, lck_grp_t * lock_group)
+{
+    struct lustre_node_table * table;
+
+    table = OSMalloc(sizeof(struct lustre_node_table), malloc_tag);
+    if (!table) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate node table");
+        return NULL;
+    }
+
+    bzero(table, sizeof(struct lustre_node_table));
+
+    table->malloc_tag = malloc_tag;
+    table->lock_group = lock_group;
+
+    table->lock = lck_mtx_alloc_init(lock_group, NULL);
+    if (!table->lock) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate node table lock");
+        OSFree(table, sizeof(struct lustre_node_table), malloc_tag);
+        return NULL;
+    }
+
+    return table;
+}
+
+// Every vnode has been reclaimed by the time the volume goes away, so the table must be empty.
+void lustre_node_table_free(struct lustre_node_table * table)
+{
+    LUSTRE_BUG_ON(!table);
+    LUSTRE_BUG_ON(table->count != 0);
+
+    lck_mtx_free(table->lock, table->lock_group);
+    OSFree(table, sizeof(struct lustre_node_table), table->malloc_tag);
+}
+
+// Calls callback for every node in the table, with the table lock held.
+void lustre_node_table_iterate(struct lustre_node_table * table, lustre_node_table_callback callback, void * data)
+{
+    struct lustre_node *    node;
+    uint32_t                i;
+
+    LUSTRE_BUG_ON(!table);
+    LUSTRE_BUG_ON(!callback);
+
+    lck_mtx_lock(table->lock);
+    for (i=0; i<kLustreNodeHashSize; i++) {
+        for (node = table->buckets[i]; node; node = node->hash_next) {
+            callback(node, data);
+        }
+    }
+    lck_mtx_unlock(table->lock);
+}
+
+struct lustre_node * lustre_node_alloc(struct lustre_volume * volume, const struct lu_fid * fid, const struct lustre_node_attr * attr)
+{
+    struct lustre_node * node;
+
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!attr);
+
+    node = OSMalloc(sizeof(struct lustre_node), volume->malloc_tag);
+    if (!node) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate node");
+        return NULL;
+    }
+
+    bzero(node, sizeof(struct lustre_node));
+
+    node->volume    = volume;
+    node->fid       = *fid;
+    node->type      = lustre_node_vtype(attr->mode);
+    node->attr      = *attr;
+
+    node->lock = lck_mtx_alloc_init(volume->lock_group, NULL);
+    if (!node->lock) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate node lock");
+        OSFree(node, sizeof(struct lustre_node), volume->malloc_tag);
+        return NULL;
+    }
+
+    return node;
+}
+
+void lustre_node_free(struct lustre_node * node)
+{
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(node->hashed);
+    LUSTRE_BUG_ON(node->vnode);
+
+    lustre_node_lock_release(node->lookup_lock);
+    lustre_node_lock_release(node->update_lock);
+    if (node->dir) {
+        lustre_dir_ref_count_dec(node->dir);
+    }
+    if (node->statahead) {
+        lustre_statahead_free(node->statahead);
+    }
+    if (node->layout) {
+        lustre_layout_ref_count_dec(node->layout);
+    }
+    if (node->readahead) {
+        lustre_readahead_free(node->readahead);
+    }
+    if (node->glimpse) {
+        lustre_glimpse_free(node->glimpse);
+    }
+    if (node->xattr) {
+        lustre_xattr_ref_count_dec(node->xattr);
+    }
+    if (node->flocks) {
+        lustre_flocks_free(node->flocks);
+    }
+
+    lck_mtx_free(node->lock, node->volume->lock_group);
+    OSFree(node, sizeof(struct lustre_node), node->volume->malloc_tag);
+}
+
+void lustre_node_attr_from_body(struct lustre_node_attr * attr, const struct mdt_body * body)
+{
+    LUSTRE_BUG_ON(!attr);
+    LUSTRE_BUG_ON(!body);
+
+    bzero(attr, sizeof(struct lustre_node_attr));
+
+    attr->mode          = body->mbo_mode;
+    attr->owner         = ((uint64_t)body->mbo_uid_h << 32) | body->mbo_uid;
+    attr->group         = ((uint64_t)body->mbo_gid_h << 32) | body->mbo_gid;
+    attr->nlink         = body->mbo_nlink;
+    attr->rdev          = body->mbo_rdev;
+    attr->flags         = body->mbo_flags;
+    attr->size          = body->mbo_size;
+    attr->blocks        = body->mbo_blocks;
+    attr->access_time   = (struct timespec){ body->mbo_atime, 0 };
+    attr->modify_time   = (struct timespec){ body->mbo_mtime, 0 };
+    attr->change_time   = (struct timespec){ body->mbo_ctime, 0 };
+}
+
+// Folds a FID into an inode number the way the Linux client does, so both sides report the same numbers.
+uint64_t lustre_node_fileid(const struct lu_fid * fid)
+{
+    LUSTRE_BUG_ON(!fid);
+
+    return (fid->f_seq << 24) + ((fid->f_seq >> 24) & 0xffffff0000ULL) + fid->f_oid;
+}
+
+// Servers send Linux mode bits, whose file types happen to match ours.
+enum vtype lustre_node_vtype(uint32_t mode)
+{
+    switch (mode & S_IFMT) {
+        case S_IFDIR:   return VDIR;
+        case S_IFREG:   return VREG;
+        case S_IFLNK:   return VLNK;
+        case S_IFCHR:   return VCHR;
+        case S_IFBLK:   return VBLK;
+        case S_IFIFO:   return VFIFO;
+        case S_IFSOCK:  return VSOCK;
+        default:        return VNON;
+    }
+}
+
+// Returns the vnode for fid with an I/O reference, creating it if need be.  Works like the root vnode: whoever creates a node marks it
+// attaching while vnode_create runs, so a racing lookup of the same FID waits instead of making a second vnode.  Names are not entered
+// here; lustre_node_set_lookup_lock does that once a lock makes them safe to cache.
+errno_t lustre_node_vnode_get(struct lustre_volume * volume, const struct lu_fid * fid, const struct lustre_node_attr * attr, vnode_t dvp, struct componentname * cnp, vnode_t * vnode)
+{
+    struct lustre_node_table *  table;
+    struct lustre_node *        node;
+    struct vnode_fsparam        params;
+    vnode_t                     result;
+    vnode_t                     candidate;
+    uint32_t                    vid;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!attr);
+    LUSTRE_BUG_ON(!vnode);
+
+    table   = volume->nodes;
+    result  = NULL;
+
+    lck_mtx_lock(table->lock);
+
+    do {
+        node = lustre_node_table_find(table, fid);
+
+        if (node && node->attaching) {
+            node->waiting = TRUE;
+            (void) msleep(node, table->lock, PINOD, __FUNCTION__, NULL);
+            error = EAGAIN;
+        } else if (node) {
+            lck_mtx_lock(node->lock);
+            candidate   = node->vnode;
+            vid         = node->vid;
+            lck_mtx_unlock(node->lock);
+
+            lck_mtx_unlock(table->lock);
+
+            // Fails if the vnode was reclaimed meanwhile, by which time the node is gone from the table and the next pass creates a new one.
+
+            error = vnode_getwithvid(candidate, vid);
+            if (error == 0) {
+                lustre_node_set_attr(node, attr);
+                result = candidate;
+            } else {
+                error = EAGAIN;
+            }
+
+            lck_mtx_lock(table->lock);
+        } else {
+            node = lustre_node_alloc(volume, fid, attr);
+            if (!node) {
+                error = ENOMEM;
+                break;
+            }
+
+            node->attaching = TRUE;
+            lustre_node_table_insert(table, node);
+
+            lck_mtx_unlock(table->lock);
+
+            params.vnfs_mp         = lustre_volume_mount_point(volume);
+            params.vnfs_vtype      = node->type;
+            params.vnfs_str        = NULL;
+            params.vnfs_dvp        = dvp;
+            params.vnfs_fsnode     = node;
+            params.vnfs_vops       = vnode_operations;
+            params.vnfs_markroot   = FALSE;
+            params.vnfs_marksystem = FALSE;
+            params.vnfs_rdev       = attr->rdev;
+            params.vnfs_filesize   = attr->size;
+            params.vnfs_cnp        = cnp;
+            params.vnfs_flags      = VNFS_NOCACHE;                      // entered once the lookup lock is installed
+
+            error = vnode_create(VNCREATE_FLAVOR, sizeof(params), &params, &result);
+
+            if (error == 0) {
+                lustre_node_attach(node, result);
+                vnode_addfsref(result);
+            }
+
+            lck_mtx_lock(table->lock);
+
+            node->attaching = FALSE;
+            if (node->waiting) {
+                wakeup(node);
+                node->waiting = FALSE;
+            }
+
+            if (error != 0) {
+                os_log_error(lustre_logger_vfs, "Couldn't create vnode, error %d", error);
+                lustre_node_table_remove(table, node);
+                lustre_node_free(node);
+                result = NULL;
+            }
+        }
+
+        LUSTRE_BUG_ON(error != 0 && result);
+    } while (error == EAGAIN);
+
+    lck_mtx_unlock(table->lock);
+
+    *vnode = result;
+
+    return error;
+}
+
+struct lustre_node * lustre_node_peek(vnode_t vnode)
+{
+    struct lustre_node * node;
+
+    LUSTRE_BUG_ON(!vnode);
+
+    node = (struct lustre_node *)vnode_fsnode(vnode);
+
+    LUSTRE_BUG_ON(!node);
+
+    return node;
+}
+
+void lustre_node_attach(struct lustre_node * node, vnode_t vnode)
+{
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!vnode);
+
+    lck_mtx_lock(node->lock);
+    LUSTRE_BUG_ON(node->vnode);
+    node->vnode = vnode;
+    node->vid   = vnode_vid(vnode);
+    lck_mtx_unlock(node->lock);
+}
+
+// Forgets the vnode and gives up the locks that protected what VFS cached about it.  Revoke callbacks check node->vnode under the node
+// lock, so once this has cleared it none of them touch the vnode again.
+void lustre_node_detach(struct lustre_node * node)
+{
+    struct lustre_dlm_lock * lookup_lock;
+    struct lustre_dlm_lock * update_lock;
+
+    LUSTRE_BUG_ON(!node);
+
+    lck_mtx_lock(node->lock);
+    node->vnode         = NULL;
+    node->vid           = 0;
+    lookup_lock         = node->lookup_lock;
+    update_lock         = node->update_lock;
+    node->lookup_lock   = NULL;
+    node->update_lock   = NULL;
+    node->probes_absent = 0;
+    lck_mtx_unlock(node->lock);
+
+    lustre_node_lock_release(lookup_lock);
+    lustre_node_lock_release(update_lock);
+}
+
+// Called from reclaim for every vnode except the root, which the volume owns.
+void lustre_node_reclaim(vnode_t vnode)
+{
+    struct lustre_node *        node;
+    struct lustre_node_table *  table;
+
+    node    = lustre_node_peek(vnode);
+    table   = node->volume->nodes;
+
+    LUSTRE_BUG_ON(node->vnode != vnode);
+
+    lck_mtx_lock(table->lock);
+    LUSTRE_BUG_ON(node->attaching);
+    lustre_node_table_remove(table, node);
+    lck_mtx_unlock(table->lock);
+
+    lustre_node_detach(node);
+
+    vnode_removefsref(vnode);
+    vnode_clearfsnode(vnode);
+
+    lustre_node_free(node);
+}
+
+// The vnode the node is attached to, or NULL once reclaim has started taking it away.  Takes no reference, so the caller must be something
+// reclaim waits for, such as a revoke callback for a lock the node keeps.
+vnode_t lustre_node_vnode(struct lustre_node * node)
+{
+    vnode_t vnode;
+
+    LUSTRE_BUG_ON(!node);
+
+    lck_mtx_lock(node->lock);
+    vnode = node->vnode;
+    lck_mtx_unlock(node->lock);
+
+    return vnode;
+}
+
+struct lustre_node_attr lustre_node_get_attr(struct lustre_node * node)
+{
+    struct lustre_node_attr attr;
+
+    LUSTRE_BUG_ON(!node);
+
+    lck_mtx_lock(node->lock);
+    attr = node->attr;
+    lck_mtx_unlock(node->lock);
+
+    return attr;
+}
+
+// Once a file has objects its size and blocks belong to the OSTs; the MDT's copies lag behind, so those we keep from the last time we
+// asked the OSTs, and the modify time too unless the MDT's is later.
+void lustre_node_set_attr(struct lustre_node * node, const struct lustre_node_attr * attr)
+{
+    struct lustre_node_attr old;
+
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!attr);
+
+    lck_mtx_lock(node->lock);
+    old         = node->attr;
+    node->attr  = *attr;
+    if (node->layout && (node->layout->object_count > 0)) {
+        node->attr.size     = old.size;
+        node->attr.blocks   = old.blocks;
+        if (lustre_node_time_before(&attr->modify_time, &old.modify_time)) {
+            node->attr.modify_time = old.modify_time;
+        }
+    }
+    node->attr_expires = lustre_node_attr_deadline();
+    lck_mtx_unlock(node->lock);
+}
+
+// Copies out the attributes of the node for fid if we have one and its lookup lock still vouches for them, so callers that only want
+// attributes can skip the RPC.  Returns FALSE if there's no such node or its attributes may be stale.
+boolean_t lustre_node_cached_attr(struct lustre_volume * volume, const struct lu_fid * fid, struct lustre_node_attr * attr)
+{
+    struct lustre_node_table *  table;
+    struct lustre_node *        node;
+    boolean_t                   found;
+
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!attr);
+
+    table = volume->nodes;
+    found = FALSE;
+
+    lck_mtx_lock(table->lock);
+
+    node = lustre_node_table_find(table, fid);
+    if (node && !node->attaching) {
+        lck_mtx_lock(node->lock);
+        if ((node->lookup_lock != NULL) && lustre_dlm_lock_is_valid(node->lookup_lock)) {
+            *attr = node->attr;
+            found = TRUE;
+        }
+        lck_mtx_unlock(node->lock);
+    }
+
+    lck_mtx_unlock(table->lock);
+
+    return found;
+}
+
+// Returns the file's layout with a reference for the caller, or NULL if we haven't fetched it yet.
+struct lustre_layout * lustre_node_layout(struct lustre_node * node)
+{
+    struct lustre_layout * layout;
+
+    LUSTRE_BUG_ON(!node);
+
+    lck_mtx_lock(node->lock);
+    layout = node->layout;
+    if (layout) {
+        lustre_layout_ref_count_inc(layout);
+    }
+    lck_mtx_unlock(node->lock);
+
+    return layout;
+}
+
+// Installs a freshly fetched layout along with the attributes that came with it, sizes included, taking over the caller's reference to
+// layout (which may be NULL for a file without objects).
+void lustre_node_set_layout(struct lustre_node * node, struct lustre_layout * layout, const struct lustre_node_attr * attr)
+{
+    struct lustre_layout * release;
+
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!attr);
+
+    lck_mtx_lock(node->lock);
+    release             = node->layout;
+    node->layout        = layout;
+    node->attr          = *attr;
+    node->attr_expires  = lustre_node_attr_deadline();
+    node->size_expires  = node->attr_expires;
+    lck_mtx_unlock(node->lock);
+
+    if (release) {
+        lustre_layout_ref_count_dec(release);
+    }
+}
+
+// Records attr's modify time and size as those of the file's cached pages, returning TRUE if they differ from the last ones recorded, in
+// which case the pages belong to an older version of the file.
+boolean_t lustre_node_data_changed(struct lustre_node * node, const struct lustre_node_attr * attr)
+{
+    boolean_t changed;
+
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!attr);
+
+    lck_mtx_lock(node->lock);
+    changed = (node->data_modify_time.tv_sec != attr->modify_time.tv_sec) || (node->data_modify_time.tv_nsec != attr->modify_time.tv_nsec) || (node->data_size != attr->size);
+    node->data_modify_time  = attr->modify_time;
+    node->data_size         = attr->size;
+    lck_mtx_unlock(node->lock);
+
+    return changed;
+}
+
+// Installs the size, blocks and modify time a glimpse of the file's objects came back with, leaving the other attributes as they are.
+void lustre_node_set_size(struct lustre_node * node, const struct lustre_node_attr * attr)
+{
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!attr);
+
+    lck_mtx_lock(node->lock);
+    node->attr.size         = attr->size;
+    node->attr.blocks       = attr->blocks;
+    node->attr.modify_time  = attr->modify_time;
+    node->size_expires      = lustre_node_attr_deadline();
+    lck_mtx_unlock(node->lock);
+}
+
+// Records a write of our own, which took the file to at least size and modified it now.  The OSTs will agree once the data reaches them;
+// until then this is the only place the new size and modify time are known.
+void lustre_node_written(struct lustre_node * node, uint64_t size)
+{
+    struct timespec now;
+
+    LUSTRE_BUG_ON(!node);
+
+    nanotime(&now);
+
+    lck_mtx_lock(node->lock);
+    if (size > node->attr.size) {
+        node->attr.size = size;
+        node->data_size = size;
+    }
+    if (lustre_node_time_before(&node->attr.modify_time, &now)) {
+        node->attr.modify_time = now;
+        node->attr.change_time = now;
+    }
+    lck_mtx_unlock(node->lock);
+}
+
+// Whether the cached attributes can be returned as they are: an inode lock vouches for them, or they're younger than their TTL.  size
+// asks about a regular file's size, blocks and modify time as well, which need the layout and, with objects, a recent word from the
+// OSTs.  Takes only the node lock.  A lock the server has asked back still counts until its revoke callback has run, as it would for
+// anything else cached under it.
+boolean_t lustre_node_attr_is_valid(struct lustre_node * node, boolean_t size)
+{
+    uint64_t    now;
+    boolean_t   valid;
+
+    LUSTRE_BUG_ON(!node);
+
+    clock_get_uptime(&now);
+
+    lck_mtx_lock(node->lock);
+    valid = (node->lookup_lock != NULL) || (node->update_lock != NULL) || (now < node->attr_expires);
+    if (valid && size && (node->type == VREG)) {
+        valid = (node->layout != NULL) && ((node->layout->object_count == 0) || (now < node->size_expires));
+    }
+    lck_mtx_unlock(node->lock);
+
+    return valid;
+}
+
+// Returns the file's readahead state, making it if need be and create is set.  It belongs to the node and lasts as long as it does.
+struct lustre_readahead * lustre_node_readahead(struct lustre_node * node, boolean_t create)
+{
+    struct lustre_readahead * readahead;
+    struct lustre_readahead * created;
+
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(node->type != VREG);
+
+    lck_mtx_lock(node->lock);
+    readahead = node->readahead;
+    lck_mtx_unlock(node->lock);
+
+    if (!readahead && create) {
+        created = lustre_readahead_alloc(node->volume);
+        if (!created) {
+            return NULL;
+        }
+
+        lck_mtx_lock(node->lock);
+        if (!node->readahead) {
+            node->readahead = created;
+            created         = NULL;
+        }
+        readahead = node->readahead;
+        lck_mtx_unlock(node->lock);
+
+        if (created) {
+            lustre_readahead_free(created);
+        }
+    }
+
+    return readahead;
+}
+
+// Returns the file's glimpse state, making it if need be.  It belongs to the node and lasts as long as it does.
+struct lustre_glimpse * lustre_node_glimpse(struct lustre_node * node)
+{
+    struct lustre_glimpse * glimpse;
+    struct lustre_glimpse * created;
+
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(node->type != VREG);
+
+    lck_mtx_lock(node->lock);
+    glimpse = node->glimpse;
+    lck_mtx_unlock(node->lock);
+
+    if (!glimpse) {
+        created = lustre_glimpse_alloc(node);
+        if (!created) {
+            return NULL;
+        }
+
+        lck_mtx_lock(node->lock);
+        if (!node->glimpse) {
+            node->glimpse   = created;
+            created         = NULL;
+        }
+        glimpse = node->glimpse;
+        lck_mtx_unlock(node->lock);
+
+        if (created) {
+            lustre_glimpse_free(created);
+        }
+    }
+
+    return glimpse;
+}
+
+// Returns the node's extended attribute cache, making it if need be and create is set.  It belongs to the node and lasts as long as it
+// does.
+struct lustre_xattr * lustre_node_xattr(struct lustre_node * node, boolean_t create)
+{
+    struct lustre_xattr * xattr;
+    struct lustre_xattr * created;
+
+    LUSTRE_BUG_ON(!node);
+
+    lck_mtx_lock(node->lock);
+    xattr = node->xattr;
+    lck_mtx_unlock(node->lock);
+
+    if (!xattr && create) {
+        created = lustre_xattr_alloc(node->volume, &node->fid);
+        if (!created) {
+            return NULL;
+        }
+
+        lck_mtx_lock(node->lock);
+        if (!node->xattr) {
+            node->xattr = created;
+            created     = NULL;
+        }
+        xattr = node->xattr;
+        lck_mtx_unlock(node->lock);
+
+        if (created) {
+            lustre_xattr_ref_count_dec(created);
+        }
+    }
+
+    return xattr;
+}
+
+// Returns the node's advisory lock table, making it if need be and create is set.  It belongs to the node and lasts as long as it does.
+struct lustre_flocks * lustre_node_flocks(struct lustre_node * node, boolean_t create)
+{
+    struct lustre_flocks * flocks;
+    struct lustre_flocks * created;
+
+    LUSTRE_BUG_ON(!node);
+
+    lck_mtx_lock(node->lock);
+    flocks = node->flocks;
+    lck_mtx_unlock(node->lock);
+
+    if (!flocks && create) {
+        created = lustre_flocks_alloc(node->volume, &node->fid);
+        if (!created) {
+            return NULL;
+        }
+
+        lck_mtx_lock(node->lock);
+        if (!node->flocks) {
+            node->flocks    = created;
+            created         = NULL;
+        }
+        flocks = node->flocks;
+        lck_mtx_unlock(node->lock);
+
+        if (created) {
+            lustre_flocks_free(created);
+        }
+    }
+
+    return flocks;
+}
+
+// Takes over the caller's reference to lock.  If the lock is still good, it replaces any older one and, when cnp asks for it, the name is
+// entered in the name cache; both happen under the node lock, so a revoke can't slip in between and leave the entry behind.  Returns FALSE
+// if the lock was revoked before we got here, in which case nothing is cached.
+boolean_t lustre_node_set_lookup_lock(struct lustre_node * node, struct lustre_dlm_lock * lock, vnode_t dvp, struct componentname * cnp)
+{
+    struct lustre_dlm_lock *    release;
+    boolean_t                   installed;
+
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!lock);
+
+    lck_mtx_lock(node->lock);
+
+    installed = (node->vnode != NULL) && lustre_dlm_lock_set_revoke(lock, lustre_node_lookup_revoked, node);
+    if (installed) {
+        release             = node->lookup_lock;
+        node->lookup_lock   = lock;
+        if (dvp && cnp && (cnp->cn_flags & MAKEENTRY)) {
+            cache_enter(dvp, node->vnode, cnp);
+        }
+    } else {
+        release             = lock;
+    }
+
+    lck_mtx_unlock(node->lock);
+
+    lustre_node_lock_release(release);
+
+    return installed;
+}
+
+boolean_t lustre_node_has_update_lock(struct lustre_node * node)
+{
+    boolean_t result;
+
+    LUSTRE_BUG_ON(!node);
+
+    lck_mtx_lock(node->lock);
+    result = (node->update_lock != NULL) && lustre_dlm_lock_is_valid(node->update_lock);
+    lck_mtx_unlock(node->lock);
+
+    return result;
+}
+
+// Returns the directory's page cache with a reference for the caller, making it if need be.
+struct lustre_dir * lustre_node_dir(struct lustre_node * node)
+{
+    struct lustre_dir * dir;
+    struct lustre_dir * created;
+
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(node->type != VDIR);
+
+    created = NULL;
+
+    lck_mtx_lock(node->lock);
+    dir = node->dir;
+    lck_mtx_unlock(node->lock);
+
+    if (!dir) {
+        created = lustre_dir_alloc(node->volume->malloc_tag, node->volume->lock_group);
+        if (!created) {
+            return NULL;
+        }
+
+        lck_mtx_lock(node->lock);
+        if (!node->dir) {
+            node->dir   = created;
+            created     = NULL;
+        }
+        dir = node->dir;
+        lck_mtx_unlock(node->lock);
+
+        if (created) {
+            lustre_dir_ref_count_dec(created);
+        }
+    }
+
+    lustre_dir_ref_count_inc(dir);
+
+    return dir;
+}
+
+// Returns the directory's statahead state, making it if need be and create is set.  It belongs to the node and lasts as long as it does.
+struct lustre_statahead * lustre_node_statahead(struct lustre_node * node, boolean_t create)
+{
+    struct lustre_statahead * statahead;
+    struct lustre_statahead * created;
+
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(node->type != VDIR);
+
+    lck_mtx_lock(node->lock);
+    statahead = node->statahead;
+    lck_mtx_unlock(node->lock);
+
+    if (!statahead && create) {
+        created = lustre_statahead_alloc(node->volume->malloc_tag, node->volume->lock_group);
+        if (!created) {
+            return NULL;
+        }
+
+        lck_mtx_lock(node->lock);
+        if (!node->statahead) {
+            node->statahead = created;
+            created         = NULL;
+        }
+        statahead = node->statahead;
+        lck_mtx_unlock(node->lock);
+
+        if (created) {
+            lustre_statahead_free(created);
+        }
+    }
+
+    return statahead;
+}
+
+// As lustre_node_set_lookup_lock, for a directory's UPDATE lock.  When cnp is given, it names an entry the server said doesn't exist,
+// and is entered as a negative name under the directory; if it's a probe name, its kind is remembered as missing too (bar the ._ names,
+// where one missing says nothing of the others).
+boolean_t lustre_node_set_update_lock(struct lustre_node * node, struct lustre_dlm_lock * lock, struct componentname * cnp)
+{
+    struct lustre_dlm_lock *    release;
+    boolean_t                   installed;
+
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!lock);
+
+    lck_mtx_lock(node->lock);
+
+    installed = (node->vnode != NULL) && lustre_dlm_lock_set_revoke(lock, lustre_node_update_revoked, node);
+    if (installed) {
+        release             = node->update_lock;
+        node->update_lock   = lock;
+        if (cnp && (cnp->cn_flags & MAKEENTRY)) {
+            cache_enter(node->vnode, NULL, cnp);
+        }
+        if (cnp) {
+            lustre_probe_note_missing(&node->probes_absent, cnp->cn_nameptr, cnp->cn_namelen);
+        }
+    } else {
+        release             = lock;
+    }
+
+    lck_mtx_unlock(node->lock);
+
+    lustre_node_lock_release(release);
+
+    return installed;
+}
+
+// Returns TRUE if the directory is known to have none of the kLustreProbe* kinds in probes, which holds while we keep its UPDATE lock.
+boolean_t lustre_node_probes_absent(struct lustre_node * node, uint32_t probes)
+{
+    boolean_t result;
+
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(probes == 0);
+
+    lck_mtx_lock(node->lock);
+    result = lustre_probe_are_absent(node->probes_absent, probes) && (node->update_lock != NULL) && lustre_dlm_lock_is_valid(node->update_lock);
+    lck_mtx_unlock(node->lock);
+
+    return result;
+}
+
+// Remembers that the directory has none of the kinds in probes, as found by reading it whole at generation of its page cache.  Nothing is
+// remembered if the directory changed since, or we no longer hold its UPDATE lock.
+void lustre_node_set_probes_absent(struct lustre_node * node, uint32_t probes, uint32_t generation)
+{
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(node->type != VDIR);
+
+    lck_mtx_lock(node->lock);
+    if (node->update_lock && node->dir) {
+        lustre_probe_note_absent(&node->probes_absent, probes, generation, lustre_dir_generation(node->dir));
+    }
+    lck_mtx_unlock(node->lock);
+}
@@ -0,0 +1,150 @@
+//
+//  node.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// A node is our side of a vnode: the MDT object it stands for, its attributes and the DLM locks that keep what VFS caches about it
+// (name cache entries, attributes) valid.  Nodes are found by FID so that every name for an object ends up at the same vnode.  The
+// attributes are good for as long as we hold an inode lock on the object, or else for kLustreNodeAttrTTLMilliseconds after they were
+// fetched; a regular file's size, blocks and modify time belong to its objects, which no MDT lock covers, so they only get the latter.
+
+#ifndef lustre_node_h
+#define lustre_node_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <sys/vnode.h>
+#include <kern/locks.h>
+#include <libkern/OSMalloc.h>
+#include "wire.h"
+#include "dlm.h"
+#include "dir.h"
+
+static const uint32_t   kLustreNodeHashSize                 = 4096;
+static const uint32_t   kLustreNodeAttrTTLMilliseconds      = 1000;             // attributes no lock vouches for are good this long
+
+struct lustre_volume;
+struct lustre_statahead;
+struct lustre_readahead;
+struct lustre_glimpse;
+struct lustre_xattr;
+struct lustre_flocks;
+struct lustre_layout;
+
+struct lustre_node_attr {
+    uint32_t                                        mode;                           // type and permission bits
+    uint64_t                                        owner;                          // server uid, mapped through the volume's uid map
+    uint64_t                                        group;                          // server gid, mapped through the volume's gid map
+    uint32_t                                        nlink;
+    uint32_t                                        rdev;
+    uint32_t                                        flags;
+    uint64_t                                        size;
+    uint64_t                                        blocks;                         // 512 byte blocks
+    struct timespec                                 access_time;
+    struct timespec                                 modify_time;
+    struct timespec                                 change_time;
+};
+
+struct lustre_node {
+    struct lustre_volume *                          volume;                         // owner; outlives all its nodes
+    struct lu_fid                                   fid;
+    enum vtype                                      type;
+
+    lck_mtx_t *                                     lock;                           // protects following fields
+    vnode_t                                         vnode;                          // we hold only a soft (fs) reference
+    uint32_t                                        vid;                            // of vnode, to get an I/O reference without holding one
+    struct lustre_node_attr                         attr;
+    uint64_t                                        attr_expires;                   // uptime the attributes are good until without a lock
+    uint64_t                                        size_expires;                   // regular files with objects: likewise, for what the OSTs said
+    struct lustre_dlm_lock *                        lookup_lock;                    // keeps the names pointing at this node cached
+    struct lustre_dlm_lock *                        update_lock;                    // directories: keeps negative names and pages cached
+    uint32_t                                        probes_absent;                  // directories: kLustreProbe* kinds known missing, under update_lock
+    struct lustre_dir *                             dir;                            // directories: page cache, made on first readdir
+    struct lustre_statahead *                       statahead;                      // directories: made on first readdir
+    struct lustre_layout *                          layout;                         // regular files: fetched on open or first read
+    struct timespec                                 data_modify_time;               // regular files: modify time and size the cached pages
+    uint64_t                                        data_size;                      // were read at
+    struct lustre_readahead *                       readahead;                      // regular files: made on first read
+    uint64_t                                        pagein_next;                    // regular files: where a sequential page fault comes next
+    uint32_t                                        pagein_ahead;                   // and how many clusters it prefetches
+    struct lustre_glimpse *                         glimpse;                        // regular files: made on first glimpse
+    struct lustre_xattr *                           xattr;                          // extended attributes: made on first getattr or xattr call
+    struct lustre_flocks *                          flocks;                         // advisory locks held here: made on first lock
+
+    uint64_t                                        dirty;                          // regular files, protected by the volume's writeback lock: bytes dirtied in the UBC, roughly
+    uint64_t                                        dirtied;                        // flusher tick the oldest dirty page dates from, 0 if clean
+    errno_t                                         write_error;                    // first write to fail since the last fsync or close
+
+    boolean_t                                       attaching;                      // following protected by the node table lock
+    boolean_t                                       waiting;
+    boolean_t                                       hashed;
+    struct lustre_node *                            hash_next;
+};
+
+struct lustre_node_table {
+    OSMallocTag                                     malloc_tag;
+    lck_grp_t *                                     lock_group;
+    lck_mtx_t *                                     lock;                           // protects following fields and the nodes' hash state
+    struct lustre_node *                            buckets[kLustreNodeHashSize];   // by FID
+    uint32_t                                        count;
+};
+
+typedef void (* lustre_node_table_callback)(struct lustre_node * node, void * data);
+
+struct lustre_node_table *  lustre_node_table_alloc(OSMallocTag malloc_tag, lck_grp_t * lock_group);
+void                        lustre_node_table_free(struct lustre_node_table * table);
+void                        lustre_node_table_iterate(struct lustre_node_table * table, lustre_node_table_callback callback, void * data);
+
+struct lustre_node *        lustre_node_alloc(struct lustre_volume * volume, const struct lu_fid * fid, const struct lustre_node_attr * attr);
+void                        lustre_node_free(struct lustre_node * node);
+
+void                        lustre_node_attr_from_body(struct lustre_node_attr * attr, const struct mdt_body * body);
+uint64_t                    lustre_node_fileid(const struct lu_fid * fid);
+enum vtype                  lustre_node_vtype(uint32_t mode);
+
+errno_t                     lustre_node_vnode_get(struct lustre_volume * volume, const struct lu_fid * fid, const struct lustre_node_attr * attr, vnode_t dvp, struct componentname * cnp, vnode_t * vnode);
+struct lustre_node *        lustre_node_peek(vnode_t vnode);
+void                        lustre_node_attach(struct lustre_node * node, vnode_t vnode);
+void                        lustre_node_detach(struct lustre_node * node);
+void                        lustre_node_reclaim(vnode_t vnode);
+vnode_t                     lustre_node_vnode(struct lustre_node * node);
+
+struct lustre_node_attr     lustre_node_get_attr(struct lustre_node * node);
+void                        lustre_node_set_attr(struct lustre_node * node, const struct lustre_node_attr * attr);
+boolean_t                   lustre_node_cached_attr(struct lustre_volume * volume, const struct lu_fid * fid, struct lustre_node_attr * attr);
+struct lustre_layout *      lustre_node_layout(struct lustre_node * node);
+void                        lustre_node_set_layout(struct lustre_node * node, struct lustre_layout * layout, const struct lustre_node_attr * attr);
+boolean_t                   lustre_node_data_changed(struct lustre_node * node, const struct lustre_node_attr * attr);
+void                        lustre_node_set_size(struct lustre_node * node, const struct lustre_node_attr * attr);
+void                        lustre_node_written(struct lustre_node * node, uint64_t size);
+boolean_t                   lustre_node_attr_is_valid(struct lustre_node * node, boolean_t size);
+struct lustre_readahead *   lustre_node_readahead(struct lustre_node * node, boolean_t create);
+struct lustre_glimpse *     lustre_node_glimpse(struct lustre_node * node);
+struct lustre_xattr *       lustre_node_xattr(struct lustre_node * node, boolean_t create);
+struct lustre_flocks *      lustre_node_flocks(struct lustre_node * node, boolean_t create);
+
+boolean_t                   lustre_node_set_lookup_lock(struct lustre_node * node, struct lustre_dlm_lock * lock, vnode_t dvp, struct componentname * cnp);
+boolean_t                   lustre_node_has_update_lock(struct lustre_node * node);
+struct lustre_dir *         lustre_node_dir(struct lustre_node * node);
+struct lustre_statahead *   lustre_node_statahead(struct lustre_node * node, boolean_t create);
+boolean_t                   lustre_node_set_update_lock(struct lustre_node * node, struct lustre_dlm_lock * lock, struct componentname * cnp);
+boolean_t                   lustre_node_probes_absent(struct lustre_node * node, uint32_t probes);
+void                        lustre_node_set_probes_absent(struct lustre_node * node, uint32_t probes, uint32_t generation);
+
+#endif /* lustre_node_h */
@@ -0,0 +1,480 @@
+//
+//  opencache.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <libkern/libkern.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/fcntl.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "opencache.h"
+#include "volume.h"
+#include "import.h"
+#include "mdc.h"
+#include "dlm.h"
+#include "logging.h"
+#include "assert.h"
+
+#pragma mark - Internal
+
+static uint32_t lustre_open_cache_bucket(const struct lu_fid * fid, enum lustre_open_mode mode)
+{
+    return (uint32_t)(((fid->f_seq * 31 + fid->f_oid) * kLustreOpenModeCount + mode) % kLustreOpenCacheHashSize);
+}
+
+static enum lustre_open_mode lustre_open_cache_mode(int fflag)
+{
+    return (fflag & FWRITE) ? kLustreOpenModeWrite : kLustreOpenModeRead;
+}
+
+// Caller holds the lock.
+static struct lustre_open_handle * lustre_open_cache_find(struct lustre_open_cache * cache, const struct lu_fid * fid, enum lustre_open_mode mode)
+{
+    struct lustre_open_handle * handle;
+
+    for (handle = cache->buckets[lustre_open_cache_bucket(fid, mode)]; handle; handle = handle->hash_next) {
+        if ((handle->mode == mode) && (handle->fid.f_seq == fid->f_seq) && (handle->fid.f_oid == fid->f_oid) && (handle->fid.f_ver == fid->f_ver)) {
+            break;
+        }
+    }
+
+    return handle;
+}
+
+// Caller holds the lock.
+static void lustre_open_cache_idle_append(struct lustre_open_cache * cache, struct lustre_open_handle * handle)
+{
+    handle->idle_prev   = cache->idle_newest;
+    handle->idle_next   = NULL;
+    if (cache->idle_newest) {
+        cache->idle_newest->idle_next = handle;
+    } else {
+        cache->idle_oldest = handle;
+    }
+    cache->idle_newest  = handle;
+    cache->idle_count  += 1;
+}
+
+// Caller holds the lock.
+static void lustre_open_cache_idle_remove(struct lustre_open_cache * cache, struct lustre_open_handle * handle)
+{
+    if (handle->idle_prev) {
+        handle->idle_prev->idle_next = handle->idle_next;
+    } else {
+        cache->idle_oldest = handle->idle_next;
+    }
+    if (handle->idle_next) {
+        handle->idle_next->idle_prev = handle->idle_prev;
+    } else {
+        cache->idle_newest = handle->idle_prev;
+    }
+    handle->idle_prev   = NULL;
+    handle->idle_next   = NULL;
+    cache->idle_count  -= 1;
+}
+
+// Caller holds the lock.  Whoever unhashes a handle owns it, and must release it once the lock is dropped.
+static void lustre_open_cache_unhash(struct lustre_open_cache * cache, struct lustre_open_handle * handle)
+{
+    struct lustre_open_handle ** link;
+
+    for (link = &cache->buckets[lustre_open_cache_bucket(&handle->fid, handle->mode)]; *link != handle; link = &(*link)->hash_next) {
+        LUSTRE_BUG_ON(!*link);
+    }
+    *link = handle->hash_next;
+
+    if (handle->users == 0) {
+        lustre_open_cache_idle_remove(cache, handle);
+    }
+    handle->hash_next   = NULL;
+    handle->hashed      = FALSE;
+}
+
+// Called once the handle is closed on the MDT, or can't be: frees it.  A close sent with lustre_open_cache_release_async was counted in
+// closing, and the cache can go as soon as that count drops, so nothing here touches the cache after the lock is dropped.
+static void lustre_open_cache_finish(struct lustre_open_handle * handle, errno_t error, boolean_t async)
+{
+    struct lustre_open_cache *  cache;
+    struct lustre_import *      import;
+
+    cache   = handle->cache;
+    import  = handle->import;
+
+    if (error != 0) {
+        os_log_info(lustre_logger_vfs, "Couldn't close [0x%llx:0x%x:0x%x], error %d", handle->fid.f_seq, handle->fid.f_oid, handle->fid.f_ver, error);
+    }
+
+    OSFree(handle, sizeof(struct lustre_open_handle), cache->volume->malloc_tag);
+    lustre_import_ref_count_dec(import);
+
+    lck_mtx_lock(cache->lock);
+    cache->stats.closes += 1;
+    if (async) {
+        cache->closing -= 1;
+        if (cache->closing == 0) {
+            wakeup(&cache->closing);
+        }
+    }
+    lck_mtx_unlock(cache->lock);
+}
+
+static void lustre_open_cache_drop_lock(struct lustre_open_handle * handle)
+{
+    if (handle->lock) {
+        lustre_dlm_lock_cancel(handle->lock);
+        lustre_dlm_lock_ref_count_dec(handle->lock);
+        handle->lock = NULL;
+    }
+}
+
+// Gives back the handle's lock, closes it on the MDT and frees it.  Called without the cache lock, on a handle nobody can find.
+static void lustre_open_cache_release(struct lustre_open_handle * handle)
+{
+    errno_t error;
+
+    LUSTRE_BUG_ON(handle->hashed);
+
+    lustre_open_cache_drop_lock(handle);
+
+    error = lustre_mdc_close(handle->import, &handle->fid, handle->handle);
+
+    lustre_open_cache_finish(handle, error, FALSE);
+}
+
+static void lustre_open_cache_closed(struct lustre_request * request, void * data)
+{
+    lustre_open_cache_finish((struct lustre_open_handle *)data, request->error, TRUE);
+}
+
+// As lustre_open_cache_release, without waiting for the MDT: the handle is freed when the close's reply comes back.
+static void lustre_open_cache_release_async(struct lustre_open_handle * handle)
+{
+    struct lustre_open_cache *  cache;
+    struct lustre_request *     request;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(handle->hashed);
+
+    cache = handle->cache;
+
+    lustre_open_cache_drop_lock(handle);
+
+    lck_mtx_lock(cache->lock);
+    cache->closing += 1;
+    lck_mtx_unlock(cache->lock);
+
+    error = lustre_mdc_close_prepare(handle->import, &handle->fid, handle->handle, &request);
+    if (error != 0) {
+        lustre_open_cache_finish(handle, error, TRUE);
+        return;
+    }
+
+    lustre_request_set_callback(request, lustre_open_cache_closed, handle);
+
+    // A failure to send completes the request, so the callback has already heard about it.
+
+    (void)lustre_request_send_async(request);
+    lustre_request_ref_count_dec(request);
+}
+
+// The server wants the OPEN lock back, so the handle can't be kept once nobody is using it.  An idle handle is closed now; one in use is
+// closed by its last close.  This runs on the thread that answers every lock callback for every mount, and the server is waiting for our
+// answer, so the close is sent without waiting for it.
+static void lustre_open_cache_revoke(struct lustre_dlm_lock * lock, void * data)
+{
+    struct lustre_open_handle * handle;
+    struct lustre_open_cache *  cache;
+    boolean_t                   release;
+
+    handle  = data;
+    cache   = handle->cache;
+    release = FALSE;
+
+    lck_mtx_lock(cache->lock);
+    if (handle->hashed) {
+        handle->revoked = TRUE;
+        if (handle->users == 0) {
+            lustre_open_cache_unhash(cache, handle);
+            cache->stats.revoked += 1;
+            release = TRUE;
+        }
+    }
+    lck_mtx_unlock(cache->lock);
+
+    // Anyone else who unhashed the handle is cancelling the lock, which waits for us to return before they free it.
+
+    if (release) {
+        lustre_open_cache_release_async(handle);
+    }
+}
+
+#pragma mark - External
+
+struct lustre_open_cache * lustre_open_cache_alloc(struct lustre_volume * volume)
+{
+    struct lustre_open_cache * cache;
+
+    LUSTRE_BUG_ON(!volume);
+
+    cache = OSMalloc(sizeof(struct lustre_open_cache), volume->malloc_tag);
+    if (!cache) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate open cache");
+        return NULL;
+    }
+
+    bzero(cache, sizeof(struct lustre_open_cache));
+
+    cache->volume = volume;
+
+    cache->lock = lck_mtx_alloc_init(volume->lock_group, NULL);
+    if (!cache->lock) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate open cache lock");
+        OSFree(cache, sizeof(struct lustre_open_cache), volume->malloc_tag);
+        return NULL;
+    }
+
+    return cache;
+}
+
+// Only called once the cache has been purged and every vnode has gone, so there are no handles left.
+void lustre_open_cache_free(struct lustre_open_cache * cache)
+{
+    struct lustre_volume *  volume;
+    uint32_t                i;
+
+    LUSTRE_BUG_ON(!cache);
+
+    volume = cache->volume;
+
+    for (i=0; i<kLustreOpenCacheHashSize; i++) {
+        LUSTRE_BUG_ON(cache->buckets[i]);
+    }
+    LUSTRE_BUG_ON(cache->closing > 0);
+
+    lck_mtx_free(cache->lock, volume->lock_group);
+    OSFree(cache, sizeof(struct lustre_open_cache), volume->malloc_tag);
+}
+
+// Gets an open handle on fid for an open with fflag, either one we already have (which costs nothing) or a new one from the MDT.  Every
+// successful call must be matched by a lustre_open_cache_close with the same fflag.  *fresh says whether the MDT was asked, in which case
+// reply holds what it said about the file and the caller releases it with lustre_mdc_open_reply_release.
+errno_t lustre_open_cache_open(struct lustre_open_cache * cache, const struct lu_fid * fid, int fflag, struct lustre_mdc_open_reply * reply, boolean_t * fresh)
+{
+    struct lustre_volume *          volume;
+    struct lustre_open_handle *     handle;
+    struct lustre_open_handle *     existing;
+    struct lustre_import *          import;
+    struct lustre_dlm_lock *        lock;
+    enum lustre_open_mode           mode;
+    uint64_t                        flags;
+    errno_t                         error;
+
+    LUSTRE_BUG_ON(!cache);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!reply);
+    LUSTRE_BUG_ON(!fresh);
+
+    *fresh  = FALSE;
+    volume  = cache->volume;
+    mode    = lustre_open_cache_mode(fflag);
+
+    lck_mtx_lock(cache->lock);
+    handle = lustre_open_cache_find(cache, fid, mode);
+    if (handle) {
+        if (handle->users == 0) {
+            lustre_open_cache_idle_remove(cache, handle);
+        }
+        handle->users            += 1;
+        cache->stats.opens_saved += 1;
+    }
+    lck_mtx_unlock(cache->lock);
+
+    if (handle) {
+        return 0;
+    }
+
+    error = lustre_volume_fid_import(volume, fid, &import);
+    if (error != 0) {
+        return error;
+    }
+
+    flags = ((mode == kLustreOpenModeWrite) ? kLustreOpenFlagWrite : kLustreOpenFlagRead) | kLustreOpenFlagLock;
+
+    error = lustre_mdc_open(import, volume->dlm, fid, flags, volume->malloc_tag, reply, &lock);
+    if (error != 0) {
+        lustre_import_ref_count_dec(import);
+        return error;
+    }
+
+    handle = OSMalloc(sizeof(struct lustre_open_handle), volume->malloc_tag);
+    if (!handle) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate open handle");
+        if (lock) {
+            lustre_dlm_lock_cancel(lock);
+            lustre_dlm_lock_ref_count_dec(lock);
+        }
+        (void)lustre_mdc_close(import, fid, reply->body.mbo_open_handle);
+        lustre_mdc_open_reply_release(reply, volume->malloc_tag);
+        lustre_import_ref_count_dec(import);
+        return ENOMEM;
+    }
+
+    bzero(handle, sizeof(struct lustre_open_handle));
+
+    handle->cache   = cache;
+    handle->fid     = *fid;
+    handle->mode    = mode;
+    handle->import  = import;
+    handle->handle  = reply->body.mbo_open_handle;
+    handle->lock    = lock;
+    handle->users   = 1;
+
+    *fresh = TRUE;
+
+    // Someone else may have opened the file in the same mode while we were asking; theirs wins and ours goes straight back.
+
+    lck_mtx_lock(cache->lock);
+    cache->stats.opens += 1;
+    existing = lustre_open_cache_find(cache, fid, mode);
+    if (existing) {
+        if (existing->users == 0) {
+            lustre_open_cache_idle_remove(cache, existing);
+        }
+        existing->users += 1;
+    } else {
+        handle->hash_next   = cache->buckets[lustre_open_cache_bucket(fid, mode)];
+        handle->hashed      = TRUE;
+        cache->buckets[lustre_open_cache_bucket(fid, mode)] = handle;
+    }
+    lck_mtx_unlock(cache->lock);
+
+    if (existing) {
+        lustre_open_cache_release(handle);
+        return 0;
+    }
+
+    // We're a user, so nobody can release the handle before this.  A lock revoked in the meantime just means the handle isn't kept.
+
+    if (lock && !lustre_dlm_lock_set_revoke(lock, lustre_open_cache_revoke, handle)) {
+        lck_mtx_lock(cache->lock);
+        handle->revoked = TRUE;
+        lck_mtx_unlock(cache->lock);
+    }
+
+    return 0;
+}
+
+// Drops a use of the handle lustre_open_cache_open found for fid and fflag.  The last close keeps the handle if its OPEN lock is still
+// good, and closes it on the MDT if not.
+void lustre_open_cache_close(struct lustre_open_cache * cache, const struct lu_fid * fid, int fflag)
+{
+    struct lustre_open_handle *     handle;
+    struct lustre_open_handle *     evict;
+    boolean_t                       release;
+
+    LUSTRE_BUG_ON(!cache);
+    LUSTRE_BUG_ON(!fid);
+
+    evict   = NULL;
+    release = FALSE;
+
+    lck_mtx_lock(cache->lock);
+
+    handle = lustre_open_cache_find(cache, fid, lustre_open_cache_mode(fflag));
+    if (!handle) {
+        lck_mtx_unlock(cache->lock);
+        return;
+    }
+
+    LUSTRE_BUG_ON(handle->users == 0);
+
+    handle->users -= 1;
+    if (handle->users > 0) {
+        cache->stats.closes_saved += 1;
+    } else if (handle->lock && !handle->revoked) {
+        lustre_open_cache_idle_append(cache, handle);
+        cache->stats.closes_saved += 1;
+        if (cache->idle_count > kLustreOpenCacheIdleMax) {
+            evict = cache->idle_oldest;
+            lustre_open_cache_unhash(cache, evict);
+            cache->stats.evicted += 1;
+        }
+    } else {
+        lustre_open_cache_unhash(cache, handle);
+        release = TRUE;
+    }
+
+    lck_mtx_unlock(cache->lock);
+
+    if (evict) {
+        lustre_open_cache_release(evict);
+    }
+    if (release) {
+        lustre_open_cache_release(handle);
+    }
+}
+
+// Closes every handle, and waits for closes already sent, for unmount.  Must be called while the MDTs are still connected.  A forced unmount can leave handles in use by
+// files whose vnodes were torn away; their closes find nothing and do nothing.
+void lustre_open_cache_purge(struct lustre_open_cache * cache)
+{
+    struct lustre_open_handle * handle;
+    uint32_t                    i;
+
+    LUSTRE_BUG_ON(!cache);
+
+    for (i=0; i<kLustreOpenCacheHashSize; ) {
+        lck_mtx_lock(cache->lock);
+        handle = cache->buckets[i];
+        if (handle) {
+            lustre_open_cache_unhash(cache, handle);
+            handle->users = 0;
+        }
+        lck_mtx_unlock(cache->lock);
+
+        if (handle) {
+            lustre_open_cache_release(handle);
+        } else {
+            i++;
+        }
+    }
+
+    lck_mtx_lock(cache->lock);
+    while (cache->closing > 0) {
+        (void)msleep(&cache->closing, cache->lock, PINOD, __FUNCTION__, NULL);
+    }
+    lck_mtx_unlock(cache->lock);
+}
+
+struct lustre_open_stats lustre_open_cache_stats(struct lustre_open_cache * cache)
+{
+    struct lustre_open_stats stats;
+
+    LUSTRE_BUG_ON(!cache);
+
+    lck_mtx_lock(cache->lock);
+    stats = cache->stats;
+    lck_mtx_unlock(cache->lock);
+
+    return stats;
+}
@@ -0,0 +1,96 @@
+//
+//  opencache.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// Open handle cache.  Every open of a file needs an open handle from its MDT and every close gives one back, two RPCs per open/close pair.
+// We keep one handle per FID and access mode and share it between all the opens of that file in that mode, so only the first open and
+// the last close talk to the MDT.  Better still, if the MDT granted an OPEN lock along with the handle, the last close keeps the handle
+// instead of closing it, and the next open reuses it without any RPC at all.  Idle handles are closed when the server revokes their lock,
+// or oldest first once there are more than kLustreOpenCacheIdleMax of them.
+
+#ifndef lustre_opencache_h
+#define lustre_opencache_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <kern/locks.h>
+#include "wire.h"
+#include "mdc.h"
+
+static const uint32_t   kLustreOpenCacheHashSize            = 256;
+static const uint32_t   kLustreOpenCacheIdleMax             = 1024;             // handles kept open with nobody using them, per volume
+
+struct lustre_volume;
+struct lustre_import;
+struct lustre_dlm_lock;
+struct lustre_open_cache;
+
+enum lustre_open_mode {
+    kLustreOpenModeRead                             = 0,
+    kLustreOpenModeWrite,
+    kLustreOpenModeCount,
+};
+
+struct lustre_open_handle {
+    struct lustre_open_cache *                      cache;
+    struct lu_fid                                   fid;
+    enum lustre_open_mode                           mode;
+    struct lustre_import *                          import;                         // MDT holding the handle, with a reference
+    struct lustre_handle                            handle;                         // the MDT's
+    struct lustre_dlm_lock *                        lock;                           // OPEN lock that lets us keep the handle, or NULL
+
+    uint32_t                                        users;                          // following protected by the cache lock
+    boolean_t                                       hashed;                         // findable; whoever unhashes it closes it
+    boolean_t                                       revoked;                        // lost the lock, so closed once unused
+    struct lustre_open_handle *                     hash_next;
+    struct lustre_open_handle *                     idle_prev;                      // on the idle list while users is 0
+    struct lustre_open_handle *                     idle_next;
+};
+
+struct lustre_open_stats {
+    uint64_t                                        opens;                          // open RPCs sent
+    uint64_t                                        closes;                         // close RPCs sent
+    uint64_t                                        opens_saved;                    // opens that used a handle we already had
+    uint64_t                                        closes_saved;                   // closes that left the handle open for others, or cached
+    uint64_t                                        revoked;                        // idle handles closed because the server revoked their lock
+    uint64_t                                        evicted;                        // idle handles closed to stay under kLustreOpenCacheIdleMax
+};
+
+struct lustre_open_cache {
+    struct lustre_volume *                          volume;
+    lck_mtx_t *                                     lock;                           // protects following fields and the handles' state
+    struct lustre_open_handle *                     buckets[kLustreOpenCacheHashSize];  // by FID and mode
+    struct lustre_open_handle *                     idle_oldest;
+    struct lustre_open_handle *                     idle_newest;
+    uint32_t                                        idle_count;
+    uint32_t                                        closing;                        // closes sent without waiting, not yet answered
+    struct lustre_open_stats                        stats;
+};
+
+struct lustre_open_cache *  lustre_open_cache_alloc(struct lustre_volume * volume);
+void                        lustre_open_cache_free(struct lustre_open_cache * cache);
+
+errno_t                     lustre_open_cache_open(struct lustre_open_cache * cache, const struct lu_fid * fid, int fflag, struct lustre_mdc_open_reply * reply, boolean_t * fresh);
+void                        lustre_open_cache_close(struct lustre_open_cache * cache, const struct lu_fid * fid, int fflag);
+void                        lustre_open_cache_purge(struct lustre_open_cache * cache);
+struct lustre_open_stats    lustre_open_cache_stats(struct lustre_open_cache * cache);
+
+#endif /* lustre_opencache_h */
@@ -0,0 +1,388 @@
+//
+//  osc.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <libkern/libkern.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "osc.h"
+#include "import.h"
+#include "request.h"
+#include "dlm.h"
+#include "logging.h"
+#include "assert.h"
+
+static const uint32_t   kLustreOSCReplySize                 = 4096;
+
+#pragma mark - Internal
+
+// Builds a bulk read or write of extents of one object, in increasing offset order, from or into segments.  The extents' bytes go back to
+// back, filling or draining the segments in turn, so the two only have to agree on the total length.
+static errno_t lustre_osc_brw_prepare(struct lustre_import * import, uint32_t opcode, const struct ost_id * oi, const struct lustre_osc_extent * extents, uint32_t extent_count, const struct lustre_request_segment * segments, uint32_t segment_count, struct lustre_request ** result)
+{
+    struct lustre_request *     request;
+    struct ost_body *           body;
+    struct obd_ioobj *          ioobj;
+    struct niobuf_remote *      niobufs;
+    uint64_t                    extent_length;
+    uint64_t                    segment_length;
+    uint32_t                    i;
+
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!oi);
+    LUSTRE_BUG_ON(!extents);
+    LUSTRE_BUG_ON(!segments);
+    LUSTRE_BUG_ON(!result);
+    LUSTRE_BUG_ON((extent_count == 0) || (extent_count > kLustreBRWPagesMax));
+
+    extent_length   = 0;
+    segment_length  = 0;
+    for (i=0; i<extent_count; i++) {
+        extent_length += extents[i].length;
+    }
+    for (i=0; i<segment_count; i++) {
+        segment_length += segments[i].length;
+    }
+
+    LUSTRE_BUG_ON(extent_length != segment_length);
+
+    request = lustre_request_alloc(import, opcode);
+    if (!request) {
+        return ENOMEM;
+    }
+
+    body    = lustre_request_field_add(request, sizeof(struct ost_body));
+    ioobj   = lustre_request_field_add(request, sizeof(struct obd_ioobj));
+    niobufs = lustre_request_field_add(request, extent_count * sizeof(struct niobuf_remote));
+    if (!body || !ioobj || !niobufs) {
+        lustre_request_ref_count_dec(request);
+        return ENOMEM;
+    }
+
+    body->oa.o_oi       = *oi;
+    body->oa.o_valid    = kLustreMDFlagId | kLustreOBDFlagGroup | kLustreMDFlagFlags;
+    body->oa.o_flags    = kLustreOBDFlagServerLock;
+
+    ioobj->ioo_oid      = *oi;
+    ioobj->ioo_max_brw  = 0;
+    ioobj->ioo_bufcnt   = extent_count;
+
+    for (i=0; i<extent_count; i++) {
+        niobufs[i].rnb_offset   = extents[i].offset;
+        niobufs[i].rnb_len      = extents[i].length;
+        niobufs[i].rnb_flags    = kLustreBRWFlagServerLock | ((opcode == kLustreOpcodeOSTRead) ? kLustreBRWFlagRead : 0);
+    }
+
+    if (opcode == kLustreOpcodeOSTRead) {
+        lustre_request_set_bulk(request, kLustreRequestBulkPut, kLustrePortalOSTBulk, segments, segment_count);
+    } else {
+        lustre_import_grant_announce(import, &body->oa);
+        lustre_request_set_bulk(request, kLustreRequestBulkGet, kLustrePortalOSTBulk, segments, segment_count);
+    }
+    lustre_request_set_reply_size(request, kLustreOSCReplySize);
+
+    *result = request;
+
+    return 0;
+}
+
+#pragma mark - External
+
+// Builds a getattr for one object without sending it; a file's objects are usually asked about all at once, from a request set.
+errno_t lustre_osc_getattr_prepare(struct lustre_import * import, const struct ost_id * oi, struct lustre_request ** result)
+{
+    struct lustre_request *     request;
+    struct ost_body *           body;
+
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!oi);
+    LUSTRE_BUG_ON(!result);
+
+    request = lustre_request_alloc(import, kLustreOpcodeOSTGetattr);
+    if (!request) {
+        return ENOMEM;
+    }
+
+    body = lustre_request_field_add(request, sizeof(struct ost_body));
+    if (!body) {
+        lustre_request_ref_count_dec(request);
+        return ENOMEM;
+    }
+
+    body->oa.o_oi       = *oi;
+    body->oa.o_valid    = kLustreMDFlagId | kLustreOBDFlagGroup;
+
+    lustre_request_set_reply_size(request, kLustreOSCReplySize);
+
+    *result = request;
+
+    return 0;
+}
+
+errno_t lustre_osc_getattr_interpret(struct lustre_request * request, struct obdo * oa)
+{
+    const struct ost_body *     reply_body;
+
+    LUSTRE_BUG_ON(!request);
+    LUSTRE_BUG_ON(!oa);
+
+    if (request->error != 0) {
+        return request->error;
+    }
+
+    reply_body = lustre_request_reply_field(request, 1, sizeof(struct ost_body), NULL);
+    if (!reply_body) {
+        return EPROTO;
+    }
+
+    *oa = reply_body->oa;
+
+    return 0;
+}
+
+// Builds a request for the extent map of one object, at most extent_count extents from its start, without sending it.
+errno_t lustre_osc_fiemap_prepare(struct lustre_import * import, const struct ost_id * oi, uint32_t extent_count, struct lustre_request ** result)
+{
+    struct lustre_request *         request;
+    struct ll_fiemap_info_key *     key;
+    struct fiemap *                 fiemap;
+
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!oi);
+    LUSTRE_BUG_ON(extent_count == 0);
+    LUSTRE_BUG_ON(!result);
+
+    request = lustre_request_alloc(import, kLustreOpcodeOSTGetInfo);
+    if (!request) {
+        return ENOMEM;
+    }
+
+    key     = lustre_request_field_add(request, sizeof(struct ll_fiemap_info_key));
+    fiemap  = lustre_request_field_add(request, sizeof(struct fiemap));
+    if (!key || !fiemap) {
+        lustre_request_ref_count_dec(request);
+        return ENOMEM;
+    }
+
+    strlcpy(key->lfik_name, kLustreFiemapKey, sizeof(key->lfik_name));
+    key->lfik_oa.o_oi                   = *oi;
+    key->lfik_oa.o_valid                = kLustreMDFlagId | kLustreOBDFlagGroup;
+    key->lfik_fiemap.fm_start           = 0;
+    key->lfik_fiemap.fm_length          = UINT64_MAX;
+    key->lfik_fiemap.fm_flags           = kLustreFiemapFlagSync;
+    key->lfik_fiemap.fm_extent_count    = extent_count;
+
+    *fiemap = key->lfik_fiemap;
+
+    lustre_request_set_reply_size(request, kLustreOSCReplySize + sizeof(struct fiemap) + extent_count * sizeof(struct fiemap_extent));
+
+    *result = request;
+
+    return 0;
+}
+
+// Points *fiemap into the reply, which holds as many extents as it says it does; good while the caller holds the request.
+errno_t lustre_osc_fiemap_interpret(struct lustre_request * request, const struct fiemap ** fiemap)
+{
+    const struct fiemap *   reply;
+    uint32_t                length;
+
+    LUSTRE_BUG_ON(!request);
+    LUSTRE_BUG_ON(!fiemap);
+
+    *fiemap = NULL;
+
+    if (request->error != 0) {
+        return request->error;
+    }
+
+    reply = lustre_request_reply_field(request, 1, sizeof(struct fiemap), &length);
+    if (!reply) {
+        return EPROTO;
+    }
+    if (reply->fm_mapped_extents > (length - sizeof(struct fiemap)) / sizeof(struct fiemap_extent)) {
+        return EPROTO;
+    }
+
+    *fiemap = reply;
+
+    return 0;
+}
+
+// Builds a glimpse of one object without sending it: an intent enqueue for a PR extent lock over the whole object.  If no one is writing
+// the object the OST grants the lock, and the size that comes with it stays good until the lock is called back; otherwise it asks the
+// writers how far they've got and answers for them, without a lock.  *lock is ours until lustre_osc_glimpse_interpret takes it over.
+errno_t lustre_osc_glimpse_prepare(struct lustre_import * import, struct lustre_dlm_namespace * namespace, const struct ost_id * oi, struct lustre_request ** result, struct lustre_dlm_lock ** lock)
+{
+    struct lustre_request *         request;
+    struct lustre_dlm_lock *        dlm_lock;
+    struct ldlm_request *           enqueue;
+    union ldlm_wire_policy_data     policy;
+    struct ldlm_res_id              resource;
+
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!namespace);
+    LUSTRE_BUG_ON(!oi);
+    LUSTRE_BUG_ON(!result);
+    LUSTRE_BUG_ON(!lock);
+
+    *result = NULL;
+    *lock   = NULL;
+
+    // OSTs name an object's resource after its FID; an old-style id with no sequence comes out as [id, 0] either way.
+
+    resource = lustre_dlm_resource_from_fid(&oi->oi_fid);
+
+    request = lustre_request_alloc(import, kLustreOpcodeLDLMEnqueue);
+    if (!request) {
+        return ENOMEM;
+    }
+
+    dlm_lock = lustre_dlm_lock_alloc(namespace, import, kLustreDLMTypeExtent, kLustreDLMModePR, &resource);
+    if (!dlm_lock) {
+        lustre_request_ref_count_dec(request);
+        return ENOMEM;
+    }
+
+    enqueue = lustre_request_field_add(request, sizeof(struct ldlm_request));
+    if (!enqueue) {
+        lustre_dlm_lock_cancel(dlm_lock);
+        lustre_dlm_lock_ref_count_dec(dlm_lock);
+        lustre_request_ref_count_dec(request);
+        return ENOMEM;
+    }
+
+    bzero(&policy, sizeof(policy));
+    policy.l_extent.start   = 0;
+    policy.l_extent.end     = UINT64_MAX;
+
+    lustre_dlm_lock_pack(dlm_lock, enqueue, kLustreDLMFlagHasIntent, &policy);
+
+    lustre_request_set_reply_size(request, kLustreOSCReplySize);
+
+    *result = request;
+    *lock   = dlm_lock;
+
+    return 0;
+}
+
+// Unpacks a completed glimpse into *lvb.  Takes over the caller's reference to dlm_lock, which ends up in *lock if the OST granted it and
+// is cancelled otherwise; *lock NULL with no error means the size is only good for now.
+errno_t lustre_osc_glimpse_interpret(struct lustre_request * request, struct lustre_dlm_lock * dlm_lock, struct ost_lvb * lvb, struct lustre_dlm_lock ** lock)
+{
+    const struct ldlm_reply *   reply;
+    const void *                reply_lvb;
+    uint32_t                    length;
+    errno_t                     error;
+
+    LUSTRE_BUG_ON(!request);
+    LUSTRE_BUG_ON(!dlm_lock);
+    LUSTRE_BUG_ON(!lvb);
+    LUSTRE_BUG_ON(!lock);
+
+    *lock = NULL;
+
+    error = request->error;
+    if (error != 0) {
+        goto end;
+    }
+
+    reply       = lustre_request_reply_field(request, 1, sizeof(struct ldlm_reply), NULL);
+    reply_lvb   = lustre_request_reply_field(request, 2, kLustreOSTLVBSizeV1, &length);
+    if (!reply || !reply_lvb) {
+        error = EPROTO;
+        goto end;
+    }
+
+    bzero(lvb, sizeof(struct ost_lvb));
+    memcpy(lvb, reply_lvb, MIN(length, (uint32_t)sizeof(struct ost_lvb)));
+
+    if (lustre_dlm_lock_granted(dlm_lock, reply)) {
+        *lock       = dlm_lock;
+        dlm_lock    = NULL;
+    }
+
+end:
+    if (dlm_lock) {
+        lustre_dlm_lock_cancel(dlm_lock);
+        lustre_dlm_lock_ref_count_dec(dlm_lock);
+    }
+
+    return error;
+}
+
+// Builds a bulk read of extents of one object into segments (see lustre_osc_brw_prepare).  Nothing is sent; the caller owns the request.
+errno_t lustre_osc_read_prepare(struct lustre_import * import, const struct ost_id * oi, const struct lustre_osc_extent * extents, uint32_t extent_count, const struct lustre_request_segment * segments, uint32_t segment_count, struct lustre_request ** result)
+{
+    return lustre_osc_brw_prepare(import, kLustreOpcodeOSTRead, oi, extents, extent_count, segments, segment_count, result);
+}
+
+// Unpacks a completed read.  *transferred is how many bytes arrived, which is short of what was asked for when the read ran past the end
+// of the object; the rest of the segments are left untouched.
+errno_t lustre_osc_read_interpret(struct lustre_request * request, uint32_t * transferred)
+{
+    LUSTRE_BUG_ON(!request);
+    LUSTRE_BUG_ON(!transferred);
+
+    *transferred = 0;
+
+    if (request->error != 0) {
+        return request->error;
+    }
+
+    if (!lustre_request_reply_field(request, 1, sizeof(struct ost_body), NULL)) {
+        return EPROTO;
+    }
+
+    *transferred = request->bulk_transferred;
+
+    return 0;
+}
+
+// Builds a bulk write of segments into extents of one object, telling the OST how our grant stands.  Nothing is sent; the caller owns
+// the request, and the segments must stay put until it completes.
+errno_t lustre_osc_write_prepare(struct lustre_import * import, const struct ost_id * oi, const struct lustre_osc_extent * extents, uint32_t extent_count, const struct lustre_request_segment * segments, uint32_t segment_count, struct lustre_request ** result)
+{
+    return lustre_osc_brw_prepare(import, kLustreOpcodeOSTWrite, oi, extents, extent_count, segments, segment_count, result);
+}
+
+// Unpacks a completed write, taking in any grant the OST sent back with it.
+errno_t lustre_osc_write_interpret(struct lustre_request * request)
+{
+    const struct ost_body *     reply_body;
+
+    LUSTRE_BUG_ON(!request);
+
+    if (request->error != 0) {
+        return request->error;
+    }
+
+    reply_body = lustre_request_reply_field(request, 1, sizeof(struct ost_body), NULL);
+    if (!reply_body) {
+        return EPROTO;
+    }
+
+    lustre_import_grant_update(request->import, &reply_body->oa);
+
+    return 0;
+}
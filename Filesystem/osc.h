@@ -0,0 +1,54 @@
+//
+//  osc.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Object storage client: the RPCs we send to OSTs.  Reads and writes ask the OST to take the extent lock itself (server-side locking),
+// which keeps each RPC consistent with concurrent writers without the client holding extent locks between calls.  The only extent locks
+// we hold are glimpse locks, read locks over a whole object that keep what we know of its size current (see glimpse.h).
+
+#ifndef lustre_osc_h
+#define lustre_osc_h
+
+#include <sys/types.h>
+#include "wire.h"
+#include "request.h"
+
+struct lustre_import;
+struct lustre_dlm_namespace;
+struct lustre_dlm_lock;
+
+// A run of bytes within one object.
+struct lustre_osc_extent {
+    uint64_t                                        offset;
+    uint32_t                                        length;
+};
+
+errno_t     lustre_osc_getattr_prepare(struct lustre_import * import, const struct ost_id * oi, struct lustre_request ** request);
+errno_t     lustre_osc_getattr_interpret(struct lustre_request * request, struct obdo * oa);
+errno_t     lustre_osc_fiemap_prepare(struct lustre_import * import, const struct ost_id * oi, uint32_t extent_count, struct lustre_request ** request);
+errno_t     lustre_osc_fiemap_interpret(struct lustre_request * request, const struct fiemap ** fiemap);
+errno_t     lustre_osc_glimpse_prepare(struct lustre_import * import, struct lustre_dlm_namespace * namespace, const struct ost_id * oi, struct lustre_request ** request, struct lustre_dlm_lock ** lock);
+errno_t     lustre_osc_glimpse_interpret(struct lustre_request * request, struct lustre_dlm_lock * dlm_lock, struct ost_lvb * lvb, struct lustre_dlm_lock ** lock);
+errno_t     lustre_osc_read_prepare(struct lustre_import * import, const struct ost_id * oi, const struct lustre_osc_extent * extents, uint32_t extent_count, const struct lustre_request_segment * segments, uint32_t segment_count, struct lustre_request ** request);
+errno_t     lustre_osc_read_interpret(struct lustre_request * request, uint32_t * transferred);
+errno_t     lustre_osc_write_prepare(struct lustre_import * import, const struct ost_id * oi, const struct lustre_osc_extent * extents, uint32_t extent_count, const struct lustre_request_segment * segments, uint32_t segment_count, struct lustre_request ** request);
+errno_t     lustre_osc_write_interpret(struct lustre_request * request);
+
+#endif /* lustre_osc_h */
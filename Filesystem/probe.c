@@ -0,0 +1,100 @@
+//
+//  probe.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <libkern/libkern.h>
+#include <string.h>
+
+#include "probe.h"
+
+struct lustre_probe_name {
+    const char *    name;
+    size_t          length;
+    uint32_t        probe;
+};
+
+#define LUSTRE_PROBE_NAME(name, probe) { name, sizeof(name) - 1, probe }
+
+static const struct lustre_probe_name kLustreProbeNames[] = {
+    LUSTRE_PROBE_NAME(".DS_Store",                          kLustreProbeDSStore),
+    LUSTRE_PROBE_NAME(".localized",                         kLustreProbeLocalized),
+    LUSTRE_PROBE_NAME("Icon\r",                             kLustreProbeIcon),
+    LUSTRE_PROBE_NAME(".hidden",                            kLustreProbeHidden),
+    LUSTRE_PROBE_NAME(".metadata_never_index",              kLustreProbeNeverIndex),
+    LUSTRE_PROBE_NAME(".metadata_never_index_unless_rootfs", kLustreProbeNeverIndex),
+    LUSTRE_PROBE_NAME(".metadata_direct_scope_only",        kLustreProbeNeverIndex),
+    LUSTRE_PROBE_NAME(".Spotlight-V100",                    kLustreProbeSpotlight),
+    LUSTRE_PROBE_NAME(".Trashes",                           kLustreProbeTrashes),
+    LUSTRE_PROBE_NAME(".fseventsd",                         kLustreProbeFSEvents),
+    LUSTRE_PROBE_NAME(".VolumeIcon.icns",                   kLustreProbeVolumeIcon),
+};
+
+#pragma mark - External
+
+// Returns the probe bit for a name, which needn't be terminated, or 0 if it isn't one.
+uint32_t lustre_probe_from_name(const char * name, size_t length)
+{
+    uint32_t i;
+
+    if ((length > 2) && (name[0] == '.') && (name[1] == '_')) {
+        return kLustreProbeAppleDouble;
+    }
+
+    for (i=0; i<sizeof(kLustreProbeNames)/sizeof(kLustreProbeNames[0]); i++) {
+        if ((kLustreProbeNames[i].length == length) && (memcmp(kLustreProbeNames[i].name, name, length) == 0)) {
+            return kLustreProbeNames[i].probe;
+        }
+    }
+
+    return 0;
+}
+
+// Returns the kinds a directory was found not to have, given the kinds seen while reading all of it.
+uint32_t lustre_probe_from_scan(uint32_t seen)
+{
+    return kLustreProbeAll & ~seen;
+}
+
+// Notes that the server said name doesn't exist.  One missing ._ name says nothing of the others, so only a scan sets that bit.
+void lustre_probe_note_missing(uint32_t * absent, const char * name, size_t length)
+{
+    *absent |= lustre_probe_from_name(name, length) & ~kLustreProbeAppleDouble;
+}
+
+// Notes the kinds a scan of the directory at generation of its page cache found missing, unless it has changed since (current).
+void lustre_probe_note_absent(uint32_t * absent, uint32_t probes, uint32_t generation, uint32_t current)
+{
+    if (generation == current) {
+        *absent |= probes;
+    }
+}
+
+// Forgets everything known missing, once the directory may have changed.
+void lustre_probe_invalidate(uint32_t * absent)
+{
+    *absent = 0;
+}
+
+// Returns TRUE if every kind in probes is known missing.
+boolean_t lustre_probe_are_absent(uint32_t absent, uint32_t probes)
+{
+    return (probes != 0) && ((absent & probes) == probes);
+}
@@ -0,0 +1,55 @@
+//
+//  probe.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Probe names: the files Finder, Spotlight and friends look for in every directory they touch (.DS_Store, ._ AppleDouble files,
+// .localized, Icon\r and the like), which on a tree written from other systems are nearly always missing.  Each kind has a bit, and a
+// directory keeps the bits of the kinds it's known not to have for as long as we hold its UPDATE lock, so a probe it has answered before
+// is answered again without asking the MDT.  All the ._ names share one bit, which only a look at the whole directory can set.
+
+#ifndef lustre_probe_h
+#define lustre_probe_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+
+static const uint32_t   kLustreProbeAppleDouble             = 0x0001;           // ._name, any of them
+static const uint32_t   kLustreProbeDSStore                 = 0x0002;           // .DS_Store
+static const uint32_t   kLustreProbeLocalized               = 0x0004;           // .localized
+static const uint32_t   kLustreProbeIcon                    = 0x0008;           // Icon\r
+static const uint32_t   kLustreProbeHidden                  = 0x0010;           // .hidden
+static const uint32_t   kLustreProbeNeverIndex              = 0x0020;           // .metadata_never_index and its variants
+static const uint32_t   kLustreProbeSpotlight               = 0x0040;           // .Spotlight-V100
+static const uint32_t   kLustreProbeTrashes                 = 0x0080;           // .Trashes
+static const uint32_t   kLustreProbeFSEvents                = 0x0100;           // .fseventsd
+static const uint32_t   kLustreProbeVolumeIcon              = 0x0200;           // .VolumeIcon.icns
+static const uint32_t   kLustreProbeAll                     = 0x03ff;
+
+static const uint64_t   kLustreProbeScanMax                 = 1024 * 1024;      // largest directory read whole to learn what it lacks
+
+uint32_t    lustre_probe_from_name(const char * name, size_t length);
+uint32_t    lustre_probe_from_scan(uint32_t seen);
+
+void        lustre_probe_note_missing(uint32_t * absent, const char * name, size_t length);
+void        lustre_probe_note_absent(uint32_t * absent, uint32_t probes, uint32_t generation, uint32_t current);
+void        lustre_probe_invalidate(uint32_t * absent);
+boolean_t   lustre_probe_are_absent(uint32_t absent, uint32_t probes);
+
+#endif /* lustre_probe_h */
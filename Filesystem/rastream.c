@@ -0,0 +1,337 @@
+//
+//  rastream.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// Readahead's streams and its share of the budget: which stream an access continues, what to read ahead of it and what that costs.  No
+// locks, allocation or I/O; readahead.c does those around it.
+
+#include <libkern/libkern.h>
+#include <libkern/OSAtomic.h>
+#include <sys/param.h>
+#include <string.h>
+
+#include "readahead.h"
+
+#pragma mark - Internal
+
+static boolean_t lustre_readahead_stream_is_contiguous(const struct lustre_readahead_stream * stream)
+{
+    return (stream->step == (int64_t)stream->length) || (stream->step == -(int64_t)stream->length);
+}
+
+// Takes bytes of the stream's share of the budget.
+static void lustre_readahead_reserve(struct lustre_readahead * readahead, struct lustre_readahead_stream * stream, uint64_t bytes)
+{
+    stream->reserved += bytes;
+    OSAddAtomic64((SInt64)bytes, readahead->budget);
+}
+
+// Gives bytes of the stream's share of the budget back.
+static void lustre_readahead_release(struct lustre_readahead * readahead, struct lustre_readahead_stream * stream, uint64_t bytes)
+{
+    bytes = MIN(bytes, stream->reserved);
+
+    stream->reserved -= bytes;
+    OSAddAtomic64(-(SInt64)bytes, readahead->budget);
+}
+
+// Starts a fresh stream at this access.
+static void lustre_readahead_stream_reset(struct lustre_readahead * readahead, struct lustre_readahead_stream * stream, uint64_t offset, uint32_t length, uint64_t now)
+{
+    lustre_readahead_release(readahead, stream, stream->reserved);
+
+    bzero(stream, sizeof(struct lustre_readahead_stream));
+    stream->used        = TRUE;
+    stream->offset      = offset;
+    stream->length      = length;
+    stream->last_used   = readahead->clock;
+    stream->touched     = now;
+}
+
+// The slot a new stream goes in: a free one, or else the least recently used.
+static struct lustre_readahead_stream * lustre_readahead_victim(struct lustre_readahead * readahead)
+{
+    struct lustre_readahead_stream *    victim;
+    uint32_t                            i;
+
+    victim = &readahead->streams[0];
+    for (i=0; i<kLustreReadAheadStreams; i++) {
+        if (!readahead->streams[i].used) {
+            return &readahead->streams[i];
+        }
+        if (readahead->streams[i].last_used < victim->last_used) {
+            victim = &readahead->streams[i];
+        }
+    }
+
+    return victim;
+}
+
+// Tops the stream's readahead up to its window and returns the ranges to read, charging the budget for exactly what they cover.  A
+// contiguous stream reads ahead in one range from where its last one ended, stretched to the next stripe boundary so the cluster layer
+// turns it into whole-stripe RPCs; a strided one reads each access it expects on its own.  Nothing is read past the end of the file or
+// before its start.
+static uint32_t lustre_readahead_plan(struct lustre_readahead * readahead, struct lustre_readahead_stream * stream, uint64_t size, uint32_t stripe_size, uint64_t stripe_width, struct lustre_readahead_range * ranges)
+{
+    int64_t     available;
+    int64_t     start;
+    int64_t     end;
+    uint64_t    target;
+    uint64_t    ahead;
+    uint64_t    bytes;
+    uint32_t    count;
+    uint32_t    need;
+    uint32_t    k;
+
+    if (stream->window == 0) {
+        if (lustre_readahead_stream_is_contiguous(stream)) {
+            stream->window = MAX(stripe_width, stream->length);
+        } else {
+            stream->window = (uint64_t)stream->length * kLustreReadAheadTrigger * 2;
+        }
+        stream->window = MIN(stream->window, kLustreReadAheadWindowMax);
+    }
+
+    target = MAX(stream->window / stream->length, 1);
+    if (!lustre_readahead_stream_is_contiguous(stream)) {
+        target = MIN(target, kLustreReadAheadAccessesMax);
+    }
+    ahead = lustre_readahead_stream_ahead(stream);
+    if (ahead >= target) {
+        return 0;
+    }
+
+    available = kLustreReadAheadBudget - *readahead->budget;
+    if (available < (int64_t)stream->length) {
+        return 0;
+    }
+
+    need    = (uint32_t)MIN(target - ahead, (uint64_t)available / stream->length);
+    count   = 0;
+    bytes   = 0;
+
+    if (stream->step > 0) {
+        if (lustre_readahead_stream_is_contiguous(stream)) {
+            start   = (int64_t)stream->frontier;
+            end     = (int64_t)(stream->offset + stream->length) + (int64_t)(ahead + need) * stream->step;
+            end     = roundup(end, (int64_t)stripe_size);
+            end     = MIN(end, (int64_t)size);
+            if (start < end) {
+                ranges[count]       = (struct lustre_readahead_range){ start, (int)(end - start) };
+                count              += 1;
+                bytes              += (uint64_t)(end - start);
+                stream->frontier    = (uint64_t)end;
+            }
+            goto end;
+        }
+    } else if (lustre_readahead_stream_is_contiguous(stream)) {
+        start   = (int64_t)stream->offset + (int64_t)(ahead + need) * stream->step;
+        start   = MAX(start - (start % (int64_t)stripe_size), 0);
+        end     = MIN((int64_t)stream->frontier, (int64_t)size);
+        if (start < end) {
+            ranges[count]   = (struct lustre_readahead_range){ start, (int)(end - start) };
+            count          += 1;
+            bytes          += (uint64_t)(end - start);
+        }
+        stream->frontier = (uint64_t)MIN(start, (int64_t)stream->frontier);
+        goto end;
+    }
+
+    for (k=stream->ahead+1; k<=stream->ahead+need; k++) {
+        start   = (int64_t)stream->offset + (int64_t)k * stream->step;
+        end     = MIN(start + (int64_t)stream->length, (int64_t)size);
+        if ((start < 0) || (start >= end)) {
+            break;
+        }
+        ranges[count]   = (struct lustre_readahead_range){ start, (int)(end - start) };
+        count          += 1;
+        bytes          += (uint64_t)(end - start);
+    }
+    stream->ahead += count;
+
+end:
+    lustre_readahead_reserve(readahead, stream, bytes);
+
+    return count;
+}
+
+#pragma mark - External
+
+// Finds the stream an access at offset continues.  An established stream only takes an access exactly one step on; a stream still
+// learning its step takes any access within kLustreReadAheadStepMax, the nearest such stream winning.
+struct lustre_readahead_stream * lustre_readahead_match(struct lustre_readahead * readahead, uint64_t offset)
+{
+    struct lustre_readahead_stream *    stream;
+    struct lustre_readahead_stream *    nearest;
+    uint64_t                            distance;
+    uint64_t                            nearest_distance;
+    int64_t                             step;
+    uint32_t                            i;
+
+    nearest             = NULL;
+    nearest_distance    = UINT64_MAX;
+
+    for (i=0; i<kLustreReadAheadStreams; i++) {
+        stream = &readahead->streams[i];
+        if (!stream->used) {
+            continue;
+        }
+
+        step = (int64_t)(offset - stream->offset);
+        if ((stream->repeats > 0) && (step == stream->step)) {
+            return stream;
+        }
+        if (stream->repeats >= kLustreReadAheadTrigger) {
+            continue;
+        }
+
+        distance = (step < 0) ? (uint64_t)-step : (uint64_t)step;
+        if ((distance <= kLustreReadAheadStepMax) && (distance < nearest_distance)) {
+            nearest             = stream;
+            nearest_distance    = distance;
+        }
+    }
+
+    return nearest;
+}
+
+enum lustre_readahead_pattern lustre_readahead_stream_pattern(const struct lustre_readahead_stream * stream)
+{
+    if (!stream->used || (stream->repeats < kLustreReadAheadTrigger)) {
+        return kLustreReadAheadPatternNone;
+    } else if (stream->step < 0) {
+        return kLustreReadAheadPatternReverse;
+    } else if (stream->step <= (int64_t)stream->length) {
+        return kLustreReadAheadPatternSequential;
+    } else {
+        return kLustreReadAheadPatternStrided;
+    }
+}
+
+// Returns how many of the stream's next accesses have been read ahead whole.
+uint32_t lustre_readahead_stream_ahead(const struct lustre_readahead_stream * stream)
+{
+    if (!lustre_readahead_stream_is_contiguous(stream)) {
+        return stream->ahead;
+    } else if ((stream->step > 0) && (stream->frontier > stream->offset + stream->length)) {
+        return (uint32_t)MIN((stream->frontier - stream->offset - stream->length) / stream->length, UINT32_MAX);
+    } else if ((stream->step < 0) && (stream->offset > stream->frontier)) {
+        return (uint32_t)MIN((stream->offset - stream->frontier) / stream->length, UINT32_MAX);
+    }
+
+    return 0;
+}
+
+// Files an access of length bytes at offset, at absolute time now, in the stream it continues (or starts a new one) and, once the stream
+// has a pattern, returns the ranges to read ahead of it, which the caller must read.  size is the file's, and the stripe sizes its
+// layout's.  A stream whose reads reach either end of the file gives back all it holds of the budget, as nothing it holds can be used.
+uint32_t lustre_readahead_access(struct lustre_readahead * readahead, uint64_t offset, uint32_t length, uint64_t size, uint32_t stripe_size, uint64_t stripe_width, uint64_t now, struct lustre_readahead_range * ranges)
+{
+    struct lustre_readahead_stream *    stream;
+    uint32_t                            count;
+    uint32_t                            i;
+    int64_t                             step;
+    boolean_t                           hit;
+
+    readahead->clock += 1;
+
+    stream = lustre_readahead_match(readahead, offset);
+    if (!stream) {
+        readahead->stats.misses += 1;
+        lustre_readahead_stream_reset(readahead, lustre_readahead_victim(readahead), offset, length, now);
+        return 0;
+    }
+
+    stream->touched = now;
+
+    // Rereading the last access changes nothing.
+
+    step = (int64_t)(offset - stream->offset);
+    if (step == 0) {
+        return 0;
+    }
+
+    if ((stream->repeats > 0) && (step == stream->step) && (length == stream->length)) {
+        stream->repeats += (stream->repeats < UINT32_MAX) ? 1 : 0;
+        hit = (lustre_readahead_stream_ahead(stream) > 0);
+    } else {
+        lustre_readahead_release(readahead, stream, stream->reserved);
+        stream->step        = step;
+        stream->repeats     = 1;
+        stream->window      = 0;
+        stream->ahead       = 0;
+        stream->frontier    = (step > 0) ? offset + length : offset;
+        hit                 = FALSE;
+    }
+
+    stream->offset      = offset;
+    stream->length      = length;
+    stream->last_used   = readahead->clock;
+
+    // A hit uses up one access read ahead; if that leaves less than half the window, the window was too small for the reader.  A contiguous
+    // stream's frontier only moves when it reads ahead, so one that fell behind it picks up from where it's reading now.
+
+    if (hit) {
+        readahead->stats.hits += 1;
+        if (!lustre_readahead_stream_is_contiguous(stream)) {
+            stream->ahead -= 1;
+        }
+        lustre_readahead_release(readahead, stream, length);
+        if ((uint64_t)lustre_readahead_stream_ahead(stream) * length < stream->window / 2) {
+            stream->window = MIN(stream->window * 2, kLustreReadAheadWindowMax);
+        }
+    } else {
+        readahead->stats.misses += 1;
+    }
+    if (step > 0) {
+        stream->frontier = MAX(stream->frontier, offset + length);
+    } else {
+        stream->frontier = MIN(stream->frontier, offset);
+    }
+
+    if (((step > 0) && (offset + length >= size)) || ((step < 0) && (offset == 0))) {
+        lustre_readahead_release(readahead, stream, stream->reserved);
+        return 0;
+    }
+
+    count = 0;
+    if (stream->repeats >= kLustreReadAheadTrigger) {
+        count = lustre_readahead_plan(readahead, stream, size, stripe_size, stripe_width, ranges);
+        for (i=0; i<count; i++) {
+            readahead->stats.bytes += ranges[i].length;
+        }
+    }
+
+    return count;
+}
+
+// Gives back the share of the budget held by every stream last used before the absolute time before.  What they read ahead stays in the
+// UBC; only the charge for it goes, and a stream that carries on starts charging again with its next readahead.
+void lustre_readahead_release_idle(struct lustre_readahead * readahead, uint64_t before)
+{
+    uint32_t i;
+
+    for (i=0; i<kLustreReadAheadStreams; i++) {
+        if (readahead->streams[i].used && (readahead->streams[i].touched < before)) {
+            lustre_readahead_release(readahead, &readahead->streams[i], readahead->streams[i].reserved);
+        }
+    }
+}
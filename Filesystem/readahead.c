@@ -0,0 +1,185 @@
+//
+//  readahead.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <libkern/libkern.h>
+#include <libkern/OSAtomic.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/ubc.h>
+#include <kern/clock.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "readahead.h"
+#include "layout.h"
+#include "volume.h"
+#include "logging.h"
+#include "assert.h"
+
+#pragma mark - External
+
+struct lustre_readahead * lustre_readahead_alloc(struct lustre_volume * volume)
+{
+    struct lustre_readahead * readahead;
+
+    LUSTRE_BUG_ON(!volume);
+
+    readahead = OSMalloc(sizeof(struct lustre_readahead), volume->malloc_tag);
+    if (!readahead) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate readahead");
+        return NULL;
+    }
+
+    bzero(readahead, sizeof(struct lustre_readahead));
+
+    readahead->volume = volume;
+    readahead->budget = &volume->readahead_bytes;
+
+    readahead->lock = lck_mtx_alloc_init(volume->lock_group, NULL);
+    if (!readahead->lock) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate readahead lock");
+        OSFree(readahead, sizeof(struct lustre_readahead), volume->malloc_tag);
+        return NULL;
+    }
+
+    lck_mtx_lock(volume->readahead_lock);
+    readahead->next     = volume->readaheads;
+    volume->readaheads  = readahead;
+    lck_mtx_unlock(volume->readahead_lock);
+
+    return readahead;
+}
+
+void lustre_readahead_free(struct lustre_readahead * readahead)
+{
+    struct lustre_readahead **  link;
+    struct lustre_volume *      volume;
+
+    LUSTRE_BUG_ON(!readahead);
+
+    volume = readahead->volume;
+
+    lck_mtx_lock(volume->readahead_lock);
+    for (link = &volume->readaheads; *link != readahead; link = &(*link)->next) {
+        LUSTRE_BUG_ON(!*link);
+    }
+    *link = readahead->next;
+    lck_mtx_unlock(volume->readahead_lock);
+
+    lustre_readahead_release_idle(readahead, UINT64_MAX);
+
+    lck_mtx_free(readahead->lock, volume->lock_group);
+    OSFree(readahead, sizeof(struct lustre_readahead), volume->malloc_tag);
+}
+
+// Called for every read of the file, before the read itself, with the file's layout and size.  Files the stream the read belongs to (or
+// starts a new one) and, once the stream has a pattern, starts reading ahead of it.  The reads are advisory: they fill the UBC
+// asynchronously and never hold the caller up beyond sending them.
+void lustre_readahead_read(struct lustre_readahead * readahead, vnode_t vnode, const struct lustre_layout * layout, uint64_t offset, uint32_t length, uint64_t size)
+{
+    struct lustre_readahead_range   ranges[kLustreReadAheadAccessesMax];
+    uint64_t                        now;
+    uint32_t                        count;
+    uint32_t                        i;
+
+    LUSTRE_BUG_ON(!readahead);
+    LUSTRE_BUG_ON(!vnode);
+    LUSTRE_BUG_ON(!layout);
+    LUSTRE_BUG_ON(layout->stripe_size == 0);
+
+    if (length == 0) {
+        return;
+    }
+
+    if (*readahead->budget > kLustreReadAheadBudget - (int64_t)kLustreReadAheadWindowMax) {
+        lustre_readahead_expire(readahead->volume);
+    }
+
+    clock_get_uptime(&now);
+
+    lck_mtx_lock(readahead->lock);
+    count = lustre_readahead_access(readahead, offset, length, size, layout->stripe_size, lustre_layout_stripe_width(layout), now, ranges);
+    lck_mtx_unlock(readahead->lock);
+
+    for (i=0; i<count; i++) {
+        (void)advisory_read(vnode, (off_t)size, ranges[i].offset, ranges[i].length);
+    }
+}
+
+// Called when the file is closed.  Gives back the budget its streams hold; they keep their patterns for any other open of the file.
+void lustre_readahead_close(struct lustre_readahead * readahead)
+{
+    LUSTRE_BUG_ON(!readahead);
+
+    lck_mtx_lock(readahead->lock);
+    lustre_readahead_release_idle(readahead, UINT64_MAX);
+    lck_mtx_unlock(readahead->lock);
+}
+
+// Gives back the budget held by streams that haven't been read from in kLustreReadAheadIdle, in every file of the volume.  Called as the
+// budget runs short, and does nothing if it looked less than kLustreReadAheadSweepInterval ago.  A file whose lock is busy is being read,
+// so it's passed over rather than waited for.
+void lustre_readahead_expire(struct lustre_volume * volume)
+{
+    struct lustre_readahead *   readahead;
+    uint64_t                    now;
+    uint64_t                    idle;
+    uint64_t                    interval;
+
+    LUSTRE_BUG_ON(!volume);
+
+    clock_get_uptime(&now);
+    nanoseconds_to_absolutetime(kLustreReadAheadIdle * NSEC_PER_SEC, &idle);
+    nanoseconds_to_absolutetime(kLustreReadAheadSweepInterval * NSEC_PER_SEC, &interval);
+
+    lck_mtx_lock(volume->readahead_lock);
+
+    if ((volume->readahead_swept == 0) || (now - volume->readahead_swept >= interval)) {
+        volume->readahead_swept = now;
+        for (readahead = volume->readaheads; readahead; readahead = readahead->next) {
+            if (lck_mtx_try_lock(readahead->lock)) {
+                lustre_readahead_release_idle(readahead, (now > idle) ? now - idle : 0);
+                lck_mtx_unlock(readahead->lock);
+            }
+        }
+    }
+
+    lck_mtx_unlock(volume->readahead_lock);
+}
+
+struct lustre_readahead_stats lustre_readahead_stats(struct lustre_readahead * readahead)
+{
+    struct lustre_readahead_stats   stats;
+    uint32_t                        i;
+
+    LUSTRE_BUG_ON(!readahead);
+
+    lck_mtx_lock(readahead->lock);
+    stats = readahead->stats;
+    for (i=0; i<kLustreReadAheadStreams; i++) {
+        if (readahead->streams[i].used) {
+            stats.streams[lustre_readahead_stream_pattern(&readahead->streams[i])] += 1;
+        }
+    }
+    lck_mtx_unlock(readahead->lock);
+
+    return stats;
+}
@@ -0,0 +1,109 @@
+//
+//  readahead.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Readahead: watches a file's reads for streams of accesses a constant step apart (sequential, strided, as when reading a column slice
+// out of a row-major array, or backwards) and, once a stream has repeated its step, reads its next accesses into the UBC before they're
+// asked for.  Up to kLustreReadAheadStreams streams are told apart per file, so interleaved readers don't spoil each other's patterns.  A
+// stream's window grows while what it read ahead is being used, and all of a volume's unused readahead is held to a memory budget.  A
+// stream gives its share of the budget back as its reads use what was read ahead, when it reaches the end of the file, when the file is
+// closed, and once it has sat idle for kLustreReadAheadIdle while the budget runs short.
+
+#ifndef lustre_readahead_h
+#define lustre_readahead_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <sys/vnode.h>
+#include <kern/locks.h>
+#include <libkern/OSMalloc.h>
+
+static const uint32_t   kLustreReadAheadStreams             = 8;                // per file
+static const uint32_t   kLustreReadAheadTrigger             = 2;                // repeats of a step before we read ahead
+static const uint32_t   kLustreReadAheadAccessesMax         = 64;               // separate accesses read ahead per stream
+static const uint64_t   kLustreReadAheadStepMax             = 1ULL << 30;       // accesses further apart aren't one stream
+static const uint64_t   kLustreReadAheadWindowMax           = 64 * 1024 * 1024; // bytes, per stream
+static const int64_t    kLustreReadAheadBudget              = 256 * 1024 * 1024;// bytes read ahead and not yet used, per volume
+static const uint64_t   kLustreReadAheadIdle                = 10;               // seconds before an unused stream's share may be taken back
+static const uint64_t   kLustreReadAheadSweepInterval       = 1;                // seconds between looks for idle streams, per volume
+
+struct lustre_volume;
+struct lustre_layout;
+
+struct lustre_readahead_range {
+    off_t                                           offset;
+    int                                             length;
+};
+
+enum lustre_readahead_pattern {
+    kLustreReadAheadPatternNone                     = 0,
+    kLustreReadAheadPatternSequential,
+    kLustreReadAheadPatternStrided,
+    kLustreReadAheadPatternReverse,
+};
+
+struct lustre_readahead_stats {
+    uint64_t                                        hits;                           // reads that had been read ahead
+    uint64_t                                        misses;                         // reads that hadn't
+    uint64_t                                        bytes;                          // read ahead in all
+    uint32_t                                        streams[kLustreReadAheadPatternReverse + 1];// streams being tracked, by pattern
+};
+
+struct lustre_readahead_stream {
+    boolean_t                                       used;                           // slot holds a stream
+    uint64_t                                        offset;                         // of the stream's last access
+    uint32_t                                        length;                         // likewise
+    int64_t                                         step;                           // from the access before it to the last one
+    uint32_t                                        repeats;                        // consecutive accesses at step
+    uint64_t                                        window;                         // bytes to keep read ahead, 0 until active
+    uint32_t                                        ahead;                          // strided: accesses already read ahead of the last one
+    uint64_t                                        frontier;                       // contiguous: where what's been read ahead ends
+    uint64_t                                        reserved;                       // bytes of the budget read ahead and not yet used
+    uint64_t                                        last_used;
+    uint64_t                                        touched;                        // absolute time of the last access
+};
+
+struct lustre_readahead {
+    struct lustre_volume *                          volume;
+    volatile SInt64 *                               budget;                         // the volume's readahead_bytes, charged for what's read ahead
+    struct lustre_readahead *                       next;                           // on the volume's list, under its readahead_lock
+    lck_mtx_t *                                     lock;                           // protects following fields
+    struct lustre_readahead_stream                  streams[kLustreReadAheadStreams];
+    uint64_t                                        clock;                          // for replacing the least recently used stream
+    struct lustre_readahead_stats                   stats;                          // streams is only filled in by lustre_readahead_stats
+};
+
+struct lustre_readahead *       lustre_readahead_alloc(struct lustre_volume * volume);
+void                            lustre_readahead_free(struct lustre_readahead * readahead);
+
+void                            lustre_readahead_read(struct lustre_readahead * readahead, vnode_t vnode, const struct lustre_layout * layout, uint64_t offset, uint32_t length, uint64_t size);
+void                            lustre_readahead_close(struct lustre_readahead * readahead);
+void                            lustre_readahead_expire(struct lustre_volume * volume);
+struct lustre_readahead_stats   lustre_readahead_stats(struct lustre_readahead * readahead);
+
+// Stream tracking and budget accounting (rastream.c).  Callers hold the readahead's lock.
+
+uint32_t                        lustre_readahead_access(struct lustre_readahead * readahead, uint64_t offset, uint32_t length, uint64_t size, uint32_t stripe_size, uint64_t stripe_width, uint64_t now, struct lustre_readahead_range * ranges);
+void                            lustre_readahead_release_idle(struct lustre_readahead * readahead, uint64_t before);
+struct lustre_readahead_stream * lustre_readahead_match(struct lustre_readahead * readahead, uint64_t offset);
+enum lustre_readahead_pattern   lustre_readahead_stream_pattern(const struct lustre_readahead_stream * stream);
+uint32_t                        lustre_readahead_stream_ahead(const struct lustre_readahead_stream * stream);
+
+#endif /* lustre_readahead_h */
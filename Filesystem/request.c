@@ -0,0 +1,637 @@
+//
+//  request.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <libkern/OSAtomic.h>
+#include <libkern/libkern.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/proc.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "request.h"
+#include "import.h"
+#include "network.h"
+#include "logging.h"
+#include "assert.h"
+
+static const uint32_t   kLustreRequestSetInitialCapacity    = 16;
+
+#define LUSTRE_REQUEST_ROUND(_length)   (((_length) + 7) & ~7)
+
+#pragma mark - Internal
+
+static uint32_t lustre_request_version(uint32_t opcode)
+{
+    if (opcode < 30) {
+        return kLustreOSTVersion;
+    } else if (opcode < 100) {
+        return kLustreMDSVersion;
+    } else if (opcode < 200) {
+        return kLustreDLMVersion;
+    } else if (opcode < 300) {
+        return kLustreMGSVersion;
+    } else if (opcode < 500) {
+        return kLustreOBDVersion;
+    } else {
+        return kLustreLogVersion;
+    }
+}
+
+// Requests allocate from their import's tag, so the import is released last.
+static void lustre_request_free(struct lustre_request * request)
+{
+    struct lustre_import *  import;
+    uint32_t                i;
+
+    LUSTRE_BUG_ON(!request);
+    LUSTRE_BUG_ON(!request->import);
+
+    import = request->import;
+
+    for (i=0; i<request->field_count; i++) {
+        OSFree(request->fields[i].data, MAX(request->fields[i].length, 1), import->malloc_tag);
+    }
+    if (request->reply) {
+        OSFree(request->reply, request->reply_length, import->malloc_tag);
+    }
+    if (request->lock) {
+        lck_mtx_free(request->lock, import->lock_group);
+    }
+
+    OSFree(request, sizeof(struct lustre_request), import->malloc_tag);
+
+    lustre_import_ref_count_dec(import);
+}
+
+// Checks the reply header and works out the request's final error.  Called with the request lock held.
+static errno_t lustre_request_validate_reply(struct lustre_request * request)
+{
+    const struct lustre_msg_v2 *    msg;
+    const struct ptlrpc_body *      body;
+
+    msg = request->reply;
+
+    if (request->reply_length < sizeof(struct lustre_msg_v2)) {
+        return EPROTO;
+    }
+    if (msg->lm_magic == kLustreMsgMagicV2Swabbed) {
+        os_log_error(lustre_logger_network, "Big endian peers are not supported");
+        return EPROTO;
+    }
+    if (msg->lm_magic != kLustreMsgMagicV2) {
+        return EPROTO;
+    }
+
+    body = lustre_request_reply_field(request, 0, sizeof(struct ptlrpc_body), NULL);
+    if (!body) {
+        return EPROTO;
+    }
+    if ((int32_t)body->pb_status < 0) {
+        return lustre_request_errno_from_wire((int32_t)body->pb_status);
+    }
+    if (body->pb_type == kLustreMsgTypeError) {
+        return EIO;
+    }
+
+    return 0;
+}
+
+// Says whether the reply means the server doesn't know us any more, because it evicted us or restarted.  ESTALE only counts on a ping,
+// since elsewhere it can just mean a file has gone.
+static boolean_t lustre_request_evicted(const struct lustre_request * request)
+{
+    switch (request->error) {
+        case ENOTCONN:
+        case ENODEV:
+            return TRUE;
+        case ESTALE:
+            return (request->opcode == kLustreOpcodeOBDPing);
+        default:
+            return FALSE;
+    }
+}
+
+#pragma mark - External
+
+// Servers report failures as negated Linux errno values.  Most of the low numbers agree with ours; the rest have to be translated.
+errno_t lustre_request_errno_from_wire(int32_t status)
+{
+    int32_t wire_errno;
+
+    wire_errno = -status;
+
+    switch (wire_errno) {
+        case 11:    return EAGAIN;
+        case 35:    return EDEADLK;
+        case 36:    return ENAMETOOLONG;
+        case 37:    return ENOLCK;
+        case 38:    return ENOSYS;
+        case 39:    return ENOTEMPTY;
+        case 40:    return ELOOP;
+        case 61:    return ENOATTR;
+        case 71:    return EPROTO;
+        case 75:    return EOVERFLOW;
+        case 95:    return ENOTSUP;
+        case 107:   return ENOTCONN;
+        case 108:   return ESHUTDOWN;
+        case 110:   return ETIMEDOUT;
+        case 111:   return ECONNREFUSED;
+        case 114:   return EALREADY;
+        case 115:   return EINPROGRESS;
+        case 116:   return ESTALE;
+        case 122:   return EDQUOT;
+        case 125:   return ECANCELED;
+        case 524:   return ENOTSUP;
+        default:
+            if ((wire_errno > 0) && (wire_errno < 35)) {
+                return wire_errno;
+            }
+            return EIO;
+    }
+}
+
+struct lustre_request * lustre_request_alloc(struct lustre_import * import, uint32_t opcode)
+{
+    struct lustre_request * request;
+
+    LUSTRE_BUG_ON(!import);
+
+    request = (struct lustre_request *)OSMalloc(sizeof(struct lustre_request), import->malloc_tag);
+    if (!request) {
+        os_log_error(lustre_logger_network, "Couldn't allocate request");
+        return NULL;
+    }
+
+    bzero(request, sizeof(struct lustre_request));
+
+    lustre_import_ref_count_inc(import);
+    request->import     = import;
+    request->ref_count  = 1;
+    request->opcode     = opcode;
+    request->reply_size = 4096;
+
+    request->lock = lck_mtx_alloc_init(import->lock_group, NULL);
+    if (!request->lock) {
+        os_log_error(lustre_logger_network, "Couldn't allocate request lock");
+        lustre_request_free(request);
+        return NULL;
+    }
+
+    request->xid    = lustre_import_next_xid(import);
+    request->handle = lustre_import_remote_handle(import);
+
+    if (!lustre_request_field_add(request, sizeof(struct ptlrpc_body))) {
+        lustre_request_free(request);
+        return NULL;
+    }
+
+    return request;
+}
+
+void lustre_request_ref_count_inc(struct lustre_request * request)
+{
+    LUSTRE_BUG_ON(!request);
+
+    OSIncrementAtomic(&request->ref_count);
+}
+
+void lustre_request_ref_count_dec(struct lustre_request * request)
+{
+    LUSTRE_BUG_ON(!request);
+
+    if (OSDecrementAtomic(&request->ref_count) == 1) {
+        lustre_request_free(request);
+    }
+}
+
+// Appends a zero filled buffer to the request and returns it for the caller to fill in.  The buffer belongs to the request.  A zero
+// length adds an empty buffer, which is how optional fields are left out; the pointer returned is still non-NULL.
+void * lustre_request_field_add(struct lustre_request * request, uint32_t length)
+{
+    void * data;
+
+    LUSTRE_BUG_ON(!request);
+    LUSTRE_BUG_ON(request->field_count >= kLustreMsgBufferMax);
+
+    data = OSMalloc(MAX(length, 1), request->import->malloc_tag);
+    if (!data) {
+        os_log_error(lustre_logger_network, "Couldn't allocate request field");
+        return NULL;
+    }
+
+    bzero(data, MAX(length, 1));
+
+    request->fields[request->field_count].data      = data;
+    request->fields[request->field_count].length    = length;
+    request->field_count += 1;
+
+    return data;
+}
+
+void lustre_request_set_reply_size(struct lustre_request * request, uint32_t reply_size)
+{
+    LUSTRE_BUG_ON(!request);
+
+    request->reply_size = reply_size;
+}
+
+void lustre_request_set_bulk(struct lustre_request * request, enum lustre_request_bulk_type type, uint32_t portal, const struct lustre_request_segment * segments, uint32_t count)
+{
+    LUSTRE_BUG_ON(!request);
+    LUSTRE_BUG_ON((type != kLustreRequestBulkNone) && (!segments || (count == 0)));
+
+    request->bulk_type      = type;
+    request->bulk_portal    = portal;
+    request->bulk_segments  = segments;
+    request->bulk_count     = count;
+}
+
+void lustre_request_set_callback(struct lustre_request * request, lustre_request_callback callback, void * data)
+{
+    LUSTRE_BUG_ON(!request);
+
+    request->callback       = callback;
+    request->callback_data  = data;
+}
+
+// Flattens the request into a lustre_msg_v2.  The caller owns the returned buffer and frees it with OSFree using the returned length and
+// the import's malloc tag.
+errno_t lustre_request_pack(struct lustre_request * request, void ** message, uint32_t * length)
+{
+    struct lustre_msg_v2 *  msg;
+    struct ptlrpc_body *    body;
+    uint32_t                header_length;
+    uint32_t                total_length;
+    uint8_t *               cursor;
+    uint32_t                i;
+
+    LUSTRE_BUG_ON(!request);
+    LUSTRE_BUG_ON(!message);
+    LUSTRE_BUG_ON(!length);
+    LUSTRE_BUG_ON(request->field_count == 0);
+
+    body                    = request->fields[0].data;
+    body->pb_handle         = request->handle;
+    body->pb_type           = kLustreMsgTypeRequest;
+    body->pb_version        = kLustreMsgVersion | lustre_request_version(request->opcode);
+    body->pb_opc            = request->opcode;
+    body->pb_timeout        = kLustreRequestTimeoutSeconds;
+    body->pb_conn_cnt       = request->import->connection_count;
+    body->pb_mbits          = (request->bulk_type != kLustreRequestBulkNone) ? request->xid : 0;
+
+    header_length = LUSTRE_REQUEST_ROUND((uint32_t)sizeof(struct lustre_msg_v2) + request->field_count * (uint32_t)sizeof(uint32_t));
+    total_length  = header_length;
+    for (i=0; i<request->field_count; i++) {
+        total_length += LUSTRE_REQUEST_ROUND(request->fields[i].length);
+    }
+
+    msg = OSMalloc(total_length, request->import->malloc_tag);
+    if (!msg) {
+        os_log_error(lustre_logger_network, "Couldn't allocate request message");
+        return ENOMEM;
+    }
+
+    bzero(msg, total_length);
+
+    msg->lm_bufcount    = request->field_count;
+    msg->lm_magic       = kLustreMsgMagicV2;
+    msg->lm_repsize     = request->reply_size;
+
+    cursor = (uint8_t *)msg + header_length;
+    for (i=0; i<request->field_count; i++) {
+        msg->lm_buflens[i] = request->fields[i].length;
+        memcpy(cursor, request->fields[i].data, request->fields[i].length);
+        cursor += LUSTRE_REQUEST_ROUND(request->fields[i].length);
+    }
+
+    *message    = msg;
+    *length     = total_length;
+
+    return 0;
+}
+
+// Called by the network layer when the reply arrives (reply non-NULL, error 0) or when the request can never complete (reply NULL, error
+// set).  Ownership of reply, which must come from the import's malloc tag, passes to the request.  Only the first completion counts; later ones are dropped.
+void lustre_request_complete(struct lustre_request * request, void * reply, uint32_t reply_length, errno_t error)
+{
+    struct lustre_request_set * set;
+    boolean_t                   evicted;
+
+    LUSTRE_BUG_ON(!request);
+    LUSTRE_BUG_ON(reply && (error != 0));
+
+    lck_mtx_lock(request->lock);
+    if (request->completing) {
+        lck_mtx_unlock(request->lock);
+        if (reply) {
+            OSFree(reply, reply_length, request->import->malloc_tag);
+        }
+        return;
+    }
+
+    request->completing     = TRUE;                                                 // done is only set once the callback has run
+    request->reply          = reply;
+    request->reply_length   = reply_length;
+    request->error          = (reply != NULL) ? lustre_request_validate_reply(request) : error;
+    evicted                 = (reply != NULL) && lustre_request_evicted(request);
+    lck_mtx_unlock(request->lock);
+
+    if (evicted) {
+        lustre_import_disconnected(request->import, request->handle, request->error);
+    }
+
+    // The callback runs before anyone waiting on the request is woken, so waiters always see its side effects.
+
+    if (request->callback) {
+        request->callback(request, request->callback_data);
+    }
+
+    lck_mtx_lock(request->lock);
+    request->done   = TRUE;
+    set             = request->set;
+    wakeup(request);
+    lck_mtx_unlock(request->lock);
+
+    if (set) {
+        lck_mtx_lock(set->lock);
+        LUSTRE_BUG_ON(set->outstanding == 0);
+        set->outstanding -= 1;
+        if (set->outstanding == 0) {
+            wakeup(set);
+        }
+        lck_mtx_unlock(set->lock);
+    }
+}
+
+// Hands the request to the network layer and returns without waiting for the reply.
+errno_t lustre_request_send_async(struct lustre_request * request)
+{
+    errno_t error;
+
+    LUSTRE_BUG_ON(!request);
+
+    error = lustre_network_send(request);
+    if (error != 0) {
+        lustre_request_complete(request, NULL, 0, error);
+    }
+
+    return error;
+}
+
+errno_t lustre_request_wait(struct lustre_request * request)
+{
+    struct timespec timeout;
+    errno_t         error;
+    int             result;
+
+    LUSTRE_BUG_ON(!request);
+
+    timeout = (struct timespec){ kLustreRequestTimeoutSeconds, 0 };
+
+    lck_mtx_lock(request->lock);
+    while (!request->done) {
+        result = msleep(request, request->lock, PINOD, __FUNCTION__, &timeout);
+        if ((result == EWOULDBLOCK) && !request->done) {
+            lck_mtx_unlock(request->lock);
+            lustre_network_cancel(request);
+            lustre_request_complete(request, NULL, 0, ETIMEDOUT);
+            lck_mtx_lock(request->lock);
+        }
+    }
+    error = request->error;
+    lck_mtx_unlock(request->lock);
+
+    return error;
+}
+
+errno_t lustre_request_send(struct lustre_request * request)
+{
+    errno_t error;
+
+    error = lustre_request_send_async(request);
+    if (error == 0) {
+        error = lustre_request_wait(request);
+    }
+
+    return error;
+}
+
+const struct ptlrpc_body * lustre_request_reply_body(struct lustre_request * request)
+{
+    return lustre_request_reply_field(request, 0, sizeof(struct ptlrpc_body), NULL);
+}
+
+// Returns buffer index of the reply, or NULL if there is no such buffer or it's shorter than min_length.
+void * lustre_request_reply_field(struct lustre_request * request, uint32_t index, uint32_t min_length, uint32_t * length)
+{
+    LUSTRE_BUG_ON(!request);
+
+    return lustre_request_message_field(request->reply, request->reply_length, index, min_length, length);
+}
+
+// As lustre_request_reply_field, for any whole lustre_msg_v2; the network layer uses it on requests servers send us.
+void * lustre_request_message_field(const void * message, uint32_t message_length, uint32_t index, uint32_t min_length, uint32_t * length)
+{
+    const struct lustre_msg_v2 *    msg;
+    uint32_t                        offset;
+    uint32_t                        i;
+
+    msg = message;
+    if (!msg || (message_length < sizeof(struct lustre_msg_v2))) {
+        return NULL;
+    }
+    if ((msg->lm_bufcount <= index) || (msg->lm_bufcount > kLustreMsgBufferMax)) {
+        return NULL;
+    }
+
+    offset = LUSTRE_REQUEST_ROUND((uint32_t)sizeof(struct lustre_msg_v2) + msg->lm_bufcount * (uint32_t)sizeof(uint32_t));
+    if (offset > message_length) {
+        return NULL;
+    }
+    for (i=0; i<index; i++) {
+        offset += LUSTRE_REQUEST_ROUND(msg->lm_buflens[i]);
+        if (offset > message_length) {
+            return NULL;
+        }
+    }
+
+    if ((msg->lm_buflens[index] < min_length) || (msg->lm_buflens[index] > message_length - offset)) {
+        return NULL;
+    }
+
+    if (length) {
+        *length = msg->lm_buflens[index];
+    }
+
+    return (uint8_t *)msg + offset;
+}
+
+#pragma mark - Sets
+
+// A request set lets a caller fire off many independent requests at once and then wait for all of them, rather than paying one round trip each.
+
+struct lustre_request_set * lustre_request_set_alloc(OSMallocTag malloc_tag, lck_grp_t * lock_group)
+{
+    struct lustre_request_set * set;
+
+    set = (struct lustre_request_set *)OSMalloc(sizeof(struct lustre_request_set), malloc_tag);
+    if (!set) {
+        os_log_error(lustre_logger_network, "Couldn't allocate request set");
+        return NULL;
+    }
+
+    bzero(set, sizeof(struct lustre_request_set));
+
+    set->malloc_tag = malloc_tag;
+    set->lock_group = lock_group;
+
+    set->lock = lck_mtx_alloc_init(lock_group, NULL);
+    if (!set->lock) {
+        os_log_error(lustre_logger_network, "Couldn't allocate request set lock");
+        OSFree(set, sizeof(struct lustre_request_set), malloc_tag);
+        return NULL;
+    }
+
+    return set;
+}
+
+// Waits for any outstanding requests and releases the set's references on them.
+void lustre_request_set_free(struct lustre_request_set * set)
+{
+    uint32_t i;
+
+    LUSTRE_BUG_ON(!set);
+
+    (void)lustre_request_set_wait(set);
+
+    for (i=0; i<set->count; i++) {
+        lck_mtx_lock(set->requests[i]->lock);
+        set->requests[i]->set = NULL;
+        lck_mtx_unlock(set->requests[i]->lock);
+        lustre_request_ref_count_dec(set->requests[i]);
+    }
+    if (set->requests) {
+        OSFree(set->requests, set->capacity * sizeof(struct lustre_request *), set->malloc_tag);
+    }
+    lck_mtx_free(set->lock, set->lock_group);
+    OSFree(set, sizeof(struct lustre_request_set), set->malloc_tag);
+}
+
+// The set takes its own reference on the request.
+errno_t lustre_request_set_add(struct lustre_request_set * set, struct lustre_request * request)
+{
+    struct lustre_request **    requests;
+    uint32_t                    capacity;
+
+    LUSTRE_BUG_ON(!set);
+    LUSTRE_BUG_ON(!request);
+    LUSTRE_BUG_ON(request->set);
+
+    lck_mtx_lock(set->lock);
+
+    if (set->count == set->capacity) {
+        capacity = (set->capacity == 0) ? kLustreRequestSetInitialCapacity : set->capacity * 2;
+        requests = OSMalloc(capacity * sizeof(struct lustre_request *), set->malloc_tag);
+        if (!requests) {
+            lck_mtx_unlock(set->lock);
+            os_log_error(lustre_logger_network, "Couldn't grow request set");
+            return ENOMEM;
+        }
+        if (set->requests) {
+            memcpy(requests, set->requests, set->count * sizeof(struct lustre_request *));
+            OSFree(set->requests, set->capacity * sizeof(struct lustre_request *), set->malloc_tag);
+        }
+        set->requests = requests;
+        set->capacity = capacity;
+    }
+
+    lustre_request_ref_count_inc(request);
+    request->set = set;
+    set->requests[set->count] = request;
+    set->count += 1;
+
+    lck_mtx_unlock(set->lock);
+
+    return 0;
+}
+
+// Sends every request in the set without waiting between them.  Requests that fail to send complete immediately with their error; the
+// first such error is returned, but the remaining requests are still sent.
+errno_t lustre_request_set_send(struct lustre_request_set * set)
+{
+    errno_t     error;
+    errno_t     result;
+    uint32_t    count;
+    uint32_t    i;
+
+    LUSTRE_BUG_ON(!set);
+
+    result = 0;
+
+    lck_mtx_lock(set->lock);
+    count = set->count;
+    set->outstanding += count;
+    lck_mtx_unlock(set->lock);
+
+    for (i=0; i<count; i++) {
+        error = lustre_request_send_async(set->requests[i]);
+        if ((error != 0) && (result == 0)) {
+            result = error;
+        }
+    }
+
+    return result;
+}
+
+// Waits until every request in the set has completed.  Returns the first request error, in set order.
+errno_t lustre_request_set_wait(struct lustre_request_set * set)
+{
+    struct timespec timeout;
+    errno_t         error;
+    uint32_t        i;
+    int             result;
+
+    LUSTRE_BUG_ON(!set);
+
+    timeout = (struct timespec){ kLustreRequestTimeoutSeconds, 0 };
+
+    lck_mtx_lock(set->lock);
+    while (set->outstanding > 0) {
+        result = msleep(set, set->lock, PINOD, __FUNCTION__, &timeout);
+        if ((result == EWOULDBLOCK) && (set->outstanding > 0)) {
+            // Something has been outstanding for a full timeout; let each request time itself out.
+            lck_mtx_unlock(set->lock);
+            for (i=0; i<set->count; i++) {
+                (void)lustre_request_wait(set->requests[i]);
+            }
+            lck_mtx_lock(set->lock);
+        }
+    }
+    lck_mtx_unlock(set->lock);
+
+    error = 0;
+    for (i=0; (i<set->count) && (error == 0); i++) {
+        error = set->requests[i]->error;
+    }
+
+    return error;
+}
@@ -0,0 +1,123 @@
+//
+//  request.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef lustre_request_h
+#define lustre_request_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <kern/locks.h>
+#include <libkern/OSMalloc.h>
+#include "wire.h"
+
+static const uint32_t   kLustreRequestTimeoutSeconds        = 30;
+
+struct lustre_import;
+struct lustre_request;
+struct lustre_request_set;
+
+typedef void (* lustre_request_callback)(struct lustre_request * request, void * data);
+
+struct lustre_request_field {
+    void *                                          data;                           // owned by the request
+    uint32_t                                        length;
+};
+
+// Bulk data goes straight between these buffers and the network, without passing through the request or reply messages.
+struct lustre_request_segment {
+    void *                                          data;                           // owned by the caller; must outlive the request
+    uint32_t                                        length;
+};
+
+enum lustre_request_bulk_type {
+    kLustreRequestBulkNone                          = 0,
+    kLustreRequestBulkPut,                                                          // server puts data into our segments (reads)
+    kLustreRequestBulkGet,                                                          // server gets data from our segments (writes)
+};
+
+struct lustre_request {
+    struct lustre_import *                          import;                         // target this request is sent to
+    uint32_t                                        opcode;
+    uint64_t                                        xid;                            // unique per import, matches the reply
+    struct lustre_handle                            handle;                         // connection handle sent in ptlrpc_body
+
+    struct lustre_request_field                     fields[kLustreMsgBufferMax];    // request buffers, fields[0] is the ptlrpc_body
+    uint32_t                                        field_count;
+    uint32_t                                        reply_size;                     // expected reply size, advertised to the server
+
+    enum lustre_request_bulk_type                   bulk_type;
+    uint32_t                                        bulk_portal;
+    const struct lustre_request_segment *           bulk_segments;
+    uint32_t                                        bulk_count;
+    uint32_t                                        bulk_transferred;               // bytes actually moved, set before completion
+
+    void *                                          reply;                          // whole reply message as received
+    uint32_t                                        reply_length;
+
+    lck_mtx_t *                                     lock;                           // protects following fields
+    boolean_t                                       completing;                     // the first completion has claimed the request
+    boolean_t                                       done;                           // reply received, timed out or failed to send
+    errno_t                                         error;                          // transport error or negated server status
+    lustre_request_callback                         callback;                       // called once, on completion, without the lock
+    void *                                          callback_data;
+    struct lustre_request_set *                     set;                            // set this request belongs to, if any
+
+    int32_t                                         ref_count;
+};
+
+struct lustre_request_set {
+    OSMallocTag                                     malloc_tag;
+    lck_grp_t *                                     lock_group;
+    lck_mtx_t *                                     lock;                           // protects following fields
+    struct lustre_request **                        requests;
+    uint32_t                                        count;
+    uint32_t                                        capacity;
+    uint32_t                                        outstanding;                    // requests sent but not yet completed
+};
+
+struct lustre_request *     lustre_request_alloc(struct lustre_import * import, uint32_t opcode);
+void                        lustre_request_ref_count_inc(struct lustre_request * request);
+void                        lustre_request_ref_count_dec(struct lustre_request * request);
+
+void *                      lustre_request_field_add(struct lustre_request * request, uint32_t length);
+void                        lustre_request_set_reply_size(struct lustre_request * request, uint32_t reply_size);
+void                        lustre_request_set_bulk(struct lustre_request * request, enum lustre_request_bulk_type type, uint32_t portal, const struct lustre_request_segment * segments, uint32_t count);
+void                        lustre_request_set_callback(struct lustre_request * request, lustre_request_callback callback, void * data);
+
+errno_t                     lustre_request_pack(struct lustre_request * request, void ** message, uint32_t * length);
+void                        lustre_request_complete(struct lustre_request * request, void * reply, uint32_t reply_length, errno_t error);
+
+errno_t                     lustre_request_send_async(struct lustre_request * request);
+errno_t                     lustre_request_wait(struct lustre_request * request);
+errno_t                     lustre_request_send(struct lustre_request * request);
+
+const struct ptlrpc_body *  lustre_request_reply_body(struct lustre_request * request);
+void *                      lustre_request_reply_field(struct lustre_request * request, uint32_t index, uint32_t min_length, uint32_t * length);
+void *                      lustre_request_message_field(const void * message, uint32_t message_length, uint32_t index, uint32_t min_length, uint32_t * length);
+errno_t                     lustre_request_errno_from_wire(int32_t status);
+
+struct lustre_request_set * lustre_request_set_alloc(OSMallocTag malloc_tag, lck_grp_t * lock_group);
+void                        lustre_request_set_free(struct lustre_request_set * set);
+errno_t                     lustre_request_set_add(struct lustre_request_set * set, struct lustre_request * request);
+errno_t                     lustre_request_set_send(struct lustre_request_set * set);
+errno_t                     lustre_request_set_wait(struct lustre_request_set * set);
+
+#endif /* lustre_request_h */
@@ -0,0 +1,784 @@
+//
+//  search.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <libkern/libkern.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+#include <sys/dirent.h>
+#include <kern/clock.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "search.h"
+#include "volume.h"
+#include "import.h"
+#include "node.h"
+#include "logging.h"
+#include "assert.h"
+
+// A parameter block: a size that counts itself, then values in the order of the attribute bits.
+struct lustre_search_params {
+    const uint8_t *     base;
+    const uint8_t *     cursor;
+    const uint8_t *     end;
+};
+
+static const char * const kLustreSearchPackageExtensions[] = {
+    ".app", ".bundle", ".framework", ".kext", ".pkg", ".plugin",
+};
+
+#pragma mark - Internal
+
+static errno_t lustre_search_params_init(const void * params, struct lustre_search_params * p)
+{
+    uint32_t size;
+
+    if (!params) {
+        return EINVAL;
+    }
+
+    memcpy(&size, params, sizeof(uint32_t));
+    if ((size < sizeof(uint32_t)) || (size > SEARCHFS_MAX_SEARCHPARMS)) {
+        return EINVAL;
+    }
+
+    p->base     = (const uint8_t *)params;
+    p->cursor   = p->base + sizeof(uint32_t);
+    p->end      = p->base + size;
+
+    return 0;
+}
+
+static errno_t lustre_search_params_take(struct lustre_search_params * p, void * value, size_t length)
+{
+    if ((size_t)(p->end - p->cursor) < length) {
+        return EINVAL;
+    }
+
+    memcpy(value, p->cursor, length);
+    p->cursor += length;
+
+    return 0;
+}
+
+// Times come in the caller's layout: a 64 bit process passes a pair of 64 bit fields, a 32 bit one a pair of 32 bit fields.
+static errno_t lustre_search_params_time(struct lustre_search_params * p, boolean_t is64bit, struct timespec * time)
+{
+    int64_t     wide[2];
+    int32_t     narrow[2];
+    errno_t     error;
+
+    if (is64bit) {
+        error = lustre_search_params_take(p, wide, sizeof(wide));
+        time->tv_sec    = (__darwin_time_t)wide[0];
+        time->tv_nsec   = (long)wide[1];
+    } else {
+        error = lustre_search_params_take(p, narrow, sizeof(narrow));
+        time->tv_sec    = narrow[0];
+        time->tv_nsec   = narrow[1];
+    }
+
+    return error;
+}
+
+// Unpacks one parameter block into the index'th half of each range.  The name is only taken from the first block; the second holds a
+// placeholder for it.
+static errno_t lustre_search_params_unpack(const void * params, const struct attrlist * attrs, boolean_t is64bit, uint32_t index, struct lustre_search_criteria * criteria)
+{
+    struct lustre_search_params     p;
+    attrreference_t                 reference;
+    const uint8_t *                 name;
+    uint32_t                        namelen;
+    errno_t                         error;
+
+    error = lustre_search_params_init(params, &p);
+    if (error != 0) {
+        return error;
+    }
+
+    if (attrs->commonattr & ATTR_CMN_NAME) {
+        name = p.cursor;
+
+        error = lustre_search_params_take(&p, &reference, sizeof(attrreference_t));
+        if (error != 0) {
+            return error;
+        }
+
+        if (index == 0) {
+            name += reference.attr_dataoffset;
+            if ((name < p.base) || (name > p.end) || (reference.attr_length > (size_t)(p.end - name))) {
+                return EINVAL;
+            }
+
+            // The length counts the terminator, if there is one.
+
+            namelen = reference.attr_length;
+            while ((namelen > 0) && (name[namelen - 1] == '\0')) {
+                namelen -= 1;
+            }
+            if (namelen > MAXNAMLEN) {
+                return EINVAL;
+            }
+
+            memcpy(criteria->name, name, namelen);
+            criteria->name[namelen] = '\0';
+            criteria->namelen       = namelen;
+        }
+    }
+    if (attrs->commonattr & ATTR_CMN_MODTIME) {
+        error = lustre_search_params_time(&p, is64bit, &criteria->modify_time[index]);
+    }
+    if ((error == 0) && (attrs->commonattr & ATTR_CMN_CHGTIME)) {
+        error = lustre_search_params_time(&p, is64bit, &criteria->change_time[index]);
+    }
+    if ((error == 0) && (attrs->commonattr & ATTR_CMN_ACCTIME)) {
+        error = lustre_search_params_time(&p, is64bit, &criteria->access_time[index]);
+    }
+    if ((error == 0) && (attrs->commonattr & ATTR_CMN_OWNERID)) {
+        error = lustre_search_params_take(&p, &criteria->uid[index], sizeof(uid_t));
+    }
+    if ((error == 0) && (attrs->commonattr & ATTR_CMN_GRPID)) {
+        error = lustre_search_params_take(&p, &criteria->gid[index], sizeof(gid_t));
+    }
+    if ((error == 0) && (attrs->commonattr & ATTR_CMN_FILEID)) {
+        error = lustre_search_params_take(&p, &criteria->fileid[index], sizeof(uint64_t));
+    }
+    if ((error == 0) && (attrs->fileattr & ATTR_FILE_DATALENGTH)) {
+        error = lustre_search_params_take(&p, &criteria->size[index], sizeof(off_t));
+    }
+    if ((error == 0) && (attrs->fileattr & ATTR_FILE_DATAALLOCSIZE)) {
+        error = lustre_search_params_take(&p, &criteria->alloc_size[index], sizeof(off_t));
+    }
+
+    return error;
+}
+
+static char lustre_search_fold(char c)
+{
+    return ((c >= 'A') && (c <= 'Z')) ? (c - 'A' + 'a') : c;
+}
+
+// Names match as the Finder expects, ignoring ASCII case, and anywhere in the name with SRCHFS_MATCHPARTIALNAMES.
+static boolean_t lustre_search_name_matches(const struct lustre_search_criteria * criteria, const char * name, uint32_t namelen)
+{
+    uint32_t start;
+    uint32_t i;
+
+    if (criteria->namelen > namelen) {
+        return FALSE;
+    }
+    if (!(criteria->options & SRCHFS_MATCHPARTIALNAMES) && (criteria->namelen != namelen)) {
+        return FALSE;
+    }
+
+    for (start=0; start + criteria->namelen <= namelen; start++) {
+        for (i=0; i<criteria->namelen; i++) {
+            if (lustre_search_fold(name[start + i]) != lustre_search_fold(criteria->name[i])) {
+                break;
+            }
+        }
+        if (i == criteria->namelen) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static boolean_t lustre_search_time_matches(const struct timespec * time, const struct timespec range[2])
+{
+    if ((time->tv_sec < range[0].tv_sec) || ((time->tv_sec == range[0].tv_sec) && (time->tv_nsec < range[0].tv_nsec))) {
+        return FALSE;
+    }
+    if ((time->tv_sec > range[1].tv_sec) || ((time->tv_sec == range[1].tv_sec) && (time->tv_nsec > range[1].tv_nsec))) {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static boolean_t lustre_search_is_invisible(const char * name)
+{
+    return name[0] == '.';
+}
+
+static boolean_t lustre_search_is_package(const char * name, uint32_t namelen)
+{
+    size_t  length;
+    size_t  i;
+
+    for (i=0; i<sizeof(kLustreSearchPackageExtensions) / sizeof(kLustreSearchPackageExtensions[0]); i++) {
+        length = strlen(kLustreSearchPackageExtensions[i]);
+        if ((namelen > length) && (strncasecmp(name + namelen - length, kLustreSearchPackageExtensions[i], length) == 0)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+// Turns down, from the directory page alone, entries that can't be a match and needn't be descended into.  Everything else gets its
+// attributes fetched.  With SRCHFS_NEGATEPARAMS a name that doesn't match could still be a match, so every file is taken.
+static boolean_t lustre_search_filter(const struct lustre_dir_entry * entry, void * data)
+{
+    const struct lustre_search_criteria * criteria;
+
+    criteria = (const struct lustre_search_criteria *)data;
+
+    // "." and ".." never get this far; lustre_dirplus_collect passes over them.
+
+    if ((criteria->options & SRCHFS_SKIPINVISIBLE) && lustre_search_is_invisible(entry->name)) {
+        return FALSE;
+    }
+    if (entry->type == DT_DIR) {
+        return TRUE;
+    }
+    if (!(criteria->options & SRCHFS_MATCHFILES)) {
+        return FALSE;
+    }
+    if ((criteria->common & ATTR_CMN_NAME) && !(criteria->options & SRCHFS_NEGATEPARAMS)) {
+        return lustre_search_name_matches(criteria, entry->name, entry->namelen);
+    }
+    return TRUE;
+}
+
+static boolean_t lustre_search_matches(struct lustre_volume * volume, const struct lustre_search_criteria * criteria, const struct lustre_dirplus_entry * entry)
+{
+    boolean_t   isdir;
+    boolean_t   matched;
+    uint64_t    value;
+
+    isdir = S_ISDIR(entry->attr.mode);
+
+    if (isdir ? !(criteria->options & SRCHFS_MATCHDIRS) : !(criteria->options & SRCHFS_MATCHFILES)) {
+        return FALSE;
+    }
+
+    matched = TRUE;
+
+    if (criteria->common & ATTR_CMN_NAME) {
+        matched = matched && lustre_search_name_matches(criteria, entry->name, entry->namelen);
+    }
+    if (criteria->common & ATTR_CMN_MODTIME) {
+        matched = matched && lustre_search_time_matches(&entry->attr.modify_time, criteria->modify_time);
+    }
+    if (criteria->common & ATTR_CMN_CHGTIME) {
+        matched = matched && lustre_search_time_matches(&entry->attr.change_time, criteria->change_time);
+    }
+    if (criteria->common & ATTR_CMN_ACCTIME) {
+        matched = matched && lustre_search_time_matches(&entry->attr.access_time, criteria->access_time);
+    }
+    if (criteria->common & ATTR_CMN_OWNERID) {
+        value   = lustre_volume_uid_from_owner_identity(volume, entry->attr.owner);
+        matched = matched && (value >= criteria->uid[0]) && (value <= criteria->uid[1]);
+    }
+    if (criteria->common & ATTR_CMN_GRPID) {
+        value   = lustre_volume_gid_from_group_identity(volume, entry->attr.group);
+        matched = matched && (value >= criteria->gid[0]) && (value <= criteria->gid[1]);
+    }
+    if (criteria->common & ATTR_CMN_FILEID) {
+        value   = lustre_volume_is_root_fid(volume, &entry->fid) ? 2 : lustre_node_fileid(&entry->fid);
+        matched = matched && (value >= criteria->fileid[0]) && (value <= criteria->fileid[1]);
+    }
+
+    // File attributes say nothing about directories, which are matched on the rest.
+
+    if (!isdir && (criteria->file & ATTR_FILE_DATALENGTH)) {
+        matched = matched && (entry->attr.size >= criteria->size[0]) && (entry->attr.size <= criteria->size[1]);
+    }
+    if (!isdir && (criteria->file & ATTR_FILE_DATAALLOCSIZE)) {
+        value   = entry->attr.blocks * 512;
+        matched = matched && (value >= criteria->alloc_size[0]) && (value <= criteria->alloc_size[1]);
+    }
+
+    return (criteria->options & SRCHFS_NEGATEPARAMS) ? !matched : matched;
+}
+
+// Only directories the caller could list themselves are searched.
+static boolean_t lustre_search_may_descend(struct lustre_volume * volume, const struct lustre_search_criteria * criteria, kauth_cred_t cred, const struct lustre_dirplus_entry * entry)
+{
+    uint32_t    mode;
+    int         ismember;
+
+    if (!S_ISDIR(entry->attr.mode)) {
+        return FALSE;
+    }
+    if ((criteria->options & SRCHFS_SKIPPACKAGES) && lustre_search_is_package(entry->name, entry->namelen)) {
+        return FALSE;
+    }
+    if (kauth_cred_issuser(cred)) {
+        return TRUE;
+    }
+
+    mode = entry->attr.mode;
+
+    if (kauth_cred_getuid(cred) == lustre_volume_uid_from_owner_identity(volume, entry->attr.owner)) {
+        return (mode & (S_IRUSR | S_IXUSR)) == (S_IRUSR | S_IXUSR);
+    }
+    if ((kauth_cred_ismember_gid(cred, lustre_volume_gid_from_group_identity(volume, entry->attr.group), &ismember) == 0) && ismember) {
+        return (mode & (S_IRGRP | S_IXGRP)) == (S_IRGRP | S_IXGRP);
+    }
+    return (mode & (S_IROTH | S_IXOTH)) == (S_IROTH | S_IXOTH);
+}
+
+static uint64_t lustre_search_now(void)
+{
+    uint64_t now;
+
+    clock_get_uptime(&now);
+
+    return now;
+}
+
+static void lustre_search_dir_free(struct lustre_volume * volume, struct lustre_search_dir * sdir)
+{
+    if (sdir->dir) {
+        lustre_dir_ref_count_dec(sdir->dir);
+    }
+    if (sdir->import) {
+        lustre_import_ref_count_dec(sdir->import);
+    }
+    OSFree(sdir, sizeof(struct lustre_search_dir), volume->malloc_tag);
+}
+
+static errno_t lustre_search_push(struct lustre_search * search, const struct lu_fid * fid)
+{
+    struct lustre_volume *      volume;
+    struct lustre_search_dir *  sdir;
+
+    volume = search->searches->volume;
+
+    sdir = OSMalloc(sizeof(struct lustre_search_dir), volume->malloc_tag);
+    if (!sdir) {
+        return ENOMEM;
+    }
+
+    bzero(sdir, sizeof(struct lustre_search_dir));
+
+    sdir->fid   = *fid;
+    sdir->hash  = lustre_dir_hash_from_cookie(0);
+    sdir->next  = search->pending;
+
+    search->pending         = sdir;
+    search->pending_count   += 1;
+
+    return 0;
+}
+
+// Gets a directory ready to walk and starts reading its first chunk.  The pages are the search's alone and live no longer than its walk
+// of them, so no UPDATE lock is needed to keep them.
+static errno_t lustre_search_dir_start(struct lustre_volume * volume, struct lustre_search_dir * sdir)
+{
+    errno_t error;
+
+    if (sdir->dir) {
+        return 0;
+    }
+
+    if (!sdir->import) {
+        error = lustre_volume_fid_import(volume, &sdir->fid, &sdir->import);
+        if (error != 0) {
+            return error;
+        }
+    }
+
+    sdir->dir = lustre_dir_alloc(volume->malloc_tag, volume->lock_group);
+    if (!sdir->dir) {
+        return ENOMEM;
+    }
+
+    sdir->generation = lustre_dir_generation(sdir->dir);
+
+    lustre_dir_prefetch(sdir->dir, sdir->import, &sdir->fid, sdir->hash, sdir->generation);
+
+    return 0;
+}
+
+// Starts the directories the walk comes to next.  One that can't be started now is tried again when its turn comes.
+static void lustre_search_read_ahead(struct lustre_search * search)
+{
+    struct lustre_search_dir *  sdir;
+    uint32_t                    i;
+
+    for (sdir=search->pending, i=0; sdir && (i < kLustreSearchWindow); sdir=sdir->next, i++) {
+        (void)lustre_search_dir_start(search->searches->volume, sdir);
+    }
+}
+
+static void lustre_search_free(struct lustre_search * search)
+{
+    struct lustre_volume *      volume;
+    struct lustre_search_dir *  sdir;
+
+    volume = search->searches->volume;
+
+    if (search->current) {
+        lustre_search_dir_free(volume, search->current);
+    }
+    while (search->pending) {
+        sdir            = search->pending;
+        search->pending = sdir->next;
+        lustre_search_dir_free(volume, sdir);
+    }
+
+    OSFree(search, sizeof(struct lustre_search), volume->malloc_tag);
+}
+
+static void lustre_search_unlist_locked(struct lustre_searches * searches, struct lustre_search * search)
+{
+    struct lustre_search ** link;
+
+    for (link=&searches->list; *link; link=&(*link)->next) {
+        if (*link == search) {
+            *link = search->next;
+            searches->count -= 1;
+            break;
+        }
+    }
+}
+
+#pragma mark - External
+
+struct lustre_searches * lustre_searches_alloc(struct lustre_volume * volume)
+{
+    struct lustre_searches * searches;
+
+    LUSTRE_BUG_ON(!volume);
+
+    searches = OSMalloc(sizeof(struct lustre_searches), volume->malloc_tag);
+    if (!searches) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate search table");
+        return NULL;
+    }
+
+    bzero(searches, sizeof(struct lustre_searches));
+
+    searches->volume    = volume;
+    searches->next_id   = 1;
+
+    searches->lock = lck_mtx_alloc_init(volume->lock_group, NULL);
+    if (!searches->lock) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate search table lock");
+        OSFree(searches, sizeof(struct lustre_searches), volume->malloc_tag);
+        return NULL;
+    }
+
+    return searches;
+}
+
+// Only called once the volume is unmounted, so no search is running.
+void lustre_searches_free(struct lustre_searches * searches)
+{
+    struct lustre_volume *  volume;
+    struct lustre_search *  search;
+
+    LUSTRE_BUG_ON(!searches);
+
+    volume = searches->volume;
+
+    while (searches->list) {
+        search          = searches->list;
+        searches->list  = search->next;
+        LUSTRE_BUG_ON(search->busy);
+        lustre_search_free(search);
+    }
+
+    lck_mtx_free(searches->lock, volume->lock_group);
+    OSFree(searches, sizeof(struct lustre_searches), volume->malloc_tag);
+}
+
+// Fills in criteria from searchfs's parameter blocks, which must ask only for what we can match: see kLustreSearchCommonAttrs and
+// kLustreSearchFileAttrs.  Ranges not asked for are left empty and never looked at.
+errno_t lustre_search_criteria_parse(const void * params1, const void * params2, const struct attrlist * attrs, uint32_t options, boolean_t is64bit, struct lustre_search_criteria * criteria)
+{
+    errno_t error;
+
+    LUSTRE_BUG_ON(!attrs);
+    LUSTRE_BUG_ON(!criteria);
+
+    bzero(criteria, sizeof(struct lustre_search_criteria));
+
+    if (attrs->bitmapcount != ATTR_BIT_MAP_COUNT) {
+        return EINVAL;
+    }
+    if ((attrs->commonattr & ~kLustreSearchCommonAttrs) || (attrs->fileattr & ~kLustreSearchFileAttrs)) {
+        return EINVAL;
+    }
+    if (attrs->volattr || attrs->dirattr || attrs->forkattr) {
+        return EINVAL;
+    }
+    if (!(options & (SRCHFS_MATCHFILES | SRCHFS_MATCHDIRS))) {
+        return EINVAL;
+    }
+
+    criteria->options   = options;
+    criteria->common    = attrs->commonattr;
+    criteria->file      = attrs->fileattr;
+
+    error = lustre_search_params_unpack(params1, attrs, is64bit, 0, criteria);
+    if (error != 0) {
+        return error;
+    }
+
+    return lustre_search_params_unpack(params2, attrs, is64bit, 1, criteria);
+}
+
+// Starts a search of everything under fid, returned busy for the caller.  Making room for it drops the least recently used of the
+// searches nobody is running.
+errno_t lustre_search_start(struct lustre_searches * searches, const struct lu_fid * fid, struct lustre_search ** result)
+{
+    struct lustre_volume *  volume;
+    struct lustre_search *  search;
+    struct lustre_search *  oldest;
+    struct lustre_search *  each;
+    errno_t                 error;
+
+    LUSTRE_BUG_ON(!searches);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!result);
+
+    volume  = searches->volume;
+    *result = NULL;
+
+    search = OSMalloc(sizeof(struct lustre_search), volume->malloc_tag);
+    if (!search) {
+        return ENOMEM;
+    }
+
+    bzero(search, sizeof(struct lustre_search));
+
+    search->searches    = searches;
+    search->busy        = TRUE;
+
+    error = lustre_search_push(search, fid);
+    if (error != 0) {
+        lustre_search_free(search);
+        return error;
+    }
+
+    oldest = NULL;
+
+    lck_mtx_lock(searches->lock);
+
+    search->id          = searches->next_id++;
+    search->last_used   = lustre_search_now();
+    search->next        = searches->list;
+    searches->list      = search;
+    searches->count     += 1;
+
+    if (searches->count > kLustreSearchKept) {
+        for (each=searches->list; each; each=each->next) {
+            if (!each->busy && (!oldest || (each->last_used < oldest->last_used))) {
+                oldest = each;
+            }
+        }
+        if (oldest) {
+            lustre_search_unlist_locked(searches, oldest);
+        }
+    }
+
+    lck_mtx_unlock(searches->lock);
+
+    if (oldest) {
+        lustre_search_free(oldest);
+    }
+
+    *result = search;
+
+    return 0;
+}
+
+// Finds the search named by a searchstate and marks it busy.  EBUSY, which tells the caller to start over, if it's gone or already
+// being run by someone else.
+errno_t lustre_search_resume(struct lustre_searches * searches, uint64_t id, struct lustre_search ** result)
+{
+    struct lustre_search *  search;
+    errno_t                 error;
+
+    LUSTRE_BUG_ON(!searches);
+    LUSTRE_BUG_ON(!result);
+
+    *result = NULL;
+    error   = EBUSY;
+
+    lck_mtx_lock(searches->lock);
+
+    for (search=searches->list; search; search=search->next) {
+        if (search->id == id) {
+            if (!search->busy) {
+                search->busy        = TRUE;
+                search->last_used   = lustre_search_now();
+                *result             = search;
+                error               = 0;
+            }
+            break;
+        }
+    }
+
+    lck_mtx_unlock(searches->lock);
+
+    return error;
+}
+
+// Hands the search back, for the next call to resume unless finished, in which case it's dropped.
+void lustre_search_release(struct lustre_search * search, boolean_t finished)
+{
+    struct lustre_searches * searches;
+
+    LUSTRE_BUG_ON(!search);
+    LUSTRE_BUG_ON(!search->busy);
+
+    searches = search->searches;
+
+    lck_mtx_lock(searches->lock);
+    search->busy = FALSE;
+    if (finished) {
+        lustre_search_unlist_locked(searches, search);
+    }
+    lck_mtx_unlock(searches->lock);
+
+    if (finished) {
+        lustre_search_free(search);
+    }
+}
+
+// Walks on from where the search left off, handing matches to callback, until max matches, callback runs out of room, uptime passes
+// deadline or there's nothing left, which sets *finished.  ENOBUFS if the first match didn't fit.  A directory that can't be read is
+// passed over rather than ending the search.
+errno_t lustre_search_run(struct lustre_search * search, const struct lustre_search_criteria * criteria, kauth_cred_t cred, uint64_t deadline, uint32_t max, lustre_search_match_callback callback, void * data, uint32_t * matches, boolean_t * finished)
+{
+    struct lustre_volume *          volume;
+    struct lustre_search_dir *      sdir;
+    struct lustre_dirplus *         dirplus;
+    struct lustre_dirplus_entry *   entry;
+    uint64_t                        resume;
+    uint64_t                        now;
+    boolean_t                       stop;
+    uint32_t                        i;
+    errno_t                         error;
+
+    LUSTRE_BUG_ON(!search);
+    LUSTRE_BUG_ON(!search->busy);
+    LUSTRE_BUG_ON(!criteria);
+    LUSTRE_BUG_ON(!callback);
+    LUSTRE_BUG_ON(!matches);
+    LUSTRE_BUG_ON(!finished);
+
+    volume      = search->searches->volume;
+    *matches    = 0;
+    *finished   = FALSE;
+    stop        = FALSE;
+    error       = 0;
+
+    while (!stop) {
+        if (!search->current) {
+            if (!search->pending) {
+                *finished = TRUE;
+                break;
+            }
+
+            search->current         = search->pending;
+            search->pending         = search->current->next;
+            search->pending_count   -= 1;
+            search->current->next   = NULL;
+        }
+
+        sdir = search->current;
+
+        error = lustre_search_dir_start(volume, sdir);
+        if (error == ENOMEM) {
+            break;
+        }
+
+        lustre_search_read_ahead(search);
+
+        if (error == 0) {
+            error = lustre_dirplus_read_filtered(volume, sdir->dir, sdir->import, &sdir->fid, sdir->generation, sdir->hash, kLustreDirPlusBatchMax, lustre_search_filter, (void *)criteria, &dirplus);
+        }
+        if (error == ENOMEM) {
+            break;
+        }
+        if (error != 0) {
+            os_log_info(lustre_logger_vfs, "Search passing over [0x%llx:0x%x:0x%x], error %d", sdir->fid.f_seq, sdir->fid.f_oid, sdir->fid.f_ver, error);
+            lustre_search_dir_free(volume, sdir);
+            search->current = NULL;
+            error = 0;
+            continue;
+        }
+
+        resume = dirplus->hash;
+
+        for (i=0; i<dirplus->count; i++) {
+            entry = &dirplus->entries[i];
+
+            if (entry->error != 0) {
+                continue;
+            }
+
+            if (lustre_search_matches(volume, criteria, entry)) {
+                error = callback(&sdir->fid, entry, data);
+                if (error != 0) {
+                    resume  = entry->hash;
+                    stop    = TRUE;
+                    break;
+                }
+                *matches += 1;
+            }
+
+            // Only once the entry is done with, so a call that stops before it doesn't queue its directory twice.
+
+            if (lustre_search_may_descend(volume, criteria, cred, entry)) {
+                error = lustre_search_push(search, &entry->fid);
+                if (error != 0) {
+                    resume  = entry->next_hash;
+                    stop    = TRUE;
+                    break;
+                }
+            }
+
+            if (*matches == max) {
+                resume  = entry->next_hash;
+                stop    = TRUE;
+                break;
+            }
+        }
+
+        lustre_dirplus_free(dirplus);
+
+        sdir->hash = resume;
+        if (sdir->hash == kLustreDirHashEnd) {
+            lustre_search_dir_free(volume, sdir);
+            search->current = NULL;
+        }
+
+        clock_get_uptime(&now);
+        if (now >= deadline) {
+            stop = TRUE;
+        }
+    }
+
+    // Running out of room only matters to the caller when not even one match fitted.
+
+    if ((error == ENOBUFS) && (*matches > 0)) {
+        error = 0;
+    }
+
+    return error;
+}
@@ -0,0 +1,120 @@
+//
+//  search.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Catalog search, for searchfs.  The volume is walked depth first from the root, a readdir-plus batch at a time, and entries are matched
+// against the caller's criteria here rather than in the caller after a stat each.  Entries the criteria can't want are turned down from
+// the directory page alone, so only candidates and subdirectories cost a getattr, and those go out together.  The first pages of the
+// next kLustreSearchWindow directories to be walked are read while the current one is, so the MDTs always have work in hand.
+//
+// A search outlives the call that started it: results go back a buffer at a time and the searchstate the caller hands back names the
+// search to carry on with.  Searches nobody comes back for are dropped oldest first once there are more than kLustreSearchKept.
+
+#ifndef lustre_search_h
+#define lustre_search_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/attr.h>
+#include <sys/kauth.h>
+#include <kern/locks.h>
+#include "wire.h"
+#include "dirplus.h"
+
+static const uint32_t   kLustreSearchWindow                 = 8;                // directories read ahead of the walk, per search
+static const uint32_t   kLustreSearchKept                   = 8;                // unfinished searches kept per volume
+static const uint32_t   kLustreSearchStateMagic             = 0x4c534631;       // 'LSF1', marks a searchstate as ours
+
+static const attrgroup_t kLustreSearchCommonAttrs           = ATTR_CMN_NAME | ATTR_CMN_MODTIME | ATTR_CMN_CHGTIME | ATTR_CMN_ACCTIME | ATTR_CMN_OWNERID | ATTR_CMN_GRPID | ATTR_CMN_FILEID;
+static const attrgroup_t kLustreSearchFileAttrs             = ATTR_FILE_DATALENGTH | ATTR_FILE_DATAALLOCSIZE;
+
+struct lustre_volume;
+struct lustre_import;
+struct lustre_searches;
+
+// What searchfs asked for: a name, and inclusive ranges for everything else, taken from the two parameter blocks.
+struct lustre_search_criteria {
+    uint32_t                                        options;                        // SRCHFS_*
+    attrgroup_t                                     common;                         // which of kLustreSearchCommonAttrs to match
+    attrgroup_t                                     file;                           // which of kLustreSearchFileAttrs to match; files only
+    char                                            name[MAXNAMLEN + 1];
+    uint32_t                                        namelen;
+    struct timespec                                 modify_time[2];
+    struct timespec                                 change_time[2];
+    struct timespec                                 access_time[2];
+    uid_t                                           uid[2];
+    gid_t                                           gid[2];
+    uint64_t                                        fileid[2];
+    uint64_t                                        size[2];
+    uint64_t                                        alloc_size[2];
+};
+
+// The part of struct searchstate that's ours.
+struct lustre_search_state {
+    uint32_t                                        magic;
+    uint32_t                                        reserved;
+    uint64_t                                        id;
+};
+
+struct lustre_search_dir {
+    struct lu_fid                                   fid;
+    struct lustre_dir *                             dir;                            // page cache for this search alone, once started
+    struct lustre_import *                          import;                         // with a reference, once started
+    uint32_t                                        generation;
+    uint64_t                                        hash;                           // where the walk resumes
+    struct lustre_search_dir *                      next;
+};
+
+struct lustre_search {
+    struct lustre_searches *                        searches;
+    uint64_t                                        id;
+    struct lustre_search_dir *                      current;                        // being walked
+    struct lustre_search_dir *                      pending;                        // still to walk, next first
+    uint32_t                                        pending_count;
+
+    boolean_t                                       busy;                           // following protected by the searches lock
+    uint64_t                                        last_used;
+    struct lustre_search *                          next;
+};
+
+struct lustre_searches {
+    struct lustre_volume *                          volume;
+    lck_mtx_t *                                     lock;                           // protects following fields
+    struct lustre_search *                          list;
+    uint32_t                                        count;
+    uint64_t                                        next_id;
+};
+
+// Called for each match with the FID of the directory it's in; returning ENOBUFS stops the search before the entry, to resume there.
+typedef errno_t (* lustre_search_match_callback)(const struct lu_fid * parent, const struct lustre_dirplus_entry * entry, void * data);
+
+struct lustre_searches *    lustre_searches_alloc(struct lustre_volume * volume);
+void                        lustre_searches_free(struct lustre_searches * searches);
+
+errno_t                     lustre_search_criteria_parse(const void * params1, const void * params2, const struct attrlist * attrs, uint32_t options, boolean_t is64bit, struct lustre_search_criteria * criteria);
+
+errno_t                     lustre_search_start(struct lustre_searches * searches, const struct lu_fid * fid, struct lustre_search ** result);
+errno_t                     lustre_search_resume(struct lustre_searches * searches, uint64_t id, struct lustre_search ** result);
+void                        lustre_search_release(struct lustre_search * search, boolean_t finished);
+
+errno_t                     lustre_search_run(struct lustre_search * search, const struct lustre_search_criteria * criteria, kauth_cred_t cred, uint64_t deadline, uint32_t max, lustre_search_match_callback callback, void * data, uint32_t * matches, boolean_t * finished);
+
+#endif /* lustre_search_h */
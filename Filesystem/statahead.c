@@ -0,0 +1,467 @@
+//
+//  statahead.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <libkern/libkern.h>
+#include <sys/errno.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "statahead.h"
+#include "dir.h"
+#include "mdc.h"
+#include "node.h"
+#include "volume.h"
+#include "logging.h"
+#include "assert.h"
+
+static const uint32_t   kLustreStatAheadEntriesMax          = kLustreStatAheadWindowMax + kLustreStatAheadSlack;
+
+struct lustre_statahead_fill {
+    struct lustre_statahead_entry * entries;
+    uint32_t                        count;
+    uint32_t                        capacity;
+};
+
+#pragma mark - Internal
+
+static struct lustre_statahead_entry * lustre_statahead_entry_at(struct lustre_statahead * statahead, uint32_t index)
+{
+    return &statahead->entries[(statahead->head + index) % kLustreStatAheadEntriesMax];
+}
+
+// Caller holds the statahead lock.  Throws away whatever lookup was sent for entry.  The lookup is only put aside here; it's waited for,
+// so the lock it enqueued can be given back, by lustre_statahead_reap once the statahead lock is dropped.
+static void lustre_statahead_entry_discard(struct lustre_statahead * statahead, struct lustre_statahead_entry * entry)
+{
+    if (!entry->request) {
+        return;
+    }
+
+    LUSTRE_BUG_ON(statahead->discard_count == kLustreStatAheadEntriesMax);
+
+    statahead->discards[statahead->discard_count].request   = entry->request;
+    statahead->discards[statahead->discard_count].lock      = entry->lock;
+    statahead->discard_count += 1;
+
+    statahead->stats.wasted += 1;
+
+    entry->request  = NULL;
+    entry->lock     = NULL;
+}
+
+// Called without the statahead lock.  Waits for the lookups discarded so far and cancels the locks they were granted.  Whoever is already
+// reaping takes care of discards that turn up meanwhile.
+static void lustre_statahead_reap(struct lustre_statahead * statahead)
+{
+    struct lustre_statahead_discard discard;
+    struct lustre_dlm_lock *        lock;
+    struct mdt_body                 body;
+
+    lck_mtx_lock(statahead->lock);
+
+    if (statahead->reaping) {
+        lck_mtx_unlock(statahead->lock);
+        return;
+    }
+
+    statahead->reaping = TRUE;
+
+    while (statahead->discard_count > 0) {
+        statahead->discard_count   -= 1;
+        discard                     = statahead->discards[statahead->discard_count];
+
+        lck_mtx_unlock(statahead->lock);
+
+        (void)lustre_request_wait(discard.request);
+        (void)lustre_mdc_lookup_interpret(discard.request, discard.lock, &body, &lock);
+        if (lock) {
+            lustre_dlm_lock_cancel(lock);
+            lustre_dlm_lock_ref_count_dec(lock);
+        }
+        lustre_request_ref_count_dec(discard.request);
+
+        lck_mtx_lock(statahead->lock);
+    }
+
+    statahead->reaping = FALSE;
+
+    lck_mtx_unlock(statahead->lock);
+}
+
+// Caller holds the statahead lock.
+static void lustre_statahead_pop(struct lustre_statahead * statahead)
+{
+    LUSTRE_BUG_ON(statahead->count == 0);
+
+    statahead->head     = (statahead->head + 1) % kLustreStatAheadEntriesMax;
+    statahead->count   -= 1;
+}
+
+// Caller holds the statahead lock.
+static void lustre_statahead_discard_all(struct lustre_statahead * statahead)
+{
+    while (statahead->count > 0) {
+        lustre_statahead_entry_discard(statahead, lustre_statahead_entry_at(statahead, 0));
+        lustre_statahead_pop(statahead);
+    }
+}
+
+static errno_t lustre_statahead_collect(const struct lustre_dir_entry * entry, void * data)
+{
+    struct lustre_statahead_fill *  fill;
+    struct lustre_statahead_entry * collected;
+
+    fill = (struct lustre_statahead_fill *)data;
+
+    // Nobody looks up "." or "..", at least not through us.
+
+    if ((entry->namelen == 1) && (entry->name[0] == '.')) {
+        return 0;
+    }
+    if ((entry->namelen == 2) && (entry->name[0] == '.') && (entry->name[1] == '.')) {
+        return 0;
+    }
+
+    if (fill->count == fill->capacity) {
+        return ENOBUFS;
+    }
+
+    collected = &fill->entries[fill->count];
+
+    bzero(collected, sizeof(struct lustre_statahead_entry));
+    memcpy(collected->name, entry->name, entry->namelen);
+    collected->namelen  = entry->namelen;
+    collected->hash     = entry->hash;
+
+    fill->count += 1;
+
+    return 0;
+}
+
+// Caller holds the statahead lock, which is dropped while reading.  Tops the ring up to want entries from the directory's page cache,
+// unless someone else is already at it or a new listing started meanwhile.
+static void lustre_statahead_fill(struct lustre_statahead * statahead, struct lustre_node * node, struct lustre_import * import, uint32_t want)
+{
+    struct lustre_statahead_fill    fill;
+    struct lustre_dir *             dir;
+    uint64_t                        hash;
+    uint32_t                        epoch;
+    uint32_t                        i;
+    errno_t                         error;
+
+    if (statahead->filling || statahead->ended || (statahead->count >= want)) {
+        return;
+    }
+
+    fill.capacity   = want - statahead->count;
+    fill.count      = 0;
+    fill.entries    = OSMalloc(fill.capacity * sizeof(struct lustre_statahead_entry), statahead->malloc_tag);
+    if (!fill.entries) {
+        return;
+    }
+
+    statahead->filling  = TRUE;
+    hash                = statahead->hash;
+    epoch               = statahead->epoch;
+
+    lck_mtx_unlock(statahead->lock);
+
+    error = ENOMEM;
+    dir = lustre_node_dir(node);
+    if (dir) {
+        error = lustre_dir_walk(dir, import, &node->fid, lustre_dir_generation(dir), &hash, lustre_statahead_collect, &fill);
+        lustre_dir_ref_count_dec(dir);
+    }
+
+    lck_mtx_lock(statahead->lock);
+
+    statahead->filling = FALSE;
+
+    if ((error == 0) && (statahead->epoch == epoch)) {
+        for (i=0; (i<fill.count) && (statahead->count < kLustreStatAheadEntriesMax); i++) {
+            *lustre_statahead_entry_at(statahead, statahead->count) = fill.entries[i];
+            statahead->count += 1;
+        }
+        statahead->hash     = hash;
+        statahead->ended    = (hash == kLustreDirHashEnd);
+    }
+
+    OSFree(fill.entries, fill.capacity * sizeof(struct lustre_statahead_entry), statahead->malloc_tag);
+}
+
+// Caller holds the statahead lock.  Grows the window while most of what it sends gets used and shrinks it when most doesn't; a window
+// shrunk below the minimum turns statahead off until the caller goes back to looking up entries in order.
+static void lustre_statahead_adapt(struct lustre_statahead * statahead)
+{
+    if ((statahead->window == 0) || (statahead->sample_total < statahead->window)) {
+        return;
+    }
+
+    if ((statahead->sample_hits * 4) >= (statahead->sample_total * 3)) {
+        statahead->window = (statahead->window * 2 < kLustreStatAheadWindowMax) ? statahead->window * 2 : kLustreStatAheadWindowMax;
+    } else if ((statahead->sample_hits * 4) < statahead->sample_total) {
+        statahead->window /= 2;
+        if (statahead->window < kLustreStatAheadWindowMin) {
+            statahead->window   = 0;
+            statahead->in_order = 0;
+            lustre_statahead_discard_all(statahead);
+        }
+    }
+
+    statahead->sample_hits  = 0;
+    statahead->sample_total = 0;
+}
+
+// Caller holds the statahead lock.  Sends lookups for every entry in the window that doesn't have one yet.  Nothing is sent while discarded
+// lookups wait to be reaped, which keeps those sent but not yet reaped within the room there is to set them aside.
+static void lustre_statahead_launch(struct lustre_statahead * statahead, struct lustre_volume * volume, struct lustre_node * node, struct lustre_import * import)
+{
+    struct lustre_statahead_entry * entry;
+    uint32_t                        i;
+
+    if (statahead->discard_count > 0) {
+        return;
+    }
+
+    for (i=0; (i<statahead->window) && (i<statahead->count); i++) {
+        entry = lustre_statahead_entry_at(statahead, i);
+        if (entry->request) {
+            continue;
+        }
+        if (lustre_mdc_lookup_prepare(import, volume->dlm, &node->fid, entry->name, entry->namelen, &entry->request, &entry->lock) != 0) {
+            break;
+        }
+
+        // A failure to send completes the request, which the lookup then reports like any other error.
+
+        (void)lustre_request_send_async(entry->request);
+    }
+}
+
+#pragma mark - External
+
+struct lustre_statahead * lustre_statahead_alloc(OSMallocTag malloc_tag, lck_grp_t * lock_group)
+{
+    struct lustre_statahead * statahead;
+
+    statahead = OSMalloc(sizeof(struct lustre_statahead), malloc_tag);
+    if (!statahead) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate statahead");
+        return NULL;
+    }
+
+    bzero(statahead, sizeof(struct lustre_statahead));
+
+    statahead->malloc_tag   = malloc_tag;
+    statahead->lock_group   = lock_group;
+
+    statahead->lock = lck_mtx_alloc_init(lock_group, NULL);
+    if (!statahead->lock) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate statahead lock");
+        OSFree(statahead, sizeof(struct lustre_statahead), malloc_tag);
+        return NULL;
+    }
+
+    return statahead;
+}
+
+void lustre_statahead_free(struct lustre_statahead * statahead)
+{
+    LUSTRE_BUG_ON(!statahead);
+
+    if (statahead->entries) {
+        lck_mtx_lock(statahead->lock);
+        lustre_statahead_discard_all(statahead);
+        lck_mtx_unlock(statahead->lock);
+
+        lustre_statahead_reap(statahead);
+
+        OSFree(statahead->entries, kLustreStatAheadEntriesMax * sizeof(struct lustre_statahead_entry), statahead->malloc_tag);
+        OSFree(statahead->discards, kLustreStatAheadEntriesMax * sizeof(struct lustre_statahead_discard), statahead->malloc_tag);
+    }
+
+    lck_mtx_free(statahead->lock, statahead->lock_group);
+    OSFree(statahead, sizeof(struct lustre_statahead), statahead->malloc_tag);
+}
+
+// Called when a listing of the directory starts at hash.  Whatever was being read ahead for the last listing is dropped; the new one is
+// watched to see whether it's followed by lookups in order.
+void lustre_statahead_listed(struct lustre_statahead * statahead, uint64_t hash)
+{
+    struct lustre_statahead_entry *     entries;
+    struct lustre_statahead_discard *   discards;
+
+    LUSTRE_BUG_ON(!statahead);
+
+    entries     = NULL;
+    discards    = NULL;
+    if (!statahead->entries) {
+        entries     = OSMalloc(kLustreStatAheadEntriesMax * sizeof(struct lustre_statahead_entry), statahead->malloc_tag);
+        discards    = OSMalloc(kLustreStatAheadEntriesMax * sizeof(struct lustre_statahead_discard), statahead->malloc_tag);
+        if (!entries || !discards) {
+            goto end;
+        }
+    }
+
+    lck_mtx_lock(statahead->lock);
+
+    if (!statahead->entries) {
+        statahead->entries  = entries;
+        statahead->discards = discards;
+        entries             = NULL;
+        discards            = NULL;
+    }
+
+    lustre_statahead_discard_all(statahead);
+
+    statahead->head         = 0;
+    statahead->hash         = hash;
+    statahead->ended        = FALSE;
+    statahead->epoch       += 1;
+    statahead->in_order     = 0;
+    statahead->window       = 0;
+    statahead->sample_hits  = 0;
+    statahead->sample_total = 0;
+    statahead->stats.window = 0;
+
+    lck_mtx_unlock(statahead->lock);
+
+    lustre_statahead_reap(statahead);
+
+end:
+    if (entries) {
+        OSFree(entries, kLustreStatAheadEntriesMax * sizeof(struct lustre_statahead_entry), statahead->malloc_tag);
+    }
+    if (discards) {
+        OSFree(discards, kLustreStatAheadEntriesMax * sizeof(struct lustre_statahead_discard), statahead->malloc_tag);
+    }
+}
+
+// Called for each lookup in the directory that missed the name cache.  Returns TRUE if statahead had already sent this lookup, in which
+// case *error, *body and *lock are what lustre_mdc_lookup would have returned; otherwise the caller sends the lookup itself.
+boolean_t lustre_statahead_lookup(struct lustre_statahead * statahead, struct lustre_volume * volume, struct lustre_node * node, struct lustre_import * import, const char * name, size_t length, errno_t * error, struct mdt_body * body, struct lustre_dlm_lock ** lock)
+{
+    struct lustre_statahead_entry * entry;
+    struct lustre_request *         request;
+    struct lustre_dlm_lock *        dlm_lock;
+    uint32_t                        limit;
+    uint32_t                        found;
+    uint32_t                        i;
+
+    LUSTRE_BUG_ON(!statahead);
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!import);
+    LUSTRE_BUG_ON(!name);
+    LUSTRE_BUG_ON(!error);
+    LUSTRE_BUG_ON(!body);
+    LUSTRE_BUG_ON(!lock);
+
+    request     = NULL;
+    dlm_lock    = NULL;
+
+    lck_mtx_lock(statahead->lock);
+
+    if (!statahead->entries) {
+        lck_mtx_unlock(statahead->lock);
+        return FALSE;
+    }
+
+    lustre_statahead_fill(statahead, node, import, statahead->window + kLustreStatAheadSlack);
+
+    // Look for the name a little way past where we expect it, so a caller that skips an entry or two doesn't lose its place.
+
+    limit = (statahead->count < kLustreStatAheadSlack + 1) ? statahead->count : kLustreStatAheadSlack + 1;
+    found = limit;
+    for (i=0; i<limit; i++) {
+        entry = lustre_statahead_entry_at(statahead, i);
+        if ((entry->namelen == length) && (memcmp(entry->name, name, length) == 0)) {
+            found = i;
+            break;
+        }
+    }
+
+    if (found < limit) {
+        for (i=0; i<found; i++) {
+            lustre_statahead_entry_discard(statahead, lustre_statahead_entry_at(statahead, 0));
+            lustre_statahead_pop(statahead);
+        }
+
+        entry           = lustre_statahead_entry_at(statahead, 0);
+        request         = entry->request;
+        dlm_lock        = entry->lock;
+        entry->request  = NULL;
+        entry->lock     = NULL;
+        lustre_statahead_pop(statahead);
+
+        statahead->in_order += 1;
+    } else {
+        statahead->in_order = 0;
+    }
+
+    if (statahead->window != 0) {
+        statahead->sample_total += 1;
+        if (request) {
+            statahead->sample_hits  += 1;
+            statahead->stats.hits   += 1;
+        } else {
+            statahead->stats.misses += 1;
+        }
+    }
+
+    if ((statahead->window == 0) && (statahead->in_order >= kLustreStatAheadTrigger)) {
+        statahead->window       = kLustreStatAheadWindowMin;
+        statahead->sample_hits  = 0;
+        statahead->sample_total = 0;
+    }
+
+    lustre_statahead_adapt(statahead);
+
+    if (statahead->window != 0) {
+        lustre_statahead_fill(statahead, node, import, statahead->window + kLustreStatAheadSlack);
+        lustre_statahead_launch(statahead, volume, node, import);
+    }
+
+    statahead->stats.window = statahead->window;
+
+    lck_mtx_unlock(statahead->lock);
+
+    lustre_statahead_reap(statahead);
+
+    if (!request) {
+        return FALSE;
+    }
+
+    (void)lustre_request_wait(request);
+    *error = lustre_mdc_lookup_interpret(request, dlm_lock, body, lock);
+    lustre_request_ref_count_dec(request);
+
+    return TRUE;
+}
+
+// Counters are updated under the statahead lock but read without it; they're only ever reported, never acted on.
+struct lustre_statahead_stats lustre_statahead_stats(struct lustre_statahead * statahead)
+{
+    LUSTRE_BUG_ON(!statahead);
+
+    return statahead->stats;
+}
@@ -0,0 +1,97 @@
+//
+//  statahead.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// Statahead: notices a directory being listed and then looked up entry by entry, in listing order (ls -l, rsync, find), and sends the
+// lookups for the entries just ahead of the caller before it asks for them.  The window of lookups in flight grows while they're being
+// used and shrinks, and eventually stops, when they aren't.
+
+#ifndef lustre_statahead_h
+#define lustre_statahead_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <kern/locks.h>
+#include <libkern/OSMalloc.h>
+#include "wire.h"
+#include "dlm.h"
+#include "request.h"
+
+static const uint32_t   kLustreStatAheadWindowMin           = 8;
+static const uint32_t   kLustreStatAheadWindowMax           = 256;
+static const uint32_t   kLustreStatAheadTrigger             = 2;                // lookups in listing order before we start
+static const uint32_t   kLustreStatAheadSlack               = 4;                // how far ahead of the cursor a lookup still counts as in order
+
+struct lustre_volume;
+struct lustre_import;
+struct lustre_node;
+
+struct lustre_statahead_stats {
+    uint64_t                                        hits;                           // lookups answered by statahead
+    uint64_t                                        misses;                         // lookups while active that it hadn't sent
+    uint64_t                                        wasted;                         // lookups sent that nobody asked for
+    uint32_t                                        window;                         // 0 when inactive
+};
+
+struct lustre_statahead_entry {
+    char                                            name[MAXNAMLEN + 1];
+    uint32_t                                        namelen;
+    uint64_t                                        hash;
+    struct lustre_request *                         request;                        // lookup sent for this entry, if any
+    struct lustre_dlm_lock *                        lock;                           // the lock it enqueues
+};
+
+// A lookup that was sent but isn't wanted any more, waiting to be reaped once the statahead lock is dropped.
+struct lustre_statahead_discard {
+    struct lustre_request *                         request;
+    struct lustre_dlm_lock *                        lock;
+};
+
+struct lustre_statahead {
+    OSMallocTag                                     malloc_tag;
+    lck_grp_t *                                     lock_group;
+    lck_mtx_t *                                     lock;                           // protects following fields
+    struct lustre_statahead_entry *                 entries;                        // ring of upcoming entries, in listing order
+    uint32_t                                        head;                           // the entry we expect to be looked up next
+    uint32_t                                        count;
+    uint64_t                                        hash;                           // where to continue reading the listing
+    boolean_t                                       filling;                        // someone is reading the listing
+    uint32_t                                        epoch;                          // bumped when a new listing starts
+    boolean_t                                       ended;                          // the listing has no more entries
+    uint32_t                                        in_order;                       // consecutive lookups in listing order
+    uint32_t                                        window;                         // 0 when inactive
+    uint32_t                                        sample_hits;                    // since the window last changed
+    uint32_t                                        sample_total;
+    struct lustre_statahead_discard *               discards;                       // lookups discarded but not yet reaped
+    uint32_t                                        discard_count;
+    boolean_t                                       reaping;                        // someone is waiting on the discards
+    struct lustre_statahead_stats                   stats;                          // updated under the lock, read without it
+};
+
+struct lustre_statahead *   lustre_statahead_alloc(OSMallocTag malloc_tag, lck_grp_t * lock_group);
+void                        lustre_statahead_free(struct lustre_statahead * statahead);
+
+void                        lustre_statahead_listed(struct lustre_statahead * statahead, uint64_t hash);
+boolean_t                   lustre_statahead_lookup(struct lustre_statahead * statahead, struct lustre_volume * volume, struct lustre_node * node, struct lustre_import * import, const char * name, size_t length, errno_t * error, struct mdt_body * body, struct lustre_dlm_lock ** lock);
+struct lustre_statahead_stats lustre_statahead_stats(struct lustre_statahead * statahead);
+
+#endif /* lustre_statahead_h */
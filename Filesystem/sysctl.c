@@ -0,0 +1,322 @@
+//
+//  sysctl.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <libkern/libkern.h>
+#include <sys/errno.h>
+#include <sys/sysctl.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "sysctl.h"
+#include "volume.h"
+#include "node.h"
+#include "statahead.h"
+#include "readahead.h"
+#include "logging.h"
+#include "assert.h"
+
+struct lustre_sysctl_report {
+    char *                  buffer;
+    uint32_t                length;
+    const char *            url;
+};
+
+static lck_mtx_t *              lustre_sysctl_lock          = NULL;         // protects following
+static struct lustre_volume *   lustre_sysctl_volumes       = NULL;
+
+static int lustre_sysctl_statahead SYSCTL_HANDLER_ARGS;
+static int lustre_sysctl_readahead SYSCTL_HANDLER_ARGS;
+static int lustre_sysctl_writeback SYSCTL_HANDLER_ARGS;
+static int lustre_sysctl_opencache SYSCTL_HANDLER_ARGS;
+
+SYSCTL_DECL(_vfs);
+SYSCTL_NODE(_vfs, OID_AUTO, lustre, CTLFLAG_RW | CTLFLAG_LOCKED, NULL, "Lustre filesystem");
+SYSCTL_PROC(_vfs_lustre, OID_AUTO, statahead, CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_LOCKED, NULL, 0, lustre_sysctl_statahead, "A", "Per-directory statahead counters");
+SYSCTL_PROC(_vfs_lustre, OID_AUTO, readahead, CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_LOCKED, NULL, 0, lustre_sysctl_readahead, "A", "Per-file readahead counters");
+SYSCTL_PROC(_vfs_lustre, OID_AUTO, writeback, CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_LOCKED, NULL, 0, lustre_sysctl_writeback, "A", "Per-volume writeback counters");
+SYSCTL_PROC(_vfs_lustre, OID_AUTO, opencache, CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_LOCKED, NULL, 0, lustre_sysctl_opencache, "A", "Per-volume open handle cache counters");
+
+#pragma mark - Internal
+
+// Appends to the report, quietly dropping whatever doesn't fit.
+static void lustre_sysctl_report_printf(struct lustre_sysctl_report * report, const char * format, ...)
+{
+    va_list     arguments;
+    int         length;
+
+    if (report->length + 1 >= kLustreSysctlReportSize) {
+        return;
+    }
+
+    va_start(arguments, format);
+    length = vsnprintf(report->buffer + report->length, kLustreSysctlReportSize - report->length, format, arguments);
+    va_end(arguments);
+
+    if (length > 0) {
+        report->length += (uint32_t)length;
+        if (report->length >= kLustreSysctlReportSize) {
+            report->length = kLustreSysctlReportSize - 1;
+        }
+    }
+}
+
+static void lustre_sysctl_statahead_node(struct lustre_node * node, void * data)
+{
+    struct lustre_sysctl_report *   report;
+    struct lustre_statahead *       statahead;
+    struct lustre_statahead_stats   stats;
+
+    report = (struct lustre_sysctl_report *)data;
+
+    lck_mtx_lock(node->lock);
+    statahead = node->statahead;
+    lck_mtx_unlock(node->lock);
+
+    if (!statahead) {
+        return;
+    }
+
+    stats = lustre_statahead_stats(statahead);
+
+    lustre_sysctl_report_printf(report, "%s [0x%llx:0x%x:0x%x] hits %llu misses %llu wasted %llu window %u\n",
+                                report->url, node->fid.f_seq, node->fid.f_oid, node->fid.f_ver, stats.hits, stats.misses, stats.wasted, stats.window);
+}
+
+// Builds a report from every node of every volume and copies it out.
+static int lustre_sysctl_report_nodes(struct sysctl_req * req, lustre_node_table_callback callback)
+{
+    struct lustre_sysctl_report     report;
+    struct lustre_volume *          volume;
+    int                             error;
+
+    report.buffer = OSMalloc(kLustreSysctlReportSize, lustre_os_malloc_tag);
+    if (!report.buffer) {
+        return ENOMEM;
+    }
+
+    report.length       = 0;
+    report.buffer[0]    = '\0';
+
+    lck_mtx_lock(lustre_sysctl_lock);
+    for (volume = lustre_sysctl_volumes; volume; volume = volume->sysctl_next) {
+        report.url = lustre_volume_url(volume);
+        if (volume->root_node) {
+            callback(volume->root_node, &report);
+        }
+        if (volume->nodes) {
+            lustre_node_table_iterate(volume->nodes, callback, &report);
+        }
+    }
+    lck_mtx_unlock(lustre_sysctl_lock);
+
+    error = SYSCTL_OUT(req, report.buffer, report.length + 1);
+
+    OSFree(report.buffer, kLustreSysctlReportSize, lustre_os_malloc_tag);
+
+    return error;
+}
+
+// One line per directory that has been listed: volume, FID, and its statahead counters.
+static int lustre_sysctl_statahead SYSCTL_HANDLER_ARGS
+{
+    return lustre_sysctl_report_nodes(req, lustre_sysctl_statahead_node);
+}
+
+static void lustre_sysctl_readahead_node(struct lustre_node * node, void * data)
+{
+    struct lustre_sysctl_report *   report;
+    struct lustre_readahead *       readahead;
+    struct lustre_readahead_stats   stats;
+
+    report = (struct lustre_sysctl_report *)data;
+
+    lck_mtx_lock(node->lock);
+    readahead = node->readahead;
+    lck_mtx_unlock(node->lock);
+
+    if (!readahead) {
+        return;
+    }
+
+    stats = lustre_readahead_stats(readahead);
+
+    lustre_sysctl_report_printf(report, "%s [0x%llx:0x%x:0x%x] hits %llu misses %llu bytes %llu sequential %u strided %u reverse %u\n",
+                                report->url, node->fid.f_seq, node->fid.f_oid, node->fid.f_ver, stats.hits, stats.misses, stats.bytes,
+                                stats.streams[kLustreReadAheadPatternSequential], stats.streams[kLustreReadAheadPatternStrided],
+                                stats.streams[kLustreReadAheadPatternReverse]);
+}
+
+// One line per file that has been read: volume, FID, its readahead counters, and how many of its streams have each pattern.
+static int lustre_sysctl_readahead SYSCTL_HANDLER_ARGS
+{
+    return lustre_sysctl_report_nodes(req, lustre_sysctl_readahead_node);
+}
+
+// One line per volume: write RPCs and bytes sent, why the RPCs went, how often writers waited or had to write synchronously, and what's
+// dirty and held right now.
+static int lustre_sysctl_writeback SYSCTL_HANDLER_ARGS
+{
+    struct lustre_sysctl_report     report;
+    struct lustre_writeback_stats   stats;
+    struct lustre_volume *          volume;
+    uint64_t                        dirty;
+    uint64_t                        held;
+    int                             error;
+
+    report.buffer = OSMalloc(kLustreSysctlReportSize, lustre_os_malloc_tag);
+    if (!report.buffer) {
+        return ENOMEM;
+    }
+
+    report.length       = 0;
+    report.buffer[0]    = '\0';
+
+    lck_mtx_lock(lustre_sysctl_lock);
+    for (volume = lustre_sysctl_volumes; volume; volume = volume->sysctl_next) {
+        stats = lustre_writeback_stats(volume->writeback);
+
+        lck_mtx_lock(volume->writeback->lock);
+        dirty   = volume->writeback->dirty;
+        held    = volume->writeback->held;
+        lck_mtx_unlock(volume->writeback->lock);
+
+        lustre_sysctl_report_printf(&report, "%s rpcs %llu bytes %llu full %llu aged %llu pressure %llu sync %llu throttled %llu ungranted %llu dirty %llu held %llu\n",
+                                    lustre_volume_url(volume), stats.rpcs, stats.bytes, stats.full, stats.aged, stats.pressure, stats.sync,
+                                    stats.throttled, stats.ungranted, dirty, held);
+    }
+    lck_mtx_unlock(lustre_sysctl_lock);
+
+    error = SYSCTL_OUT(req, report.buffer, report.length + 1);
+
+    OSFree(report.buffer, kLustreSysctlReportSize, lustre_os_malloc_tag);
+
+    return error;
+}
+
+// One line per volume: open and close RPCs sent, how many of each the open cache saved, and why idle handles were closed.
+static int lustre_sysctl_opencache SYSCTL_HANDLER_ARGS
+{
+    struct lustre_sysctl_report     report;
+    struct lustre_open_stats        stats;
+    struct lustre_volume *          volume;
+    int                             error;
+
+    report.buffer = OSMalloc(kLustreSysctlReportSize, lustre_os_malloc_tag);
+    if (!report.buffer) {
+        return ENOMEM;
+    }
+
+    report.length       = 0;
+    report.buffer[0]    = '\0';
+
+    lck_mtx_lock(lustre_sysctl_lock);
+    for (volume = lustre_sysctl_volumes; volume; volume = volume->sysctl_next) {
+        stats = lustre_open_cache_stats(volume->open_cache);
+
+        lustre_sysctl_report_printf(&report, "%s opens %llu closes %llu saved %llu opens_saved %llu closes_saved %llu revoked %llu evicted %llu\n",
+                                    lustre_volume_url(volume), stats.opens, stats.closes, stats.opens_saved + stats.closes_saved,
+                                    stats.opens_saved, stats.closes_saved, stats.revoked, stats.evicted);
+    }
+    lck_mtx_unlock(lustre_sysctl_lock);
+
+    error = SYSCTL_OUT(req, report.buffer, report.length + 1);
+
+    OSFree(report.buffer, kLustreSysctlReportSize, lustre_os_malloc_tag);
+
+    return error;
+}
+
+#pragma mark - External
+
+kern_return_t lustre_sysctl_register(void)
+{
+    LUSTRE_BUG_ON(lustre_sysctl_lock);
+
+    lustre_sysctl_lock = lck_mtx_alloc_init(lustre_lock_group, NULL);
+    if (!lustre_sysctl_lock) {
+        os_log_error(lustre_logger_default, "Couldn't allocate sysctl lock");
+        return KERN_FAILURE;
+    }
+
+    sysctl_register_oid(&sysctl__vfs_lustre);
+    sysctl_register_oid(&sysctl__vfs_lustre_statahead);
+    sysctl_register_oid(&sysctl__vfs_lustre_readahead);
+    sysctl_register_oid(&sysctl__vfs_lustre_writeback);
+    sysctl_register_oid(&sysctl__vfs_lustre_opencache);
+
+    return KERN_SUCCESS;
+}
+
+// Only called once every volume has gone, so nothing is left on the list.
+void lustre_sysctl_unregister(void)
+{
+    if (!lustre_sysctl_lock) {
+        return;
+    }
+
+    LUSTRE_BUG_ON(lustre_sysctl_volumes);
+
+    sysctl_unregister_oid(&sysctl__vfs_lustre_opencache);
+    sysctl_unregister_oid(&sysctl__vfs_lustre_writeback);
+    sysctl_unregister_oid(&sysctl__vfs_lustre_readahead);
+    sysctl_unregister_oid(&sysctl__vfs_lustre_statahead);
+    sysctl_unregister_oid(&sysctl__vfs_lustre);
+
+    lck_mtx_free(lustre_sysctl_lock, lustre_lock_group);
+    lustre_sysctl_lock = NULL;
+}
+
+void lustre_sysctl_volume_add(struct lustre_volume * volume)
+{
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(volume->sysctl_listed);
+
+    lck_mtx_lock(lustre_sysctl_lock);
+    volume->sysctl_next     = lustre_sysctl_volumes;
+    volume->sysctl_listed   = TRUE;
+    lustre_sysctl_volumes   = volume;
+    lck_mtx_unlock(lustre_sysctl_lock);
+}
+
+// Does nothing if the volume was never added, so it's safe on any volume being freed.
+void lustre_sysctl_volume_remove(struct lustre_volume * volume)
+{
+    struct lustre_volume ** link;
+
+    LUSTRE_BUG_ON(!volume);
+
+    lck_mtx_lock(lustre_sysctl_lock);
+    if (volume->sysctl_listed) {
+        link = &lustre_sysctl_volumes;
+        while (*link && (*link != volume)) {
+            link = &(*link)->sysctl_next;
+        }
+
+        LUSTRE_BUG_ON(!*link);
+
+        *link                   = volume->sysctl_next;
+        volume->sysctl_next     = NULL;
+        volume->sysctl_listed   = FALSE;
+    }
+    lck_mtx_unlock(lustre_sysctl_lock);
+}
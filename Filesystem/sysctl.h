@@ -0,0 +1,41 @@
+//
+//  sysctl.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// sysctl nodes under vfs.lustre, reporting on every mounted volume.
+
+#ifndef lustre_sysctl_h
+#define lustre_sysctl_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+
+static const uint32_t   kLustreSysctlReportSize             = 64 * 1024;        // longest report we return
+
+struct lustre_volume;
+
+kern_return_t   lustre_sysctl_register(void);
+void            lustre_sysctl_unregister(void);
+
+void            lustre_sysctl_volume_add(struct lustre_volume * volume);
+void            lustre_sysctl_volume_remove(struct lustre_volume * volume);
+
+#endif /* lustre_sysctl_h */
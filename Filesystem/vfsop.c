@@ -34,12 +34,14 @@
 #include <sys/proc.h>
 #include <sys/fcntl.h>
 #include <sys/sysctl.h>
+#include <sys/ubc.h>
 
 #include "vfsop.h"
 #include "lustre.h"
 #include "mount.h"
 #include "logging.h"
 #include "volume.h"
+#include "node.h"
 #include "assert.h"
 
 #pragma mark - Core Data Structures
@@ -51,6 +53,28 @@ extern struct vnodeopv_desc         lustre_vnodeop_opv_desc;
 
 #pragma mark - Helpers
 
+static int lustre_vfsop_sync_vnode(vnode_t vnode, void * data)
+{
+    if (vnode_isreg(vnode)) {
+        (void)cluster_push(vnode, 0);
+    }
+    
+    return VNODE_RETURNED;
+}
+
+static int lustre_vfsop_sync_vnode_wait(vnode_t vnode, void * data)
+{
+    struct lustre_volume * volume;
+    
+    volume = (struct lustre_volume *)data;
+    
+    if (vnode_isreg(vnode)) {
+        lustre_writeback_flush(volume->writeback, lustre_node_peek(vnode), vnode);
+    }
+    
+    return VNODE_RETURNED;
+}
+
 // Returns the root vnode for the volume, creating it if necessary.  The resulting vnode has a I/O reference count, which the caller is responsible for releasing (using vnode_put) or passing along to its caller.
 static errno_t lustre_vfsop_get_root_vnode_creating_if_necessary(struct lustre_volume * volume, vnode_t * vnode)
 {
@@ -109,14 +133,14 @@ static errno_t lustre_vfsop_get_root_vnode_creating_if_necessary(struct lustre_v
             params.vnfs_vtype      = VDIR;
             params.vnfs_str        = NULL;
             params.vnfs_dvp        = NULL;
-            params.vnfs_fsnode     = NULL;
+            params.vnfs_fsnode     = volume->root_node;
             params.vnfs_vops       = vnode_operations;
             params.vnfs_markroot   = TRUE;
             params.vnfs_marksystem = FALSE;
             params.vnfs_rdev       = 0;                                 // we don't currently support VBLK or VCHR
             params.vnfs_filesize   = 0;                                 // not relevant for a directory
             params.vnfs_cnp        = NULL;
-            params.vnfs_flags      = VNFS_NOCACHE | VNFS_CANTCACHE;     // do no vnode name caching
+            params.vnfs_flags      = 0;                                 // names under the root are cached, see lustre_vnop_lookup
             
             error = vnode_create(VNCREATE_FLAVOR, sizeof(params), &params, &new_vn);
             
@@ -132,6 +156,7 @@ static errno_t lustre_vfsop_get_root_vnode_creating_if_necessary(struct lustre_v
                 
                 LUSTRE_BUG_ON(volume->root_vnode);
                 volume->root_vnode = new_vn;
+                lustre_node_attach(volume->root_node, new_vn);
                 
                 // Also let the VFS layer know that we have a soft reference to
                 // the vnode.
@@ -467,17 +492,27 @@ errno_t lustre_vfsop_getattr(mount_t mp, struct vfs_attr * attr, vfs_context_t c
     return 0;
 }
 
-// After receiving this calldown, a filesystem will be hooked into the mount list and should expect calls down from the VFS layer.
-//
-// Marks a mount as ready to be used.
+// Called by VFS to write back everything dirty on the volume: by <x-man-page://2/sync>, periodically by the update daemon, and before
+// an unmount.
 //
 // mp is a reference to the kernel structure tracking this instance of the file system.
 //
-// flags are ununsed
+// flags is MNT_WAIT to wait for the writes, MNT_NOWAIT to only start them.
 //
 // context identifies the calling process.
 //
+// Errors stay with their files, for fsync and close to report.
 errno_t lustre_vfsop_sync(struct mount *mp, int flags, vfs_context_t context)
 {
+    struct lustre_volume *  volume;
+    
+    // Pre-conditions
+    
+    LUSTRE_BUG_ON(!mp);
+    
+    volume = lustre_volume_peek(mp);
+    
+    (void)vnode_iterate(mp, 0, (flags & MNT_WAIT) ? lustre_vfsop_sync_vnode_wait : lustre_vfsop_sync_vnode, volume);
+    
     return 0;
 }
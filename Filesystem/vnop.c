@@ -33,18 +33,37 @@
 #include <sys/dirent.h>
 #include <sys/proc.h>
 #include <sys/fcntl.h>
+#include <sys/buf.h>
+#include <sys/ubc.h>
+#include <sys/uio.h>
+#include <sys/fsctl.h>
+#include <kern/clock.h>
 
 #include "lustre.h"
 #include "mount.h"
 #include "volume.h"
+#include "vfsop.h"
+#include "node.h"
+#include "mdc.h"
+#include "dirplus.h"
+#include "statahead.h"
+#include "readahead.h"
+#include "writeback.h"
+#include "opencache.h"
+#include "xattr.h"
+#include "flock.h"
+#include "probe.h"
+#include "search.h"
+#include "layout.h"
+#include "io.h"
 #include "assert.h"
 #include "extensions.h"
 #include "logging.h"
 
 extern int (**vnode_operations)(void *);
 
-// Called by higher-level code within our VFS plug-in to reclaim a vnode, that is, for us to 'forget' about it.  We only 'know' about one vnode,
-// the root vnode, so this code is much easier than it would be in a real file system.
+// Called by higher-level code within our VFS plug-in to reclaim the root vnode, that is, for us to 'forget' about it.  Every other vnode
+// belongs to a node in the volume's node table and is reclaimed through lustre_node_reclaim.
 static void lustre_mount_detach_root_vnode(struct lustre_volume * volume, vnode_t vn)
 {
     LUSTRE_BUG_ON(!volume);
@@ -80,14 +99,199 @@ static void lustre_mount_detach_root_vnode(struct lustre_volume * volume, vnode_
     lck_mtx_unlock(volume->root_lock);
 }
 
+static const uint32_t   kLustreVnopAttrListEntryMin         = 64;               // smallest likely getattrlistbulk record, to size batches
+
+// Returns the attributes VFS asks of every object we know about.
+static void lustre_vnop_vattr_return(struct lustre_volume * volume, struct vnode_attr * vap, const struct lustre_node_attr * attr)
+{
+    VATTR_RETURN(vap, va_rdev,          attr->rdev);
+    VATTR_RETURN(vap, va_nlink,         attr->nlink);
+    VATTR_RETURN(vap, va_data_size,     attr->size);
+    VATTR_RETURN(vap, va_total_alloc,   attr->blocks * 512);
+    VATTR_RETURN(vap, va_uid,           lustre_volume_uid_from_owner_identity(volume, attr->owner));
+    VATTR_RETURN(vap, va_gid,           lustre_volume_gid_from_group_identity(volume, attr->group));
+    VATTR_RETURN(vap, va_mode,          (mode_t)attr->mode);
+    VATTR_RETURN(vap, va_access_time,   attr->access_time);
+    VATTR_RETURN(vap, va_modify_time,   attr->modify_time);
+    VATTR_RETURN(vap, va_change_time,   attr->change_time);
+}
+
+static uint64_t lustre_vnop_fileid(struct lustre_volume * volume, const struct lu_fid * fid)
+{
+    return lustre_volume_is_root_fid(volume, fid) ? 2 : lustre_node_fileid(fid);
+}
+
+// Fetches the node's attributes afresh.  Asked for a regular file's size (or blocks, or modify time), this is a glimpse of its objects,
+// along with a getattr on the MDT as on open unless the rest of the attributes are still good; otherwise one getattr on the MDT does.
+static errno_t lustre_vnop_getattr_refresh(struct lustre_volume * volume, struct lustre_node * node, boolean_t size)
+{
+    struct lustre_import *      import;
+    struct lustre_node_attr     attr;
+    struct mdt_body             body;
+    errno_t                     error;
+    
+    if (size && (node->type == VREG)) {
+        if (lustre_node_attr_is_valid(node, FALSE)) {
+            return lustre_io_glimpse(volume, node);
+        }
+        return lustre_io_refresh(volume, node);
+    }
+    
+    error = lustre_volume_fid_import(volume, &node->fid, &import);
+    if (error != 0) {
+        return error;
+    }
+    
+    error = lustre_mdc_getattr(import, &node->fid, &body);
+    lustre_import_ref_count_dec(import);
+    if (error != 0) {
+        return error;
+    }
+    
+    lustre_node_attr_from_body(&attr, &body);
+    lustre_node_set_attr(node, &attr);
+    
+    return 0;
+}
+
+// Gets what reading a directory needs: its page cache, with a reference, the import that serves it and the generation to read the cache
+// at.  The generation is taken before we make sure of the UPDATE lock, so a revoke in between stops what we read from being kept.  If the
+// server won't grant the lock the cache is invalidated, which leaves the pages read now for this call only.
+static errno_t lustre_vnop_dir_prepare(struct lustre_volume * volume, struct lustre_node * node, struct lustre_dir ** dir, struct lustre_import ** import, uint32_t * generation)
+{
+    struct lustre_dlm_lock *    lock;
+    errno_t                     error;
+    
+    *import = NULL;
+    
+    *dir = lustre_node_dir(node);
+    if (!*dir) {
+        return ENOMEM;
+    }
+    
+    error = lustre_volume_fid_import(volume, &node->fid, import);
+    if (error != 0) {
+        goto end;
+    }
+    
+    *generation = lustre_dir_generation(*dir);
+    
+    if (!lustre_node_has_update_lock(node)) {
+        error = lustre_mdc_update_lock(*import, volume->dlm, &node->fid, &lock);
+        if (error != 0) {
+            goto end;
+        }
+        if (!lock || !lustre_node_set_update_lock(node, lock, NULL)) {
+            lustre_dir_invalidate(*dir);
+        }
+    }
+    
+end:
+    if (error != 0) {
+        if (*import) {
+            lustre_import_ref_count_dec(*import);
+            *import = NULL;
+        }
+        lustre_dir_ref_count_dec(*dir);
+        *dir = NULL;
+    }
+    
+    return error;
+}
+
+// Notes the probe kinds a directory has as it's walked.
+static errno_t lustre_vnop_probe_entry(const struct lustre_dir_entry * entry, void * data)
+{
+    uint32_t * seen;
+    
+    seen    = (uint32_t *)data;
+    *seen   |= lustre_probe_from_name(entry->name, entry->namelen);
+    
+    return 0;
+}
+
+// Returns TRUE if a probe name of kind probe is known to be missing from the directory, without asking the MDT for it by name.  Unless
+// the mount's policy settles it, the answer is in the kinds the directory is known to lack; failing that, a small directory we hold the
+// UPDATE lock on is read whole, usually from the page cache Finder has just filled by listing it, which answers this probe and every other
+// one to come.
+static boolean_t lustre_vnop_probe_is_absent(struct lustre_volume * volume, struct lustre_node * dnode, uint32_t probe)
+{
+    struct lustre_dir *         dir;
+    struct lustre_import *      import;
+    struct lustre_node_attr     attr;
+    uint32_t                    generation;
+    uint32_t                    seen;
+    uint64_t                    hash;
+    errno_t                     error;
+    
+    switch (volume->mount_args.probes) {
+        case kLustreMountProbesLookup:
+            return FALSE;
+        case kLustreMountProbesAbsent:
+            return TRUE;
+        default:
+            break;
+    }
+    
+    if (lustre_node_probes_absent(dnode, probe)) {
+        return TRUE;
+    }
+    
+    attr = lustre_node_get_attr(dnode);
+    if (attr.size > kLustreProbeScanMax) {
+        return FALSE;
+    }
+    
+    error = lustre_vnop_dir_prepare(volume, dnode, &dir, &import, &generation);
+    if (error != 0) {
+        return FALSE;
+    }
+    
+    // What a scan finds is only remembered under the UPDATE lock.  Without it every probe would read the directory over again, which
+    // costs more than the lookup it saves.
+    
+    seen = 0;
+    if (!lustre_node_has_update_lock(dnode)) {
+        error = ENOLCK;
+        goto end;
+    }
+    
+    hash    = 0;
+    error   = lustre_dir_walk(dir, import, &dnode->fid, generation, &hash, lustre_vnop_probe_entry, &seen);
+    if (error == 0) {
+        lustre_node_set_probes_absent(dnode, lustre_probe_from_scan(seen), generation);
+    }
+    
+end:
+    lustre_import_ref_count_dec(import);
+    lustre_dir_ref_count_dec(dir);
+    
+    return (error == 0) && !(seen & probe);
+}
+
+// Called by VFS to look a name up in a directory.
+//
+// Names are looked up with a getattr intent, so one RPC brings back the child's attributes along with a lock on its name.  As long as
+// the server lets us keep that lock the name stays in the name cache, and so does a name the server said doesn't exist, for as long as
+// we hold the directory's UPDATE lock.  Either way, asking again costs no RPC until someone changes the directory.  Names Finder and
+// Spotlight probe for in every directory (.DS_Store, ._ files and so on) needn't cost one the first time either; see probe.h.
 errno_t lustre_vnop_lookup(struct vnop_lookup_args * ap)
 {
-    errno_t                 error;
-    vnode_t                 dvp;
-    vnode_t *               vpp;
-    struct componentname *  cnp;
-    vfs_context_t           context;
-    vnode_t                 vn;
+    errno_t                     error;
+    vnode_t                     dvp;
+    vnode_t *                   vpp;
+    struct componentname *      cnp;
+    vfs_context_t               context;
+    vnode_t                     vn;
+    struct lustre_volume *      volume;
+    struct lustre_node *        dnode;
+    struct lustre_import *      import;
+    struct lustre_dlm_lock *    lock;
+    struct lustre_statahead *   statahead;
+    struct mdt_body             body;
+    struct lustre_node_attr     attr;
+    uint32_t                    probe;
+    boolean_t                   negative;
     
     // Unpack arguments
     
@@ -106,20 +310,40 @@ errno_t lustre_vnop_lookup(struct vnop_lookup_args * ap)
     
     // Prepare for failure.
     
-    vn = NULL;
+    vn      = NULL;
+    import  = NULL;
+    lock    = NULL;
+    volume  = lustre_volume_peek(vnode_mount(dvp));
+    dnode   = lustre_node_peek(dvp);
+    
+    // cache_lookup returns -1 with an I/O reference on a hit, ENOENT for a name cached as missing and 0 on a miss.
+    
+    error = cache_lookup(dvp, &vn, cnp);
+    if (error == -1) {
+        error = 0;
+        goto end;
+    }
+    if (error == ENOENT) {
+        goto end;
+    }
     
-    // Trivial implementation
+    vn = NULL;
     
     if (cnp->cn_flags & ISDOTDOT) {
-        // Implement lookup for ".." (that is, the parent directory).  As we currently
-        // only support one directory (the root directory) and the parent of the root
-        // is always the root, this is trivial (and, incidentally, exactly the same
-        // as the code for ".", but that wouldn't be true in a more general VFS plug-in).
-        // We just get an I/O reference on dvp and return that.
+        // The parent of the root is the root.  Otherwise VFS usually knows the parent already, and we only ask the server when it doesn't.
         
-        error = vnode_get(dvp);
-        if (error == 0) {
-            vn = dvp;
+        if (vnode_isvroot(dvp)) {
+            error = vnode_get(dvp);
+            if (error == 0) {
+                vn = dvp;
+            }
+            goto end;
+        }
+        
+        vn = vnode_getparent(dvp);
+        if (vn) {
+            error = 0;
+            goto end;
         }
     } else if ( (cnp->cn_namelen == 1) && (cnp->cn_nameptr[0] == '.') ) {
         // Implement lookup for "." (that is, this directory).  Just get an I/O reference
@@ -129,8 +353,66 @@ errno_t lustre_vnop_lookup(struct vnop_lookup_args * ap)
         if (error == 0) {
             vn = dvp;
         }
+        goto end;
+    } else if (cnp->cn_nameiop == LOOKUP) {
+        // A probe for a name that's nearly never there.  One about to be made is always asked about.
+        
+        probe = lustre_probe_from_name(cnp->cn_nameptr, cnp->cn_namelen);
+        if ((probe != 0) && lustre_vnop_probe_is_absent(volume, dnode, probe)) {
+            error = ENOENT;
+            goto end;
+        }
+    }
+    
+    error = lustre_volume_fid_import(volume, &dnode->fid, &import);
+    if (error != 0) {
+        goto end;
+    }
+    
+    // A lookup in listing order may already have been sent by statahead.
+    
+    statahead = (cnp->cn_flags & ISDOTDOT) ? NULL : lustre_node_statahead(dnode, FALSE);
+    if (!statahead || !lustre_statahead_lookup(statahead, volume, dnode, import, cnp->cn_nameptr, cnp->cn_namelen, &error, &body, &lock)) {
+        error = lustre_mdc_lookup(import, volume->dlm, &dnode->fid, cnp->cn_nameptr, cnp->cn_namelen, &body, &lock);
+    }
+    
+    if (error == ENOENT) {
+        // The lock we got back, if any, is the directory's UPDATE lock.  There's no point caching a name that's about to be created.
+        
+        negative = (cnp->cn_nameiop != CREATE) && (cnp->cn_nameiop != RENAME);
+        if (lock) {
+            (void)lustre_node_set_update_lock(dnode, lock, negative ? cnp : NULL);
+            lock = NULL;
+        }
+        goto end;
+    }
+    if (error != 0) {
+        goto end;
+    }
+    
+    lustre_node_attr_from_body(&attr, &body);
+    
+    if (lustre_volume_is_root_fid(volume, &body.mbo_fid1)) {
+        lustre_node_set_attr(volume->root_node, &attr);
+        error = lustre_vfsop_root(vnode_mount(dvp), &vn, context);
     } else {
-        error = ENOENT;
+        error = lustre_node_vnode_get(volume, &body.mbo_fid1, &attr, dvp, cnp, &vn);
+    }
+    
+    // ".." isn't kept in the name cache; VFS tracks parents itself.
+    
+    if ((error == 0) && lock) {
+        (void)lustre_node_set_lookup_lock(lustre_node_peek(vn), lock, (cnp->cn_flags & ISDOTDOT) ? NULL : dvp, cnp);
+        lock = NULL;
+    }
+    
+end:
+    if (lock) {
+        lustre_dlm_lock_cancel(lock);
+        lustre_dlm_lock_ref_count_dec(lock);
+    }
+    if (import) {
+        lustre_import_ref_count_dec(import);
     }
     
     // Under all circumstances we set *vpp to vn.  That way, we satisfy the
@@ -156,12 +438,20 @@ errno_t lustre_vnop_lookup(struct vnop_lookup_args * ap)
 //
 // This entry is rarely useful because VFS can read a file vnode without ever opening it, thus any work that you'd usually do here you have to do lazily in your read/write entry points.
 //
-// Regardless, in our implementation we have nothing to do.
+// For regular files we fetch the layout and current size here, and drop cached pages if the file changed since they were read, so each
+// open sees what other clients wrote before it.  Reads fetch the layout lazily if there was no open.  The MDT open handle comes from the
+// volume's open cache, which only asks the MDT when it doesn't already hold one for this file and mode.  When it does ask, the reply
+// has the attributes and layout in it, and for a small file kept on the MDT its data too, so there's nothing more to fetch.
 errno_t lustre_vnop_open(struct vnop_open_args * ap)
 {
-    vnode_t         vp;
-    int             mode;
-    vfs_context_t   context;
+    vnode_t                         vp;
+    int                             mode;
+    vfs_context_t                   context;
+    struct lustre_volume *          volume;
+    struct lustre_node *            node;
+    struct lustre_mdc_open_reply    reply;
+    boolean_t                       fresh;
+    errno_t                         error;
     
     // Unpack arguments
     
@@ -173,11 +463,29 @@ errno_t lustre_vnop_open(struct vnop_open_args * ap)
     
     LUSTRE_BUG_ON(!context);
     
-    // Empty implementation
+    if (!vnode_isreg(vp)) {
+        return 0;
+    }
     
-    LUSTRE_BUG_ON(!vnode_isdir(vp));
+    volume  = lustre_volume_peek(vnode_mount(vp));
+    node    = lustre_node_peek(vp);
     
-    return 0;
+    error = lustre_open_cache_open(volume->open_cache, &node->fid, mode, &reply, &fresh);
+    if (error != 0) {
+        return error;
+    }
+    
+    if (fresh) {
+        error = lustre_io_opened(volume, node, vp, &reply);
+        lustre_mdc_open_reply_release(&reply, volume->malloc_tag);
+    } else {
+        error = lustre_io_revalidate(volume, node, vp);
+    }
+    if (error != 0) {
+        lustre_open_cache_close(volume->open_cache, &node->fid, mode);
+    }
+    
+    return error;
 }
 
 // Called by VFS to close a vnode for access.
@@ -191,12 +499,18 @@ errno_t lustre_vnop_open(struct vnop_open_args * ap)
 // This entry is not as useful as you might think because a vnode can be accessed after the last close (if, for example, if has been memory mapped).  In most cases
 // the work that you might think to do here, you end up doing in lustre_vnop_inactive.
 //
-// Regardless, in our implementation we have nothing to do.
+// A file that was open for writing has its dirty data written back, so that whoever opens it next, here or on another client, sees it
+// (close-to-open consistency), and so that any write that failed in the background is reported to someone.  One open for reading gives
+// back the readahead budget the file holds.  The open handle goes back to the open cache, which keeps it for the next open if it can.
 errno_t lustre_vnop_close(struct vnop_close_args * ap)
 {
-    vnode_t         vp;
-    int             fflag;
-    vfs_context_t   context;
+    vnode_t                     vp;
+    int                         fflag;
+    vfs_context_t               context;
+    struct lustre_volume *      volume;
+    struct lustre_node *        node;
+    struct lustre_readahead *   readahead;
+    errno_t                     error;
     
     // Unpack arguments
     
@@ -208,11 +522,28 @@ errno_t lustre_vnop_close(struct vnop_close_args * ap)
     
     LUSTRE_BUG_ON(!context);
     
-    // Empty implementation
+    if (!vnode_isreg(vp)) {
+        return 0;
+    }
     
-    LUSTRE_BUG_ON(!vnode_isdir(vp));
+    volume  = lustre_volume_peek(vnode_mount(vp));
+    node    = lustre_node_peek(vp);
+    error   = 0;
     
-    return 0;
+    if (fflag & FWRITE) {
+        error = lustre_writeback_sync(volume->writeback, node, vp);
+    }
+    
+    if (fflag & FREAD) {
+        readahead = lustre_node_readahead(node, FALSE);
+        if (readahead) {
+            lustre_readahead_close(readahead);
+        }
+    }
+    
+    lustre_open_cache_close(volume->open_cache, &node->fid, fflag);
+    
+    return error;
 }
 
 // Called by VFS to get information about a vnode (this is called by the VFS implementation of <x-man-page://2/stat> and <x-man-page://2/getattrlist>).
@@ -232,13 +563,22 @@ errno_t lustre_vnop_close(struct vnop_close_args * ap)
 //   if the caller requested the attribute and, if so, copy the value into the
 //   appropriate field.
 //
-// Our implementation is trivial; we just return statically configured values.
+// We return the node's cached attributes while they're valid (see lustre_node_attr_is_valid), which costs no RPC, and fetch them again
+// when they're not.  A file we hold dirty data for is its own authority on size and modify time: our writes are the latest we know of,
+// and the OSTs haven't seen them all yet, so there's no glimpse for those.
 errno_t lustre_vnop_getattr(struct vnop_getattr_args * ap)
 {
     vnode_t                 vp;
     struct vnode_attr *     vap;
     vfs_context_t           context;
     struct lustre_volume *  volume;
+    struct lustre_node *    node;
+    struct lustre_node_attr attr;
+    struct lustre_layout *  layout;
+    struct lustre_xattr *   xattr;
+    uint32_t                iosize;
+    boolean_t               size;
+    errno_t                 error;
     
     // Unpack arguments
     
@@ -251,158 +591,1255 @@ errno_t lustre_vnop_getattr(struct vnop_getattr_args * ap)
     LUSTRE_BUG_ON(!vap);
     LUSTRE_BUG_ON(!context);
     
-    // Trivial implementation
+    volume  = lustre_volume_peek(vnode_mount(vp));
+    node    = lustre_node_peek(vp);
     
-    LUSTRE_BUG_ON(!vnode_isdir(vp));
+    size = VATTR_IS_ACTIVE(vap, va_data_size) || VATTR_IS_ACTIVE(vap, va_total_size) || VATTR_IS_ACTIVE(vap, va_data_alloc) ||
+           VATTR_IS_ACTIVE(vap, va_total_alloc) || VATTR_IS_ACTIVE(vap, va_modify_time);
+    
+    // Whoever looks at a file's attributes for the first time (Finder, ls -l) usually asks for its extended attributes next, so they're
+    // fetched now, alongside any refresh below, rather than one name at a time later.
+    
+    if (!lustre_node_xattr(node, FALSE)) {
+        xattr = lustre_node_xattr(node, TRUE);
+        if (xattr) {
+            lustre_xattr_prefetch(xattr);
+        }
+    }
+    
+    if (!lustre_node_attr_is_valid(node, size)) {
+        if (!size || (node->type != VREG) || !lustre_writeback_is_dirty(volume->writeback, node) || !lustre_node_attr_is_valid(node, FALSE)) {
+            error = lustre_vnop_getattr_refresh(volume, node, size);
+            if (error != 0) {
+                return error;
+            }
+        }
+    }
     
-    volume = vfs_fsprivate(vnode_mount(vp));
-
-    VATTR_RETURN(vap, va_rdev,          0);
-    VATTR_RETURN(vap, va_nlink,         2);           // traditional for directories
-    VATTR_RETURN(vap, va_data_size,     2 * sizeof(struct dirent));
-    VATTR_RETURN(vap, va_uid,           kLustreFilesystemNobodyOwnerId);
-    VATTR_RETURN(vap, va_gid,           kLustreFilesystemNobodyGroupId);
-    VATTR_RETURN(vap, va_mode,          S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
-    VATTR_RETURN(vap, va_create_time,   volume->create_time);
-    VATTR_RETURN(vap, va_access_time,   volume->access_time);
-    VATTR_RETURN(vap, va_modify_time,   volume->modify_time);
-    VATTR_RETURN(vap, va_backup_time,   volume->backup_time);
-    VATTR_RETURN(vap, va_fileid,        2);
+    attr = lustre_node_get_attr(node);
+
+    lustre_vnop_vattr_return(volume, vap, &attr);
+    VATTR_RETURN(vap, va_fileid,        lustre_vnop_fileid(volume, &node->fid));
     VATTR_RETURN(vap, va_fsid,          lustre_volume_fsid(volume).val[0]);
     
+    // A file reads best a stripe at a time, so that's its preferred I/O size.
+    
+    iosize = lustre_volume_block_size(volume);
+    if (node->type == VREG) {
+        layout = lustre_node_layout(node);
+        if (layout) {
+            if (layout->stripe_size != 0) {
+                iosize = layout->stripe_size;
+            }
+            lustre_layout_ref_count_dec(layout);
+        }
+    }
+    VATTR_RETURN(vap, va_iosize,        iosize);
+    
     return 0;
 }
 
-errno_t lustre_vnop_read_dir(struct vnop_readdir_args * ap)
+// Called by VFS to read an extended attribute (this is called by the VFS implementation of <x-man-page://2/getxattr>).
+//
+// vp is the file.
+//
+// name is the attribute's name.
+//
+// uio receives its value, or is NULL, in which case size receives its length instead.
+//
+// options are XATTR_* flags, none of which matter to us.
+//
+// context identifies the calling process.
+//
+// Answers come from the node's extended attribute cache, which holds every attribute the file has, so a name it doesn't have costs no
+// RPC either.
+errno_t lustre_vnop_getxattr(struct vnop_getxattr_args * ap)
 {
-    errno_t         error;
-    vnode_t         vp;
-    struct uio *    uio;
-    int             flags;
-    int *           eofflagPtr;
-    int             eofflag;
-    int *           numdirentPtr;
-    int             numdirent;
-    vfs_context_t   context;
+    vnode_t                 vp;
+    const char *            name;
+    uio_t                   uio;
+    size_t *                size;
+    vfs_context_t           context;
+    struct lustre_xattr *   xattr;
     
     // Unpack arguments
     
-    vp           = ap->a_vp;
-    uio          = ap->a_uio;
-    flags        = ap->a_flags;
-    eofflagPtr   = ap->a_eofflag;
-    numdirentPtr = ap->a_numdirent;
-    context      = ap->a_context;
+    vp      = ap->a_vp;
+    name    = ap->a_name;
+    uio     = ap->a_uio;
+    size    = ap->a_size;
+    context = ap->a_context;
     
     // Pre-conditions
     
-    LUSTRE_BUG_ON(!uio);
+    LUSTRE_BUG_ON(!name);
     LUSTRE_BUG_ON(!context);
     
-    // An easy, but non-trivial, implementation
+    xattr = lustre_node_xattr(lustre_node_peek(vp), TRUE);
+    if (!xattr) {
+        return ENOMEM;
+    }
     
-    LUSTRE_BUG_ON(!vnode_isdir(vp));
+    return lustre_xattr_get(xattr, name, uio, size);
+}
+
+// Called by VFS to list a file's extended attributes (this is called by the VFS implementation of <x-man-page://2/listxattr>).
+//
+// vp is the file.
+//
+// uio receives the names, each terminated, or is NULL, in which case size receives the length of the list instead.
+//
+// options are XATTR_* flags, none of which matter to us.
+//
+// context identifies the calling process.
+errno_t lustre_vnop_listxattr(struct vnop_listxattr_args * ap)
+{
+    vnode_t                 vp;
+    uio_t                   uio;
+    size_t *                size;
+    vfs_context_t           context;
+    struct lustre_xattr *   xattr;
     
-    eofflag = FALSE;
-    numdirent = 0;
+    // Unpack arguments
     
-    if ((flags & VNODE_READDIR_EXTENDED) || (flags & VNODE_READDIR_REQSEEKOFF)) {
-        // We only need to support these flags if we want to support being exported by NFS.
-        error = EINVAL;
-    } else {
-        struct dirent   thisItem;
-        off_t           index;
-        
-        error = 0;
-        
-        // Set up thisItem.
-        
-        thisItem.d_fileno = 2;
-        thisItem.d_reclen = sizeof(thisItem);
-        thisItem.d_type = DT_DIR;
-        strncpy(thisItem.d_name, ".", 1);
-        thisItem.d_namlen = strlen(".");
-        
-        // We set uio_offset to the directory item index * 7 to:
-        //
-        // o Illustrate the points about uio_offset usage in the comment above.
-        //
-        // o Allow us to check that we're getting valid input.
-        //
-        // However, be aware of the comments above about not trusting uio_offset;
-        // the client can set it to an arbitrary value using lseek.
-        
-        LUSTRE_BUG_ON((uio_offset(uio) % 7) != 0);
-        
-        index = uio_offset(uio) / 7;
-        
-        // If we're being asked for the first directory entry...
-        
-        if (index == 0) {
-            error = lustre_extension_uio_move(&thisItem, sizeof(thisItem), uio);
-            if (error == 0) {
-                numdirent += 1;
-                index += 1;
-            }
-        }
-        
-        // If we're being asked for the second directory entry...
-        
-        if ((error == 0) && (index == 1)) {
-            strncpy(thisItem.d_name, "..", 2);
-            thisItem.d_namlen = strlen("..");
-            error = lustre_extension_uio_move(&thisItem, sizeof(thisItem), uio);
-            if (error == 0) {
-                numdirent += 1;
-                index += 1;
-            }
-        }
-        
-        // If we failed because there wasn't enough space in the user's buffer,
-        // just swallow the error.  This will result getdirentries returning
-        // less than the buffer size (possibly even zero), and the caller is
-        // expected to cope with that.
-        
-        if (error == ENOBUFS) {
-            error = 0;
-        }
-        
-        // Update uio_offset.
-        
-        uio_setoffset(uio, index * 7);
-        
-        // Determine if we're at the end of the directory.
-        
-        eofflag = (index > 1);
-    }
+    vp      = ap->a_vp;
+    uio     = ap->a_uio;
+    size    = ap->a_size;
+    context = ap->a_context;
     
-    // Copy out any information that's requested by the caller.
+    // Pre-conditions
     
-    if (eofflagPtr != NULL) {
-        *eofflagPtr = eofflag;
+    LUSTRE_BUG_ON(!context);
+    
+    xattr = lustre_node_xattr(lustre_node_peek(vp), TRUE);
+    if (!xattr) {
+        return ENOMEM;
     }
-    if (numdirentPtr != NULL) {
-        *numdirentPtr = numdirent;
+    
+    return lustre_xattr_list(xattr, uio, size);
+}
+
+// Called by VFS to set an extended attribute (this is called by the VFS implementation of <x-man-page://2/setxattr>).
+//
+// vp is the file.
+//
+// name is the attribute's name.
+//
+// uio holds its new value.
+//
+// options may include XATTR_CREATE or XATTR_REPLACE.
+//
+// context identifies the calling process.
+errno_t lustre_vnop_setxattr(struct vnop_setxattr_args * ap)
+{
+    vnode_t                 vp;
+    const char *            name;
+    uio_t                   uio;
+    int                     options;
+    vfs_context_t           context;
+    struct lustre_xattr *   xattr;
+    
+    // Unpack arguments
+    
+    vp      = ap->a_vp;
+    name    = ap->a_name;
+    uio     = ap->a_uio;
+    options = ap->a_options;
+    context = ap->a_context;
+    
+    // Pre-conditions
+    
+    LUSTRE_BUG_ON(!name);
+    LUSTRE_BUG_ON(!uio);
+    LUSTRE_BUG_ON(!context);
+    
+    xattr = lustre_node_xattr(lustre_node_peek(vp), TRUE);
+    if (!xattr) {
+        return ENOMEM;
     }
     
-    return error;
+    return lustre_xattr_set(xattr, name, uio, options);
 }
 
-errno_t lustre_vnop_reclaim(struct vnop_reclaim_args * ap)
+// Called by VFS to remove an extended attribute (this is called by the VFS implementation of <x-man-page://2/removexattr>).
+//
+// vp is the file.
+//
+// name is the attribute's name.
+//
+// context identifies the calling process.
+errno_t lustre_vnop_removexattr(struct vnop_removexattr_args * ap)
 {
-    vnode_t                 vnode;
-    vfs_context_t       	context;
-    struct lustre_volume *  volume;
+    vnode_t                 vp;
+    const char *            name;
+    vfs_context_t           context;
+    struct lustre_xattr *   xattr;
     
-    vnode       = ap->a_vp;
-    context     = ap->a_context;
+    // Unpack arguments
     
-    LUSTRE_BUG_ON(!vnode);
+    vp      = ap->a_vp;
+    name    = ap->a_name;
+    context = ap->a_context;
+    
+    // Pre-conditions
+    
+    LUSTRE_BUG_ON(!name);
     LUSTRE_BUG_ON(!context);
     
-    volume  = vfs_fsprivate(vnode_mount(vnode));
+    xattr = lustre_node_xattr(lustre_node_peek(vp), TRUE);
+    if (!xattr) {
+        return ENOMEM;
+    }
     
-    lustre_mount_detach_root_vnode(volume, vnode);
+    return lustre_xattr_remove(xattr, name);
+}
+
+// Called by VFS to read a directory's entries.
+//
+// uio_offset is a cookie made from the hash of the next entry, not a byte offset, so any value a caller got back from an earlier read
+// (or a direntry's d_seekoff) resumes there without reading the entries before it.  Pages come from the directory's page cache, which
+// stays valid for as long as we hold the directory's UPDATE lock.
+errno_t lustre_vnop_read_dir(struct vnop_readdir_args * ap)
+{
+    errno_t                     error;
+    vnode_t                     vp;
+    struct uio *                uio;
+    int                         flags;
+    int *                       eofflagPtr;
+    int                         eofflag;
+    int *                       numdirentPtr;
+    int                         numdirent;
+    vfs_context_t               context;
+    struct lustre_volume *      volume;
+    struct lustre_node *        node;
+    struct lustre_dir *         dir;
+    struct lustre_import *      import;
+    struct lustre_statahead *   statahead;
+    uint32_t                    generation;
+    
+    // Unpack arguments
+    
+    vp           = ap->a_vp;
+    uio          = ap->a_uio;
+    flags        = ap->a_flags;
+    eofflagPtr   = ap->a_eofflag;
+    numdirentPtr = ap->a_numdirent;
+    context      = ap->a_context;
+    
+    // Pre-conditions
+    
+    LUSTRE_BUG_ON(!uio);
+    LUSTRE_BUG_ON(!context);
+    LUSTRE_BUG_ON(!vnode_isdir(vp));
+    
+    eofflag     = FALSE;
+    numdirent   = 0;
+    dir         = NULL;
+    import      = NULL;
+    volume      = lustre_volume_peek(vnode_mount(vp));
+    node        = lustre_node_peek(vp);
+    
+    // Our cookies need all 64 bits.
+    
+    if (flags & VNODE_READDIR_SEEKOFF32) {
+        error = EINVAL;
+        goto end;
+    }
+    
+    error = lustre_vnop_dir_prepare(volume, node, &dir, &import, &generation);
+    if (error != 0) {
+        goto end;
+    }
+    
+    // A listing starting from the top may be followed by a lookup of each entry, which statahead watches for.
+    
+    if (uio_offset(uio) == 0) {
+        statahead = lustre_node_statahead(node, TRUE);
+        if (statahead) {
+            lustre_statahead_listed(statahead, 0);
+        }
+    }
+    
+    error = lustre_dir_read(dir, import, &node->fid, &volume->root_fid, generation, uio, flags, &eofflag, &numdirent);
+    
+end:
+    if (import) {
+        lustre_import_ref_count_dec(import);
+    }
+    if (dir) {
+        lustre_dir_ref_count_dec(dir);
+    }
+    
+    // Copy out any information that's requested by the caller.
+    
+    if (eofflagPtr != NULL) {
+        *eofflagPtr = eofflag;
+    }
+    if (numdirentPtr != NULL) {
+        *numdirentPtr = numdirent;
+    }
+    
+    return error;
+}
+
+// Called by VFS to read a directory's entries together with their attributes (this is how <x-man-page://2/getattrlistbulk> gets here).
+//
+// As for readdir, uio_offset is a cookie made from the hash of the next entry.  A batch of entries is gathered first, sized to what the
+// caller's buffer is likely to hold, and all their attributes are fetched at once, so listing a directory costs a round trip per batch
+// rather than one per entry.  Entries are then packed with vfs_attr_pack until the buffer is full.
+errno_t lustre_vnop_getattrlistbulk(struct vnop_getattrlistbulk_args * ap)
+{
+    errno_t                         error;
+    vnode_t                         vp;
+    struct attrlist *               alist;
+    struct vnode_attr *             vap;
+    struct uio *                    uio;
+    uint64_t                        options;
+    int32_t *                       eofflagPtr;
+    int32_t                         eofflag;
+    int32_t *                       actualcountPtr;
+    int32_t                         actualcount;
+    vfs_context_t                   context;
+    struct lustre_volume *          volume;
+    struct lustre_node *            node;
+    struct lustre_dir *             dir;
+    struct lustre_import *          import;
+    struct lustre_dirplus *         dirplus;
+    struct lustre_dirplus_entry *   entry;
+    uint32_t                        generation;
+    uint64_t                        hash;
+    uint64_t                        active;
+    char *                          name;
+    uint32_t                        max;
+    uint32_t                        i;
+    
+    // Unpack arguments
+    
+    vp              = ap->a_vp;
+    alist           = ap->a_alist;
+    vap             = ap->a_vap;
+    uio             = ap->a_uio;
+    options         = ap->a_options;
+    eofflagPtr      = ap->a_eofflag;
+    actualcountPtr  = ap->a_actualcount;
+    context         = ap->a_context;
+    
+    // Pre-conditions
+    
+    LUSTRE_BUG_ON(!alist);
+    LUSTRE_BUG_ON(!vap);
+    LUSTRE_BUG_ON(!uio);
+    LUSTRE_BUG_ON(!context);
+    LUSTRE_BUG_ON(!vnode_isdir(vp));
+    
+    eofflag     = FALSE;
+    actualcount = 0;
+    dir         = NULL;
+    import      = NULL;
+    dirplus     = NULL;
+    volume      = lustre_volume_peek(vnode_mount(vp));
+    node        = lustre_node_peek(vp);
+    hash        = lustre_dir_hash_from_cookie(uio_offset(uio));
+    active      = vap->va_active;
+    name        = vap->va_name;
+    
+    error = lustre_vnop_dir_prepare(volume, node, &dir, &import, &generation);
+    if (error != 0) {
+        goto end;
+    }
+    
+    max = (uint32_t)(uio_resid(uio) / kLustreVnopAttrListEntryMin);
+    if (max == 0) {
+        max = 1;
+    }
+    
+    error = lustre_dirplus_read(volume, dir, import, &node->fid, generation, hash, max, &dirplus);
+    if (error != 0) {
+        goto end;
+    }
+    
+    hash = dirplus->hash;
+    
+    for (i=0; i<dirplus->count; i++) {
+        entry = &dirplus->entries[i];
+        
+        // Each entry starts from what the caller asked for; vfs_attr_pack only looks at what we mark supported.
+        
+        vap->va_active      = active;
+        vap->va_supported   = 0;
+        
+        if (VATTR_IS_ACTIVE(vap, va_name) && name) {
+            strlcpy(name, entry->name, MAXPATHLEN);
+            VATTR_SET_SUPPORTED(vap, va_name);
+        }
+        
+        // An entry we couldn't get attributes for still gets its name and identity, rather than failing the whole listing.
+        
+        if (entry->error == 0) {
+            lustre_vnop_vattr_return(volume, vap, &entry->attr);
+            VATTR_RETURN(vap, va_objtype,   lustre_node_vtype(entry->attr.mode));
+        } else {
+            VATTR_RETURN(vap, va_objtype,   lustre_node_vtype(DTTOIF(entry->type)));
+        }
+        VATTR_RETURN(vap, va_fileid,        lustre_vnop_fileid(volume, &entry->fid));
+        VATTR_RETURN(vap, va_parentid,      lustre_vnop_fileid(volume, &node->fid));
+        VATTR_RETURN(vap, va_fsid,          lustre_volume_fsid(volume).val[0]);
+        
+        error = vfs_attr_pack(NULL, uio, alist, options, vap, NULL, context);
+        if (error != 0) {
+            hash = entry->hash;
+            break;
+        }
+        
+        actualcount += 1;
+    }
+    
+    // Running out of room ends this call; the next one resumes at the entry that didn't fit.  Only when not even one fitted does the caller
+    // need to hear about it, since an empty result would otherwise read as the end of the directory.
+    
+    if ((error == ENOBUFS) && (actualcount > 0)) {
+        error = 0;
+    }
+    
+    if (error == 0) {
+        uio_setoffset(uio, lustre_dir_cookie_from_hash(hash));
+        eofflag = (hash == kLustreDirHashEnd);
+    }
+    
+end:
+    vap->va_active = active;
+    
+    if (dirplus) {
+        lustre_dirplus_free(dirplus);
+    }
+    if (import) {
+        lustre_import_ref_count_dec(import);
+    }
+    if (dir) {
+        lustre_dir_ref_count_dec(dir);
+    }
+    
+    // Copy out any information that's requested by the caller.
+    
+    if (eofflagPtr != NULL) {
+        *eofflagPtr = eofflag;
+    }
+    if (actualcountPtr != NULL) {
+        *actualcountPtr = actualcount;
+    }
+    
+    return error;
+}
+
+// What packing a searchfs match needs.
+struct lustre_vnop_search_pack {
+    struct lustre_volume *          volume;
+    struct attrlist *               alist;
+    struct uio *                    uio;
+    vfs_context_t                   context;
+    struct vnode_attr *             vap;
+    char *                          name;                   // MAXPATHLEN bytes, for va_name
+};
+
+// Packs one match as getattrlist would, with what the directory page and its batch of getattrs told us.
+static errno_t lustre_vnop_search_pack(const struct lu_fid * parent, const struct lustre_dirplus_entry * entry, void * data)
+{
+    struct lustre_vnop_search_pack *    pack;
+    struct vnode_attr *                 vap;
+    
+    pack    = (struct lustre_vnop_search_pack *)data;
+    vap     = pack->vap;
+    
+    VATTR_INIT(vap);
+    
+    vap->va_name = pack->name;
+    strlcpy(pack->name, entry->name, MAXPATHLEN);
+    VATTR_SET_SUPPORTED(vap, va_name);
+    
+    lustre_vnop_vattr_return(pack->volume, vap, &entry->attr);
+    VATTR_RETURN(vap, va_objtype,   lustre_node_vtype(entry->attr.mode));
+    VATTR_RETURN(vap, va_fileid,    lustre_vnop_fileid(pack->volume, &entry->fid));
+    VATTR_RETURN(vap, va_parentid,  lustre_vnop_fileid(pack->volume, parent));
+    VATTR_RETURN(vap, va_fsid,      lustre_volume_fsid(pack->volume).val[0]);
+    
+    // vfs_attr_pack works out what the attribute list wants and packs whatever of that we have.
+    
+    vap->va_active = vap->va_supported;
+    
+    return vfs_attr_pack(NULL, pack->uio, pack->alist, 0, vap, NULL, pack->context);
+}
+
+// Called by VFS to search the volume by name and attributes (this is how <x-man-page://2/searchfs> gets here).
+//
+// The whole volume is searched whatever vp is, as searchfs promises.  Matching is done here against readdir-plus batches, see search.h,
+// and matches are packed into uio as getattrlist would pack them.  A call returns when uio is full, maxmatches are found or timelimit
+// runs out, with EAGAIN if there's more to come; the searchstate it leaves names the search for the next call to carry on with.
+errno_t lustre_vnop_searchfs(struct vnop_searchfs_args * ap)
+{
+    errno_t                             error;
+    vnode_t                             vp;
+    void *                              params1;
+    void *                              params2;
+    struct attrlist *                   searchattrs;
+    uint32_t                            maxmatches;
+    struct timeval *                    timelimit;
+    struct attrlist *                   returnattrs;
+    uint32_t *                          nummatchesPtr;
+    uint32_t                            nummatches;
+    uint32_t                            options;
+    struct uio *                        uio;
+    struct searchstate *                searchstate;
+    vfs_context_t                       context;
+    struct lustre_volume *              volume;
+    struct lustre_search_criteria *     criteria;
+    struct lustre_search_state *        state;
+    struct lustre_search *              search;
+    struct lustre_vnop_search_pack      pack;
+    struct vnode_attr                   va;
+    uint64_t                            deadline;
+    uint64_t                            interval;
+    boolean_t                           finished;
+    
+    // Unpack arguments
+    
+    vp              = ap->a_vp;
+    params1         = ap->a_searchparams1;
+    params2         = ap->a_searchparams2;
+    searchattrs     = ap->a_searchattrs;
+    maxmatches      = ap->a_maxmatches;
+    timelimit       = ap->a_timelimit;
+    returnattrs     = ap->a_returnattrs;
+    nummatchesPtr   = ap->a_nummatches;
+    options         = ap->a_options;
+    uio             = ap->a_uio;
+    searchstate     = ap->a_searchstate;
+    context         = ap->a_context;
+    
+    // Pre-conditions
+    
+    LUSTRE_BUG_ON(!searchattrs);
+    LUSTRE_BUG_ON(!returnattrs);
+    LUSTRE_BUG_ON(!uio);
+    LUSTRE_BUG_ON(!searchstate);
+    LUSTRE_BUG_ON(!context);
+    
+    nummatches  = 0;
+    finished    = FALSE;
+    search      = NULL;
+    volume      = lustre_volume_peek(vnode_mount(vp));
+    state       = (struct lustre_search_state *)searchstate->ss_fsstate;
+    
+    criteria = OSMalloc(sizeof(struct lustre_search_criteria), volume->malloc_tag);
+    pack.name = OSMalloc(MAXPATHLEN, volume->malloc_tag);
+    if (!criteria || !pack.name) {
+        error = ENOMEM;
+        goto end;
+    }
+    
+    if (maxmatches == 0) {
+        error = EINVAL;
+        goto end;
+    }
+    
+    error = lustre_search_criteria_parse(params1, params2, searchattrs, options, proc_is64bit(vfs_context_proc(context)), criteria);
+    if (error != 0) {
+        goto end;
+    }
+    
+    if (options & SRCHFS_START) {
+        bzero(searchstate, sizeof(struct searchstate));
+        error = lustre_search_start(volume->searches, &volume->root_fid, &search);
+    } else if (state->magic == kLustreSearchStateMagic) {
+        error = lustre_search_resume(volume->searches, state->id, &search);
+    } else {
+        error = EINVAL;
+    }
+    if (error != 0) {
+        goto end;
+    }
+    
+    deadline = UINT64_MAX;
+    if (timelimit) {
+        interval = (uint64_t)timelimit->tv_sec * USEC_PER_SEC + (uint64_t)timelimit->tv_usec;
+        clock_interval_to_deadline((uint32_t)MIN(interval, UINT32_MAX), kMicrosecondScale, &deadline);
+    }
+    
+    pack.volume     = volume;
+    pack.alist      = returnattrs;
+    pack.uio        = uio;
+    pack.context    = context;
+    pack.vap        = &va;
+    
+    error = lustre_search_run(search, criteria, vfs_context_ucred(context), deadline, maxmatches, lustre_vnop_search_pack, &pack, &nummatches, &finished);
+    
+    state->magic    = kLustreSearchStateMagic;
+    state->id       = search->id;
+    
+    // A search that went wrong isn't kept; one that ran out of room is, in case the caller tries again with more.
+    
+    lustre_search_release(search, finished || ((error != 0) && (error != ENOBUFS)));
+    
+    if ((error == 0) && !finished) {
+        error = EAGAIN;
+    }
+    
+end:
+    if (pack.name) {
+        OSFree(pack.name, MAXPATHLEN, volume->malloc_tag);
+    }
+    if (criteria) {
+        OSFree(criteria, sizeof(struct lustre_search_criteria), volume->malloc_tag);
+    }
+    
+    // Copy out any information that's requested by the caller.
+    
+    if (nummatchesPtr != NULL) {
+        *nummatchesPtr = nummatches;
+    }
+    
+    return error;
+}
+
+// Called by VFS to read from a regular file.
+//
+// vp is the file to read from.
+//
+// uio describes the range to read and where the data goes.
+//
+// ioflag contains the flags passed to read (things like IO_NOCACHE).
+//
+// context identifies the calling process.
+//
+// Reads go through the UBC: the cluster layer finds what's already cached and reads the rest, a cluster at a time and ahead of a
+// sequential reader, through lustre_vnop_strategy.  Clusters are sized from the filesystem's stripe width, see lustre_volume_cluster_size.
+// Direct reads (see lustre_io_is_direct) go from the OSTs into the caller's buffer; anything we still hold dirty is written out first.
+errno_t lustre_vnop_read(struct vnop_read_args * ap)
+{
+    vnode_t                     vp;
+    struct uio *                uio;
+    int                         ioflag;
+    vfs_context_t               context;
+    struct lustre_volume *      volume;
+    struct lustre_node *        node;
+    struct lustre_layout *      layout;
+    struct lustre_readahead *   readahead;
+    struct lustre_node_attr     attr;
+    errno_t                     error;
+    
+    // Unpack arguments
+    
+    vp      = ap->a_vp;
+    uio     = ap->a_uio;
+    ioflag  = ap->a_ioflag;
+    context = ap->a_context;
+    
+    // Pre-conditions
+    
+    LUSTRE_BUG_ON(!uio);
+    LUSTRE_BUG_ON(!context);
+    
+    if (vnode_isdir(vp)) {
+        return EISDIR;
+    }
+    if (!vnode_isreg(vp)) {
+        return EPERM;
+    }
+    if (uio_offset(uio) < 0) {
+        return EINVAL;
+    }
+    if (uio_resid(uio) == 0) {
+        return 0;
+    }
+    
+    volume  = lustre_volume_peek(vnode_mount(vp));
+    node    = lustre_node_peek(vp);
+    
+    // Read without being opened (by the kernel, say): get the layout and size the way open would have.
+    
+    layout = lustre_node_layout(node);
+    if (!layout) {
+        error = lustre_io_revalidate(volume, node, vp);
+        if (error != 0) {
+            return error;
+        }
+        layout = lustre_node_layout(node);
+    }
+    
+    if (lustre_io_is_direct(uio, ioflag)) {
+        ioflag |= IO_NOCACHE;
+        if (lustre_writeback_is_dirty(volume->writeback, node)) {
+            lustre_writeback_flush(volume->writeback, node, vp);
+        }
+    }
+    
+    // A sparse file's holes are read as zeroes without asking the OSTs for them (see lustre_vnop_blockmap).  Without the maps the holes
+    // are just read, so failing to get them doesn't fail the read.
+    
+    if (layout && (layout->object_count > 0)) {
+        (void)lustre_io_extents(volume, node);
+    }
+    
+    attr = lustre_node_get_attr(node);
+    
+    // Our readahead knows the stripes and tells interleaved and strided readers apart, so the cluster layer's is turned off when it runs.
+    
+    if (layout && (layout->object_count > 0) && !(ioflag & IO_NOCACHE)) {
+        readahead = lustre_node_readahead(node, TRUE);
+        if (readahead) {
+            lustre_readahead_read(readahead, vp, layout, (uint64_t)uio_offset(uio), (uint32_t)MIN(uio_resid(uio), UINT32_MAX), attr.size);
+            ioflag |= IO_RAOFF;
+        }
+    }
+    if (layout) {
+        lustre_layout_ref_count_dec(layout);
+    }
+    
+    return cluster_read(vp, uio, (off_t)attr.size, ioflag);
+}
+
+// Called by VFS to write to a regular file.
+//
+// vp is the file to write to.
+//
+// uio describes the data and where in the file it goes.
+//
+// ioflag contains the flags passed to write (things like IO_APPEND and IO_SYNC).
+//
+// context identifies the calling process.
+//
+// Writes go into the UBC through the cluster layer and reach the OSTs later, through lustre_vnop_strategy (see writeback.h).  A write the
+// OSTs haven't granted us space for is made synchronous, so that running out of space fails the write itself.  Direct writes (see
+// lustre_io_is_direct) go from the caller's buffer to the OSTs before returning, after anything older we hold dirty for the file, so
+// that nothing older can land on top of them; the cluster layer's buffered head and tail are pushed out after them.
+errno_t lustre_vnop_write(struct vnop_write_args * ap)
+{
+    vnode_t                              vp;
+    struct uio *                         uio;
+    int                                  ioflag;
+    vfs_context_t                        context;
+    struct lustre_volume *               volume;
+    struct lustre_node *                 node;
+    struct lustre_layout *               layout;
+    struct lustre_node_attr              attr;
+    off_t                                offset;
+    user_ssize_t                         resid;
+    user_ssize_t                         written;
+    struct lustre_writeback_reservation  reservation;
+    boolean_t                            reserved;
+    boolean_t                            direct;
+    errno_t                              error;
+    
+    // Unpack arguments
+    
+    vp      = ap->a_vp;
+    uio     = ap->a_uio;
+    ioflag  = ap->a_ioflag;
+    context = ap->a_context;
+    
+    // Pre-conditions
+    
+    LUSTRE_BUG_ON(!uio);
+    LUSTRE_BUG_ON(!context);
+    
+    if (vnode_isdir(vp)) {
+        return EISDIR;
+    }
+    if (!vnode_isreg(vp)) {
+        return EPERM;
+    }
+    
+    volume  = lustre_volume_peek(vnode_mount(vp));
+    node    = lustre_node_peek(vp);
+    
+    layout = lustre_node_layout(node);
+    if (!layout) {
+        error = lustre_io_revalidate(volume, node, vp);
+        if (error != 0) {
+            return error;
+        }
+        layout = lustre_node_layout(node);
+    }
+    
+    // A file without objects would need the MDT to instantiate its layout first, unless it keeps its data on the MDT.
+    
+    if (!layout || ((layout->object_count == 0) && (layout->dom_size == 0))) {
+        error = ENOTSUP;
+        goto end;
+    }
+    
+    attr = lustre_node_get_attr(node);
+    
+    if (ioflag & IO_APPEND) {
+        uio_setoffset(uio, (off_t)attr.size);
+    }
+    
+    offset  = uio_offset(uio);
+    resid   = uio_resid(uio);
+    
+    if (offset < 0) {
+        error = EINVAL;
+        goto end;
+    }
+    if (resid == 0) {
+        error = 0;
+        goto end;
+    }
+    
+    // Growing past the MDT's part of the file would likewise need objects.  What stays within it is written through to the MDT, one RPC
+    // per write: there's no grant to hold it dirty against, and the writeback only knows how to gather writes for OST objects.
+    
+    direct      = FALSE;
+    reserved    = FALSE;
+    if (layout->object_count == 0) {
+        if ((uint64_t)(offset + resid) > layout->dom_size) {
+            error = ENOTSUP;
+            goto end;
+        }
+        ioflag |= IO_SYNC;
+    } else {
+        direct = lustre_io_is_direct(uio, ioflag);
+    }
+    if (direct) {
+        ioflag |= IO_NOCACHE;
+        if (lustre_writeback_is_dirty(volume->writeback, node)) {
+            lustre_writeback_flush(volume->writeback, node, vp);
+        }
+    } else if (!(ioflag & IO_SYNC)) {
+        reserved = lustre_writeback_reserve(volume->writeback, layout, vp, (uint64_t)offset, (uint64_t)resid, &reservation);
+        if (!reserved) {
+            ioflag |= IO_SYNC;
+        }
+    }
+    if (!direct && !(ioflag & IO_SYNC)) {
+        lustre_writeback_throttle(volume->writeback, node, vp);
+    }
+    
+    error = cluster_write(vp, uio, (off_t)attr.size, MAX((off_t)attr.size, offset + resid), 0, 0, ioflag);
+    
+    written = resid - uio_resid(uio);
+    
+    // Grant taken for the part cluster_write didn't copy in would never come back with a flush.
+    
+    if (reserved && (written < resid)) {
+        lustre_writeback_unreserve(volume->writeback, layout, &reservation, (uint64_t)(offset + MAX(written, 0)));
+    }
+    if (written > 0) {
+        lustre_node_written(node, (uint64_t)(offset + written));
+        if (offset + written > (off_t)attr.size) {
+            (void)ubc_setsize(vp, offset + written);
+        }
+        if (!direct && !(ioflag & IO_SYNC)) {
+            lustre_writeback_dirtied(volume->writeback, node, (uint64_t)written);
+        }
+    }
+    if (direct && (error == 0)) {
+        error = lustre_writeback_sync(volume->writeback, node, vp);
+    }
+    
+end:
+    if (layout) {
+        lustre_layout_ref_count_dec(layout);
+    }
+    
+    return error;
+}
+
+// Called by VFS to get a file's data onto stable storage (this is called by the VFS implementation of <x-man-page://2/fsync>).
+//
+// vp is the file.
+//
+// waitfor says whether to wait (MNT_WAIT) or just start the writes (MNT_NOWAIT).
+//
+// context identifies the calling process.
+//
+// We always wait, since fsync has to report any write that failed in the background, and only the writeback knows about those.
+errno_t lustre_vnop_fsync(struct vnop_fsync_args * ap)
+{
+    vnode_t                 vp;
+    vfs_context_t           context;
+    struct lustre_volume *  volume;
+    
+    // Unpack arguments
+    
+    vp      = ap->a_vp;
+    context = ap->a_context;
+    
+    // Pre-conditions
+    
+    LUSTRE_BUG_ON(!context);
+    
+    if (!vnode_isreg(vp)) {
+        return 0;
+    }
+    
+    volume = lustre_volume_peek(vnode_mount(vp));
+    
+    return lustre_writeback_sync(volume->writeback, lustre_node_peek(vp), vp);
+}
+
+// Called by VFS for an ioctl on a file (this is called by the VFS implementation of <x-man-page://2/ioctl>, and of
+// <x-man-page://2/lseek> for SEEK_HOLE and SEEK_DATA).
+//
+// command is the ioctl and data its argument, already copied in.
+//
+// We answer FSIOC_FIOSEEKHOLE and FSIOC_FIOSEEKDATA, whose argument is the offset to seek from and receives the answer, from the file's
+// extent maps (see lustre_io_seek); anything else isn't ours.
+errno_t lustre_vnop_ioctl(struct vnop_ioctl_args * ap)
+{
+    vnode_t                 vp;
+    u_long                  command;
+    caddr_t                 data;
+    vfs_context_t           context;
+    struct lustre_volume *  volume;
+    
+    // Unpack arguments
+    
+    vp      = ap->a_vp;
+    command = ap->a_command;
+    data    = ap->a_data;
+    context = ap->a_context;
+    
+    // Pre-conditions
+    
+    LUSTRE_BUG_ON(!context);
+    
+    if ((command != FSIOC_FIOSEEKHOLE) && (command != FSIOC_FIOSEEKDATA)) {
+        return ENOTTY;
+    }
+    if (!vnode_isreg(vp)) {
+        return EINVAL;
+    }
+    
+    volume = lustre_volume_peek(vnode_mount(vp));
+    
+    return lustre_io_seek(volume, lustre_node_peek(vp), vp, command == FSIOC_FIOSEEKHOLE, (off_t *)data);
+}
+
+// Called by VFS to take, drop or test an advisory lock on a file (this is called by the VFS implementation of <x-man-page://2/fcntl> for
+// F_SETLK, F_SETLKW and F_GETLK, of <x-man-page://2/flock>, and of <x-man-page://2/close>, which drops what the owner held).
+//
+// id is the lock's owner: the process for fcntl locks (F_POSIX in flags), the open file for flock ones (F_FLOCK in flags).
+//
+// op is F_SETLK, F_UNLCK or F_GETLK, and fl describes the lock; a flock lock covers the whole file whatever fl says.
+//
+// flags has F_WAIT if a lock somebody is in the way of should wait for them rather than fail.
+//
+// The MDT arbitrates between clients, but each file keeps what its local owners hold, so re-taking a held lock and dropping one that
+// isn't held are answered here (see lustre_flocks_set).
+errno_t lustre_vnop_advlock(struct vnop_advlock_args * ap)
+{
+    vnode_t                 vp;
+    caddr_t                 id;
+    int                     op;
+    struct flock *          fl;
+    int                     flags;
+    struct lustre_volume *  volume;
+    struct lustre_node *    node;
+    struct lustre_flocks *  flocks;
+    uint64_t                owner;
+    uint64_t                size;
+    uint64_t                start;
+    uint64_t                end;
+    errno_t                 error;
+    
+    // Unpack arguments
+    
+    vp      = ap->a_vp;
+    id      = ap->a_id;
+    op      = ap->a_op;
+    fl      = ap->a_fl;
+    flags   = ap->a_flags;
+    
+    // Pre-conditions
+    
+    LUSTRE_BUG_ON(!fl);
+    
+    if (!vnode_isreg(vp)) {
+        return EINVAL;
+    }
+    
+    volume  = lustre_volume_peek(vnode_mount(vp));
+    node    = lustre_node_peek(vp);
+    
+    // A file nobody has locked has no table, and nothing to unlock.
+    
+    flocks = lustre_node_flocks(node, op != F_UNLCK);
+    if (!flocks) {
+        return (op == F_UNLCK) ? 0 : ENOMEM;
+    }
+    
+    owner = lustre_flocks_owner(flocks, id);
+    
+    if (flags & F_FLOCK) {
+        start   = 0;
+        end     = kLustreFlockEOF;
+    } else {
+        size = 0;
+        if (fl->l_whence == SEEK_END) {
+            error = lustre_io_glimpse(volume, node);
+            if (error != 0) {
+                return error;
+            }
+            size = lustre_node_get_attr(node).size;
+        }
+        
+        error = lustre_flocks_range(fl, size, &start, &end);
+        if (error != 0) {
+            return error;
+        }
+    }
+    
+    switch (op) {
+        case F_SETLK:
+            return lustre_flocks_set(flocks, owner, proc_selfpid(), fl->l_type, start, end, (flags & F_WAIT) != 0);
+        case F_UNLCK:
+            return lustre_flocks_set(flocks, owner, proc_selfpid(), F_UNLCK, start, end, FALSE);
+        case F_GETLK:
+            return lustre_flocks_get(flocks, owner, proc_selfpid(), fl, start, end);
+        default:
+            return EINVAL;
+    }
+}
+
+// Called by VFS when a file is mapped into memory (this is called by the VFS implementation of <x-man-page://2/mmap>).
+//
+// vp is the file.
+//
+// fflags contains the protection the mapping was made with (PROT_READ and so on).
+//
+// context identifies the calling process.
+//
+// Page faults need the layout and an up to date size; a file mapped without being read or written first gets them here, as open would.
+errno_t lustre_vnop_mmap(struct vnop_mmap_args * ap)
+{
+    vnode_t                 vp;
+    vfs_context_t           context;
+    struct lustre_volume *  volume;
+    struct lustre_node *    node;
+    struct lustre_layout *  layout;
+    
+    // Unpack arguments
+    
+    vp      = ap->a_vp;
+    context = ap->a_context;
+    
+    // Pre-conditions
+    
+    LUSTRE_BUG_ON(!context);
+    
+    if (!vnode_isreg(vp)) {
+        return EPERM;
+    }
+    
+    volume  = lustre_volume_peek(vnode_mount(vp));
+    node    = lustre_node_peek(vp);
+    
+    layout = lustre_node_layout(node);
+    if (layout) {
+        lustre_layout_ref_count_dec(layout);
+        return 0;
+    }
+    
+    return lustre_io_revalidate(volume, node, vp);
+}
+
+// Called by the VM to read pages of a file in, on a page fault on a mapping of it.
+//
+// vp is the file.
+//
+// pl is NULL, as we register for version 2 pageins (VFS_TBLVNOP_PAGEINV2): we make our own UPL, for the pages and those around them.
+// Were one given, pl_offset would be where in it the pages start.  f_offset is their offset in the file and size how much to read.
+//
+// flags contains UPL_* flags, such as UPL_IOSYNC.
+//
+// lustre_io_pagein reads whole stripes, and ahead of sequential faults.
+errno_t lustre_vnop_pagein(struct vnop_pagein_args * ap)
+{
+    vnode_t                 vp;
+    struct lustre_volume *  volume;
+    struct lustre_node *    node;
+    struct lustre_layout *  layout;
+    struct lustre_node_attr attr;
+    errno_t                 error;
+    
+    // Unpack arguments
+    
+    vp      = ap->a_vp;
+    
+    // Pre-conditions
+    
+    LUSTRE_BUG_ON(ap->a_size == 0);
+    
+    volume  = lustre_volume_peek(vnode_mount(vp));
+    node    = lustre_node_peek(vp);
+    attr    = lustre_node_get_attr(node);
+    
+    if (ap->a_pl) {
+        return cluster_pagein(vp, ap->a_pl, ap->a_pl_offset, ap->a_f_offset, (int)ap->a_size, (off_t)attr.size, ap->a_flags);
+    }
+    
+    layout = lustre_node_layout(node);
+    
+    error = lustre_io_pagein(node, vp, layout, ap->a_f_offset, ap->a_size, (off_t)attr.size, ap->a_flags);
+    
+    if (layout) {
+        lustre_layout_ref_count_dec(layout);
+    }
+    
+    return error;
+}
+
+// Called by the VM to write dirty pages of a file back, when it wants the memory or for msync.
+//
+// vp is the file.
+//
+// pl is the UPL holding the pages, pl_offset where in it they start, f_offset their offset in the file and size how much to write.
+//
+// flags contains UPL_* flags, such as UPL_NOCOMMIT.
+//
+// The cluster layer turns the pages into bufs for lustre_vnop_strategy, which gathers them into RPCs with everything else being written
+// (see lustre_io_strategy).
+errno_t lustre_vnop_pageout(struct vnop_pageout_args * ap)
+{
+    vnode_t                 vp;
+    struct lustre_node_attr attr;
+    
+    // Unpack arguments
+    
+    vp      = ap->a_vp;
+    
+    // Pre-conditions
+    
+    LUSTRE_BUG_ON(!ap->a_pl);
+    
+    attr = lustre_node_get_attr(lustre_node_peek(vp));
+    
+    return cluster_pageout(vp, ap->a_pl, ap->a_pl_offset, ap->a_f_offset, (int)ap->a_size, (off_t)attr.size, ap->a_flags);
+}
+
+// Called by the cluster layer to do I/O on a buf it has built.
+//
+// bp is the buf, whose block number came from lustre_vnop_blockmap.
+//
+// lustre_io_strategy sends reads to the file's objects and writes to the writeback, and completes the buf when they're all done.
+errno_t lustre_vnop_strategy(struct vnop_strategy_args * ap)
+{
+    buf_t                   bp;
+    vnode_t                 vp;
+    struct lustre_volume *  volume;
+    
+    // Unpack arguments
+    
+    bp      = ap->a_bp;
+    
+    // Pre-conditions
+    
+    LUSTRE_BUG_ON(!bp);
+    
+    vp      = buf_vnode(bp);
+    volume  = lustre_volume_peek(vnode_mount(vp));
+    
+    lustre_io_strategy(volume, lustre_node_peek(vp), bp);
+    
+    return 0;
+}
+
+// Called by the cluster layer to map a file range onto "disk" blocks.
+//
+// foffset and size describe the range, bpn receives the first block, run how many bytes from foffset are contiguous on disk and poff the
+// offset of foffset within the block.  flags says whether the range is to be read or written.
+//
+// We have no disk: a block number is just the file offset in kLustreIOBlockSize units, so any range maps in one contiguous run and
+// lustre_io_strategy turns the block number straight back into an offset.  The exception is a read of a hole the file's extent maps know
+// about (see lustre_io_hole): that maps to block -1, which the cluster layer fills with zeroes itself, and the run stops where the hole
+// does, or where the data does if the range starts with data.  Writes always map, holes or not.
+errno_t lustre_vnop_blockmap(struct vnop_blockmap_args * ap)
+{
+    vnode_t         vp;
+    off_t           foffset;
+    size_t          size;
+    daddr64_t *     bpn;
+    size_t *        run;
+    void *          poff;
+    int             flags;
+    uint64_t        length;
+    boolean_t       hole;
+    
+    // Unpack arguments
+    
+    vp      = ap->a_vp;
+    foffset = ap->a_foffset;
+    size    = ap->a_size;
+    bpn     = ap->a_bpn;
+    run     = ap->a_run;
+    poff    = ap->a_poff;
+    flags   = ap->a_flags;
+    
+    // Pre-conditions
+    
+    LUSTRE_BUG_ON(foffset < 0);
+    LUSTRE_BUG_ON((foffset % kLustreIOBlockSize) != 0);
+    
+    hole    = FALSE;
+    length  = size;
+    
+    if ((flags & VNODE_READ) && vnode_isreg(vp)) {
+        hole = lustre_io_hole(lustre_node_peek(vp), (uint64_t)foffset, size, &length);
+    }
+    
+    if (bpn) {
+        *bpn = hole ? (daddr64_t)-1 : (daddr64_t)(foffset / kLustreIOBlockSize);
+    }
+    if (run) {
+        *run = (size_t)length;
+    }
+    if (poff) {
+        *(int *)poff = 0;
+    }
+    
+    return 0;
+}
+
+// Called by VFS to turn a logical block number into a file offset; see lustre_vnop_blockmap.
+errno_t lustre_vnop_blktooff(struct vnop_blktooff_args * ap)
+{
+    *ap->a_offset = (off_t)ap->a_lblkno * kLustreIOBlockSize;
+    
+    return 0;
+}
+
+// Called by VFS to turn a file offset into a logical block number; see lustre_vnop_blockmap.
+errno_t lustre_vnop_offtoblk(struct vnop_offtoblk_args * ap)
+{
+    *ap->a_lblkno = (daddr64_t)(ap->a_offset / kLustreIOBlockSize);
+    
+    return 0;
+}
+
+errno_t lustre_vnop_reclaim(struct vnop_reclaim_args * ap)
+{
+    vnode_t                 vnode;
+    vfs_context_t       	context;
+    struct lustre_volume *  volume;
+    
+    vnode       = ap->a_vp;
+    context     = ap->a_context;
+    
+    LUSTRE_BUG_ON(!vnode);
+    LUSTRE_BUG_ON(!context);
+    
+    volume  = vfs_fsprivate(vnode_mount(vnode));
+    
+    if (vnode_isvroot(vnode)) {
+        lustre_mount_detach_root_vnode(volume, vnode);
+        lustre_node_detach(volume->root_node);
+        vnode_clearfsnode(vnode);
+    } else {
+        if (vnode_isreg(vnode)) {
+            lustre_writeback_forget(volume->writeback, lustre_node_peek(vnode));
+        }
+        lustre_node_reclaim(vnode);
+    }
     
     return 0;
 }
@@ -22,11 +22,29 @@
 #ifndef lustre_vnop_h
 #define lustre_vnop_h
 
+errno_t lustre_vnop_advlock(struct vnop_advlock_args *ap);
+errno_t lustre_vnop_blktooff(struct vnop_blktooff_args *ap);
+errno_t lustre_vnop_blockmap(struct vnop_blockmap_args *ap);
 errno_t lustre_vnop_close(struct vnop_close_args *ap);
+errno_t lustre_vnop_fsync(struct vnop_fsync_args *ap);
 errno_t lustre_vnop_getattr(struct vnop_getattr_args *ap);
+errno_t lustre_vnop_getattrlistbulk(struct vnop_getattrlistbulk_args *ap);
+errno_t lustre_vnop_getxattr(struct vnop_getxattr_args *ap);
+errno_t lustre_vnop_ioctl(struct vnop_ioctl_args *ap);
+errno_t lustre_vnop_listxattr(struct vnop_listxattr_args *ap);
 errno_t lustre_vnop_lookup(struct vnop_lookup_args *ap);
+errno_t lustre_vnop_mmap(struct vnop_mmap_args *ap);
+errno_t lustre_vnop_offtoblk(struct vnop_offtoblk_args *ap);
 errno_t lustre_vnop_open(struct vnop_open_args *ap);
+errno_t lustre_vnop_pagein(struct vnop_pagein_args *ap);
+errno_t lustre_vnop_pageout(struct vnop_pageout_args *ap);
+errno_t lustre_vnop_read(struct vnop_read_args *ap);
 errno_t lustre_vnop_read_dir(struct vnop_readdir_args *ap);
 errno_t lustre_vnop_reclaim(struct vnop_reclaim_args *ap);
+errno_t lustre_vnop_removexattr(struct vnop_removexattr_args *ap);
+errno_t lustre_vnop_searchfs(struct vnop_searchfs_args *ap);
+errno_t lustre_vnop_setxattr(struct vnop_setxattr_args *ap);
+errno_t lustre_vnop_strategy(struct vnop_strategy_args *ap);
+errno_t lustre_vnop_write(struct vnop_write_args *ap);
 
 #endif /* lustre_vnop_h */
@@ -22,74 +22,268 @@
 #include <libkern/OSAtomic.h>
 #include <libkern/libkern.h>
 #include <sys/buf.h>
+#include <sys/param.h>
+#include <sys/random.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <string.h>
 
 #include "volume.h"
+#include "config.h"
+#include "network.h"
+#include "request.h"
+#include "mdc.h"
+#include "layout.h"
+#include "io.h"
+#include "sysctl.h"
 #include "logging.h"
 #include "assert.h"
 #include "constants.h"
 
 extern char * itoa(int, char *);
 
+static const uint32_t   kLustreVolumeRootMDTIndex           = 0;
+
+static volatile SInt32  lustre_volume_next_number           = 0;        // only used to give each volume's tag and lock group a unique name
+
 #pragma mark - Internal Functions
 
+// An import lost its connection, and with it every lock its target granted; whatever was cached under them goes before it reconnects.
+static void lustre_volume_import_evicted(struct lustre_import * import, void * data)
+{
+    struct lustre_volume * volume;
+    
+    volume = (struct lustre_volume *)data;
+    
+    lustre_dlm_namespace_revoke(volume->dlm, import);
+}
+
+// Called for each target as the config log is read.  The connect is only started here; nobody waits for it until the target is used.
+static void lustre_volume_config_target(const struct lustre_config_target * target, void * data)
+{
+    struct lustre_volume *          volume;
+    struct lustre_import *          import;
+    struct lustre_import_table *    table;
+    errno_t                         error;
+    
+    volume = (struct lustre_volume *)data;
+    
+    table = (target->type == kLustreImportTypeMDT) ? volume->mdt_imports : volume->ost_imports;
+    
+    import = lustre_import_alloc(volume->malloc_tag, volume->lock_group, target->type, target->index, target->target_uuid, volume->client_uuid, target->nid, kLustreImportDefaultPort);
+    if (!import) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate import for %{public}s", target->target_uuid);
+        return;
+    }
+    
+    lustre_import_set_evict(import, lustre_volume_import_evicted, volume);
+    
+    error = lustre_import_table_insert(table, import);
+    if (error == 0) {
+        (void)lustre_import_connect_async(import);
+    } else if (error != EEXIST) {
+        os_log_error(lustre_logger_vfs, "Couldn't add import for %{public}s, error %d", target->target_uuid, error);
+    }
+    
+    lustre_import_ref_count_dec(import);
+}
+
+static errno_t lustre_volume_import(struct lustre_import_table * table, uint32_t index, struct lustre_import ** import)
+{
+    struct lustre_import *  result;
+    errno_t                 error;
+    
+    result = lustre_import_table_lookup(table, index);
+    if (!result) {
+        error = ENXIO;
+        goto end;
+    }
+    
+    error = lustre_import_wait_connected(result);
+    if (error != 0) {
+        lustre_import_ref_count_dec(result);
+        result = NULL;
+        goto end;
+    }
+    
+end:
+    *import = result;
+    
+    return error;
+}
+
+// The root vnode is created lazily, but its node is set up here so the root's FID and attributes are known before anything asks for them.
+static errno_t lustre_volume_connect_root(struct lustre_volume * volume, struct lustre_import * import)
+{
+    struct mdt_body         body;
+    struct lustre_node_attr attr;
+    struct lustre_layout *  layout;
+    errno_t                 error;
+    
+    error = lustre_mdc_get_root(import, &volume->root_fid);
+    if (error != 0) {
+        return error;
+    }
+    
+    // The root's default layout, if it has one, says how new files are striped, which is what we size I/O by.  One we can't parse still
+    // leaves us the attributes.
+    
+    error = lustre_mdc_getattr_layout(import, &volume->root_fid, volume->malloc_tag, &body, &layout);
+    if (error == ENOTSUP) {
+        error = 0;
+    }
+    if (error != 0) {
+        return error;
+    }
+    
+    if (layout) {
+        lck_mtx_lock(volume->lock);
+        if (layout->stripe_size != 0) {
+            volume->block_size = layout->stripe_size;
+        }
+        if (layout->stripe_count != 0) {
+            volume->stripe_count = layout->stripe_count;
+        }
+        lck_mtx_unlock(volume->lock);
+        
+        lustre_layout_ref_count_dec(layout);
+    }
+    
+    lustre_node_attr_from_body(&attr, &body);
+    
+    volume->root_node = lustre_node_alloc(volume, &volume->root_fid, &attr);
+    if (!volume->root_node) {
+        return ENOMEM;
+    }
+    
+    return 0;
+}
+
 #pragma mark - External Functions
 
+// Each volume gets its own malloc tag and lock group so that mounts don't share allocator or lock statistics; everything a volume owns is
+// allocated from them.  Only the volume structure itself comes from the global tag.
 struct lustre_volume * lustre_volume_alloc(void)
 {
     struct lustre_volume *  volume;
+    char                    name[64];
     errno_t                 error;
     
     error = 0;
     
     volume = (struct lustre_volume *)OSMalloc(sizeof(struct lustre_volume), lustre_os_malloc_tag);
     if (!volume) {
-        error = ENOMEM;
         os_log_error(lustre_logger_default, "Couldn't allocate volume");
-        goto end;
+        return NULL;
     }
     
     bzero(volume, sizeof(struct lustre_volume));
     
     volume->ref_count = 1;
+    read_random(&volume->flock_salt, sizeof(volume->flock_salt));
+    
+    snprintf(name, sizeof(name), "com.ciderapps.lustre.Filesystem.volume.%d", (int)OSIncrementAtomic(&lustre_volume_next_number));
+    
+    volume->malloc_tag = OSMalloc_Tagalloc(name, OSMT_DEFAULT);
+    if (volume->malloc_tag == NULL) {
+        error = ENOMEM;
+        os_log_error(lustre_logger_default, "Couldn't allocate volume malloc tag");
+        goto end;
+    }
+    
+    volume->lock_group = lck_grp_alloc_init(name, LCK_GRP_ATTR_NULL);
+    if (volume->lock_group == NULL) {
+        error = ENOMEM;
+        os_log_error(lustre_logger_default, "Couldn't allocate volume lock group");
+        goto end;
+    }
     
-    volume->lock = lck_mtx_alloc_init(lustre_lock_group, NULL);
+    volume->lock = lck_mtx_alloc_init(volume->lock_group, NULL);
     if (volume->lock == NULL) {
         error = ENOMEM;
         os_log_error(lustre_logger_default, "Couldn't allocate volume lock");
         goto end;
     }
     
-    volume->root_lock = lck_mtx_alloc_init(lustre_lock_group, NULL);
+    volume->root_lock = lck_mtx_alloc_init(volume->lock_group, NULL);
     if (volume->root_lock == NULL) {
         error = ENOMEM;
         os_log_error(lustre_logger_default, "Couldn't allocate volume root lock");
         goto end;
     }
     
-    volume->stats_lock = lck_spin_alloc_init(lustre_lock_group, NULL);
+    volume->stats_lock = lck_spin_alloc_init(volume->lock_group, NULL);
     if (volume->stats_lock == NULL) {
         error = ENOMEM;
         os_log_error(lustre_logger_default, "Couldn't allocate volume stats lock");
         goto end;
     }
     
+    volume->readahead_lock = lck_mtx_alloc_init(volume->lock_group, NULL);
+    if (volume->readahead_lock == NULL) {
+        error = ENOMEM;
+        os_log_error(lustre_logger_default, "Couldn't allocate volume readahead lock");
+        goto end;
+    }
+    
+    volume->mdt_imports = lustre_import_table_alloc(volume->malloc_tag, volume->lock_group);
+    if (volume->mdt_imports == NULL) {
+        error = ENOMEM;
+        os_log_error(lustre_logger_default, "Couldn't allocate volume MDT imports");
+        goto end;
+    }
+    
+    volume->ost_imports = lustre_import_table_alloc(volume->malloc_tag, volume->lock_group);
+    if (volume->ost_imports == NULL) {
+        error = ENOMEM;
+        os_log_error(lustre_logger_default, "Couldn't allocate volume OST imports");
+        goto end;
+    }
+    
+    volume->dlm = lustre_dlm_namespace_alloc(volume->malloc_tag, volume->lock_group);
+    if (volume->dlm == NULL) {
+        error = ENOMEM;
+        os_log_error(lustre_logger_default, "Couldn't allocate volume lock namespace");
+        goto end;
+    }
+    error = lustre_network_namespace_add(volume->dlm);
+    if (error != 0) {
+        os_log_error(lustre_logger_default, "Couldn't register volume lock namespace");
+        goto end;
+    }
+    
+    volume->nodes = lustre_node_table_alloc(volume->malloc_tag, volume->lock_group);
+    if (volume->nodes == NULL) {
+        error = ENOMEM;
+        os_log_error(lustre_logger_default, "Couldn't allocate volume node table");
+        goto end;
+    }
+    
+    volume->writeback = lustre_writeback_alloc(volume);
+    if (volume->writeback == NULL) {
+        error = ENOMEM;
+        os_log_error(lustre_logger_default, "Couldn't allocate volume writeback");
+        goto end;
+    }
+    
+    volume->open_cache = lustre_open_cache_alloc(volume);
+    if (volume->open_cache == NULL) {
+        error = ENOMEM;
+        os_log_error(lustre_logger_default, "Couldn't allocate volume open cache");
+        goto end;
+    }
+    
+    volume->searches = lustre_searches_alloc(volume);
+    if (volume->searches == NULL) {
+        error = ENOMEM;
+        os_log_error(lustre_logger_default, "Couldn't allocate volume search table");
+        goto end;
+    }
+    
 end:
     if (error != 0) {
-        if (volume->stats_lock) {
-            lck_spin_free(volume->stats_lock, lustre_lock_group);
-        }
-        if (volume->root_lock) {
-            lck_mtx_free(volume->root_lock, lustre_lock_group);
-        }
-        if (volume->lock) {
-            lck_mtx_free(volume->lock, lustre_lock_group);
-        }
-        if (volume) {
-            OSFree(volume, sizeof(struct lustre_volume), lustre_os_malloc_tag);
-        }
+        volume->ref_count = 0;
+        lustre_volume_free(volume);
         volume = NULL;
     }
     
@@ -99,16 +293,61 @@ end:
 void lustre_volume_free(struct lustre_volume * volume)
 {
     LUSTRE_BUG_ON(!volume);
-    LUSTRE_BUG_ON(volume->ref_count == 0);
+    LUSTRE_BUG_ON(volume->ref_count != 0);
+    
+    lustre_sysctl_volume_remove(volume);
     
+    if (volume->searches) {
+        lustre_searches_free(volume->searches);
+    }
+    if (volume->open_cache) {
+        lustre_open_cache_free(volume->open_cache);
+    }
+    if (volume->writeback) {
+        lustre_writeback_free(volume->writeback);
+    }
+    if (volume->root_node) {
+        lustre_node_free(volume->root_node);
+    }
+    if (volume->nodes) {
+        lustre_node_table_free(volume->nodes);
+    }
+    if (volume->dlm) {
+        lustre_network_namespace_remove(volume->dlm);
+        lustre_dlm_namespace_free(volume->dlm);
+    }
+    if (volume->mgs_import) {
+        lustre_import_ref_count_dec(volume->mgs_import);
+    }
+    if (volume->ost_imports) {
+        lustre_import_table_free(volume->ost_imports);
+    }
+    if (volume->mdt_imports) {
+        lustre_import_table_free(volume->mdt_imports);
+    }
+    if (volume->readahead_lock) {
+        lck_mtx_free(volume->readahead_lock, volume->lock_group);
+    }
     if (volume->stats_lock) {
-        lck_spin_free(volume->stats_lock, lustre_lock_group);
+        lck_spin_free(volume->stats_lock, volume->lock_group);
     }
     if (volume->root_lock) {
-        lck_mtx_free(volume->root_lock, lustre_lock_group);
+        lck_mtx_free(volume->root_lock, volume->lock_group);
     }
+    if (volume->lock) {
+        lck_mtx_free(volume->lock, volume->lock_group);
+    }
+    
+    // Imports still referenced by in-flight requests keep allocations in the tag alive; OSMalloc_Tagfree defers the release until they're gone.
     
-    volume = NULL;
+    if (volume->lock_group) {
+        lck_grp_free(volume->lock_group);
+    }
+    if (volume->malloc_tag) {
+        OSMalloc_Tagfree(volume->malloc_tag);
+    }
+    
+    OSFree(volume, sizeof(struct lustre_volume), lustre_os_malloc_tag);
 }
 
 void lustre_volume_ref_count_inc(struct lustre_volume * volume)
@@ -126,7 +365,7 @@ void lustre_volume_ref_count_dec(struct lustre_volume * volume)
     
     count = OSDecrementAtomic(&volume->ref_count);
     
-    if (count == 0) {
+    if (count == 1) {
         lustre_volume_free(volume);
     }
 }
@@ -172,6 +411,7 @@ void lustre_volume_set_mount_args(struct lustre_volume * volume, struct lustre_m
     
     volume->mount_args = mount_args;
     strlcpy(volume->volume_name, mount_args.label, kLustreVolumeLabelSize);
+    snprintf(volume->url, sizeof(volume->url), "lustre://%s/%s", mount_args.host, mount_args.label);
     
     lck_mtx_unlock(volume->lock);
 }
@@ -183,20 +423,12 @@ mount_t lustre_volume_mount_point(const struct lustre_volume * volume)
     return volume->mount_point;
 }
 
+// Formatted once, when the mount arguments are set, and never changed afterwards.
 const char * lustre_volume_url(const struct lustre_volume * volume)
 {
-    static char url[9+8+1+kLustreMountArgsHostMax+1+MAXPATHLEN] = "?"; // lustre://user@host/path
-    
-    const char * identity;
-    
     LUSTRE_BUG_ON(!volume);
     
-    if (url[0] == '?') {
-        identity = (const char *)&volume->mount_args.identity;
-        snprintf(url, sizeof(url), "lustre://%s/%s", volume->mount_args.host, volume->mount_args.label);
-    }
-    
-    return url;
+    return volume->url;
 }
 
 errno_t lustre_volume_setup(struct lustre_volume * volume)
@@ -209,6 +441,7 @@ errno_t lustre_volume_setup(struct lustre_volume * volume)
     error = 0;
     
     uuid_generate(volume->uuid);
+    uuid_unparse_lower(volume->uuid, volume->client_uuid);
     nanotime(&now_spec);
     
     volume->fsid.val[0]     = *((uint32_t *)volume->uuid);
@@ -218,20 +451,151 @@ errno_t lustre_volume_setup(struct lustre_volume * volume)
     volume->access_time     = (struct timespec){ 0, 0 };
     volume->backup_time     = (struct timespec){ 0, 0 };
     volume->checked_time    = (struct timespec){ 0, 0 };
+    volume->block_size      = kLustreLayoutStripeSizeDefault;
+    volume->stripe_count    = 1;
 
     return error;
 }
 
 errno_t lustre_volume_teardown(struct lustre_volume * volume)
 {
-    errno_t error;
+    struct lustre_request_set * set;
+    errno_t                     error;
     
     LUSTRE_BUG_ON(!volume);
     
     error = 0;
     
+    // Handles kept open for reuse are closed while the MDTs can still hear about it.
+    
+    lustre_open_cache_purge(volume->open_cache);
+    
+    // Every target is told we're going, all at once, so it drops our export and locks now rather than when it evicts us.  The imports are
+    // closed before the disconnects go, so no pinger reconnects once a server has let go of us.
+    
+    set = lustre_request_set_alloc(volume->malloc_tag, volume->lock_group);
+    if (set) {
+        lustre_import_table_disconnect(volume->ost_imports, set);
+        lustre_import_table_disconnect(volume->mdt_imports, set);
+        if (volume->mgs_import) {
+            (void)lustre_import_disconnect(volume->mgs_import, set);
+        }
+    }
+    
+    lustre_import_table_close(volume->ost_imports);
+    lustre_import_table_close(volume->mdt_imports);
+    if (volume->mgs_import) {
+        lustre_import_close(volume->mgs_import);
+    }
+    
+    if (set) {
+        (void)lustre_request_set_send(set);
+        lustre_request_set_free(set);
+    }
+    
+    return error;
+    
+}
+
+// Connects to the MGS, reads the client config log and starts connecting to every target it names.  Only MDT0 is waited for, since the
+// root directory lives there; OSTs finish connecting in the background and the first I/O to each one waits for just that target.
+errno_t lustre_volume_connect(struct lustre_volume * volume)
+{
+    struct lustre_import *  import;
+    uint64_t                nid;
+    errno_t                 error;
+    
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(volume->mgs_import);
+    
+    import  = NULL;
+    nid     = lustre_network_nid(volume->mount_args.address_ip4.sin_addr);
+    
+    volume->mgs_import = lustre_import_alloc(volume->malloc_tag, volume->lock_group, kLustreImportTypeMGS, 0, "MGS", volume->client_uuid, nid, (volume->mount_args.port != 0) ? volume->mount_args.port : kLustreImportDefaultPort);
+    if (!volume->mgs_import) {
+        error = ENOMEM;
+        goto end;
+    }
+    
+    lustre_import_set_evict(volume->mgs_import, lustre_volume_import_evicted, volume);
+    
+    error = lustre_import_connect_async(volume->mgs_import);
+    if (error == 0) {
+        error = lustre_import_wait_connected(volume->mgs_import);
+    }
+    if (error != 0) {
+        os_log_error(lustre_logger_vfs, "Couldn't connect to MGS %{public}s, error %d", volume->mount_args.host, error);
+        goto end;
+    }
+    
+    error = lustre_config_process(volume->mgs_import, volume->mount_args.label, lustre_volume_config_target, volume);
+    if (error != 0) {
+        os_log_error(lustre_logger_vfs, "Couldn't process config log for %{public}s, error %d", volume->mount_args.label, error);
+        goto end;
+    }
+    
+    error = lustre_volume_mdt_import(volume, kLustreVolumeRootMDTIndex, &import);
+    if (error != 0) {
+        os_log_error(lustre_logger_vfs, "Couldn't connect to MDT0, error %d", error);
+        goto end;
+    }
+    
+    error = lustre_volume_connect_root(volume, import);
+    if (error != 0) {
+        os_log_error(lustre_logger_vfs, "Couldn't get root directory, error %d", error);
+        goto end;
+    }
+    
+    os_log_info(lustre_logger_vfs, "Connected to MDT0, %u OSTs connecting", lustre_import_table_count(volume->ost_imports));
+    
+end:
+    if (import) {
+        lustre_import_ref_count_dec(import);
+    }
+    
     return error;
+}
+
+// On success returns a connected import with a reference the caller must drop.  Waits only for the requested target.
+errno_t lustre_volume_mdt_import(struct lustre_volume * volume, uint32_t index, struct lustre_import ** import)
+{
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!import);
+    
+    return lustre_volume_import(volume->mdt_imports, index, import);
+}
+
+errno_t lustre_volume_ost_import(struct lustre_volume * volume, uint32_t index, struct lustre_import ** import)
+{
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!import);
+    
+    return lustre_volume_import(volume->ost_imports, index, import);
+}
+
+// Returns the MDT that holds fid.  We don't look sequences up in the FLD yet, so everything is assumed to live on MDT0.
+errno_t lustre_volume_fid_import(struct lustre_volume * volume, const struct lu_fid * fid, struct lustre_import ** import)
+{
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!fid);
+    LUSTRE_BUG_ON(!import);
+    
+    return lustre_volume_import(volume->mdt_imports, kLustreVolumeRootMDTIndex, import);
+}
+
+uint32_t lustre_volume_ost_count(struct lustre_volume * volume)
+{
+    LUSTRE_BUG_ON(!volume);
     
+    return lustre_import_table_count(volume->ost_imports);
+}
+
+boolean_t lustre_volume_is_root_fid(const struct lustre_volume * volume, const struct lu_fid * fid)
+{
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!fid);
+    
+    return (fid->f_seq == volume->root_fid.f_seq) && (fid->f_oid == volume->root_fid.f_oid) && (fid->f_ver == volume->root_fid.f_ver);
 }
 
 uid_t lustre_volume_uid_from_owner_identity(const struct lustre_volume * volume, uint64_t identity)
@@ -240,7 +604,7 @@ uid_t lustre_volume_uid_from_owner_identity(const struct lustre_volume * volume,
     
     LUSTRE_BUG_ON(!volume);
     
-    result = kLustreFilesystemNobodyOwnerId;
+    result = (uid_t)lustre_idmap_lookup(identity, (uint32_t)kLustreFilesystemNobodyOwnerId);
     
     return result;
 }
@@ -251,7 +615,7 @@ gid_t lustre_volume_gid_from_group_identity(const struct lustre_volume * volume,
     
     LUSTRE_BUG_ON(!volume);
     
-    result = kLustreFilesystemNobodyGroupId;
+    result = (gid_t)lustre_idmap_lookup(identity, (uint32_t)kLustreFilesystemNobodyGroupId);
     
     return result;
 }
@@ -304,6 +668,33 @@ uint32_t lustre_volume_block_size(const struct lustre_volume * volume)
     return block_size;
 }
 
+// How much the cluster layer reads or writes at once: a whole default stripe width, so one cluster keeps every object of a file busy with
+// a single RPC each, within kLustreIOClusterMin and kLustreIOClusterMax and rounded down to whole stripes.
+uint32_t lustre_volume_cluster_size(struct lustre_volume * volume)
+{
+    uint32_t block_size;
+    uint32_t stripe_count;
+    uint64_t size;
+    
+    LUSTRE_BUG_ON(!volume);
+    
+    lck_mtx_lock(volume->lock);
+    block_size      = volume->block_size;
+    stripe_count    = volume->stripe_count;
+    lck_mtx_unlock(volume->lock);
+    
+    if (stripe_count == kLustreLOVStripeCountAll) {
+        stripe_count = MAX(lustre_volume_ost_count(volume), 1);
+    }
+    
+    size = MIN(MAX((uint64_t)block_size * stripe_count, kLustreIOClusterMin), kLustreIOClusterMax);
+    if (block_size <= size) {
+        size -= size % block_size;
+    }
+    
+    return (uint32_t)size;
+}
+
 uint64_t lustre_volume_blocks_total(const struct lustre_volume * volume)
 {
     uint64_t    blocks_total;
@@ -359,9 +750,9 @@ struct timespec lustre_volume_create_time(const struct lustre_volume * volume)
     
     LUSTRE_BUG_ON(!volume);
     
-    lck_mtx_lock(volume->lock);
+    lck_spin_lock(volume->stats_lock);
     create_time = volume->create_time;
-    lck_mtx_unlock(volume->lock);
+    lck_spin_unlock(volume->stats_lock);
     
     return create_time;
 }
@@ -372,9 +763,9 @@ struct timespec lustre_volume_modify_time(const struct lustre_volume * volume)
     
     LUSTRE_BUG_ON(!volume);
     
-    lck_mtx_lock(volume->lock);
+    lck_spin_lock(volume->stats_lock);
     modify_time = volume->modify_time;
-    lck_mtx_unlock(volume->lock);
+    lck_spin_unlock(volume->stats_lock);
     
     return modify_time;
 }
@@ -385,9 +776,9 @@ struct timespec lustre_volume_access_time(const struct lustre_volume * volume)
     
     LUSTRE_BUG_ON(!volume);
     
-    lck_mtx_lock(volume->lock);
+    lck_spin_lock(volume->stats_lock);
     access_time = volume->access_time;
-    lck_mtx_unlock(volume->lock);
+    lck_spin_unlock(volume->stats_lock);
     
     return access_time;
 }
@@ -398,9 +789,9 @@ struct timespec lustre_volume_backup_time(const struct lustre_volume * volume)
     
     LUSTRE_BUG_ON(!volume);
     
-    lck_mtx_lock(volume->lock);
+    lck_spin_lock(volume->stats_lock);
     backup_time = volume->backup_time;
-    lck_mtx_unlock(volume->lock);
+    lck_spin_unlock(volume->stats_lock);
     
     return backup_time;
 }
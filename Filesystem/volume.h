@@ -28,6 +28,13 @@
 #include "mount_args.h"
 #include "lustre.h"
 #include "rb_tree.h"
+#include "import.h"
+#include "idmap.h"
+#include "dlm.h"
+#include "node.h"
+#include "writeback.h"
+#include "opencache.h"
+#include "search.h"
 
 static const uint8_t    kLustreVolumeUUIDSize               = 16;
 
@@ -36,10 +43,14 @@ struct lustre_volume {
     struct lustre_mount_args                        mount_args;                     // arguments set on mount
     char                                            volume_name[kLustreVolumeLabelSize];// volume name (UTF-8)
     struct vfs_attr                                 attr;                           // pre-calculate volume attributes
+    char                                            url[9+kLustreMountArgsHostMax+1+kLustreMountArgsLabelMax+1];// lustre://host/label, set with the mount args
+    OSMallocTag                                     malloc_tag;                     // used for everything this volume allocates
+    lck_grp_t *                                     lock_group;                     // used for all of this volume's locks
     
     lck_mtx_t *                                     lock;                           // protects following fields
     uint8_t                                         ready;                          // all initialized flag
-    uint32_t                                        block_size;                     // default size for blocks
+    uint32_t                                        block_size;                     // default stripe size, from the root's default layout
+    uint32_t                                        stripe_count;                   // default stripe count, likewise; may be kLustreLOVStripeCountAll
     
     uint8_t                                         uuid[kLustreVolumeUUIDSize];
     fsid_t                                          fsid;
@@ -56,10 +67,31 @@ struct lustre_volume {
     struct timespec                                 backup_time;                    // time of last backup
     struct timespec                                 checked_time;                   // time of last disk check
     
+    char                                            client_uuid[kLustreUUIDSize];   // identifies this mount to every target
+    struct lustre_import *                          mgs_import;                     // management server, used for the config log
+    struct lustre_import_table *                    mdt_imports;                    // metadata targets, by index
+    struct lustre_import_table *                    ost_imports;                    // object storage targets, by index
+    struct lustre_dlm_namespace *                   dlm;                            // locks granted to this mount by any target
+    struct lustre_node_table *                      nodes;                          // every node but the root, by FID
+    struct lu_fid                                   root_fid;                       // set on connect
+    struct lustre_node *                            root_node;                      // set on connect; backs root_vnode
+    struct lustre_writeback *                       writeback;                      // dirty data on its way to the OSTs
+    struct lustre_open_cache *                      open_cache;                     // MDT open handles, kept between opens
+    struct lustre_searches *                        searches;                       // searchfs walks waiting for their next call
+    volatile SInt64                                 readahead_bytes;                // read ahead and not yet used, held to kLustreReadAheadBudget
+    lck_mtx_t *                                     readahead_lock;                 // protects following fields
+    struct lustre_readahead *                       readaheads;                     // every file's readahead state, for giving back idle budget
+    uint64_t                                        readahead_swept;                // when idle budget was last looked for
+    uint64_t                                        flock_salt;                     // mixed into flock owners, so they don't give away kernel addresses
+    
+    struct lustre_volume *                          sysctl_next;                    // protected by the sysctl lock
+    boolean_t                                       sysctl_listed;
+    
     int32_t                                         ref_count;                      // keep track of the number of references
 };
 
 struct lustre_volume *      lustre_volume_alloc(void);
+void                        lustre_volume_free(struct lustre_volume * volume);
 
 void                        lustre_volume_ref_count_inc(struct lustre_volume * volume);
 void                        lustre_volume_ref_count_dec(struct lustre_volume * volume);
@@ -80,6 +112,13 @@ const char *                lustre_volume_url(const struct lustre_volume * volum
 errno_t                     lustre_volume_setup(struct lustre_volume * volume);
 errno_t                     lustre_volume_teardown(struct lustre_volume * volume);
 
+errno_t                     lustre_volume_connect(struct lustre_volume * volume);
+errno_t                     lustre_volume_mdt_import(struct lustre_volume * volume, uint32_t index, struct lustre_import ** import);
+errno_t                     lustre_volume_ost_import(struct lustre_volume * volume, uint32_t index, struct lustre_import ** import);
+errno_t                     lustre_volume_fid_import(struct lustre_volume * volume, const struct lu_fid * fid, struct lustre_import ** import);
+uint32_t                    lustre_volume_ost_count(struct lustre_volume * volume);
+boolean_t                   lustre_volume_is_root_fid(const struct lustre_volume * volume, const struct lu_fid * fid);
+
 uid_t                       lustre_volume_uid_from_owner_identity(const struct lustre_volume * volume, uint64_t identity);
 gid_t                       lustre_volume_gid_from_group_identity(const struct lustre_volume * volume, uint64_t identity);
 
@@ -88,6 +127,7 @@ void                        lustre_volume_uuid(const struct lustre_volume * volu
 fsid_t                      lustre_volume_fsid(const struct lustre_volume * volume);
 const char *                lustre_volume_label(const struct lustre_volume * volume);
 uint32_t                    lustre_volume_block_size(const struct lustre_volume * volume);
+uint32_t                    lustre_volume_cluster_size(struct lustre_volume * volume);
 uint64_t                    lustre_volume_blocks_total(const struct lustre_volume * volume);
 uint64_t                    lustre_volume_blocks_free(const struct lustre_volume * volume);
 uint64_t                    lustre_volume_blocks_available(const struct lustre_volume * volume);
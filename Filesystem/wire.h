@@ -0,0 +1,889 @@
+//
+//  wire.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Structures and constants that travel on the wire.  These mirror the layouts in the Lustre protocol definitions (lustre_idl.h and
+// friends) and must not be reordered or resized.  All values are little-endian on the wire, which matches every architecture we build for.
+
+#ifndef lustre_wire_h
+#define lustre_wire_h
+
+#include <stdint.h>
+
+#pragma mark - Messages
+
+static const uint32_t   kLustreMsgMagicV2                   = 0x0BD00BD3;
+static const uint32_t   kLustreMsgMagicV2Swabbed            = 0xD30BD00B;
+static const uint32_t   kLustreMsgVersion                   = 0x00000003;
+static const uint32_t   kLustreOBDVersion                   = 0x00010000;
+static const uint32_t   kLustreOSTVersion                   = 0x00030000;
+static const uint32_t   kLustreMDSVersion                   = 0x00040000;
+static const uint32_t   kLustreLogVersion                   = 0x00050000;
+static const uint32_t   kLustreMGSVersion                   = 0x00060000;
+static const uint32_t   kLustreDLMVersion                   = 0x00070000;
+static const uint32_t   kLustreMsgBufferMax                 = 8;
+static const uint32_t   kLustreUUIDSize                     = 40;
+
+enum lustre_msg_type {
+    kLustreMsgTypeRequest                                   = 4711,
+    kLustreMsgTypeError                                     = 4712,
+    kLustreMsgTypeReply                                     = 4713,
+};
+
+// Portals a request or its bulk data is sent to.  Bulk data moves separately from the request, matched to it by the request's xid.
+enum lustre_portal {
+    kLustrePortalConnectRequest                             = 1,
+    kLustrePortalConnectReply                               = 2,
+    kLustrePortalOSCReply                                   = 4,
+    kLustrePortalOSTIO                                      = 6,
+    kLustrePortalOSTBulk                                    = 8,
+    kLustrePortalMDCReply                                   = 10,
+    kLustrePortalMDSRequest                                 = 12,
+    kLustrePortalMDSBulk                                    = 14,
+    kLustrePortalLDLMCallbackRequest                        = 15,
+    kLustrePortalLDLMCallbackReply                          = 16,
+    kLustrePortalLDLMCancelRequest                          = 17,
+    kLustrePortalLDLMCancelReply                            = 18,
+    kLustrePortalMDSReadpage                                = 23,
+    kLustrePortalMGCReply                                   = 25,
+    kLustrePortalMGSRequest                                 = 26,
+    kLustrePortalOSTRequest                                 = 28,
+};
+
+enum lustre_opcode {
+    kLustreOpcodeOSTGetattr                                 = 1,
+    kLustreOpcodeOSTSetattr                                 = 2,
+    kLustreOpcodeOSTRead                                    = 3,
+    kLustreOpcodeOSTWrite                                   = 4,
+    kLustreOpcodeOSTGetInfo                                 = 7,
+    kLustreOpcodeOSTConnect                                 = 8,
+    kLustreOpcodeOSTDisconnect                              = 9,
+    kLustreOpcodeOSTPunch                                   = 10,
+    kLustreOpcodeOSTStatfs                                  = 13,
+    kLustreOpcodeOSTSync                                    = 16,
+    kLustreOpcodeMDSGetattr                                 = 33,
+    kLustreOpcodeMDSGetattrName                             = 34,
+    kLustreOpcodeMDSClose                                   = 35,
+    kLustreOpcodeMDSReint                                   = 36,
+    kLustreOpcodeMDSReadpage                                = 37,
+    kLustreOpcodeMDSConnect                                 = 38,
+    kLustreOpcodeMDSDisconnect                              = 39,
+    kLustreOpcodeMDSGetRoot                                 = 40,
+    kLustreOpcodeMDSStatfs                                  = 41,
+    kLustreOpcodeMDSGetxattr                                = 49,
+    kLustreOpcodeMDSSetxattr                                = 50,
+    kLustreOpcodeLDLMEnqueue                                = 101,
+    kLustreOpcodeLDLMCancel                                 = 103,
+    kLustreOpcodeLDLMBlockingCallback                       = 104,
+    kLustreOpcodeLDLMCompletionCallback                     = 105,
+    kLustreOpcodeLDLMGlimpseCallback                        = 106,
+    kLustreOpcodeMGSConnect                                 = 250,
+    kLustreOpcodeMGSDisconnect                              = 251,
+    kLustreOpcodeOBDPing                                    = 400,
+    kLustreOpcodeLLOGOriginHandleCreate                     = 501,
+    kLustreOpcodeLLOGOriginHandleNextBlock                  = 502,
+    kLustreOpcodeLLOGOriginHandleReadHeader                 = 503,
+};
+
+// Every message starts with this header, followed by lm_bufcount buffer lengths and then the buffers themselves, each padded to 8 bytes.
+struct lustre_msg_v2 {
+    uint32_t                    lm_bufcount;
+    uint32_t                    lm_secflvr;
+    uint32_t                    lm_magic;
+    uint32_t                    lm_repsize;
+    uint32_t                    lm_cksum;
+    uint32_t                    lm_flags;
+    uint32_t                    lm_padding_2;
+    uint32_t                    lm_padding_3;
+    uint32_t                    lm_buflens[0];
+};
+
+struct lustre_handle {
+    uint64_t                    cookie;
+};
+
+// Always buffer 0 of a message.
+struct ptlrpc_body {
+    struct lustre_handle        pb_handle;
+    uint32_t                    pb_type;
+    uint32_t                    pb_version;
+    uint32_t                    pb_opc;
+    uint32_t                    pb_status;
+    uint64_t                    pb_last_xid;
+    uint16_t                    pb_tag;
+    uint16_t                    pb_padding0;
+    uint32_t                    pb_padding1;
+    uint64_t                    pb_last_committed;
+    uint64_t                    pb_transno;
+    uint32_t                    pb_flags;
+    uint32_t                    pb_op_flags;
+    uint32_t                    pb_conn_cnt;
+    uint32_t                    pb_timeout;
+    uint32_t                    pb_service_time;
+    uint32_t                    pb_limit;
+    uint64_t                    pb_slv;
+    uint64_t                    pb_pre_versions[4];
+    uint64_t                    pb_mbits;
+    uint64_t                    pb_padding64_0;
+    uint64_t                    pb_padding64_1;
+    uint64_t                    pb_padding64_2;
+    char                        pb_jobid[32];
+};
+
+#pragma mark - Connection
+
+static const uint64_t   kLustreConnectFlagGrant             = 0x8ULL;
+static const uint64_t   kLustreConnectFlagVersion           = 0x20ULL;
+static const uint64_t   kLustreConnectFlagIBits             = 0x1000ULL;
+static const uint64_t   kLustreConnectFlagAttrFid           = 0x4000ULL;
+static const uint64_t   kLustreConnectFlagBRWSize           = 0x40000ULL;
+static const uint64_t   kLustreConnectFlagFid               = 0x40000000ULL;
+static const uint64_t   kLustreConnectFlagFull20            = 0x1000000000ULL;
+static const uint64_t   kLustreConnectFlag64BitHash         = 0x4000000000ULL;
+static const uint64_t   kLustreConnectFlagBulkMatchBits     = 0x2000000000000000ULL;
+
+static const uint32_t   kLustreConnectVersion               = 0x020c0000;   // 2.12.0.0
+
+struct obd_connect_data {
+    uint64_t                    ocd_connect_flags;
+    uint32_t                    ocd_version;
+    uint32_t                    ocd_grant;
+    uint32_t                    ocd_index;
+    uint32_t                    ocd_brw_size;
+    uint64_t                    ocd_ibits_known;
+    uint8_t                     ocd_grant_blkbits;
+    uint8_t                     ocd_grant_inobits;
+    uint16_t                    ocd_grant_tax_kb;
+    uint32_t                    ocd_grant_max_blks;
+    uint64_t                    ocd_transno;
+    uint32_t                    ocd_group;
+    uint32_t                    ocd_cksum_types;
+    uint32_t                    ocd_max_easize;
+    uint32_t                    ocd_instance;
+    uint64_t                    ocd_maxbytes;
+    uint64_t                    ocd_padding[15];
+};
+
+#pragma mark - Configuration Logs
+
+static const uint32_t   kLustreLLOGChunkSize                = 8192;
+static const uint32_t   kLustreLLOGRecordTypeConfig         = 0x10620000;
+
+struct llog_logid {
+    uint64_t                    lgl_oi_id;
+    uint64_t                    lgl_oi_seq;
+    uint32_t                    lgl_ogen;
+} __attribute__((packed));
+
+struct llogd_body {
+    struct llog_logid           lgd_logid;
+    uint32_t                    lgd_ctxt_idx;
+    uint32_t                    lgd_llh_flags;
+    uint32_t                    lgd_index;
+    uint32_t                    lgd_saved_index;
+    uint32_t                    lgd_len;
+    uint64_t                    lgd_cur_offset;
+} __attribute__((packed));
+
+struct llog_rec_tail {
+    uint32_t                    lrt_len;
+    uint32_t                    lrt_index;
+};
+
+struct llog_rec_hdr {
+    uint32_t                    lrh_len;
+    uint32_t                    lrh_index;
+    uint32_t                    lrh_type;
+    uint32_t                    lrh_id;
+};
+
+enum lustre_cfg_command {
+    kLustreCfgAttach                                        = 0x00cf001,
+    kLustreCfgSetup                                         = 0x00cf003,
+    kLustreCfgAddUUID                                       = 0x00cf005,
+    kLustreCfgAddConn                                       = 0x00cf00b,
+    kLustreCfgLOVAddOBD                                     = 0x00cf00d,
+    kLustreCfgAddMDC                                        = 0x00cf014,
+};
+
+struct lustre_cfg {
+    uint32_t                    lcfg_version;
+    uint32_t                    lcfg_command;
+    uint32_t                    lcfg_num;
+    uint32_t                    lcfg_flags;
+    uint64_t                    lcfg_nid;
+    uint32_t                    lcfg_nal;
+    uint32_t                    lcfg_bufcount;
+    uint32_t                    lcfg_buflens[0];
+};
+
+#pragma mark - Identifiers
+
+// Every object on an MDT is named by a FID.  OST objects use the same layout with the OST's sequence.
+struct lu_fid {
+    uint64_t                    f_seq;
+    uint32_t                    f_oid;
+    uint32_t                    f_ver;
+};
+
+#pragma mark - Metadata
+
+// Valid bits for mdt_body.mbo_valid (and obdo.o_valid).
+static const uint64_t   kLustreMDFlagId                     = 0x00000001ULL;
+static const uint64_t   kLustreMDFlagATime                  = 0x00000002ULL;
+static const uint64_t   kLustreMDFlagMTime                  = 0x00000004ULL;
+static const uint64_t   kLustreMDFlagCTime                  = 0x00000008ULL;
+static const uint64_t   kLustreMDFlagSize                   = 0x00000010ULL;
+static const uint64_t   kLustreMDFlagBlocks                 = 0x00000020ULL;
+static const uint64_t   kLustreMDFlagBlockSize              = 0x00000040ULL;
+static const uint64_t   kLustreMDFlagMode                   = 0x00000080ULL;
+static const uint64_t   kLustreMDFlagType                   = 0x00000100ULL;
+static const uint64_t   kLustreMDFlagUID                    = 0x00000200ULL;
+static const uint64_t   kLustreMDFlagGID                    = 0x00000400ULL;
+static const uint64_t   kLustreMDFlagFlags                  = 0x00000800ULL;
+static const uint64_t   kLustreMDFlagNLink                  = 0x00002000ULL;
+static const uint64_t   kLustreMDFlagRDev                   = 0x00010000ULL;
+static const uint64_t   kLustreMDFlagEASize                 = 0x00020000ULL;
+static const uint64_t   kLustreMDFlagHandle                 = 0x00080000ULL;
+static const uint64_t   kLustreMDFlagXattr                  = 0x1000000000ULL;  // an extended attribute's value
+static const uint64_t   kLustreMDFlagXattrList              = 0x2000000000ULL;  // and the names of them all
+static const uint64_t   kLustreMDFlagXattrRemove            = 0x4000000000ULL;
+static const uint64_t   kLustreMDFlagXattrAll               = kLustreMDFlagXattr | kLustreMDFlagXattrList;
+static const uint64_t   kLustreMDFlagGetattr                = kLustreMDFlagId | kLustreMDFlagATime | kLustreMDFlagMTime | kLustreMDFlagCTime
+                                                            | kLustreMDFlagSize | kLustreMDFlagBlocks | kLustreMDFlagMode | kLustreMDFlagType
+                                                            | kLustreMDFlagUID | kLustreMDFlagGID | kLustreMDFlagFlags | kLustreMDFlagNLink
+                                                            | kLustreMDFlagRDev;
+
+static const uint32_t   kLustreMDMaxEASize                  = 4096;             // largest layout we ask for
+
+struct mdt_body {
+    struct lu_fid               mbo_fid1;
+    struct lu_fid               mbo_fid2;
+    struct lustre_handle        mbo_open_handle;
+    uint64_t                    mbo_valid;
+    uint64_t                    mbo_size;
+    int64_t                     mbo_mtime;
+    int64_t                     mbo_atime;
+    int64_t                     mbo_ctime;
+    uint64_t                    mbo_blocks;
+    uint64_t                    mbo_version;
+    uint64_t                    mbo_t_state;
+    uint32_t                    mbo_fsuid;
+    uint32_t                    mbo_fsgid;
+    uint32_t                    mbo_capability;
+    uint32_t                    mbo_mode;
+    uint32_t                    mbo_uid;
+    uint32_t                    mbo_gid;
+    uint32_t                    mbo_flags;
+    uint32_t                    mbo_rdev;
+    uint32_t                    mbo_nlink;
+    uint32_t                    mbo_layout_gen;
+    uint32_t                    mbo_suppgid;
+    uint32_t                    mbo_eadatasize;
+    uint32_t                    mbo_aclsize;
+    uint32_t                    mbo_max_mdsize;
+    uint32_t                    mbo_unused3;
+    uint32_t                    mbo_uid_h;
+    uint32_t                    mbo_gid_h;
+    uint32_t                    mbo_projid;
+    uint64_t                    mbo_dom_size;
+    uint64_t                    mbo_dom_blocks;
+    uint64_t                    mbo_btime;
+    uint64_t                    mbo_padding_9;
+    uint64_t                    mbo_padding_10;
+};
+
+// Updates to the namespace ("reintegration") carry one of these records, whose first field names the operation.
+static const uint32_t   kLustreReintSetattr                 = 1;
+static const uint32_t   kLustreReintOpen                    = 6;
+static const uint32_t   kLustreReintSetxattr                = 7;
+
+// Open flags, split across mdt_rec_create.cr_flags_l and cr_flags_h.  The access mode is in the kernel's FMODE form rather than O_ACCMODE.
+static const uint64_t   kLustreOpenFlagRead                 = 00000000001ULL;
+static const uint64_t   kLustreOpenFlagWrite                = 00000000002ULL;
+static const uint64_t   kLustreOpenFlagExec                 = 00000000040ULL;
+static const uint64_t   kLustreOpenFlagLock                 = 04000000000ULL;   // ask for an OPEN lock along with the handle
+static const uint64_t   kLustreOpenFlagByFid                = 040000000000ULL;  // open cr_fid2 itself rather than a name in cr_fid1
+
+struct mdt_rec_create {
+    uint32_t                    cr_opcode;
+    uint32_t                    cr_cap;
+    uint32_t                    cr_fsuid;
+    uint32_t                    cr_fsuid_h;
+    uint32_t                    cr_fsgid;
+    uint32_t                    cr_fsgid_h;
+    uint32_t                    cr_suppgid1;
+    uint32_t                    cr_suppgid1_h;
+    uint32_t                    cr_suppgid2;
+    uint32_t                    cr_suppgid2_h;
+    struct lu_fid               cr_fid1;
+    struct lu_fid               cr_fid2;
+    struct lustre_handle        cr_open_handle_old;
+    int64_t                     cr_time;
+    uint64_t                    cr_rdev;
+    uint64_t                    cr_ioepoch;
+    uint64_t                    cr_padding_1;
+    uint32_t                    cr_mode;
+    uint32_t                    cr_bias;
+    uint32_t                    cr_flags_l;
+    uint32_t                    cr_flags_h;
+    uint32_t                    cr_umask;
+    uint32_t                    cr_padding_4;
+};
+
+struct mdt_rec_setattr {
+    uint32_t                    sa_opcode;
+    uint32_t                    sa_cap;
+    uint32_t                    sa_fsuid;
+    uint32_t                    sa_fsuid_h;
+    uint32_t                    sa_fsgid;
+    uint32_t                    sa_fsgid_h;
+    uint32_t                    sa_suppgid;
+    uint32_t                    sa_suppgid_h;
+    uint32_t                    sa_padding_1;
+    uint32_t                    sa_padding_1_h;
+    struct lu_fid               sa_fid;
+    uint64_t                    sa_valid;
+    uint32_t                    sa_uid;
+    uint32_t                    sa_gid;
+    uint64_t                    sa_size;
+    uint64_t                    sa_blocks;
+    int64_t                     sa_mtime;
+    int64_t                     sa_atime;
+    int64_t                     sa_ctime;
+    uint32_t                    sa_attr_flags;
+    uint32_t                    sa_mode;
+    uint32_t                    sa_bias;
+    uint32_t                    sa_projid;
+    uint32_t                    sa_padding_4;
+    uint32_t                    sa_padding_5;
+};
+
+// Sets or removes one extended attribute.  The flags are Linux's XATTR_CREATE and XATTR_REPLACE, not ours.
+static const uint32_t   kLustreXattrFlagCreate              = 1;
+static const uint32_t   kLustreXattrFlagReplace             = 2;
+
+struct mdt_rec_setxattr {
+    uint32_t                    sx_opcode;
+    uint32_t                    sx_cap;
+    uint32_t                    sx_fsuid;
+    uint32_t                    sx_fsuid_h;
+    uint32_t                    sx_fsgid;
+    uint32_t                    sx_fsgid_h;
+    uint32_t                    sx_suppgid1;
+    uint32_t                    sx_suppgid1_h;
+    uint32_t                    sx_suppgid2;
+    uint32_t                    sx_suppgid2_h;
+    struct lu_fid               sx_fid;
+    uint64_t                    sx_padding_1;
+    uint32_t                    sx_padding_2;
+    uint32_t                    sx_padding_3;
+    uint64_t                    sx_valid;
+    int64_t                     sx_time;
+    uint32_t                    sx_padding_5;
+    uint32_t                    sx_padding_6;
+    uint32_t                    sx_padding_7;
+    uint32_t                    sx_size;
+    uint32_t                    sx_flags;
+    uint32_t                    sx_padding_8;
+    uint32_t                    sx_padding_9;
+    uint32_t                    sx_padding_10;
+    uint32_t                    sx_padding_11;
+    uint32_t                    sx_padding_12;
+    uint32_t                    sx_padding_13;
+    uint32_t                    sx_padding_14;                                  // every reintegration record is the same size
+};
+
+// Names the open handle an MDS_CLOSE is for.
+struct mdt_ioepoch {
+    struct lustre_handle        mio_open_handle;
+    uint64_t                    mio_unused1;
+    uint32_t                    mio_unused2;
+    uint32_t                    mio_padding;
+};
+
+#pragma mark - Distributed Locks
+
+enum lustre_dlm_mode {
+    kLustreDLMModeEX                                        = 1,
+    kLustreDLMModePW                                        = 2,
+    kLustreDLMModePR                                        = 4,
+    kLustreDLMModeCW                                        = 8,
+    kLustreDLMModeCR                                        = 16,
+    kLustreDLMModeNL                                        = 32,
+};
+
+enum lustre_dlm_type {
+    kLustreDLMTypePlain                                     = 10,
+    kLustreDLMTypeExtent                                    = 11,
+    kLustreDLMTypeFlock                                     = 12,
+    kLustreDLMTypeIBits                                     = 13,
+};
+
+// Inode bits, which say which parts of an MDT object an IBITS lock protects.
+static const uint64_t   kLustreInodeBitLookup               = 0x01;             // the name(s) pointing at the object
+static const uint64_t   kLustreInodeBitUpdate               = 0x02;             // attributes, and a directory's entries
+static const uint64_t   kLustreInodeBitOpen                 = 0x04;
+static const uint64_t   kLustreInodeBitLayout               = 0x08;
+static const uint64_t   kLustreInodeBitPerm                 = 0x10;
+static const uint64_t   kLustreInodeBitXattr                = 0x20;
+static const uint64_t   kLustreInodeBitDOM                  = 0x40;
+static const uint64_t   kLustreInodeBitsKnown               = 0x7f;
+
+// Intent operations carried by an enqueue.
+static const uint64_t   kLustreIntentOpen                   = 0x0001;
+static const uint64_t   kLustreIntentCreate                 = 0x0002;
+static const uint64_t   kLustreIntentGetattr                = 0x0008;
+static const uint64_t   kLustreIntentLookup                 = 0x0010;
+static const uint64_t   kLustreIntentGetxattr               = 0x0080;
+static const uint64_t   kLustreIntentLayout                 = 0x0400;
+
+// Dispositions returned in ldlm_reply.lock_policy_res1 for intent enqueues.
+static const uint64_t   kLustreDispositionIntentExecuted    = 0x00000001ULL;
+static const uint64_t   kLustreDispositionLookupExecuted    = 0x00000002ULL;
+static const uint64_t   kLustreDispositionLookupNegative    = 0x00000004ULL;
+static const uint64_t   kLustreDispositionLookupPositive    = 0x00000008ULL;
+static const uint64_t   kLustreDispositionOpenCreate        = 0x00000010ULL;
+static const uint64_t   kLustreDispositionOpenOpen          = 0x00000020ULL;
+static const uint64_t   kLustreDispositionOpenLock          = 0x02000000ULL;    // the lock granted is an OPEN lock on the file
+
+static const uint32_t   kLustreDLMFlagBlockGranted          = 0x00000002;       // in a reply: queued behind a granted lock
+static const uint32_t   kLustreDLMFlagBlockConverting       = 0x00000004;       // likewise, behind a lock being converted
+static const uint32_t   kLustreDLMFlagBlockWaiting          = 0x00000008;       // likewise, behind a waiting lock
+static const uint32_t   kLustreDLMFlagsBlocked              = 0x0000000e;
+static const uint32_t   kLustreDLMFlagTestLock              = 0x00000800;       // flock: only say what would conflict
+static const uint32_t   kLustreDLMFlagHasIntent             = 0x00001000;
+static const uint32_t   kLustreDLMFlagFlockDeadlock         = 0x00008000;       // in a reply: waiting would deadlock
+static const uint32_t   kLustreDLMFlagBlockNoWait           = 0x00040000;       // flock: fail rather than queue
+
+struct ldlm_res_id {
+    uint64_t                    name[4];
+};
+
+struct ldlm_extent {
+    uint64_t                    start;
+    uint64_t                    end;
+    uint64_t                    gid;
+};
+
+struct ldlm_inodebits {
+    uint64_t                    bits;
+    uint64_t                    try_bits;
+};
+
+struct ldlm_flock_wire {
+    uint64_t                    lfw_start;
+    uint64_t                    lfw_end;
+    uint64_t                    lfw_owner;
+    uint32_t                    lfw_padding;
+    uint32_t                    lfw_pid;
+};
+
+union ldlm_wire_policy_data {
+    struct ldlm_extent          l_extent;
+    struct ldlm_flock_wire      l_flock;
+    struct ldlm_inodebits       l_inodebits;
+};
+
+struct ldlm_resource_desc {
+    uint32_t                    lr_type;
+    uint32_t                    lr_pad;
+    struct ldlm_res_id          lr_name;
+};
+
+struct ldlm_lock_desc {
+    struct ldlm_resource_desc   l_resource;
+    uint32_t                    l_req_mode;
+    uint32_t                    l_granted_mode;
+    union ldlm_wire_policy_data l_policy_data;
+};
+
+struct ldlm_request {
+    uint32_t                    lock_flags;
+    uint32_t                    lock_count;
+    struct ldlm_lock_desc       lock_desc;
+    struct lustre_handle        lock_handle[2];
+};
+
+struct ldlm_reply {
+    uint32_t                    lock_flags;
+    uint32_t                    lock_padding;
+    struct ldlm_lock_desc       lock_desc;
+    struct lustre_handle        lock_handle;
+    uint64_t                    lock_policy_res1;
+    uint64_t                    lock_policy_res2;
+};
+
+struct ldlm_intent {
+    uint64_t                    opc;
+};
+
+// Lock value block an OST returns with an extent lock (or a glimpse of one): what the object looks like now.  Servers that don't know the
+// newer type send the first five fields only.
+static const uint32_t   kLustreOSTLVBSizeV1                 = 40;
+
+struct ost_lvb {
+    uint64_t                    lvb_size;
+    int64_t                     lvb_mtime;
+    int64_t                     lvb_atime;
+    int64_t                     lvb_ctime;
+    uint64_t                    lvb_blocks;
+    uint32_t                    lvb_mtime_ns;
+    uint32_t                    lvb_atime_ns;
+    uint32_t                    lvb_ctime_ns;
+    uint32_t                    lvb_padding;
+};
+
+#pragma mark - Directories
+
+// MDS_READPAGE fills whole directory pages.  They are always 4KB, whatever the host page size, and each covers a range of name hashes.
+static const uint32_t   kLustreDirPageSize                  = 4096;
+static const uint64_t   kLustreDirHashEnd                   = 0xfffffffffffffffeULL;    // hash_end of the last page
+static const uint32_t   kLustreDirPageFlagEmpty             = 0x1;
+static const uint32_t   kLustreDirPageFlagCollide           = 0x2;              // hash_end is shared with the next page's first entry
+
+// What each lu_dirent carries, requested in mdt_body.mbo_mode.
+static const uint32_t   kLustreDirentAttrFid                = 0x1;
+static const uint32_t   kLustreDirentAttrType               = 0x2;              // a luda_type follows the name
+static const uint32_t   kLustreDirentAttr64BitHash          = 0x4;
+
+struct lu_dirent {
+    struct lu_fid               lde_fid;
+    uint64_t                    lde_hash;
+    uint16_t                    lde_reclen;                                     // 0 for the last entry of a page
+    uint16_t                    lde_namelen;
+    uint32_t                    lde_attrs;
+    char                        lde_name[0];
+};
+
+struct luda_type {
+    uint16_t                    lt_type;                                        // S_IFMT bits
+};
+
+struct lu_dirpage {
+    uint64_t                    ldp_hash_start;
+    uint64_t                    ldp_hash_end;
+    uint32_t                    ldp_flags;
+    uint32_t                    ldp_pad0;
+    struct lu_dirent            ldp_entries[0];
+};
+
+#pragma mark - Objects
+
+// A file's data lives in objects on the OSTs, named by ost_id.  Depending on the OST's age that holds a sequence and id or a real FID; we
+// only ever copy it from the layout to the requests, so which doesn't matter here.
+struct ost_id {
+    union {
+        struct {
+            uint64_t            oi_id;
+            uint64_t            oi_seq;
+        }                       oi;
+        struct lu_fid           oi_fid;
+    };
+};
+
+// Layouts, the LOV EA an MDT keeps for each file (and, as a default, for directories).  Stripe i of the file is object (i % stripe count);
+// a directory's default has no objects and may leave the size or count zero, meaning the filesystem default.
+static const uint32_t   kLustreLOVMagicV1                   = 0x0BD10BD0;
+static const uint32_t   kLustreLOVMagicV3                   = 0x0BD30BD0;
+static const uint32_t   kLustreLOVMagicCompV1               = 0x0BD60BD0;
+static const uint32_t   kLustreLOVPatternRAID0              = 0x00000001;
+static const uint32_t   kLustreLOVPatternMDT                = 0x00000100;
+static const uint32_t   kLustreLOVPatternReleased           = 0x80000000;
+static const uint16_t   kLustreLOVStripeCountAll            = 0xffff;           // stripe over every OST
+
+struct lov_ost_data_v1 {
+    struct ost_id               l_ost_oi;
+    uint32_t                    l_ost_gen;
+    uint32_t                    l_ost_idx;
+};
+
+struct lov_mds_md_v1 {
+    uint32_t                    lmm_magic;
+    uint32_t                    lmm_pattern;
+    struct ost_id               lmm_oi;
+    uint32_t                    lmm_stripe_size;
+    uint16_t                    lmm_stripe_count;
+    uint16_t                    lmm_layout_gen;
+    struct lov_ost_data_v1      lmm_objects[0];
+};
+
+struct lov_mds_md_v3 {
+    uint32_t                    lmm_magic;
+    uint32_t                    lmm_pattern;
+    struct ost_id               lmm_oi;
+    uint32_t                    lmm_stripe_size;
+    uint16_t                    lmm_stripe_count;
+    uint16_t                    lmm_layout_gen;
+    char                        lmm_pool_name[16];
+    struct lov_ost_data_v1      lmm_objects[0];
+};
+
+// Composite layouts cut the file into extents, each with a layout of its own (a lov_mds_md_v1 or v3, at lcme_offset from the start of the
+// lov_comp_md_v1).  A component with pattern kLustreLOVPatternMDT keeps its extent's data on the MDT itself (Data-on-MDT); the others
+// stripe over OSTs once instantiated.
+static const uint32_t   kLustreLOVCompFlagInit              = 0x00000010;       // the component has its objects
+
+struct lu_extent {
+    uint64_t                    e_start;
+    uint64_t                    e_end;
+};
+
+struct lov_comp_md_entry_v1 {
+    uint32_t                    lcme_id;
+    uint32_t                    lcme_flags;
+    struct lu_extent            lcme_extent;
+    uint32_t                    lcme_offset;
+    uint32_t                    lcme_size;
+    uint32_t                    lcme_layout_gen;
+    uint64_t                    lcme_timestamp;
+    uint32_t                    lcme_padding_1;
+} __attribute__((packed));
+
+struct lov_comp_md_v1 {
+    uint32_t                    lcm_magic;
+    uint32_t                    lcm_size;
+    uint32_t                    lcm_layout_gen;
+    uint16_t                    lcm_flags;
+    uint16_t                    lcm_entry_count;
+    uint16_t                    lcm_mirror_count;
+    uint16_t                    lcm_padding1[3];
+    uint64_t                    lcm_padding2;
+    struct lov_comp_md_entry_v1 lcm_entries[0];
+};
+
+// Valid bits for obdo.o_valid beyond the kLustreMDFlag ones it shares with mdt_body.
+static const uint64_t   kLustreOBDFlagGroup                 = 0x01000000ULL;    // o_oi carries a sequence
+static const uint64_t   kLustreOBDFlagGrant                 = 0x08000000ULL;    // o_grant, and o_mode and o_misc as below, carry grant
+
+// obdo.o_flags
+static const uint32_t   kLustreOBDFlagServerLock            = 0x00000800;       // the OST takes the extent lock on our behalf
+
+struct ost_layout {
+    uint32_t                    ol_stripe_size;
+    uint32_t                    ol_stripe_count;
+    uint64_t                    ol_comp_start;
+    uint64_t                    ol_comp_end;
+    uint32_t                    ol_comp_id;
+} __attribute__((packed));
+
+// On writes, obdo also tells the OST how its grant to us stands: o_grant is what we have left, o_blocks (with kLustreMDFlagBlocks) what
+// we've spent on dirty data not yet written, o_mode how much more we'd like and o_misc how much we've given up.  The reply's o_grant is
+// extra grant for us.
+struct obdo {
+    uint64_t                    o_valid;
+    struct ost_id               o_oi;
+    uint64_t                    o_parent_seq;
+    uint64_t                    o_size;
+    int64_t                     o_mtime;
+    int64_t                     o_atime;
+    int64_t                     o_ctime;
+    uint64_t                    o_blocks;
+    uint64_t                    o_grant;
+    uint32_t                    o_blksize;
+    uint32_t                    o_mode;
+    uint32_t                    o_uid;
+    uint32_t                    o_gid;
+    uint32_t                    o_flags;
+    uint32_t                    o_nlink;
+    uint32_t                    o_parent_oid;
+    uint32_t                    o_misc;
+    uint64_t                    o_ioepoch;
+    uint32_t                    o_stripe_idx;
+    uint32_t                    o_parent_ver;
+    struct lustre_handle        o_handle;
+    struct ost_layout           o_layout;
+    uint32_t                    o_layout_version;
+    uint32_t                    o_uid_h;
+    uint32_t                    o_gid_h;
+    uint64_t                    o_data_version;
+    uint32_t                    o_projid;
+    uint32_t                    o_padding_4;
+    uint64_t                    o_padding_5;
+    uint64_t                    o_padding_6;
+};
+
+struct ost_body {
+    struct obdo                 oa;
+};
+
+// An object's extent map comes from an OST_GET_INFO keyed "fiemap": the key names the object (lfik_oa) and says which part of it to map
+// and how many extents to return at most (lfik_fiemap); the reply is a struct fiemap followed by fm_mapped_extents extents.  A second
+// request field carries the same fiemap header.
+static const char       kLustreFiemapKey[]                  = "fiemap";
+static const uint32_t   kLustreFiemapFlagSync               = 0x00000001;       // have the OST flush cached writes first
+static const uint32_t   kLustreFiemapExtentLast             = 0x00000001;       // no more extents after this one
+static const uint32_t   kLustreFiemapExtentUnwritten        = 0x00000800;       // allocated but reads as zeroes
+
+struct fiemap_extent {
+    uint64_t                    fe_logical;
+    uint64_t                    fe_physical;
+    uint64_t                    fe_length;
+    uint64_t                    fe_reserved64[2];
+    uint32_t                    fe_flags;
+    uint32_t                    fe_device;
+    uint32_t                    fe_reserved[2];
+};
+
+struct fiemap {
+    uint64_t                    fm_start;
+    uint64_t                    fm_length;
+    uint32_t                    fm_flags;
+    uint32_t                    fm_mapped_extents;
+    uint32_t                    fm_extent_count;
+    uint32_t                    fm_reserved;
+    struct fiemap_extent        fm_extents[0];
+};
+
+struct ll_fiemap_info_key {
+    char                        lfik_name[8];
+    struct obdo                 lfik_oa;
+    struct fiemap               lfik_fiemap;
+};
+
+// Bulk reads and writes name one object (obd_ioobj) and the extents of it to move (niobuf_remote, ioo_bufcnt of them, in order).  The
+// bulk data is the extents' bytes back to back.
+static const uint32_t   kLustreBRWFlagRead                  = 0x00000001;
+static const uint32_t   kLustreBRWFlagServerLock            = 0x00000200;
+static const uint32_t   kLustreBRWPagesMax                  = 1024;             // extents per RPC
+
+struct obd_ioobj {
+    struct ost_id               ioo_oid;
+    uint32_t                    ioo_max_brw;
+    uint32_t                    ioo_bufcnt;
+};
+
+struct niobuf_remote {
+    uint64_t                    rnb_offset;
+    uint32_t                    rnb_len;
+    uint32_t                    rnb_flags;
+};
+
+#pragma mark - LNet
+
+// LNet over TCP, as the Linux socklnd speaks it.  A connection opens with an acceptor request naming the NID we want to reach, then each
+// side sends a hello; after that every message is a ksock_msg, an lnet_hdr and payload_length bytes of payload.  Only version 3 of the
+// socklnd protocol is spoken, which every server since Lustre 2.0 offers.
+static const uint32_t   kLustreLNetAcceptorMagic            = 0xacce7100;
+static const uint32_t   kLustreLNetAcceptorVersion          = 1;
+static const uint32_t   kLustreLNetProtoMagic               = 0x45726963;       // 'Eric'
+static const uint32_t   kLustreLNetProtoMagicSwabbed        = 0x63697245;
+static const uint32_t   kLustreLNetSocklndVersion           = 3;
+static const uint32_t   kLustreLNetPIDLustre                = 12345;            // every kernel LNet instance
+static const uint32_t   kLustreLNetInterfacesMax            = 16;               // most addresses a hello can carry
+static const uint32_t   kLustreLNetMTU                      = 1 << 20;          // largest payload of one message
+static const uint64_t   kLustreLNetWireCookieNone           = 0xffffffffffffffffULL;
+
+enum lustre_lnet_msg_type {
+    kLustreLNetMsgAck                                       = 0,
+    kLustreLNetMsgPut                                       = 1,
+    kLustreLNetMsgGet                                       = 2,
+    kLustreLNetMsgReply                                     = 3,
+    kLustreLNetMsgHello                                     = 4,
+};
+
+// As seen by whoever sends the hello, so the two ends of a bulk connection disagree.
+enum lustre_ksock_conn_type {
+    kLustreKsockConnNone                                    = -1,               // the acceptor turned the connection down
+    kLustreKsockConnControl                                 = 1,
+    kLustreKsockConnBulkIn                                  = 2,
+    kLustreKsockConnBulkOut                                 = 3,
+};
+
+enum lustre_ksock_msg_type {
+    kLustreKsockMsgNoop                                     = 0xc0,             // header only; keepalives and zero-copy acks
+    kLustreKsockMsgLNet                                     = 0xc1,
+};
+
+struct lnet_acceptor_connreq {
+    uint32_t                    acr_magic;
+    uint32_t                    acr_version;
+    uint64_t                    acr_nid;                                        // the NID we expect to reach
+} __attribute__((packed));
+
+struct ksock_hello_msg {
+    uint32_t                    kshm_magic;
+    uint32_t                    kshm_version;
+    uint64_t                    kshm_src_nid;
+    uint64_t                    kshm_dst_nid;
+    uint32_t                    kshm_src_pid;
+    uint32_t                    kshm_dst_pid;
+    uint64_t                    kshm_src_incarnation;
+    uint64_t                    kshm_dst_incarnation;
+    uint32_t                    kshm_ctype;
+    uint32_t                    kshm_nips;
+    uint32_t                    kshm_ips[0];
+} __attribute__((packed));
+
+struct lnet_handle_wire {
+    uint64_t                    wh_interface_cookie;
+    uint64_t                    wh_object_cookie;
+} __attribute__((packed));
+
+struct lnet_ack {
+    struct lnet_handle_wire     dst_wmd;
+    uint64_t                    match_bits;
+    uint32_t                    mlength;
+} __attribute__((packed));
+
+struct lnet_put {
+    struct lnet_handle_wire     ack_wmd;                                        // kLustreLNetWireCookieNone if no ack is wanted
+    uint64_t                    match_bits;
+    uint64_t                    hdr_data;
+    uint32_t                    ptl_index;
+    uint32_t                    offset;
+} __attribute__((packed));
+
+struct lnet_get {
+    struct lnet_handle_wire     return_wmd;
+    uint64_t                    match_bits;
+    uint32_t                    ptl_index;
+    uint32_t                    src_offset;
+    uint32_t                    sink_length;
+} __attribute__((packed));
+
+struct lnet_reply {
+    struct lnet_handle_wire     dst_wmd;
+} __attribute__((packed));
+
+struct lnet_hdr {
+    uint64_t                    dest_nid;
+    uint64_t                    src_nid;
+    uint32_t                    dest_pid;
+    uint32_t                    src_pid;
+    uint32_t                    type;
+    uint32_t                    payload_length;
+    union {
+        struct lnet_ack         ack;
+        struct lnet_put         put;
+        struct lnet_get         get;
+        struct lnet_reply       reply;
+    } msg;
+} __attribute__((packed));
+
+// A noop is only the part before ksm_hdr.  A non-zero ksm_zc_cookies[0] asks for a noop back with the cookie in ksm_zc_cookies[1].
+struct ksock_msg {
+    uint32_t                    ksm_type;
+    uint32_t                    ksm_csum;
+    uint64_t                    ksm_zc_cookies[2];
+    struct lnet_hdr             ksm_hdr;
+} __attribute__((packed));
+
+#endif /* lustre_wire_h */
@@ -0,0 +1,865 @@
+//
+//  writeback.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <libkern/libkern.h>
+#include <libkern/OSAtomic.h>
+#include <kern/thread.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/ubc.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "writeback.h"
+#include "volume.h"
+#include "node.h"
+#include "layout.h"
+#include "import.h"
+#include "osc.h"
+#include "request.h"
+#include "logging.h"
+#include "assert.h"
+
+static const uint32_t   kLustreWritebackPushMax             = 16;               // files the flusher pushes per pass
+
+struct lustre_writeback_push {
+    struct lustre_writeback *                       writeback;
+    boolean_t                                       all;                            // push every dirty file, not just old ones
+    vnode_t                                         vnodes[kLustreWritebackPushMax];
+    uint32_t                                        vids[kLustreWritebackPushMax];
+    uint32_t                                        count;
+};
+
+#pragma mark - Internal
+
+static void lustre_writeback_write_release(struct lustre_writeback * writeback, struct lustre_writeback_write * write, errno_t error)
+{
+    if (error != 0) {
+        (void)OSCompareAndSwap(0, (UInt32)error, (volatile UInt32 *)&write->error);
+    }
+
+    if (OSDecrementAtomic(&write->outstanding) != 1) {
+        return;
+    }
+
+    // The node is only known to exist until the callback has run: once the last buf of a file is done, it may be reclaimed.
+
+    if (write->error != 0) {
+        lck_mtx_lock(writeback->lock);
+        if (write->node->write_error == 0) {
+            write->node->write_error = write->error;
+        }
+        lck_mtx_unlock(writeback->lock);
+    }
+
+    write->callback(write->error, write->callback_data);
+
+    OSFree(write, sizeof(struct lustre_writeback_write), writeback->volume->malloc_tag);
+}
+
+static void lustre_writeback_window_free(struct lustre_writeback_window * window)
+{
+    lustre_import_ref_count_dec(window->import);
+    lustre_layout_ref_count_dec(window->layout);
+
+    OSFree(window, sizeof(struct lustre_writeback_window), window->writeback->volume->malloc_tag);
+}
+
+static void lustre_writeback_window_done(struct lustre_writeback_window * window, errno_t error)
+{
+    struct lustre_writeback *   writeback;
+    uint32_t                    i;
+
+    writeback = window->writeback;
+
+    lustre_import_grant_written(window->import, window->length);
+
+    if (error != 0) {
+        os_log_error(lustre_logger_vfs, "Write of %u bytes to object %u of [0x%llx:0x%x:0x%x] failed, error %d", window->length, window->stripe,
+                     window->node->fid.f_seq, window->node->fid.f_oid, window->node->fid.f_ver, error);
+    }
+
+    for (i=0; i<window->write_count; i++) {
+        lustre_writeback_write_release(writeback, window->writes[i], error);
+    }
+
+    lustre_writeback_window_free(window);
+
+    lck_mtx_lock(writeback->lock);
+    writeback->sending -= 1;
+    if (writeback->sending == 0) {
+        wakeup(&writeback->sending);
+    }
+    lck_mtx_unlock(writeback->lock);
+}
+
+static void lustre_writeback_window_complete(struct lustre_request * request, void * data)
+{
+    lustre_writeback_window_done((struct lustre_writeback_window *)data, lustre_osc_write_interpret(request));
+}
+
+static void lustre_writeback_window_send(struct lustre_writeback_window * window)
+{
+    struct lustre_request * request;
+    errno_t                 error;
+
+    error = lustre_osc_write_prepare(window->import, &window->layout->objects[window->stripe].oi, window->extents, window->extent_count, window->segments, window->segment_count, &request);
+    if (error != 0) {
+        lustre_writeback_window_done(window, error);
+        return;
+    }
+
+    lustre_request_set_callback(request, lustre_writeback_window_complete, window);
+
+    // A failure to send completes the request, so the callback has already heard about it.
+
+    (void)lustre_request_send_async(request);
+    lustre_request_ref_count_dec(request);
+}
+
+// Caller holds the lock.  Takes window off the held list and onto the front of *send, counting why it's going.
+static void lustre_writeback_window_detach(struct lustre_writeback * writeback, struct lustre_writeback_window * window, struct lustre_writeback_window ** send, uint64_t * reason)
+{
+    struct lustre_writeback_window ** link;
+
+    for (link = &writeback->windows; *link != window; link = &(*link)->next) {
+        LUSTRE_BUG_ON(!*link);
+    }
+    *link = window->next;
+
+    writeback->held     -= window->length;
+    writeback->sending  += 1;
+    writeback->stats.rpcs   += 1;
+    writeback->stats.bytes  += window->length;
+    *reason += 1;
+
+    window->next    = *send;
+    *send           = window;
+}
+
+static void lustre_writeback_send_all(struct lustre_writeback_window * send)
+{
+    struct lustre_writeback_window * next;
+
+    for (; send; send = next) {
+        next = send->next;
+        lustre_writeback_window_send(send);
+    }
+}
+
+// Caller holds the lock.  Sends whatever node (every node, if NULL) has held.
+static void lustre_writeback_detach_node(struct lustre_writeback * writeback, struct lustre_node * node, struct lustre_writeback_window ** send)
+{
+    struct lustre_writeback_window * window;
+    struct lustre_writeback_window * next;
+
+    for (window = writeback->windows; window; window = next) {
+        next = window->next;
+        if (!node || (window->node == node)) {
+            lustre_writeback_window_detach(writeback, window, send, &writeback->stats.sync);
+        }
+    }
+}
+
+// Caller holds the lock.  Whether piece fits on the end of window without breaking its extents' order or running out of room.
+static boolean_t lustre_writeback_window_fits(const struct lustre_writeback_window * window, struct lustre_writeback_write * write, uint64_t object_offset, uint8_t * data)
+{
+    const struct lustre_osc_extent *        extent;
+    const struct lustre_request_segment *   segment;
+
+    if (window->length == window->brw_size) {
+        return FALSE;
+    }
+    if (window->extent_count > 0) {
+        extent = &window->extents[window->extent_count - 1];
+        if (object_offset < extent->offset + extent->length) {
+            return FALSE;
+        }
+        if ((window->extent_count == kLustreWritebackExtentsMax) && (object_offset != extent->offset + extent->length)) {
+            return FALSE;
+        }
+    }
+    if (window->segment_count == kLustreWritebackSegmentsMax) {
+        segment = &window->segments[window->segment_count - 1];
+        if ((uint8_t *)segment->data + segment->length != data) {
+            return FALSE;
+        }
+    }
+    if ((window->write_count == kLustreWritebackSegmentsMax) && (window->writes[window->write_count - 1] != write)) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Caller holds the lock.  Puts piece on the end of window, merging it with the last extent and segment where it carries straight on.
+static void lustre_writeback_window_append(struct lustre_writeback * writeback, struct lustre_writeback_window * window, struct lustre_writeback_write * write, uint64_t object_offset, uint8_t * data, uint32_t piece)
+{
+    struct lustre_osc_extent *          extent;
+    struct lustre_request_segment *     segment;
+
+    extent = (window->extent_count > 0) ? &window->extents[window->extent_count - 1] : NULL;
+    if (extent && (extent->offset + extent->length == object_offset)) {
+        extent->length += piece;
+    } else {
+        window->extents[window->extent_count] = (struct lustre_osc_extent){ object_offset, piece };
+        window->extent_count += 1;
+    }
+
+    segment = (window->segment_count > 0) ? &window->segments[window->segment_count - 1] : NULL;
+    if (segment && ((uint8_t *)segment->data + segment->length == data)) {
+        segment->length += piece;
+    } else {
+        window->segments[window->segment_count] = (struct lustre_request_segment){ data, piece };
+        window->segment_count += 1;
+    }
+
+    if ((window->write_count == 0) || (window->writes[window->write_count - 1] != write)) {
+        window->writes[window->write_count] = write;
+        window->write_count += 1;
+        OSIncrementAtomic(&write->outstanding);
+    }
+
+    window->length      += piece;
+    writeback->held     += piece;
+}
+
+// Opens a window for stripe of node.  Called without the lock, since finding the OST may wait for it to connect.
+static errno_t lustre_writeback_window_alloc(struct lustre_writeback * writeback, struct lustre_node * node, struct lustre_layout * layout, uint32_t stripe, struct lustre_writeback_window ** result)
+{
+    struct lustre_writeback_window *    window;
+    struct lustre_import *              import;
+    errno_t                             error;
+
+    error = lustre_volume_ost_import(writeback->volume, layout->objects[stripe].ost_index, &import);
+    if (error != 0) {
+        return error;
+    }
+
+    window = OSMalloc(sizeof(struct lustre_writeback_window), writeback->volume->malloc_tag);
+    if (!window) {
+        lustre_import_ref_count_dec(import);
+        return ENOMEM;
+    }
+
+    bzero(window, sizeof(struct lustre_writeback_window));
+
+    lustre_layout_ref_count_inc(layout);
+
+    window->writeback   = writeback;
+    window->node        = node;
+    window->layout      = layout;
+    window->import      = import;
+    window->stripe      = stripe;
+    window->brw_size    = lustre_import_brw_size(import);
+
+    *result = window;
+
+    return 0;
+}
+
+static void lustre_writeback_push_node(struct lustre_node * node, void * data)
+{
+    struct lustre_writeback_push *  push;
+    boolean_t                       old;
+
+    push = (struct lustre_writeback_push *)data;
+
+    if ((node->type != VREG) || (push->count == kLustreWritebackPushMax)) {
+        return;
+    }
+
+    lck_mtx_lock(push->writeback->lock);
+    old = (node->dirtied != 0) && (push->all || (push->writeback->tick - node->dirtied >= kLustreWritebackAgeSeconds / kLustreWritebackTickSeconds));
+    lck_mtx_unlock(push->writeback->lock);
+
+    if (!old) {
+        return;
+    }
+
+    lck_mtx_lock(node->lock);
+    if (node->vnode) {
+        push->vnodes[push->count]   = node->vnode;
+        push->vids[push->count]     = node->vid;
+        push->count += 1;
+    }
+    lck_mtx_unlock(node->lock);
+}
+
+// Caller holds the lock.  Forgets node's dirty count once its pages have all been pushed.
+static void lustre_writeback_clean(struct lustre_writeback * writeback, struct lustre_node * node)
+{
+    writeback->dirty    -= node->dirty;
+    node->dirty         = 0;
+    node->dirtied       = 0;
+
+    wakeup(&writeback->dirty);
+}
+
+// Runs once a tick.  Sends everything held since before the last tick, and pushes files whose pages have been dirty too long, or all dirty
+// files once the volume is halfway to its limit, so writers seldom meet the limit itself.
+static void lustre_writeback_flusher(void * parameter, wait_result_t wait_result)
+{
+    struct lustre_writeback *           writeback;
+    struct lustre_writeback_window *    window;
+    struct lustre_writeback_window *    next;
+    struct lustre_writeback_window *    send;
+    struct lustre_writeback_push        push;
+    struct timespec                     timeout;
+    vnode_t                             vnode;
+    uint32_t                            i;
+
+    writeback = (struct lustre_writeback *)parameter;
+
+    lck_mtx_lock(writeback->lock);
+
+    while (!writeback->stopping) {
+        timeout = (struct timespec){ kLustreWritebackTickSeconds, 0 };
+        (void)msleep(&writeback->stopping, writeback->lock, PINOD, __FUNCTION__, &timeout);
+        if (writeback->stopping) {
+            break;
+        }
+
+        writeback->tick += 1;
+
+        send = NULL;
+        for (window = writeback->windows; window; window = next) {
+            next = window->next;
+            if (window->tick < writeback->tick - 1) {
+                lustre_writeback_window_detach(writeback, window, &send, &writeback->stats.aged);
+            }
+        }
+
+        bzero(&push, sizeof(struct lustre_writeback_push));
+        push.writeback  = writeback;
+        push.all        = (writeback->dirty >= kLustreWritebackVolumeMax / 2);
+
+        lck_mtx_unlock(writeback->lock);
+
+        lustre_writeback_send_all(send);
+
+        lustre_node_table_iterate(writeback->volume->nodes, lustre_writeback_push_node, &push);
+
+        for (i=0; i<push.count; i++) {
+            vnode = push.vnodes[i];
+            if (vnode_getwithvid(vnode, push.vids[i]) != 0) {
+                continue;
+            }
+            (void)cluster_push(vnode, 0);
+
+            lck_mtx_lock(writeback->lock);
+            lustre_writeback_clean(writeback, lustre_node_peek(vnode));
+            lck_mtx_unlock(writeback->lock);
+
+            vnode_put(vnode);
+        }
+
+        lck_mtx_lock(writeback->lock);
+    }
+
+    writeback->running = FALSE;
+    wakeup(&writeback->running);
+
+    lck_mtx_unlock(writeback->lock);
+
+    thread_terminate(current_thread());
+}
+
+#pragma mark - External
+
+struct lustre_writeback * lustre_writeback_alloc(struct lustre_volume * volume)
+{
+    struct lustre_writeback *   writeback;
+    thread_t                    thread;
+
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!volume->nodes);
+
+    writeback = OSMalloc(sizeof(struct lustre_writeback), volume->malloc_tag);
+    if (!writeback) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate writeback");
+        return NULL;
+    }
+
+    bzero(writeback, sizeof(struct lustre_writeback));
+
+    writeback->volume   = volume;
+    writeback->tick     = 1;
+
+    writeback->lock = lck_mtx_alloc_init(volume->lock_group, NULL);
+    if (!writeback->lock) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate writeback lock");
+        OSFree(writeback, sizeof(struct lustre_writeback), volume->malloc_tag);
+        return NULL;
+    }
+
+    writeback->running = TRUE;
+    if (kernel_thread_start(lustre_writeback_flusher, writeback, &thread) != KERN_SUCCESS) {
+        os_log_error(lustre_logger_vfs, "Couldn't start writeback flusher");
+        lck_mtx_free(writeback->lock, volume->lock_group);
+        OSFree(writeback, sizeof(struct lustre_writeback), volume->malloc_tag);
+        return NULL;
+    }
+    thread_deallocate(thread);
+
+    return writeback;
+}
+
+// Only called once every vnode has gone, so nothing is dirty; anything still held or being written is seen through first.
+void lustre_writeback_free(struct lustre_writeback * writeback)
+{
+    struct lustre_writeback_window *    send;
+    struct lustre_volume *              volume;
+
+    LUSTRE_BUG_ON(!writeback);
+
+    volume  = writeback->volume;
+    send    = NULL;
+
+    lck_mtx_lock(writeback->lock);
+    writeback->stopping = TRUE;
+    wakeup(&writeback->stopping);
+    while (writeback->running) {
+        (void)msleep(&writeback->running, writeback->lock, PINOD, __FUNCTION__, NULL);
+    }
+    lustre_writeback_detach_node(writeback, NULL, &send);
+    lck_mtx_unlock(writeback->lock);
+
+    lustre_writeback_send_all(send);
+
+    lck_mtx_lock(writeback->lock);
+    while (writeback->sending > 0) {
+        (void)msleep(&writeback->sending, writeback->lock, PINOD, __FUNCTION__, NULL);
+    }
+    lck_mtx_unlock(writeback->lock);
+
+    lck_mtx_free(writeback->lock, volume->lock_group);
+    OSFree(writeback, sizeof(struct lustre_writeback), volume->malloc_tag);
+}
+
+// Gives back grant for [offset, offset + length) of a file with layout to each OST it touches, or the first stripes of them.
+static void lustre_writeback_grant_return(struct lustre_writeback * writeback, struct lustre_layout * layout, uint64_t offset, uint64_t length, uint32_t stripes)
+{
+    struct lustre_import *  import;
+    uint64_t                bytes;
+    uint32_t                stripe;
+
+    for (stripe=0; stripe<stripes; stripe++) {
+        bytes = lustre_layout_object_offset(layout, stripe, offset + length) - lustre_layout_object_offset(layout, stripe, offset);
+        if ((bytes != 0) && (lustre_volume_ost_import(writeback->volume, layout->objects[stripe].ost_index, &import) == 0)) {
+            lustre_import_grant_return(import, bytes);
+            lustre_import_ref_count_dec(import);
+        }
+    }
+}
+
+// Takes grant for [offset, offset + length) of a file with layout from each OST it touches.  Returns FALSE, having taken none, if any of
+// them is short.
+static boolean_t lustre_writeback_grant_take(struct lustre_writeback * writeback, struct lustre_layout * layout, uint64_t offset, uint64_t length)
+{
+    struct lustre_import *  import;
+    uint64_t                bytes;
+    uint32_t                taken;
+    boolean_t               granted;
+
+    granted = TRUE;
+
+    for (taken=0; taken<layout->object_count; taken++) {
+        bytes = lustre_layout_object_offset(layout, taken, offset + length) - lustre_layout_object_offset(layout, taken, offset);
+        if (bytes == 0) {
+            continue;
+        }
+        if (lustre_volume_ost_import(writeback->volume, layout->objects[taken].ost_index, &import) != 0) {
+            granted = FALSE;
+            break;
+        }
+        granted = lustre_import_grant_take(import, bytes);
+        lustre_import_ref_count_dec(import);
+        if (!granted) {
+            break;
+        }
+    }
+
+    if (!granted) {
+        lustre_writeback_grant_return(writeback, layout, offset, length, taken);
+    }
+
+    return granted;
+}
+
+// Adds [offset, offset + length) to the reservation's clean runs, merging it with the last where it carries straight on.  Returns FALSE if
+// there's no room for it.
+static boolean_t lustre_writeback_reservation_add(struct lustre_writeback_reservation * reservation, uint64_t offset, uint64_t length)
+{
+    struct lustre_writeback_run * last;
+
+    last = (reservation->count > 0) ? &reservation->runs[reservation->count - 1] : NULL;
+    if (last && (last->offset + last->length == offset)) {
+        last->length += length;
+        return TRUE;
+    }
+    if (reservation->count == kLustreWritebackRunsMax) {
+        return FALSE;
+    }
+
+    reservation->runs[reservation->count] = (struct lustre_writeback_run){ offset, length };
+    reservation->count += 1;
+
+    return TRUE;
+}
+
+// Takes grant for writing [offset, offset + length) of vnode, a file with layout.  Grant is only spent when a page goes from clean to
+// dirty, since the flush gives back what it writes once however often the page was written, so pages already dirty in the UBC are left
+// out; which were taken for is recorded in reservation, for lustre_writeback_unreserve.  Returns FALSE, having taken none, if any OST
+// is short, or if the clean parts of the range are too scattered to record; the write must then go straight out.
+boolean_t lustre_writeback_reserve(struct lustre_writeback * writeback, struct lustre_layout * layout, vnode_t vnode, uint64_t offset, uint64_t length, struct lustre_writeback_reservation * reservation)
+{
+    uint64_t    page;
+    uint64_t    start;
+    uint64_t    end;
+    uint32_t    i;
+    int         flags;
+    boolean_t   granted;
+
+    LUSTRE_BUG_ON(!writeback);
+    LUSTRE_BUG_ON(!layout);
+    LUSTRE_BUG_ON(layout->object_count == 0);
+    LUSTRE_BUG_ON(!vnode);
+    LUSTRE_BUG_ON(!reservation);
+
+    bzero(reservation, sizeof(struct lustre_writeback_reservation));
+
+    // A file with nothing in the UBC has nothing dirty, which spares looking at each page of a large write.
+
+    granted = TRUE;
+    if (!ubc_pages_resident(vnode)) {
+        granted = lustre_writeback_reservation_add(reservation, offset, length);
+    } else {
+        for (page = offset & ~(uint64_t)PAGE_MASK; granted && (page < offset + length); page += PAGE_SIZE) {
+            flags = 0;
+            if ((ubc_page_op(vnode, (off_t)page, 0, NULL, &flags) == KERN_SUCCESS) && (flags & UPL_POP_DIRTY)) {
+                continue;
+            }
+            start   = MAX(page, offset);
+            end     = MIN(page + PAGE_SIZE, offset + length);
+            granted = lustre_writeback_reservation_add(reservation, start, end - start);
+        }
+    }
+
+    for (i=0; granted && (i<reservation->count); i++) {
+        if (!lustre_writeback_grant_take(writeback, layout, reservation->runs[i].offset, reservation->runs[i].length)) {
+            granted = FALSE;
+            break;
+        }
+    }
+
+    if (granted) {
+        return TRUE;
+    }
+
+    while (i-- > 0) {
+        lustre_writeback_grant_return(writeback, layout, reservation->runs[i].offset, reservation->runs[i].length, layout->object_count);
+    }
+    reservation->count = 0;
+
+    lck_mtx_lock(writeback->lock);
+    writeback->stats.ungranted += 1;
+    lck_mtx_unlock(writeback->lock);
+
+    return FALSE;
+}
+
+// Gives back the grant lustre_writeback_reserve took for whatever of the range from offset on wasn't written after all.
+void lustre_writeback_unreserve(struct lustre_writeback * writeback, struct lustre_layout * layout, const struct lustre_writeback_reservation * reservation, uint64_t offset)
+{
+    const struct lustre_writeback_run * run;
+    uint64_t                            start;
+    uint32_t                            i;
+
+    LUSTRE_BUG_ON(!writeback);
+    LUSTRE_BUG_ON(!layout);
+    LUSTRE_BUG_ON(!reservation);
+
+    for (i=0; i<reservation->count; i++) {
+        run     = &reservation->runs[i];
+        start   = MAX(run->offset, offset);
+        if (start < run->offset + run->length) {
+            lustre_writeback_grant_return(writeback, layout, start, run->offset + run->length - start, layout->object_count);
+        }
+    }
+}
+
+// Called before dirtying more of a file.  Waits while the file or the volume is over its dirty limit, pushing the file's own pages first
+// and leaving the rest of the volume to the flusher.
+void lustre_writeback_throttle(struct lustre_writeback * writeback, struct lustre_node * node, vnode_t vnode)
+{
+    struct timespec timeout;
+    boolean_t       throttled;
+
+    LUSTRE_BUG_ON(!writeback);
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!vnode);
+
+    throttled = FALSE;
+
+    lck_mtx_lock(writeback->lock);
+    while ((node->dirty >= kLustreWritebackFileMax) || (writeback->dirty >= kLustreWritebackVolumeMax)) {
+        if (!throttled) {
+            throttled = TRUE;
+            writeback->stats.throttled += 1;
+        }
+
+        if (node->dirty > 0) {
+            lck_mtx_unlock(writeback->lock);
+            (void)cluster_push(vnode, 0);
+            lck_mtx_lock(writeback->lock);
+            lustre_writeback_clean(writeback, node);
+        } else {
+            wakeup(&writeback->stopping);
+            timeout = (struct timespec){ kLustreWritebackTickSeconds, 0 };
+            (void)msleep(&writeback->dirty, writeback->lock, PINOD, __FUNCTION__, &timeout);
+        }
+    }
+    lck_mtx_unlock(writeback->lock);
+}
+
+// Called once bytes of a file have been dirtied in the UBC.  Rewriting dirty pages counts them again, so this overstates; the count is
+// reset whenever all the file's pages are pushed.
+void lustre_writeback_dirtied(struct lustre_writeback * writeback, struct lustre_node * node, uint64_t bytes)
+{
+    LUSTRE_BUG_ON(!writeback);
+    LUSTRE_BUG_ON(!node);
+
+    lck_mtx_lock(writeback->lock);
+    node->dirty         += bytes;
+    writeback->dirty    += bytes;
+    if (node->dirtied == 0) {
+        node->dirtied = writeback->tick;
+    }
+    lck_mtx_unlock(writeback->lock);
+}
+
+// Writes [offset, offset + length) of node, a file with layout, from data.  The range is cut at stripe boundaries and each piece held
+// with whatever else is bound for the same object; a window goes out as soon as it makes a full RPC, at the next flusher tick otherwise,
+// or straight away if now is set (the caller is waiting, or memory is short).  callback runs exactly once, when every piece is written,
+// and data must stay put until then.
+void lustre_writeback_add(struct lustre_writeback * writeback, struct lustre_node * node, struct lustre_layout * layout, uint64_t offset, void * data, uint32_t length, boolean_t now, lustre_io_callback callback, void * callback_data)
+{
+    struct lustre_writeback_write *     write;
+    struct lustre_writeback_window *    window;
+    struct lustre_writeback_window *    created;
+    struct lustre_writeback_window *    next;
+    struct lustre_writeback_window *    send;
+    uint64_t                            object_offset;
+    uint64_t                            cleaned;
+    uint32_t                            stripe;
+    uint32_t                            run;
+    uint32_t                            piece;
+    uint32_t                            done;
+    uint32_t                            i;
+    errno_t                             error;
+
+    LUSTRE_BUG_ON(!writeback);
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!layout);
+    LUSTRE_BUG_ON(layout->object_count == 0);
+    LUSTRE_BUG_ON(!data);
+    LUSTRE_BUG_ON(!callback);
+
+    write = OSMalloc(sizeof(struct lustre_writeback_write), writeback->volume->malloc_tag);
+    if (!write) {
+        callback(ENOMEM, callback_data);
+        return;
+    }
+
+    write->node             = node;
+    write->callback         = callback;
+    write->callback_data    = callback_data;
+    write->outstanding      = 1;
+    write->error            = 0;
+
+    send = NULL;
+
+    lck_mtx_lock(writeback->lock);
+    cleaned             = MIN(node->dirty, length);
+    node->dirty         -= cleaned;
+    writeback->dirty    -= cleaned;
+    lck_mtx_unlock(writeback->lock);
+
+    for (done=0; done<length; done+=piece) {
+        lustre_layout_map(layout, offset + done, &stripe, &object_offset, &run);
+        piece = MIN(run, length - done);
+
+        lck_mtx_lock(writeback->lock);
+
+        for (window = writeback->windows; window; window = window->next) {
+            if ((window->node == node) && (window->layout == layout) && (window->stripe == stripe)) {
+                break;
+            }
+        }
+        if (window && !lustre_writeback_window_fits(window, write, object_offset, (uint8_t *)data + done)) {
+            lustre_writeback_window_detach(writeback, window, &send, &writeback->stats.full);
+            window = NULL;
+        }
+
+        if (!window) {
+            lck_mtx_unlock(writeback->lock);
+            error = lustre_writeback_window_alloc(writeback, node, layout, stripe, &created);
+            if (error != 0) {
+                (void)OSCompareAndSwap(0, (UInt32)error, (volatile UInt32 *)&write->error);
+                break;
+            }
+            lck_mtx_lock(writeback->lock);
+
+            window          = created;
+            window->tick    = writeback->tick;
+            if (writeback->windows) {
+                for (next = writeback->windows; next->next; next = next->next) {
+                }
+                next->next = window;
+            } else {
+                writeback->windows = window;
+            }
+        }
+
+        piece = MIN(piece, window->brw_size - window->length);
+        lustre_writeback_window_append(writeback, window, write, object_offset, (uint8_t *)data + done, piece);
+
+        if (window->length == window->brw_size) {
+            lustre_writeback_window_detach(writeback, window, &send, &writeback->stats.full);
+        }
+
+        lck_mtx_unlock(writeback->lock);
+    }
+
+    // Pieces of a write someone is waiting for go now, and so, oldest first, does whatever is over the held limit.
+
+    lck_mtx_lock(writeback->lock);
+    if (now) {
+        for (window = writeback->windows; window; window = next) {
+            next = window->next;
+            for (i=0; i<window->write_count; i++) {
+                if (window->writes[i] == write) {
+                    lustre_writeback_window_detach(writeback, window, &send, &writeback->stats.sync);
+                    break;
+                }
+            }
+        }
+    }
+    while (writeback->held > kLustreWritebackHeldMax) {
+        lustre_writeback_window_detach(writeback, writeback->windows, &send, &writeback->stats.pressure);
+    }
+    lck_mtx_unlock(writeback->lock);
+
+    lustre_writeback_send_all(send);
+
+    lustre_writeback_write_release(writeback, write, 0);
+}
+
+// Whether the file may have data that hasn't reached its OSTs: dirty pages, or pieces held here.  I/O that bypasses the UBC has to flush
+// it first, or it would read stale data, or have its own writes overtaken by older ones.
+boolean_t lustre_writeback_is_dirty(struct lustre_writeback * writeback, struct lustre_node * node)
+{
+    struct lustre_writeback_window *    window;
+    boolean_t                           dirty;
+
+    LUSTRE_BUG_ON(!writeback);
+    LUSTRE_BUG_ON(!node);
+
+    lck_mtx_lock(writeback->lock);
+    dirty = (node->dirtied != 0);
+    for (window = writeback->windows; window && !dirty; window = window->next) {
+        dirty = (window->node == node);
+    }
+    lck_mtx_unlock(writeback->lock);
+
+    return dirty;
+}
+
+// Gets everything the file has written onto its OSTs.
+void lustre_writeback_flush(struct lustre_writeback * writeback, struct lustre_node * node, vnode_t vnode)
+{
+    struct lustre_writeback_window * send;
+
+    LUSTRE_BUG_ON(!writeback);
+    LUSTRE_BUG_ON(!node);
+    LUSTRE_BUG_ON(!vnode);
+
+    // Pushing hands every dirty page to lustre_writeback_add before it returns, so afterwards all of them are held or on their way.
+
+    (void)cluster_push(vnode, 0);
+
+    send = NULL;
+
+    lck_mtx_lock(writeback->lock);
+    lustre_writeback_clean(writeback, node);
+    lustre_writeback_detach_node(writeback, node, &send);
+    lck_mtx_unlock(writeback->lock);
+
+    lustre_writeback_send_all(send);
+
+    (void)vnode_waitforwrites(vnode, 0, 0, 0, __FUNCTION__);
+}
+
+// As lustre_writeback_flush, and returns the first error any write of the file met since the last call, as fsync and close have to.
+errno_t lustre_writeback_sync(struct lustre_writeback * writeback, struct lustre_node * node, vnode_t vnode)
+{
+    errno_t error;
+
+    lustre_writeback_flush(writeback, node, vnode);
+
+    lck_mtx_lock(writeback->lock);
+    error               = node->write_error;
+    node->write_error   = 0;
+    lck_mtx_unlock(writeback->lock);
+
+    return error;
+}
+
+// Called as node goes away.  The VFS has already written its pages, so this only drops what it still counts as dirty.
+void lustre_writeback_forget(struct lustre_writeback * writeback, struct lustre_node * node)
+{
+    struct lustre_writeback_window * window;
+
+    LUSTRE_BUG_ON(!writeback);
+    LUSTRE_BUG_ON(!node);
+
+    lck_mtx_lock(writeback->lock);
+    for (window = writeback->windows; window; window = window->next) {
+        LUSTRE_BUG_ON(window->node == node);
+    }
+    lustre_writeback_clean(writeback, node);
+    lck_mtx_unlock(writeback->lock);
+}
+
+struct lustre_writeback_stats lustre_writeback_stats(struct lustre_writeback * writeback)
+{
+    struct lustre_writeback_stats stats;
+
+    LUSTRE_BUG_ON(!writeback);
+
+    lck_mtx_lock(writeback->lock);
+    stats = writeback->stats;
+    lck_mtx_unlock(writeback->lock);
+
+    return stats;
+}
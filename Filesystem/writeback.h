@@ -0,0 +1,134 @@
+//
+//  writeback.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// Write-back.  Writes only dirty the UBC; the data goes to the OSTs later, when the cluster layer pushes it (a writer moving past a
+// cluster, fsync, close, pageout) or the flusher does (pages dirty for kLustreWritebackAgeSeconds, or too much dirty on the volume).  What
+// comes down is cut up by object and held, per object, until it makes one full-sized RPC, so small sequential writes still reach every
+// OST as brw_size bulk writes.  Held pieces never wait longer than a flusher tick, and never when someone is waiting for them.
+//
+// A write is only left dirty if each OST it touches has granted us the space for it; otherwise it is written before write returns, so
+// running out of space shows up there rather than being lost at some later flush.
+
+#ifndef lustre_writeback_h
+#define lustre_writeback_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <sys/vnode.h>
+#include <kern/locks.h>
+#include "osc.h"
+#include "io.h"
+
+static const uint64_t   kLustreWritebackFileMax             = 64 * 1024 * 1024; // dirty bytes a file may have before its writers wait
+static const uint64_t   kLustreWritebackVolumeMax           = 512 * 1024 * 1024;// likewise, for the whole volume
+static const uint64_t   kLustreWritebackHeldMax             = 64 * 1024 * 1024; // held waiting for RPCs to fill, per volume
+static const uint32_t   kLustreWritebackAgeSeconds          = 5;                // dirty pages older than this are pushed
+static const uint32_t   kLustreWritebackTickSeconds         = 1;                // flusher period
+static const uint32_t   kLustreWritebackExtentsMax          = 16;               // per RPC
+static const uint32_t   kLustreWritebackSegmentsMax         = 64;               // likewise
+static const uint32_t   kLustreWritebackRunsMax             = 16;               // clean runs a write can take grant for
+
+struct lustre_volume;
+struct lustre_node;
+struct lustre_layout;
+struct lustre_import;
+struct lustre_writeback;
+
+// A run of clean pages a write took grant for.
+struct lustre_writeback_run {
+    uint64_t                                        offset;
+    uint64_t                                        length;
+};
+
+// What lustre_writeback_reserve took, so what isn't written can be given back.
+struct lustre_writeback_reservation {
+    struct lustre_writeback_run                     runs[kLustreWritebackRunsMax];
+    uint32_t                                        count;
+};
+
+struct lustre_writeback_stats {
+    uint64_t                                        rpcs;                           // write RPCs sent
+    uint64_t                                        bytes;                          // in them
+    uint64_t                                        full;                           // RPCs sent because they were full
+    uint64_t                                        aged;                           // because they'd been held a tick
+    uint64_t                                        pressure;                       // because too much was held
+    uint64_t                                        sync;                           // because someone was waiting
+    uint64_t                                        throttled;                      // writes that waited for the dirty limits
+    uint64_t                                        ungranted;                      // writes made synchronous for want of grant
+};
+
+// One lustre_writeback_add: done when every window holding a piece of it has been written.
+struct lustre_writeback_write {
+    struct lustre_node *                            node;
+    lustre_io_callback                              callback;
+    void *                                          callback_data;
+    volatile SInt32                                 outstanding;                    // windows holding pieces, plus one while being cut up
+    volatile SInt32                                 error;
+};
+
+// Pieces bound for one object, held until they make one RPC.  Extents only ever grow upwards, as the OST wants them.
+struct lustre_writeback_window {
+    struct lustre_writeback *                       writeback;
+    struct lustre_node *                            node;
+    struct lustre_layout *                          layout;                         // with a reference
+    struct lustre_import *                          import;                         // OST holding the object, with a reference
+    uint32_t                                        stripe;
+    uint32_t                                        brw_size;
+    uint32_t                                        length;
+    uint64_t                                        tick;                           // flusher tick it was opened in
+    struct lustre_osc_extent                        extents[kLustreWritebackExtentsMax];
+    uint32_t                                        extent_count;
+    struct lustre_request_segment                   segments[kLustreWritebackSegmentsMax];
+    uint32_t                                        segment_count;
+    struct lustre_writeback_write *                 writes[kLustreWritebackSegmentsMax];
+    uint32_t                                        write_count;
+    struct lustre_writeback_window *                next;
+};
+
+struct lustre_writeback {
+    struct lustre_volume *                          volume;
+    lck_mtx_t *                                     lock;                           // protects following fields and the nodes' dirty state
+    struct lustre_writeback_window *                windows;                        // held, oldest first
+    uint64_t                                        held;                           // bytes in them
+    uint32_t                                        sending;                        // windows sent and not yet completed
+    uint64_t                                        dirty;                          // sum of the nodes' dirty
+    uint64_t                                        tick;                           // flusher ticks so far, from 1
+    boolean_t                                       stopping;
+    boolean_t                                       running;                        // the flusher thread hasn't finished
+    struct lustre_writeback_stats                   stats;
+};
+
+struct lustre_writeback *       lustre_writeback_alloc(struct lustre_volume * volume);
+void                            lustre_writeback_free(struct lustre_writeback * writeback);
+
+boolean_t                       lustre_writeback_reserve(struct lustre_writeback * writeback, struct lustre_layout * layout, vnode_t vnode, uint64_t offset, uint64_t length, struct lustre_writeback_reservation * reservation);
+void                            lustre_writeback_unreserve(struct lustre_writeback * writeback, struct lustre_layout * layout, const struct lustre_writeback_reservation * reservation, uint64_t offset);
+void                            lustre_writeback_throttle(struct lustre_writeback * writeback, struct lustre_node * node, vnode_t vnode);
+void                            lustre_writeback_dirtied(struct lustre_writeback * writeback, struct lustre_node * node, uint64_t bytes);
+void                            lustre_writeback_add(struct lustre_writeback * writeback, struct lustre_node * node, struct lustre_layout * layout, uint64_t offset, void * data, uint32_t length, boolean_t now, lustre_io_callback callback, void * callback_data);
+boolean_t                       lustre_writeback_is_dirty(struct lustre_writeback * writeback, struct lustre_node * node);
+void                            lustre_writeback_flush(struct lustre_writeback * writeback, struct lustre_node * node, vnode_t vnode);
+errno_t                         lustre_writeback_sync(struct lustre_writeback * writeback, struct lustre_node * node, vnode_t vnode);
+void                            lustre_writeback_forget(struct lustre_writeback * writeback, struct lustre_node * node);
+struct lustre_writeback_stats   lustre_writeback_stats(struct lustre_writeback * writeback);
+
+#endif /* lustre_writeback_h */
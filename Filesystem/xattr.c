@@ -0,0 +1,667 @@
+//
+//  xattr.c
+//  Lustre
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <libkern/libkern.h>
+#include <libkern/OSAtomic.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/xattr.h>
+#include <kern/clock.h>
+#include <string.h>
+
+#include "lustre.h"
+#include "xattr.h"
+#include "volume.h"
+#include "import.h"
+#include "mdc.h"
+#include "dlm.h"
+#include "request.h"
+#include "logging.h"
+#include "assert.h"
+
+static const char       kLustreXattrNamespace[]             = "user.";          // where our names live on the server
+static const size_t     kLustreXattrNamespaceLength         = sizeof(kLustreXattrNamespace) - 1;
+
+// One fetch of the whole set, in flight.
+struct lustre_xattr_fetch {
+    struct lustre_xattr *           xattr;                      // with a reference
+    struct lustre_dlm_lock *        lock;                       // until the reply has been interpreted
+    uint32_t                        generation;                 // of the set when the fetch started
+};
+
+#pragma mark - Internal
+
+static void lustre_xattr_free(struct lustre_xattr * xattr)
+{
+    struct lustre_volume * volume;
+
+    volume = xattr->volume;
+
+    lustre_mdc_xattrs_release(&xattr->xattrs, volume->malloc_tag);
+
+    lck_mtx_free(xattr->lock, volume->lock_group);
+    OSFree(xattr, sizeof(struct lustre_xattr), volume->malloc_tag);
+}
+
+// Caller holds the lock.
+static boolean_t lustre_xattr_is_ready(struct lustre_xattr * xattr)
+{
+    uint64_t now;
+
+    if (xattr->state != kLustreXattrReady) {
+        return FALSE;
+    }
+    if (xattr->dlm_lock) {
+        return TRUE;
+    }
+
+    clock_get_uptime(&now);
+
+    return now < xattr->expires;
+}
+
+// Caller holds the lock.  Forgets the set; the lock that kept it, if any, is handed back for the caller to cancel once the lock is
+// dropped, since cancelling waits for revoke callbacks, which take the lock.
+static struct lustre_dlm_lock * lustre_xattr_drop(struct lustre_xattr * xattr)
+{
+    struct lustre_dlm_lock * lock;
+
+    lock                = xattr->dlm_lock;
+    xattr->dlm_lock     = NULL;
+    xattr->generation   += 1;
+    if (xattr->state == kLustreXattrReady) {
+        lustre_mdc_xattrs_release(&xattr->xattrs, xattr->volume->malloc_tag);
+        xattr->state = kLustreXattrEmpty;
+    }
+
+    return lock;
+}
+
+// Caller holds the lock.  Finds name, a full server name, in the set, which must be ready.
+static boolean_t lustre_xattr_find(struct lustre_xattr * xattr, const char * name, const uint8_t ** value, uint32_t * length)
+{
+    const char *    next;
+    uint32_t        offset;
+    uint32_t        i;
+
+    next    = xattr->xattrs.names;
+    offset  = 0;
+    for (i=0; i<xattr->xattrs.count; i++) {
+        if (strcmp(next, name) == 0) {
+            *value  = xattr->xattrs.values + offset;
+            *length = xattr->xattrs.lengths[i];
+            return TRUE;
+        }
+        next    += strlen(next) + 1;
+        offset  += xattr->xattrs.lengths[i];
+    }
+
+    return FALSE;
+}
+
+// Makes the server's name for one of ours.
+static errno_t lustre_xattr_server_name(const char * name, char * buffer, size_t size)
+{
+    size_t length;
+
+    length = strlen(name);
+    if ((length == 0) || (length > XATTR_MAXNAMELEN)) {
+        return (length == 0) ? EINVAL : ENAMETOOLONG;
+    }
+    if (kLustreXattrNamespaceLength + length + 1 > size) {
+        return ENAMETOOLONG;
+    }
+
+    memcpy(buffer, kLustreXattrNamespace, kLustreXattrNamespaceLength);
+    memcpy(buffer + kLustreXattrNamespaceLength, name, length + 1);
+
+    return 0;
+}
+
+// The MDT wants the XATTR lock back: someone is about to change the file's extended attributes, so the set we kept is going stale.
+static void lustre_xattr_revoked(struct lustre_dlm_lock * lock, void * data)
+{
+    struct lustre_xattr *   xattr;
+    boolean_t               release;
+
+    xattr   = (struct lustre_xattr *)data;
+    release = FALSE;
+
+    lck_mtx_lock(xattr->lock);
+    if (xattr->dlm_lock == lock) {
+        (void)lustre_xattr_drop(xattr);
+        release = TRUE;
+    }
+    lck_mtx_unlock(xattr->lock);
+
+    if (release) {
+        lustre_dlm_lock_ref_count_dec(lock);
+    }
+}
+
+// Runs on the network layer's completion path once the MDT has answered: installs the set, and keeps the lock if one was granted, unless
+// the set was invalidated while the fetch was in flight.  Anyone waiting for the fetch is woken either way.
+static void lustre_xattr_fetched(struct lustre_request * request, void * data)
+{
+    struct lustre_xattr_fetch *     fetch;
+    struct lustre_xattr *           xattr;
+    struct lustre_volume *          volume;
+    struct lustre_mdc_xattrs        xattrs;
+    struct lustre_dlm_lock *        lock;
+    struct lustre_dlm_lock *        release;
+    errno_t                         error;
+
+    fetch   = (struct lustre_xattr_fetch *)data;
+    xattr   = fetch->xattr;
+    volume  = xattr->volume;
+
+    error       = lustre_mdc_getxattr_interpret(request, fetch->lock, volume->malloc_tag, &xattrs, &lock);
+    fetch->lock = NULL;
+    release     = lock;
+
+    lck_mtx_lock(xattr->lock);
+
+    LUSTRE_BUG_ON(xattr->state != kLustreXattrFetching);
+
+    xattr->state = kLustreXattrEmpty;
+    if (fetch->generation != xattr->generation) {
+        // Invalidated meanwhile; whoever is waiting fetches again.
+    } else if (error == 0) {
+        xattr->xattrs   = xattrs;
+        xattr->state    = kLustreXattrReady;
+        bzero(&xattrs, sizeof(xattrs));
+
+        if (lock && lustre_dlm_lock_set_revoke(lock, lustre_xattr_revoked, xattr)) {
+            xattr->dlm_lock = lock;
+            release         = NULL;
+        } else {
+            clock_interval_to_deadline(kLustreXattrTTLMilliseconds, kMillisecondScale, &xattr->expires);
+        }
+    } else if ((error == ERANGE) && !xattr->large) {
+        xattr->large = TRUE;
+    } else {
+        xattr->error = error;
+    }
+
+    if (xattr->waiting) {
+        xattr->waiting = FALSE;
+        wakeup(xattr);
+    }
+
+    lck_mtx_unlock(xattr->lock);
+
+    if (error == 0) {
+        lustre_mdc_xattrs_release(&xattrs, volume->malloc_tag);
+    }
+    if (release) {
+        lustre_dlm_lock_cancel(release);
+        lustre_dlm_lock_ref_count_dec(release);
+    }
+
+    OSFree(fetch, sizeof(struct lustre_xattr_fetch), volume->malloc_tag);
+    lustre_xattr_ref_count_dec(xattr);
+}
+
+// Sends the getxattr intent.  Returns an error only if it couldn't be sent; otherwise lustre_xattr_fetched runs exactly once.
+static errno_t lustre_xattr_fetch_send(struct lustre_xattr * xattr, uint32_t generation, uint32_t size)
+{
+    struct lustre_volume *          volume;
+    struct lustre_xattr_fetch *     fetch;
+    struct lustre_import *          import;
+    struct lustre_request *         request;
+    errno_t                         error;
+
+    volume = xattr->volume;
+
+    fetch = OSMalloc(sizeof(struct lustre_xattr_fetch), volume->malloc_tag);
+    if (!fetch) {
+        return ENOMEM;
+    }
+
+    bzero(fetch, sizeof(struct lustre_xattr_fetch));
+    fetch->xattr        = xattr;
+    fetch->generation   = generation;
+
+    error = lustre_volume_fid_import(volume, &xattr->fid, &import);
+    if (error != 0) {
+        OSFree(fetch, sizeof(struct lustre_xattr_fetch), volume->malloc_tag);
+        return error;
+    }
+
+    error = lustre_mdc_getxattr_prepare(import, volume->dlm, &xattr->fid, size, &request, &fetch->lock);
+    lustre_import_ref_count_dec(import);
+    if (error != 0) {
+        OSFree(fetch, sizeof(struct lustre_xattr_fetch), volume->malloc_tag);
+        return error;
+    }
+
+    lustre_xattr_ref_count_inc(xattr);
+    lustre_request_set_callback(request, lustre_xattr_fetched, fetch);
+
+    // A failure to send completes the request, so the callback hears about it.
+
+    (void)lustre_request_send_async(request);
+    lustre_request_ref_count_dec(request);
+
+    return 0;
+}
+
+// Caller holds the lock, and has found the set neither ready nor being fetched.  Starts fetching it, dropping the lock meanwhile.
+static void lustre_xattr_fetch(struct lustre_xattr * xattr)
+{
+    uint32_t    generation;
+    uint32_t    size;
+    errno_t     error;
+
+    LUSTRE_BUG_ON(xattr->state == kLustreXattrFetching);
+    LUSTRE_BUG_ON(xattr->dlm_lock);
+
+    // A set fetched without a lock that has outlived its time goes now.
+
+    lustre_mdc_xattrs_release(&xattr->xattrs, xattr->volume->malloc_tag);
+
+    xattr->state    = kLustreXattrFetching;
+    xattr->error    = 0;
+    generation      = xattr->generation;
+    size            = xattr->large ? kLustreXattrFetchSizeMax : kLustreXattrFetchSize;
+
+    lck_mtx_unlock(xattr->lock);
+    error = lustre_xattr_fetch_send(xattr, generation, size);
+    lck_mtx_lock(xattr->lock);
+
+    if (error != 0) {
+        xattr->state = kLustreXattrEmpty;
+        xattr->error = error;
+        if (xattr->waiting) {
+            xattr->waiting = FALSE;
+            wakeup(xattr);
+        }
+    }
+}
+
+// Returns 0 with the lock held and the set ready, fetching it if need be, or the error the fetch failed with, with the lock dropped.
+static errno_t lustre_xattr_lock_ready(struct lustre_xattr * xattr)
+{
+    errno_t error;
+
+    lck_mtx_lock(xattr->lock);
+
+    while (!lustre_xattr_is_ready(xattr)) {
+        if (xattr->state != kLustreXattrFetching) {
+            lustre_xattr_fetch(xattr);
+        }
+        while (xattr->state == kLustreXattrFetching) {
+            xattr->waiting = TRUE;
+            msleep(xattr, xattr->lock, PINOD, __FUNCTION__, NULL);
+        }
+        if ((xattr->state == kLustreXattrEmpty) && (xattr->error != 0)) {
+            error = xattr->error;
+            lck_mtx_unlock(xattr->lock);
+            return error;
+        }
+    }
+
+    return 0;
+}
+
+#pragma mark - External
+
+struct lustre_xattr * lustre_xattr_alloc(struct lustre_volume * volume, const struct lu_fid * fid)
+{
+    struct lustre_xattr * xattr;
+
+    LUSTRE_BUG_ON(!volume);
+    LUSTRE_BUG_ON(!fid);
+
+    xattr = OSMalloc(sizeof(struct lustre_xattr), volume->malloc_tag);
+    if (!xattr) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate xattr cache");
+        return NULL;
+    }
+
+    bzero(xattr, sizeof(struct lustre_xattr));
+
+    xattr->volume       = volume;
+    xattr->fid          = *fid;
+    xattr->ref_count    = 1;
+
+    xattr->lock = lck_mtx_alloc_init(volume->lock_group, NULL);
+    if (!xattr->lock) {
+        os_log_error(lustre_logger_vfs, "Couldn't allocate xattr cache lock");
+        OSFree(xattr, sizeof(struct lustre_xattr), volume->malloc_tag);
+        return NULL;
+    }
+
+    return xattr;
+}
+
+void lustre_xattr_ref_count_inc(struct lustre_xattr * xattr)
+{
+    LUSTRE_BUG_ON(!xattr);
+
+    OSIncrementAtomic(&xattr->ref_count);
+}
+
+// The last reference gives back the XATTR lock, if we kept one.
+void lustre_xattr_ref_count_dec(struct lustre_xattr * xattr)
+{
+    int32_t count;
+
+    LUSTRE_BUG_ON(!xattr);
+
+    count = OSDecrementAtomic(&xattr->ref_count);
+
+    if (count == 1) {
+        lustre_xattr_invalidate(xattr);
+        lustre_xattr_free(xattr);
+    }
+}
+
+// Starts fetching the set in the background unless it's ready or on its way already.  Whoever asks for an attribute next waits for it
+// rather than asking again.
+void lustre_xattr_prefetch(struct lustre_xattr * xattr)
+{
+    LUSTRE_BUG_ON(!xattr);
+
+    lck_mtx_lock(xattr->lock);
+    if (!lustre_xattr_is_ready(xattr) && (xattr->state != kLustreXattrFetching)) {
+        lustre_xattr_fetch(xattr);
+    }
+    lck_mtx_unlock(xattr->lock);
+}
+
+// Forgets the set, and gives back the lock that kept it.  A fetch in flight is dropped when it lands.
+void lustre_xattr_invalidate(struct lustre_xattr * xattr)
+{
+    struct lustre_dlm_lock * lock;
+
+    LUSTRE_BUG_ON(!xattr);
+
+    lck_mtx_lock(xattr->lock);
+    lock = lustre_xattr_drop(xattr);
+    lck_mtx_unlock(xattr->lock);
+
+    if (lock) {
+        lustre_dlm_lock_cancel(lock);
+        lustre_dlm_lock_ref_count_dec(lock);
+    }
+}
+
+// Reads our attribute name into uio, or with uio NULL returns its size in *size.  Names the file doesn't have are ENOATTR, found in the
+// set like any other answer.  Only the resource fork may be read from somewhere other than its start, and a short read of it isn't ERANGE.
+errno_t lustre_xattr_get(struct lustre_xattr * xattr, const char * name, uio_t uio, size_t * size)
+{
+    char            server_name[sizeof(kLustreXattrNamespace) + XATTR_MAXNAMELEN];
+    const uint8_t * value;
+    uint8_t *       copy;
+    uint32_t        length;
+    off_t           offset;
+    uint32_t        count;
+    boolean_t       fork;
+    errno_t         error;
+
+    LUSTRE_BUG_ON(!xattr);
+    LUSTRE_BUG_ON(!name);
+    LUSTRE_BUG_ON(!uio && !size);
+
+    error = lustre_xattr_server_name(name, server_name, sizeof(server_name));
+    if (error != 0) {
+        return error;
+    }
+
+    fork    = (strcmp(name, XATTR_RESOURCEFORK_NAME) == 0);
+    offset  = uio ? uio_offset(uio) : 0;
+    if ((offset < 0) || ((offset != 0) && !fork)) {
+        return EINVAL;
+    }
+
+    error = lustre_xattr_lock_ready(xattr);
+    if (error != 0) {
+        return error;
+    }
+
+    if (!lustre_xattr_find(xattr, server_name, &value, &length)) {
+        lck_mtx_unlock(xattr->lock);
+        return ENOATTR;
+    }
+
+    if (!uio) {
+        *size = length;
+        lck_mtx_unlock(xattr->lock);
+        return 0;
+    }
+
+    if (!fork && (uio_resid(uio) < length)) {
+        lck_mtx_unlock(xattr->lock);
+        return ERANGE;
+    }
+
+    // The value is copied out of the set so the lock isn't held across faulting in the caller's buffer.
+
+    count   = (offset < length) ? (uint32_t)MIN((user_ssize_t)(length - offset), uio_resid(uio)) : 0;
+    copy    = NULL;
+    if (count > 0) {
+        copy = OSMalloc(count, xattr->volume->malloc_tag);
+        if (copy) {
+            memcpy(copy, value + offset, count);
+        }
+    }
+
+    lck_mtx_unlock(xattr->lock);
+
+    if (count == 0) {
+        return 0;
+    }
+    if (!copy) {
+        return ENOMEM;
+    }
+
+    error = uiomove((const char *)copy, (int)count, uio);
+    OSFree(copy, count, xattr->volume->malloc_tag);
+
+    return error;
+}
+
+// Lists our names, each terminated, into uio, or with uio NULL returns the size of the list in *size.
+errno_t lustre_xattr_list(struct lustre_xattr * xattr, uio_t uio, size_t * size)
+{
+    const char *    next;
+    char *          list;
+    size_t          total;
+    size_t          length;
+    uint32_t        i;
+    errno_t         error;
+
+    LUSTRE_BUG_ON(!xattr);
+    LUSTRE_BUG_ON(!uio && !size);
+
+    error = lustre_xattr_lock_ready(xattr);
+    if (error != 0) {
+        return error;
+    }
+
+    total = 0;
+    next  = xattr->xattrs.names;
+    for (i=0; i<xattr->xattrs.count; i++) {
+        length = strlen(next);
+        if ((length > kLustreXattrNamespaceLength) && (strncmp(next, kLustreXattrNamespace, kLustreXattrNamespaceLength) == 0)) {
+            total += length - kLustreXattrNamespaceLength + 1;
+        }
+        next += length + 1;
+    }
+
+    if (!uio) {
+        *size = total;
+        lck_mtx_unlock(xattr->lock);
+        return 0;
+    }
+    if (uio_resid(uio) < (user_ssize_t)total) {
+        lck_mtx_unlock(xattr->lock);
+        return ERANGE;
+    }
+    if (total == 0) {
+        lck_mtx_unlock(xattr->lock);
+        return 0;
+    }
+
+    list = OSMalloc((uint32_t)total, xattr->volume->malloc_tag);
+    if (!list) {
+        lck_mtx_unlock(xattr->lock);
+        return ENOMEM;
+    }
+
+    total = 0;
+    next  = xattr->xattrs.names;
+    for (i=0; i<xattr->xattrs.count; i++) {
+        length = strlen(next);
+        if ((length > kLustreXattrNamespaceLength) && (strncmp(next, kLustreXattrNamespace, kLustreXattrNamespaceLength) == 0)) {
+            memcpy(list + total, next + kLustreXattrNamespaceLength, length - kLustreXattrNamespaceLength + 1);
+            total += length - kLustreXattrNamespaceLength + 1;
+        }
+        next += length + 1;
+    }
+
+    lck_mtx_unlock(xattr->lock);
+
+    error = uiomove(list, (int)total, uio);
+    OSFree(list, (uint32_t)total, xattr->volume->malloc_tag);
+
+    return error;
+}
+
+// Sets our attribute name to what uio holds.  options are XATTR_CREATE and XATTR_REPLACE.  The resource fork may be written somewhere
+// other than its start, which rewrites the whole of it with the new bytes in place.  The set is forgotten afterwards; the MDT will have
+// called our lock back anyway.
+errno_t lustre_xattr_set(struct lustre_xattr * xattr, const char * name, uio_t uio, int options)
+{
+    char                    server_name[sizeof(kLustreXattrNamespace) + XATTR_MAXNAMELEN];
+    struct lustre_import *  import;
+    const uint8_t *         value;
+    uint8_t *               buffer;
+    uint32_t                old_length;
+    uint32_t                length;
+    user_ssize_t            resid;
+    off_t                   offset;
+    uint32_t                flags;
+    errno_t                 error;
+
+    LUSTRE_BUG_ON(!xattr);
+    LUSTRE_BUG_ON(!name);
+    LUSTRE_BUG_ON(!uio);
+
+    error = lustre_xattr_server_name(name, server_name, sizeof(server_name));
+    if (error != 0) {
+        return error;
+    }
+
+    offset  = uio_offset(uio);
+    resid   = uio_resid(uio);
+    if ((offset < 0) || ((offset != 0) && (strcmp(name, XATTR_RESOURCEFORK_NAME) != 0))) {
+        return EINVAL;
+    }
+    if ((resid < 0) || (offset + resid > kLustreXattrValueMax)) {
+        return E2BIG;
+    }
+
+    flags = 0;
+    if (options & XATTR_CREATE) {
+        flags |= kLustreXattrFlagCreate;
+    }
+    if (options & XATTR_REPLACE) {
+        flags |= kLustreXattrFlagReplace;
+    }
+
+    // Writing into the middle of the fork keeps what's there around the new bytes.
+
+    value       = NULL;
+    old_length  = 0;
+    if (offset > 0) {
+        error = lustre_xattr_lock_ready(xattr);
+        if (error != 0) {
+            return error;
+        }
+        if (!lustre_xattr_find(xattr, server_name, &value, &old_length) || (old_length < offset)) {
+            lck_mtx_unlock(xattr->lock);
+            return EINVAL;
+        }
+    }
+
+    length = MAX(old_length, (uint32_t)(offset + resid));
+    buffer = OSMalloc(MAX(length, 1), xattr->volume->malloc_tag);
+    if (buffer && value) {
+        memcpy(buffer, value, old_length);
+    }
+    if (offset > 0) {
+        lck_mtx_unlock(xattr->lock);
+    }
+    if (!buffer) {
+        return ENOMEM;
+    }
+
+    error = uiomove((char *)buffer + offset, (int)resid, uio);
+    if (error != 0) {
+        goto end;
+    }
+
+    error = lustre_volume_fid_import(xattr->volume, &xattr->fid, &import);
+    if (error != 0) {
+        goto end;
+    }
+
+    error = lustre_mdc_setxattr(import, &xattr->fid, server_name, buffer, length, flags);
+    lustre_import_ref_count_dec(import);
+
+    lustre_xattr_invalidate(xattr);
+
+end:
+    OSFree(buffer, MAX(length, 1), xattr->volume->malloc_tag);
+
+    return error;
+}
+
+// Removes our attribute name.  The set is forgotten afterwards, as for lustre_xattr_set.
+errno_t lustre_xattr_remove(struct lustre_xattr * xattr, const char * name)
+{
+    char                    server_name[sizeof(kLustreXattrNamespace) + XATTR_MAXNAMELEN];
+    struct lustre_import *  import;
+    errno_t                 error;
+
+    LUSTRE_BUG_ON(!xattr);
+    LUSTRE_BUG_ON(!name);
+
+    error = lustre_xattr_server_name(name, server_name, sizeof(server_name));
+    if (error != 0) {
+        return error;
+    }
+
+    error = lustre_volume_fid_import(xattr->volume, &xattr->fid, &import);
+    if (error != 0) {
+        return error;
+    }
+
+    error = lustre_mdc_setxattr(import, &xattr->fid, server_name, NULL, 0, 0);
+    lustre_import_ref_count_dec(import);
+
+    lustre_xattr_invalidate(xattr);
+
+    return error;
+}
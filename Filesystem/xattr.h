@@ -0,0 +1,82 @@
+//
+//  xattr.h
+//  Filesystem
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Extended attribute cache.  A file's extended attributes are fetched from the MDT all at once, names and values together, and kept under
+// a PR lock on its XATTR bit, so every later getxattr and listxattr (and so every name a file turns out not to have) is answered without
+// asking again until the MDT calls the lock back, which it does before anyone changes them.  The first getattr of a node starts the
+// fetch, so by the time Finder asks for com.apple.FinderInfo and friends the answers are usually here.
+//
+// Our names live in the server's "user." namespace: com.apple.FinderInfo is user.com.apple.FinderInfo there, and names in the other
+// namespaces (the layout, ACLs, security labels) aren't ours to see.
+
+#ifndef lustre_xattr_h
+#define lustre_xattr_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <kern/locks.h>
+#include "wire.h"
+#include "mdc.h"
+
+static const uint32_t   kLustreXattrFetchSize               = 16 * 1024;        // for the names, and for the values, of most files
+static const uint32_t   kLustreXattrFetchSizeMax            = 256 * 1024;       // for files whose attributes didn't fit
+static const uint32_t   kLustreXattrValueMax                = 64 * 1024;        // largest value the server takes
+static const uint32_t   kLustreXattrTTLMilliseconds         = 1000;             // a set fetched without a lock is good this long
+
+struct lustre_volume;
+struct lustre_dlm_lock;
+
+enum lustre_xattr_state {
+    kLustreXattrEmpty                               = 0,
+    kLustreXattrFetching,
+    kLustreXattrReady,
+};
+
+struct lustre_xattr {
+    struct lustre_volume *                          volume;
+    struct lu_fid                                   fid;
+    lck_mtx_t *                                     lock;                           // protects following fields
+    enum lustre_xattr_state                         state;
+    boolean_t                                       waiting;
+    boolean_t                                       large;                          // the set didn't fit kLustreXattrFetchSize
+    errno_t                                         error;                          // of the last fetch, for whoever waited on it
+    uint32_t                                        generation;                     // bumped on invalidation; stale fetches are dropped
+    struct lustre_mdc_xattrs                        xattrs;                         // when ready
+    struct lustre_dlm_lock *                        dlm_lock;                       // keeps xattrs good, or NULL if the MDT wouldn't grant it
+    uint64_t                                        expires;                        // and then xattrs are good until this uptime
+
+    int32_t                                         ref_count;                      // the node's, plus one per fetch in flight
+};
+
+struct lustre_xattr *   lustre_xattr_alloc(struct lustre_volume * volume, const struct lu_fid * fid);
+void                    lustre_xattr_ref_count_inc(struct lustre_xattr * xattr);
+void                    lustre_xattr_ref_count_dec(struct lustre_xattr * xattr);
+
+void                    lustre_xattr_prefetch(struct lustre_xattr * xattr);
+void                    lustre_xattr_invalidate(struct lustre_xattr * xattr);
+
+errno_t                 lustre_xattr_get(struct lustre_xattr * xattr, const char * name, uio_t uio, size_t * size);
+errno_t                 lustre_xattr_list(struct lustre_xattr * xattr, uio_t uio, size_t * size);
+errno_t                 lustre_xattr_set(struct lustre_xattr * xattr, const char * name, uio_t uio, int options);
+errno_t                 lustre_xattr_remove(struct lustre_xattr * xattr, const char * name);
+
+#endif /* lustre_xattr_h */
@@ -0,0 +1,214 @@
+//
+//  checksum_test.c
+//  Filesystem Test
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <kern/clock.h>
+#include "test.h"
+#include "checksum.h"
+
+static const size_t     kLustreChecksumTestBufferSize       = 1024 * 1024;
+static const uint32_t   kLustreChecksumTestRounds           = 64;               // times through the buffer when measuring throughput
+
+static uint8_t lustre_checksum_test_buffer[1024 * 1024 + 8];
+
+// A byte at a time, straight from the definitions, for the fast paths to be checked against.
+static uint32_t lustre_checksum_test_crc32c(uint32_t crc, const uint8_t * data, size_t length)
+{
+    uint32_t i;
+
+    crc = ~crc;
+    while (length-- > 0) {
+        crc ^= *data++;
+        for (i=0; i<8; i++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+    }
+
+    return ~crc;
+}
+
+static uint32_t lustre_checksum_test_adler32(uint32_t adler, const uint8_t * data, size_t length)
+{
+    uint32_t s1;
+    uint32_t s2;
+
+    s1 = adler & 0xffff;
+    s2 = adler >> 16;
+    while (length-- > 0) {
+        s1 = (s1 + *data++) % 65521;
+        s2 = (s2 + s1) % 65521;
+    }
+
+    return (s2 << 16) | s1;
+}
+
+static void lustre_checksum_test_fill(void)
+{
+    uint64_t    state;
+    size_t      i;
+
+    state = 0x9e3779b97f4a7c15ULL;
+    for (i=0; i<sizeof(lustre_checksum_test_buffer); i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        lustre_checksum_test_buffer[i] = (uint8_t)state;
+    }
+}
+
+// Bytes per second, given how long it took to do length bytes.
+static uint64_t lustre_checksum_test_rate(uint64_t start, uint64_t length)
+{
+    uint64_t nanoseconds;
+
+    absolutetime_to_nanoseconds(mach_absolute_time() - start, &nanoseconds);
+
+    return (nanoseconds > 0) ? (length * NSEC_PER_SEC) / nanoseconds : 0;
+}
+
+LUSTRE_TEST(checksum, crc32c_check_value)
+{
+    LUSTRE_ASSERT_EQUAL(lustre_crc32c(kLustreCRC32CInit, "123456789", 9), 0xe3069283, "0x%08x");
+    LUSTRE_ASSERT_EQUAL(lustre_crc32c(kLustreCRC32CInit, NULL, 0), 0, "0x%08x");
+}
+
+LUSTRE_TEST(checksum, adler32_check_value)
+{
+    LUSTRE_ASSERT_EQUAL(lustre_adler32(kLustreAdler32Init, "123456789", 9), 0x091e01de, "0x%08x");
+    LUSTRE_ASSERT_EQUAL(lustre_adler32(kLustreAdler32Init, NULL, 0), 1, "0x%08x");
+}
+
+// Every length up to a few lanes' worth and every alignment, so each path and each tail is taken.
+LUSTRE_TEST(checksum, crc32c_matches_reference)
+{
+    size_t      length;
+    size_t      offset;
+    uint32_t    expected;
+
+    lustre_checksum_test_fill();
+
+    for (offset=0; offset<8; offset++) {
+        for (length=0; length<4 * 1024; length += (length < 64) ? 1 : 61) {
+            expected = lustre_checksum_test_crc32c(kLustreCRC32CInit, lustre_checksum_test_buffer + offset, length);
+            LUSTRE_ASSERT_EQUAL(lustre_crc32c(kLustreCRC32CInit, lustre_checksum_test_buffer + offset, length), expected, "0x%08x");
+        }
+        expected = lustre_checksum_test_crc32c(kLustreCRC32CInit, lustre_checksum_test_buffer + offset, kLustreChecksumTestBufferSize);
+        LUSTRE_ASSERT_EQUAL(lustre_crc32c(kLustreCRC32CInit, lustre_checksum_test_buffer + offset, kLustreChecksumTestBufferSize), expected, "0x%08x");
+    }
+}
+
+LUSTRE_TEST(checksum, adler32_matches_reference)
+{
+    size_t      length;
+    size_t      offset;
+    uint32_t    expected;
+
+    lustre_checksum_test_fill();
+
+    for (offset=0; offset<8; offset++) {
+        for (length=0; length<4 * 1024; length += (length < 64) ? 1 : 61) {
+            expected = lustre_checksum_test_adler32(kLustreAdler32Init, lustre_checksum_test_buffer + offset, length);
+            LUSTRE_ASSERT_EQUAL(lustre_adler32(kLustreAdler32Init, lustre_checksum_test_buffer + offset, length), expected, "0x%08x");
+        }
+        expected = lustre_checksum_test_adler32(kLustreAdler32Init, lustre_checksum_test_buffer + offset, kLustreChecksumTestBufferSize);
+        LUSTRE_ASSERT_EQUAL(lustre_adler32(kLustreAdler32Init, lustre_checksum_test_buffer + offset, kLustreChecksumTestBufferSize), expected, "0x%08x");
+    }
+}
+
+// The buffer cut into uneven pieces, checksummed as segments and folded from per-piece checksums, must give what the whole buffer does.
+LUSTRE_TEST(checksum, segments_and_combine)
+{
+    struct lustre_checksum_segment  segments[5];
+    uint32_t                        lengths[5] = { 1, 4095, 4096, 12289, 100000 };
+    uint32_t                        crc;
+    uint32_t                        adler;
+    size_t                          offset;
+    uint32_t                        i;
+
+    lustre_checksum_test_fill();
+
+    crc     = kLustreCRC32CInit;
+    adler   = kLustreAdler32Init;
+    offset  = 0;
+    for (i=0; i<5; i++) {
+        segments[i].data    = lustre_checksum_test_buffer + offset;
+        segments[i].length  = lengths[i];
+        crc                 = lustre_crc32c_combine(crc, lustre_crc32c(kLustreCRC32CInit, segments[i].data, lengths[i]), lengths[i]);
+        adler               = lustre_adler32_combine(adler, lustre_adler32(kLustreAdler32Init, segments[i].data, lengths[i]), lengths[i]);
+        offset              += lengths[i];
+    }
+
+    LUSTRE_ASSERT_EQUAL(lustre_crc32c_segments(kLustreCRC32CInit, segments, 5), lustre_crc32c(kLustreCRC32CInit, lustre_checksum_test_buffer, offset), "0x%08x");
+    LUSTRE_ASSERT_EQUAL(crc, lustre_crc32c(kLustreCRC32CInit, lustre_checksum_test_buffer, offset), "0x%08x");
+    LUSTRE_ASSERT_EQUAL(lustre_adler32_segments(kLustreAdler32Init, segments, 5), lustre_adler32(kLustreAdler32Init, lustre_checksum_test_buffer, offset), "0x%08x");
+    LUSTRE_ASSERT_EQUAL(adler, lustre_adler32(kLustreAdler32Init, lustre_checksum_test_buffer, offset), "0x%08x");
+}
+
+// Not a pass/fail measure, since it depends on the machine: logs the rate of each checksum next to the reference's, and only checks that
+// the answers agree.
+LUSTRE_TEST(checksum, throughput)
+{
+    uint64_t    start;
+    uint64_t    total;
+    uint64_t    rates[4];
+    uint32_t    crc;
+    uint32_t    adler;
+    uint32_t    expected_crc;
+    uint32_t    expected_adler;
+    uint32_t    i;
+
+    lustre_checksum_test_fill();
+
+    total = (uint64_t)kLustreChecksumTestBufferSize * kLustreChecksumTestRounds;
+
+    crc     = kLustreCRC32CInit;
+    start   = mach_absolute_time();
+    for (i=0; i<kLustreChecksumTestRounds; i++) {
+        crc = lustre_crc32c(crc, lustre_checksum_test_buffer, kLustreChecksumTestBufferSize);
+    }
+    rates[0] = lustre_checksum_test_rate(start, total);
+
+    adler   = kLustreAdler32Init;
+    start   = mach_absolute_time();
+    for (i=0; i<kLustreChecksumTestRounds; i++) {
+        adler = lustre_adler32(adler, lustre_checksum_test_buffer, kLustreChecksumTestBufferSize);
+    }
+    rates[1] = lustre_checksum_test_rate(start, total);
+
+    expected_crc    = kLustreCRC32CInit;
+    start           = mach_absolute_time();
+    for (i=0; i<kLustreChecksumTestRounds; i++) {
+        expected_crc = lustre_checksum_test_crc32c(expected_crc, lustre_checksum_test_buffer, kLustreChecksumTestBufferSize);
+    }
+    rates[2] = lustre_checksum_test_rate(start, total);
+
+    expected_adler  = kLustreAdler32Init;
+    start           = mach_absolute_time();
+    for (i=0; i<kLustreChecksumTestRounds; i++) {
+        expected_adler = lustre_checksum_test_adler32(expected_adler, lustre_checksum_test_buffer, kLustreChecksumTestBufferSize);
+    }
+    rates[3] = lustre_checksum_test_rate(start, total);
+
+    printf("lustre checksum: crc32c %llu MB/s (%s, reference %llu MB/s), adler32 %llu MB/s (reference %llu MB/s)\n", rates[0] / 1000000, lustre_crc32c_is_accelerated() ? "crc instruction" : "tables", rates[2] / 1000000, rates[1] / 1000000, rates[3] / 1000000);
+
+    LUSTRE_ASSERT_EQUAL(crc, expected_crc, "0x%08x");
+    LUSTRE_ASSERT_EQUAL(adler, expected_adler, "0x%08x");
+}
@@ -0,0 +1,294 @@
+//
+//  dir_test.c
+//  Filesystem Test
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <sys/errno.h>
+#include <sys/stat.h>
+#include <sys/dirent.h>
+#include "test.h"
+#include "dir.h"
+
+struct lustre_dir_test_entry {
+    uint64_t        hash;
+    const char *    name;
+};
+
+struct lustre_dir_test_walk {
+    uint64_t        hashes[8];
+    uint64_t        next_hashes[8];
+    uint8_t         types[8];
+    uint32_t        count;
+    uint32_t        limit;                                                          // entries taken before refusing with ENOBUFS
+};
+
+static uint8_t lustre_dir_test_pages[3][4096];
+
+// Lays out a directory page the way the MDT sends it.
+static void lustre_dir_test_page(uint8_t * data, uint64_t hash_start, uint64_t hash_end, uint32_t flags, const struct lustre_dir_test_entry * entries, uint32_t count)
+{
+    struct lu_dirpage * page;
+    struct lu_dirent *  entry;
+    struct luda_type *  type;
+    uint32_t            namelen;
+    uint32_t            length;
+    uint32_t            i;
+
+    bzero(data, kLustreDirPageSize);
+
+    page                    = (struct lu_dirpage *)data;
+    page->ldp_hash_start    = hash_start;
+    page->ldp_hash_end      = hash_end;
+    page->ldp_flags         = flags;
+
+    entry = page->ldp_entries;
+    for (i=0; i<count; i++) {
+        namelen             = (uint32_t)strlen(entries[i].name);
+        length              = (sizeof(struct lu_dirent) + ((namelen + 1) & ~1) + sizeof(struct luda_type) + 7) & ~7;
+        entry->lde_fid      = (struct lu_fid){ 0x200000400ULL, i + 1, 0 };
+        entry->lde_hash     = entries[i].hash;
+        entry->lde_reclen   = (i + 1 < count) ? length : 0;
+        entry->lde_namelen  = namelen;
+        entry->lde_attrs    = kLustreDirentAttrFid | kLustreDirentAttrType;
+        memcpy(entry->lde_name, entries[i].name, namelen);
+        type                = (struct luda_type *)(entry->lde_name + ((namelen + 1) & ~1));
+        type->lt_type       = S_IFREG;
+        entry               = (struct lu_dirent *)((uint8_t *)entry + length);
+    }
+}
+
+static void lustre_dir_test_chunk(struct lustre_dir * dir, struct lustre_dir_chunk * chunk, uint64_t hash_start, uint64_t hash_end, uint8_t * data, uint32_t length)
+{
+    bzero(chunk, sizeof(struct lustre_dir_chunk));
+    chunk->dir          = dir;
+    chunk->hash_start   = hash_start;
+    chunk->hash_end     = hash_end;
+    chunk->data         = data;
+    chunk->length       = length;
+    chunk->state        = kLustreDirChunkReady;
+}
+
+// Two chunks: [0, 0x200) over two pages and [0x200, end) over one.
+static void lustre_dir_test_fill(struct lustre_dir * dir, struct lustre_dir_chunk * first, struct lustre_dir_chunk * last)
+{
+    static const struct lustre_dir_test_entry page0[] = { { 0x10, "a" }, { 0x40, "bb" }, { 0x80, "ccc" } };
+    static const struct lustre_dir_test_entry page1[] = { { 0x100, "d" }, { 0x180, "e" } };
+    static const struct lustre_dir_test_entry page2[] = { { 0x200, "f" }, { 0x300, "g" } };
+
+    lustre_dir_test_page(lustre_dir_test_pages[0], 0, 0x100, 0, page0, 3);
+    lustre_dir_test_page(lustre_dir_test_pages[1], 0x100, 0x200, 0, page1, 2);
+    lustre_dir_test_page(lustre_dir_test_pages[2], 0x200, kLustreDirHashEnd, 0, page2, 2);
+
+    bzero(dir, sizeof(struct lustre_dir));
+    lustre_dir_test_chunk(dir, first, 0, 0x200, lustre_dir_test_pages[0], 2 * kLustreDirPageSize);
+    lustre_dir_test_chunk(dir, last, 0x200, kLustreDirHashEnd, lustre_dir_test_pages[2], kLustreDirPageSize);
+
+    lustre_dir_chunk_insert(dir, last);
+    lustre_dir_chunk_insert(dir, first);
+}
+
+static errno_t lustre_dir_test_collect(const struct lustre_dir_entry * entry, void * data)
+{
+    struct lustre_dir_test_walk * walk;
+
+    walk = (struct lustre_dir_test_walk *)data;
+    if ((walk->count == walk->limit) || (walk->count == 8)) {
+        return ENOBUFS;
+    }
+
+    walk->hashes[walk->count]       = entry->hash;
+    walk->next_hashes[walk->count]  = entry->next_hash;
+    walk->types[walk->count]        = entry->type;
+    walk->count                    += 1;
+
+    return 0;
+}
+
+LUSTRE_TEST(dir, cookie_round_trip)
+{
+    LUSTRE_ASSERT_EQUAL(lustre_dir_cookie_from_hash(0x1234), 0x91a, "%lld");
+    LUSTRE_ASSERT_EQUAL(lustre_dir_hash_from_cookie(0x91a), 0x1234, "%llu");
+    LUSTRE_ASSERT_EQUAL(lustre_dir_hash_from_cookie(lustre_dir_cookie_from_hash(0x1235)), 0x1234, "%llu");
+    LUSTRE_ASSERT_EQUAL(lustre_dir_hash_from_cookie(-1), 0, "%llu");
+    LUSTRE_ASSERT_TRUE((lustre_dir_cookie_from_hash(kLustreDirHashEnd) > 0));
+    LUSTRE_ASSERT_EQUAL(lustre_dir_hash_from_cookie(lustre_dir_cookie_from_hash(kLustreDirHashEnd)), kLustreDirHashEnd, "%llu");
+}
+
+// Any hash a chunk covers finds it, and the last chunk covers everything past its start.
+LUSTRE_TEST(dir, cookie_to_chunk)
+{
+    struct lustre_dir       dir;
+    struct lustre_dir_chunk first;
+    struct lustre_dir_chunk last;
+
+    lustre_dir_test_fill(&dir, &first, &last);
+
+    LUSTRE_ASSERT_EQUAL(dir.chunk_count, 2, "%u");
+    LUSTRE_ASSERT_EQUAL(dir.chunks, &first, "%p");
+    LUSTRE_ASSERT_EQUAL(first.next, &last, "%p");
+
+    LUSTRE_ASSERT_EQUAL(lustre_dir_chunk_find(&dir, 0), &first, "%p");
+    LUSTRE_ASSERT_EQUAL(lustre_dir_chunk_find(&dir, lustre_dir_hash_from_cookie(lustre_dir_cookie_from_hash(0x180))), &first, "%p");
+    LUSTRE_ASSERT_EQUAL(lustre_dir_chunk_find(&dir, 0x1ff), &first, "%p");
+    LUSTRE_ASSERT_EQUAL(lustre_dir_chunk_find(&dir, 0x200), &last, "%p");
+    LUSTRE_ASSERT_EQUAL(lustre_dir_chunk_find(&dir, 0x7000000000000000ULL), &last, "%p");
+}
+
+// A hash past what the cached chunks cover needs a fetch, and a chunk still being fetched only answers for the hash it was asked from.
+LUSTRE_TEST(dir, cookie_to_missing_chunk)
+{
+    struct lustre_dir       dir;
+    struct lustre_dir_chunk first;
+    struct lustre_dir_chunk last;
+
+    lustre_dir_test_fill(&dir, &first, &last);
+    lustre_dir_chunk_unlist(&dir, &last);
+
+    LUSTRE_ASSERT_EQUAL(dir.chunk_count, 1, "%u");
+    LUSTRE_ASSERT_FALSE(last.listed);
+    LUSTRE_ASSERT_NULL(lustre_dir_chunk_find(&dir, 0x200));
+
+    lustre_dir_test_chunk(&dir, &last, 0x200, 0x200, lustre_dir_test_pages[2], 0);
+    last.state = kLustreDirChunkFetching;
+    lustre_dir_chunk_insert(&dir, &last);
+
+    LUSTRE_ASSERT_EQUAL(lustre_dir_chunk_find(&dir, 0x200), &last, "%p");
+    LUSTRE_ASSERT_NULL(lustre_dir_chunk_find(&dir, 0x280));
+    LUSTRE_ASSERT_EQUAL(lustre_dir_chunk_find(&dir, 0x80), &first, "%p");
+}
+
+// A read that runs out of room resumes from the cookie it was left at in the chunk it stopped in, without anything being fetched again,
+// and the chunk's end leads to the next one.
+LUSTRE_TEST(dir, seek_without_refetch)
+{
+    struct lustre_dir           dir;
+    struct lustre_dir_chunk     first;
+    struct lustre_dir_chunk     last;
+    struct lustre_dir_chunk *   chunk;
+    struct lustre_dir_test_walk walk;
+    uint64_t                    hash;
+
+    lustre_dir_test_fill(&dir, &first, &last);
+
+    bzero(&walk, sizeof(walk));
+    walk.limit  = 2;
+    hash        = lustre_dir_hash_from_cookie(lustre_dir_cookie_from_hash(0x40));
+    chunk       = lustre_dir_chunk_find(&dir, hash);
+
+    LUSTRE_ASSERT_EQUAL(chunk, &first, "%p");
+    LUSTRE_ASSERT_EQUAL(lustre_dir_chunk_walk(chunk, &hash, lustre_dir_test_collect, &walk), ENOBUFS, "%d");
+    LUSTRE_ASSERT_EQUAL(walk.count, 2, "%u");
+    LUSTRE_ASSERT_EQUAL(walk.hashes[0], 0x40, "%llx");
+    LUSTRE_ASSERT_EQUAL(walk.next_hashes[0], 0x80, "%llx");
+    LUSTRE_ASSERT_EQUAL(walk.hashes[1], 0x80, "%llx");
+    LUSTRE_ASSERT_EQUAL(walk.next_hashes[1], 0x100, "%llx");
+    LUSTRE_ASSERT_EQUAL(walk.types[1], DT_REG, "%u");
+    LUSTRE_ASSERT_EQUAL(hash, 0x100, "%llx");
+
+    bzero(&walk, sizeof(walk));
+    walk.limit  = 8;
+    hash        = lustre_dir_hash_from_cookie(lustre_dir_cookie_from_hash(hash));
+    chunk       = lustre_dir_chunk_find(&dir, hash);
+
+    LUSTRE_ASSERT_EQUAL(chunk, &first, "%p");
+    LUSTRE_ASSERT_EQUAL(lustre_dir_chunk_walk(chunk, &hash, lustre_dir_test_collect, &walk), 0, "%d");
+    LUSTRE_ASSERT_EQUAL(walk.count, 2, "%u");
+    LUSTRE_ASSERT_EQUAL(walk.hashes[0], 0x100, "%llx");
+    LUSTRE_ASSERT_EQUAL(walk.hashes[1], 0x180, "%llx");
+    LUSTRE_ASSERT_EQUAL(hash, 0x200, "%llx");
+
+    bzero(&walk, sizeof(walk));
+    walk.limit  = 8;
+    chunk       = lustre_dir_chunk_find(&dir, hash);
+
+    LUSTRE_ASSERT_EQUAL(chunk, &last, "%p");
+    LUSTRE_ASSERT_EQUAL(lustre_dir_chunk_walk(chunk, &hash, lustre_dir_test_collect, &walk), 0, "%d");
+    LUSTRE_ASSERT_EQUAL(walk.count, 2, "%u");
+    LUSTRE_ASSERT_EQUAL(walk.hashes[1], 0x300, "%llx");
+    LUSTRE_ASSERT_EQUAL(hash, kLustreDirHashEnd, "%llx");
+}
+
+// Entries sharing the hash a chunk ends on when it ends in a collision belong to the next chunk.
+LUSTRE_TEST(dir, collision_left_to_next_chunk)
+{
+    static const struct lustre_dir_test_entry entries[] = { { 0x10, "a" }, { 0x20, "b" }, { 0x20, "c" } };
+    struct lustre_dir           dir;
+    struct lustre_dir_chunk     chunk;
+    struct lustre_dir_test_walk walk;
+    uint64_t                    hash;
+
+    bzero(&dir, sizeof(dir));
+    lustre_dir_test_page(lustre_dir_test_pages[0], 0, 0x20, kLustreDirPageFlagCollide, entries, 3);
+    lustre_dir_test_chunk(&dir, &chunk, 0, 0x20, lustre_dir_test_pages[0], kLustreDirPageSize);
+
+    bzero(&walk, sizeof(walk));
+    walk.limit  = 8;
+    hash        = 0;
+
+    LUSTRE_ASSERT_EQUAL(lustre_dir_chunk_walk(&chunk, &hash, lustre_dir_test_collect, &walk), 0, "%d");
+    LUSTRE_ASSERT_EQUAL(walk.count, 1, "%u");
+    LUSTRE_ASSERT_EQUAL(walk.hashes[0], 0x10, "%llx");
+    LUSTRE_ASSERT_EQUAL(hash, 0x20, "%llx");
+}
+
+LUSTRE_TEST(dir, entry_past_page)
+{
+    static const struct lustre_dir_test_entry entries[] = { { 0x10, "a" } };
+    struct lustre_dir           dir;
+    struct lustre_dir_chunk     chunk;
+    struct lustre_dir_test_walk walk;
+    struct lu_dirpage *         page;
+    uint64_t                    hash;
+
+    bzero(&dir, sizeof(dir));
+    lustre_dir_test_page(lustre_dir_test_pages[0], 0, kLustreDirHashEnd, 0, entries, 1);
+    lustre_dir_test_chunk(&dir, &chunk, 0, kLustreDirHashEnd, lustre_dir_test_pages[0], kLustreDirPageSize);
+    page                                = (struct lu_dirpage *)lustre_dir_test_pages[0];
+    page->ldp_entries[0].lde_namelen    = kLustreDirPageSize;
+
+    bzero(&walk, sizeof(walk));
+    walk.limit  = 8;
+    hash        = 0;
+
+    LUSTRE_ASSERT_EQUAL(lustre_dir_chunk_walk(&chunk, &hash, lustre_dir_test_collect, &walk), EPROTO, "%d");
+    LUSTRE_ASSERT_EQUAL(walk.count, 0, "%u");
+}
+
+// Eviction takes the least recently used chunk nobody is reading or fetching.
+LUSTRE_TEST(dir, eviction_victim)
+{
+    struct lustre_dir       dir;
+    struct lustre_dir_chunk first;
+    struct lustre_dir_chunk last;
+
+    lustre_dir_test_fill(&dir, &first, &last);
+    first.last_used = 2;
+    last.last_used  = 1;
+
+    LUSTRE_ASSERT_EQUAL(lustre_dir_chunk_victim(&dir), &last, "%p");
+
+    last.users = 1;
+
+    LUSTRE_ASSERT_EQUAL(lustre_dir_chunk_victim(&dir), &first, "%p");
+
+    first.state = kLustreDirChunkFetching;
+
+    LUSTRE_ASSERT_NULL(lustre_dir_chunk_victim(&dir));
+}
@@ -0,0 +1,229 @@
+//
+//  flock_test.c
+//  Filesystem Test
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <sys/errno.h>
+#include <sys/unistd.h>
+#include "test.h"
+#include "flock.h"
+
+static const uint64_t   kLustreFlockTestOwner               = 1;
+static const uint64_t   kLustreFlockTestOther               = 2;
+
+static struct lustre_flock_range lustre_flock_test_ranges[16];
+static uint32_t lustre_flock_test_used;
+
+static void lustre_flock_test_init(struct lustre_flocks * flocks)
+{
+    bzero(flocks, sizeof(struct lustre_flocks));
+    bzero(lustre_flock_test_ranges, sizeof(lustre_flock_test_ranges));
+    lustre_flock_test_used = 0;
+}
+
+// Applies a change with two fresh spares, and returns how many ranges it dropped.
+static uint32_t lustre_flock_test_apply(struct lustre_flocks * flocks, uint64_t owner, short type, uint64_t start, uint64_t end)
+{
+    struct lustre_flock_range * spares[2];
+    struct lustre_flock_range * freed;
+    uint32_t                    count;
+
+    spares[0]   = &lustre_flock_test_ranges[lustre_flock_test_used++ % 16];
+    spares[1]   = &lustre_flock_test_ranges[lustre_flock_test_used++ % 16];
+    freed       = NULL;
+
+    lustre_flocks_apply(flocks, owner, 100, type, start, end, spares, &freed);
+
+    for (count = 0; freed; freed = freed->next) {
+        count += 1;
+    }
+
+    return count;
+}
+
+// Returns owner's range starting at start, if it holds one.
+static const struct lustre_flock_range * lustre_flock_test_find(struct lustre_flocks * flocks, uint64_t owner, uint64_t start)
+{
+    const struct lustre_flock_range * range;
+
+    for (range = flocks->ranges; range; range = range->next) {
+        if ((range->owner == owner) && (range->start == start)) {
+            return range;
+        }
+    }
+
+    return NULL;
+}
+
+static errno_t lustre_flock_test_range(short whence, off_t start, off_t length, uint64_t size, uint64_t * first, uint64_t * last)
+{
+    struct flock fl;
+
+    bzero(&fl, sizeof(fl));
+    fl.l_whence = whence;
+    fl.l_start  = start;
+    fl.l_len    = length;
+
+    return lustre_flocks_range(&fl, size, first, last);
+}
+
+LUSTRE_TEST(flock, range)
+{
+    uint64_t start;
+    uint64_t end;
+
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_range(SEEK_SET, 10, 0, 0, &start, &end), 0, "%d");
+    LUSTRE_ASSERT_EQUAL(start, 10, "%llu");
+    LUSTRE_ASSERT_EQUAL(end, kLustreFlockEOF, "%llu");
+
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_range(SEEK_SET, 10, 5, 0, &start, &end), 0, "%d");
+    LUSTRE_ASSERT_EQUAL(start, 10, "%llu");
+    LUSTRE_ASSERT_EQUAL(end, 14, "%llu");
+
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_range(SEEK_END, -5, 5, 100, &start, &end), 0, "%d");
+    LUSTRE_ASSERT_EQUAL(start, 95, "%llu");
+    LUSTRE_ASSERT_EQUAL(end, 99, "%llu");
+
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_range(SEEK_SET, 10, -5, 0, &start, &end), 0, "%d");
+    LUSTRE_ASSERT_EQUAL(start, 5, "%llu");
+    LUSTRE_ASSERT_EQUAL(end, 9, "%llu");
+}
+
+LUSTRE_TEST(flock, range_invalid)
+{
+    uint64_t start;
+    uint64_t end;
+
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_range(SEEK_SET, 0, -1, 0, &start, &end), EINVAL, "%d");
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_range(SEEK_SET, 3, -5, 0, &start, &end), EINVAL, "%d");
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_range(SEEK_SET, -1, 5, 0, &start, &end), EINVAL, "%d");
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_range(SEEK_END, -200, 5, 100, &start, &end), EINVAL, "%d");
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_range(SEEK_SET, INT64_MAX, 2, 0, &start, &end), EOVERFLOW, "%d");
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_range(SEEK_END, INT64_MAX, 1, 100, &start, &end), EOVERFLOW, "%d");
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_range(7, 0, 0, 0, &start, &end), EINVAL, "%d");
+}
+
+// Ranges of one type that touch merge, an unlock in the middle of one splits it, and nobody else's ranges are touched.
+LUSTRE_TEST(flock, apply_merge_and_split)
+{
+    struct lustre_flocks                flocks;
+    const struct lustre_flock_range *   range;
+
+    lustre_flock_test_init(&flocks);
+
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_apply(&flocks, kLustreFlockTestOther, F_RDLCK, 0, 1000), 0, "%u");
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_apply(&flocks, kLustreFlockTestOwner, F_WRLCK, 0, 99), 0, "%u");
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_apply(&flocks, kLustreFlockTestOwner, F_WRLCK, 100, 199), 1, "%u");
+    LUSTRE_ASSERT_EQUAL(flocks.count, 2, "%u");
+
+    range = lustre_flock_test_find(&flocks, kLustreFlockTestOwner, 0);
+    LUSTRE_ASSERT_NOT_NULL(range);
+    LUSTRE_ASSERT_EQUAL(range->end, 199, "%llu");
+
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_apply(&flocks, kLustreFlockTestOwner, F_UNLCK, 50, 59), 0, "%u");
+    LUSTRE_ASSERT_EQUAL(flocks.count, 3, "%u");
+
+    range = lustre_flock_test_find(&flocks, kLustreFlockTestOwner, 0);
+    LUSTRE_ASSERT_NOT_NULL(range);
+    LUSTRE_ASSERT_EQUAL(range->end, 49, "%llu");
+    range = lustre_flock_test_find(&flocks, kLustreFlockTestOwner, 60);
+    LUSTRE_ASSERT_NOT_NULL(range);
+    LUSTRE_ASSERT_EQUAL(range->end, 199, "%llu");
+    LUSTRE_ASSERT_EQUAL(range->type, F_WRLCK, "%d");
+
+    range = lustre_flock_test_find(&flocks, kLustreFlockTestOther, 0);
+    LUSTRE_ASSERT_NOT_NULL(range);
+    LUSTRE_ASSERT_EQUAL(range->end, 1000, "%llu");
+}
+
+// A lock of another type over part of a range trims it, and one of the range's type over the gap joins everything back up.
+LUSTRE_TEST(flock, apply_type_change)
+{
+    struct lustre_flocks                flocks;
+    const struct lustre_flock_range *   range;
+
+    lustre_flock_test_init(&flocks);
+
+    (void)lustre_flock_test_apply(&flocks, kLustreFlockTestOwner, F_WRLCK, 0, 199);
+
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_apply(&flocks, kLustreFlockTestOwner, F_RDLCK, 40, 70), 0, "%u");
+    LUSTRE_ASSERT_EQUAL(flocks.count, 3, "%u");
+
+    range = lustre_flock_test_find(&flocks, kLustreFlockTestOwner, 40);
+    LUSTRE_ASSERT_NOT_NULL(range);
+    LUSTRE_ASSERT_EQUAL(range->type, F_RDLCK, "%d");
+    LUSTRE_ASSERT_EQUAL(range->end, 70, "%llu");
+    range = lustre_flock_test_find(&flocks, kLustreFlockTestOwner, 71);
+    LUSTRE_ASSERT_NOT_NULL(range);
+    LUSTRE_ASSERT_EQUAL(range->end, 199, "%llu");
+
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_apply(&flocks, kLustreFlockTestOwner, F_WRLCK, 40, 70), 3, "%u");
+    LUSTRE_ASSERT_EQUAL(flocks.count, 1, "%u");
+
+    range = lustre_flock_test_find(&flocks, kLustreFlockTestOwner, 0);
+    LUSTRE_ASSERT_NOT_NULL(range);
+    LUSTRE_ASSERT_EQUAL(range->type, F_WRLCK, "%d");
+    LUSTRE_ASSERT_EQUAL(range->end, 199, "%llu");
+}
+
+// A range running to the end of the file merges with one just before it, and unlocking everything leaves other owners alone.
+LUSTRE_TEST(flock, apply_to_end_of_file)
+{
+    struct lustre_flocks                flocks;
+    const struct lustre_flock_range *   range;
+
+    lustre_flock_test_init(&flocks);
+
+    (void)lustre_flock_test_apply(&flocks, kLustreFlockTestOther, F_RDLCK, 0, 10);
+    (void)lustre_flock_test_apply(&flocks, kLustreFlockTestOwner, F_WRLCK, 100, kLustreFlockEOF);
+
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_apply(&flocks, kLustreFlockTestOwner, F_WRLCK, 0, 99), 1, "%u");
+
+    range = lustre_flock_test_find(&flocks, kLustreFlockTestOwner, 0);
+    LUSTRE_ASSERT_NOT_NULL(range);
+    LUSTRE_ASSERT_EQUAL(range->end, kLustreFlockEOF, "%llu");
+
+    LUSTRE_ASSERT_EQUAL(lustre_flock_test_apply(&flocks, kLustreFlockTestOwner, F_UNLCK, 0, kLustreFlockEOF), 1, "%u");
+    LUSTRE_ASSERT_EQUAL(flocks.count, 1, "%u");
+    LUSTRE_ASSERT_NULL(lustre_flock_test_find(&flocks, kLustreFlockTestOwner, 0));
+    LUSTRE_ASSERT_NOT_NULL(lustre_flock_test_find(&flocks, kLustreFlockTestOther, 0));
+}
+
+// What the table settles without the server: locks already held, unlocks of nothing held, and local conflicts.
+LUSTRE_TEST(flock, held_and_conflict)
+{
+    struct lustre_flocks flocks;
+
+    lustre_flock_test_init(&flocks);
+
+    (void)lustre_flock_test_apply(&flocks, kLustreFlockTestOwner, F_RDLCK, 0, 99);
+
+    LUSTRE_ASSERT_TRUE(lustre_flocks_held(&flocks, kLustreFlockTestOwner, F_RDLCK, 10, 20));
+    LUSTRE_ASSERT_FALSE(lustre_flocks_held(&flocks, kLustreFlockTestOwner, F_RDLCK, 90, 100));
+    LUSTRE_ASSERT_FALSE(lustre_flocks_held(&flocks, kLustreFlockTestOwner, F_WRLCK, 10, 20));
+    LUSTRE_ASSERT_TRUE(lustre_flocks_held(&flocks, kLustreFlockTestOwner, F_UNLCK, 99, 200));
+    LUSTRE_ASSERT_FALSE(lustre_flocks_held(&flocks, kLustreFlockTestOwner, F_UNLCK, 100, 200));
+    LUSTRE_ASSERT_FALSE(lustre_flocks_held(&flocks, kLustreFlockTestOther, F_UNLCK, 0, 200));
+
+    LUSTRE_ASSERT_NOT_NULL(lustre_flocks_conflict(&flocks, kLustreFlockTestOther, F_WRLCK, 50, 60));
+    LUSTRE_ASSERT_NULL(lustre_flocks_conflict(&flocks, kLustreFlockTestOther, F_RDLCK, 50, 60));
+    LUSTRE_ASSERT_NULL(lustre_flocks_conflict(&flocks, kLustreFlockTestOther, F_WRLCK, 100, 200));
+    LUSTRE_ASSERT_NULL(lustre_flocks_conflict(&flocks, kLustreFlockTestOwner, F_WRLCK, 50, 60));
+}
@@ -0,0 +1,110 @@
+//
+//  probe_test.c
+//  Filesystem Test
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "test.h"
+#include "probe.h"
+
+LUSTRE_TEST(probe, classification)
+{
+    LUSTRE_ASSERT_EQUAL(lustre_probe_from_name(".DS_Store", 9), kLustreProbeDSStore, "0x%04x");
+    LUSTRE_ASSERT_EQUAL(lustre_probe_from_name(".localized", 10), kLustreProbeLocalized, "0x%04x");
+    LUSTRE_ASSERT_EQUAL(lustre_probe_from_name("Icon\r", 5), kLustreProbeIcon, "0x%04x");
+    LUSTRE_ASSERT_EQUAL(lustre_probe_from_name(".metadata_never_index_unless_rootfs", 35), kLustreProbeNeverIndex, "0x%04x");
+    LUSTRE_ASSERT_EQUAL(lustre_probe_from_name(".metadata_direct_scope_only", 27), kLustreProbeNeverIndex, "0x%04x");
+    LUSTRE_ASSERT_EQUAL(lustre_probe_from_name(".VolumeIcon.icns", 16), kLustreProbeVolumeIcon, "0x%04x");
+    LUSTRE_ASSERT_EQUAL(lustre_probe_from_name("._report.pdf", 12), kLustreProbeAppleDouble, "0x%04x");
+    LUSTRE_ASSERT_EQUAL(lustre_probe_from_name("._.DS_Store", 11), kLustreProbeAppleDouble, "0x%04x");
+}
+
+// Names are compared by length, not termination, and only exactly.
+LUSTRE_TEST(probe, classification_misses)
+{
+    LUSTRE_ASSERT_EQUAL(lustre_probe_from_name("._", 2), 0, "0x%04x");
+    LUSTRE_ASSERT_EQUAL(lustre_probe_from_name(".ds_store", 9), 0, "0x%04x");
+    LUSTRE_ASSERT_EQUAL(lustre_probe_from_name(".DS_Store", 8), 0, "0x%04x");
+    LUSTRE_ASSERT_EQUAL(lustre_probe_from_name(".DS_Stores", 10), 0, "0x%04x");
+    LUSTRE_ASSERT_EQUAL(lustre_probe_from_name(".DS_Store/x", 9), kLustreProbeDSStore, "0x%04x");
+    LUSTRE_ASSERT_EQUAL(lustre_probe_from_name("Icon", 4), 0, "0x%04x");
+    LUSTRE_ASSERT_EQUAL(lustre_probe_from_name("report.pdf", 10), 0, "0x%04x");
+    LUSTRE_ASSERT_EQUAL(lustre_probe_from_name("", 0), 0, "0x%04x");
+}
+
+// A lookup that misses proves one kind missing, except for ._ names.
+LUSTRE_TEST(probe, bitmap_from_misses)
+{
+    uint32_t absent;
+
+    absent = 0;
+    lustre_probe_note_missing(&absent, ".DS_Store", 9);
+    lustre_probe_note_missing(&absent, "._report.pdf", 12);
+    lustre_probe_note_missing(&absent, "report.pdf", 10);
+
+    LUSTRE_ASSERT_EQUAL(absent, kLustreProbeDSStore, "0x%04x");
+    LUSTRE_ASSERT_TRUE(lustre_probe_are_absent(absent, kLustreProbeDSStore));
+    LUSTRE_ASSERT_FALSE(lustre_probe_are_absent(absent, kLustreProbeAppleDouble));
+    LUSTRE_ASSERT_FALSE(lustre_probe_are_absent(absent, kLustreProbeDSStore | kLustreProbeLocalized));
+    LUSTRE_ASSERT_FALSE(lustre_probe_are_absent(absent, 0));
+}
+
+// A scan proves every kind it didn't see missing, ._ names included, but only if the directory is as it was when the scan began.
+LUSTRE_TEST(probe, bitmap_from_scan)
+{
+    uint32_t absent;
+    uint32_t seen;
+
+    seen    = lustre_probe_from_name(".DS_Store", 9) | lustre_probe_from_name("._report.pdf", 12);
+    absent  = 0;
+    lustre_probe_note_absent(&absent, lustre_probe_from_scan(seen), 7, 7);
+
+    LUSTRE_ASSERT_EQUAL(absent, (kLustreProbeAll & ~(kLustreProbeDSStore | kLustreProbeAppleDouble)), "0x%04x");
+    LUSTRE_ASSERT_TRUE(lustre_probe_are_absent(absent, kLustreProbeLocalized | kLustreProbeIcon));
+    LUSTRE_ASSERT_FALSE(lustre_probe_are_absent(absent, kLustreProbeDSStore));
+    LUSTRE_ASSERT_FALSE(lustre_probe_are_absent(absent, kLustreProbeAppleDouble));
+
+    absent = 0;
+    lustre_probe_note_absent(&absent, lustre_probe_from_scan(0), 7, 8);
+
+    LUSTRE_ASSERT_EQUAL(absent, 0, "0x%04x");
+
+    lustre_probe_note_absent(&absent, lustre_probe_from_scan(0), 8, 8);
+
+    LUSTRE_ASSERT_EQUAL(absent, kLustreProbeAll, "0x%04x");
+    LUSTRE_ASSERT_TRUE(lustre_probe_are_absent(absent, kLustreProbeAppleDouble));
+}
+
+// Losing the UPDATE lock forgets everything, after which only new answers count.
+LUSTRE_TEST(probe, bitmap_invalidation)
+{
+    uint32_t absent;
+
+    absent = 0;
+    lustre_probe_note_absent(&absent, lustre_probe_from_scan(0), 1, 1);
+    lustre_probe_invalidate(&absent);
+
+    LUSTRE_ASSERT_EQUAL(absent, 0, "0x%04x");
+    LUSTRE_ASSERT_FALSE(lustre_probe_are_absent(absent, kLustreProbeDSStore));
+
+    lustre_probe_note_missing(&absent, ".hidden", 7);
+
+    LUSTRE_ASSERT_EQUAL(absent, kLustreProbeHidden, "0x%04x");
+    LUSTRE_ASSERT_FALSE(lustre_probe_are_absent(absent, kLustreProbeDSStore));
+}
@@ -0,0 +1,254 @@
+//
+//  readahead_test.c
+//  Filesystem Test
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "test.h"
+#include "readahead.h"
+
+static const uint32_t   kLustreReadAheadTestStripeSize      = 1024 * 1024;
+static const uint64_t   kLustreReadAheadTestFileSize        = 4ULL * 1024 * 1024 * 1024;
+static const uint64_t   kLustreReadAheadTestApart           = 2ULL * 1024 * 1024 * 1024;    // further than any step, so never one stream
+
+static volatile SInt64 lustre_readahead_test_budget;
+
+static void lustre_readahead_test_init(struct lustre_readahead * readahead)
+{
+    bzero(readahead, sizeof(struct lustre_readahead));
+    readahead->budget               = &lustre_readahead_test_budget;
+    lustre_readahead_test_budget    = 0;
+}
+
+// Reads length bytes at offset of a file of size, striped over one object, a second after the last read.
+static uint32_t lustre_readahead_test_read(struct lustre_readahead * readahead, uint64_t offset, uint32_t length, uint64_t size, struct lustre_readahead_range * ranges)
+{
+    return lustre_readahead_access(readahead, offset, length, size, kLustreReadAheadTestStripeSize, kLustreReadAheadTestStripeSize, readahead->clock + 1, ranges);
+}
+
+// Interleaved readers each keep their own stream, and only a stream that has repeated its step reads ahead.
+LUSTRE_TEST(readahead, match_interleaved)
+{
+    struct lustre_readahead             readahead;
+    struct lustre_readahead_range       ranges[kLustreReadAheadAccessesMax];
+    struct lustre_readahead_stream *    first;
+    struct lustre_readahead_stream *    second;
+
+    lustre_readahead_test_init(&readahead);
+
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_read(&readahead, 0, 65536, kLustreReadAheadTestFileSize, ranges), 0, "%u");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_read(&readahead, kLustreReadAheadTestApart, 65536, kLustreReadAheadTestFileSize, ranges), 0, "%u");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_read(&readahead, 65536, 65536, kLustreReadAheadTestFileSize, ranges), 0, "%u");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_read(&readahead, kLustreReadAheadTestApart + 65536, 65536, kLustreReadAheadTestFileSize, ranges), 0, "%u");
+
+    first   = lustre_readahead_match(&readahead, 131072);
+    second  = lustre_readahead_match(&readahead, kLustreReadAheadTestApart + 131072);
+
+    LUSTRE_ASSERT_NOT_NULL(first);
+    LUSTRE_ASSERT_NOT_NULL(second);
+    LUSTRE_ASSERT_TRUE((first != second));
+    LUSTRE_ASSERT_EQUAL(first->step, 65536, "%lld");
+    LUSTRE_ASSERT_EQUAL(second->step, 65536, "%lld");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_budget, 0, "%lld");
+
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_read(&readahead, 131072, 65536, kLustreReadAheadTestFileSize, ranges), 1, "%u");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_stream_pattern(first), kLustreReadAheadPatternSequential, "%d");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_stream_pattern(second), kLustreReadAheadPatternNone, "%d");
+}
+
+// A sequential stream reads ahead from just past its last read to its window's end, rounded up to a stripe, and is charged for exactly
+// that; the next plan picks up where the last one ended, and hits give the budget back.
+LUSTRE_TEST(readahead, plan_sequential)
+{
+    struct lustre_readahead         readahead;
+    struct lustre_readahead_range   ranges[kLustreReadAheadAccessesMax];
+    uint32_t                        count;
+
+    lustre_readahead_test_init(&readahead);
+
+    (void)lustre_readahead_test_read(&readahead, 0, 65536, kLustreReadAheadTestFileSize, ranges);
+    (void)lustre_readahead_test_read(&readahead, 65536, 65536, kLustreReadAheadTestFileSize, ranges);
+    count = lustre_readahead_test_read(&readahead, 131072, 65536, kLustreReadAheadTestFileSize, ranges);
+
+    LUSTRE_ASSERT_EQUAL(count, 1, "%u");
+    LUSTRE_ASSERT_EQUAL(ranges[0].offset, 196608, "%lld");
+    LUSTRE_ASSERT_EQUAL(ranges[0].length, 2 * 1024 * 1024 - 196608, "%d");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_budget, 2 * 1024 * 1024 - 196608, "%lld");
+
+    count = lustre_readahead_test_read(&readahead, 196608, 65536, kLustreReadAheadTestFileSize, ranges);
+
+    LUSTRE_ASSERT_EQUAL(readahead.stats.hits, 1, "%llu");
+    LUSTRE_ASSERT_EQUAL(count, 0, "%u");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_budget, 2 * 1024 * 1024 - 262144, "%lld");
+}
+
+// A backwards stream reads ahead below its last read, down to a stripe boundary.
+LUSTRE_TEST(readahead, plan_reverse)
+{
+    struct lustre_readahead         readahead;
+    struct lustre_readahead_range   ranges[kLustreReadAheadAccessesMax];
+    uint64_t                        top;
+    uint32_t                        count;
+
+    lustre_readahead_test_init(&readahead);
+
+    top = 10 * 1024 * 1024;
+    (void)lustre_readahead_test_read(&readahead, top - 65536, 65536, kLustreReadAheadTestFileSize, ranges);
+    (void)lustre_readahead_test_read(&readahead, top - 131072, 65536, kLustreReadAheadTestFileSize, ranges);
+    count = lustre_readahead_test_read(&readahead, top - 196608, 65536, kLustreReadAheadTestFileSize, ranges);
+
+    LUSTRE_ASSERT_EQUAL(count, 1, "%u");
+    LUSTRE_ASSERT_EQUAL(ranges[0].offset, 8 * 1024 * 1024, "%lld");
+    LUSTRE_ASSERT_EQUAL(ranges[0].length, 2 * 1024 * 1024 - 196608, "%d");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_budget, 2 * 1024 * 1024 - 196608, "%lld");
+
+    count = lustre_readahead_test_read(&readahead, top - 262144, 65536, kLustreReadAheadTestFileSize, ranges);
+
+    LUSTRE_ASSERT_EQUAL(readahead.stats.hits, 1, "%llu");
+    LUSTRE_ASSERT_EQUAL(count, 0, "%u");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_budget, 2 * 1024 * 1024 - 262144, "%lld");
+}
+
+// Readahead clamped at the end of the file is charged for what was read, not what was asked for, and a stream that reaches the end gives
+// back all it holds.
+LUSTRE_TEST(readahead, accounting_at_end_of_file)
+{
+    struct lustre_readahead         readahead;
+    struct lustre_readahead_range   ranges[kLustreReadAheadAccessesMax];
+    uint32_t                        count;
+
+    lustre_readahead_test_init(&readahead);
+
+    (void)lustre_readahead_test_read(&readahead, 0, 65536, 300000, ranges);
+    (void)lustre_readahead_test_read(&readahead, 65536, 65536, 300000, ranges);
+    count = lustre_readahead_test_read(&readahead, 131072, 65536, 300000, ranges);
+
+    LUSTRE_ASSERT_EQUAL(count, 1, "%u");
+    LUSTRE_ASSERT_EQUAL(ranges[0].length, 300000 - 196608, "%d");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_budget, 300000 - 196608, "%lld");
+
+    count = lustre_readahead_test_read(&readahead, 196608, 65536, 300000, ranges);
+
+    LUSTRE_ASSERT_EQUAL(count, 0, "%u");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_budget, 300000 - 262144, "%lld");
+
+    count = lustre_readahead_test_read(&readahead, 262144, 65536, 300000, ranges);
+
+    LUSTRE_ASSERT_EQUAL(count, 0, "%u");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_budget, 0, "%lld");
+}
+
+// A strided stream whose next access would start past the end of the file has nothing to read ahead, and is charged nothing.
+LUSTRE_TEST(readahead, accounting_past_end_of_file)
+{
+    struct lustre_readahead         readahead;
+    struct lustre_readahead_range   ranges[kLustreReadAheadAccessesMax];
+    uint64_t                        step;
+    uint64_t                        size;
+    uint32_t                        i;
+
+    lustre_readahead_test_init(&readahead);
+
+    step = 1024 * 1024;
+    size = 2 * step + 8192;
+    for (i=0; i<3; i++) {
+        LUSTRE_ASSERT_EQUAL(lustre_readahead_test_read(&readahead, i * step, 4096, size, ranges), 0, "%u");
+    }
+
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_stream_pattern(lustre_readahead_match(&readahead, 3 * step)), kLustreReadAheadPatternStrided, "%d");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_budget, 0, "%lld");
+}
+
+// A strided stream reads each access it expects on its own, and is charged for each it reads.
+LUSTRE_TEST(readahead, plan_strided)
+{
+    struct lustre_readahead         readahead;
+    struct lustre_readahead_range   ranges[kLustreReadAheadAccessesMax];
+    uint32_t                        count;
+    uint64_t                        step;
+
+    lustre_readahead_test_init(&readahead);
+
+    step = 1024 * 1024;
+    (void)lustre_readahead_test_read(&readahead, 0, 4096, 6 * step, ranges);
+    (void)lustre_readahead_test_read(&readahead, step, 4096, 6 * step, ranges);
+    count = lustre_readahead_test_read(&readahead, 2 * step, 4096, 6 * step, ranges);
+
+    LUSTRE_ASSERT_EQUAL(count, 3, "%u");
+    LUSTRE_ASSERT_EQUAL(ranges[0].offset, 3 * step, "%lld");
+    LUSTRE_ASSERT_EQUAL(ranges[2].offset, 5 * step, "%lld");
+    LUSTRE_ASSERT_EQUAL(ranges[2].length, 4096, "%d");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_budget, 3 * 4096, "%lld");
+
+    count = lustre_readahead_test_read(&readahead, 3 * step, 4096, 6 * step, ranges);
+
+    LUSTRE_ASSERT_EQUAL(count, 0, "%u");
+    LUSTRE_ASSERT_EQUAL(readahead.stats.hits, 1, "%llu");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_budget, 2 * 4096, "%lld");
+}
+
+// Nothing is read ahead once the volume's budget is spent.
+LUSTRE_TEST(readahead, budget_exhausted)
+{
+    struct lustre_readahead         readahead;
+    struct lustre_readahead_range   ranges[kLustreReadAheadAccessesMax];
+
+    lustre_readahead_test_init(&readahead);
+    lustre_readahead_test_budget = kLustreReadAheadBudget;
+
+    (void)lustre_readahead_test_read(&readahead, 0, 65536, kLustreReadAheadTestFileSize, ranges);
+    (void)lustre_readahead_test_read(&readahead, 65536, 65536, kLustreReadAheadTestFileSize, ranges);
+
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_read(&readahead, 131072, 65536, kLustreReadAheadTestFileSize, ranges), 0, "%u");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_budget, kLustreReadAheadBudget, "%lld");
+}
+
+// Only streams idle since before the cutoff give their share back.  What they read ahead is still there for them to use.
+LUSTRE_TEST(readahead, release_idle)
+{
+    struct lustre_readahead         readahead;
+    struct lustre_readahead_range   ranges[kLustreReadAheadAccessesMax];
+    uint64_t                        held;
+    uint32_t                        i;
+
+    lustre_readahead_test_init(&readahead);
+
+    for (i=0; i<3; i++) {
+        (void)lustre_readahead_test_read(&readahead, (uint64_t)i * 65536, 65536, kLustreReadAheadTestFileSize, ranges);
+    }
+    held = (uint64_t)lustre_readahead_test_budget;
+    for (i=0; i<3; i++) {
+        (void)lustre_readahead_test_read(&readahead, kLustreReadAheadTestApart + (uint64_t)i * 65536, 65536, kLustreReadAheadTestFileSize, ranges);
+    }
+
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_budget, 2 * held, "%lld");
+
+    lustre_readahead_release_idle(&readahead, 4);
+
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_budget, held, "%lld");
+
+    lustre_readahead_release_idle(&readahead, UINT64_MAX);
+
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_budget, 0, "%lld");
+
+    (void)lustre_readahead_test_read(&readahead, 196608, 65536, kLustreReadAheadTestFileSize, ranges);
+
+    LUSTRE_ASSERT_EQUAL(readahead.stats.hits, 1, "%llu");
+    LUSTRE_ASSERT_EQUAL(lustre_readahead_test_budget, 0, "%lld");
+}
@@ -0,0 +1,432 @@
+//
+//  ksock_test.c
+//  Network Test
+//
+//  Lustre Filesystem For macOS
+//  Copyright (C) 2016 Cider Apps, LLC.
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// The socklnd framing the kext speaks, run in userspace against a stand-in server on loopback: the hello exchange, a server turning a
+// connection down, and a put whose payload is gathered from bulk segments and echoed back behind a noop.  Builds and runs on Linux or
+// macOS from the top of the tree with
+//
+//     cc -std=gnu11 -I Filesystem -I Filesystem/Utility -o ksock_test Tests/Network/ksock_test.c Filesystem/Utility/ksock.c -lpthread
+//     ./ksock_test
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ksock.h"
+
+static const uint64_t   kLustreKsockTestClientNID           = (2ULL << 32) | 0x7f000001;    // @tcp, as a NID is laid out
+static const uint64_t   kLustreKsockTestServerNID           = (2ULL << 32) | 0x7f000002;
+static const uint32_t   kLustreKsockTestPayloadSize         = 3000;
+static const uint32_t   kLustreKsockTestPayloadOffset       = 5;                // into the segments
+
+static uint32_t lustre_ksock_test_failures = 0;
+
+#define LUSTRE_KSOCK_TEST_ASSERT(condition)                                                         \
+    do {                                                                                            \
+        if (!(condition)) {                                                                         \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #condition);                  \
+            lustre_ksock_test_failures += 1;                                                        \
+        }                                                                                           \
+    } while (0)
+
+struct lustre_ksock_test_server {
+    int                         listener;
+    uint16_t                    port;
+};
+
+#pragma mark - Sockets
+
+static int lustre_ksock_test_write(int fd, struct iovec * iov, int count)
+{
+    ssize_t sent;
+
+    while (count > 0) {
+        sent = writev(fd, iov, count);
+        if (sent <= 0) {
+            return (sent < 0) ? errno : ECONNRESET;
+        }
+        while ((count > 0) && ((size_t)sent >= iov[0].iov_len)) {
+            sent -= iov[0].iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov[0].iov_base  = (uint8_t *)iov[0].iov_base + sent;
+            iov[0].iov_len  -= sent;
+        }
+    }
+
+    return 0;
+}
+
+static int lustre_ksock_test_write_buffer(int fd, const void * buffer, size_t length)
+{
+    struct iovec iov;
+
+    iov.iov_base    = (void *)buffer;
+    iov.iov_len     = length;
+
+    return lustre_ksock_test_write(fd, &iov, 1);
+}
+
+static int lustre_ksock_test_read(int fd, void * buffer, size_t length)
+{
+    ssize_t received;
+
+    while (length > 0) {
+        received = read(fd, buffer, length);
+        if (received <= 0) {
+            return (received < 0) ? errno : ECONNRESET;
+        }
+        buffer  = (uint8_t *)buffer + received;
+        length -= (size_t)received;
+    }
+
+    return 0;
+}
+
+// Reads a hello in two goes, as the kext does, checking it came from peer_nid as a connection of type.
+static errno_t lustre_ksock_test_read_hello(int fd, uint64_t peer_nid, uint32_t type, uint32_t * nips)
+{
+    struct ksock_hello_msg  hello;
+    uint32_t                addresses[kLustreLNetInterfacesMax];
+    errno_t                 error;
+
+    memset(&hello, 0, sizeof(hello));
+    error = lustre_ksock_test_read(fd, &hello, offsetof(struct ksock_hello_msg, kshm_src_nid));
+    if (error == 0) {
+        error = lustre_ksock_hello_check_version(&hello);
+    }
+    if (error == 0) {
+        error = lustre_ksock_test_read(fd, &hello.kshm_src_nid, sizeof(hello) - offsetof(struct ksock_hello_msg, kshm_src_nid));
+    }
+    if (error == 0) {
+        error = lustre_ksock_hello_check(&hello, peer_nid, type);
+    }
+    if (error == 0) {
+        error = lustre_ksock_test_read(fd, addresses, hello.kshm_nips * sizeof(uint32_t));
+    }
+    if (nips) {
+        *nips = hello.kshm_nips;
+    }
+
+    return error;
+}
+
+// Reads the next LNet message, passing over noops, and its payload into a buffer of length bytes.
+static errno_t lustre_ksock_test_read_message(int fd, struct ksock_msg * header, void * payload, uint32_t length, uint32_t * noops)
+{
+    errno_t error;
+
+    for (;;) {
+        error = lustre_ksock_test_read(fd, header, offsetof(struct ksock_msg, ksm_hdr));
+        if (error != 0) {
+            return error;
+        }
+        if (header->ksm_type != kLustreKsockMsgNoop) {
+            break;
+        }
+        *noops += 1;
+    }
+
+    error = lustre_ksock_test_read(fd, &header->ksm_hdr, sizeof(struct lnet_hdr));
+    if (error == 0) {
+        error = lustre_ksock_header_check(header);
+    }
+    if ((error == 0) && (header->ksm_hdr.payload_length > length)) {
+        error = EMSGSIZE;
+    }
+    if (error == 0) {
+        error = lustre_ksock_test_read(fd, payload, header->ksm_hdr.payload_length);
+    }
+
+    return error;
+}
+
+#pragma mark - Stand-in Server
+
+// Answers one connection as a server would: checks the acceptor request and hello, and answers with a hello describing the connection
+// from its own side, or turning it down.  An accepted connection then gets back each message sent on it, behind a noop.
+static void lustre_ksock_test_serve(int fd, int refuse)
+{
+    struct lnet_acceptor_connreq    request;
+    struct lnet_acceptor_connreq    unused;
+    struct ksock_msg                header;
+    struct ksock_msg                noop;
+    uint8_t                         reply[sizeof(struct ksock_hello_msg) + 2 * sizeof(uint32_t)];
+    struct ksock_hello_msg *        hello;
+    struct iovec                    iov[2];
+    uint8_t *                       payload;
+    uint32_t                        noops;
+
+    if ((lustre_ksock_test_read(fd, &request, sizeof(request)) != 0) || (request.acr_magic != kLustreLNetAcceptorMagic) || (request.acr_nid != kLustreKsockTestServerNID)) {
+        return;
+    }
+    if (lustre_ksock_test_read_hello(fd, kLustreKsockTestClientNID, kLustreKsockConnControl, NULL) != 0) {
+        return;
+    }
+
+    // Two addresses, to be skipped.
+
+    hello = (struct ksock_hello_msg *)reply;
+    lustre_ksock_hello(&unused, hello, kLustreKsockTestServerNID, kLustreKsockTestClientNID, 1, refuse ? (uint32_t)kLustreKsockConnNone : kLustreKsockConnControl);
+    hello->kshm_nips = 2;
+    memset(reply + sizeof(struct ksock_hello_msg), 0x7f, 2 * sizeof(uint32_t));
+    if ((lustre_ksock_test_write_buffer(fd, reply, sizeof(reply)) != 0) || refuse) {
+        return;
+    }
+
+    payload = malloc(kLustreLNetMTU);
+    noops   = 0;
+    while (payload && (lustre_ksock_test_read_message(fd, &header, payload, kLustreLNetMTU, &noops) == 0)) {
+        memset(&noop, 0, sizeof(noop));
+        noop.ksm_type = kLustreKsockMsgNoop;
+
+        lustre_ksock_header(&header, kLustreKsockTestClientNID, kLustreKsockTestServerNID, header.ksm_hdr.type, header.ksm_hdr.payload_length);
+
+        iov[0].iov_base = &header;
+        iov[0].iov_len  = sizeof(header);
+        iov[1].iov_base = payload;
+        iov[1].iov_len  = header.ksm_hdr.payload_length;
+        if ((lustre_ksock_test_write_buffer(fd, &noop, offsetof(struct ksock_msg, ksm_hdr)) != 0) || (lustre_ksock_test_write(fd, iov, 2) != 0)) {
+            break;
+        }
+    }
+    free(payload);
+}
+
+// Serves an accepted connection, then one it turns down.
+static void * lustre_ksock_test_server(void * data)
+{
+    struct lustre_ksock_test_server *   server;
+    int                                 fd;
+    int                                 i;
+
+    server = data;
+
+    for (i=0; i<2; i++) {
+        fd = accept(server->listener, NULL, NULL);
+        if (fd < 0) {
+            break;
+        }
+        lustre_ksock_test_serve(fd, i == 1);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static int lustre_ksock_test_server_start(struct lustre_ksock_test_server * server, pthread_t * thread)
+{
+    struct sockaddr_in  address;
+    socklen_t           length;
+
+    server->listener = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (server->listener < 0) {
+        return errno;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    length                  = sizeof(address);
+    if ((bind(server->listener, (struct sockaddr *)&address, sizeof(address)) != 0) || (listen(server->listener, 2) != 0) || (getsockname(server->listener, (struct sockaddr *)&address, &length) != 0)) {
+        return errno;
+    }
+    server->port = ntohs(address.sin_port);
+
+    return pthread_create(thread, NULL, lustre_ksock_test_server, server);
+}
+
+#pragma mark - Client
+
+// Connects to the stand-in server and says hello, returning what checking its hello back came to.
+static errno_t lustre_ksock_test_connect(const struct lustre_ksock_test_server * server, int * fd)
+{
+    struct sockaddr_in              address;
+    struct lnet_acceptor_connreq    request;
+    struct ksock_hello_msg          hello;
+    struct iovec                    iov[2];
+    uint32_t                        nips;
+    errno_t                         error;
+
+    *fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (*fd < 0) {
+        return errno;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_port        = htons(server->port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(*fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        return errno;
+    }
+
+    lustre_ksock_hello(&request, &hello, kLustreKsockTestClientNID, kLustreKsockTestServerNID, 1, kLustreKsockConnControl);
+
+    iov[0].iov_base = &request;
+    iov[0].iov_len  = sizeof(request);
+    iov[1].iov_base = &hello;
+    iov[1].iov_len  = sizeof(hello);
+
+    error = lustre_ksock_test_write(*fd, iov, 2);
+    if (error == 0) {
+        error = lustre_ksock_test_read_hello(*fd, kLustreKsockTestServerNID, kLustreKsockConnControl, &nips);
+    }
+    if (error == 0) {
+        LUSTRE_KSOCK_TEST_ASSERT(nips == 2);
+    }
+
+    return error;
+}
+
+// Puts a payload gathered from three uneven segments, partway into the first, and checks it comes back whole.
+static void lustre_ksock_test_put(int fd)
+{
+    static uint8_t                  data[3][3000];                  // kLustreKsockTestPayloadSize
+    struct lustre_ksock_segment     segments[3];
+    struct lustre_ksock_cursor      cursor;
+    struct ksock_msg                header;
+    struct iovec                    iov[8];
+    uint8_t *                       expected;
+    uint8_t *                       echoed;
+    uint32_t                        remaining;
+    uint32_t                        count;
+    uint32_t                        noops;
+    uint32_t                        i;
+
+    for (i=0; i<3; i++) {
+        memset(data[i], 'a' + i, sizeof(data[i]));
+        data[i][0]          = (uint8_t)i;
+        segments[i].data    = data[i];
+        segments[i].length  = (i + 1) * 700;
+    }
+
+    expected    = malloc(kLustreKsockTestPayloadSize);
+    echoed      = malloc(kLustreKsockTestPayloadSize);
+    LUSTRE_KSOCK_TEST_ASSERT(expected && echoed);
+    if (!expected || !echoed) {
+        goto end;
+    }
+
+    // 695 bytes from the first segment, 1400 from the second and the first 905 of the third.
+
+    memcpy(expected, data[0] + kLustreKsockTestPayloadOffset, 695);
+    memcpy(expected + 695, data[1], 1400);
+    memcpy(expected + 2095, data[2], 905);
+
+    lustre_ksock_header(&header, kLustreKsockTestServerNID, kLustreKsockTestClientNID, kLustreLNetMsgPut, kLustreKsockTestPayloadSize);
+    header.ksm_hdr.msg.put.match_bits = 42;
+
+    lustre_ksock_cursor_init(&cursor, segments, 3, kLustreKsockTestPayloadOffset);
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len  = sizeof(header);
+    remaining       = kLustreKsockTestPayloadSize;
+    count           = 1 + lustre_ksock_cursor_fill(&cursor, iov + 1, 7, &remaining);
+    LUSTRE_KSOCK_TEST_ASSERT(count == 4);
+    LUSTRE_KSOCK_TEST_ASSERT(remaining == 0);
+    LUSTRE_KSOCK_TEST_ASSERT(iov[3].iov_len == 905);
+    LUSTRE_KSOCK_TEST_ASSERT(lustre_ksock_test_write(fd, iov, (int)count) == 0);
+
+    noops = 0;
+    LUSTRE_KSOCK_TEST_ASSERT(lustre_ksock_test_read_message(fd, &header, echoed, kLustreKsockTestPayloadSize, &noops) == 0);
+    LUSTRE_KSOCK_TEST_ASSERT(noops == 1);
+    LUSTRE_KSOCK_TEST_ASSERT(header.ksm_hdr.type == kLustreLNetMsgPut);
+    LUSTRE_KSOCK_TEST_ASSERT(header.ksm_hdr.src_nid == kLustreKsockTestServerNID);
+    LUSTRE_KSOCK_TEST_ASSERT(header.ksm_hdr.payload_length == kLustreKsockTestPayloadSize);
+    LUSTRE_KSOCK_TEST_ASSERT(memcmp(echoed, expected, kLustreKsockTestPayloadSize) == 0);
+
+end:
+    free(expected);
+    free(echoed);
+}
+
+#pragma mark - Checks
+
+// What the parsing turns away without a server: the wrong byte order or version, a hello from the wrong NID, too many addresses, and
+// a payload bigger than LNet allows.
+static void lustre_ksock_test_checks(void)
+{
+    struct lnet_acceptor_connreq    request;
+    struct ksock_hello_msg          hello;
+    struct ksock_msg                header;
+
+    lustre_ksock_hello(&request, &hello, kLustreKsockTestServerNID, kLustreKsockTestClientNID, 1, kLustreKsockConnBulkOut);
+    LUSTRE_KSOCK_TEST_ASSERT(lustre_ksock_hello_check_version(&hello) == 0);
+    LUSTRE_KSOCK_TEST_ASSERT(lustre_ksock_hello_check(&hello, kLustreKsockTestServerNID, kLustreKsockConnBulkOut) == 0);
+    LUSTRE_KSOCK_TEST_ASSERT(lustre_ksock_hello_check(&hello, kLustreKsockTestServerNID, kLustreKsockConnBulkIn) == EPROTO);
+    LUSTRE_KSOCK_TEST_ASSERT(lustre_ksock_hello_check(&hello, kLustreKsockTestClientNID, kLustreKsockConnBulkOut) == EPROTO);
+
+    hello.kshm_nips = kLustreLNetInterfacesMax + 1;
+    LUSTRE_KSOCK_TEST_ASSERT(lustre_ksock_hello_check(&hello, kLustreKsockTestServerNID, kLustreKsockConnBulkOut) == EPROTO);
+
+    hello.kshm_magic = kLustreLNetProtoMagicSwabbed;
+    LUSTRE_KSOCK_TEST_ASSERT(lustre_ksock_hello_check_version(&hello) == EPROTO);
+    hello.kshm_magic    = kLustreLNetProtoMagic;
+    hello.kshm_version  = 2;
+    LUSTRE_KSOCK_TEST_ASSERT(lustre_ksock_hello_check_version(&hello) == EPROTO);
+
+    lustre_ksock_header(&header, kLustreKsockTestServerNID, kLustreKsockTestClientNID, kLustreLNetMsgPut, kLustreLNetMTU);
+    LUSTRE_KSOCK_TEST_ASSERT(lustre_ksock_header_check(&header) == 0);
+    header.ksm_hdr.payload_length = kLustreLNetMTU + 1;
+    LUSTRE_KSOCK_TEST_ASSERT(lustre_ksock_header_check(&header) == EPROTO);
+}
+
+int main(void)
+{
+    struct lustre_ksock_test_server server;
+    pthread_t                       thread;
+    int                             fd;
+    int                             error;
+
+    lustre_ksock_test_checks();
+
+    error = lustre_ksock_test_server_start(&server, &thread);
+    if (error != 0) {
+        fprintf(stderr, "Couldn't start the stand-in server, error %d\n", error);
+        return 1;
+    }
+
+    LUSTRE_KSOCK_TEST_ASSERT(lustre_ksock_test_connect(&server, &fd) == 0);
+    lustre_ksock_test_put(fd);
+    close(fd);
+
+    LUSTRE_KSOCK_TEST_ASSERT(lustre_ksock_test_connect(&server, &fd) == ECONNREFUSED);
+    close(fd);
+
+    pthread_join(thread, NULL);
+    close(server.listener);
+
+    printf("ksock: %s\n", (lustre_ksock_test_failures == 0) ? "passed" : "FAILED");
+
+    return (lustre_ksock_test_failures == 0) ? 0 : 1;
+}
@@ -20,6 +20,7 @@
 //
 
 #import <sys/mount.h>
+#import <arpa/inet.h>
 
 #import "LFSMount.h"
 #import "constants.h"
@@ -29,6 +30,7 @@
     NSArray *           _arguments;
     
     NSArray *           _options;
+    uint32_t            _probes;
     NSMutableArray *    _managementServers;
     NSString *          _filesystem;
     NSString *          _mountPoint;
@@ -98,8 +100,18 @@
     address             = [[(NSHost *)[_managementServers firstObject] address] cStringUsingEncoding:NSUTF8StringEncoding];
     label               = [_filesystem cStringUsingEncoding:NSUTF8StringEncoding];
     
+    bzero(&mountArgs, sizeof(mountArgs));
     strlcpy(mountArgs.host,     address,    kLustreMountArgsHostMax);
     strlcpy(mountArgs.label,    label,      kLustreMountArgsLabelMax);
+    mountArgs.probes                    = _probes;
+    
+    mountArgs.address_ip4.sin_len       = sizeof(mountArgs.address_ip4);
+    mountArgs.address_ip4.sin_family    = AF_INET;
+    if (inet_pton(AF_INET, address, &mountArgs.address_ip4.sin_addr) != 1) {
+        [self populateError:error code:EXIT_FAILURE message:@"management server must have an IPv4 address"];
+        return NO;
+    }
+    mountArgs.port                      = 988;
 
     err = mount(kLustreFilesystemName, realMountPoint, flags, &mountArgs);
     if (err < 0) {
@@ -138,7 +150,7 @@
     index = 1;
     
     if ([[_arguments objectAtIndex:index] isEqualToString:@"-o"]) {
-        _options = [[_arguments objectAtIndex:1] componentsSeparatedByString:@","];
+        _options = [[_arguments objectAtIndex:2] componentsSeparatedByString:@","];
         index = 3;
     } else {
         index = 1;
@@ -171,11 +183,24 @@
     return YES;
 }
 
+// The only option is probes=cache|lookup|absent, which says what lookups of the names Finder probes every directory for do.
 - (BOOL)processOptions:(NSError **)error
 {
-    if ([_options count] != 0) {
-        [self populateError:error code:EXIT_FAILURE message:@"options are not supported"];
-        return NO;
+    NSDictionary *  probes;
+    NSNumber *      policy;
+    
+    probes  = @{ @"cache"   : @(kLustreMountProbesCache),
+                 @"lookup"  : @(kLustreMountProbesLookup),
+                 @"absent"  : @(kLustreMountProbesAbsent) };
+    _probes = kLustreMountProbesCache;
+    
+    for (NSString * option in _options) {
+        policy = [option hasPrefix:@"probes="] ? probes[[option substringFromIndex:7]] : nil;
+        if (!policy) {
+            [self populateError:error code:EXIT_FAILURE message:[NSString stringWithFormat:@"Unsupported option: %@", option]];
+            return NO;
+        }
+        _probes = policy.unsignedIntValue;
     }
     
     return YES;